@@ -0,0 +1,124 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_BRIDGE_
+#define _H_LG_BRIDGE_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/KVMFR.h"
+
+/* The bridge carries an LGMP session over a stream socket. The sender is an
+ * LGMP client of the guest's IVSHMEM, the receiver is an LGMP host of a shared
+ * memory file that an unmodified client reads as it would IVSHMEM. Every
+ * message is a BridgeHeader and size bytes of payload, in host byte order as
+ * both ends are expected to be x86. */
+
+#define BRIDGE_MAGIC   0x5242474C // LGBR
+#define BRIDGE_VERSION 1
+
+/* pixel data is sent in LZ4 blocks of up to this many bytes, each prefixed
+ * with its size, blocks that do not compress are sent raw */
+#define BRIDGE_BLOCK_SIZE 1048576
+#define BRIDGE_BLOCK_RAW  0x80000000U
+
+// the largest cursor shape, as the host allows
+#define BRIDGE_MAX_SHAPE (512 * 512 * 4)
+
+enum
+{
+  BRIDGE_MSG_HELLO,  // BridgeHello, followed by the KVMFR user data
+  BRIDGE_MSG_FRAME,  // BridgeFrame, followed by the pixel blocks
+  BRIDGE_MSG_CURSOR  // BridgeCursor, followed by the shape if CURSOR_FLAG_SHAPE
+};
+
+typedef struct BridgeHeader
+{
+  uint32_t type;
+  uint32_t size;
+}
+BridgeHeader;
+
+typedef struct BridgeHello
+{
+  uint32_t magic;
+  uint32_t version;
+}
+BridgeHello;
+
+typedef struct BridgeFrame
+{
+  KVMFRFrame frame;
+
+  /* full frames carry every row of the frame, partial frames the pixels of
+   * each damage rect in turn. dataSize is the size once decompressed */
+  uint32_t   full;
+  uint32_t   dataSize;
+}
+BridgeFrame;
+
+typedef struct BridgeCursor
+{
+  KVMFRCursorFlags flags;
+  KVMFRCursor      cursor;
+}
+BridgeCursor;
+
+// net.c
+int  bridgeListen (const char * address, int port);
+int  bridgeAccept (int listenFd);
+int  bridgeConnect(const char * address, int port);
+bool bridgeSend   (int fd, uint32_t type, const void * data, size_t size,
+    const void * extra, size_t extraSize);
+bool bridgeRecv   (int fd, void * data, size_t size);
+
+/* compresses size bytes of src into dst, which must hold bridgeBound(size),
+ * and returns the bytes used */
+size_t bridgeBound     (size_t size);
+size_t bridgeCompress  (const uint8_t * src, size_t size, uint8_t * dst,
+    bool compress);
+bool   bridgeDecompress(const uint8_t * src, size_t srcSize, uint8_t * dst,
+    size_t size);
+
+// the bytes per pixel of the frame type
+static inline unsigned int bridgeFrameBpp(FrameType type)
+{
+  return type == FRAME_TYPE_RGBA16F ? 8 : 4;
+}
+
+/* clamps damage rect i of the frame to it, both ends must agree on the size of
+ * the pixel data of a partial frame */
+static inline FrameDamageRect bridgeFrameRect(const KVMFRFrame * frame,
+    unsigned int i)
+{
+  FrameDamageRect r = frame->damageRects[i];
+  r.x      = r.x < frame->frameWidth  ? r.x : frame->frameWidth;
+  r.y      = r.y < frame->frameHeight ? r.y : frame->frameHeight;
+  r.width  = r.width  < frame->frameWidth  - r.x ? r.width  : frame->frameWidth  - r.x;
+  r.height = r.height < frame->frameHeight - r.y ? r.height : frame->frameHeight - r.y;
+  return r;
+}
+
+int bridgeSendRun(volatile bool * running);
+int bridgeRecvRun(volatile bool * running);
+
+#endif
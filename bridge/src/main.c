@@ -0,0 +1,155 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "bridge.h"
+
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/crash.h"
+#include "common/ivshmem.h"
+
+#include <signal.h>
+#include <string.h>
+
+static volatile bool running = true;
+
+static bool modeValidator(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_string &&
+      (strcmp(opt->value.x_string, "send") == 0 ||
+       strcmp(opt->value.x_string, "recv") == 0))
+    return true;
+
+  *error = "Must be send or recv";
+  return false;
+}
+
+static struct Option options[] =
+{
+  {
+    .module         = "app",
+    .name           = "configFile",
+    .description    = "A file to read additional configuration from",
+    .shortopt       = 'C',
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "bridge",
+    .name           = "mode",
+    .description    = "send the guest's frames from IVSHMEM, or recv them into "
+                      "bridge:shmFile",
+    .shortopt       = 'm',
+    .type           = OPTION_TYPE_STRING,
+    .validator      = modeValidator,
+    .value.x_string = "send"
+  },
+  {
+    .module         = "bridge",
+    .name           = "address",
+    .description    = "The receiver to connect to, or the address to listen on",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "bridge",
+    .name           = "port",
+    .description    = "The TCP port of the receiver",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 5910
+  },
+  {
+    .module         = "bridge",
+    .name           = "compress",
+    .description    = "LZ4 compress the frames that are sent",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = true
+  },
+  {
+    .module         = "bridge",
+    .name           = "shmFile",
+    .description    = "The file the receiver publishes the frames in for the "
+                      "client",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "/dev/shm/looking-glass-bridge"
+  },
+  {
+    .module         = "bridge",
+    .name           = "shmSize",
+    .description    = "The size of bridge:shmFile in MiB",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 128
+  },
+  {0}
+};
+
+static void stopHandler(int sig)
+{
+  // a second signal ends the bridge at once
+  running = false;
+  signal(sig, SIG_DFL);
+}
+
+int main(int argc, char * argv[])
+{
+  DEBUG_INFO("Looking Glass (" BUILD_VERSION ") - KVMFR Bridge");
+
+  if (!installCrashHandler("/proc/self/exe"))
+    DEBUG_WARN("Failed to install the crash handler");
+
+  option_register(options);
+  ivshmemOptionsInit();
+
+  if (!option_parse(argc, argv))
+  {
+    option_free();
+    return -1;
+  }
+
+  const char * configFile = option_get_string("app", "configFile");
+  if (configFile)
+  {
+    DEBUG_INFO("Loading config from: %s", configFile);
+    if (!option_load(configFile))
+    {
+      option_free();
+      return -1;
+    }
+  }
+
+  if (!option_validate())
+  {
+    option_free();
+    return -1;
+  }
+
+  struct sigaction sa = { .sa_handler = stopHandler };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT , &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  const char * mode = option_get_string("bridge", "mode");
+  const int ret = strcmp(mode, "send") == 0 ?
+    bridgeSendRun(&running) : bridgeRecvRun(&running);
+
+  option_free();
+  return ret;
+}
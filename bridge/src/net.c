@@ -0,0 +1,288 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#define _GNU_SOURCE
+#include "bridge.h"
+
+#include "common/debug.h"
+#include "common/lz4.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// large enough for a full 4K frame to be in flight
+#define SOCKET_BUFFER (8 * 1048576)
+
+static void setupSocket(int fd)
+{
+  const int one  = 1;
+  const int size = SOCKET_BUFFER;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one , sizeof(one ));
+  setsockopt(fd, SOL_SOCKET , SO_SNDBUF  , &size, sizeof(size));
+  setsockopt(fd, SOL_SOCKET , SO_RCVBUF  , &size, sizeof(size));
+}
+
+static struct addrinfo * resolve(const char * address, int port, bool passive)
+{
+  char service[8];
+  snprintf(service, sizeof(service), "%d", port);
+
+  struct addrinfo hints =
+  {
+    .ai_family   = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+    .ai_flags    = passive ? AI_PASSIVE : 0
+  };
+
+  struct addrinfo * res;
+  const int err = getaddrinfo(address, service, &hints, &res);
+  if (err)
+  {
+    DEBUG_ERROR("Failed to resolve %s: %s", address ? address : "*",
+        gai_strerror(err));
+    return NULL;
+  }
+  return res;
+}
+
+int bridgeListen(const char * address, int port)
+{
+  struct addrinfo * res = resolve(address, port, true);
+  if (!res)
+    return -1;
+
+  int fd = -1;
+  for(struct addrinfo * ai = res; ai; ai = ai->ai_next)
+  {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+        ai->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 1) == 0)
+      break;
+
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd < 0)
+    DEBUG_ERROR("Failed to listen on port %d: %s", port, strerror(errno));
+  return fd;
+}
+
+int bridgeAccept(int listenFd)
+{
+  int fd;
+  do
+    fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+  while(fd < 0 && errno == EINTR);
+
+  if (fd < 0)
+  {
+    DEBUG_ERROR("accept failed: %s", strerror(errno));
+    return -1;
+  }
+
+  setupSocket(fd);
+  return fd;
+}
+
+int bridgeConnect(const char * address, int port)
+{
+  struct addrinfo * res = resolve(address, port, false);
+  if (!res)
+    return -1;
+
+  int fd = -1;
+  for(struct addrinfo * ai = res; ai; ai = ai->ai_next)
+  {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+        ai->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    setupSocket(fd);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd < 0)
+    DEBUG_ERROR("Failed to connect to %s:%d: %s", address, port,
+        strerror(errno));
+  return fd;
+}
+
+bool bridgeSend(int fd, uint32_t type, const void * data, size_t size,
+    const void * extra, size_t extraSize)
+{
+  BridgeHeader header =
+  {
+    .type = type,
+    .size = size + extraSize
+  };
+
+  struct iovec iov[3] =
+  {
+    { .iov_base = &header      , .iov_len = sizeof(header) },
+    { .iov_base = (void *)data , .iov_len = size           },
+    { .iov_base = (void *)extra, .iov_len = extraSize      }
+  };
+
+  struct iovec * v = iov;
+  int count = extraSize ? 3 : 2;
+  while(count)
+  {
+    const ssize_t sent = writev(fd, v, count);
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      DEBUG_ERROR("send failed: %s", strerror(errno));
+      return false;
+    }
+
+    size_t left = sent;
+    while(count && left >= v->iov_len)
+    {
+      left -= v->iov_len;
+      ++v;
+      --count;
+    }
+
+    if (count)
+    {
+      v->iov_base  = (uint8_t *)v->iov_base + left;
+      v->iov_len  -= left;
+    }
+  }
+
+  return true;
+}
+
+bool bridgeRecv(int fd, void * data, size_t size)
+{
+  uint8_t * p = data;
+  while(size)
+  {
+    const ssize_t got = recv(fd, p, size, 0);
+    if (got == 0)
+    {
+      DEBUG_INFO("The connection was closed");
+      return false;
+    }
+
+    if (got < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      DEBUG_ERROR("recv failed: %s", strerror(errno));
+      return false;
+    }
+
+    p    += got;
+    size -= got;
+  }
+
+  return true;
+}
+
+size_t bridgeBound(size_t size)
+{
+  const size_t blocks = (size + BRIDGE_BLOCK_SIZE - 1) / BRIDGE_BLOCK_SIZE;
+  return size + blocks * sizeof(uint32_t);
+}
+
+size_t bridgeCompress(const uint8_t * src, size_t size, uint8_t * dst,
+    bool compress)
+{
+  size_t wp = 0;
+  for(size_t i = 0; i < size; i += BRIDGE_BLOCK_SIZE)
+  {
+    const size_t blockSize = size - i < BRIDGE_BLOCK_SIZE ?
+      size - i : BRIDGE_BLOCK_SIZE;
+    uint8_t * out = dst + wp + sizeof(uint32_t);
+
+    // only keep the compressed block if it is smaller
+    uint32_t hdr = compress ?
+      lz4_compress(src + i, blockSize, out, blockSize - 1) : 0;
+    if (!hdr)
+    {
+      memcpy(out, src + i, blockSize);
+      hdr = blockSize | BRIDGE_BLOCK_RAW;
+    }
+
+    memcpy(dst + wp, &hdr, sizeof(hdr));
+    wp += sizeof(hdr) + (hdr & ~BRIDGE_BLOCK_RAW);
+  }
+
+  return wp;
+}
+
+bool bridgeDecompress(const uint8_t * src, size_t srcSize, uint8_t * dst,
+    size_t size)
+{
+  size_t rp = 0;
+  for(size_t i = 0; i < size; i += BRIDGE_BLOCK_SIZE)
+  {
+    const size_t blockSize = size - i < BRIDGE_BLOCK_SIZE ?
+      size - i : BRIDGE_BLOCK_SIZE;
+
+    uint32_t hdr;
+    if (rp + sizeof(hdr) > srcSize)
+      return false;
+
+    memcpy(&hdr, src + rp, sizeof(hdr));
+    rp += sizeof(hdr);
+
+    const size_t len = hdr & ~BRIDGE_BLOCK_RAW;
+    if (rp + len > srcSize)
+      return false;
+
+    if (hdr & BRIDGE_BLOCK_RAW)
+    {
+      if (len != blockSize)
+        return false;
+      memcpy(dst + i, src + rp, len);
+    }
+    else if (lz4_decompress(src + rp, len, dst + i, blockSize) != blockSize)
+      return false;
+
+    rp += len;
+  }
+
+  return rp == srcSize;
+}
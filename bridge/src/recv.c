@@ -0,0 +1,585 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "bridge.h"
+
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/framebuffer.h"
+#include "common/locking.h"
+#include "common/time.h"
+#include "common/util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <lgmp/host.h>
+
+#define POINTER_QUEUE_LEN 20
+#define MAX_POINTER_SIZE  (sizeof(KVMFRCursor) + BRIDGE_MAX_SHAPE)
+
+struct Receiver
+{
+  int       fd;
+  bool      compress;
+  void    * shm;
+  size_t    shmSize;
+  long      pageSize;
+
+  /* the timer processes the session while frames are posted from the socket
+   * loop, the lock covers every LGMP call */
+  LG_Lock   lock;
+  LGTimer * timer;
+
+  PLGMPHost      lgmp;
+  PLGMPHostQueue frameQueue;
+  PLGMPHostQueue pointerQueue;
+  PLGMPMemory    frameMemory[LGMP_Q_FRAME_LEN];
+  PLGMPMemory    pointerMemory[POINTER_QUEUE_LEN];
+  size_t         maxFrameSize;
+  unsigned int   frameIndex;
+  unsigned int   pointerIndex;
+  bool           frameValid;
+  bool           pointerValid;
+  uint32_t       frameSerial;
+
+  // the last frame in full, damage from the sender is applied to it
+  uint8_t * image;
+  size_t    imageSize;
+  bool      imageValid;
+  uint32_t  formatVer;
+  size_t    rows, pitch;
+
+  uint8_t * in;
+  size_t    inSize;
+  uint8_t * data;
+  size_t    dataSize;
+};
+
+static bool grow(uint8_t ** buffer, size_t * size, size_t needed)
+{
+  if (*size >= needed)
+    return true;
+
+  free(*buffer);
+  *buffer = malloc(needed);
+  *size   = *buffer ? needed : 0;
+  if (!*buffer)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+  return true;
+}
+
+static bool openShm(struct Receiver * r)
+{
+  const char * file = option_get_string("bridge", "shmFile");
+  r->shmSize = (size_t)option_get_int("bridge", "shmSize") * 1048576;
+
+  int fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+  if (fd < 0)
+  {
+    DEBUG_ERROR("Failed to open %s: %s", file, strerror(errno));
+    return false;
+  }
+
+  if (ftruncate(fd, r->shmSize) != 0)
+  {
+    DEBUG_ERROR("Failed to resize %s: %s", file, strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  r->shm = mmap(NULL, r->shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (r->shm == MAP_FAILED)
+  {
+    DEBUG_ERROR("Failed to map %s: %s", file, strerror(errno));
+    r->shm = NULL;
+    return false;
+  }
+
+  DEBUG_INFO("Publishing into %s (%zu MiB)", file, r->shmSize / 1048576);
+  return true;
+}
+
+static void lgmpFree(struct Receiver * r)
+{
+  if (r->timer)
+  {
+    lgTimerDestroy(r->timer);
+    r->timer = NULL;
+  }
+
+  for(int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+    lgmpHostMemFree(&r->frameMemory[i]);
+  for(int i = 0; i < POINTER_QUEUE_LEN; ++i)
+    lgmpHostMemFree(&r->pointerMemory[i]);
+  lgmpHostFree(&r->lgmp);
+
+  r->frameValid   = false;
+  r->pointerValid = false;
+}
+
+static bool lgmpTimer(void * opaque)
+{
+  struct Receiver * r = (struct Receiver *)opaque;
+  LGMP_STATUS status;
+
+  LG_LOCK(r->lock);
+  if ((status = lgmpHostProcess(r->lgmp)) != LGMP_OK)
+  {
+    LG_UNLOCK(r->lock);
+    DEBUG_ERROR("lgmpHostProcess Failed: %s", lgmpStatusString(status));
+    return false;
+  }
+
+  // nothing the clients send back is forwarded, drop it
+  uint8_t data[LGMP_MSGS_SIZE];
+  size_t  size;
+  while(lgmpHostReadData(r->pointerQueue, &data, &size) == LGMP_OK)
+    lgmpHostAckData(r->pointerQueue);
+
+  // late joiners get the last frame and cursor, as the host would send them
+  if (lgmpHostQueueNewSubs(r->frameQueue) > 0 && r->frameValid)
+    lgmpHostQueuePost(r->frameQueue, 0, r->frameMemory[r->frameIndex]);
+
+  if (lgmpHostQueueNewSubs(r->pointerQueue) > 0 && r->pointerValid)
+    lgmpHostQueuePost(r->pointerQueue,
+        CURSOR_FLAG_POSITION | CURSOR_FLAG_VISIBLE | CURSOR_FLAG_SHAPE,
+        r->pointerMemory[r->pointerIndex]);
+  LG_UNLOCK(r->lock);
+
+  return true;
+}
+
+/* starts a new session for the clients with the sender's KVMFR header, minus
+ * the features that need a path back to the guest */
+static bool lgmpSetup(struct Receiver * r, const uint8_t * udata,
+    size_t udataSize)
+{
+  lgmpFree(r);
+
+  uint8_t * copy = malloc(udataSize);
+  if (!copy)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+  memcpy(copy, udata, udataSize);
+
+  KVMFR * kvmfr = (KVMFR *)copy;
+  kvmfr->features     &= ~(KVMFR_FEATURE_SETCURSORPOS | KVMFR_FEATURE_DOORBELL |
+      KVMFR_FEATURE_AUDIO);
+  kvmfr->frameQueueLen = LGMP_Q_FRAME_LEN;
+  DEBUG_INFO("Host session from the sender (%.*s)",
+      (int)sizeof(kvmfr->hostver), kvmfr->hostver);
+
+  LGMP_STATUS status;
+  status = lgmpHostInit(r->shm, r->shmSize, &r->lgmp, udataSize, copy);
+  free(copy);
+  if (status != LGMP_OK)
+  {
+    DEBUG_ERROR("lgmpHostInit Failed: %s", lgmpStatusString(status));
+    return false;
+  }
+
+  const struct LGMPQueueConfig frameQueueConfig =
+  {
+    .queueID     = LGMP_Q_FRAME,
+    .numMessages = LGMP_Q_FRAME_LEN,
+    .subTimeout  = 1000
+  };
+
+  const struct LGMPQueueConfig pointerQueueConfig =
+  {
+    .queueID     = LGMP_Q_POINTER,
+    .numMessages = POINTER_QUEUE_LEN,
+    .subTimeout  = 1000
+  };
+
+  if ((status = lgmpHostQueueNew(r->lgmp, frameQueueConfig,
+          &r->frameQueue)) != LGMP_OK)
+  {
+    DEBUG_ERROR("lgmpHostQueueNew Failed (Frame): %s",
+        lgmpStatusString(status));
+    goto fail;
+  }
+
+  if ((status = lgmpHostQueueNew(r->lgmp, pointerQueueConfig,
+          &r->pointerQueue)) != LGMP_OK)
+  {
+    DEBUG_ERROR("lgmpHostQueueNew Failed (Pointer): %s",
+        lgmpStatusString(status));
+    goto fail;
+  }
+
+  for(int i = 0; i < POINTER_QUEUE_LEN; ++i)
+  {
+    if ((status = lgmpHostMemAlloc(r->lgmp, MAX_POINTER_SIZE,
+            &r->pointerMemory[i])) != LGMP_OK)
+    {
+      DEBUG_ERROR("lgmpHostMemAlloc Failed (Pointer): %s",
+          lgmpStatusString(status));
+      goto fail;
+    }
+    memset(lgmpHostMemPtr(r->pointerMemory[i]), 0, MAX_POINTER_SIZE);
+  }
+
+  r->maxFrameSize = lgmpHostMemAvail(r->lgmp) / LGMP_Q_FRAME_LEN;
+  r->maxFrameSize = (r->maxFrameSize - (r->pageSize - 1)) & ~(r->pageSize - 1);
+  for(int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  {
+    if ((status = lgmpHostMemAllocAligned(r->lgmp, r->maxFrameSize,
+            r->pageSize, &r->frameMemory[i])) != LGMP_OK)
+    {
+      DEBUG_ERROR("lgmpHostMemAllocAligned Failed (Frame): %s",
+          lgmpStatusString(status));
+      goto fail;
+    }
+  }
+
+  DEBUG_INFO("Max Frame Size   : %u MiB",
+      (unsigned int)(r->maxFrameSize / 1048576));
+
+  r->frameIndex   = 0;
+  r->pointerIndex = 0;
+  if (!lgCreateTimer(10, lgmpTimer, r, &r->timer))
+  {
+    DEBUG_ERROR("Failed to create the LGMP timer");
+    goto fail;
+  }
+
+  return true;
+
+fail:
+  lgmpFree(r);
+  return false;
+}
+
+static bool recvData(struct Receiver * r, size_t size, size_t dataSize)
+{
+  if (!grow(&r->in, &r->inSize, size) ||
+      !grow(&r->data, &r->dataSize, dataSize))
+    return false;
+
+  if (!bridgeRecv(r->fd, r->in, size))
+    return false;
+
+  if (!bridgeDecompress(r->in, size, r->data, dataSize))
+  {
+    DEBUG_ERROR("Corrupt frame data from the sender");
+    return false;
+  }
+  return true;
+}
+
+static bool onFrame(struct Receiver * r, size_t size)
+{
+  BridgeFrame bf;
+  if (size < sizeof(bf) || !bridgeRecv(r->fd, &bf, sizeof(bf)))
+    return false;
+
+  KVMFRFrame * frame = &bf.frame;
+  const size_t rows  = kvmfrFrameRows(frame->type, frame->frameHeight);
+  const size_t total = rows * frame->pitch;
+  frame->damageRectsCount = min(frame->damageRectsCount,
+      KVMFR_MAX_DAMAGE_RECTS);
+
+  if (!recvData(r, size - sizeof(bf), bf.dataSize))
+    return false;
+
+  if (bf.full)
+  {
+    if (bf.dataSize != total || !grow(&r->image, &r->imageSize, total))
+      return false;
+    memcpy(r->image, r->data, total);
+
+    r->imageValid = true;
+    r->formatVer  = frame->formatVer;
+    r->rows       = rows;
+    r->pitch      = frame->pitch;
+  }
+  else
+  {
+    /* the damage is only valid in the layout the sender's readFrame sends it
+     * for, that of the last full frame, anything else writes past the image */
+    if (!r->imageValid                        ||
+        frame->formatVer != r->formatVer      ||
+        rows             != r->rows           ||
+        frame->pitch     != r->pitch          ||
+        frame->type      == FRAME_TYPE_NV12   ||
+        bridgeFrameBpp(frame->type) != 4      ||
+        frame->pitch < (size_t)frame->frameWidth * 4)
+    {
+      DEBUG_ERROR("Damage from the sender that does not match the last full frame");
+      return false;
+    }
+
+    const uint8_t * p   = r->data;
+    const uint8_t * end = r->data + bf.dataSize;
+    for(unsigned int i = 0; i < frame->damageRectsCount; ++i)
+    {
+      const FrameDamageRect rect = bridgeFrameRect(frame, i);
+      if ((size_t)(end - p) < (size_t)rect.width * rect.height * 4)
+        return false;
+
+      for(unsigned int y = rect.y; y < rect.y + rect.height; ++y)
+      {
+        memcpy(r->image + y * frame->pitch + rect.x * 4, p, rect.width * 4);
+        p += rect.width * 4;
+      }
+    }
+  }
+
+  if (!r->lgmp)
+    return true;
+
+  if (r->pageSize + total > r->maxFrameSize)
+  {
+    DEBUG_WARN("A %ux%u frame does not fit bridge:shmSize",
+        frame->frameWidth, frame->frameHeight);
+    return true;
+  }
+
+  // the clients fall behind rather than the sender, wait for room
+  for(;;)
+  {
+    LG_LOCK(r->lock);
+    const bool full = lgmpHostQueuePending(r->frameQueue) == LGMP_Q_FRAME_LEN;
+    LG_UNLOCK(r->lock);
+    if (!full)
+      break;
+    usleep(1000);
+  }
+
+  const unsigned int index = (r->frameIndex + 1) % LGMP_Q_FRAME_LEN;
+  KVMFRFrame * fi = lgmpHostMemPtr(r->frameMemory[index]);
+
+  /* the guest's clock means nothing here so the timings restart locally, the
+   * durations the host measured are kept */
+  const uint64_t now = microtime();
+  memcpy(fi, frame, sizeof(*fi));
+  fi->frameSerial = r->frameSerial++;
+  fi->offset      = r->pageSize - sizeof(FrameBuffer);
+  fi->flags      &= ~FRAME_FLAG_COMPRESSED;
+  fi->captureTime = now;
+  fi->writeTime   = 0;
+
+  FrameBuffer * fb = (FrameBuffer *)((uint8_t *)fi + fi->offset);
+  framebuffer_prepare(fb);
+
+  LGMP_STATUS status = LGMP_OK;
+  LG_LOCK(r->lock);
+  r->frameIndex = index;
+  r->frameValid = true;
+  if (lgmpHostQueueHasSubs(r->frameQueue))
+    status = lgmpHostQueuePost(r->frameQueue, 0, r->frameMemory[index]);
+  LG_UNLOCK(r->lock);
+
+  if (status != LGMP_OK)
+  {
+    DEBUG_ERROR("lgmpHostQueuePost Failed (Frame): %s",
+        lgmpStatusString(status));
+    return true;
+  }
+
+  framebuffer_write(fb, r->image, total);
+  fi->writeTime = max(microtime() - now, 1);
+  return true;
+}
+
+static bool onCursor(struct Receiver * r, size_t size)
+{
+  BridgeCursor bc;
+  if (size < sizeof(bc) || size - sizeof(bc) > BRIDGE_MAX_SHAPE ||
+      !bridgeRecv(r->fd, &bc, sizeof(bc)))
+    return false;
+
+  const size_t shapeSize = size - sizeof(bc);
+  if (!(bc.flags & CURSOR_FLAG_SHAPE) && shapeSize)
+    return false;
+
+  /* the header is posted with the shape, clients and the next position only
+   * message trust it to describe the bytes that follow it */
+  if (bc.flags & CURSOR_FLAG_SHAPE)
+  {
+    const size_t rowSize = bc.cursor.type == CURSOR_TYPE_MONOCHROME ?
+      ((size_t)bc.cursor.width + 7) / 8 : (size_t)bc.cursor.width * 4;
+    if (bc.cursor.pitch < rowSize ||
+        (size_t)bc.cursor.height * bc.cursor.pitch != shapeSize)
+    {
+      DEBUG_ERROR("Cursor shape from the sender that does not match its size");
+      return false;
+    }
+  }
+
+  if (!r->lgmp)
+  {
+    if (!grow(&r->in, &r->inSize, shapeSize))
+      return false;
+    return bridgeRecv(r->fd, r->in, shapeSize);
+  }
+
+  for(;;)
+  {
+    LG_LOCK(r->lock);
+    const bool full =
+      lgmpHostQueuePending(r->pointerQueue) == POINTER_QUEUE_LEN;
+    LG_UNLOCK(r->lock);
+    if (!full)
+      break;
+    usleep(1000);
+  }
+
+  const unsigned int index = (r->pointerIndex + 1) % POINTER_QUEUE_LEN;
+  KVMFRCursor * cursor = lgmpHostMemPtr(r->pointerMemory[index]);
+
+  // a shape is kept with the message so a late joiner can be sent it again
+  if (bc.flags & CURSOR_FLAG_SHAPE)
+  {
+    memcpy(cursor, &bc.cursor, sizeof(*cursor));
+    if (!bridgeRecv(r->fd, cursor + 1, shapeSize))
+      return false;
+  }
+  else
+  {
+    const KVMFRCursor * last = lgmpHostMemPtr(r->pointerMemory[r->pointerIndex]);
+    const size_t lastSize = sizeof(*last) + (size_t)last->height * last->pitch;
+    memcpy(cursor, last, min(lastSize, MAX_POINTER_SIZE));
+    cursor->x = bc.cursor.x;
+    cursor->y = bc.cursor.y;
+  }
+
+  LGMP_STATUS status = LGMP_OK;
+  LG_LOCK(r->lock);
+  r->pointerIndex = index;
+  r->pointerValid = r->pointerValid || (bc.flags & CURSOR_FLAG_SHAPE);
+  if (lgmpHostQueueHasSubs(r->pointerQueue))
+    status = lgmpHostQueuePost(r->pointerQueue, bc.flags,
+        r->pointerMemory[index]);
+  LG_UNLOCK(r->lock);
+
+  if (status != LGMP_OK)
+    DEBUG_ERROR("lgmpHostQueuePost Failed (Pointer): %s",
+        lgmpStatusString(status));
+  return true;
+}
+
+static bool onHello(struct Receiver * r, size_t size)
+{
+  BridgeHello hello;
+  if (size < sizeof(hello) + sizeof(KVMFR) ||
+      !bridgeRecv(r->fd, &hello, sizeof(hello)))
+    return false;
+
+  if (hello.magic != BRIDGE_MAGIC || hello.version != BRIDGE_VERSION)
+  {
+    DEBUG_ERROR("The sender is not compatible with this bridge");
+    DEBUG_ERROR("Expected bridge version %d, got %u", BRIDGE_VERSION,
+        hello.version);
+    return false;
+  }
+
+  size -= sizeof(hello);
+  if (!grow(&r->in, &r->inSize, size) || !bridgeRecv(r->fd, r->in, size))
+    return false;
+
+  // a sender restarts the session when the host does
+  if (!lgmpSetup(r, r->in, size))
+    return false;
+
+  free(r->image);
+  r->image      = NULL;
+  r->imageSize  = 0;
+  r->imageValid = false;
+  return true;
+}
+
+int bridgeRecvRun(volatile bool * running)
+{
+  struct Receiver r =
+  {
+    .fd       = -1,
+    .pageSize = sysconf(_SC_PAGESIZE)
+  };
+  LG_LOCK_INIT(r.lock);
+
+  int ret = -1;
+  if (!openShm(&r))
+    return ret;
+
+  const int listenFd = bridgeListen(option_get_string("bridge", "address"),
+      option_get_int("bridge", "port"));
+  if (listenFd < 0)
+    goto out;
+
+  while(*running)
+  {
+    if ((r.fd = bridgeAccept(listenFd)) < 0)
+      continue;
+
+    BridgeHeader header;
+    bool ok = true;
+    while(*running && ok && bridgeRecv(r.fd, &header, sizeof(header)))
+    {
+      switch(header.type)
+      {
+        case BRIDGE_MSG_HELLO:
+          ok = onHello(&r, header.size);
+          break;
+
+        case BRIDGE_MSG_FRAME:
+          ok = onFrame(&r, header.size);
+          break;
+
+        case BRIDGE_MSG_CURSOR:
+          ok = onCursor(&r, header.size);
+          break;
+
+        default:
+          DEBUG_ERROR("Unknown message type %u from the sender", header.type);
+          ok = false;
+          break;
+      }
+    }
+
+    // the clients keep the last frame until the sender is back
+    DEBUG_INFO("The sender disconnected");
+    close(r.fd);
+    r.fd         = -1;
+    r.imageValid = false;
+  }
+  ret = 0;
+
+  close(listenFd);
+out:
+  lgmpFree(&r);
+  munmap(r.shm, r.shmSize);
+  free(r.image);
+  free(r.in);
+  free(r.data);
+  return ret;
+}
@@ -0,0 +1,428 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "bridge.h"
+
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/ivshmem.h"
+#include "common/framebuffer.h"
+#include "common/rects.h"
+#include "common/util.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lgmp/client.h>
+
+struct Sender
+{
+  int              fd;
+  bool             compress;
+  struct IVSHMEM   shmDev;
+  PLGMPClient      lgmp;
+  PLGMPClientQueue frameQueue;
+  PLGMPClientQueue pointerQueue;
+
+  // the position is read from the live record when the host provides one
+  const KVMFRCursorLive * live;
+  uint32_t                liveSeq;
+  bool                    visible;
+
+  // a copy of the frame so only the damage needs to be read and sent
+  bool      valid;
+  uint32_t  formatVer;
+  size_t    rows, pitch;
+  uint8_t * image;
+  size_t    imageSize;
+
+  uint8_t * packed;
+  size_t    packedSize;
+  uint8_t * out;
+  size_t    outSize;
+  uint8_t * shape;
+};
+
+static bool grow(uint8_t ** buffer, size_t * size, size_t needed)
+{
+  if (*size >= needed)
+    return true;
+
+  free(*buffer);
+  *buffer = malloc(needed);
+  *size   = *buffer ? needed : 0;
+  if (!*buffer)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+  return true;
+}
+
+static bool sendCursor(struct Sender * s, const BridgeCursor * bc,
+    size_t shapeSize)
+{
+  return bridgeSend(s->fd, BRIDGE_MSG_CURSOR, bc, sizeof(*bc),
+      s->shape, shapeSize);
+}
+
+static LGMP_STATUS processPointer(struct Sender * s, bool * ok)
+{
+  LGMPMessage msg;
+  LGMP_STATUS status;
+  while((status = lgmpClientProcess(s->pointerQueue, &msg)) == LGMP_OK)
+  {
+    if (msg.udata & CURSOR_FLAG_LIVE)
+    {
+      s->live    = (const KVMFRCursorLive *)msg.mem;
+      s->liveSeq = 0;
+      lgmpClientMessageDone(s->pointerQueue);
+      continue;
+    }
+
+    BridgeCursor bc = { .flags = msg.udata };
+    memcpy(&bc.cursor, msg.mem, sizeof(bc.cursor));
+
+    size_t shapeSize = 0;
+    if (bc.flags & CURSOR_FLAG_SHAPE)
+    {
+      shapeSize = (size_t)bc.cursor.height * bc.cursor.pitch;
+      if (shapeSize > BRIDGE_MAX_SHAPE)
+      {
+        DEBUG_WARN("Dropping a %ux%u cursor shape", bc.cursor.width,
+            bc.cursor.height);
+        bc.flags &= ~CURSOR_FLAG_SHAPE;
+        shapeSize = 0;
+      }
+      else
+        memcpy(s->shape, (const KVMFRCursor *)msg.mem + 1, shapeSize);
+    }
+    lgmpClientMessageDone(s->pointerQueue);
+
+    s->visible = bc.flags & CURSOR_FLAG_VISIBLE;
+    if (!sendCursor(s, &bc, shapeSize))
+    {
+      *ok = false;
+      return LGMP_OK;
+    }
+  }
+
+  return status == LGMP_ERR_QUEUE_EMPTY ? LGMP_OK : status;
+}
+
+static bool processLive(struct Sender * s)
+{
+  if (!s->live)
+    return true;
+
+  // odd while the host is updating it, zero until the first position
+  const uint32_t seq = atomic_load_explicit(
+      (_Atomic(uint32_t) *)&s->live->seq, memory_order_acquire);
+  if (seq == s->liveSeq || !seq || (seq & 1))
+    return true;
+
+  const int16_t x = s->live->x;
+  const int16_t y = s->live->y;
+  atomic_thread_fence(memory_order_acquire);
+  if (s->live->seq != seq)
+    return true;
+
+  s->liveSeq = seq;
+  BridgeCursor bc =
+  {
+    .flags    = CURSOR_FLAG_POSITION | (s->visible ? CURSOR_FLAG_VISIBLE : 0),
+    .cursor.x = x,
+    .cursor.y = y
+  };
+  return sendCursor(s, &bc, 0);
+}
+
+/* copies what is needed of the frame out of IVSHMEM so the message can be
+ * released before the frame is sent */
+static bool readFrame(struct Sender * s, const KVMFRFrame * frame,
+    BridgeFrame * bf)
+{
+  const FrameBuffer * fb = (const FrameBuffer *)
+    ((const uint8_t *)frame + frame->offset);
+  const size_t rows = kvmfrFrameRows(frame->type, frame->frameHeight);
+  if (!grow(&s->image, &s->imageSize, rows * frame->pitch))
+    return false;
+
+  memcpy(&bf->frame, frame, sizeof(*frame));
+  bf->frame.damageRectsCount = min(frame->damageRectsCount,
+      KVMFR_MAX_DAMAGE_RECTS);
+
+  // the rects only cover 32bpp RGB frames in their own layout
+  bf->full =
+    !s->valid                                 ||
+    frame->formatVer != s->formatVer          ||
+    rows             != s->rows               ||
+    frame->pitch     != s->pitch              ||
+    bf->frame.damageRectsCount == 0           ||
+    frame->type      == FRAME_TYPE_NV12       ||
+    bridgeFrameBpp(frame->type) != 4;
+
+  bool ok = true;
+  if (frame->flags & FRAME_FLAG_COMPRESSED)
+    ok = framebuffer_read_compressed(fb, s->image, frame->pitch, rows,
+        frame->pitch, 1, frame->pitch);
+  else if (bf->full)
+    ok = framebuffer_read(fb, s->image, frame->pitch, rows, frame->pitch, 1,
+        frame->pitch);
+  else
+  {
+    FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+    memcpy(rects, bf->frame.damageRects,
+        bf->frame.damageRectsCount * sizeof(*rects));
+    rectsFramebufferToBuffer(rects, bf->frame.damageRectsCount, s->image,
+        frame->pitch, frame->frameHeight, fb, frame->pitch);
+  }
+
+  s->valid     = ok;
+  s->formatVer = frame->formatVer;
+  s->rows      = rows;
+  s->pitch     = frame->pitch;
+  return ok;
+}
+
+static bool sendFrame(struct Sender * s, BridgeFrame * bf)
+{
+  const KVMFRFrame * frame = &bf->frame;
+  const uint8_t    * data  = s->image;
+  size_t             size  = s->rows * s->pitch;
+
+  if (!bf->full)
+  {
+    size = 0;
+    for(unsigned int i = 0; i < frame->damageRectsCount; ++i)
+    {
+      const FrameDamageRect r = bridgeFrameRect(frame, i);
+      size += (size_t)r.width * r.height * 4;
+    }
+
+    if (!grow(&s->packed, &s->packedSize, size))
+      return false;
+
+    uint8_t * p = s->packed;
+    for(unsigned int i = 0; i < frame->damageRectsCount; ++i)
+    {
+      const FrameDamageRect r = bridgeFrameRect(frame, i);
+      for(unsigned int y = r.y; y < r.y + r.height; ++y)
+      {
+        memcpy(p, s->image + y * s->pitch + r.x * 4, r.width * 4);
+        p += r.width * 4;
+      }
+    }
+    data = s->packed;
+  }
+
+  if (!grow(&s->out, &s->outSize, bridgeBound(size)))
+    return false;
+
+  bf->dataSize = size;
+  const size_t len = bridgeCompress(data, size, s->out, s->compress);
+  return bridgeSend(s->fd, BRIDGE_MSG_FRAME, bf, sizeof(*bf), s->out, len);
+}
+
+static bool subscribe(struct Sender * s, uint32_t queueID,
+    PLGMPClientQueue * queue, volatile bool * running)
+{
+  LGMP_STATUS status;
+  while(*running)
+  {
+    status = lgmpClientSubscribe(s->lgmp, queueID, queue);
+    if (status == LGMP_OK)
+      return true;
+
+    if (status != LGMP_ERR_NO_SUCH_QUEUE)
+    {
+      DEBUG_ERROR("lgmpClientSubscribe Failed: %s", lgmpStatusString(status));
+      return false;
+    }
+    usleep(1000);
+  }
+  return false;
+}
+
+/* forwards a host session until it ends, false is returned if the connection
+ * failed */
+static bool runSession(struct Sender * s, volatile bool * running)
+{
+  uint32_t udataSize;
+  KVMFR  * udata;
+  LGMP_STATUS status;
+
+  bool waiting = false;
+  while(*running)
+  {
+    status = lgmpClientSessionInit(s->lgmp, &udataSize, (uint8_t **)&udata,
+        NULL);
+    if (status == LGMP_OK)
+      break;
+
+    if (!waiting)
+    {
+      DEBUG_INFO("Waiting for the host application: %s",
+          lgmpStatusString(status));
+      waiting = true;
+    }
+    usleep(100000);
+  }
+
+  if (!*running)
+    return true;
+
+  if (udataSize < sizeof(KVMFR) ||
+      memcmp(udata->magic, KVMFR_MAGIC, sizeof(udata->magic)) != 0 ||
+      udata->version != KVMFR_VERSION)
+  {
+    DEBUG_ERROR("The host application is not compatible with this bridge");
+    DEBUG_ERROR("Expected KVMFR version %d", KVMFR_VERSION);
+    usleep(1000000);
+    return true;
+  }
+
+  DEBUG_INFO("Host session started (%s)", udata->hostver);
+  const BridgeHello hello =
+  {
+    .magic   = BRIDGE_MAGIC,
+    .version = BRIDGE_VERSION
+  };
+
+  if (!bridgeSend(s->fd, BRIDGE_MSG_HELLO, &hello, sizeof(hello), udata,
+        udataSize))
+    return false;
+
+  if (!subscribe(s, LGMP_Q_FRAME  , &s->frameQueue  , running) ||
+      !subscribe(s, LGMP_Q_POINTER, &s->pointerQueue, running))
+  {
+    lgmpClientUnsubscribe(&s->frameQueue);
+    return true;
+  }
+
+  s->valid   = false;
+  s->live    = NULL;
+  s->visible = false;
+
+  bool ok = true;
+  while(*running && ok)
+  {
+    if ((status = processPointer(s, &ok)) != LGMP_OK || !ok ||
+        !(ok = processLive(s)))
+      break;
+
+    LGMPMessage msg;
+    if ((status = lgmpClientProcess(s->frameQueue, &msg)) != LGMP_OK)
+    {
+      if (status == LGMP_ERR_QUEUE_EMPTY)
+      {
+        status = LGMP_OK;
+        usleep(500);
+        continue;
+      }
+      break;
+    }
+
+    BridgeFrame bf;
+    const bool read = readFrame(s, (const KVMFRFrame *)msg.mem, &bf);
+    lgmpClientMessageDone(s->frameQueue);
+
+    if (read)
+      ok = sendFrame(s, &bf);
+  }
+
+  if (status != LGMP_OK && status != LGMP_ERR_INVALID_SESSION)
+    DEBUG_ERROR("lgmpClientProcess Failed: %s", lgmpStatusString(status));
+
+  lgmpClientUnsubscribe(&s->pointerQueue);
+  lgmpClientUnsubscribe(&s->frameQueue);
+  return ok;
+}
+
+int bridgeSendRun(volatile bool * running)
+{
+  struct Sender s =
+  {
+    .fd       = -1,
+    .compress = option_get_bool("bridge", "compress"),
+    .shape    = malloc(BRIDGE_MAX_SHAPE)
+  };
+
+  int ret = -1;
+  if (!s.shape)
+  {
+    DEBUG_ERROR("out of memory");
+    return ret;
+  }
+
+  if (!ivshmemOpen(&s.shmDev))
+    goto out;
+
+  LGMP_STATUS status;
+  if ((status = lgmpClientInit(s.shmDev.mem, s.shmDev.size, &s.lgmp))
+      != LGMP_OK)
+  {
+    DEBUG_ERROR("lgmpClientInit: %s", lgmpStatusString(status));
+    goto out;
+  }
+
+  const char * address = option_get_string("bridge", "address");
+  const int    port    = option_get_int   ("bridge", "port");
+  if (!address)
+  {
+    DEBUG_ERROR("bridge:address is required to send");
+    goto out;
+  }
+
+  while(*running)
+  {
+    if (s.fd < 0)
+    {
+      s.fd = bridgeConnect(address, port);
+      if (s.fd < 0)
+      {
+        usleep(1000000);
+        continue;
+      }
+      DEBUG_INFO("Connected to %s:%d", address, port);
+    }
+
+    // the connection outlives host sessions, a new hello starts another
+    if (!runSession(&s, running))
+    {
+      close(s.fd);
+      s.fd = -1;
+    }
+  }
+  ret = 0;
+
+out:
+  if (s.fd >= 0)
+    close(s.fd);
+  lgmpClientFree(&s.lgmp);
+  ivshmemClose(&s.shmDev);
+  free(s.image);
+  free(s.packed);
+  free(s.out);
+  free(s.shape);
+  return ret;
+}
@@ -24,6 +24,7 @@
 #include <spa/param/props.h>
 #include <pipewire/pipewire.h>
 #include <math.h>
+#include <stdatomic.h>
 
 #include "common/debug.h"
 #include "common/stringutils.h"
@@ -49,6 +50,9 @@ struct PipeWire
     struct pw_stream * stream;
     struct spa_io_rate_match * rateMatch;
 
+    // the rate correction for the PipeWire resampler, zero when not in use
+    _Atomic(double) rate;
+
     int            channels;
     int            sampleRate;
     int            stride;
@@ -83,6 +87,8 @@ static void pipewire_onPlaybackIoChanged(void * userdata, uint32_t id,
   {
     case SPA_IO_RateMatch:
       pw.playback.rateMatch = data;
+      if (!data)
+        atomic_store(&pw.playback.rate, 0.0);
       break;
   }
 }
@@ -104,8 +110,23 @@ static void pipewire_onPlaybackProcess(void * userdata)
     return;
 
   int frames = sbuf->datas[0].maxsize / pw.playback.stride;
-  if (pw.playback.rateMatch && pw.playback.rateMatch->size > 0)
-    frames = min(frames, pw.playback.rateMatch->size);
+  if (pw.playback.rateMatch)
+  {
+    // let the PipeWire resampler correct the drift if we were asked to
+    const double rate = atomic_load(&pw.playback.rate);
+    if (rate > 0.0)
+    {
+      pw.playback.rateMatch->rate = rate;
+      SPA_FLAG_SET(pw.playback.rateMatch->flags,
+          SPA_IO_RATE_MATCH_FLAG_ACTIVE);
+    }
+    else
+      SPA_FLAG_CLEAR(pw.playback.rateMatch->flags,
+          SPA_IO_RATE_MATCH_FLAG_ACTIVE);
+
+    if (pw.playback.rateMatch->size > 0)
+      frames = min(frames, pw.playback.rateMatch->size);
+  }
 
   frames = pw.playback.pullFn(dst, frames);
   if (!frames)
@@ -206,6 +227,7 @@ static void pipewire_playbackStopStream(void)
   pw_stream_destroy(pw.playback.stream);
   pw.playback.stream    = NULL;
   pw.playback.rateMatch = NULL;
+  atomic_store(&pw.playback.rate, 0.0);
   pw_thread_loop_unlock(pw.thread);
 }
 
@@ -417,6 +439,16 @@ static size_t pipewire_playbackLatency(void)
   return time.delay + time.queued / pw.playback.stride;
 }
 
+static bool pipewire_playbackRateMatch(double ratio)
+{
+  // this is only possible if PipeWire is resampling the stream for us
+  if (!pw.playback.rateMatch)
+    return false;
+
+  atomic_store(&pw.playback.rate, ratio);
+  return true;
+}
+
 static void pipewire_recordStopStream(void)
 {
   if (!pw.record.stream)
@@ -600,12 +632,13 @@ struct LG_AudioDevOps LGAD_PipeWire =
   .free      = pipewire_free,
   .playback =
   {
-    .setup   = pipewire_playbackSetup,
-    .start   = pipewire_playbackStart,
-    .stop    = pipewire_playbackStop,
-    .volume  = pipewire_playbackVolume,
-    .mute    = pipewire_playbackMute,
-    .latency = pipewire_playbackLatency
+    .setup     = pipewire_playbackSetup,
+    .start     = pipewire_playbackStart,
+    .stop      = pipewire_playbackStop,
+    .volume    = pipewire_playbackVolume,
+    .mute      = pipewire_playbackMute,
+    .latency   = pipewire_playbackLatency,
+    .rateMatch = pipewire_playbackRateMatch
   },
   .record =
   {
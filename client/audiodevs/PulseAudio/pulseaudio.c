@@ -25,6 +25,8 @@
 #include <math.h>
 
 #include "common/debug.h"
+#include "common/option.h"
+#include "common/util.h"
 
 struct PulseAudio
 {
@@ -106,6 +108,24 @@ static void pulseaudio_ctx_state_change_cb(pa_context * c, void * userdata)
   }
 }
 
+static struct Option pulseaudio_options[] =
+{
+  {
+    .module       = "pulseaudio",
+    .name         = "lowWakeupMs",
+    .description  = "Buffer this much playback to reduce wakeups, at the cost of latency (0 to disable)",
+    .type         = OPTION_TYPE_INT,
+    .value.x_int  = 0
+  },
+
+  {0}
+};
+
+static void pulseaudio_earlyInit(void)
+{
+  option_register(pulseaudio_options);
+}
+
 static bool pulseaudio_init(void)
 {
   pa.loop = pa_threaded_mainloop_new();
@@ -274,8 +294,10 @@ static void pulseaudio_setup(int channels, int sampleRate,
     .channels = channels
   };
 
-  int stride = channels * sizeof(float);
-  int bufferSize = requestedPeriodFrames * 2 * stride;
+  int stride       = channels * sizeof(float);
+  int periodFrames = requestedPeriodFrames;
+  int startFrames  = requestedPeriodFrames * 4;
+  int bufferSize   = requestedPeriodFrames * 2 * stride;
   pa_buffer_attr attribs =
   {
     .maxlength = -1,
@@ -284,6 +306,23 @@ static void pulseaudio_setup(int channels, int sampleRate,
     .minreq    = (uint32_t)-1
   };
 
+  /* In low wakeup mode the server's timer based scheduling drains a large
+   * buffer and only asks for more once half of it has played. This trades
+   * latency for far fewer wakeups of both the server and the pull function,
+   * and the larger period is reported so the latency target accounts for it */
+  const int lowWakeupMs = option_get_int("pulseaudio", "lowWakeupMs");
+  if (lowWakeupMs > 0)
+  {
+    const int bufferFrames =
+      max(lowWakeupMs * sampleRate / 1000, requestedPeriodFrames * 2);
+    periodFrames     = bufferFrames / 2;
+    startFrames      = bufferFrames;
+    attribs.tlength  = bufferFrames * stride;
+    attribs.minreq   = periodFrames * stride;
+    DEBUG_INFO("Low wakeup mode: %d frame buffer, %d frame requests",
+        bufferFrames, periodFrames);
+  }
+
   pa_threaded_mainloop_lock(pa.loop);
   pulseaudio_sink_close_nl();
 
@@ -301,15 +340,15 @@ static void pulseaudio_setup(int channels, int sampleRate,
 
   pa.sinkStride          = stride;
   pa.sinkPullFn          = pullFn;
-  pa.sinkMaxPeriodFrames = requestedPeriodFrames;
+  pa.sinkMaxPeriodFrames = periodFrames;
   pa.sinkCorked          = true;
   pa.sinkStarting        = false;
 
   // If something else is, or was recently using a small latency value,
   // PulseAudio can request way more data at startup than is reasonable
-  pa.sinkStartFrames = requestedPeriodFrames * 4;
+  pa.sinkStartFrames = startFrames;
 
-  *maxPeriodFrames = requestedPeriodFrames;
+  *maxPeriodFrames = pa.sinkMaxPeriodFrames;
   *startFrames     = pa.sinkStartFrames;
 
   pa_threaded_mainloop_unlock(pa.loop);
@@ -379,9 +418,10 @@ static void pulseaudio_mute(bool mute)
 
 struct LG_AudioDevOps LGAD_PulseAudio =
 {
-  .name   = "PulseAudio",
-  .init   = pulseaudio_init,
-  .free   = pulseaudio_free,
+  .name      = "PulseAudio",
+  .earlyInit = pulseaudio_earlyInit,
+  .init      = pulseaudio_init,
+  .free      = pulseaudio_free,
   .playback =
   {
     .setup  = pulseaudio_setup,
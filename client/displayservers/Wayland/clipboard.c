@@ -368,11 +368,72 @@ static void clipboardReadCancel(struct ClipboardRead * data)
 {
   waylandPollUnregister(data->fd);
   close(data->fd);
-  free(data->buf);
+  if (data->spool)
+    fclose(data->spool);
   free(data);
   wlCb.currentRead = NULL;
 }
 
+/* SPICE needs the size of the payload before the first byte is sent, so a
+ * payload larger than a chunk is spooled to an anonymous temporary file and
+ * then forwarded chunk by chunk, keeping the memory used constant */
+static bool clipboardReadSpool(struct ClipboardRead * data)
+{
+  if (!data->spool)
+  {
+    data->spool = tmpfile();
+    if (!data->spool)
+    {
+      DEBUG_ERROR("Failed to create the clipboard spool file: %s", strerror(errno));
+      return false;
+    }
+  }
+
+  if (fwrite(data->buf, 1, data->numRead, data->spool) != data->numRead)
+  {
+    DEBUG_ERROR("Failed to write the clipboard spool file: %s", strerror(errno));
+    return false;
+  }
+
+  data->numRead = 0;
+  return true;
+}
+
+static void clipboardReadSend(struct ClipboardRead * data)
+{
+  app_clipboardNotifySize(data->type, data->total);
+
+  if (!data->spool)
+  {
+    app_clipboardData(data->type, data->buf, data->numRead);
+    return;
+  }
+
+  if (data->numRead && !clipboardReadSpool(data))
+    goto err;
+
+  rewind(data->spool);
+
+  size_t remaining = data->total;
+  while (remaining)
+  {
+    const size_t len = fread(data->buf, 1, sizeof(data->buf), data->spool);
+    if (len == 0)
+    {
+      DEBUG_ERROR("Failed to read the clipboard spool file: %s", strerror(errno));
+      goto err;
+    }
+
+    app_clipboardData(data->type, data->buf, len);
+    remaining -= len;
+  }
+  return;
+
+err:
+  // the transfer was already started, abort it
+  app_clipboardNotifySize(LG_CLIPBOARD_DATA_NONE, 0);
+}
+
 static void clipboardReadCallback(uint32_t events, void * opaque)
 {
   struct ClipboardRead * data = opaque;
@@ -382,7 +443,14 @@ static void clipboardReadCallback(uint32_t events, void * opaque)
     return;
   }
 
-  ssize_t result = read(data->fd, data->buf + data->numRead, data->size - data->numRead);
+  if (data->numRead == sizeof(data->buf) && !clipboardReadSpool(data))
+  {
+    clipboardReadCancel(data);
+    return;
+  }
+
+  ssize_t result = read(data->fd, data->buf + data->numRead,
+      sizeof(data->buf) - data->numRead);
   if (result < 0)
   {
     DEBUG_ERROR("Failed to read from clipboard: %s", strerror(errno));
@@ -392,25 +460,13 @@ static void clipboardReadCallback(uint32_t events, void * opaque)
 
   if (result == 0)
   {
-    app_clipboardNotifySize(data->type, data->numRead);
-    app_clipboardData(data->type, data->buf, data->numRead);
+    clipboardReadSend(data);
     clipboardReadCancel(data);
     return;
   }
 
   data->numRead += result;
-  if (data->numRead >= data->size)
-  {
-    data->size *= 2;
-    void * nbuf = realloc(data->buf, data->size);
-    if (!nbuf) {
-      DEBUG_ERROR("Failed to realloc clipboard buffer: %s", strerror(errno));
-      clipboardReadCancel(data);
-      return;
-    }
-
-    data->buf = nbuf;
-  }
+  data->total   += result;
 }
 
 void waylandCBInvalidate(void)
@@ -455,26 +511,18 @@ void waylandCBRequest(LG_ClipboardData type)
   }
 
   data->fd      = fds[0];
-  data->size    = 4096;
   data->numRead = 0;
-  data->buf     = malloc(data->size);
+  data->total   = 0;
+  data->spool   = NULL;
   data->offer   = wlCb.offer;
   data->type    = type;
 
-  if (!data->buf)
-  {
-    DEBUG_ERROR("Failed to allocate memory to receive clipboard data");
-    close(data->fd);
-    free(data);
-    return;
-  }
-
   if (!waylandPollRegister(data->fd, clipboardReadCallback, data, EPOLLIN))
   {
     DEBUG_ERROR("Failed to register clipboard read into epoll: %s", strerror(errno));
     close(data->fd);
-    free(data->buf);
     free(data);
+    return;
   }
 
   wlCb.currentRead = data;
@@ -22,6 +22,7 @@
 
 #include <stdbool.h>
 #include <string.h>
+#include <math.h>
 
 #include <EGL/egl.h>
 #include <wayland-client.h>
@@ -84,13 +85,18 @@ void waylandEGLSwapBuffers(EGLDisplay display, EGLSurface surface, const struct
   }
 
   waylandPresentationFrame();
+  waylandWindowUpdateTearing();
   swapWithDamage(&wlWm.swapWithDamage, display, surface, damage, count);
 
   if (wlWm.needsResize)
   {
     bool skipResize = false;
-    wl_egl_window_resize(wlWm.eglWindow, wl_fixed_to_int(wlWm.width * wlWm.scale),
-        wl_fixed_to_int(wlWm.height * wlWm.scale), 0, 0);
+
+    /* round the buffer to whole pixels the same way the compositor does for
+     * the fractional scale, the viewport source must not exceed the buffer */
+    const int bufferWidth  = lround(wl_fixed_to_double(wlWm.scale) * wlWm.width );
+    const int bufferHeight = lround(wl_fixed_to_double(wlWm.scale) * wlWm.height);
+    wl_egl_window_resize(wlWm.eglWindow, bufferWidth, bufferHeight, 0, 0);
 
     if (wlWm.width == 0 || wlWm.height == 0)
       skipResize = true;
@@ -99,7 +105,8 @@ void waylandEGLSwapBuffers(EGLDisplay display, EGLSurface surface, const struct
       wl_surface_set_buffer_scale(wlWm.surface, 1);
       if (!wlWm.viewport)
         wlWm.viewport = wp_viewporter_get_viewport(wlWm.viewporter, wlWm.surface);
-      wp_viewport_set_source(wlWm.viewport, 0, 0, wlWm.width * wlWm.scale, wlWm.height * wlWm.scale);
+      wp_viewport_set_source(wlWm.viewport, 0, 0,
+          wl_fixed_from_int(bufferWidth), wl_fixed_from_int(bufferHeight));
       wp_viewport_set_destination(wlWm.viewport, wlWm.width, wlWm.height);
     }
     else
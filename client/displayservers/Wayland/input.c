@@ -129,12 +129,37 @@ static void pointerButtonHandler(void *data, struct wl_pointer *pointer,
     app_handleButtonRelease(button);
 }
 
+static void pointerFrameHandler(void * data, struct wl_pointer * pointer)
+{
+  // relative motion of the frame goes to the guest as a single message
+  app_endInputBatch();
+}
+
+static void pointerAxisSourceHandler(void * data, struct wl_pointer * pointer,
+    uint32_t source)
+{
+}
+
+static void pointerAxisStopHandler(void * data, struct wl_pointer * pointer,
+    uint32_t time, uint32_t axis)
+{
+}
+
+static void pointerAxisDiscreteHandler(void * data, struct wl_pointer * pointer,
+    uint32_t axis, int32_t discrete)
+{
+}
+
 static const struct wl_pointer_listener pointerListener = {
   .enter = pointerEnterHandler,
   .leave = pointerLeaveHandler,
   .motion = pointerMotionHandler,
   .button = pointerButtonHandler,
   .axis = pointerAxisHandler,
+  .frame = pointerFrameHandler,
+  .axis_source = pointerAxisSourceHandler,
+  .axis_stop = pointerAxisStopHandler,
+  .axis_discrete = pointerAxisDiscreteHandler,
 };
 
 static void relativePointerMotionHandler(void * data,
@@ -146,6 +171,10 @@ static void relativePointerMotionHandler(void * data,
   wlWm.cursorY += wl_fixed_to_double(dyW);
   app_updateCursorPos(wlWm.cursorX, wlWm.cursorY);
 
+  // wl_pointer.frame only exists from wl_seat version 5
+  if (wl_seat_get_version(wlWm.seat) >= WL_POINTER_FRAME_SINCE_VERSION)
+    app_beginInputBatch();
+
   app_handleMouseRelative(
       wl_fixed_to_double(dxW),
       wl_fixed_to_double(dyW),
@@ -293,12 +322,19 @@ static void keyboardModifiersHandler(void * data,
   );
 }
 
+static void keyboardRepeatInfoHandler(void * data, struct wl_keyboard * keyboard,
+    int32_t rate, int32_t delay)
+{
+  // key repeat is left to the guest
+}
+
 static const struct wl_keyboard_listener keyboardListener = {
   .keymap = keyboardKeymapHandler,
   .enter = keyboardEnterHandler,
   .leave = keyboardLeaveHandler,
   .key = keyboardKeyHandler,
   .modifiers = keyboardModifiersHandler,
+  .repeat_info = keyboardRepeatInfoHandler,
 };
 
 static void waylandCleanUpPointer(void)
@@ -29,6 +29,8 @@
 
 #include "common/debug.h"
 #include "common/locking.h"
+#include "common/event.h"
+#include "common/thread.h"
 
 #ifdef ENABLE_LIBDECOR
 #include <libdecor.h>
@@ -195,3 +197,88 @@ bool waylandPollUnregister(int fd)
   });
   return true;
 }
+
+/* Frame callbacks and presentation feedback are dispatched from their own
+ * queue and thread so that a busy main loop, e.g. a large clipboard transfer
+ * or a burst of input, can not delay the render thread's waitFrame wakeups.
+ * libwayland coordinates the reads on the display fd between the threads. */
+static int waylandFrameThread(void * opaque)
+{
+  while (atomic_load(&wlWm.frameThreadRun))
+    if (wl_display_dispatch_queue(wlWm.display, wlWm.frameQueue) < 0)
+    {
+      DEBUG_ERROR("Failed to dispatch the frame queue: %s", strerror(errno));
+      break;
+    }
+
+  // don't leave the render thread waiting on a callback that will never come
+  if (wlWm.frameEvent)
+    lgSignalEvent(wlWm.frameEvent);
+  return 0;
+}
+
+bool waylandFrameQueueInit(void)
+{
+  wlWm.frameQueue = wl_display_create_queue(wlWm.display);
+  if (!wlWm.frameQueue)
+  {
+    DEBUG_ERROR("Failed to create the frame event queue");
+    return false;
+  }
+
+  atomic_store(&wlWm.frameThreadRun, true);
+  if (!lgCreateThread("waylandFrame", waylandFrameThread, NULL,
+        &wlWm.frameThread))
+  {
+    DEBUG_ERROR("Failed to create the frame thread");
+    wl_event_queue_destroy(wlWm.frameQueue);
+    wlWm.frameQueue = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+void * waylandFrameQueueWrap(void * proxy)
+{
+  void * wrapper = wl_proxy_create_wrapper(proxy);
+  if (!wrapper)
+  {
+    DEBUG_ERROR("Failed to create a proxy wrapper");
+    return NULL;
+  }
+
+  wl_proxy_set_queue(wrapper, wlWm.frameQueue);
+  return wrapper;
+}
+
+void waylandFrameQueueStop(void)
+{
+  if (!wlWm.frameThread)
+    return;
+
+  atomic_store(&wlWm.frameThreadRun, false);
+
+  // the thread blocks in the dispatch, wake it with a round trip on its queue
+  struct wl_display  * display = waylandFrameQueueWrap(wlWm.display);
+  struct wl_callback * sync    = display ? wl_display_sync(display) : NULL;
+  wl_display_flush(wlWm.display);
+
+  lgJoinThread(wlWm.frameThread, NULL);
+  wlWm.frameThread = NULL;
+
+  if (sync)
+    wl_callback_destroy(sync);
+  if (display)
+    wl_proxy_wrapper_destroy(display);
+}
+
+void waylandFrameQueueFree(void)
+{
+  waylandFrameQueueStop();
+  if (wlWm.frameQueue)
+  {
+    wl_event_queue_destroy(wlWm.frameQueue);
+    wlWm.frameQueue = NULL;
+  }
+}
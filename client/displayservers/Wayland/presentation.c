@@ -28,13 +28,28 @@
 #include <wayland-client.h>
 
 #include "common/debug.h"
+#include "common/event.h"
 #include "common/time.h"
+#include "common/util.h"
 
 struct FrameData
 {
   struct timespec sent;
+  uint64_t        sentUs;
+  uint32_t        serial;
+
+  // the vblank this frame was scheduled for, zero if it was not predicted
+  uint64_t        target;
 };
 
+// never cut it finer than this after the render
+#define JIT_MARGIN_MIN 500000ULL
+
+static inline uint64_t tsToNs(const struct timespec * ts)
+{
+  return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
 static void presentationClockId(void * data,
     struct wp_presentation * presentation, uint32_t clkId)
 {
@@ -64,6 +79,34 @@ static void presentationFeedbackPresented(void * opaque,
 
   tsDiff(&delta, &present, &data->sent);
   ringbuffer_push(wlWm.photonTimings, &(float){ delta.tv_sec + delta.tv_nsec * 1e-6f });
+
+  // the last vblank is also kept without JIT for the guest cadence pacing
+  const uint64_t presentNs = tsToNs(&present);
+  LG_LOCK(wlWm.jitPredict.lock);
+  wlWm.jitPredict.lastPresent = presentNs;
+  if (refresh)
+    wlWm.jitPredict.refresh = refresh;
+
+  if (wlWm.jitPredict.enabled)
+  {
+    /* back off quickly if the frame missed the vblank it was scheduled for,
+     * and creep back towards the deadline while frames make it */
+    const uint64_t period = wlWm.jitPredict.refresh;
+    if (data->target && period)
+    {
+      if (presentNs > data->target + period / 2)
+        wlWm.jitPredict.margin = min(wlWm.jitPredict.margin + period / 8,
+            period);
+      else
+        wlWm.jitPredict.margin = max(wlWm.jitPredict.margin -
+            wlWm.jitPredict.margin / 64, JIT_MARGIN_MIN);
+    }
+  }
+  LG_UNLOCK(wlWm.jitPredict.lock);
+
+  // the compositor clock may differ from ours, so only carry the delta over
+  app_framePresented(data->serial, data->sentUs +
+      (uint64_t)delta.tv_sec * 1000000ULL + delta.tv_nsec / 1000);
   free(data);
   wp_presentation_feedback_destroy(feedback);
 }
@@ -89,7 +132,16 @@ bool waylandPresentationInit(void)
     wlWm.photonGraph   = app_registerGraph("PHOTON", wlWm.photonTimings,
         0.0f, 30.0f, NULL);
     wp_presentation_add_listener(wlWm.presentation, &presentationListener, NULL);
+    LG_LOCK_INIT(wlWm.jitPredict.lock);
+
+    // the feedback is handled on the frame queue along with the callbacks
+    wlWm.framePresentation = waylandFrameQueueWrap(wlWm.presentation);
+    if (!wlWm.framePresentation)
+      return false;
   }
+  else
+    wlWm.jitPredict.enabled = false;
+
   return true;
 }
 
@@ -98,9 +150,12 @@ void waylandPresentationFree(void)
   if (!wlWm.presentation)
     return;
 
+  if (wlWm.framePresentation)
+    wl_proxy_wrapper_destroy(wlWm.framePresentation);
   wp_presentation_destroy(wlWm.presentation);
   app_unregisterGraph(wlWm.photonGraph);
   ringbuffer_free(&wlWm.photonTimings);
+  LG_LOCK_FREE(wlWm.jitPredict.lock);
 }
 
 void waylandPresentationFrame(void)
@@ -113,8 +168,111 @@ void waylandPresentationFrame(void)
   {
     DEBUG_ERROR("clock_gettime failed: %s\n", strerror(errno));
     free(data);
+    return;
+  }
+  data->sentUs = microtime();
+  data->serial = app_getFrameSerial();
+  data->target = 0;
+
+  if (wlWm.jitPredict.enabled)
+  {
+    // learn how long a render takes, rising at once and falling slowly
+    const uint64_t sentNs = tsToNs(&data->sent);
+    LG_LOCK(wlWm.jitPredict.lock);
+    if (wlWm.jitPredict.wake && sentNs > wlWm.jitPredict.wake)
+    {
+      const uint64_t took = sentNs - wlWm.jitPredict.wake;
+      if (took > wlWm.jitPredict.renderEst)
+        wlWm.jitPredict.renderEst = took;
+      else
+        wlWm.jitPredict.renderEst -= (wlWm.jitPredict.renderEst - took) / 16;
+    }
+    data->target = wlWm.jitPredict.target;
+    wlWm.jitPredict.wake   = 0;
+    wlWm.jitPredict.target = 0;
+    LG_UNLOCK(wlWm.jitPredict.lock);
   }
 
-  struct wp_presentation_feedback * feedback = wp_presentation_feedback(wlWm.presentation, wlWm.surface);
+  struct wp_presentation_feedback * feedback = wp_presentation_feedback(wlWm.framePresentation, wlWm.surface);
   wp_presentation_feedback_add_listener(feedback, &presentationFeedbackListener, data);
 }
+
+void waylandPresentationWaitDeadline(void)
+{
+  // the frame event waits on CLOCK_MONOTONIC so the clocks must match
+  if (!wlWm.jitPredict.enabled || wlWm.clkId != CLOCK_MONOTONIC)
+    return;
+
+  // async flips are not tied to a vblank so there is no deadline to wait for
+  if (wlWm.tearing)
+    return;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  const uint64_t now = tsToNs(&ts);
+
+  LG_LOCK(wlWm.jitPredict.lock);
+  const uint64_t period      = wlWm.jitPredict.refresh;
+  const uint64_t lastPresent = wlWm.jitPredict.lastPresent;
+  if (!wlWm.jitPredict.margin)
+    wlWm.jitPredict.margin = period / 4;
+  const uint64_t budget = wlWm.jitPredict.renderEst + wlWm.jitPredict.margin;
+  LG_UNLOCK(wlWm.jitPredict.lock);
+
+  uint64_t wake   = now;
+  uint64_t target = 0;
+
+  /* aim for the first vblank that can still be made and wake as late as the
+   * learnt render time and compositor margin allow */
+  if (period && lastPresent && lastPresent <= now && budget < period)
+  {
+    const uint64_t frames = (now + budget - lastPresent + period - 1) / period;
+    target = lastPresent + frames * period;
+
+    const uint64_t deadline = target - budget;
+    if (deadline > now)
+    {
+      ts.tv_sec  = deadline / 1000000000ULL;
+      ts.tv_nsec = deadline % 1000000000ULL;
+
+      // stopWaitFrame signals the event so a resize or quit is not delayed
+      lgWaitEventAbs(wlWm.frameEvent, &ts);
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      wake = tsToNs(&ts);
+    }
+  }
+
+  LG_LOCK(wlWm.jitPredict.lock);
+  wlWm.jitPredict.wake   = wake;
+  wlWm.jitPredict.target = target;
+  LG_UNLOCK(wlWm.jitPredict.lock);
+}
+
+bool waylandPresentationGetVBlank(uint64_t * lastUs, uint64_t * periodNs)
+{
+  if (!wlWm.presentation)
+    return false;
+
+  LG_LOCK(wlWm.jitPredict.lock);
+  const uint64_t lastPresent = wlWm.jitPredict.lastPresent;
+  const uint64_t period      = wlWm.jitPredict.refresh;
+  LG_UNLOCK(wlWm.jitPredict.lock);
+
+  if (!lastPresent || !period)
+    return false;
+
+  // the presentation clock may not be the one microtime() reads
+  struct timespec ts;
+  if (clock_gettime(wlWm.clkId, &ts))
+    return false;
+
+  const uint64_t nowNs = tsToNs(&ts);
+  const uint64_t nowUs = microtime();
+  const uint64_t ago   = nowNs > lastPresent ? (nowNs - lastPresent) / 1000 : 0;
+  if (ago > nowUs)
+    return false;
+
+  *lastUs   = nowUs - ago;
+  *periodNs = period;
+  return true;
+}
@@ -33,7 +33,9 @@ static void registryGlobalHandler(void * data, struct wl_registry * registry,
   if (!strcmp(interface, wl_output_interface.name))
     waylandOutputBind(name, version);
   else if (!strcmp(interface, wl_seat_interface.name) && !wlWm.seat)
-    wlWm.seat = wl_registry_bind(wlWm.registry, name, &wl_seat_interface, 1);
+    // version 5 groups pointer events with wl_pointer.frame
+    wlWm.seat = wl_registry_bind(wlWm.registry, name, &wl_seat_interface,
+        version < 5 ? version : 5);
   else if (!strcmp(interface, wl_shm_interface.name))
     wlWm.shm = wl_registry_bind(wlWm.registry, name, &wl_shm_interface, 1);
   else if (!strcmp(interface, wl_compositor_interface.name) && version >= 3)
@@ -53,6 +55,12 @@ static void registryGlobalHandler(void * data, struct wl_registry * registry,
   else if (!strcmp(interface, wp_viewporter_interface.name))
     wlWm.viewporter = wl_registry_bind(wlWm.registry, name,
         &wp_viewporter_interface, 1);
+  else if (!strcmp(interface, wp_fractional_scale_manager_v1_interface.name))
+    wlWm.fractionalScaleManager = wl_registry_bind(wlWm.registry, name,
+        &wp_fractional_scale_manager_v1_interface, 1);
+  else if (!strcmp(interface, wp_tearing_control_manager_v1_interface.name))
+    wlWm.tearingControlManager = wl_registry_bind(wlWm.registry, name,
+        &wp_tearing_control_manager_v1_interface, 1);
   else if (!strcmp(interface, zwp_relative_pointer_manager_v1_interface.name))
     wlWm.relativePointerManager = wl_registry_bind(wlWm.registry, name,
         &zwp_relative_pointer_manager_v1_interface, 1);
@@ -27,6 +27,7 @@
 
 #include "common/debug.h"
 #include "common/option.h"
+#include "common/util.h"
 
 static struct Option waylandOptions[] =
 {
@@ -44,6 +45,20 @@ static struct Option waylandOptions[] =
     .type         = OPTION_TYPE_BOOL,
     .value.x_bool = true,
   },
+  {
+    .module       = "wayland",
+    .name         = "jitPredict",
+    .description  = "Delay JIT renders until just before the compositor deadline",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = true,
+  },
+  {
+    .module       = "wayland",
+    .name         = "allowTearing",
+    .description  = "Allow async page flips in fullscreen when using jitRender",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = false,
+  },
   {0}
 };
 
@@ -75,6 +90,10 @@ static bool waylandInit(const LG_DSInitParams params)
 
   wlWm.warpSupport        = option_get_bool("wayland", "warpSupport");
   wlWm.useFractionalScale = option_get_bool("wayland", "fractionScale");
+  wlWm.jitPredict.enabled = params.jitRender &&
+    option_get_bool("wayland", "jitPredict");
+  wlWm.allowTearing       = params.jitRender &&
+    option_get_bool("wayland", "allowTearing");
 
   wlWm.display = wl_display_connect(NULL);
   wlWm.width = params.w;
@@ -89,6 +108,9 @@ static bool waylandInit(const LG_DSInitParams params)
   if (!waylandRegistryInit())
     return false;
 
+  if (!waylandFrameQueueInit())
+    return false;
+
   if (!waylandActivationInit())
     return false;
 
@@ -131,6 +153,7 @@ static void waylandShutdown(void)
 
 static void waylandFree(void)
 {
+  waylandFrameQueueStop();
   waylandIdleFree();
   waylandWindowFree();
   waylandPresentationFree();
@@ -138,6 +161,7 @@ static void waylandFree(void)
   waylandOutputFree();
   waylandRegistryFree();
   waylandCursorFree();
+  waylandFrameQueueFree();
   wl_display_disconnect(wlWm.display);
 }
 
@@ -149,6 +173,21 @@ static bool waylandGetProp(LG_DSProperty prop, void * ret)
     return true;
   }
 
+  if (prop == LG_DS_REFRESH_RATE)
+  {
+    // the fastest output the surface is on, the mode refresh is in mHz
+    int32_t refresh = 0;
+    struct SurfaceOutput * node;
+    wl_list_for_each(node, &wlWm.surfaceOutputs, link)
+      refresh = max(refresh, waylandOutputGetRefresh(node->output));
+
+    if (refresh <= 0)
+      return false;
+
+    *(int*)ret = (refresh + 500) / 1000;
+    return true;
+  }
+
   return false;
 }
 
@@ -180,6 +219,7 @@ struct LG_DisplayServerOps LGDS_Wayland =
   .waitFrame           = waylandWaitFrame,
   .skipFrame           = waylandSkipFrame,
   .stopWaitFrame       = waylandStopWaitFrame,
+  .getVBlank           = waylandPresentationGetVBlank,
   .guestPointerUpdated = waylandGuestPointerUpdated,
   .setPointer          = waylandSetPointer,
   .grabPointer         = waylandGrabPointer,
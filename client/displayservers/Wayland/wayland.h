@@ -19,6 +19,8 @@
  */
 
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 
 #include <wayland-client.h>
@@ -34,6 +36,7 @@
 #include "app.h"
 #include "egl_dynprocs.h"
 #include "common/locking.h"
+#include "common/thread.h"
 #include "common/countedbuffer.h"
 #include "common/ringbuffer.h"
 #include "interface/displayserver.h"
@@ -48,6 +51,8 @@
 #include "wayland-idle-inhibit-unstable-v1-client-protocol.h"
 #include "wayland-xdg-output-unstable-v1-client-protocol.h"
 #include "wayland-xdg-activation-v1-client-protocol.h"
+#include "wayland-fractional-scale-v1-client-protocol.h"
+#include "wayland-tearing-control-v1-client-protocol.h"
 
 typedef void (*WaylandPollCallback)(uint32_t events, void * opaque);
 
@@ -69,6 +74,7 @@ struct WaylandOutput
   int32_t logicalHeight;
   int32_t modeWidth;
   int32_t modeHeight;
+  int32_t modeRefresh;
   bool    modeRotate;
   struct wl_output * output;
   struct zxdg_output_v1 * xdgOutput;
@@ -134,6 +140,20 @@ struct WaylandDSState
   RingBuffer photonTimings;
   GraphHandle photonGraph;
 
+  // JIT deadline prediction from the presentation feedback, all in ns
+  struct
+  {
+    bool     enabled;
+    LG_Lock  lock;
+    uint64_t lastPresent;
+    uint64_t refresh;
+    uint64_t renderEst;
+    uint64_t margin;
+    uint64_t wake;
+    uint64_t target;
+  }
+  jitPredict;
+
 #ifdef ENABLE_LIBDECOR
   struct libdecor * libdecor;
   struct libdecor_frame * libdecorFrame;
@@ -186,12 +206,25 @@ struct WaylandDSState
 
   struct wp_viewporter * viewporter;
   struct wp_viewport * viewport;
+  struct wp_fractional_scale_manager_v1 * fractionalScaleManager;
+  struct wp_fractional_scale_v1 * surfaceFractionalScale;
+  wl_fixed_t preferredScale; // from wp_fractional_scale_v1, zero if unknown
   struct zxdg_output_manager_v1 * xdgOutputManager;
   struct wl_list outputs; // WaylandOutput::link
   struct wl_list surfaceOutputs; // SurfaceOutput::link
   bool useFractionalScale;
 
+  bool allowTearing;
+  bool tearing; // the async presentation hint is currently applied
+  struct wp_tearing_control_manager_v1 * tearingControlManager;
+  struct wp_tearing_control_v1 * tearingControl;
+
   LGEvent * frameEvent;
+  struct wl_event_queue * frameQueue;
+  struct wl_surface * frameSurface;           // wlWm.surface on frameQueue
+  struct wp_presentation * framePresentation; // wlWm.presentation on frameQueue
+  LGThread * frameThread;
+  atomic_bool frameThreadRun;
 
   struct wl_list poll; // WaylandPoll::link
   struct wl_list pollFree; // WaylandPoll::link
@@ -207,14 +240,18 @@ struct WCBTransfer
   const char ** mimetypes;
 };
 
+// clipboard reads are buffered in fixed size chunks
+#define CLIPBOARD_CHUNK_SIZE (64 * 1024)
+
 struct ClipboardRead
 {
   int fd;
-  size_t size;
-  size_t numRead;
-  uint8_t * buf;
+  size_t numRead;  // bytes in buf
+  size_t total;    // bytes read including those spooled
+  FILE * spool;    // only created when the payload exceeds a single chunk
   enum LG_ClipboardData type;
   struct wl_data_offer * offer;
+  uint8_t buf[CLIPBOARD_CHUNK_SIZE];
 };
 
 struct WCBState
@@ -298,16 +335,23 @@ void waylandOutputFree(void);
 void waylandOutputBind(uint32_t name, uint32_t version);
 void waylandOutputTryUnbind(uint32_t name);
 wl_fixed_t waylandOutputGetScale(struct wl_output * output);
+int32_t waylandOutputGetRefresh(struct wl_output * output);
 
 // poll module
 bool waylandPollInit(void);
 void waylandWait(unsigned int time);
 bool waylandPollRegister(int fd, WaylandPollCallback callback, void * opaque, uint32_t events);
 bool waylandPollUnregister(int fd);
+bool waylandFrameQueueInit(void);
+void * waylandFrameQueueWrap(void * proxy);
+void waylandFrameQueueStop(void);
+void waylandFrameQueueFree(void);
 
 // presentation module
 bool waylandPresentationInit(void);
 void waylandPresentationFrame(void);
+void waylandPresentationWaitDeadline(void);
+bool waylandPresentationGetVBlank(uint64_t * lastUs, uint64_t * periodNs);
 void waylandPresentationFree(void);
 
 // registry module
@@ -326,6 +370,7 @@ void waylandShellResize(int w, int h);
 bool waylandWindowInit(const char * title, bool fullscreen, bool maximize, bool borderless, bool resizable);
 void waylandWindowFree(void);
 void waylandWindowUpdateScale(void);
+void waylandWindowUpdateTearing(void);
 void waylandSetWindowSize(int x, int y);
 bool waylandIsValidPointerPos(int x, int y);
 bool waylandWaitFrame(void);
@@ -36,12 +36,16 @@ void waylandWindowUpdateScale(void)
   wl_fixed_t maxScale = 0;
   struct SurfaceOutput * node;
 
-  wl_list_for_each(node, &wlWm.surfaceOutputs, link)
-  {
-    wl_fixed_t scale = waylandOutputGetScale(node->output);
-    if (scale > maxScale)
-      maxScale = scale;
-  }
+  // the compositor's preferred scale is exact, the output estimate is not
+  if (wlWm.preferredScale)
+    maxScale = wlWm.preferredScale;
+  else
+    wl_list_for_each(node, &wlWm.surfaceOutputs, link)
+    {
+      wl_fixed_t scale = waylandOutputGetScale(node->output);
+      if (scale > maxScale)
+        maxScale = scale;
+    }
 
   if (maxScale)
   {
@@ -85,6 +89,22 @@ static const struct wl_surface_listener wlSurfaceListener = {
   .leave = wlSurfaceLeaveHandler,
 };
 
+static void fractionalScalePreferredHandler(void * data,
+    struct wp_fractional_scale_v1 * fractionalScale, uint32_t scale)
+{
+  // the scale is sent as a numerator over 120
+  const wl_fixed_t preferred = wl_fixed_from_double(scale / 120.0);
+  if (preferred == wlWm.preferredScale)
+    return;
+
+  wlWm.preferredScale = preferred;
+  waylandWindowUpdateScale();
+}
+
+static const struct wp_fractional_scale_v1_listener fractionalScaleListener = {
+  .preferred_scale = fractionalScalePreferredHandler,
+};
+
 bool waylandWindowInit(const char * title, bool fullscreen, bool maximize, bool borderless, bool resizable)
 {
   wlWm.scale = wl_fixed_from_int(1);
@@ -112,6 +132,39 @@ bool waylandWindowInit(const char * title, bool fullscreen, bool maximize, bool
 
   wl_surface_add_listener(wlWm.surface, &wlSurfaceListener, NULL);
 
+  /* with the fractional scale protocol the compositor tells us the exact
+   * scale to render at, which the viewport then maps back to surface size */
+  if (wlWm.useFractionalScale && wlWm.fractionalScaleManager &&
+      wlWm.viewporter)
+  {
+    wlWm.surfaceFractionalScale = wp_fractional_scale_manager_v1_get_fractional_scale(
+        wlWm.fractionalScaleManager, wlWm.surface);
+    if (wlWm.surfaceFractionalScale)
+    {
+      wp_fractional_scale_v1_add_listener(wlWm.surfaceFractionalScale,
+          &fractionalScaleListener, NULL);
+      DEBUG_INFO("Using wp_fractional_scale_v1");
+    }
+  }
+
+  if (wlWm.allowTearing)
+  {
+    if (wlWm.tearingControlManager)
+    {
+      wlWm.tearingControl = wp_tearing_control_manager_v1_get_tearing_control(
+          wlWm.tearingControlManager, wlWm.surface);
+      if (wlWm.tearingControl)
+        DEBUG_INFO("Using wp_tearing_control_v1");
+    }
+    else
+      DEBUG_WARN("wayland:allowTearing is set but the compositor does not support wp_tearing_control_v1");
+  }
+
+  // frame callbacks are created through this so they land on the frame queue
+  wlWm.frameSurface = waylandFrameQueueWrap(wlWm.surface);
+  if (!wlWm.frameSurface)
+    return false;
+
   if (!waylandShellInit(title, fullscreen, maximize, borderless, resizable))
     return false;
 
@@ -121,6 +174,17 @@ bool waylandWindowInit(const char * title, bool fullscreen, bool maximize, bool
 
 void waylandWindowFree(void)
 {
+  if (wlWm.tearingControl)
+    wp_tearing_control_v1_destroy(wlWm.tearingControl);
+  if (wlWm.tearingControlManager)
+    wp_tearing_control_manager_v1_destroy(wlWm.tearingControlManager);
+  if (wlWm.surfaceFractionalScale)
+    wp_fractional_scale_v1_destroy(wlWm.surfaceFractionalScale);
+  if (wlWm.fractionalScaleManager)
+    wp_fractional_scale_manager_v1_destroy(wlWm.fractionalScaleManager);
+
+  if (wlWm.frameSurface)
+    wl_proxy_wrapper_destroy(wlWm.frameSurface);
   wl_surface_destroy(wlWm.surface);
   lgFreeEvent(wlWm.frameEvent);
 }
@@ -145,17 +209,48 @@ static const struct wl_callback_listener frame_listener = {
    .done = frameHandler,
 };
 
+/* a compositor stops sending frame callbacks to a surface that can not be
+ * seen, a callback this late means the window is hidden */
+#define HIDDEN_TIMEOUT_MS 500
+
 bool waylandWaitFrame(void)
 {
-  lgWaitEvent(wlWm.frameEvent, TIMEOUT_INFINITE);
+  bool hidden = false;
+  while (!lgWaitEvent(wlWm.frameEvent, HIDDEN_TIMEOUT_MS))
+    if (!hidden)
+    {
+      hidden = true;
+      app_handleVisibilityEvent(false);
+    }
+
+  if (hidden)
+    app_handleVisibilityEvent(true);
+  waylandPresentationWaitDeadline();
 
-  struct wl_callback * callback = wl_surface_frame(wlWm.surface);
+  struct wl_callback * callback = wl_surface_frame(wlWm.frameSurface);
   if (callback)
     wl_callback_add_listener(callback, &frame_listener, NULL);
 
   return false;
 }
 
+void waylandWindowUpdateTearing(void)
+{
+  if (!wlWm.tearingControl)
+    return;
+
+  // only tear when fullscreen, a torn window gains nothing under composition
+  const bool tearing = wlWm.fullscreen;
+  if (tearing == wlWm.tearing)
+    return;
+
+  // the hint is double buffered and applied by the next commit
+  wp_tearing_control_v1_set_presentation_hint(wlWm.tearingControl, tearing ?
+      WP_TEARING_CONTROL_V1_PRESENTATION_HINT_ASYNC :
+      WP_TEARING_CONTROL_V1_PRESENTATION_HINT_VSYNC);
+  wlWm.tearing = tearing;
+}
+
 void waylandSkipFrame(void)
 {
   // If we decided to not render, we must commit the surface so that the callback is registered.
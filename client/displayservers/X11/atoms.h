@@ -32,6 +32,7 @@
   DEF_ATOM(_NET_WM_STATE, True) \
   DEF_ATOM(_NET_WM_STATE_FULLSCREEN, True) \
   DEF_ATOM(_NET_WM_STATE_FOCUSED, True) \
+  DEF_ATOM(_NET_WM_STATE_HIDDEN, True) \
   DEF_ATOM(_NET_WM_STATE_MAXIMIZED_HORZ, True) \
   DEF_ATOM(_NET_WM_STATE_MAXIMIZED_VERT, True) \
   DEF_ATOM(_NET_WM_STATE_DEMANDS_ATTENTION, True) \
@@ -34,6 +34,7 @@
 #include <X11/extensions/scrnsaver.h>
 #include <X11/extensions/Xinerama.h>
 #include <X11/extensions/Xpresent.h>
+#include <X11/extensions/Xrandr.h>
 #include <X11/Xcursor/Xcursor.h>
 
 #include <xkbcommon/xkbcommon.h>
@@ -271,16 +272,20 @@ static bool x11Init(const LG_DSInitParams params)
   x11.xValuator = -1;
   x11.yValuator = -1;
   x11.display = XOpenDisplay(NULL);
-  x11.jitRender = params.jitRender;
+  x11.presentClock = params.jitRender || params.vblankTimes;
 
   XSetWindowAttributes swa =
   {
     .event_mask =
       StructureNotifyMask |
       PropertyChangeMask |
-      ExposureMask
+      ExposureMask |
+      VisibilityChangeMask,
+    /* the server fills exposed areas black before the client draws them, zero
+     * is black on the TrueColor visuals the renderers use */
+    .background_pixel = 0
   };
-  unsigned long swaMask = CWEventMask;
+  unsigned long swaMask = CWEventMask | CWBackPixel;
 
 #ifdef ENABLE_OPENGL
   if (params.opengl)
@@ -680,7 +685,7 @@ static bool x11Init(const LG_DSInitParams params)
   /* default to the square cursor */
   XDefineCursor(x11.display, x11.window, x11.cursors[LG_POINTER_SQUARE]);
 
-  if (x11.jitRender)
+  if (x11.presentClock)
   {
     x11.frameEvent = lgCreateEvent(true, 0);
     XPresentQueryExtension(x11.display, &x11.xpresentOp, &event, &error);
@@ -725,7 +730,7 @@ static bool x11Init(const LG_DSInitParams params)
   {
     XSetICFocus(x11.xic);
     XSelectInput(x11.display, x11.window, StructureNotifyMask | ExposureMask |
-        PropertyChangeMask | KeyPressMask);
+        PropertyChangeMask | VisibilityChangeMask | KeyPressMask);
   }
   else
     DEBUG_WARN("Failed to initialize X Input Context, typing will not work");
@@ -736,7 +741,7 @@ static bool x11Init(const LG_DSInitParams params)
     goto fail_window;
   }
 
-  if (x11.jitRender)
+  if (x11.presentClock)
     x11DoPresent(0);
 
   return true;
@@ -756,7 +761,7 @@ static void x11Startup(void)
 
 static void x11Shutdown(void)
 {
-  if (x11.jitRender)
+  if (x11.presentClock)
     lgSignalEvent(x11.frameEvent);
 }
 
@@ -764,7 +769,7 @@ static void x11Free(void)
 {
   lgJoinThread(x11.eventThread, NULL);
 
-  if (x11.jitRender)
+  if (x11.presentClock)
   {
     lgFreeEvent(x11.frameEvent);
     XFreePixmap(x11.display, x11.presentPixmap);
@@ -781,9 +786,113 @@ static void x11Free(void)
   if (x11.keysyms)
     XFree(x11.keysyms);
 
+  if (x11.screens)
+    XFree(x11.screens);
+
   XCloseDisplay(x11.display);
 }
 
+/* finds the CRTC showing the center of the window, the returned info must be
+ * freed with XRRFreeCrtcInfo */
+static XRRCrtcInfo * x11FindCrtc(XRRScreenResources * res, RRCrtc * id)
+{
+  XWindowAttributes attr;
+  if (!XGetWindowAttributes(x11.display, x11.window, &attr))
+    return NULL;
+
+  int cx, cy;
+  Window child;
+  XTranslateCoordinates(x11.display, x11.window, DefaultRootWindow(x11.display),
+      attr.width / 2, attr.height / 2, &cx, &cy, &child);
+
+  for(int i = 0; i < res->ncrtc; ++i)
+  {
+    XRRCrtcInfo * crtc = XRRGetCrtcInfo(x11.display, res, res->crtcs[i]);
+    if (!crtc)
+      continue;
+
+    if (crtc->mode == None || crtc->noutput == 0 ||
+        cx <  crtc->x || cx >= crtc->x + (int)crtc->width ||
+        cy <  crtc->y || cy >= crtc->y + (int)crtc->height)
+    {
+      XRRFreeCrtcInfo(crtc);
+      continue;
+    }
+
+    if (id)
+      *id = res->crtcs[i];
+    return crtc;
+  }
+
+  return NULL;
+}
+
+/* reports the refresh rate of the CRTC showing the window and if the output
+ * driving it is capable of variable refresh */
+static bool x11GetOutputInfo(int * refresh, bool * vrrCapable)
+{
+  XRRScreenResources * res = XRRGetScreenResourcesCurrent(x11.display,
+      DefaultRootWindow(x11.display));
+  if (!res)
+    return false;
+
+  XRRCrtcInfo * crtc = x11FindCrtc(res, NULL);
+  if (!crtc)
+  {
+    XRRFreeScreenResources(res);
+    return false;
+  }
+
+  for(int m = 0; m < res->nmode; ++m)
+  {
+    const XRRModeInfo * mode = res->modes + m;
+    if (mode->id != crtc->mode || !mode->hTotal || !mode->vTotal)
+      continue;
+
+    *refresh = (int)((double)mode->dotClock /
+        ((double)mode->hTotal * mode->vTotal) + 0.5);
+    break;
+  }
+
+  *vrrCapable = false;
+  const Atom vrrAtom = XInternAtom(x11.display, "vrr_capable", True);
+  if (vrrAtom != None)
+  {
+    Atom type;
+    int format;
+    unsigned long items, bytesAfter;
+    unsigned char * data = NULL;
+    if (XRRGetOutputProperty(x11.display, crtc->outputs[0], vrrAtom, 0, 1,
+          False, False, AnyPropertyType, &type, &format, &items, &bytesAfter,
+          &data) == Success && data)
+    {
+      if (items == 1 && format == 32)
+        *vrrCapable = *(long *)data != 0;
+      XFree(data);
+    }
+  }
+
+  XRRFreeCrtcInfo(crtc);
+  XRRFreeScreenResources(res);
+  return true;
+}
+
+static RRCrtc x11GetWindowCrtc(void)
+{
+  XRRScreenResources * res = XRRGetScreenResourcesCurrent(x11.display,
+      DefaultRootWindow(x11.display));
+  if (!res)
+    return None;
+
+  RRCrtc id = None;
+  XRRCrtcInfo * crtc = x11FindCrtc(res, &id);
+  if (crtc)
+    XRRFreeCrtcInfo(crtc);
+
+  XRRFreeScreenResources(res);
+  return id;
+}
+
 static bool x11GetProp(LG_DSProperty prop, void *ret)
 {
   switch (prop)
@@ -839,11 +948,38 @@ static bool x11GetProp(LG_DSProperty prop, void *ret)
       return true;
     }
 
+    case LG_DS_REFRESH_RATE:
+    {
+      int  refresh = 0;
+      bool vrr;
+      if (!x11GetOutputInfo(&refresh, &vrr) || refresh <= 0)
+        return false;
+
+      *(int*)ret = refresh;
+      return true;
+    }
+
+    case LG_DS_VRR_CAPABLE:
+    {
+      int  refresh;
+      bool vrr = false;
+      if (!x11GetOutputInfo(&refresh, &vrr))
+        return false;
+
+      *(bool*)ret = vrr;
+      return true;
+    }
+
     default:
       return true;
   }
 }
 
+static void x11UpdateVisibility(void)
+{
+  app_handleVisibilityEvent(!x11.obscured && !x11.unmapped && !x11.wmHidden);
+}
+
 static int x11EventThread(void * unused)
 {
   int epollfd = epoll_create1(0);
@@ -873,6 +1009,9 @@ static int x11EventThread(void * unused)
 
     if (!XPending(x11.display))
     {
+      // the queue has drained, send the motion it carried
+      app_endInputBatch();
+
       struct epoll_event events[1];
       int nfds = epoll_wait(epollfd, events, 1, 100);
       if (nfds == -1)
@@ -906,6 +1045,8 @@ static int x11EventThread(void * unused)
       case ConfigureNotify:
       {
         atomic_store(&x11.lastWMEvent, microtime());
+        atomic_store(&x11.presentOutputChanged, true);
+        x11.screensChanged = true;
 
         int x, y;
 
@@ -945,6 +1086,21 @@ static int x11EventThread(void * unused)
         break;
       }
 
+      /* a compositor redirects the window so it is never reported obscured,
+       * there the unmap on minimize and _NET_WM_STATE_HIDDEN cover it */
+      case VisibilityNotify:
+        x11.obscured = xe.xvisibility.state == VisibilityFullyObscured;
+        x11UpdateVisibility();
+        break;
+
+      case MapNotify:
+      case UnmapNotify:
+        if (xe.xany.window != x11.window)
+          break;
+        x11.unmapped = xe.type == UnmapNotify;
+        x11UpdateVisibility();
+        break;
+
       case GenericEvent:
       {
         XGenericEventCookie *cookie = (XGenericEventCookie*)&xe.xcookie;
@@ -987,6 +1143,7 @@ static int x11EventThread(void * unused)
 
           bool fullscreen = false;
           bool focused    = false;
+          bool hidden     = false;
           for(unsigned long i = 0; i < num; ++i)
           {
             Atom prop = ((Atom *)data)[i];
@@ -994,6 +1151,14 @@ static int x11EventThread(void * unused)
               fullscreen = true;
             else if (prop == x11atoms._NET_WM_STATE_FOCUSED)
               focused = true;
+            else if (prop == x11atoms._NET_WM_STATE_HIDDEN)
+              hidden = true;
+          }
+
+          if (x11.wmHidden != hidden)
+          {
+            x11.wmHidden = hidden;
+            x11UpdateVisibility();
           }
 
           if (x11.ewmhHasFocusEvent && x11.focused != focused)
@@ -1409,6 +1574,8 @@ static void x11XInputEvent(XGenericEventCookie *cookie)
       prev_axis[0] = axis[0];
       prev_axis[1] = axis[1];
 
+      // held until the event queue drains
+      app_beginInputBatch();
       app_handleMouseRelative(axis[0], axis[1], raw_axis[0], raw_axis[1]);
       return;
     }
@@ -1425,6 +1592,14 @@ static void x11XPresentEvent(XGenericEventCookie *cookie)
     {
       XPresentCompleteNotifyEvent * e = cookie->data;
       x11DoPresent(e->msc);
+
+      const uint64_t lastUst = atomic_load(&x11.presentUst);
+      const uint64_t lastMsc = atomic_load(&x11.presentMsc);
+      if (lastUst && e->msc > lastMsc && e->ust > lastUst &&
+          e->ust - lastUst < 1000000UL)
+        atomic_store(&x11.presentPeriod,
+            (e->ust - lastUst) * 1000 / (e->msc - lastMsc));
+
       atomic_store(&x11.presentMsc, e->msc);
       atomic_store(&x11.presentUst, e->ust);
       lgSignalEvent(x11.frameEvent);
@@ -1514,148 +1689,145 @@ static void x11GLSwapBuffers(void)
 }
 #endif
 
+/* The render phase controller delays each frame after the vblank so rendering
+ * finishes as late as possible, and so with the freshest guest frame, without
+ * missing the next vblank. The delay is increased slowly while frames are
+ * hitting every MSC and cut back on a miss, remembering where the miss
+ * happened so it only creeps back towards that ceiling. The ceiling itself is
+ * probed upwards periodically to follow load or thermal changes. */
+#define PHASE_SETTLE_FRAMES 60   // clean frames after a miss before increasing
+#define PHASE_PROBE_FRAMES  600  // clean frames between ceiling probes
+#define PHASE_MIN_DELAY     1000 // delays shorter than 1ms are unmaintainable
+
+static struct X11Phase * x11GetPhase(uint64_t ust)
+{
+  /* the window can move between outputs with different timings, so keep the
+   * state of each output to resume with when it comes back. Moves generate a
+   * stream of configure events so only look up the output every 250ms */
+  static uint64_t lastCheck = 0;
+  if (!x11.phase || (ust - lastCheck > 250000 &&
+        atomic_exchange(&x11.presentOutputChanged, false)))
+  {
+    lastCheck = ust;
+    const RRCrtc crtc = x11GetWindowCrtc();
+    struct X11Phase * oldest = &x11.phases[0];
+    for(int i = 0; i < X11_PHASE_OUTPUTS; ++i)
+    {
+      struct X11Phase * p = &x11.phases[i];
+      if (p->valid && p->crtc == crtc)
+      {
+        oldest = NULL;
+        x11.phase = p;
+        break;
+      }
+
+      if (!p->valid || p->lastUsed < oldest->lastUsed)
+        oldest = p;
+    }
+
+    if (oldest)
+    {
+      *oldest = (struct X11Phase){ .valid = true, .crtc = crtc };
+      x11.phase = oldest;
+    }
+  }
+
+  return x11.phase;
+}
+
+static bool x11GetVBlank(uint64_t * lastUs, uint64_t * periodNs)
+{
+  if (!x11.presentClock)
+    return false;
+
+  // the UST is CLOCK_MONOTONIC microseconds, the same clock as microtime()
+  const uint64_t ust    = atomic_load(&x11.presentUst);
+  const uint64_t period = atomic_load(&x11.presentPeriod);
+  if (!ust || !period)
+    return false;
+
+  *lastUs   = ust;
+  *periodNs = period;
+  return true;
+}
+
 static bool x11WaitFrame(void)
 {
   /* wait until we are woken up by the present event */
   lgWaitEvent(x11.frameEvent, TIMEOUT_INFINITE);
 
-#define WARMUP_TIME 3000000 //2s
-#define CALIBRATION_COUNT 400
   const uint64_t ust = atomic_load(&x11.presentUst);
   const uint64_t msc = atomic_load(&x11.presentMsc);
 
-  static bool warmup = true;
-  if (warmup)
-  {
-    static uint64_t expire = 0;
-    if (!expire)
-    {
-      DEBUG_INFO("Warming up...");
-      expire = ust + WARMUP_TIME;
-    }
-
-    if (ust < expire)
-      return false;
+  struct X11Phase * p = x11GetPhase(ust);
+  p->lastUsed = ust;
 
-    warmup = false;
-    DEBUG_INFO("Warmup done, doing calibration...");
+  if (!p->lastUst || msc <= p->lastMsc)
+  {
+    p->lastUst = ust;
+    p->lastMsc = msc;
+    return true;
   }
 
-  /* calibrate a delay to push our presentation time forward as far as
-   * possible without skipping frames */
-  static int      calibrate = 0;
-  static uint64_t lastts    = 0;
-  static uint64_t lastmsc   = 0;
-  static uint64_t delay     = 0;
+  const uint64_t deltaUst = ust - p->lastUst;
+  const uint64_t deltaMsc = msc - p->lastMsc;
+  p->lastUst = ust;
+  p->lastMsc = msc;
 
-  uint64_t deltamsc = 0;
-  if (lastts)
-  {
-    uint64_t deltats = ust - lastts;
-    deltamsc = msc - lastmsc;
+  // a long gap is a stall, not something the phase can account for
+  if (deltaUst > 1000000UL)
+    return true;
 
-    if (calibrate == 0)
+  const double period = (double)deltaUst / deltaMsc;
+  if (p->period == 0.0 || fabs(period - p->period) > p->period * 0.05)
+  {
+    // a refresh rate switch, keep the phase proportional to the new period
+    if (p->period != 0.0)
     {
-      if (!delay)
-        delay = deltats / 2;
-      else
-      {
-        /* increase the delay until we see a skip */
-        if (deltamsc < 2)
-          delay += 100;
-        else
-        {
-          delay -= 100;
-          ++calibrate;
-          deltamsc = 0;
-        }
-      }
+      DEBUG_INFO("Refresh period changed from %.0f to %.0f us",
+          p->period, period);
+      p->delay   *= period / p->period;
+      p->ceiling *= period / p->period;
     }
     else
-    {
-      if (calibrate < CALIBRATION_COUNT)
-      {
-        /* every skip we back off the delay */
-        if (deltamsc > 1)
-        {
-          /* prevent underflow */
-          if (delay - 100 < delay)
-          {
-            delay -= 100;
-            calibrate = 1;
-            deltamsc = 0;
-          }
-          else
-          {
-            /* if underflow, we are simply too slow, no delay */
-            delay = 0;
-            calibrate = CALIBRATION_COUNT;
-          }
-        }
+      p->delay = period / 2.0;
 
-        /* if we have finished, print out the delay */
-        if (++calibrate == CALIBRATION_COUNT)
-        {
-          /* delays shorter then 1ms are unmaintainable */
-          if (delay < 1000)
-          {
-            delay = 0;
-            DEBUG_INFO("Calibration done, no delay required");
-          }
-          else
-            DEBUG_INFO("Calibration done, delay = %lu us", delay);
-        }
-      }
-    }
+    p->period = period;
+    p->clean  = 0;
+    return true;
   }
+  p->period += (period - p->period) / 32.0;
 
-  lastts  = ust;
-  lastmsc = msc;
-
-  /* adjustments if we are still seeing odd skips */
+  // skips while the window manager is busy are not our doing
   const uint64_t lastWMEvent = atomic_load(&x11.lastWMEvent);
-  const uint64_t eventDelta = ust > lastWMEvent ? ust - lastWMEvent : 0;
-
-  static int      skipCount = 0;
-  static uint64_t lastSkipTime = 0;
-
-  if (skipCount > 0 && ust - lastSkipTime > 1000000UL)
-    skipCount = 0;
+  const bool wmBusy = ust < lastWMEvent + 1000000UL;
 
-  if (delay > 0 && deltamsc > 1 && eventDelta > 1000000UL)
+  if (deltaMsc > 1 && !wmBusy)
+  {
+    p->ceiling = p->delay;
+    p->delay   = max(p->delay - p->period * 0.1, 0.0);
+    p->clean   = 0;
+  }
+  else if (++p->clean >= PHASE_SETTLE_FRAMES)
   {
-    /* only adjust if the last skip was less then 1s ago */
-    const bool flag = ust - lastSkipTime < 1000000UL;
-    lastSkipTime = ust;
+    const double limit = p->period * 0.9;
+    if (p->clean % PHASE_PROBE_FRAMES == 0)
+      p->ceiling = min(p->ceiling + p->period * 0.01, limit);
 
-    if (flag && ++skipCount > 10)
-    {
-      if (delay - 500 < delay)
-      {
-        delay -= 500;
-        DEBUG_INFO("Excessing skipping detected, reduced calibration delay to %lu us", delay);
-        skipCount = 0;
-      }
-      else
-      {
-        delay = 0;
-        DEBUG_WARN("Excessive skipping detected, calibration delay disabled");
-      }
-    }
+    const double target = p->ceiling > 0.0 ? p->ceiling * 0.95 : limit;
+    if (p->delay < target)
+      p->delay = min(p->delay + p->period * 0.005, target);
   }
 
-  if (delay)
+  if (p->delay >= PHASE_MIN_DELAY)
   {
-    struct timespec ts = { .tv_nsec = delay * 1000 };
+    struct timespec ts = { .tv_nsec = (long)p->delay * 1000 };
     while(nanosleep(&ts, &ts)) {};
   }
 
-  /* force rendering until we have finished calibration so we can take into
-   * account how long it takes for the scene to render */
-  if (calibrate < CALIBRATION_COUNT)
-    return true;
-
-  return false;
+  /* force rendering while settling so the render cost is part of what the
+   * controller measures */
+  return p->clean < PHASE_SETTLE_FRAMES;
 }
 
 static void x11StopWaitFrame(void)
@@ -1683,7 +1855,8 @@ static void x11GuestPointerUpdated(double x, double y, double localX, double loc
       0, 0, 0, 0,
       localX, localY);
 
-  XSync(x11.display, False);
+  // requests are processed in order, a round trip gains nothing here
+  XFlush(x11.display);
 }
 
 static void x11SetPointer(LG_DSPointer pointer)
@@ -1848,7 +2021,7 @@ static void x11WarpPointer(int x, int y, bool exiting)
       0, 0, 0, 0,
       x, y);
 
-  XSync(x11.display, False);
+  XFlush(x11.display);
 }
 
 static void x11RealignPointer(void)
@@ -1858,23 +2031,28 @@ static void x11RealignPointer(void)
 
 static bool x11IsValidPointerPos(int x, int y)
 {
-  int screens;
-  XineramaScreenInfo *xinerama = XineramaQueryScreens(x11.display, &screens);
+  /* XineramaQueryScreens is a round trip, this is called as the cursor leaves
+   * the guest so refresh the layout only once it may have changed */
+  const uint64_t now = microtime();
+  if (!x11.screens || x11.screensChanged || now - x11.screensTime > 1000000)
+  {
+    if (x11.screens)
+      XFree(x11.screens);
+    x11.screens        = XineramaQueryScreens(x11.display, &x11.screenCount);
+    x11.screensTime    = now;
+    x11.screensChanged = false;
+  }
 
+  XineramaScreenInfo * xinerama = x11.screens;
   if(!xinerama)
     return true;
 
-  bool ret = false;
-  for(int i = 0; i < screens; ++i)
+  for(int i = 0; i < x11.screenCount; ++i)
     if (x >= xinerama[i].x_org && x < xinerama[i].x_org + xinerama[i].width &&
         y >= xinerama[i].y_org && y < xinerama[i].y_org + xinerama[i].height)
-    {
-      ret = true;
-      break;
-    }
+      return true;
 
-  XFree(xinerama);
-  return ret;
+  return false;
 }
 
 static void x11RequestActivation(void)
@@ -1979,6 +2157,7 @@ struct LG_DisplayServerOps LGDS_X11 =
 #endif
   .waitFrame           = x11WaitFrame,
   .stopWaitFrame       = x11StopWaitFrame,
+  .getVBlank           = x11GetVBlank,
   .guestPointerUpdated = x11GuestPointerUpdated,
   .setPointer          = x11SetPointer,
   .grabPointer         = x11GrabPointer,
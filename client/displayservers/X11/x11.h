@@ -27,6 +27,8 @@
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/Xfixes.h>
+#include <X11/extensions/Xrandr.h>
+#include <X11/extensions/Xinerama.h>
 
 #include <GL/glx.h>
 
@@ -48,6 +50,21 @@ enum Modifiers
 
 #define MOD_COUNT (MOD_SUPER_RIGHT + 1)
 
+// the number of outputs the render phase is remembered for
+#define X11_PHASE_OUTPUTS 4
+
+struct X11Phase
+{
+  bool     valid;
+  RRCrtc   crtc;
+  uint64_t lastUsed;
+  uint64_t lastUst, lastMsc;
+  double   period;  // smoothed refresh period in microseconds
+  double   delay;   // current delay after the vblank in microseconds
+  double   ceiling; // the delay the last miss happened at, zero if none
+  unsigned clean;   // frames since the last miss or reset
+};
+
 struct X11DSState
 {
   Display *     display;
@@ -67,12 +84,22 @@ struct X11DSState
   bool              invalidateAll;
 
   int               xpresentOp;
-  bool              jitRender;
+  bool              presentClock;
   _Atomic(uint64_t) presentMsc, presentUst;
+  _Atomic(uint64_t) presentPeriod; // ns, from the last two completions
   uint32_t          presentSerial;
   Pixmap            presentPixmap;
   XserverRegion     presentRegion;
   LGEvent *         frameEvent;
+  atomic_bool       presentOutputChanged;
+
+  // cached Xinerama layout, only used from the event thread
+  XineramaScreenInfo * screens;
+  int                  screenCount;
+  uint64_t             screensTime;
+  bool                 screensChanged;
+  struct X11Phase   phases[X11_PHASE_OUTPUTS];
+  struct X11Phase * phase;
 
   LGThread * eventThread;
 
@@ -88,6 +115,11 @@ struct X11DSState
   bool focused;
   bool fullscreen;
 
+  // any of these keeps the frames from being read
+  bool obscured;
+  bool unmapped;
+  bool wmHidden;
+
   struct Rect   rect;
   struct Border border;
 
@@ -52,6 +52,13 @@ void app_invalidateWindow(bool full);
 void app_handleMouseRelative(double normx, double normy,
     double rawx, double rawy);
 
+/**
+ * Relative motion between these calls is sent to the guest as one message.
+ * Display servers call these around each group of input events they dispatch.
+ */
+void app_beginInputBatch(void);
+void app_endInputBatch(void);
+
 void app_handleMouseBasic(void);
 void app_resyncMouseBasic(void);
 
@@ -65,6 +72,7 @@ void app_handleKeyboardModifiers(bool ctrl, bool shift, bool alt, bool super);
 void app_handleKeyboardLEDs(bool numLock, bool capsLock, bool scrollLock);
 void app_handleEnterEvent(bool entered);
 void app_handleFocusEvent(bool focused);
+void app_handleVisibilityEvent(bool visible);
 void app_handleCloseEvent(void);
 void app_handleRenderEvent(const uint64_t timeUs);
 
@@ -118,6 +126,13 @@ GraphHandle app_registerGraph(const char * name, RingBuffer buffer,
 void app_unregisterGraph(GraphHandle handle);
 void app_invalidateGraph(GraphHandle handle);
 
+/**
+ * the serial of the frame the current render pass is drawing, used by the
+ * display server to attribute presentation feedback to a frame
+ */
+uint32_t app_getFrameSerial(void);
+void app_framePresented(uint32_t serial, uint64_t presentUs);
+
 void app_overlayConfigRegister(const char * title,
     void (*callback)(void * udata, int * id), void * udata);
 
@@ -26,6 +26,7 @@
 #include <EGL/eglext.h>
 #undef GL_KHR_debug
 #include <GLES3/gl3.h>
+#include <GLES3/gl31.h>
 #include <GLES2/gl2ext.h>
 
 struct EGLDynProcs
@@ -38,8 +39,20 @@ struct EGLDynProcs
   PFNGLDEBUGMESSAGECALLBACKKHRPROC    glDebugMessageCallback;
   PFNGLDEBUGMESSAGECALLBACKKHRPROC    glDebugMessageCallbackKHR;
   PFNGLBUFFERSTORAGEEXTPROC           glBufferStorageEXT;
+  PFNGLDISPATCHCOMPUTEPROC            glDispatchCompute;
+  PFNGLBINDIMAGETEXTUREPROC           glBindImageTexture;
+  PFNGLMEMORYBARRIERPROC              glMemoryBarrier;
+  PFNGLCOPYIMAGESUBDATAEXTPROC        glCopyImageSubData;
+  PFNGLMAXSHADERCOMPILERTHREADSKHRPROC glMaxShaderCompilerThreadsKHR;
+  PFNGLQUERYCOUNTEREXTPROC            glQueryCounterEXT;
+  PFNGLGETQUERYOBJECTUI64VEXTPROC     glGetQueryObjectui64vEXT;
   PFNEGLCREATEIMAGEPROC               eglCreateImage;
   PFNEGLDESTROYIMAGEPROC              eglDestroyImage;
+  PFNEGLEXPORTDMABUFIMAGEQUERYMESAPROC eglExportDMABUFImageQueryMESA;
+  PFNEGLEXPORTDMABUFIMAGEMESAPROC     eglExportDMABUFImageMESA;
+  PFNEGLCREATESYNCKHRPROC             eglCreateSyncKHR;
+  PFNEGLDESTROYSYNCKHRPROC            eglDestroySyncKHR;
+  PFNEGLCLIENTWAITSYNCKHRPROC         eglClientWaitSyncKHR;
 };
 
 extern struct EGLDynProcs g_egl_dynProcs;
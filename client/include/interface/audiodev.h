@@ -64,6 +64,12 @@ struct LG_AudioDevOps
 
     /* return the current total playback latency in microseconds */
     uint64_t (*latency)(void);
+
+    /* [optional] called for every period with the resampling ratio needed to
+     * correct the clock drift (output rate / input rate). Return true if the
+     * device applies it with its own resampler, in which case the frames are
+     * passed through without being resampled */
+    bool (*rateMatch)(double ratio);
   }
   playback;
 
@@ -53,6 +53,20 @@ typedef enum LG_DSProperty
    * return data type: bool
    */
   LG_DS_WARP_SUPPORT,
+
+  /**
+   * returns the refresh rate in Hz of the output showing the window
+   * if not implemented LG assumes it is unknown
+   * return data type: int
+   */
+  LG_DS_REFRESH_RATE,
+
+  /**
+   * returns if the output showing the window supports variable refresh
+   * if not implemented LG assumes that it does not
+   * return data type: bool
+   */
+  LG_DS_VRR_CAPABLE,
 }
 LG_DSProperty;
 
@@ -97,6 +111,9 @@ typedef struct LG_DSInitParams
   // x11 needs to know if this is in use so we can decide to setup for
   // presentation times
   bool jitRender;
+
+  // getVBlank will be used, x11 also needs the presentation times for this
+  bool vblankTimes;
 }
 LG_DSInitParams;
 
@@ -169,6 +186,10 @@ struct LG_DisplayServerOps
   /* This is used to interrupt waitFrame. */
   void (*stopWaitFrame)(void);
 
+  /* optional, returns the microtime() of the last vblank of the output the
+   * window is on and the refresh period in nanoseconds */
+  bool (*getVBlank)(uint64_t * lastUs, uint64_t * periodNs);
+
   /* dm specific cursor implementations */
   void (*guestPointerUpdated)(double x, double y, double localX, double localY);
   void (*setPointer)(LG_DSPointer pointer);
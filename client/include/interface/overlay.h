@@ -22,6 +22,7 @@
 #define _H_I_OVERLAY_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "common/types.h"
 
@@ -74,6 +75,14 @@ struct LG_OverlayOps
    */
   bool (*tick)(void * udata, unsigned long long tickCount);
 
+  /* return a value that changes whenever the output of `render` would change
+   * without the window being invalidated, this allows the last ImGui frame to
+   * be reused while nothing has changed.
+   *
+   * optional, if omitted the overlay is rebuilt every frame it draws anything
+   */
+  uint64_t (*generation)(void * udata);
+
   /* TODO: add load/save settings capabillity */
 };
 
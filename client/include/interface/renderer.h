@@ -44,9 +44,25 @@
    (x)->spiceDrawBitmap && \
    (x)->spiceShow)
 
+// the most KVMFR sources one client shows, the first is the primary
+#define LG_MAX_SOURCES 4
+
+typedef enum LG_SourceLayout
+{
+  LG_SOURCES_PIP, // the extra sources are drawn over a corner of the primary
+  LG_SOURCES_TILE // the sources share the window as a grid
+}
+LG_SourceLayout;
+
 typedef struct LG_RendererParams
 {
-  bool quickSplash;
+  bool            quickSplash;
+  unsigned int    sources;      // the number of sources, including the primary
+  LG_SourceLayout sourceLayout;
+
+  // the primary IVSHMEM mapping the frames are read from
+  void          * frameMemory;
+  size_t          frameMemorySize;
 }
 LG_RendererParams;
 
@@ -76,10 +92,12 @@ typedef struct LG_RendererFormat
   unsigned int      screenHeight; // actual height of the host
   unsigned int      frameWidth;   // width of frame transmitted
   unsigned int      frameHeight;  // height of frame transmitted
-  unsigned int      stride;  // scanline width (zero if compresed)
-  unsigned int      pitch;   // scanline bytes (or compressed size)
-  unsigned int      bpp;     // bits per pixel (zero if compressed)
+  unsigned int      stride;  // scanline width
+  unsigned int      pitch;   // scanline bytes
+  unsigned int      bpp;     // bits per pixel
   LG_RendererRotate rotate;  // guest rotation
+  bool              compressed; // frame data is LZ4 compressed
+  bool              hostScaled; // lowered by the host to keep up
 }
 LG_RendererFormat;
 
@@ -93,6 +111,35 @@ typedef struct LG_RendererRect
 }
 LG_RendererRect;
 
+/* the area of the window given to a source, the source is fit inside it
+ * keeping its aspect. The client core and the renderer must agree on this as
+ * the core maps the input into the primary's area */
+static inline LG_RendererRect lgSourceCell(LG_SourceLayout layout,
+    unsigned int sources, unsigned int index, int width, int height)
+{
+  if (layout == LG_SOURCES_PIP)
+  {
+    if (index == 0)
+      return (LG_RendererRect){ true, 0, 0, width, height };
+
+    const int margin = 8;
+    const int w      = width  / 4;
+    const int h      = height / 4;
+    return (LG_RendererRect){ true,
+      width - w - margin, margin + (index - 1) * (h + margin), w, h };
+  }
+
+  unsigned int cols = 1;
+  while (cols * cols < sources)
+    ++cols;
+  const unsigned int rows = (sources + cols - 1) / cols;
+
+  const int w = width  / cols;
+  const int h = height / rows;
+  return (LG_RendererRect){ true,
+    (index % cols) * w, (index / cols) * h, w, h };
+}
+
 typedef enum LG_RendererCursor
 {
   LG_CURSOR_COLOR       ,
@@ -139,10 +186,18 @@ typedef struct LG_RendererOps
       const double scale, const LG_RendererRect destRect,
       LG_RendererRotate rotate);
 
-  /* called when the mouse shape has changed
+  /* called when the mouse shape has changed, id is the host's content hash of
+   * the shape or zero if it is not known
    * Context: cursorThread */
   bool (*onMouseShape)(LG_Renderer * renderer, const LG_RendererCursor cursor,
-      const int width, const int height, const int pitch, const uint8_t * data);
+      const int width, const int height, const int pitch, const uint8_t * data,
+      const uint32_t id);
+
+  /* optional, called before onMouseShape when the shape has an id. Returns
+   * true if the renderer still holds the shape and has switched to it, in
+   * which case onMouseShape is not called
+   * Context: cursorThread */
+  bool (*onMouseShapeCached)(LG_Renderer * renderer, const uint32_t id);
 
   /* called when the mouse has moved or changed visibillity
    * Context: cursorThread */
@@ -154,10 +209,30 @@ typedef struct LG_RendererOps
   bool (*onFrameFormat)(LG_Renderer * renderer,
       const LG_RendererFormat format);
 
-  /* called when there is a new frame
+  /* called when there is a new frame, damageMap is NULL unless the host sent
+   * tile damage the rects only approximate
    * Context: frameThread */
   bool (*onFrame)(LG_Renderer * renderer, const FrameBuffer * frame, int dmaFD,
-      const FrameDamageRect * damage, int damageCount);
+      const FrameDamageRect * damage, int damageCount,
+      const FrameDamageMap * damageMap);
+
+  /* optional, the frame format of an extra source has changed, source is from
+   * 1 to LG_RendererParams.sources - 1
+   * Context: sourceThread */
+  bool (*onSourceFormat)(LG_Renderer * renderer, unsigned int source,
+      const LG_RendererFormat format);
+
+  /* optional, there is a new frame from an extra source, these are always
+   * uploaded by the CPU
+   * Context: sourceThread */
+  bool (*onSourceFrame)(LG_Renderer * renderer, unsigned int source,
+      const FrameBuffer * frame, const FrameDamageRect * damage,
+      int damageCount);
+
+  /* optional, the thread of an extra source is exiting and it is no longer to
+   * be shown
+   * Context: sourceThread */
+  void (*onSourceStop)(LG_Renderer * renderer, unsigned int source);
 
   /* called when the rederer is to startup
    * Context: renderThread */
@@ -193,6 +268,11 @@ typedef struct LG_RendererOps
 
   /* show the spice display */
   void (*spiceShow)(LG_Renderer * renderer, bool show);
+
+  /* skip the costly parts of the render while the client saves power
+   * this is optional
+   * Context: renderThread */
+  void (*setPowerSave)(LG_Renderer * renderer, bool enable);
 }
 LG_RendererOps;
 
@@ -22,6 +22,7 @@
 #define _H_LG_OVERLAY_UTILS_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "common/types.h"
 
@@ -46,4 +47,8 @@ bool overlayLoadSVG(const char * data, unsigned int size, OverlayImage * image,
 
 void overlayFreeImage(OverlayImage * image);
 
+/* generation for overlays that only change through app_invalidateWindow or
+ * app_invalidateOverlay, such as from their tick */
+uint64_t overlayStaticGeneration(void * udata);
+
 #endif
@@ -0,0 +1,91 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_VIDEO_RECORD_
+#define _H_LG_VIDEO_RECORD_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Encodes the rendered desktop to a video file with VA-API. The renderer
+ * converts each new frame to NV12 into one of a few surfaces it exports as
+ * DMA-BUFs, these are imported by the encoder once and encoded on a thread of
+ * its own along with the guest's audio. If the encoder falls behind frames are
+ * dropped rather than stalling the renderer */
+
+#define VIDEO_RECORD_SURFACES 3
+
+typedef struct VideoRecordSurface
+{
+  // the R8 luma and GR88 chroma planes, each a DMA-BUF of its own
+  int      fd      [2];
+  uint32_t fourcc  [2];
+  uint32_t offset  [2];
+  uint32_t pitch   [2];
+  uint64_t modifier[2];
+}
+VideoRecordSurface;
+
+#if ENABLE_VIDEO_RECORD
+
+void videoRecord_earlyInit(void);
+bool videoRecord_init(void);
+void videoRecord_free(void);
+
+// true if frames are wanted, the size is fixed by the first frame
+bool videoRecord_active(void);
+bool videoRecord_filtered(void);
+
+/* gives the encoder the surfaces of width x height, the fds are duplicated and
+ * remain owned by the caller. Must be called once before the first acquire */
+bool videoRecord_setSurfaces(unsigned int width, unsigned int height,
+    const VideoRecordSurface surfaces[VIDEO_RECORD_SURFACES]);
+
+// returns a surface that is free for the renderer to draw, or -1
+int  videoRecord_acquire(void);
+
+/* queues the surface for encoding, wait is called from the encoder thread
+ * before it is read to wait for the renderer's GPU commands to complete */
+void videoRecord_submit(int surface, void (*wait)(void * opaque),
+    void * opaque);
+
+// the guest's playback format and its interleaved S16 samples
+void videoRecord_audioStart(int channels, int sampleRate);
+void videoRecord_audio(const int16_t * samples, int count);
+
+#else
+
+static inline void videoRecord_earlyInit(void) {}
+static inline bool videoRecord_init(void) { return true; }
+static inline void videoRecord_free(void) {}
+static inline bool videoRecord_active(void) { return false; }
+static inline bool videoRecord_filtered(void) { return false; }
+static inline bool videoRecord_setSurfaces(unsigned int width,
+    unsigned int height,
+    const VideoRecordSurface surfaces[VIDEO_RECORD_SURFACES]) { return false; }
+static inline int  videoRecord_acquire(void) { return -1; }
+static inline void videoRecord_submit(int surface, void (*wait)(void * opaque),
+    void * opaque) {}
+static inline void videoRecord_audioStart(int channels, int sampleRate) {}
+static inline void videoRecord_audio(const int16_t * samples, int count) {}
+
+#endif
+
+#endif
@@ -0,0 +1,184 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "compute.h"
+
+#include <stdlib.h>
+
+#include <GLES3/gl31.h>
+
+#include "common/debug.h"
+#include "egl_dynprocs.h"
+
+struct EGL_ComputeImage
+{
+  GLuint       tex;
+  GLenum       format;
+  unsigned int width, height;
+};
+
+static bool l_computeSupported = false;
+
+void egl_computeInit(bool enable)
+{
+  l_computeSupported = enable &&
+    g_egl_dynProcs.glDispatchCompute  &&
+    g_egl_dynProcs.glBindImageTexture &&
+    g_egl_dynProcs.glMemoryBarrier;
+}
+
+bool egl_computeSupported(void)
+{
+  return l_computeSupported;
+}
+
+bool egl_computeImageInit(EGL_ComputeImage ** image)
+{
+  EGL_ComputeImage * this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("Failed to allocate ram");
+    return false;
+  }
+
+  *image = this;
+  return true;
+}
+
+void egl_computeImageFree(EGL_ComputeImage ** image)
+{
+  EGL_ComputeImage * this = *image;
+  if (!this)
+    return;
+
+  if (this->tex)
+    glDeleteTextures(1, &this->tex);
+
+  free(this);
+  *image = NULL;
+}
+
+/* image load store only supports a few formats, the 8-bit formats use rgba8
+ * and everything deeper is widened to rgba16f */
+static GLenum computeFormat(enum EGL_PixelFormat pixFmt)
+{
+  switch(pixFmt)
+  {
+    case EGL_PF_RGBA:
+    case EGL_PF_BGRA:
+      return GL_RGBA8;
+
+    default:
+      return GL_RGBA16F;
+  }
+}
+
+const char * egl_computeImageDefines(enum EGL_PixelFormat pixFmt)
+{
+  return computeFormat(pixFmt) == GL_RGBA8 ?
+    "#define OUT_FORMAT rgba8\n" :
+    "#define OUT_FORMAT rgba16f\n";
+}
+
+bool egl_computeImageSetup(EGL_ComputeImage * this,
+    enum EGL_PixelFormat pixFmt, unsigned int width, unsigned int height)
+{
+  const GLenum format = computeFormat(pixFmt);
+  if (this->tex && this->format == format &&
+      this->width == width && this->height == height)
+    return true;
+
+  // image textures must be immutable so it has to be recreated
+  if (this->tex)
+    glDeleteTextures(1, &this->tex);
+
+  glGenTextures(1, &this->tex);
+  glBindTexture(GL_TEXTURE_2D, this->tex);
+  glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  const GLenum error = glGetError();
+  if (error != GL_NO_ERROR)
+  {
+    DEBUG_ERROR("Failed to allocate the compute image: 0x%x", error);
+    glDeleteTextures(1, &this->tex);
+    this->tex = 0;
+    return false;
+  }
+
+  this->format = format;
+  this->width  = width;
+  this->height = height;
+  return true;
+}
+
+GLuint egl_computeImageRun(EGL_ComputeImage * this, EGL_Shader * shader,
+    GLuint texture, GLuint sampler, const EGL_FilterRects * rects)
+{
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glBindSampler(0, sampler);
+
+  egl_shaderUse(shader);
+  g_egl_dynProcs.glBindImageTexture(0, this->tex, 0, GL_FALSE, 0,
+      GL_WRITE_ONLY, this->format);
+
+  const GLint tileOffset = egl_shaderGetUniform(shader, "uTileOffset");
+  const struct DamageRects * damage = rects->damage;
+  if (!damage || damage->count < 0)
+  {
+    glUniform2i(tileOffset, 0, 0);
+    g_egl_dynProcs.glDispatchCompute(
+        (this->width  + EGL_COMPUTE_TILE - 1) / EGL_COMPUTE_TILE,
+        (this->height + EGL_COMPUTE_TILE - 1) / EGL_COMPUTE_TILE,
+        1);
+  }
+  else
+  {
+    // map each desktop space rect onto the image and round out to whole tiles
+    for (int i = 0; i < damage->count; ++i)
+    {
+      const FrameDamageRect * r = damage->rects + i;
+      const uint64_t x1 = (uint64_t)(r->x + r->width ) * this->width;
+      const uint64_t y1 = (uint64_t)(r->y + r->height) * this->height;
+
+      const unsigned int tx0 = (uint64_t)r->x * this->width  / rects->width  /
+        EGL_COMPUTE_TILE;
+      const unsigned int ty0 = (uint64_t)r->y * this->height / rects->height /
+        EGL_COMPUTE_TILE;
+      const unsigned int tx1 = ((x1 + rects->width  - 1) / rects->width  +
+        EGL_COMPUTE_TILE - 1) / EGL_COMPUTE_TILE;
+      const unsigned int ty1 = ((y1 + rects->height - 1) / rects->height +
+        EGL_COMPUTE_TILE - 1) / EGL_COMPUTE_TILE;
+
+      if (tx1 <= tx0 || ty1 <= ty0)
+        continue;
+
+      glUniform2i(tileOffset, tx0, ty0);
+      g_egl_dynProcs.glDispatchCompute(tx1 - tx0, ty1 - ty0, 1);
+    }
+  }
+
+  // the next stage samples the result
+  g_egl_dynProcs.glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+  return this->tex;
+}
@@ -0,0 +1,52 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "egltypes.h"
+#include "shader.h"
+#include "filter.h"
+
+// must match TILE_SIZE in the compute shaders
+#define EGL_COMPUTE_TILE 16
+
+/* called once the context is current to record if compute filters can be
+ * used, requires GLES 3.1 */
+void egl_computeInit(bool enable);
+bool egl_computeSupported(void);
+
+typedef struct EGL_ComputeImage EGL_ComputeImage;
+
+bool egl_computeImageInit(EGL_ComputeImage ** image);
+void egl_computeImageFree(EGL_ComputeImage ** image);
+
+bool egl_computeImageSetup(EGL_ComputeImage * this,
+    enum EGL_PixelFormat pixFmt, unsigned int width, unsigned int height);
+
+/* the defines to compile a compute shader with so that its output image
+ * format matches the image */
+const char * egl_computeImageDefines(enum EGL_PixelFormat pixFmt);
+
+/* runs the shader over the tiles of the image covered by the damaged area of
+ * rects reading from texture on unit zero and returns the image texture */
+GLuint egl_computeImageRun(EGL_ComputeImage * this, EGL_Shader * shader,
+    GLuint texture, GLuint sampler, const EGL_FilterRects * rects);
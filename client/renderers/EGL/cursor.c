@@ -20,6 +20,7 @@
 
 #include "cursor.h"
 #include "common/debug.h"
+#include "common/array.h"
 #include "common/locking.h"
 #include "common/option.h"
 
@@ -37,14 +38,18 @@
 #include "cursor_rgb.frag.h"
 #include "cursor_mono.frag.h"
 
+// the number of uploaded shapes kept for reuse by their host id
+#define CURSOR_CACHE_LEN 8
+
 struct CursorTex
 {
-  struct EGL_Texture * texture;
   struct EGL_Shader  * shader;
   GLuint uMousePos;
   GLuint uScale;
   GLuint uRotate;
   GLuint uCBMode;
+  GLuint uMode;
+  GLuint uShape;
 };
 
 struct CursorPos
@@ -57,6 +62,19 @@ struct CursorSize
   float w, h;
 };
 
+struct CursorShape
+{
+  uint32_t             id;       // the host's shape id, zero if not cached
+  uint64_t             lastUsed;
+  LG_RendererCursor    type;
+  int                  width;
+  int                  height;   // as given, mono shapes are double height
+
+  /* the shape as the host sent it, the masks are decoded by the shaders. Mono
+   * shapes are packed four bytes to each RGBA8 texel */
+  struct EGL_Texture * tex;
+};
+
 struct EGL_Cursor
 {
   LG_Lock           lock;
@@ -68,10 +86,25 @@ struct EGL_Cursor
   size_t            dataSize;
   bool              update;
 
+  // the shapes are selected by the cursor thread and uploaded by the render
+  struct CursorShape shapes[CURSOR_CACHE_LEN];
+  uint64_t           useCount;
+  int                current;    // the shape to show, set under the lock
+  int                active;     // the shape being shown, render thread only
+  bool               upload;     // data holds a shape for uploadSlot
+  int                uploadSlot;
+
   // cursor state
   bool              visible;
   LG_RendererRotate rotate;
   int               cbMode;
+  uint64_t          serial;     // bumped when the shown shape changes
+
+  // what egl_cursorPrepare decided to draw, render thread only
+  struct CursorState state;
+  struct CursorPos   drawPos;
+  struct CursorSize  drawSize;
+  float              drawScale;
 
   _Atomic(struct CursorPos)  pos;
   _Atomic(struct CursorPos)  hs;
@@ -87,12 +120,6 @@ static bool cursorTexInit(struct CursorTex * t,
     const char * vertex_code  , size_t vertex_size,
     const char * fragment_code, size_t fragment_size)
 {
-  if (!egl_textureInit(&t->texture, NULL, EGL_TEXTYPE_BUFFER))
-  {
-    DEBUG_ERROR("Failed to initialize the cursor texture");
-    return false;
-  }
-
   if (!egl_shaderInit(&t->shader))
   {
     DEBUG_ERROR("Failed to initialize the cursor shader");
@@ -110,26 +137,47 @@ static bool cursorTexInit(struct CursorTex * t,
   t->uScale    = egl_shaderGetUniform(t->shader, "scale"  );
   t->uRotate   = egl_shaderGetUniform(t->shader, "rotate" );
   t->uCBMode   = egl_shaderGetUniform(t->shader, "cbMode" );
+  t->uMode     = egl_shaderGetUniform(t->shader, "mode"   );
+  t->uShape    = egl_shaderGetUniform(t->shader, "shape"  );
 
   return true;
 }
 
+// the shape types as cursor_decode.h knows them
+static int shaderMode(LG_RendererCursor type)
+{
+  switch(type)
+  {
+    case LG_CURSOR_MASKED_COLOR: return 1;
+    case LG_CURSOR_MONOCHROME  : return 2;
+    default                    : return 0;
+  }
+}
+
 static inline void setCursorTexUniforms(EGL_Cursor * cursor,
-    struct CursorTex * t, bool mono, float x, float y,
+    struct CursorTex * t, const struct CursorShape * shape, float x, float y,
     float w, float h, float scale)
 {
+  const bool mono = shape->type == LG_CURSOR_MONOCHROME;
   glUniform4f(t->uMousePos, x, y, w, mono ? h / 2 : h);
   glUniform1f(t->uScale   , scale);
   glUniform1i(t->uRotate  , cursor->rotate);
   glUniform1i(t->uCBMode  , cursor->cbMode);
+  glUniform1i(t->uMode    , shaderMode(shape->type));
+  glUniform2i(t->uShape   , shape->width,
+      mono ? shape->height / 2 : shape->height);
 }
 
 static void cursorTexFree(struct CursorTex * t)
 {
-  egl_textureFree(&t->texture);
-  egl_shaderFree (&t->shader );
+  egl_shaderFree(&t->shader);
 };
 
+static void cursorCBModeChanged(struct Option * opt, void * opaque)
+{
+  ((EGL_Cursor *)opaque)->cbMode = option_int(opt);
+}
+
 bool egl_cursorInit(EGL_Cursor ** cursor)
 {
   *cursor = malloc(sizeof(**cursor));
@@ -152,6 +200,16 @@ bool egl_cursorInit(EGL_Cursor ** cursor)
       b_shader_cursor_mono_frag, b_shader_cursor_mono_frag_size))
     return false;
 
+  for (int i = 0; i < CURSOR_CACHE_LEN; ++i)
+  {
+    struct CursorShape * shape = (*cursor)->shapes + i;
+    if (!egl_textureInit(&shape->tex, NULL, EGL_TEXTYPE_BUFFER))
+    {
+      DEBUG_ERROR("Failed to initialize the cursor texture");
+      return false;
+    }
+  }
+
   if (!egl_modelInit(&(*cursor)->model))
   {
     DEBUG_ERROR("Failed to initialize the cursor model");
@@ -161,6 +219,7 @@ bool egl_cursorInit(EGL_Cursor ** cursor)
   egl_modelSetDefault((*cursor)->model, true);
 
   (*cursor)->cbMode = option_get_int("egl", "cbMode");
+  option_watch(option_get("egl", "cbMode"), cursorCBModeChanged, *cursor);
 
   struct CursorPos  pos  = { .x = 0, .y = 0 };
   struct CursorPos  hs   = { .x = 0, .y = 0 };
@@ -178,29 +237,73 @@ void egl_cursorFree(EGL_Cursor ** cursor)
   if (!*cursor)
     return;
 
+  option_unwatch(option_get("egl", "cbMode"), cursorCBModeChanged, *cursor);
+
   LG_LOCK_FREE((*cursor)->lock);
   if ((*cursor)->data)
     free((*cursor)->data);
 
   cursorTexFree(&(*cursor)->norm);
   cursorTexFree(&(*cursor)->mono);
+  for (int i = 0; i < CURSOR_CACHE_LEN; ++i)
+    egl_textureFree(&(*cursor)->shapes[i].tex);
   egl_modelFree(&(*cursor)->model);
 
   free(*cursor);
   *cursor = NULL;
 }
 
+static int findShape(EGL_Cursor * cursor, const uint32_t id)
+{
+  if (!id)
+    return -1;
+
+  for (int i = 0; i < CURSOR_CACHE_LEN; ++i)
+    if (cursor->shapes[i].id == id)
+      return i;
+
+  return -1;
+}
+
 bool egl_cursorSetShape(EGL_Cursor * cursor, const LG_RendererCursor type,
-    const int width, const int height, const int stride, const uint8_t * data)
+    const int width, const int height, const int stride, const uint8_t * data,
+    const uint32_t id)
 {
   LG_LOCK(cursor->lock);
 
+  // reuse the slot holding this shape, or the least recently used one
+  int slot = findShape(cursor, id);
+  if (slot < 0)
+  {
+    slot = 0;
+    for (int i = 1; i < CURSOR_CACHE_LEN; ++i)
+      if (cursor->shapes[i].lastUsed < cursor->shapes[slot].lastUsed)
+        slot = i;
+  }
+
+  // a shape that was never uploaded can not be reused as its data is replaced
+  if (cursor->upload && cursor->uploadSlot != slot)
+    cursor->shapes[cursor->uploadSlot].id = 0;
+
+  struct CursorShape * shape = cursor->shapes + slot;
+  shape->id       = id;
+  shape->lastUsed = ++cursor->useCount;
+  shape->type     = type;
+  shape->width    = width;
+  shape->height   = height;
+
+  cursor->current    = slot;
+  cursor->upload     = true;
+  cursor->uploadSlot = slot;
+
   cursor->type   = type;
   cursor->width  = width;
   cursor->height = (type == LG_CURSOR_MONOCHROME ? height / 2 : height);
-  cursor->stride = stride;
 
-  const size_t size = height * stride;
+  // the rows of the packed texels of a mono shape must be whole texels
+  cursor->stride = ALIGN_PAD(stride, 4);
+
+  const size_t size = height * cursor->stride;
   if (size > cursor->dataSize)
   {
     if (cursor->data)
@@ -216,13 +319,42 @@ bool egl_cursorSetShape(EGL_Cursor * cursor, const LG_RendererCursor type,
     cursor->dataSize = size;
   }
 
-  memcpy(cursor->data, data, size);
+  if (cursor->stride == stride)
+    memcpy(cursor->data, data, size);
+  else
+    for (int y = 0; y < height; ++y)
+      memcpy(cursor->data + y * cursor->stride, data + y * stride, stride);
+
   cursor->update = true;
 
   LG_UNLOCK(cursor->lock);
   return true;
 }
 
+bool egl_cursorSetCachedShape(EGL_Cursor * cursor, const uint32_t id,
+    int * width, int * height)
+{
+  LG_LOCK(cursor->lock);
+
+  const int slot = findShape(cursor, id);
+  if (slot < 0)
+  {
+    LG_UNLOCK(cursor->lock);
+    return false;
+  }
+
+  struct CursorShape * shape = cursor->shapes + slot;
+  shape->lastUsed = ++cursor->useCount;
+  *width          = shape->width;
+  *height         = shape->height;
+
+  cursor->current = slot;
+  cursor->update  = true;
+
+  LG_UNLOCK(cursor->lock);
+  return true;
+}
+
 void egl_cursorSetSize(EGL_Cursor * cursor, const float w, const float h)
 {
   struct CursorSize size = { .w = w, .h = h };
@@ -244,80 +376,35 @@ void egl_cursorSetState(EGL_Cursor * cursor, const bool visible,
   atomic_store(&cursor->hs , hs);
 }
 
-struct CursorState egl_cursorRender(EGL_Cursor * cursor,
+struct CursorState egl_cursorPrepare(EGL_Cursor * cursor,
     LG_RendererRotate rotate, int width, int height)
 {
   if (!cursor->visible)
-    return (struct CursorState) { .visible = false };
+  {
+    cursor->state = (struct CursorState) { .visible = false };
+    return cursor->state;
+  }
 
   if (cursor->update)
   {
     LG_LOCK(cursor->lock);
     cursor->update = false;
+    cursor->active = cursor->current;
+    ++cursor->serial;
 
-    uint8_t * data = cursor->data;
-
-    switch(cursor->type)
+    if (cursor->upload)
     {
-      case LG_CURSOR_MASKED_COLOR:
-      {
-        uint32_t xor[cursor->height][cursor->width];
-        for(int y = 0; y < cursor->height; ++y)
-          for(int x = 0; x < cursor->width; ++x)
-          {
-            uint32_t * src = (uint32_t *)(data + (cursor->stride * y) + x * 4);
-            const bool masked = (*src & 0xFF000000) != 0;
-            if (masked)
-              *src = xor[y][x] = *src & 0x00FFFFFF;
-            else
-            {
-              xor[y][x]  = 0xFF000000;
-              *src      |= 0xFF000000;
-            }
-          }
-
-        egl_textureSetup(cursor->mono.texture, EGL_PF_BGRA,
-            cursor->width, cursor->height, sizeof(xor[0]));
-        egl_textureUpdate(cursor->mono.texture, (uint8_t *)xor, true);
-      }
-      // fall through
-
-      case LG_CURSOR_COLOR:
-      {
-        egl_textureSetup(cursor->norm.texture, EGL_PF_BGRA,
+      struct CursorShape * shape = cursor->shapes + cursor->uploadSlot;
+      cursor->upload = false;
+
+      if (cursor->type == LG_CURSOR_MONOCHROME)
+        egl_textureSetup(shape->tex, EGL_PF_RGBA,
+            cursor->stride / 4, cursor->height * 2, cursor->stride);
+      else
+        egl_textureSetup(shape->tex, EGL_PF_BGRA,
             cursor->width, cursor->height, cursor->stride);
-        egl_textureUpdate(cursor->norm.texture, data, true);
-        break;
-      }
-
-      case LG_CURSOR_MONOCHROME:
-      {
-        uint32_t and[cursor->height][cursor->width];
-        uint32_t xor[cursor->height][cursor->width];
-
-        for(int y = 0; y < cursor->height; ++y)
-        {
-          for(int x = 0; x < cursor->width; ++x)
-          {
-            const uint8_t  * srcAnd  = data + (cursor->stride * y) + (x / 8);
-            const uint8_t  * srcXor  = srcAnd + cursor->stride * cursor->height;
-            const uint8_t    mask    = 0x80 >> (x % 8);
-            const uint32_t   andMask = (*srcAnd & mask) ? 0xFFFFFFFF : 0xFF000000;
-            const uint32_t   xorMask = (*srcXor & mask) ? 0x00FFFFFF : 0x00000000;
-
-            and[y][x] = andMask;
-            xor[y][x] = xorMask;
-          }
-        }
-
-        egl_textureSetup(cursor->norm.texture, EGL_PF_BGRA,
-            cursor->width, cursor->height, sizeof(and[0]));
-        egl_textureSetup(cursor->mono.texture, EGL_PF_BGRA,
-            cursor->width, cursor->height, sizeof(xor[0]));
-        egl_textureUpdate(cursor->norm.texture, (uint8_t *)and, true);
-        egl_textureUpdate(cursor->mono.texture, (uint8_t *)xor, true);
-        break;
-      }
+
+      egl_textureUpdate(shape->tex, cursor->data, true);
     }
     LG_UNLOCK(cursor->lock);
   }
@@ -336,6 +423,7 @@ struct CursorState egl_cursorRender(EGL_Cursor * cursor,
 
   struct CursorState state = {
     .visible = true,
+    .serial  = cursor->serial,
   };
 
   switch (rotate)
@@ -375,23 +463,40 @@ struct CursorState egl_cursorRender(EGL_Cursor * cursor,
   state.rect.x = max(0, state.rect.x - 1);
   state.rect.y = max(0, state.rect.y - 1);
 
+  cursor->state     = state;
+  cursor->drawPos   = pos;
+  cursor->drawSize  = size;
+  cursor->drawScale = scale;
+  return state;
+}
+
+void egl_cursorRender(EGL_Cursor * cursor)
+{
+  if (!cursor->state.visible)
+    return;
+
+  const struct CursorPos   pos   = cursor->drawPos;
+  const struct CursorSize  size  = cursor->drawSize;
+  const float              scale = cursor->drawScale;
+  const struct CursorShape * shape = cursor->shapes + cursor->active;
+
   glEnable(GL_BLEND);
-  switch(cursor->type)
+  switch(shape->type)
   {
     case LG_CURSOR_MONOCHROME:
     {
       egl_shaderUse(cursor->norm.shader);
-      setCursorTexUniforms(cursor, &cursor->norm, true, pos.x, pos.y,
+      setCursorTexUniforms(cursor, &cursor->norm, shape, pos.x, pos.y,
           size.w, size.h, scale);
       glBlendFunc(GL_ZERO, GL_SRC_COLOR);
-      egl_modelSetTexture(cursor->model, cursor->norm.texture);
+      egl_modelSetTexture(cursor->model, shape->tex);
       egl_modelRender(cursor->model);
 
       egl_shaderUse(cursor->mono.shader);
-      setCursorTexUniforms(cursor, &cursor->mono, true, pos.x, pos.y,
+      setCursorTexUniforms(cursor, &cursor->mono, shape, pos.x, pos.y,
           size.w, size.h, scale);
       glBlendFunc(GL_ONE_MINUS_DST_COLOR, GL_ZERO);
-      egl_modelSetTexture(cursor->model, cursor->mono.texture);
+      egl_modelSetTexture(cursor->model, shape->tex);
       egl_modelRender(cursor->model);
       break;
     }
@@ -399,17 +504,17 @@ struct CursorState egl_cursorRender(EGL_Cursor * cursor,
     case LG_CURSOR_MASKED_COLOR:
     {
       egl_shaderUse(cursor->norm.shader);
-      setCursorTexUniforms(cursor, &cursor->norm, false, pos.x, pos.y,
+      setCursorTexUniforms(cursor, &cursor->norm, shape, pos.x, pos.y,
           size.w, size.h, scale);
       glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-      egl_modelSetTexture(cursor->model, cursor->norm.texture);
+      egl_modelSetTexture(cursor->model, shape->tex);
       egl_modelRender(cursor->model);
 
       egl_shaderUse(cursor->mono.shader);
-      setCursorTexUniforms(cursor, &cursor->mono, false, pos.x, pos.y,
+      setCursorTexUniforms(cursor, &cursor->mono, shape, pos.x, pos.y,
           size.w, size.h, scale);
       glBlendFunc(GL_ONE_MINUS_DST_COLOR, GL_ZERO);
-      egl_modelSetTexture(cursor->model, cursor->mono.texture);
+      egl_modelSetTexture(cursor->model, shape->tex);
       egl_modelRender(cursor->model);
       break;
     }
@@ -417,15 +522,13 @@ struct CursorState egl_cursorRender(EGL_Cursor * cursor,
     case LG_CURSOR_COLOR:
     {
       egl_shaderUse(cursor->norm.shader);
-      setCursorTexUniforms(cursor, &cursor->norm, false, pos.x, pos.y,
+      setCursorTexUniforms(cursor, &cursor->norm, shape, pos.x, pos.y,
           size.w, size.h, scale);
       glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-      egl_modelSetTexture(cursor->model, cursor->norm.texture);
+      egl_modelSetTexture(cursor->model, shape->tex);
       egl_modelRender(cursor->model);
       break;
     }
   }
   glDisable(GL_BLEND);
-
-  return state;
 }
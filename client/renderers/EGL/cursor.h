@@ -21,6 +21,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "egl.h"
 #include "interface/renderer.h"
@@ -30,6 +31,7 @@ typedef struct EGL_Cursor EGL_Cursor;
 struct CursorState {
   bool visible;
   struct Rect rect;
+  uint64_t serial; // changes with the shape shown
 };
 
 bool egl_cursorInit(EGL_Cursor ** cursor);
@@ -41,7 +43,13 @@ bool egl_cursorSetShape(
     const int width,
     const int height,
     const int stride,
-    const uint8_t * data);
+    const uint8_t * data,
+    const uint32_t id);
+
+/* switches to the previously set shape with the given id, returns false if it
+ * is no longer held */
+bool egl_cursorSetCachedShape(EGL_Cursor * cursor, const uint32_t id,
+    int * width, int * height);
 
 void egl_cursorSetSize(EGL_Cursor * cursor, const float x, const float y);
 
@@ -50,5 +58,9 @@ void egl_cursorSetScale(EGL_Cursor * cursor, const float scale);
 void egl_cursorSetState(EGL_Cursor * cursor, const bool visible,
     const float x, const float y, const float hx, const float hy);
 
-struct CursorState egl_cursorRender(EGL_Cursor * cursor,
+/* uploads any new shape and works out where the cursor will be drawn, which
+ * egl_cursorRender then does */
+struct CursorState egl_cursorPrepare(EGL_Cursor * cursor,
     LG_RendererRotate rotate, int width, int height);
+
+void egl_cursorRender(EGL_Cursor * cursor);
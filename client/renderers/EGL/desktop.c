@@ -23,15 +23,20 @@
 #include "common/option.h"
 #include "common/locking.h"
 #include "common/array.h"
+#include "common/rects.h"
+#include "common/util.h"
 
 #include "app.h"
 #include "texture.h"
 #include "shader.h"
 #include "desktop_rects.h"
+#include "gpu_timer.h"
 #include "cimgui.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <stdatomic.h>
 
 // these headers are auto generated by cmake
 #include "desktop.vert.h"
@@ -41,14 +46,26 @@
 #include "postprocess.h"
 #include "filters.h"
 
+/* the desktop shader is specialised on the scale algorithm, colour blind mode
+ * and night vision, each variant is compiled the first time it is used */
+#define DESKTOP_CB_MODES 4
+#define DESKTOP_VARIANTS (2 * DESKTOP_CB_MODES * 2)
+
 struct DesktopShader
 {
   EGL_Shader * shader;
   GLint uTransform;
   GLint uDesktopSize;
-  GLint uScaleAlgo;
   GLint uNVGain;
-  GLint uCBMode;
+};
+
+/* a texture and the format it was set up for, the frame thread owns a buffer
+ * until it is published and gets it back once the render thread has moved on */
+struct DesktopBuffer
+{
+  EGL_Texture     * texture;
+  EGL_TexType       type;
+  LG_RendererFormat format;
 };
 
 struct EGL_Desktop
@@ -56,14 +73,32 @@ struct EGL_Desktop
   EGL * egl;
   EGLDisplay * display;
 
-  EGL_Texture          * texture;
-  struct DesktopShader shader;
+  /* a format change sets up the buffer the render thread is not using and
+   * publishes it, it is taken at the start of the next frame, so neither
+   * thread ever waits on the other */
+  struct DesktopBuffer buffers[2];
+  atomic_int           pending; // published and not taken yet, or -1
+  int                  upload;  // frame thread, the newest buffer, or -1
+  bool                 retire;  // frame thread, free the other once taken
+  int                  current; // render thread, the buffer drawn, or -1
+
+  struct DesktopShader shaders[DESKTOP_VARIANTS];
   EGL_DesktopRects     * mesh;
   CountedBuffer        * matrix;
 
-  // internals
+  // internals, the size of the current buffer
   int               width, height;
-  LG_RendererRotate rotate;
+
+  // the inputs the transform matrix was last built from
+  struct
+  {
+    bool              valid;
+    int               width , height;
+    float             x     , y;
+    float             scaleX, scaleY;
+    LG_RendererRotate rotate;
+  }
+  matrixKey;
 
   bool useSpice;
   int spiceWidth, spiceHeight;
@@ -80,40 +115,72 @@ struct EGL_Desktop
   int cbMode;
 
   bool useDMA;
-  LG_RendererFormat format;
 
   EGL_PostProcess * pp;
-  _Atomic(bool) processFrame;
 };
 
 // forwards
 void toggleNV(int key, void * opaque);
+static void desktopOptionChanged(struct Option * opt, void * opaque);
+
+// the options that are applied as they change
+static const char * liveOptions[] = { "nvGain", "cbMode", "scale" };
 
 static bool egl_initDesktopShader(
   struct DesktopShader * shader,
   const char * vertex_code  , size_t vertex_size,
-  const char * fragment_code, size_t fragment_size
+  const char * fragment_code, size_t fragment_size,
+  const char * defines
 )
 {
   if (!egl_shaderInit(&shader->shader))
     return false;
 
-  if (!egl_shaderCompile(shader->shader,
+  if (!egl_shaderCompileDefines(shader->shader,
         vertex_code  , vertex_size,
-        fragment_code, fragment_size))
+        fragment_code, fragment_size,
+        defines))
   {
+    egl_shaderFree(&shader->shader);
     return false;
   }
 
   shader->uTransform   = egl_shaderGetUniform(shader->shader, "transform"  );
   shader->uDesktopSize = egl_shaderGetUniform(shader->shader, "desktopSize");
-  shader->uScaleAlgo   = egl_shaderGetUniform(shader->shader, "scaleAlgo"  );
   shader->uNVGain      = egl_shaderGetUniform(shader->shader, "nvGain"     );
-  shader->uCBMode      = egl_shaderGetUniform(shader->shader, "cbMode"     );
 
   return true;
 }
 
+static struct DesktopShader * egl_desktopGetShader(EGL_Desktop * desktop,
+    bool linear, int cbMode, bool nv)
+{
+  if (cbMode < 0 || cbMode >= DESKTOP_CB_MODES)
+    cbMode = 0;
+
+  struct DesktopShader * shader = desktop->shaders +
+    ((linear ? DESKTOP_CB_MODES : 0) + cbMode) * 2 + (nv ? 1 : 0);
+  if (shader->shader)
+    return shader;
+
+  char defines[128];
+  snprintf(defines, sizeof(defines), "%s#define CB_MODE %d\n%s",
+      linear ? "#define SCALE_LINEAR\n" : "", cbMode,
+      nv     ? "#define NV_ENABLE\n"    : "");
+
+  if (!egl_initDesktopShader(shader,
+    b_shader_desktop_vert    , b_shader_desktop_vert_size,
+    b_shader_desktop_rgb_frag, b_shader_desktop_rgb_frag_size,
+    defines))
+  {
+    DEBUG_ERROR("Failed to compile the desktop shader (linear: %d, cbMode: %d, "
+        "nv: %d)", linear, cbMode, nv);
+    return NULL;
+  }
+
+  return shader;
+}
+
 bool egl_desktopInit(EGL * egl, EGL_Desktop ** desktop_, EGLDisplay * display,
     bool useDMA, int maxRects)
 {
@@ -127,22 +194,9 @@ bool egl_desktopInit(EGL * egl, EGL_Desktop ** desktop_, EGLDisplay * display,
 
   desktop->egl     = egl;
   desktop->display = display;
-
-  if (!egl_textureInit(&desktop->texture, display,
-        useDMA ? EGL_TEXTYPE_DMABUF : EGL_TEXTYPE_FRAMEBUFFER))
-  {
-    DEBUG_ERROR("Failed to initialize the desktop texture");
-    return false;
-  }
-
-  if (!egl_initDesktopShader(
-    &desktop->shader,
-    b_shader_desktop_vert    , b_shader_desktop_vert_size,
-    b_shader_desktop_rgb_frag, b_shader_desktop_rgb_frag_size))
-  {
-    DEBUG_ERROR("Failed to initialize the generic desktop shader");
-    return false;
-  }
+  desktop->upload  = -1;
+  desktop->current = -1;
+  atomic_init(&desktop->pending, -1);
 
   if (!egl_desktopRectsInit(&desktop->mesh, maxRects))
   {
@@ -166,6 +220,17 @@ bool egl_desktopInit(EGL * egl, EGL_Desktop ** desktop_, EGLDisplay * display,
   desktop->scaleAlgo = option_get_int("egl", "scale"    );
   desktop->useDMA    = useDMA;
 
+  for (int i = 0; i < ARRAY_LENGTH(liveOptions); ++i)
+    option_watch(option_get("egl", liveOptions[i]),
+        desktopOptionChanged, desktop);
+
+  // build the plain variant up front to fail early if the shader is broken
+  if (!egl_desktopGetShader(desktop, false, 0, false))
+  {
+    DEBUG_ERROR("Failed to initialize the desktop shader");
+    return false;
+  }
+
   if (!egl_postProcessInit(&desktop->pp))
   {
     DEBUG_ERROR("Failed to initialize the post process manager");
@@ -191,6 +256,21 @@ void toggleNV(int key, void * opaque)
   app_invalidateWindow(true);
 }
 
+/* a config reload, the shader variant is picked on each render so the new
+ * value is used from the next frame on */
+static void desktopOptionChanged(struct Option * opt, void * opaque)
+{
+  EGL_Desktop * desktop = (EGL_Desktop *)opaque;
+  const int value = option_int(opt);
+
+  if (strcmp(opt->name, "nvGain") == 0)
+    desktop->nvGain = min(max(value, 0), desktop->nvMax);
+  else if (strcmp(opt->name, "cbMode") == 0)
+    desktop->cbMode = value;
+  else
+    desktop->scaleAlgo = value;
+}
+
 bool egl_desktopScaleValidate(struct Option * opt, const char ** error)
 {
   if (opt->value.x_int >= 0 && opt->value.x_int < EGL_SCALE_MAX)
@@ -205,14 +285,20 @@ void egl_desktopFree(EGL_Desktop ** desktop)
   if (!*desktop)
     return;
 
-  egl_textureFree    (&(*desktop)->texture      );
+  egl_textureFree    (&(*desktop)->buffers[0].texture);
+  egl_textureFree    (&(*desktop)->buffers[1].texture);
   egl_textureFree    (&(*desktop)->spiceTexture );
-  egl_shaderFree     (&(*desktop)->shader.shader);
+  for (int i = 0; i < DESKTOP_VARIANTS; ++i)
+    egl_shaderFree   (&(*desktop)->shaders[i].shader);
   egl_desktopRectsFree(&(*desktop)->mesh        );
   countedBufferRelease(&(*desktop)->matrix      );
 
   egl_postProcessFree(&(*desktop)->pp);
 
+  for (int i = 0; i < ARRAY_LENGTH(liveOptions); ++i)
+    option_unwatch(option_get("egl", liveOptions[i]),
+        desktopOptionChanged, *desktop);
+
   free(*desktop);
   *desktop = NULL;
 }
@@ -259,8 +345,6 @@ void egl_desktopConfigUI(EGL_Desktop * desktop)
 
 bool egl_desktopSetup(EGL_Desktop * desktop, const LG_RendererFormat format)
 {
-  memcpy(&desktop->format, &format, sizeof(LG_RendererFormat));
-
   enum EGL_PixelFormat pixFmt;
   switch(format.type)
   {
@@ -280,39 +364,112 @@ bool egl_desktopSetup(EGL_Desktop * desktop, const LG_RendererFormat format)
       pixFmt = EGL_PF_RGBA16F;
       break;
 
+    case FRAME_TYPE_NV12:
+      pixFmt = EGL_PF_NV12;
+      break;
+
+    case FRAME_TYPE_RGBA10_PQ:
+      pixFmt = EGL_PF_RGBA10_PQ;
+      break;
+
     default:
       DEBUG_ERROR("Unsupported frame format");
       return false;
   }
 
-  desktop->width  = format.frameWidth;
-  desktop->height = format.frameHeight;
+  /* a buffer the render thread has not taken yet can be set up again as is,
+   * otherwise it is drawing the newest and the other one is free */
+  int idx = atomic_exchange(&desktop->pending, -1);
+  if (idx < 0)
+    idx = desktop->upload < 0 ? 0 : !desktop->upload;
 
-  if (!egl_textureSetup(
-    desktop->texture,
+  // compressed frames can't be imported and are decoded by the CPU
+  struct DesktopBuffer * buf = desktop->buffers + idx;
+  const EGL_TexType type = desktop->useDMA && !format.compressed ?
+    EGL_TEXTYPE_DMABUF : EGL_TEXTYPE_FRAMEBUFFER;
+
+  if (buf->texture && buf->type != type)
+    egl_textureFree(&buf->texture);
+
+  bool ok = true;
+  if (!buf->texture)
+  {
+    ok = egl_textureInit(&buf->texture, desktop->display, type);
+    if (!ok)
+      DEBUG_ERROR("Failed to initialize the desktop texture");
+    buf->type = type;
+  }
+
+  // NV12 is uploaded as is and converted by the post process
+  const bool nv12 = pixFmt == EGL_PF_NV12;
+  if (ok && !egl_textureSetup(
+    buf->texture,
     pixFmt,
-    format.frameWidth,
-    format.frameHeight,
+    nv12 ? format.frameWidth / 4 : format.frameWidth,
+    kvmfrFrameRows(format.type, format.frameHeight),
     format.pitch
   ))
   {
     DEBUG_ERROR("Failed to setup the desktop texture");
-    return false;
+    ok = false;
   }
 
+  /* a failed buffer is still published without a texture so the threads keep
+   * agreeing on which one is in use, nothing is drawn from it */
+  if (!ok)
+    egl_textureFree(&buf->texture);
+
+  memcpy(&buf->format, &format, sizeof(LG_RendererFormat));
+
+  // the storage is made in this context and must reach the render context
+  glFlush();
+
+  desktop->upload = idx;
+  desktop->retire = true;
+  atomic_store(&desktop->pending, idx);
+  return ok;
+}
+
+bool egl_desktopAcquire(EGL_Desktop * desktop, LG_RendererFormat * format)
+{
+  const int idx = atomic_exchange(&desktop->pending, -1);
+  if (idx < 0)
+    return false;
+
+  const struct DesktopBuffer * buf = desktop->buffers + idx;
+  desktop->current = idx;
+  desktop->width   = buf->format.frameWidth;
+  desktop->height  = buf->format.frameHeight;
+  egl_postProcessSetHostScaled(desktop->pp, buf->format.hostScaled);
+
+  if (format)
+    memcpy(format, &buf->format, sizeof(LG_RendererFormat));
   return true;
 }
 
 bool egl_desktopUpdate(EGL_Desktop * desktop, const FrameBuffer * frame, int dmaFd,
-    const FrameDamageRect * damageRects, int damageRectsCount)
+    const FrameDamageRect * damageRects, int damageRectsCount,
+    const FrameDamageMap * damageMap)
 {
-  if (desktop->useDMA && dmaFd >= 0)
+  if (desktop->upload < 0)
+    return false;
+
+  // once the render thread has the newest buffer the one before is unused
+  if (desktop->retire && atomic_load(&desktop->pending) < 0)
   {
-    if (egl_textureUpdateFromDMA(desktop->texture, frame, dmaFd))
-    {
-      atomic_store(&desktop->processFrame, true);
+    egl_textureFree(&desktop->buffers[!desktop->upload].texture);
+    desktop->retire = false;
+  }
+
+  struct DesktopBuffer * buf = desktop->buffers + desktop->upload;
+  if (!buf->texture)
+    return false;
+
+  if (buf->type == EGL_TEXTYPE_DMABUF)
+  {
+    DEBUG_ASSERT(dmaFd >= 0);
+    if (egl_textureUpdateFromDMA(buf->texture, frame, dmaFd))
       return true;
-    }
 
     DEBUG_WARN("DMA update failed, disabling DMABUF imports");
 
@@ -332,31 +489,36 @@ bool egl_desktopUpdate(EGL_Desktop * desktop, const FrameBuffer * frame, int dma
       return false;
     }
 
-    egl_textureFree(&desktop->texture);
-    if (!egl_textureInit(&desktop->texture, desktop->display,
-          EGL_TEXTYPE_FRAMEBUFFER))
-    {
-      DEBUG_ERROR("Failed to initialize the desktop texture");
+    // the render thread may be drawing the imported texture, use the spare
+    if (!egl_desktopSetup(desktop, buf->format))
       return false;
-    }
 
-    if (!egl_desktopSetup(desktop, desktop->format))
-      return false;
+    buf = desktop->buffers + desktop->upload;
   }
 
-  if (egl_textureUpdateFromFrame(desktop->texture, frame,
-        damageRects, damageRectsCount))
+  const LG_RendererFormat * format = &buf->format;
+
+  /* the texture is the NV12 texel image, the frame damage needs converting to
+   * it and the damage map, which is in frame tiles, does not apply */
+  if (format->type == FRAME_TYPE_NV12)
   {
-    atomic_store(&desktop->processFrame, true);
-    return true;
-  }
+    FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+    int count = 0;
+    if (damageRectsCount > 0)
+    {
+      memcpy(rects, damageRects, damageRectsCount * sizeof(*rects));
+      count = rectsOptimize(rects, damageRectsCount, KVMFR_MAX_DAMAGE_RECTS / 2,
+          format->frameWidth, format->frameHeight, 100);
+      if (count > 0)
+        count = rectsToNV12(rects, count, format->frameHeight);
+    }
 
-  return false;
-}
+    return egl_textureUpdateFromFrame(buf->texture, frame,
+        rects, count, NULL, format->compressed);
+  }
 
-void egl_desktopResize(EGL_Desktop * desktop, int width, int height)
-{
-  atomic_store(&desktop->processFrame, true);
+  return egl_textureUpdateFromFrame(buf->texture, frame,
+      damageRects, damageRectsCount, damageMap, format->compressed);
 }
 
 bool egl_desktopRender(EGL_Desktop * desktop, unsigned int outputWidth,
@@ -375,7 +537,10 @@ bool egl_desktopRender(EGL_Desktop * desktop, unsigned int outputWidth,
   }
   else
   {
-    tex    = desktop->texture;
+    if (desktop->current < 0 || !desktop->buffers[desktop->current].texture)
+      return false;
+
+    tex    = desktop->buffers[desktop->current].texture;
     width  = desktop->width;
     height = desktop->height;
   }
@@ -389,17 +554,42 @@ bool egl_desktopRender(EGL_Desktop * desktop, unsigned int outputWidth,
     if (status != EGL_TEX_STATUS_NOTREADY)
       DEBUG_ERROR("Failed to process the desktop texture");
   }
+  egl_gpuTimerMark("upload");
 
   int scaleAlgo = EGL_SCALE_NEAREST;
 
-  egl_desktopRectsMatrix((float *)desktop->matrix->data,
-      width, height, x, y, scaleX, scaleY, rotate);
+  if (!desktop->matrixKey.valid            ||
+      desktop->matrixKey.width  != width    ||
+      desktop->matrixKey.height != height   ||
+      desktop->matrixKey.x      != x        ||
+      desktop->matrixKey.y      != y        ||
+      desktop->matrixKey.scaleX != scaleX   ||
+      desktop->matrixKey.scaleY != scaleY   ||
+      desktop->matrixKey.rotate != rotate)
+  {
+    egl_desktopRectsMatrix((float *)desktop->matrix->data,
+        width, height, x, y, scaleX, scaleY, rotate);
+    desktop->matrixKey.valid  = true;
+    desktop->matrixKey.width  = width;
+    desktop->matrixKey.height = height;
+    desktop->matrixKey.x      = x;
+    desktop->matrixKey.y      = y;
+    desktop->matrixKey.scaleX = scaleX;
+    desktop->matrixKey.scaleY = scaleY;
+    desktop->matrixKey.rotate = rotate;
+  }
   egl_desktopRectsUpdate(desktop->mesh, rects, width, height);
 
-  if (atomic_exchange(&desktop->processFrame, false) ||
-      egl_postProcessConfigModified(desktop->pp))
-    egl_postProcessRun(desktop->pp, tex, desktop->mesh,
-        width, height, outputWidth, outputHeight);
+  /* the filters always run in source orientation and rotation is applied only
+   * by the final composite, so the target size is given unrotated too, this
+   * keeps the chain from being rebuilt at the wrong aspect when rotating */
+  const bool swap = rotate == LG_ROTATE_90 || rotate == LG_ROTATE_270;
+  const unsigned int targetX = swap ? outputHeight : outputWidth;
+  const unsigned int targetY = swap ? outputWidth  : outputHeight;
+
+  /* this is a no-op unless the texture or the filter chain has changed, and
+   * then only the damaged area is filtered again */
+  egl_postProcessRun(desktop->pp, tex, width, height, targetX, targetY);
 
   unsigned int finalSizeX, finalSizeY;
   GLuint texture = egl_postProcessGetOutput(desktop->pp,
@@ -435,14 +625,18 @@ bool egl_desktopRender(EGL_Desktop * desktop, unsigned int outputWidth,
       scaleAlgo = desktop->scaleAlgo;
   }
 
-  const struct DesktopShader * shader = &desktop->shader;
+  /* at 1:1 every algorithm samples texel centres, the nearest texel fetch is
+   * the cheapest way to do it */
+  const bool oneToOne = finalSizeX == targetX && finalSizeY == targetY;
+
+  const struct DesktopShader * shader = egl_desktopGetShader(desktop,
+      !oneToOne && scaleAlgo == EGL_SCALE_LINEAR, desktop->cbMode,
+      desktop->nvGain > 0);
+  if (!shader)
+    return false;
+
   EGL_Uniform uniforms[] =
   {
-    {
-      .type        = EGL_UNIFORM_TYPE_1I,
-      .location    = shader->uScaleAlgo,
-      .i           = { scaleAlgo },
-    },
     {
       .type        = EGL_UNIFORM_TYPE_2F,
       .location    = shader->uDesktopSize,
@@ -458,11 +652,6 @@ bool egl_desktopRender(EGL_Desktop * desktop, unsigned int outputWidth,
       .type        = EGL_UNIFORM_TYPE_1F,
       .location    = shader->uNVGain,
       .f           = { (float)desktop->nvGain }
-    },
-    {
-      .type        = EGL_UNIFORM_TYPE_1I,
-      .location    = shader->uCBMode,
-      .f           = { desktop->cbMode }
     }
   };
 
@@ -470,9 +659,41 @@ bool egl_desktopRender(EGL_Desktop * desktop, unsigned int outputWidth,
   egl_shaderUse(shader->shader);
   egl_desktopRectsRender(desktop->mesh);
   glBindTexture(GL_TEXTURE_2D, 0);
+  egl_gpuTimerMark("desktop");
   return true;
 }
 
+GLuint egl_desktopGetOutput(EGL_Desktop * desktop, bool filtered,
+    unsigned int * width, unsigned int * height)
+{
+  if (desktop->useSpice || desktop->current < 0)
+    return 0;
+
+  const struct DesktopBuffer * buf = desktop->buffers + desktop->current;
+  if (!buf->texture)
+    return 0;
+
+  const FrameType type = buf->format.type;
+  if (filtered || type == FRAME_TYPE_NV12 || type == FRAME_TYPE_RGBA10_PQ)
+    return egl_postProcessGetOutput(desktop->pp, width, height);
+
+  GLuint tex;
+  if (egl_textureGet(buf->texture, &tex, width, height) != EGL_TEX_STATUS_OK)
+    return 0;
+  return tex;
+}
+
+bool egl_desktopGetSpread(EGL_Desktop * desktop, int * x, int * y)
+{
+  if (desktop->useSpice)
+  {
+    *x = *y = 0;
+    return true;
+  }
+
+  return egl_postProcessGetSpread(desktop->pp, x, y);
+}
+
 void egl_desktopSpiceConfigure(EGL_Desktop * desktop, int width, int height)
 {
   if (!desktop->spiceTexture)
@@ -512,8 +733,6 @@ void egl_desktopSpiceDrawFill(EGL_Desktop * desktop, int x, int y, int width,
   for(; y < height; ++y)
     egl_textureUpdateRect(desktop->spiceTexture,
         x, y, width, 1, sizeof(line), (uint8_t *)line, false);
-
-  atomic_store(&desktop->processFrame, true);
 }
 
 void egl_desktopSpiceDrawBitmap(EGL_Desktop * desktop, int x, int y, int width,
@@ -521,10 +740,14 @@ void egl_desktopSpiceDrawBitmap(EGL_Desktop * desktop, int x, int y, int width,
 {
   egl_textureUpdateRect(desktop->spiceTexture,
       x, y, width, height, stride, data, topDown);
-  atomic_store(&desktop->processFrame, true);
 }
 
 void egl_desktopSpiceShow(EGL_Desktop * desktop, bool show)
 {
   desktop->useSpice = show;
 }
+
+void egl_desktopSetPowerSave(EGL_Desktop * desktop, bool powerSave)
+{
+  egl_postProcessSetPowerSave(desktop->pp, powerSave);
+}
@@ -21,6 +21,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <GLES3/gl3.h>
 
 #include "egl.h"
 #include "desktop_rects.h"
@@ -42,18 +43,37 @@ bool egl_desktopInit(EGL * egl, EGL_Desktop ** desktop, EGLDisplay * display,
 void egl_desktopFree(EGL_Desktop ** desktop);
 
 void egl_desktopConfigUI(EGL_Desktop * desktop);
+/* called from the frame thread, the new format is used from the frame after
+ * the render thread acquires it */
 bool egl_desktopSetup (EGL_Desktop * desktop, const LG_RendererFormat format);
+
+/* called at the start of a render, returns true and the format if a new one
+ * was set up since the last call */
+bool egl_desktopAcquire(EGL_Desktop * desktop, LG_RendererFormat * format);
 bool egl_desktopUpdate(EGL_Desktop * desktop, const FrameBuffer * frame, int dmaFd,
-    const FrameDamageRect * damageRects, int damageRectsCount);
-void egl_desktopResize(EGL_Desktop * desktop, int width, int height);
+    const FrameDamageRect * damageRects, int damageRectsCount,
+    const FrameDamageMap * damageMap);
 bool egl_desktopRender(EGL_Desktop * desktop, unsigned int outputWidth,
     unsigned int outputHeight, const float x, const float y,
     const float scaleX, const float scaleY, enum EGL_DesktopScaleType scaleType,
     LG_RendererRotate rotate, const struct DamageRects * rects);
 
+/* the texture last drawn by egl_desktopRender in RGB, before the filters
+ * unless filtered is set or the frame needs converting. Returns 0 while there
+ * is none or the spice display is shown */
+GLuint egl_desktopGetOutput(EGL_Desktop * desktop, bool filtered,
+    unsigned int * width, unsigned int * height);
+
+/* how far in desktop pixels the filters spread the frame damage when last
+ * rendered, false if any change repaints the whole desktop */
+bool egl_desktopGetSpread(EGL_Desktop * desktop, int * x, int * y);
+
 void egl_desktopSpiceConfigure(EGL_Desktop * desktop, int width, int height);
 void egl_desktopSpiceDrawFill(EGL_Desktop * desktop, int x, int y, int width,
     int height, uint32_t color);
 void egl_desktopSpiceDrawBitmap(EGL_Desktop * desktop, int x, int y, int width,
     int height, int stride, uint8_t * data, bool topDown);
 void egl_desktopSpiceShow(EGL_Desktop * desktop, bool show);
+
+// skips the costly filters while the client saves power
+void egl_desktopSetPowerSave(EGL_Desktop * desktop, bool powerSave);
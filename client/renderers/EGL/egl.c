@@ -20,6 +20,7 @@
 
 #include "interface/renderer.h"
 
+#include "common/array.h"
 #include "common/debug.h"
 #include "common/KVMFR.h"
 #include "common/option.h"
@@ -38,14 +39,25 @@
 
 #include <math.h>
 #include <string.h>
+#include <stdatomic.h>
 
 #include "egl_dynprocs.h"
 #include "model.h"
 #include "shader.h"
 #include "damage.h"
+#include "overlay.h"
+#include "record.h"
+#include "video_record.h"
 #include "desktop.h"
 #include "cursor.h"
 #include "postprocess.h"
+#include "compute.h"
+#include "shader_cache.h"
+#include "gpu_timer.h"
+#include "render_limit.h"
+#include "texture_upload.h"
+#include "texture_pinned.h"
+#include "texture_buffer.h"
 #include "util.h"
 
 #define MAX_BUFFER_AGE       3
@@ -53,12 +65,46 @@
 #define MAX_ACCUMULATED_DAMAGE ((KVMFR_MAX_DAMAGE_RECTS + MAX_OVERLAY_RECTS + 2) * MAX_BUFFER_AGE)
 #define IDX_AGO(counter, i, total) (((counter) + (total) - (i)) % (total))
 
+// EGL_NV_context_priority_realtime, missing from older headers
+#ifndef EGL_CONTEXT_PRIORITY_REALTIME_NV
+#define EGL_CONTEXT_PRIORITY_REALTIME_NV 0x3357
+#endif
+
 struct Options
 {
   bool vsync;
   bool doubleBuffer;
 };
 
+/* the desktop/screen transforms for damage only change on resize, rotation or
+ * a new frame format, so they are kept between frames */
+struct DamageMatrixKey
+{
+  int               frameWidth , frameHeight;
+  float             translateX , translateY;
+  float             scaleX     , scaleY;
+  LG_RendererRotate rotate;
+  int               width      , height;
+};
+
+struct DamageMatrix
+{
+  struct DamageMatrixKey key;
+
+  bool   valid;
+  double toScreen [6];
+  double toDesktop[6];
+};
+
+// an extra KVMFR source, shown view only next to the primary
+struct Source
+{
+  EGL_Desktop     * desktop;
+  EGLContext        context; // current in the source's thread
+  LG_RendererFormat format;  // render thread, of the desktop drawn
+  atomic_bool       ready;   // a frame has been uploaded
+};
+
 struct Inst
 {
   LG_Renderer base;
@@ -72,15 +118,23 @@ struct Inst
   EGLConfig            configs;
   EGLSurface           surface;
   EGLContext           context, frameContext;
+  EGLint               priority; // the context priority granted, or 0
 
   EGL_Desktop     * desktop; // the desktop
   EGL_Cursor      * cursor;  // the mouse cursor
   EGL_Damage      * damage;  // the damage display
+  EGL_Overlay     * overlay; // the ImGui draw data renderer
+  EGL_Record      * record;  // the video encoder's frames, NULL if unused
   bool              imgui;   // if imgui was initialized
 
+  // the format being drawn, taken from the desktop at the start of a render
   LG_RendererFormat    format;
   bool                 formatValid;
 
+  // the format last given to onFrameFormat, only used by the frame thread
+  LG_RendererFormat    uploadFormat;
+  bool                 uploadFormatValid;
+
   int               width, height;
   float             uiScale;
   struct DoubleRect destRect;
@@ -111,17 +165,39 @@ struct Inst
   LG_Lock              desktopDamageLock;
 
   bool         hasBufferAge;
-  struct Rect  overlayHistory[DESKTOP_DAMAGE_COUNT][MAX_OVERLAY_RECTS + 1];
+  struct Rect  overlayHistory[DESKTOP_DAMAGE_COUNT][MAX_OVERLAY_RECTS];
   int          overlayHistoryCount[DESKTOP_DAMAGE_COUNT];
+  struct CursorState cursorHistory[DESKTOP_DAMAGE_COUNT];
   unsigned int overlayHistoryIdx;
 
+  struct DamageMatrix damageMatrix;
+
   RingBuffer importTimings;
   GraphHandle importGraph;
 
   bool showSpice;
   int  spiceWidth, spiceHeight;
+
+  struct Source sources[LG_MAX_SOURCES - 1];
 };
 
+enum ContextPriority
+{
+  CONTEXT_PRIORITY_DEFAULT,
+  CONTEXT_PRIORITY_HIGH,
+  CONTEXT_PRIORITY_REALTIME,
+  CONTEXT_PRIORITY_MAX
+};
+
+static bool contextPriorityValidate(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_int >= 0 && opt->value.x_int < CONTEXT_PRIORITY_MAX)
+    return true;
+
+  *error = "Invalid context priority";
+  return false;
+}
+
 static struct Option egl_options[] =
 {
   {
@@ -202,6 +278,64 @@ static struct Option egl_options[] =
     .type         = OPTION_TYPE_BOOL,
     .value.x_bool = true
   },
+  {
+    .module       = "egl",
+    .name         = "computeFilters",
+    .description  = "Run the filters as compute shaders if GLES 3.1 is available",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = true
+  },
+  {
+    .module       = "egl",
+    .name         = "shaderCache",
+    .description  = "Cache the compiled shader programs on disk",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = true
+  },
+  {
+    .module       = "egl",
+    .name         = "gpuTimers",
+    .description  = "Graph the GPU time of each render stage",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = false
+  },
+  {
+    .module       = "egl",
+    .name         = "contextPriority",
+    .description  = "The GPU priority to request (0 = default, 1 = high, 2 = realtime)",
+    .type         = OPTION_TYPE_INT,
+    .validator    = contextPriorityValidate,
+    .value.x_int  = 0
+  },
+  {
+    .module       = "egl",
+    .name         = "uploadThread",
+    .description  = "Copy the frames into the textures from a separate thread",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = false
+  },
+  {
+    .module       = "egl",
+    .name         = "renderAhead",
+    .description  = "The most frames the GPU may be behind by (0 = unlimited)",
+    .type         = OPTION_TYPE_INT,
+    .validator    = egl_renderLimitValidate,
+    .value.x_int  = 1
+  },
+  {
+    .module       = "egl",
+    .name         = "pinnedMemory",
+    .description  = "Copy the frames on the GPU if the driver can pin the shared memory",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = true
+  },
+  {
+    .module       = "egl",
+    .name         = "textureCopy",
+    .description  = "Copy the regions a frame did not change from the last texture on the GPU",
+    .type         = OPTION_TYPE_BOOL,
+    .value.x_bool = true
+  },
 
   {0}
 };
@@ -277,9 +411,22 @@ static void egl_deinitialize(LG_Renderer * renderer)
 
   ringbuffer_free(&this->importTimings);
 
+  egl_texUploadFree();
   egl_desktopFree(&this->desktop);
+  egl_texPinnedFree();
+  for (int i = 0; i < ARRAY_LENGTH(this->sources); ++i)
+  {
+    egl_desktopFree(&this->sources[i].desktop);
+    if (this->sources[i].context)
+      eglDestroyContext(this->display, this->sources[i].context);
+  }
   egl_cursorFree (&this->cursor);
   egl_damageFree (&this->damage);
+  egl_overlayFree(&this->overlay);
+  egl_recordFree (&this->record);
+  egl_shaderCacheFree();
+  egl_gpuTimerFree();
+  egl_renderLimitFree();
 
   LG_LOCK_FREE(this->lock);
   LG_LOCK_FREE(this->desktopDamageLock);
@@ -517,16 +664,15 @@ static void egl_onResize(LG_Renderer * renderer, const int width, const int heig
   ImGui_ImplOpenGL3_NewFrame();
 
   egl_damageResize(this->damage, this->translateX, this->translateY, this->scaleX, this->scaleY);
-  egl_desktopResize(this->desktop, this->width, this->height);
 }
 
 static bool egl_onMouseShape(LG_Renderer * renderer, const LG_RendererCursor cursor,
     const int width, const int height,
-    const int pitch, const uint8_t * data)
+    const int pitch, const uint8_t * data, const uint32_t id)
 {
   struct Inst * this = UPCAST(struct Inst, renderer);
 
-  if (!egl_cursorSetShape(this->cursor, cursor, width, height, pitch, data))
+  if (!egl_cursorSetShape(this->cursor, cursor, width, height, pitch, data, id))
   {
     DEBUG_ERROR("Failed to update the cursor shape");
     return false;
@@ -539,6 +685,21 @@ static bool egl_onMouseShape(LG_Renderer * renderer, const LG_RendererCursor cur
   return true;
 }
 
+static bool egl_onMouseShapeCached(LG_Renderer * renderer, const uint32_t id)
+{
+  struct Inst * this = UPCAST(struct Inst, renderer);
+
+  int width, height;
+  if (!egl_cursorSetCachedShape(this->cursor, id, &width, &height))
+    return false;
+
+  this->mouseWidth  = width;
+  this->mouseHeight = height;
+  egl_calc_mouse_size(this);
+
+  return true;
+}
+
 static bool egl_onMouseEvent(LG_Renderer * renderer, const bool visible,
     int x, int y, const int hx, const int hy)
 {
@@ -555,14 +716,23 @@ static bool egl_onMouseEvent(LG_Renderer * renderer, const bool visible,
 static bool egl_onFrameFormat(LG_Renderer * renderer, const LG_RendererFormat format)
 {
   struct Inst * this = UPCAST(struct Inst, renderer);
-  memcpy(&this->format, &format, sizeof(LG_RendererFormat));
-  this->formatValid = true;
+
+  /* a host restart sends the same format again, keeping the textures keeps the
+   * last frame on screen until the new one arrives */
+  const bool unchanged = this->uploadFormatValid &&
+    memcmp(&this->uploadFormat, &format, sizeof(LG_RendererFormat)) == 0;
+
+  memcpy(&this->uploadFormat, &format, sizeof(LG_RendererFormat));
+  this->uploadFormatValid = true;
 
   /* this event runs in a second thread so we need to init it here */
   if (!this->frameContext)
   {
-    static EGLint attrs[] = {
+    // the uploads are as latency sensitive as the rendering
+    const EGLint attrs[] = {
       EGL_CONTEXT_CLIENT_VERSION, 2,
+      this->priority ? EGL_CONTEXT_PRIORITY_LEVEL_IMG : EGL_NONE,
+      this->priority,
       EGL_NONE
     };
 
@@ -579,30 +749,51 @@ static bool egl_onFrameFormat(LG_Renderer * renderer, const LG_RendererFormat fo
     }
   }
 
+  if (unchanged)
+  {
+    INTERLOCKED_SECTION(this->desktopDamageLock, {
+      this->desktopDamage[this->desktopDamageIdx].count = -1;
+    });
+    return true;
+  }
+
+  // the render thread applies the rest when it takes the new desktop
+  return egl_desktopSetup(this->desktop, format);
+}
+
+/* called by the render thread when it has taken a new desktop format, before
+ * anything of the frame is drawn */
+static void egl_applyFormat(struct Inst * this)
+{
+  this->formatValid = true;
+
   if (this->scalePointer)
   {
-    float scale = max(1.0f, (float)format.screenWidth / this->width);
+    float scale = max(1.0f, (float)this->format.screenWidth / this->width);
     egl_cursorSetScale(this->cursor, scale);
   }
 
   egl_update_scale_type(this);
-  egl_damageSetup(this->damage, format.frameWidth, format.frameHeight);
+  egl_calc_mouse_size(this);
+  egl_calc_mouse_state(this);
+  egl_damageSetup(this->damage, this->format.frameWidth,
+      this->format.frameHeight);
 
   /* we need full screen damage when the format changes */
   INTERLOCKED_SECTION(this->desktopDamageLock, {
     this->desktopDamage[this->desktopDamageIdx].count = -1;
   });
-
-  return egl_desktopSetup(this->desktop, format);
 }
 
 static bool egl_onFrame(LG_Renderer * renderer, const FrameBuffer * frame, int dmaFd,
-    const FrameDamageRect * damageRects, int damageRectsCount)
+    const FrameDamageRect * damageRects, int damageRectsCount,
+    const FrameDamageMap * damageMap)
 {
   struct Inst * this = UPCAST(struct Inst, renderer);
 
   uint64_t start = nanotime();
-  if (!egl_desktopUpdate(this->desktop, frame, dmaFd, damageRects, damageRectsCount))
+  if (!egl_desktopUpdate(this->desktop, frame, dmaFd, damageRects,
+        damageRectsCount, damageMap))
   {
     DEBUG_INFO("Failed to to update the desktop");
     return false;
@@ -624,6 +815,73 @@ static bool egl_onFrame(LG_Renderer * renderer, const FrameBuffer * frame, int d
   return true;
 }
 
+static bool egl_onSourceFormat(LG_Renderer * renderer, unsigned int source,
+    const LG_RendererFormat format)
+{
+  struct Inst * this = UPCAST(struct Inst, renderer);
+  struct Source * src = this->sources + source - 1;
+
+  if (!src->desktop)
+    return false;
+
+  if (!src->context)
+  {
+    static EGLint attrs[] = {
+      EGL_CONTEXT_CLIENT_VERSION, 2,
+      EGL_NONE
+    };
+
+    if (!(src->context = eglCreateContext(this->display, this->configs,
+            this->context, attrs)))
+    {
+      DEBUG_ERROR("Failed to create the context for source %u", source);
+      return false;
+    }
+
+    if (!eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+          src->context))
+    {
+      DEBUG_ERROR("Failed to make the context for source %u current", source);
+      return false;
+    }
+  }
+
+  atomic_store(&src->ready, false);
+  return egl_desktopSetup(src->desktop, format);
+}
+
+static bool egl_onSourceFrame(LG_Renderer * renderer, unsigned int source,
+    const FrameBuffer * frame, const FrameDamageRect * damageRects,
+    int damageRectsCount)
+{
+  struct Inst * this = UPCAST(struct Inst, renderer);
+  struct Source * src = this->sources + source - 1;
+
+  if (!egl_desktopUpdate(src->desktop, frame, -1, damageRects,
+        damageRectsCount, NULL))
+  {
+    DEBUG_INFO("Failed to to update the desktop of source %u", source);
+    return false;
+  }
+
+  atomic_store(&src->ready, true);
+  return true;
+}
+
+static void egl_onSourceStop(LG_Renderer * renderer, unsigned int source)
+{
+  struct Inst * this = UPCAST(struct Inst, renderer);
+  struct Source * src = this->sources + source - 1;
+
+  atomic_store(&src->ready, false);
+  if (!src->context)
+    return;
+
+  eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(this->display, src->context);
+  src->context = NULL;
+}
+
 static void debugCallback(GLenum source, GLenum type, GLuint id,
     GLenum severity, GLsizei length, const GLchar * message,
     const void * userParam)
@@ -709,6 +967,82 @@ static void egl_configUI(void * opaque, int * id)
   egl_desktopConfigUI(this->desktop);
 }
 
+static const char * priorityStr(EGLint priority)
+{
+  switch(priority)
+  {
+    case EGL_CONTEXT_PRIORITY_REALTIME_NV: return "realtime";
+    case EGL_CONTEXT_PRIORITY_HIGH_IMG   : return "high";
+    case EGL_CONTEXT_PRIORITY_MEDIUM_IMG : return "medium";
+    case EGL_CONTEXT_PRIORITY_LOW_IMG    : return "low";
+    default                              : return "unknown";
+  }
+}
+
+/* creates the context at the configured priority, stepping down to the next
+ * lower one when the driver refuses it. The driver may also grant a lower
+ * priority than asked without failing, so what was granted is read back and
+ * is what the other contexts then ask for */
+static EGLContext createContext(struct Inst * this, const char * client_exts,
+    EGLint * ctxattr, int ctxidx)
+{
+  this->priority = 0;
+
+  EGLint wanted[2];
+  int    count = 0;
+  if (util_hasGLExt(client_exts, "EGL_IMG_context_priority"))
+    switch(option_get_int("egl", "contextPriority"))
+    {
+      case CONTEXT_PRIORITY_REALTIME:
+        if (util_hasGLExt(client_exts, "EGL_NV_context_priority_realtime"))
+          wanted[count++] = EGL_CONTEXT_PRIORITY_REALTIME_NV;
+        else
+          DEBUG_WARN("EGL_NV_context_priority_realtime is not supported");
+        // fallthrough
+
+      case CONTEXT_PRIORITY_HIGH:
+        wanted[count++] = EGL_CONTEXT_PRIORITY_HIGH_IMG;
+        break;
+    }
+  else if (option_get_int("egl", "contextPriority") != CONTEXT_PRIORITY_DEFAULT)
+    DEBUG_WARN("EGL_IMG_context_priority is not supported, "
+        "using the default context priority");
+
+  for(int i = 0; i < count; ++i)
+  {
+    ctxattr[ctxidx + 0] = EGL_CONTEXT_PRIORITY_LEVEL_IMG;
+    ctxattr[ctxidx + 1] = wanted[i];
+    ctxattr[ctxidx + 2] = EGL_NONE;
+
+    EGLContext context = eglCreateContext(this->display, this->configs,
+        EGL_NO_CONTEXT, ctxattr);
+    if (context == EGL_NO_CONTEXT)
+    {
+      DEBUG_WARN("Failed to create a %s priority context (eglError: 0x%x)",
+          priorityStr(wanted[i]), eglGetError());
+      continue;
+    }
+
+    EGLint granted = EGL_CONTEXT_PRIORITY_MEDIUM_IMG;
+    eglQueryContext(this->display, context, EGL_CONTEXT_PRIORITY_LEVEL_IMG,
+        &granted);
+
+    if (granted != wanted[i])
+      DEBUG_WARN("Requested a %s priority context but was granted %s",
+          priorityStr(wanted[i]), priorityStr(granted));
+    else
+      DEBUG_INFO("Using a %s priority context", priorityStr(granted));
+
+    if (granted != EGL_CONTEXT_PRIORITY_MEDIUM_IMG)
+      this->priority = granted;
+    return context;
+  }
+
+  ctxattr[ctxidx] = EGL_NONE;
+  return eglCreateContext(this->display, this->configs, EGL_NO_CONTEXT,
+      ctxattr);
+}
+
 static bool egl_renderStartup(LG_Renderer * renderer, bool useDMA)
 {
   struct Inst * this = UPCAST(struct Inst, renderer);
@@ -792,7 +1126,7 @@ static bool egl_renderStartup(LG_Renderer * renderer, bool useDMA)
   }
 
   bool debug = option_get_bool("egl", "debug");
-  EGLint ctxattr[5];
+  EGLint ctxattr[7];
   int ctxidx = 0;
 
   ctxattr[ctxidx++] = EGL_CONTEXT_CLIENT_VERSION;
@@ -813,7 +1147,7 @@ static bool egl_renderStartup(LG_Renderer * renderer, bool useDMA)
 
   ctxattr[ctxidx] = EGL_NONE;
 
-  this->context = eglCreateContext(this->display, this->configs, EGL_NO_CONTEXT, ctxattr);
+  this->context = createContext(this, client_exts, ctxattr, ctxidx);
   if (this->context == EGL_NO_CONTEXT)
   {
     DEBUG_ERROR("Failed to create EGL context (eglError: 0x%x)", eglGetError());
@@ -868,6 +1202,25 @@ static bool egl_renderStartup(LG_Renderer * renderer, bool useDMA)
   glGetIntegerv(GL_MAJOR_VERSION, &esMaj);
   glGetIntegerv(GL_MINOR_VERSION, &esMin);
 
+  if (esMaj < 3 || (esMaj == 3 && esMin < 1))
+  {
+    DEBUG_INFO("GLES 3.1 unavailable, compute filters disabled");
+    egl_computeInit(false);
+  }
+  else
+    egl_computeInit(option_get_bool("egl", "computeFilters"));
+
+  egl_shaderCacheInit(option_get_bool("egl", "shaderCache"));
+  egl_gpuTimerInit(option_get_bool("egl", "gpuTimers"), gl_exts);
+  egl_renderLimitInit(option_get_int("egl", "renderAhead"));
+  if (option_get_bool("egl", "uploadThread") &&
+      !egl_texUploadInit(this->display, this->configs, this->context,
+        this->priority))
+    DEBUG_WARN("Falling back to uploading the frames from the render thread");
+  if (util_hasGLExt(gl_exts, "GL_KHR_parallel_shader_compile") &&
+      g_egl_dynProcs.glMaxShaderCompilerThreadsKHR)
+    g_egl_dynProcs.glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+
   if (!util_hasGLExt(gl_exts, "GL_EXT_texture_format_BGRA8888"))
   {
     DEBUG_ERROR("GL_EXT_texture_format_BGRA8888 is needed to use EGL backend");
@@ -911,6 +1264,20 @@ static bool egl_renderStartup(LG_Renderer * renderer, bool useDMA)
     }
   }
 
+  if (!useDMA && option_get_bool("egl", "pinnedMemory"))
+    egl_texPinnedInit(gl_exts, this->params.frameMemory,
+        this->params.frameMemorySize);
+
+  if ((esMaj > 3 || (esMaj == 3 && esMin >= 2)) ||
+      util_hasGLExt(gl_exts, "GL_EXT_copy_image") ||
+      util_hasGLExt(gl_exts, "GL_OES_copy_image"))
+    egl_texBufferCopyInit(option_get_bool("egl", "textureCopy"));
+  else
+  {
+    DEBUG_INFO("glCopyImageSubData unavailable, reused textures are filled from the frame");
+    egl_texBufferCopyInit(false);
+  }
+
   if (debug)
   {
     if ((esMaj > 3 || (esMaj == 3 && esMin >= 2)) && g_egl_dynProcs.glDebugMessageCallback)
@@ -937,6 +1304,15 @@ static bool egl_renderStartup(LG_Renderer * renderer, bool useDMA)
     return false;
   }
 
+  // the extra sources are uploaded by the CPU from their own threads
+  for (unsigned int i = 1; i < this->params.sources; ++i)
+    if (!egl_desktopInit(this, &this->sources[i - 1].desktop, this->display,
+          false, MAX_ACCUMULATED_DAMAGE))
+    {
+      DEBUG_ERROR("Failed to initialize the desktop of source %u", i);
+      return false;
+    }
+
   if (!egl_cursorInit(&this->cursor))
   {
     DEBUG_ERROR("Failed to initialize the cursor");
@@ -955,6 +1331,16 @@ static bool egl_renderStartup(LG_Renderer * renderer, bool useDMA)
     return false;
   }
 
+  // the backend still owns the font texture if this is not available
+  if (!egl_overlayInit(&this->overlay))
+  {
+    DEBUG_WARN("Failed to initialize the overlay renderer, using ImGui's");
+    egl_overlayFree(&this->overlay);
+  }
+
+  if (videoRecord_active() && !egl_recordInit(&this->record, this->display))
+    DEBUG_WARN("The desktop will not be encoded");
+
   app_overlayConfigRegister("EGL", egl_configUI, this);
 
   this->imgui = true;
@@ -975,12 +1361,62 @@ inline static EGLint egl_bufferAge(struct Inst * this)
   return result;
 }
 
-inline static void renderLetterBox(struct Inst * this)
+inline static bool cursorStateEqual(const struct CursorState * a,
+    const struct CursorState * b)
+{
+  if (a->visible != b->visible)
+    return false;
+
+  return !a->visible || (a->serial == b->serial &&
+      memcmp(&a->rect, &b->rect, sizeof(a->rect)) == 0);
+}
+
+inline static bool rectsIntersect(const struct FrameDamageRect * a,
+    const struct FrameDamageRect * b)
+{
+  return a->x < b->x + b->width  && b->x < a->x + a->width &&
+         a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+/* clears the part of a letterbox bar that is out of date, which is all of it
+ * if count is negative */
+inline static void clearLetterBox(int x, int y, int w, int h,
+    const struct Rect * refresh, int count)
+{
+  if (w <= 0 || h <= 0)
+    return;
+
+  if (count < 0)
+  {
+    glScissor(x, y, w, h);
+    glClear(GL_COLOR_BUFFER_BIT);
+    return;
+  }
+
+  for (int i = 0; i < count; ++i)
+  {
+    const struct Rect * r = refresh + i;
+    const int x1 = max(x, r->x);
+    const int y1 = max(y, r->y);
+    const int x2 = min(x + w, r->x + r->w);
+    const int y2 = min(y + h, r->y + r->h);
+    if (x2 <= x1 || y2 <= y1)
+      continue;
+
+    glScissor(x1, y1, x2 - x1, y2 - y1);
+    glClear(GL_COLOR_BUFFER_BIT);
+  }
+}
+
+/* the bars only change where the overlay or cursor was drawn over them, as
+ * given by refresh, unless count is negative */
+inline static void renderLetterBox(struct Inst * this,
+    const struct Rect * refresh, int count)
 {
   bool hLB = this->destRect.x > 0;
   bool vLB = this->destRect.y > 0;
 
-  if (hLB || vLB)
+  if ((hLB || vLB) && count != 0)
   {
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glEnable(GL_SCISSOR_TEST);
@@ -988,46 +1424,161 @@ inline static void renderLetterBox(struct Inst * this)
     if (hLB)
     {
       // left
-      glScissor(0, 0, this->destRect.x, this->height);
-      glClear(GL_COLOR_BUFFER_BIT);
+      clearLetterBox(0, 0, this->destRect.x, this->height, refresh, count);
 
       // right
-      float x2 = this->destRect.x + this->destRect.w;
-      glScissor(x2, 0, this->width - x2, this->height);
-      glClear(GL_COLOR_BUFFER_BIT);
+      int x2 = this->destRect.x + this->destRect.w;
+      clearLetterBox(x2, 0, this->width - x2, this->height, refresh, count);
     }
 
     if (vLB)
     {
       // top
-      glScissor(0, this->height - this->destRect.y,
-          this->width, this->destRect.y);
-      glClear(GL_COLOR_BUFFER_BIT);
+      clearLetterBox(0, this->height - this->destRect.y,
+          this->width, this->destRect.y, refresh, count);
 
       // bottom
       int y2 = this->destRect.y + this->destRect.h;
-      glScissor(0, 0, this->width, this->height - y2);
-      glClear(GL_COLOR_BUFFER_BIT);
+      clearLetterBox(0, 0, this->width, this->height - y2, refresh, count);
     }
 
     glDisable(GL_SCISSOR_TEST);
   }
 }
 
+/* grows a desktop damage rect by the distance rendering spreads it */
+inline static struct FrameDamageRect growDesktopRect(
+    const struct FrameDamageRect * rect, int px, int py, int width, int height)
+{
+  const int x = max((int)rect->x - px, 0);
+  const int y = max((int)rect->y - py, 0);
+  return (struct FrameDamageRect) {
+    .x      = x,
+    .y      = y,
+    .width  = min((int)(rect->x + rect->width ) + px, width ) - x,
+    .height = min((int)(rect->y + rect->height) + py, height) - y,
+  };
+}
+
+static const struct DamageMatrix * egl_getDamageMatrix(struct Inst * this,
+    LG_RendererRotate rotate)
+{
+  struct DamageMatrix * dm = &this->damageMatrix;
+  struct DamageMatrixKey key;
+
+  // zero the padding so the keys can be compared with memcmp
+  memset(&key, 0, sizeof(key));
+  key.frameWidth  = this->format.frameWidth;
+  key.frameHeight = this->format.frameHeight;
+  key.translateX  = this->translateX;
+  key.translateY  = this->translateY;
+  key.scaleX      = this->scaleX;
+  key.scaleY      = this->scaleY;
+  key.rotate      = rotate;
+  key.width       = this->width;
+  key.height      = this->height;
+
+  if (dm->valid && memcmp(&dm->key, &key, sizeof(key)) == 0)
+    return dm;
+
+  dm->key = key;
+  egl_desktopToScreenMatrix(dm->toScreen,
+      key.frameWidth, key.frameHeight,
+      key.translateX, key.translateY, key.scaleX, key.scaleY, key.rotate,
+      key.width, key.height);
+  egl_screenToDesktopMatrix(dm->toDesktop,
+      key.frameWidth, key.frameHeight,
+      key.translateX, key.translateY, key.scaleX, key.scaleY, key.rotate,
+      key.width, key.height);
+  dm->valid = true;
+  return dm;
+}
+
+/* draws the extra sources into their cells, returns true if any were drawn.
+ * They are drawn over whatever the primary left there so they are repainted
+ * in full each time */
+static bool egl_renderSources(struct Inst * this, LG_RendererRotate rotate)
+{
+  bool drawn = false;
+  for (unsigned int i = 1; i < this->params.sources; ++i)
+  {
+    struct Source * src = this->sources + i - 1;
+    egl_desktopAcquire(src->desktop, &src->format);
+    if (!atomic_load(&src->ready))
+      continue;
+
+    const LG_RendererRect cell = lgSourceCell(this->params.sourceLayout,
+        this->params.sources, i, this->width, this->height);
+
+    const bool swap = rotate == LG_ROTATE_90 || rotate == LG_ROTATE_270;
+    const float srcW = swap ? src->format.screenHeight : src->format.screenWidth;
+    const float srcH = swap ? src->format.screenWidth  : src->format.screenHeight;
+    const float fit  = min(cell.w / srcW, cell.h / srcH);
+    const float w    = srcW * fit;
+    const float h    = srcH * fit;
+    const float x    = cell.x + (cell.w - w) / 2.0f;
+    const float y    = cell.y + (cell.h - h) / 2.0f;
+
+    if (w < 1.0f || h < 1.0f)
+      continue;
+
+    const enum EGL_DesktopScaleType scaleType =
+      fit == 1.0f ? EGL_DESKTOP_NOSCALE :
+      fit <  1.0f ? EGL_DESKTOP_DOWNSCALE : EGL_DESKTOP_UPSCALE;
+
+    drawn |= egl_desktopRender(src->desktop, w, h,
+        -1.0f + ((x + w / 2.0f) * 2.0f) / this->width,
+         1.0f - ((y + h / 2.0f) * 2.0f) / this->height,
+        w / this->width, h / this->height,
+        scaleType, rotate, NULL);
+  }
+
+  if (drawn)
+    egl_gpuTimerMark("sources");
+
+  return drawn;
+}
+
 static bool egl_render(LG_Renderer * renderer, LG_RendererRotate rotate,
     const bool newFrame, const bool invalidateWindow,
     void (*preSwap)(void * udata), void * udata)
 {
   struct Inst * this = UPCAST(struct Inst, renderer);
+  egl_renderLimitWait();
+
+  if (egl_desktopAcquire(this->desktop, &this->format))
+    egl_applyFormat(this);
+
+  /* the bars are left alone by the desktop, so they are only out of date when
+   * the whole window is, not when the desktop changed in full */
   EGLint bufferAge   = egl_bufferAge(this);
-  bool renderAll     = invalidateWindow || this->hadOverlay ||
+  bool windowAll     = invalidateWindow || this->hadOverlay ||
                        bufferAge <= 0 || bufferAge > MAX_BUFFER_AGE ||
                        this->showSpice;
+  bool renderAll     = windowAll;
 
   bool hasOverlay = false;
   struct CursorState cursorState = { .visible = false };
   struct DesktopDamage * desktopDamage;
 
+  const struct CursorState cursorNext = egl_cursorPrepare(this->cursor,
+      (this->format.rotate + rotate) % LG_ROTATE_MAX,
+      this->width, this->height);
+  bool cursorSkip = false;
+
+  /* the filters move a change by their radius and the final scale samples one
+   * pixel around it, the repaint has to cover that too */
+  int spreadX, spreadY;
+  const bool spreadValid =
+    egl_desktopGetSpread(this->desktop, &spreadX, &spreadY);
+  renderAll |= !spreadValid;
+  spreadX += 1;
+  spreadY += 1;
+
+  // the screen area of the overlay and cursor history, for the letterbox
+  struct Rect refresh[(MAX_OVERLAY_RECTS + 1) * MAX_BUFFER_AGE + 1];
+  int refreshCount = 0;
+
   struct DamageRects * accumulated = (struct DamageRects *)alloca(
     sizeof(struct DamageRects) +
     MAX_ACCUMULATED_DAMAGE * sizeof(struct FrameDamageRect)
@@ -1049,16 +1600,9 @@ static bool egl_render(LG_Renderer * renderer, LG_RendererRotate rotate,
         }
 
         for (int j = 0; j < damage->count; ++j)
-        {
-          struct FrameDamageRect * rect = damage->rects + j;
-          int x = rect->x > 0 ? rect->x - 1 : 0;
-          int y = rect->y > 0 ? rect->y - 1 : 0;
-          accumulated->rects[accumulated->count++] = (struct FrameDamageRect) {
-            .x = x, .y = y,
-            .width  = min(this->format.frameWidth  - x, rect->width  + 2),
-            .height = min(this->format.frameHeight - y, rect->height + 2),
-          };
-        }
+          accumulated->rects[accumulated->count++] = growDesktopRect(
+              damage->rects + j, spreadX, spreadY,
+              this->format.frameWidth, this->format.frameHeight);
       }
     }
     desktopDamage = this->desktopDamage + this->desktopDamageIdx;
@@ -1066,13 +1610,9 @@ static bool egl_render(LG_Renderer * renderer, LG_RendererRotate rotate,
     this->desktopDamage[this->desktopDamageIdx].count = 0;
   });
 
-  if (!renderAll)
+  if (!windowAll)
   {
-    double matrix[6];
-    egl_screenToDesktopMatrix(matrix,
-        this->format.frameWidth, this->format.frameHeight,
-        this->translateX, this->translateY, this->scaleX, this->scaleY, rotate,
-        this->width, this->height);
+    const double * matrix = egl_getDamageMatrix(this, rotate)->toDesktop;
 
     for (int i = 0; i < bufferAge; ++i)
     {
@@ -1082,21 +1622,58 @@ static bool egl_render(LG_Renderer * renderer, LG_RendererRotate rotate,
 
       if (count < 0)
       {
-        renderAll = true;
+        windowAll = renderAll = true;
         break;
       }
 
-      for (int j = 0; j < count; ++j)
+      if (!renderAll)
+        for (int j = 0; j < count; ++j)
+          accumulated->count += egl_screenToDesktop(
+            accumulated->rects + accumulated->count, matrix, damage + j,
+            this->format.frameWidth, this->format.frameHeight
+          );
+
+      memcpy(refresh + refreshCount, damage, count * sizeof(*damage));
+      refreshCount += count;
+    }
+
+    /* a cursor that is unchanged over the age of the buffer is already in it,
+     * and as it blends with what is below it is only drawn again when the
+     * desktop there is, which also repaints all of it */
+    cursorSkip = !renderAll;
+    for (int i = 0; i < bufferAge && cursorSkip; ++i)
+      cursorSkip = cursorStateEqual(&cursorNext, this->cursorHistory +
+          IDX_AGO(this->overlayHistoryIdx, i, DESKTOP_DAMAGE_COUNT));
+
+    struct FrameDamageRect cursorRect;
+    if (cursorSkip && cursorNext.visible &&
+        egl_screenToDesktop(&cursorRect, matrix, &cursorNext.rect,
+          this->format.frameWidth, this->format.frameHeight))
+      for (int i = 0; i < accumulated->count && cursorSkip; ++i)
+        cursorSkip = !rectsIntersect(accumulated->rects + i, &cursorRect);
+
+    // repaint where the cursor was in the frames since the buffer was drawn
+    if (!cursorSkip)
+      for (int i = 0; i < bufferAge; ++i)
+      {
+        const struct CursorState * cursor = this->cursorHistory +
+          IDX_AGO(this->overlayHistoryIdx, i, DESKTOP_DAMAGE_COUNT);
+
+        if (!cursor->visible)
+          continue;
+
         accumulated->count += egl_screenToDesktop(
-          accumulated->rects + accumulated->count, matrix, damage + j,
+          accumulated->rects + accumulated->count, matrix, &cursor->rect,
           this->format.frameWidth, this->format.frameHeight
         );
-    }
+        refresh[refreshCount++] = cursor->rect;
+      }
 
     accumulated->count = rectsMergeOverlapping(accumulated->rects, accumulated->count);
   }
   ++this->overlayHistoryIdx;
 
+  egl_gpuTimerBegin();
   if (this->destRect.w > 0 && this->destRect.h > 0)
   {
     if (egl_desktopRender(this->desktop,
@@ -1105,18 +1682,38 @@ static bool egl_render(LG_Renderer * renderer, LG_RendererRotate rotate,
         this->scaleX    , this->scaleY    ,
         this->scaleType , rotate, renderAll ? NULL : accumulated))
     {
-      cursorState = egl_cursorRender(this->cursor,
-          (this->format.rotate + rotate) % LG_ROTATE_MAX,
-          this->width, this->height);
+      if (this->record && newFrame && videoRecord_active())
+      {
+        unsigned int w, h;
+        const GLuint tex = egl_desktopGetOutput(this->desktop,
+            videoRecord_filtered(), &w, &h);
+        if (tex)
+          egl_recordFrame(this->record, tex, w, h);
+      }
+
+      cursorState = cursorNext;
+      if (!cursorSkip)
+      {
+        egl_cursorRender(this->cursor);
+        egl_gpuTimerMark("cursor");
+
+        // the letterbox is drawn over the cursor
+        if (cursorNext.visible)
+          refresh[refreshCount++] = cursorNext.rect;
+      }
     }
     else
       hasOverlay = true;
   }
 
-  renderLetterBox(this);
+  renderLetterBox(this, refresh, windowAll ? -1 : refreshCount);
+
+  if (!this->showSpice)
+    hasOverlay |= egl_renderSources(this, rotate);
 
   hasOverlay |= egl_damageRender(this->damage, rotate, newFrame ? desktopDamage : NULL);
   hasOverlay |= invalidateWindow;
+  egl_gpuTimerMark("damage");
 
   struct Rect damage[KVMFR_MAX_DAMAGE_RECTS + MAX_OVERLAY_RECTS + 2];
   int damageIdx = app_renderOverlay(damage, MAX_OVERLAY_RECTS);
@@ -1130,16 +1727,18 @@ static bool egl_render(LG_Renderer * renderer, LG_RendererRotate rotate,
       // fallthrough
     default:
       ImGui_ImplOpenGL3_NewFrame();
-      ImGui_ImplOpenGL3_RenderDrawData(igGetDrawData());
+      if (this->overlay)
+        egl_overlayRender(this->overlay, igGetDrawData());
+      else
+        ImGui_ImplOpenGL3_RenderDrawData(igGetDrawData());
+      egl_gpuTimerMark("overlay");
 
       for (int i = 0; i < damageIdx; ++i)
         damage[i].y = this->height - damage[i].y - damage[i].h;
   }
 
-  if (damageIdx >= 0 && cursorState.visible)
-    damage[damageIdx++] = cursorState.rect;
-
   int overlayHistoryIdx = this->overlayHistoryIdx % DESKTOP_DAMAGE_COUNT;
+  this->cursorHistory[overlayHistoryIdx] = cursorState;
   if (hasOverlay)
     this->overlayHistoryCount[overlayHistoryIdx] = -1;
   else
@@ -1149,24 +1748,40 @@ static bool egl_render(LG_Renderer * renderer, LG_RendererRotate rotate,
     this->overlayHistoryCount[overlayHistoryIdx] = damageIdx;
   }
 
+  // a skipped cursor is unchanged since the last frame
+  if (damageIdx >= 0 && cursorState.visible && !cursorSkip)
+    damage[damageIdx++] = cursorState.rect;
+
   if (!hasOverlay && !this->hadOverlay)
   {
-    if (this->cursorLast.visible)
+    if (this->cursorLast.visible && !cursorSkip)
       damage[damageIdx++] = this->cursorLast.rect;
 
-    if (desktopDamage->count == -1)
-      // -1 damage count means invalidating entire window.
-      damageIdx = 0;
+    if (desktopDamage->count == -1 || !spreadValid)
+    {
+      // the whole desktop changed, the bars around it are as they were
+      const int x1 = this->destRect.x;
+      const int y1 = this->destRect.y;
+      const int x2 = ceil(this->destRect.x + this->destRect.w);
+      const int y2 = ceil(this->destRect.y + this->destRect.h);
+      damage[damageIdx++] = (struct Rect) {
+        .x = x1,
+        .y = this->height - y2,
+        .w = x2 - x1,
+        .h = y2 - y1
+      };
+    }
     else
     {
-      double matrix[6];
-      egl_desktopToScreenMatrix(matrix,
-          this->format.frameWidth, this->format.frameHeight,
-          this->translateX, this->translateY, this->scaleX, this->scaleY, rotate,
-          this->width, this->height);
+      const double * matrix = egl_getDamageMatrix(this, rotate)->toScreen;
 
       for (int i = 0; i < desktopDamage->count; ++i)
-        damage[damageIdx++] = egl_desktopToScreen(matrix, desktopDamage->rects + i);
+      {
+        const struct FrameDamageRect rect = growDesktopRect(
+            desktopDamage->rects + i, spreadX, spreadY,
+            this->format.frameWidth, this->format.frameHeight);
+        damage[damageIdx++] = egl_desktopToScreen(matrix, &rect);
+      }
     }
   }
   else
@@ -1175,8 +1790,10 @@ static bool egl_render(LG_Renderer * renderer, LG_RendererRotate rotate,
   this->hadOverlay = hasOverlay;
   this->cursorLast = cursorState;
 
+  egl_gpuTimerEnd();
   preSwap(udata);
   app_eglSwapBuffers(this->display, this->surface, damage, this->noSwapDamage ? 0 : damageIdx);
+  egl_renderLimitFence();
   return true;
 }
 
@@ -1246,27 +1863,38 @@ static void egl_spiceShow(LG_Renderer * renderer, bool show)
   egl_desktopSpiceShow(this->desktop, show);
 }
 
+static void egl_setPowerSave(LG_Renderer * renderer, bool enable)
+{
+  struct Inst * this = UPCAST(struct Inst, renderer);
+  egl_desktopSetPowerSave(this->desktop, enable);
+}
+
 struct LG_RendererOps LGR_EGL =
 {
-  .getName       = egl_getName,
-  .setup         = egl_setup,
-  .create        = egl_create,
-  .initialize    = egl_initialize,
-  .deinitialize  = egl_deinitialize,
-  .supports      = egl_supports,
-  .onRestart     = egl_onRestart,
-  .onResize      = egl_onResize,
-  .onMouseShape  = egl_onMouseShape,
-  .onMouseEvent  = egl_onMouseEvent,
-  .onFrameFormat = egl_onFrameFormat,
-  .onFrame       = egl_onFrame,
-  .renderStartup = egl_renderStartup,
-  .render        = egl_render,
-  .createTexture = egl_createTexture,
-  .freeTexture   = egl_freeTexture,
+  .getName            = egl_getName,
+  .setup              = egl_setup,
+  .create             = egl_create,
+  .initialize         = egl_initialize,
+  .deinitialize       = egl_deinitialize,
+  .supports           = egl_supports,
+  .onRestart          = egl_onRestart,
+  .onResize           = egl_onResize,
+  .onMouseShape       = egl_onMouseShape,
+  .onMouseShapeCached = egl_onMouseShapeCached,
+  .onMouseEvent       = egl_onMouseEvent,
+  .onFrameFormat      = egl_onFrameFormat,
+  .onFrame            = egl_onFrame,
+  .onSourceFormat     = egl_onSourceFormat,
+  .onSourceFrame      = egl_onSourceFrame,
+  .onSourceStop       = egl_onSourceStop,
+  .renderStartup      = egl_renderStartup,
+  .render             = egl_render,
+  .createTexture      = egl_createTexture,
+  .freeTexture        = egl_freeTexture,
 
   .spiceConfigure  = egl_spiceConfigure,
   .spiceDrawFill   = egl_spiceDrawFill,
   .spiceDrawBitmap = egl_spiceDrawBitmap,
-  .spiceShow       = egl_spiceShow
+  .spiceShow       = egl_spiceShow,
+  .setPowerSave    = egl_setPowerSave
 };
@@ -37,7 +37,9 @@ typedef enum EGL_PixelFormat
   EGL_PF_RGBA,
   EGL_PF_BGRA,
   EGL_PF_RGBA10,
-  EGL_PF_RGBA16F
+  EGL_PF_RGBA16F,
+  EGL_PF_NV12,     // RGBA8 texels holding the NV12 planes, see kvmfrFrameRows
+  EGL_PF_RGBA10_PQ // RGBA10 holding scRGB encoded with the BT.2100 PQ curve
 }
 EGL_PixelFormat;
 
@@ -33,6 +33,9 @@ typedef struct EGL_FilterRects
   EGL_DesktopRects * rects;
   GLfloat * matrix;
   int width, height;
+
+  /* the area to process in desktop space, a count < 0 is the full frame */
+  const struct DamageRects * damage;
 }
 EGL_FilterRects;
 
@@ -49,6 +52,9 @@ typedef struct EGL_FilterOps
   /* the type of this filter */
   EGL_FilterType type;
 
+  /* set if the filter is skipped while the client saves power */
+  bool costly;
+
   /* early initialization for registration of options */
   void (*earlyInit)(void);
 
@@ -77,10 +83,19 @@ typedef struct EGL_FilterOps
   void (*setOutputResHint)(EGL_Filter * filter,
       unsigned int x, unsigned int y);
 
+  /* set if the host lowered the resolution of the frames to keep up
+   * this is optional */
+  void (*setHostScaled)(EGL_Filter * filter, bool hostScaled);
+
   /* returns the output resolution of the filter */
   void (*getOutputRes)(EGL_Filter * filter,
       unsigned int *x, unsigned int *y);
 
+  /* returns the radius in input pixels of the neighbourhood an output pixel
+   * depends on, this is used to limit the filter to the damaged area
+   * this is optional, filters without it always process the full frame */
+  int (*getRadius)(EGL_Filter * filter);
+
   /* prepare the shader for use
    * A filter can return false to bypass it */
   bool (*prepare)(EGL_Filter * filter);
@@ -145,12 +160,26 @@ static inline void egl_filterSetOutputResHint(EGL_Filter * filter,
     filter->ops.setOutputResHint(filter, x, y);
 }
 
+static inline void egl_filterSetHostScaled(EGL_Filter * filter,
+    bool hostScaled)
+{
+  if (filter->ops.setHostScaled)
+    filter->ops.setHostScaled(filter, hostScaled);
+}
+
 static inline void egl_filterGetOutputRes(EGL_Filter * filter,
     unsigned int *x, unsigned int *y)
 {
   return filter->ops.getOutputRes(filter, x, y);
 }
 
+static inline int egl_filterGetRadius(EGL_Filter * filter)
+{
+  if (filter->ops.getRadius)
+    return filter->ops.getRadius(filter);
+  return -1;
+}
+
 static inline bool egl_filterPrepare(EGL_Filter * filter)
 {
   return filter->ops.prepare(filter);
@@ -43,6 +43,11 @@ DownscaleFilter;
 
 #define DOWNSCALE_COUNT (DOWNSCALE_LANCZOS2 + 1)
 
+/* above a 2x ratio the linear and lanczos filters skip over source pixels, so
+ * the source is first halved with 2x box reductions until the ratio left is
+ * at most 2x. This many allows for a 512x ratio */
+#define DOWNSCALE_MAX_LEVELS 8
+
 const char *filterNames[DOWNSCALE_COUNT] = {
   "Nearest pixel",
   "Linear",
@@ -68,6 +73,9 @@ typedef struct EGL_FilterDownscale
 
   EGL_Framebuffer * fb;
   GLuint            sampler[2];
+
+  EGL_Framebuffer * levels[DOWNSCALE_MAX_LEVELS];
+  unsigned int      levelCount;
 }
 EGL_FilterDownscale;
 
@@ -245,6 +253,9 @@ static void egl_filterDownscaleFree(EGL_Filter * filter)
   egl_shaderFree(&this->linear);
   egl_shaderFree(&this->lanczos2);
   egl_framebufferFree(&this->fb);
+  for (int i = 0; i < DOWNSCALE_MAX_LEVELS; ++i)
+    if (this->levels[i])
+      egl_framebufferFree(&this->levels[i]);
   glDeleteSamplers(ARRAY_LENGTH(this->sampler), this->sampler);
   free(this);
 }
@@ -286,6 +297,8 @@ static bool egl_filterDownscaleImguiConfig(EGL_Filter * filter)
       ImGuiSliderFlags_Logarithmic | ImGuiSliderFlags_NoInput);
 
   igText("Resolution: %dx%d", this->width, this->height);
+  if (this->levelCount > 0)
+    igText("Box reductions: %u", this->levelCount);
 
   if (pixelSize != this->pixelSize)
   {
@@ -330,6 +343,8 @@ static bool egl_filterDownscaleSetup(EGL_Filter * filter,
 {
   EGL_FilterDownscale * this = UPCAST(EGL_FilterDownscale, filter);
 
+  const unsigned int inputWidth  = width;
+  const unsigned int inputHeight = height;
   width  = (float)width  / this->pixelSize;
   height = (float)height / this->pixelSize;
 
@@ -345,6 +360,25 @@ static bool egl_filterDownscaleSetup(EGL_Filter * filter,
   if (!egl_framebufferSetup(this->fb, pixFmt, width, height))
     return false;
 
+  // nearest picks source pixels on purpose and is never reduced first
+  this->levelCount = 0;
+  if (this->filter != DOWNSCALE_NEAREST)
+    for (float ratio = this->pixelSize;
+        ratio > 2.0f && this->levelCount < DOWNSCALE_MAX_LEVELS; ratio /= 2.0f)
+    {
+      const unsigned int level = this->levelCount;
+      const unsigned int w = max(inputWidth  >> (level + 1), 1U);
+      const unsigned int h = max(inputHeight >> (level + 1), 1U);
+
+      if (!this->levels[level] && !egl_framebufferInit(&this->levels[level]))
+        return false;
+
+      if (!egl_framebufferSetup(this->levels[level], pixFmt, w, h))
+        return false;
+
+      ++this->levelCount;
+    }
+
   this->pixFmt   = pixFmt;
   this->width    = width;
   this->height   = height;
@@ -361,6 +395,17 @@ static void egl_filterDownscaleGetOutputRes(EGL_Filter * filter,
   *height = this->height;
 }
 
+static int egl_filterDownscaleGetRadius(EGL_Filter * filter)
+{
+  EGL_FilterDownscale * this = UPCAST(EGL_FilterDownscale, filter);
+
+  // Lanczos and the nearest offsets reach two output pixels out
+  const int radius = (int)ceilf(this->pixelSize * 2.0f) + 1;
+
+  // each box reduction reaches one pixel of its input further
+  return radius + (this->levelCount ? (1 << this->levelCount) : 0);
+}
+
 static bool egl_filterDownscalePrepare(EGL_Filter * filter)
 {
   EGL_FilterDownscale * this = UPCAST(EGL_FilterDownscale, filter);
@@ -390,6 +435,22 @@ static GLuint egl_filterDownscaleRun(EGL_Filter * filter,
 {
   EGL_FilterDownscale * this = UPCAST(EGL_FilterDownscale, filter);
 
+  /* sampling linearly at the centre of each output pixel averages the 2x2
+   * input pixels below it */
+  for (unsigned int i = 0; i < this->levelCount; ++i)
+  {
+    egl_framebufferBind(this->levels[i]);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glBindSampler(0, this->sampler[1]);
+
+    egl_shaderUse(this->linear);
+    egl_filterRectsRender(this->linear, rects);
+
+    texture = egl_framebufferGetTexture(this->levels[i]);
+  }
+
   egl_framebufferBind(this->fb);
 
   glActiveTexture(GL_TEXTURE0);
@@ -437,6 +498,7 @@ EGL_FilterOps egl_filterDownscaleOps =
   .loadState    = egl_filterDownscaleLoadState,
   .setup        = egl_filterDownscaleSetup,
   .getOutputRes = egl_filterDownscaleGetOutputRes,
+  .getRadius    = egl_filterDownscaleGetRadius,
   .prepare      = egl_filterDownscalePrepare,
   .run          = egl_filterDownscaleRun
 };
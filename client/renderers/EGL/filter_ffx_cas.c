@@ -20,6 +20,7 @@
 
 #include "filter.h"
 #include "framebuffer.h"
+#include "compute.h"
 
 #include "common/countedbuffer.h"
 #include "common/debug.h"
@@ -29,6 +30,7 @@
 
 #include "basic.vert.h"
 #include "ffx_cas.frag.h"
+#include "ffx_cas.comp.h"
 
 typedef struct EGL_FilterFFXCAS
 {
@@ -45,6 +47,12 @@ typedef struct EGL_FilterFFXCAS
 
   EGL_Framebuffer * fb;
   GLuint            sampler;
+
+  // tiled compute path
+  bool               useCompute;
+  EGL_Shader       * compute;
+  EGL_ComputeImage * computeImage;
+  const char       * computeDefines;
 }
 EGL_FilterFFXCAS;
 
@@ -148,6 +156,12 @@ static bool egl_filterFFXCASInit(EGL_Filter ** filter)
   glSamplerParameteri(this->sampler, GL_TEXTURE_WRAP_S    , GL_CLAMP_TO_EDGE);
   glSamplerParameteri(this->sampler, GL_TEXTURE_WRAP_T    , GL_CLAMP_TO_EDGE);
 
+  // the compute path is optional, the fragment pass is the fallback
+  if (egl_computeSupported())
+    this->useCompute =
+      egl_shaderInit(&this->compute) &&
+      egl_computeImageInit(&this->computeImage);
+
   *filter = &this->base;
   return true;
 
@@ -169,6 +183,8 @@ static void egl_filterFFXCASFree(EGL_Filter * filter)
   egl_shaderFree(&this->shader);
   countedBufferRelease(&this->consts);
   egl_framebufferFree(&this->fb);
+  egl_shaderFree(&this->compute);
+  egl_computeImageFree(&this->computeImage);
   glDeleteSamplers(1, &this->sampler);
   free(this);
 }
@@ -230,7 +246,35 @@ static bool egl_filterFFXCASSetup(EGL_Filter * filter,
   if (pixFmt == this->pixFmt && this->width == width && this->height == height)
     return true;
 
-  if (!egl_framebufferSetup(this->fb, pixFmt, width, height))
+  if (this->useCompute)
+  {
+    const char * defines = egl_computeImageDefines(pixFmt);
+    if (defines != this->computeDefines)
+    {
+      this->computeDefines = defines;
+      if (!egl_shaderCompileCompute(this->compute,
+            b_shader_ffx_cas_comp, b_shader_ffx_cas_comp_size, defines))
+      {
+        DEBUG_WARN("Failed to compile the CAS compute shader, using the fragment pass");
+        this->useCompute = false;
+      }
+      else
+        egl_shaderSetUniforms(this->compute, &(EGL_Uniform) {
+          .type     = EGL_UNIFORM_TYPE_4UIV,
+          .location = egl_shaderGetUniform(this->compute, "uConsts"),
+          .v        = this->consts,
+        }, 1);
+    }
+
+    if (this->useCompute &&
+        !egl_computeImageSetup(this->computeImage, pixFmt, width, height))
+    {
+      DEBUG_WARN("Failed to setup the CAS compute image, using the fragment pass");
+      this->useCompute = false;
+    }
+  }
+
+  if (!this->useCompute && !egl_framebufferSetup(this->fb, pixFmt, width, height))
     return false;
 
   this->pixFmt   = pixFmt;
@@ -250,6 +294,12 @@ static void egl_filterFFXCASGetOutputRes(EGL_Filter * filter,
   *height = this->height;
 }
 
+static int egl_filterFFXCASGetRadius(EGL_Filter * filter)
+{
+  // the 3x3 neighbourhood
+  return 1;
+}
+
 static bool egl_filterFFXCASPrepare(EGL_Filter * filter)
 {
   EGL_FilterFFXCAS * this = UPCAST(EGL_FilterFFXCAS, filter);
@@ -267,6 +317,10 @@ static GLuint egl_filterFFXCASRun(EGL_Filter * filter,
 {
   EGL_FilterFFXCAS * this = UPCAST(EGL_FilterFFXCAS, filter);
 
+  if (this->useCompute)
+    return egl_computeImageRun(this->computeImage, this->compute, texture,
+        this->sampler, rects);
+
   egl_framebufferBind(this->fb);
 
   glActiveTexture(GL_TEXTURE0);
@@ -284,6 +338,7 @@ EGL_FilterOps egl_filterFFXCASOps =
   .id           = "ffxCAS",
   .name         = "AMD FidelityFX CAS",
   .type         = EGL_FILTER_TYPE_EFFECT,
+  .costly       = true,
   .earlyInit    = egl_filterFFXCASEarlyInit,
   .init         = egl_filterFFXCASInit,
   .free         = egl_filterFFXCASFree,
@@ -292,6 +347,7 @@ EGL_FilterOps egl_filterFFXCASOps =
   .loadState    = egl_filterFFXCASLoadState,
   .setup        = egl_filterFFXCASSetup,
   .getOutputRes = egl_filterFFXCASGetOutputRes,
+  .getRadius    = egl_filterFFXCASGetRadius,
   .prepare      = egl_filterFFXCASPrepare,
   .run          = egl_filterFFXCASRun
 };
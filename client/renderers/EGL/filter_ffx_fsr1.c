@@ -20,6 +20,7 @@
 
 #include "filter.h"
 #include "framebuffer.h"
+#include "compute.h"
 
 #include "common/array.h"
 #include "common/countedbuffer.h"
@@ -31,6 +32,7 @@
 #include "basic.vert.h"
 #include "ffx_fsr1_easu.frag.h"
 #include "ffx_fsr1_rcas.frag.h"
+#include "ffx_fsr1.comp.h"
 
 typedef struct EGL_FilterFFXFSR1
 {
@@ -38,6 +40,7 @@ typedef struct EGL_FilterFFXFSR1
 
   EGL_Shader    * easu, * rcas;
   bool            enable, active;
+  bool            adaptive, hostScaled;
   float           sharpness;
   CountedBuffer * consts;
   EGL_Uniform     easuUniform[2], rcasUniform;
@@ -50,6 +53,12 @@ typedef struct EGL_FilterFFXFSR1
 
   EGL_Framebuffer * easuFb, * rcasFb;
   GLuint            sampler;
+
+  // fused Easu + Rcas compute path
+  bool               useCompute;
+  EGL_Shader       * compute;
+  EGL_ComputeImage * computeImage;
+  const char       * computeDefines;
 }
 EGL_FilterFFXFSR1;
 
@@ -65,6 +74,14 @@ static void egl_filterFFXFSR1EarlyInit(void)
       .type          = OPTION_TYPE_BOOL,
       .value.x_bool  = false
     },
+    {
+      .module        = "eglFilter",
+      .name          = "ffxFSRAdaptive",
+      .description   = "Use AMD FidelityFX FSR while the host has lowered the resolution",
+      .preset        = true,
+      .type          = OPTION_TYPE_BOOL,
+      .value.x_bool  = true
+    },
     {
       .module        = "eglFilter",
       .name          = "ffxFSRSharpness",
@@ -79,6 +96,12 @@ static void egl_filterFFXFSR1EarlyInit(void)
   option_register(options);
 }
 
+// enabled, or turned on for as long as the host has lowered the resolution
+static inline bool isEnabled(const EGL_FilterFFXFSR1 * this)
+{
+  return this->enable || (this->adaptive && this->hostScaled);
+}
+
 static void rcasUpdateUniform(EGL_FilterFFXFSR1 * this)
 {
   ffxFsrRcasConst(this->rcasUniform.ui, 2.0f - this->sharpness * 2.0f);
@@ -89,6 +112,7 @@ static void egl_filterFFXFSR1SaveState(EGL_Filter * filter)
   EGL_FilterFFXFSR1 * this = UPCAST(EGL_FilterFFXFSR1, filter);
 
   option_set_bool ("eglFilter", "ffxFSR", this->enable);
+  option_set_bool ("eglFilter", "ffxFSRAdaptive", this->adaptive);
   option_set_float("eglFilter", "ffxFSRSharpness", this->sharpness);
 }
 
@@ -97,6 +121,7 @@ static void egl_filterFFXFSR1LoadState(EGL_Filter * filter)
   EGL_FilterFFXFSR1 * this = UPCAST(EGL_FilterFFXFSR1, filter);
 
   this->enable    = option_get_bool ("eglFilter", "ffxFSR");
+  this->adaptive  = option_get_bool ("eglFilter", "ffxFSRAdaptive");
   this->sharpness = option_get_float("eglFilter", "ffxFSRSharpness");
 }
 
@@ -178,6 +203,12 @@ static bool egl_filterFFXFSR1Init(EGL_Filter ** filter)
   glSamplerParameteri(this->sampler, GL_TEXTURE_WRAP_S    , GL_CLAMP_TO_EDGE);
   glSamplerParameteri(this->sampler, GL_TEXTURE_WRAP_T    , GL_CLAMP_TO_EDGE);
 
+  // the compute path is optional, the fragment passes are the fallback
+  if (egl_computeSupported())
+    this->useCompute =
+      egl_shaderInit(&this->compute) &&
+      egl_computeImageInit(&this->computeImage);
+
   *filter = &this->base;
   return true;
 
@@ -207,6 +238,8 @@ static void egl_filterFFXFSR1Free(EGL_Filter * filter)
   countedBufferRelease(&this->consts);
   egl_framebufferFree(&this->easuFb);
   egl_framebufferFree(&this->rcasFb);
+  egl_shaderFree(&this->compute);
+  egl_computeImageFree(&this->computeImage);
   glDeleteSamplers(1, &this->sampler);
   free(this);
 }
@@ -226,6 +259,14 @@ static bool egl_filterFFXFSR1ImguiConfig(EGL_Filter * filter)
     redraw = true;
   }
 
+  bool adaptive = this->adaptive;
+  igCheckbox("Enable while the host lowers the resolution", &adaptive);
+  if (adaptive != this->adaptive)
+  {
+    this->adaptive = adaptive;
+    redraw = true;
+  }
+
   if (this->active)
   {
     double dimScale = (double) this->width / this->inWidth;
@@ -254,7 +295,7 @@ static bool egl_filterFFXFSR1ImguiConfig(EGL_Filter * filter)
        name = "Performance";
     else
        name = "worse than Performance";
-    igText("Equivalent quality mode: %s%s", name, this->enable ? "" : ", inactive");
+    igText("Equivalent quality mode: %s%s", name, isEnabled(this) ? "" : ", inactive");
   }
   else
     igText("Equivalent quality mode: not upscaling, inactive");
@@ -334,12 +375,19 @@ static void egl_filterFFXFSR1SetOutputResHint(EGL_Filter * filter,
   this->prepared    = false;
 }
 
+static void egl_filterFFXFSR1SetHostScaled(EGL_Filter * filter,
+    bool hostScaled)
+{
+  EGL_FilterFFXFSR1 * this = UPCAST(EGL_FilterFFXFSR1, filter);
+  this->hostScaled = hostScaled;
+}
+
 static bool egl_filterFFXFSR1Setup(EGL_Filter * filter,
     enum EGL_PixelFormat pixFmt, unsigned int width, unsigned int height)
 {
   EGL_FilterFFXFSR1 * this = UPCAST(EGL_FilterFFXFSR1, filter);
 
-  if (!this->enable)
+  if (!isEnabled(this))
     return false;
 
   this->active = this->width > width && this->height > height;
@@ -350,11 +398,36 @@ static bool egl_filterFFXFSR1Setup(EGL_Filter * filter,
       width == this->inWidth && height == this->inHeight)
     return true;
 
-  if (!egl_framebufferSetup(this->easuFb, pixFmt, this->width, this->height))
-    return false;
+  if (this->useCompute)
+  {
+    const char * defines = egl_computeImageDefines(pixFmt);
+    if (defines != this->computeDefines)
+    {
+      this->computeDefines = defines;
+      if (!egl_shaderCompileCompute(this->compute,
+            b_shader_ffx_fsr1_comp, b_shader_ffx_fsr1_comp_size, defines))
+      {
+        DEBUG_WARN("Failed to compile the FSR compute shader, using fragment passes");
+        this->useCompute = false;
+      }
+    }
 
-  if (!egl_framebufferSetup(this->rcasFb, pixFmt, this->width, this->height))
-    return false;
+    if (this->useCompute && !egl_computeImageSetup(this->computeImage,
+          pixFmt, this->width, this->height))
+    {
+      DEBUG_WARN("Failed to setup the FSR compute image, using fragment passes");
+      this->useCompute = false;
+    }
+  }
+
+  if (!this->useCompute)
+  {
+    if (!egl_framebufferSetup(this->easuFb, pixFmt, this->width, this->height))
+      return false;
+
+    if (!egl_framebufferSetup(this->rcasFb, pixFmt, this->width, this->height))
+      return false;
+  }
 
   this->inWidth     = width;
   this->inHeight    = height;
@@ -378,6 +451,12 @@ static void egl_filterFFXFSR1GetOutputRes(EGL_Filter * filter,
   *height = this->height;
 }
 
+static int egl_filterFFXFSR1GetRadius(EGL_Filter * filter)
+{
+  // the 12 tap Easu kernel plus the Rcas cross which is under an input pixel
+  return 3;
+}
+
 static bool egl_filterFFXFSR1Prepare(EGL_Filter * filter)
 {
   EGL_FilterFFXFSR1 * this = UPCAST(EGL_FilterFFXFSR1, filter);
@@ -388,8 +467,18 @@ static bool egl_filterFFXFSR1Prepare(EGL_Filter * filter)
   if (this->prepared)
     return true;
 
-  egl_shaderSetUniforms(this->easu, this->easuUniform, ARRAY_LENGTH(this->easuUniform));
-  egl_shaderSetUniforms(this->rcas, &this->rcasUniform, 1);
+  if (this->useCompute)
+  {
+    EGL_Uniform uniforms[2] = { this->easuUniform[0], this->rcasUniform };
+    uniforms[0].location = egl_shaderGetUniform(this->compute, "uEasuConsts");
+    uniforms[1].location = egl_shaderGetUniform(this->compute, "uRcasConsts");
+    egl_shaderSetUniforms(this->compute, uniforms, ARRAY_LENGTH(uniforms));
+  }
+  else
+  {
+    egl_shaderSetUniforms(this->easu, this->easuUniform, ARRAY_LENGTH(this->easuUniform));
+    egl_shaderSetUniforms(this->rcas, &this->rcasUniform, 1);
+  }
   this->prepared = true;
 
   return true;
@@ -400,6 +489,11 @@ static GLuint egl_filterFFXFSR1Run(EGL_Filter * filter,
 {
   EGL_FilterFFXFSR1 * this = UPCAST(EGL_FilterFFXFSR1, filter);
 
+  // single dispatch, Rcas reads the Easu output from shared memory
+  if (this->useCompute)
+    return egl_computeImageRun(this->computeImage, this->compute, texture,
+        this->sampler, rects);
+
   // pass 1, Easu
   egl_framebufferBind(this->easuFb);
   glActiveTexture(GL_TEXTURE0);
@@ -426,6 +520,7 @@ EGL_FilterOps egl_filterFFXFSR1Ops =
   .id               = "ffxFSR1",
   .name             = "AMD FidelityFX FSR",
   .type             = EGL_FILTER_TYPE_UPSCALE,
+  .costly           = true,
   .earlyInit        = egl_filterFFXFSR1EarlyInit,
   .init             = egl_filterFFXFSR1Init,
   .free             = egl_filterFFXFSR1Free,
@@ -434,7 +529,9 @@ EGL_FilterOps egl_filterFFXFSR1Ops =
   .loadState        = egl_filterFFXFSR1LoadState,
   .setup            = egl_filterFFXFSR1Setup,
   .setOutputResHint = egl_filterFFXFSR1SetOutputResHint,
+  .setHostScaled    = egl_filterFFXFSR1SetHostScaled,
   .getOutputRes     = egl_filterFFXFSR1GetOutputRes,
+  .getRadius        = egl_filterFFXFSR1GetRadius,
   .prepare          = egl_filterFFXFSR1Prepare,
   .run              = egl_filterFFXFSR1Run
 };
@@ -0,0 +1,162 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "filter.h"
+#include "framebuffer.h"
+
+#include "common/debug.h"
+
+#include "basic.vert.h"
+#include "nv12.frag.h"
+
+/* converts NV12 frames to RGB, this is not a user selectable filter, the post
+ * process runs it ahead of the others when the desktop texture is NV12 */
+typedef struct EGL_FilterNV12
+{
+  EGL_Filter base;
+
+  EGL_Shader      * shader;
+  EGL_Framebuffer * fb;
+  unsigned int      width, height;
+}
+EGL_FilterNV12;
+
+static bool egl_filterNV12Init(EGL_Filter ** filter)
+{
+  EGL_FilterNV12 * this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("Failed to allocate ram");
+    return false;
+  }
+
+  if (!egl_shaderInit(&this->shader))
+  {
+    DEBUG_ERROR("Failed to initialize the shader");
+    goto error_this;
+  }
+
+  if (!egl_shaderCompile(this->shader,
+        b_shader_basic_vert, b_shader_basic_vert_size,
+        b_shader_nv12_frag , b_shader_nv12_frag_size)
+     )
+  {
+    DEBUG_ERROR("Failed to compile the shader");
+    goto error_shader;
+  }
+
+  if (!egl_framebufferInit(&this->fb))
+  {
+    DEBUG_ERROR("Failed to initialize the framebuffer");
+    goto error_shader;
+  }
+
+  *filter = &this->base;
+  return true;
+
+error_shader:
+  egl_shaderFree(&this->shader);
+
+error_this:
+  free(this);
+  return false;
+}
+
+static void egl_filterNV12Free(EGL_Filter * filter)
+{
+  EGL_FilterNV12 * this = UPCAST(EGL_FilterNV12, filter);
+
+  egl_shaderFree(&this->shader);
+  egl_framebufferFree(&this->fb);
+  free(this);
+}
+
+static bool egl_filterNV12Setup(EGL_Filter * filter,
+    enum EGL_PixelFormat pixFmt, unsigned int width, unsigned int height)
+{
+  EGL_FilterNV12 * this = UPCAST(EGL_FilterNV12, filter);
+
+  if (pixFmt != EGL_PF_NV12)
+    return false;
+
+  // the input is the texel image of both planes
+  width  = width  * 4;
+  height = height * 2 / 3;
+
+  if (this->width == width && this->height == height)
+    return true;
+
+  if (!egl_framebufferSetup(this->fb, EGL_PF_RGBA, width, height))
+    return false;
+
+  this->width  = width;
+  this->height = height;
+  return true;
+}
+
+static void egl_filterNV12GetOutputRes(EGL_Filter * filter,
+    unsigned int *width, unsigned int *height)
+{
+  EGL_FilterNV12 * this = UPCAST(EGL_FilterNV12, filter);
+  *width  = this->width;
+  *height = this->height;
+}
+
+static int egl_filterNV12GetRadius(EGL_Filter * filter)
+{
+  // the damage is always aligned to whole chroma samples
+  return 0;
+}
+
+static bool egl_filterNV12Prepare(EGL_Filter * filter)
+{
+  return true;
+}
+
+static GLuint egl_filterNV12Run(EGL_Filter * filter,
+    EGL_FilterRects * rects, GLuint texture)
+{
+  EGL_FilterNV12 * this = UPCAST(EGL_FilterNV12, filter);
+
+  egl_framebufferBind(this->fb);
+
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glBindSampler(0, 0);
+
+  egl_shaderUse(this->shader);
+  egl_filterRectsRender(this->shader, rects);
+
+  return egl_framebufferGetTexture(this->fb);
+}
+
+EGL_FilterOps egl_filterNV12Ops =
+{
+  .id           = "nv12",
+  .name         = "NV12 to RGB",
+  .type         = EGL_FILTER_TYPE_EFFECT,
+  .init         = egl_filterNV12Init,
+  .free         = egl_filterNV12Free,
+  .setup        = egl_filterNV12Setup,
+  .getOutputRes = egl_filterNV12GetOutputRes,
+  .getRadius    = egl_filterNV12GetRadius,
+  .prepare      = egl_filterNV12Prepare,
+  .run          = egl_filterNV12Run
+};
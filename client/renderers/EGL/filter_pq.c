@@ -0,0 +1,157 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "filter.h"
+#include "framebuffer.h"
+
+#include "common/debug.h"
+
+#include "basic.vert.h"
+#include "pq.frag.h"
+
+/* decodes PQ encoded HDR frames to linear FP16, this is not a user selectable
+ * filter, the post process runs it ahead of the others for PQ textures */
+typedef struct EGL_FilterPQ
+{
+  EGL_Filter base;
+
+  EGL_Shader      * shader;
+  EGL_Framebuffer * fb;
+  unsigned int      width, height;
+}
+EGL_FilterPQ;
+
+static bool egl_filterPQInit(EGL_Filter ** filter)
+{
+  EGL_FilterPQ * this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("Failed to allocate ram");
+    return false;
+  }
+
+  if (!egl_shaderInit(&this->shader))
+  {
+    DEBUG_ERROR("Failed to initialize the shader");
+    goto error_this;
+  }
+
+  if (!egl_shaderCompile(this->shader,
+        b_shader_basic_vert, b_shader_basic_vert_size,
+        b_shader_pq_frag, b_shader_pq_frag_size)
+     )
+  {
+    DEBUG_ERROR("Failed to compile the shader");
+    goto error_shader;
+  }
+
+  if (!egl_framebufferInit(&this->fb))
+  {
+    DEBUG_ERROR("Failed to initialize the framebuffer");
+    goto error_shader;
+  }
+
+  *filter = &this->base;
+  return true;
+
+error_shader:
+  egl_shaderFree(&this->shader);
+
+error_this:
+  free(this);
+  return false;
+}
+
+static void egl_filterPQFree(EGL_Filter * filter)
+{
+  EGL_FilterPQ * this = UPCAST(EGL_FilterPQ, filter);
+
+  egl_shaderFree(&this->shader);
+  egl_framebufferFree(&this->fb);
+  free(this);
+}
+
+static bool egl_filterPQSetup(EGL_Filter * filter,
+    enum EGL_PixelFormat pixFmt, unsigned int width, unsigned int height)
+{
+  EGL_FilterPQ * this = UPCAST(EGL_FilterPQ, filter);
+
+  if (pixFmt != EGL_PF_RGBA10_PQ)
+    return false;
+
+  if (this->width == width && this->height == height)
+    return true;
+
+  if (!egl_framebufferSetup(this->fb, EGL_PF_RGBA16F, width, height))
+    return false;
+
+  this->width  = width;
+  this->height = height;
+  return true;
+}
+
+static void egl_filterPQGetOutputRes(EGL_Filter * filter,
+    unsigned int *width, unsigned int *height)
+{
+  EGL_FilterPQ * this = UPCAST(EGL_FilterPQ, filter);
+  *width  = this->width;
+  *height = this->height;
+}
+
+static int egl_filterPQGetRadius(EGL_Filter * filter)
+{
+  return 0;
+}
+
+static bool egl_filterPQPrepare(EGL_Filter * filter)
+{
+  return true;
+}
+
+static GLuint egl_filterPQRun(EGL_Filter * filter,
+    EGL_FilterRects * rects, GLuint texture)
+{
+  EGL_FilterPQ * this = UPCAST(EGL_FilterPQ, filter);
+
+  egl_framebufferBind(this->fb);
+
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glBindSampler(0, 0);
+
+  egl_shaderUse(this->shader);
+  egl_filterRectsRender(this->shader, rects);
+
+  return egl_framebufferGetTexture(this->fb);
+}
+
+EGL_FilterOps egl_filterPQOps =
+{
+  .id           = "pq",
+  .name         = "PQ to linear",
+  .type         = EGL_FILTER_TYPE_EFFECT,
+  .init         = egl_filterPQInit,
+  .free         = egl_filterPQFree,
+  .setup        = egl_filterPQSetup,
+  .getOutputRes = egl_filterPQGetOutputRes,
+  .getRadius    = egl_filterPQGetRadius,
+  .prepare      = egl_filterPQPrepare,
+  .run          = egl_filterPQRun
+};
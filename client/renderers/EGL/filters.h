@@ -23,3 +23,7 @@
 extern EGL_FilterOps egl_filterDownscaleOps;
 extern EGL_FilterOps egl_filterFFXCASOps;
 extern EGL_FilterOps egl_filterFFXFSR1Ops;
+
+// not user selectable, run by the post process to convert the texture format
+extern EGL_FilterOps egl_filterNV12Ops;
+extern EGL_FilterOps egl_filterPQOps;
@@ -20,17 +20,155 @@
 
 #include "framebuffer.h"
 #include "texture.h"
+#include "texture_util.h"
 
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "common/debug.h"
 
+/* the maximum number of textures the pool will track */
+#define FB_POOL_SIZE 32
+
+/* how many unused textures are kept around for a later resize to reuse */
+#define FB_POOL_MAX_IDLE 8
+
+struct FramebufferTex
+{
+  bool            allocated;
+  bool            inUse;
+  GLuint          tex;
+  EGL_PixelFormat pixFmt;
+  unsigned int    width, height;
+  uint64_t        lastUsed;
+};
+
+/* all filters render on the same context, so their targets are shared from a
+ * single pool. Textures are bucketed by their exact format and size as the
+ * shaders sample across the full texture, this still lets a resize back to a
+ * recent size, or filters swapping sizes, avoid a new allocation. */
+static struct
+{
+  struct FramebufferTex entries[FB_POOL_SIZE];
+  int                   users;
+  uint64_t              clock;
+}
+pool = { 0 };
+
 struct EGL_Framebuffer
 {
   GLuint fbo;
-  EGL_Texture * tex;
+  struct FramebufferTex * entry;
 };
 
+static void poolFreeEntry(struct FramebufferTex * entry)
+{
+  glDeleteTextures(1, &entry->tex);
+  entry->allocated = false;
+  entry->tex       = 0;
+}
+
+static void poolTrim(int maxIdle)
+{
+  for(;;)
+  {
+    int idle = 0;
+    struct FramebufferTex * oldest = NULL;
+    for(int i = 0; i < FB_POOL_SIZE; ++i)
+    {
+      struct FramebufferTex * entry = pool.entries + i;
+      if (!entry->allocated || entry->inUse)
+        continue;
+
+      ++idle;
+      if (!oldest || entry->lastUsed < oldest->lastUsed)
+        oldest = entry;
+    }
+
+    if (idle <= maxIdle)
+      return;
+
+    poolFreeEntry(oldest);
+  }
+}
+
+static struct FramebufferTex * poolAcquire(EGL_PixelFormat pixFmt,
+    unsigned int width, unsigned int height)
+{
+  struct FramebufferTex * slot = NULL;
+  for(int i = 0; i < FB_POOL_SIZE; ++i)
+  {
+    struct FramebufferTex * entry = pool.entries + i;
+    if (!entry->allocated)
+    {
+      if (!slot)
+        slot = entry;
+      continue;
+    }
+
+    if (entry->inUse || entry->pixFmt != pixFmt ||
+        entry->width != width || entry->height != height)
+      continue;
+
+    entry->inUse = true;
+    return entry;
+  }
+
+  if (!slot)
+  {
+    // evict the least recently used idle texture to make room
+    poolTrim(0);
+    for(int i = 0; i < FB_POOL_SIZE; ++i)
+      if (!pool.entries[i].allocated)
+      {
+        slot = pool.entries + i;
+        break;
+      }
+
+    if (!slot)
+    {
+      DEBUG_ERROR("Framebuffer pool exhausted");
+      return NULL;
+    }
+  }
+
+  const EGL_TexSetup setup =
+  {
+    .pixFmt = pixFmt,
+    .width  = width,
+    .height = height
+  };
+
+  EGL_TexFormat fmt;
+  if (!egl_texUtilGetFormat(&setup, &fmt))
+    return NULL;
+
+  glGenTextures(1, &slot->tex);
+  glBindTexture(GL_TEXTURE_2D, slot->tex);
+  glTexImage2D(GL_TEXTURE_2D, 0, fmt.intFormat, width, height, 0,
+      fmt.format, fmt.dataType, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  slot->allocated = true;
+  slot->inUse     = true;
+  slot->pixFmt    = pixFmt;
+  slot->width     = width;
+  slot->height    = height;
+  return slot;
+}
+
+static void poolRelease(struct FramebufferTex * entry)
+{
+  if (!entry)
+    return;
+
+  entry->inUse    = false;
+  entry->lastUsed = ++pool.clock;
+  poolTrim(FB_POOL_MAX_IDLE);
+}
+
 bool egl_framebufferInit(EGL_Framebuffer ** fb)
 {
   EGL_Framebuffer * this = calloc(1, sizeof(*this));
@@ -40,13 +178,8 @@ bool egl_framebufferInit(EGL_Framebuffer ** fb)
     return false;
   }
 
-  if (!egl_textureInit(&this->tex, NULL, EGL_TEXTYPE_BUFFER))
-  {
-    DEBUG_ERROR("Failed to initialize the texture");
-    return false;
-  }
-
   glGenFramebuffers(1, &this->fbo);
+  ++pool.users;
 
   *fb = this;
   return true;
@@ -56,30 +189,36 @@ void egl_framebufferFree(EGL_Framebuffer ** fb)
 {
   EGL_Framebuffer * this = *fb;
 
-  egl_textureFree(&this->tex);
+  poolRelease(this->entry);
+  glDeleteFramebuffers(1, &this->fbo);
   free(this);
   *fb = NULL;
+
+  // the last user is gone, release everything while the context is current
+  if (--pool.users == 0)
+    poolTrim(0);
 }
 
 bool egl_framebufferSetup(EGL_Framebuffer * this, enum EGL_PixelFormat pixFmt,
     unsigned int width, unsigned int height)
 {
-  if (!egl_textureSetup(this->tex, pixFmt, width, height, 0))
+  if (this->entry && this->entry->pixFmt == pixFmt &&
+      this->entry->width == width && this->entry->height == height)
+    return true;
+
+  struct FramebufferTex * entry = poolAcquire(pixFmt, width, height);
+  if (!entry)
   {
     DEBUG_ERROR("Failed to setup the texture");
     return false;
   }
 
-  GLuint tex;
-  egl_textureGet(this->tex, &tex, NULL, NULL);
-
-  glBindTexture(GL_TEXTURE_2D, tex);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  poolRelease(this->entry);
+  this->entry = entry;
 
   glBindFramebuffer(GL_FRAMEBUFFER, this->fbo);
   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-      GL_TEXTURE_2D, tex, 0);
+      GL_TEXTURE_2D, entry->tex, 0);
   glDrawBuffers(1, &(GLenum){GL_COLOR_ATTACHMENT0});
 
   GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
@@ -97,12 +236,10 @@ bool egl_framebufferSetup(EGL_Framebuffer * this, enum EGL_PixelFormat pixFmt,
 void egl_framebufferBind(EGL_Framebuffer * this)
 {
   glBindFramebuffer(GL_FRAMEBUFFER, this->fbo);
-  glViewport(0, 0, this->tex->format.width, this->tex->format.height);
+  glViewport(0, 0, this->entry->width, this->entry->height);
 }
 
 GLuint egl_framebufferGetTexture(EGL_Framebuffer * this)
 {
-  GLuint output;
-  egl_textureGet(this->tex, &output, NULL, NULL);
-  return output;
+  return this->entry ? this->entry->tex : 0;
 }
@@ -0,0 +1,218 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "gpu_timer.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "app.h"
+#include "egl_dynprocs.h"
+#include "util.h"
+#include "common/debug.h"
+#include "common/ringbuffer.h"
+#include "common/stringutils.h"
+
+// frames in flight before a set of queries is read back
+#define TIMER_FRAMES 4
+#define TIMER_MARKS  16
+#define TIMER_STAGES 16
+
+struct TimerFrame
+{
+  GLuint       queries[TIMER_MARKS + 1];
+  const char * names  [TIMER_MARKS];
+  int          count;
+  bool         pending;
+};
+
+struct TimerStage
+{
+  const char * name;
+  char       * graphName;
+  RingBuffer   timings;
+  GraphHandle  graph;
+  double       total;
+  unsigned int count;
+};
+
+static struct
+{
+  bool              enabled;
+  bool              recording;
+  int               current;
+  struct TimerFrame frames[TIMER_FRAMES];
+  struct TimerStage stages[TIMER_STAGES];
+  int               stageCount;
+}
+l_timer = { 0 };
+
+void egl_gpuTimerInit(bool enable, const char * gl_exts)
+{
+  if (!enable)
+    return;
+
+  if (!util_hasGLExt(gl_exts, "GL_EXT_disjoint_timer_query") ||
+      !g_egl_dynProcs.glQueryCounterEXT ||
+      !g_egl_dynProcs.glGetQueryObjectui64vEXT)
+  {
+    DEBUG_WARN("GL_EXT_disjoint_timer_query is not supported, "
+        "GPU timers disabled");
+    return;
+  }
+
+  for(int i = 0; i < TIMER_FRAMES; ++i)
+    glGenQueries(TIMER_MARKS + 1, l_timer.frames[i].queries);
+
+  l_timer.enabled = true;
+  DEBUG_INFO("GPU timers enabled");
+}
+
+void egl_gpuTimerFree(void)
+{
+  if (!l_timer.enabled)
+    return;
+
+  for(int i = 0; i < l_timer.stageCount; ++i)
+  {
+    struct TimerStage * stage = l_timer.stages + i;
+    if (stage->count)
+      DEBUG_INFO("GPU %-12s avg %7.3fms over %u frames", stage->name,
+          stage->total / stage->count, stage->count);
+
+    app_unregisterGraph(stage->graph);
+    ringbuffer_free(&stage->timings);
+    free(stage->graphName);
+  }
+
+  for(int i = 0; i < TIMER_FRAMES; ++i)
+    glDeleteQueries(TIMER_MARKS + 1, l_timer.frames[i].queries);
+
+  memset(&l_timer, 0, sizeof(l_timer));
+}
+
+static struct TimerStage * getStage(const char * name)
+{
+  for(int i = 0; i < l_timer.stageCount; ++i)
+    if (l_timer.stages[i].name == name)
+      return l_timer.stages + i;
+
+  if (l_timer.stageCount == TIMER_STAGES)
+    return NULL;
+
+  struct TimerStage * stage = l_timer.stages + l_timer.stageCount;
+  if (alloc_sprintf(&stage->graphName, "GPU %s", name) < 0)
+    return NULL;
+
+  stage->name    = name;
+  stage->timings = ringbuffer_new(256, sizeof(float));
+  stage->graph   = app_registerGraph(stage->graphName, stage->timings,
+      0.0f, 5.0f, NULL);
+  stage->total   = 0.0;
+  stage->count   = 0;
+
+  ++l_timer.stageCount;
+  return stage;
+}
+
+static bool collectFrame(struct TimerFrame * frame)
+{
+  GLuint available = 0;
+  glGetQueryObjectuiv(frame->queries[frame->count], GL_QUERY_RESULT_AVAILABLE,
+      &available);
+  if (!available)
+    return false;
+
+  GLuint64 start;
+  g_egl_dynProcs.glGetQueryObjectui64vEXT(frame->queries[0], GL_QUERY_RESULT,
+      &start);
+
+  for(int i = 0; i < frame->count; ++i)
+  {
+    GLuint64 end;
+    g_egl_dynProcs.glGetQueryObjectui64vEXT(frame->queries[i + 1],
+        GL_QUERY_RESULT, &end);
+
+    struct TimerStage * stage = getStage(frame->names[i]);
+    if (stage && end >= start)
+    {
+      const float ms = (end - start) * 1e-6f;
+      ringbuffer_push(stage->timings, &ms);
+      stage->total += ms;
+      ++stage->count;
+    }
+
+    start = end;
+  }
+
+  return true;
+}
+
+void egl_gpuTimerBegin(void)
+{
+  if (!l_timer.enabled)
+    return;
+
+  /* a disjoint operation such as a clock change makes every result that is in
+   * flight meaningless */
+  GLint disjoint = 0;
+  glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+  if (disjoint)
+    for(int i = 0; i < TIMER_FRAMES; ++i)
+      l_timer.frames[i].pending = false;
+
+  struct TimerFrame * frame = l_timer.frames + l_timer.current;
+  if (frame->pending)
+  {
+    // skip timing this frame rather than wait on the GPU
+    if (!collectFrame(frame))
+      return;
+    frame->pending = false;
+  }
+
+  frame->count = 0;
+  g_egl_dynProcs.glQueryCounterEXT(frame->queries[0], GL_TIMESTAMP_EXT);
+  l_timer.recording = true;
+}
+
+void egl_gpuTimerMark(const char * name)
+{
+  if (!l_timer.recording)
+    return;
+
+  struct TimerFrame * frame = l_timer.frames + l_timer.current;
+  if (frame->count == TIMER_MARKS)
+    return;
+
+  frame->names[frame->count] = name;
+  g_egl_dynProcs.glQueryCounterEXT(frame->queries[++frame->count],
+      GL_TIMESTAMP_EXT);
+}
+
+void egl_gpuTimerEnd(void)
+{
+  if (!l_timer.recording)
+    return;
+
+  l_timer.frames[l_timer.current].pending = true;
+  l_timer.current   = (l_timer.current + 1) % TIMER_FRAMES;
+  l_timer.recording = false;
+}
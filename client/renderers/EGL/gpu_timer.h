@@ -0,0 +1,36 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/* GPU side timing of the render stages using GL_EXT_disjoint_timer_query.
+ *
+ * Each mark times the GPU work since the previous mark, or since the start of
+ * the frame, and is graphed under its name. The results are read back a few
+ * frames later so the queries never stall the pipeline. Names must be static
+ * strings as they are compared by pointer. */
+void egl_gpuTimerInit(bool enable, const char * gl_exts);
+void egl_gpuTimerFree(void);
+
+void egl_gpuTimerBegin(void);
+void egl_gpuTimerMark(const char * name);
+void egl_gpuTimerEnd(void);
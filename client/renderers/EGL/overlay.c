@@ -0,0 +1,414 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "overlay.h"
+#include "common/debug.h"
+
+#include "egl_dynprocs.h"
+#include "egldebug.h"
+#include "shader.h"
+#include "cimgui.h"
+
+#include <GLES3/gl3.h>
+#include <GLES2/gl2ext.h>
+#include <stdlib.h>
+#include <string.h>
+
+// these headers are auto generated by cmake
+#include "overlay.vert.h"
+#include "overlay.frag.h"
+
+/* each frame's vertices and indices go in the next segment of the ring, the
+ * fence of a segment is waited on before it is written to again */
+#define OVERLAY_SEGMENTS    3
+#define OVERLAY_MIN_VERTS   65536
+#define OVERLAY_MIN_INDICES (OVERLAY_MIN_VERTS * 3)
+
+// ImDrawCallback_ResetRenderState, the state is set for every batch anyway
+#define OVERLAY_RESET_STATE ((ImDrawCallback)(intptr_t)-1)
+
+struct Batch
+{
+  GLuint  texture;
+  GLint   clip[4];
+  GLsizei offset;
+  GLsizei count;
+};
+
+struct EGL_Overlay
+{
+  EGL_Shader * shader;
+  GLint        uTransform;
+
+  GLuint       vao;
+  GLuint       buffers[2];
+  ImDrawVert * vertices;
+  GLuint     * indices;
+  size_t       maxVerts;
+  size_t       maxIndices;
+
+  int          segment;
+  GLsync       fence[OVERLAY_SEGMENTS];
+
+  struct Batch * batches;
+  int            maxBatches;
+};
+
+static void waitFence(EGL_Overlay * this, int segment)
+{
+  if (!this->fence[segment])
+    return;
+
+  glClientWaitSync(this->fence[segment], GL_SYNC_FLUSH_COMMANDS_BIT,
+      GL_TIMEOUT_IGNORED);
+  glDeleteSync(this->fence[segment]);
+  this->fence[segment] = 0;
+}
+
+static void freeBuffers(EGL_Overlay * this)
+{
+  if (!this->buffers[0])
+    return;
+
+  for (int i = 0; i < OVERLAY_SEGMENTS; ++i)
+    waitFence(this, i);
+
+  glBindVertexArray(this->vao);
+  glBindBuffer(GL_ARRAY_BUFFER, this->buffers[0]);
+  glUnmapBuffer(GL_ARRAY_BUFFER);
+  glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  glDeleteBuffers(2, this->buffers);
+  this->buffers[0] = 0;
+  this->buffers[1] = 0;
+  this->vertices   = NULL;
+  this->indices    = NULL;
+}
+
+static void * mapBuffer(GLenum target, GLuint buffer, size_t size)
+{
+  const GLbitfield flags =
+    GL_MAP_WRITE_BIT          |
+    GL_MAP_PERSISTENT_BIT_EXT |
+    GL_MAP_COHERENT_BIT_EXT;
+
+  glBindBuffer(target, buffer);
+  g_egl_dynProcs.glBufferStorageEXT(target, size, NULL, flags);
+
+  void * map = glMapBufferRange(target, 0, size,
+      flags | GL_MAP_UNSYNCHRONIZED_BIT);
+  if (!map)
+    DEBUG_GL_ERROR("glMapBufferRange failed of %zu bytes", size);
+  return map;
+}
+
+static bool allocBuffers(EGL_Overlay * this, size_t verts, size_t indices)
+{
+  freeBuffers(this);
+
+  size_t maxVerts   = OVERLAY_MIN_VERTS;
+  size_t maxIndices = OVERLAY_MIN_INDICES;
+  while (maxVerts < verts)
+    maxVerts <<= 1;
+  while (maxIndices < indices)
+    maxIndices <<= 1;
+
+  glBindVertexArray(this->vao);
+  glGenBuffers(2, this->buffers);
+
+  this->vertices = mapBuffer(GL_ARRAY_BUFFER, this->buffers[0],
+      maxVerts * OVERLAY_SEGMENTS * sizeof(ImDrawVert));
+  this->indices  = mapBuffer(GL_ELEMENT_ARRAY_BUFFER, this->buffers[1],
+      maxIndices * OVERLAY_SEGMENTS * sizeof(GLuint));
+
+  glEnableVertexAttribArray(0);
+  glEnableVertexAttribArray(1);
+  glEnableVertexAttribArray(2);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(ImDrawVert),
+      (void *)offsetof(ImDrawVert, pos));
+  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(ImDrawVert),
+      (void *)offsetof(ImDrawVert, uv));
+  glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(ImDrawVert),
+      (void *)offsetof(ImDrawVert, col));
+
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  if (!this->vertices || !this->indices)
+  {
+    freeBuffers(this);
+    return false;
+  }
+
+  this->maxVerts   = maxVerts;
+  this->maxIndices = maxIndices;
+  this->segment    = 0;
+  return true;
+}
+
+bool egl_overlayInit(EGL_Overlay ** overlay)
+{
+  EGL_Overlay * this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("Failed to malloc EGL_Overlay");
+    return false;
+  }
+  *overlay = this;
+
+  if (!egl_shaderInit(&this->shader))
+  {
+    DEBUG_ERROR("Failed to initialize the overlay shader");
+    return false;
+  }
+
+  if (!egl_shaderCompile(this->shader,
+        b_shader_overlay_vert, b_shader_overlay_vert_size,
+        b_shader_overlay_frag, b_shader_overlay_frag_size))
+  {
+    DEBUG_ERROR("Failed to compile the overlay shader");
+    return false;
+  }
+
+  this->uTransform = egl_shaderGetUniform(this->shader, "transform");
+  glGenVertexArrays(1, &this->vao);
+
+  if (!allocBuffers(this, 0, 0))
+  {
+    DEBUG_ERROR("Failed to allocate the overlay buffers");
+    return false;
+  }
+
+  return true;
+}
+
+void egl_overlayFree(EGL_Overlay ** overlay)
+{
+  EGL_Overlay * this = *overlay;
+  if (!this)
+    return;
+
+  freeBuffers(this);
+  if (this->vao)
+    glDeleteVertexArrays(1, &this->vao);
+  egl_shaderFree(&this->shader);
+  free(this->batches);
+
+  free(this);
+  *overlay = NULL;
+}
+
+/* returns false if the clip rect is empty, or off the framebuffer */
+static bool clipRect(const ImDrawCmd * cmd, const ImDrawData * data,
+    int fbWidth, int fbHeight, GLint clip[4])
+{
+  const ImVec2 off   = data->DisplayPos;
+  const ImVec2 scale = data->FramebufferScale;
+
+  const float x1 = (cmd->ClipRect.x - off.x) * scale.x;
+  const float y1 = (cmd->ClipRect.y - off.y) * scale.y;
+  const float x2 = (cmd->ClipRect.z - off.x) * scale.x;
+  const float y2 = (cmd->ClipRect.w - off.y) * scale.y;
+
+  if (x2 <= x1 || y2 <= y1 || x1 >= fbWidth || y1 >= fbHeight ||
+      x2 <= 0.0f || y2 <= 0.0f)
+    return false;
+
+  clip[0] = (GLint)x1;
+  clip[1] = (GLint)(fbHeight - y2);
+  clip[2] = (GLint)(x2 - x1);
+  clip[3] = (GLint)(y2 - y1);
+  return true;
+}
+
+static struct Batch * addBatch(EGL_Overlay * this, int * count)
+{
+  if (*count == this->maxBatches)
+  {
+    const int max = this->maxBatches ? this->maxBatches * 2 : 64;
+    struct Batch * batches = realloc(this->batches, max * sizeof(*batches));
+    if (!batches)
+    {
+      DEBUG_ERROR("out of memory");
+      return NULL;
+    }
+    this->batches    = batches;
+    this->maxBatches = max;
+  }
+
+  return &this->batches[(*count)++];
+}
+
+static void drawBatches(EGL_Overlay * this, int count, size_t indexBase)
+{
+  GLuint texture = 0;
+  GLint  clip[4] = { -1, -1, -1, -1 };
+
+  for (int i = 0; i < count; ++i)
+  {
+    const struct Batch * b = &this->batches[i];
+    if (b->texture != texture)
+    {
+      texture = b->texture;
+      glBindTexture(GL_TEXTURE_2D, texture);
+    }
+
+    if (memcmp(b->clip, clip, sizeof(clip)) != 0)
+    {
+      memcpy(clip, b->clip, sizeof(clip));
+      glScissor(clip[0], clip[1], clip[2], clip[3]);
+    }
+
+    glDrawElements(GL_TRIANGLES, b->count, GL_UNSIGNED_INT,
+        (void *)((indexBase + b->offset) * sizeof(GLuint)));
+  }
+}
+
+static void setupState(EGL_Overlay * this, const ImDrawData * data,
+    int fbWidth, int fbHeight)
+{
+  glEnable(GL_BLEND);
+  glBlendEquation(GL_FUNC_ADD);
+  glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA,
+      GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+  glEnable(GL_SCISSOR_TEST);
+  glViewport(0, 0, fbWidth, fbHeight);
+
+  const float l = data->DisplayPos.x;
+  const float t = data->DisplayPos.y;
+  const float w = data->DisplaySize.x;
+  const float h = data->DisplaySize.y;
+  const GLfloat transform[4] =
+  {
+     2.0f / w,
+    -2.0f / h,
+    -1.0f - l * 2.0f / w,
+     1.0f + t * 2.0f / h
+  };
+
+  egl_shaderUse(this->shader);
+  glUniform4fv(this->uTransform, 1, transform);
+  glActiveTexture(GL_TEXTURE0);
+  glBindVertexArray(this->vao);
+}
+
+static void resetState(void)
+{
+  glBindVertexArray(0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glDisable(GL_SCISSOR_TEST);
+  glDisable(GL_BLEND);
+}
+
+void egl_overlayRender(EGL_Overlay * this, ImDrawData * data)
+{
+  const int fbWidth  = (int)(data->DisplaySize.x * data->FramebufferScale.x);
+  const int fbHeight = (int)(data->DisplaySize.y * data->FramebufferScale.y);
+  if (!data->Valid || data->CmdListsCount == 0 || fbWidth <= 0 ||
+      fbHeight <= 0)
+    return;
+
+  if ((size_t)data->TotalVtxCount > this->maxVerts ||
+      (size_t)data->TotalIdxCount > this->maxIndices)
+    if (!allocBuffers(this, data->TotalVtxCount, data->TotalIdxCount))
+    {
+      DEBUG_ERROR("Failed to grow the overlay buffers");
+      return;
+    }
+
+  const int segment = this->segment;
+  this->segment = (segment + 1) % OVERLAY_SEGMENTS;
+  waitFence(this, segment);
+
+  const size_t  vertBase = segment * this->maxVerts;
+  const size_t  idxBase  = segment * this->maxIndices;
+  ImDrawVert  * vtx      = this->vertices + vertBase;
+  GLuint      * idx      = this->indices  + idxBase;
+  GLuint        vtxCount = 0;
+  GLsizei       idxCount = 0;
+  int           batches  = 0;
+
+  setupState(this, data, fbWidth, fbHeight);
+
+  /* the indices are rebased into the one vertex range so that commands with
+   * the same texture and clip merge across draw lists */
+  for (int n = 0; n < data->CmdListsCount; ++n)
+  {
+    const ImDrawList * list = data->CmdLists[n];
+    memcpy(vtx + vtxCount, list->VtxBuffer.Data,
+        list->VtxBuffer.Size * sizeof(ImDrawVert));
+
+    for (int c = 0; c < list->CmdBuffer.Size; ++c)
+    {
+      const ImDrawCmd * cmd = &list->CmdBuffer.Data[c];
+      if (cmd->UserCallback)
+      {
+        if (cmd->UserCallback == OVERLAY_RESET_STATE)
+          continue;
+
+        // flush what is batched so the callback draws in order
+        drawBatches(this, batches, idxBase);
+        batches = 0;
+        cmd->UserCallback(list, cmd);
+        setupState(this, data, fbWidth, fbHeight);
+        continue;
+      }
+
+      GLint clip[4];
+      if (!cmd->ElemCount ||
+          !clipRect(cmd, data, fbWidth, fbHeight, clip))
+        continue;
+
+      const GLuint          base = vertBase + vtxCount + cmd->VtxOffset;
+      const ImDrawIdx     * src  = list->IdxBuffer.Data + cmd->IdxOffset;
+      GLuint              * dst  = idx + idxCount;
+      for (unsigned int i = 0; i < cmd->ElemCount; ++i)
+        dst[i] = base + src[i];
+
+      const GLuint texture = (GLuint)(intptr_t)cmd->TextureId;
+      struct Batch * last = batches ? &this->batches[batches - 1] : NULL;
+      if (last && last->texture == texture &&
+          memcmp(last->clip, clip, sizeof(clip)) == 0 &&
+          last->offset + last->count == idxCount)
+        last->count += cmd->ElemCount;
+      else
+      {
+        struct Batch * b = addBatch(this, &batches);
+        if (!b)
+          break;
+
+        b->texture = texture;
+        b->offset  = idxCount;
+        b->count   = cmd->ElemCount;
+        memcpy(b->clip, clip, sizeof(clip));
+      }
+
+      idxCount += cmd->ElemCount;
+    }
+
+    vtxCount += list->VtxBuffer.Size;
+  }
+
+  drawBatches(this, batches, idxBase);
+  this->fence[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  resetState();
+}
@@ -0,0 +1,34 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+typedef struct EGL_Overlay EGL_Overlay;
+typedef struct ImDrawData ImDrawData;
+
+bool egl_overlayInit(EGL_Overlay ** overlay);
+void egl_overlayFree(EGL_Overlay ** overlay);
+
+/* draws the ImGui draw data from a persistently mapped ring in as few calls as
+ * the texture and clip changes allow, the font texture is still created by the
+ * ImGui OpenGL3 backend */
+void egl_overlayRender(EGL_Overlay * overlay, ImDrawData * data);
@@ -21,6 +21,7 @@
 #define _GNU_SOURCE
 #include "postprocess.h"
 #include "filters.h"
+#include "gpu_timer.h"
 #include "app.h"
 #include "cimgui.h"
 
@@ -35,8 +36,10 @@
 #include "common/array.h"
 #include "common/option.h"
 #include "common/paths.h"
+#include "common/rects.h"
 #include "common/stringlist.h"
 #include "common/stringutils.h"
+#include "common/util.h"
 #include "common/vector.h"
 
 static const EGL_FilterOps * EGL_Filters[] =
@@ -49,11 +52,34 @@ static const EGL_FilterOps * EGL_Filters[] =
 struct EGL_PostProcess
 {
   Vector filters;
+  EGL_Filter * convert;
   GLuint output;
   unsigned int outputX, outputY;
   _Atomic(bool) modified;
 
-  EGL_DesktopRects * rects;
+  // a config reload changed the filter options
+  bool reload;
+
+  // the host lowered the resolution of the frames to keep up
+  bool hostScaled;
+
+  // the client is saving power, the costly filters are skipped
+  bool powerSave;
+
+  // the inputs the output was produced from, a match skips the filters
+  bool          cacheValid;
+  EGL_Texture * cacheTex;
+  uint64_t      cacheGen;
+  int           cacheWidth, cacheHeight;
+  unsigned int  cacheTargetX, cacheTargetY;
+  enum EGL_PixelFormat cachePixFmt;
+
+  // the area the filters run over, grown by each filter's radius in turn
+  EGL_DesktopRects   * rects;
+  struct DamageRects * damage;
+
+  // how far the last run spread a change in desktop pixels, -1 if unbounded
+  int spreadX, spreadY;
 
   StringList presets;
   char * presetDir;
@@ -531,6 +557,11 @@ static void configUI(void * opaque, int * id)
   }
 }
 
+static void filterOptionChanged(struct Option * opt, void * opaque)
+{
+  ((struct EGL_PostProcess *)opaque)->reload = true;
+}
+
 bool egl_postProcessInit(EGL_PostProcess ** pp)
 {
   EGL_PostProcess * this = calloc(1, sizeof(*this));
@@ -546,19 +577,31 @@ bool egl_postProcessInit(EGL_PostProcess ** pp)
     goto error_this;
   }
 
-  if (!egl_desktopRectsInit(&this->rects, 1))
+  if (!egl_desktopRectsInit(&this->rects, KVMFR_MAX_DAMAGE_RECTS))
   {
     DEBUG_ERROR("Failed to initialize the desktop rects");
     goto error_filters;
   }
 
+  this->damage = malloc(sizeof(*this->damage) +
+      sizeof(*this->damage->rects) * KVMFR_MAX_DAMAGE_RECTS);
+  if (!this->damage)
+  {
+    DEBUG_ERROR("Failed to allocate memory");
+    goto error_rects;
+  }
+
   loadPresetList(this);
   reorderFilters(this);
   app_overlayConfigRegisterTab("EGL Filters", configUI, this);
+  option_watchModule("eglFilter", filterOptionChanged, this);
 
   *pp = this;
   return true;
 
+error_rects:
+  egl_desktopRectsFree(&this->rects);
+
 error_filters:
   vector_destroy(&this->filters);
 
@@ -573,17 +616,22 @@ void egl_postProcessFree(EGL_PostProcess ** pp)
     return;
 
   EGL_PostProcess * this = *pp;
+  option_unwatchModule("eglFilter", filterOptionChanged, this);
 
   EGL_Filter ** filter;
   vector_forEachRef(filter, &this->filters)
     egl_filterFree(filter);
   vector_destroy(&this->filters);
 
+  if (this->convert)
+    egl_filterFree(&this->convert);
+
   free(this->presetDir);
   if (this->presets)
     stringlist_free(&this->presets);
 
   egl_desktopRectsFree(&this->rects);
+  free(this->damage);
   free(this->presetError);
   free(this);
   *pp = NULL;
@@ -599,13 +647,107 @@ bool egl_postProcessAdd(EGL_PostProcess * this, const EGL_FilterOps * ops)
   return true;
 }
 
-bool egl_postProcessConfigModified(EGL_PostProcess * this)
+void egl_postProcessSetHostScaled(EGL_PostProcess * this, bool hostScaled)
+{
+  if (this->hostScaled == hostScaled)
+    return;
+
+  this->hostScaled = hostScaled;
+  EGL_Filter * filter;
+  vector_forEach(filter, &this->filters)
+    egl_filterSetHostScaled(filter, hostScaled);
+  atomic_store(&this->modified, true);
+}
+
+void egl_postProcessSetPowerSave(EGL_PostProcess * this, bool powerSave)
+{
+  if (this->powerSave == powerSave)
+    return;
+
+  this->powerSave = powerSave;
+  atomic_store(&this->modified, true);
+}
+
+/* grows the damaged area by the desktop space radius of a filter so that
+ * every output pixel that samples a changed input pixel is run again */
+static void growDamage(struct DamageRects * damage, int rx, int ry,
+    int desktopWidth, int desktopHeight)
+{
+  if (damage->count < 0)
+    return;
+
+  if (rx < 0)
+  {
+    damage->count = -1;
+    return;
+  }
+
+  for (int i = 0; i < damage->count; ++i)
+  {
+    FrameDamageRect * r = damage->rects + i;
+    const int x2 = min((int)(r->x + r->width ) + rx, desktopWidth );
+    const int y2 = min((int)(r->y + r->height) + ry, desktopHeight);
+    r->x      = max((int)r->x - rx, 0);
+    r->y      = max((int)r->y - ry, 0);
+    r->width  = x2 - r->x;
+    r->height = y2 - r->y;
+  }
+
+  damage->count = rectsMergeOverlapping(damage->rects, damage->count);
+}
+
+/* the built in filter that converts a texture format the others can't take,
+ * or NULL if the format needs none */
+static const EGL_FilterOps * convertOps(enum EGL_PixelFormat pixFmt,
+    enum EGL_PixelFormat * outFmt)
+{
+  switch(pixFmt)
+  {
+    case EGL_PF_NV12:
+      *outFmt = EGL_PF_RGBA;
+      return &egl_filterNV12Ops;
+
+    case EGL_PF_RGBA10_PQ:
+      *outFmt = EGL_PF_RGBA16F;
+      return &egl_filterPQOps;
+
+    default:
+      return NULL;
+  }
+}
+
+/* NV12 damage is over the texel image of both planes, map it back to the
+ * desktop pixels, a rect spanning the planes can't be and damages it all */
+static void nv12Damage(struct DamageRects * damage,
+    int desktopWidth, int desktopHeight)
 {
-  return atomic_load(&this->modified);
+  if (damage->count < 0)
+    return;
+
+  for (int i = 0; i < damage->count; ++i)
+  {
+    FrameDamageRect * r = damage->rects + i;
+    if (r->y >= desktopHeight)
+    {
+      r->y      = (r->y - desktopHeight) * 2;
+      r->height = r->height * 2;
+    }
+    else if (r->y + r->height > desktopHeight)
+    {
+      damage->count = -1;
+      return;
+    }
+
+    r->x      = r->x * 4;
+    r->width  = min((int)r->width * 4, desktopWidth - (int)r->x);
+    r->height = min((int)r->height, desktopHeight - (int)r->y);
+  }
+
+  damage->count = rectsMergeOverlapping(damage->rects, damage->count);
 }
 
 bool egl_postProcessRun(EGL_PostProcess * this, EGL_Texture * tex,
-    EGL_DesktopRects * rects, int desktopWidth, int desktopHeight,
+    int desktopWidth, int desktopHeight,
     unsigned int targetX, unsigned int targetY)
 {
   if (targetX == 0 && targetY == 0)
@@ -618,10 +760,45 @@ bool egl_postProcessRun(EGL_PostProcess * this, EGL_Texture * tex,
   if (egl_textureGet(tex, &texture, &sizeX, &sizeY) != EGL_TEX_STATUS_OK)
     return false;
 
-  if (atomic_exchange(&this->modified, false))
+  /* the filters save their state through the options too, which lands here
+   * with the values they already have */
+  if (this->reload)
+  {
+    this->reload = false;
+    EGL_Filter * filter;
+    vector_forEach(filter, &this->filters)
+      egl_filterLoadState(filter);
+    reorderFilters(this);
+    atomic_store(&this->modified, true);
+  }
+
+  /* cursor moves and overlay redraws reach here without a new frame, there is
+   * nothing to do unless the source or the filter chain has changed */
+  const uint64_t generation = atomic_load(&tex->generation);
+  const bool full =
+    atomic_exchange(&this->modified, false) ||
+    !this->cacheValid                       ||
+    this->cacheTex     != tex               ||
+    this->cacheWidth   != desktopWidth      ||
+    this->cacheHeight  != desktopHeight     ||
+    this->cacheTargetX != targetX           ||
+    this->cacheTargetY != targetY           ||
+    this->cachePixFmt  != tex->format.pixFmt;
+
+  if (!full && this->cacheGen == generation)
+    return true;
+
+  /* the filter outputs still hold the last result, only the area of the
+   * texture that changed grown by the filter radii needs to be run again */
+  const struct TexDamage * damage = full ? NULL :
+    egl_textureGetDamage(tex, this->cacheGen);
+  if (!damage)
+    this->damage->count = -1;
+  else
   {
-    rects = this->rects;
-    egl_desktopRectsUpdate(rects, NULL, desktopWidth, desktopHeight);
+    this->damage->count = damage->count;
+    memcpy(this->damage->rects, damage->rects,
+        sizeof(*damage->rects) * damage->count);
   }
 
   GLfloat matrix[6];
@@ -629,23 +806,75 @@ bool egl_postProcessRun(EGL_PostProcess * this, EGL_Texture * tex,
       1.0f, 1.0f, LG_ROTATE_0);
 
   EGL_FilterRects filterRects = {
-    .rects  = rects,
+    .rects  = this->rects,
     .matrix = matrix,
     .width  = desktopWidth,
     .height = desktopHeight,
+    .damage = this->damage,
   };
 
+  enum EGL_PixelFormat pixFmt = tex->format.pixFmt;
+  enum EGL_PixelFormat outFmt;
+  const EGL_FilterOps * ops = convertOps(pixFmt, &outFmt);
+  if (ops)
+  {
+    if (this->convert && this->convert->ops.id != ops->id)
+      egl_filterFree(&this->convert);
+
+    if (!this->convert && !egl_filterInit(ops, &this->convert))
+      return false;
+
+    if (!egl_filterSetup(this->convert, pixFmt, sizeX, sizeY) ||
+        !egl_filterPrepare(this->convert))
+      return false;
+
+    if (pixFmt == EGL_PF_NV12)
+      nv12Damage(this->damage, desktopWidth, desktopHeight);
+
+    egl_desktopRectsUpdate(this->rects, this->damage,
+        desktopWidth, desktopHeight);
+
+    texture = egl_filterRun(this->convert, &filterRects, texture);
+    egl_filterGetOutputRes(this->convert, &sizeX, &sizeY);
+    egl_gpuTimerMark(this->convert->ops.id);
+    pixFmt = outFmt;
+  }
+
+  int spreadX = 0, spreadY = 0;
   EGL_Filter * filter;
   vector_forEach(filter, &this->filters)
   {
+    if (this->powerSave && filter->ops.costly)
+      continue;
+
     egl_filterSetOutputResHint(filter, targetX, targetY);
 
-    if (!egl_filterSetup(filter, tex->format.pixFmt, sizeX, sizeY) ||
+    if (!egl_filterSetup(filter, pixFmt, sizeX, sizeY) ||
         !egl_filterPrepare(filter))
       continue;
 
+    // the radius is in the filter's input pixels, convert it to desktop space
+    const int radius = egl_filterGetRadius(filter);
+    const int rx = radius < 0 ? -1 :
+      (radius * desktopWidth  + (int)sizeX - 1) / (int)sizeX;
+    const int ry = radius < 0 ? -1 :
+      (radius * desktopHeight + (int)sizeY - 1) / (int)sizeY;
+
+    if (rx < 0 || spreadX < 0)
+      spreadX = spreadY = -1;
+    else
+    {
+      spreadX += rx;
+      spreadY += ry;
+    }
+
+    growDamage(this->damage, rx, ry, desktopWidth, desktopHeight);
+    egl_desktopRectsUpdate(this->rects, this->damage,
+        desktopWidth, desktopHeight);
+
     texture = egl_filterRun(filter, &filterRects, texture);
     egl_filterGetOutputRes(filter, &sizeX, &sizeY);
+    egl_gpuTimerMark(filter->ops.id);
 
     if (lastFilter)
       egl_filterRelease(lastFilter);
@@ -656,6 +885,17 @@ bool egl_postProcessRun(EGL_PostProcess * this, EGL_Texture * tex,
   this->output  = texture;
   this->outputX = sizeX;
   this->outputY = sizeY;
+  this->spreadX = spreadX;
+  this->spreadY = spreadY;
+
+  this->cacheValid   = true;
+  this->cacheTex     = tex;
+  this->cacheGen     = generation;
+  this->cacheWidth   = desktopWidth;
+  this->cacheHeight  = desktopHeight;
+  this->cacheTargetX = targetX;
+  this->cacheTargetY = targetY;
+  this->cachePixFmt  = tex->format.pixFmt;
   return true;
 }
 
@@ -666,3 +906,10 @@ GLuint egl_postProcessGetOutput(EGL_PostProcess * this,
   *outputY = this->outputY;
   return this->output;
 }
+
+bool egl_postProcessGetSpread(EGL_PostProcess * this, int * x, int * y)
+{
+  *x = this->spreadX;
+  *y = this->spreadY;
+  return this->spreadX >= 0;
+}
@@ -34,14 +34,21 @@ void egl_postProcessFree(EGL_PostProcess ** pp);
 /* create and add a filter to this processor */
 bool egl_postProcessAdd(EGL_PostProcess * this, const EGL_FilterOps * ops);
 
-/* returns true if the configuration was modified since the last run */
-bool egl_postProcessConfigModified(EGL_PostProcess * this);
+/* tells the filters the host has lowered the resolution of the frames, those
+ * that upscale may then turn themselves on */
+void egl_postProcessSetHostScaled(EGL_PostProcess * this, bool hostScaled);
+void egl_postProcessSetPowerSave(EGL_PostProcess * this, bool powerSave);
 
-/* apply the filters to the supplied texture
+/* apply the filters to the supplied texture, only the area changed since the
+ * last run is filtered again
  * targetX/Y is the final target output dimension hint if scalers are present */
 bool egl_postProcessRun(EGL_PostProcess * this, EGL_Texture * tex,
-    EGL_DesktopRects * rects, int desktopWidth, int desktopHeight,
+    int desktopWidth, int desktopHeight,
     unsigned int targetX, unsigned int targetY);
 
 GLuint egl_postProcessGetOutput(EGL_PostProcess * this,
     unsigned int * outputX, unsigned int * outputY);
+
+/* how far in desktop pixels the filters spread a change of their input, false
+ * if they read the whole of it */
+bool egl_postProcessGetSpread(EGL_PostProcess * this, int * x, int * y);
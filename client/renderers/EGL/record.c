@@ -0,0 +1,303 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "record.h"
+#include "common/debug.h"
+
+#include "egl_dynprocs.h"
+#include "egldebug.h"
+#include "shader.h"
+#include "video_record.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+// these headers are auto generated by cmake
+#include "record.vert.h"
+#include "record_nv12.frag.h"
+
+struct RecordSurface
+{
+  EGL_Record * record;
+  GLuint       tex  [2];
+  GLuint       fbo  [2];
+  EGLImage     image[2];
+  EGLSyncKHR   sync;
+};
+
+struct EGL_Record
+{
+  EGLDisplay   display;
+  bool         failed;
+  EGL_Shader * luma;
+  EGL_Shader * chroma;
+  GLuint       sampler;
+
+  unsigned int         width, height;
+  struct RecordSurface surfaces[VIDEO_RECORD_SURFACES];
+};
+
+bool egl_recordInit(EGL_Record ** record, EGLDisplay display)
+{
+  if (!g_egl_dynProcs.eglExportDMABUFImageQueryMESA ||
+      !g_egl_dynProcs.eglExportDMABUFImageMESA)
+  {
+    DEBUG_WARN("EGL_MESA_image_dma_buf_export is needed to encode the desktop");
+    return false;
+  }
+
+  if (!g_egl_dynProcs.eglCreateSyncKHR || !g_egl_dynProcs.eglDestroySyncKHR ||
+      !g_egl_dynProcs.eglClientWaitSyncKHR)
+  {
+    DEBUG_WARN("EGL_KHR_fence_sync is needed to encode the desktop");
+    return false;
+  }
+
+  EGL_Record * this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("Failed to allocate ram");
+    return false;
+  }
+  *record = this;
+
+  this->display = display;
+  for(int i = 0; i < VIDEO_RECORD_SURFACES; ++i)
+    this->surfaces[i].record = this;
+
+  if (!egl_shaderInit(&this->luma) || !egl_shaderInit(&this->chroma))
+  {
+    DEBUG_ERROR("Failed to initialize the record shaders");
+    goto fail;
+  }
+
+  if (!egl_shaderCompile(this->luma,
+        b_shader_record_vert     , b_shader_record_vert_size,
+        b_shader_record_nv12_frag, b_shader_record_nv12_frag_size) ||
+      !egl_shaderCompileDefines(this->chroma,
+        b_shader_record_vert     , b_shader_record_vert_size,
+        b_shader_record_nv12_frag, b_shader_record_nv12_frag_size,
+        "#define CHROMA\n"))
+  {
+    DEBUG_ERROR("Failed to compile the record shaders");
+    goto fail;
+  }
+
+  glGenSamplers(1, &this->sampler);
+  glSamplerParameteri(this->sampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glSamplerParameteri(this->sampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glSamplerParameteri(this->sampler, GL_TEXTURE_WRAP_S    , GL_CLAMP_TO_EDGE);
+  glSamplerParameteri(this->sampler, GL_TEXTURE_WRAP_T    , GL_CLAMP_TO_EDGE);
+  return true;
+
+fail:
+  egl_recordFree(record);
+  return false;
+}
+
+void egl_recordFree(EGL_Record ** record)
+{
+  EGL_Record * this = *record;
+  if (!this)
+    return;
+
+  for(int i = 0; i < VIDEO_RECORD_SURFACES; ++i)
+  {
+    struct RecordSurface * s = this->surfaces + i;
+    for(int j = 0; j < 2; ++j)
+      if (s->image[j])
+        g_egl_dynProcs.eglDestroyImage(this->display, s->image[j]);
+
+    if (s->sync)
+      g_egl_dynProcs.eglDestroySyncKHR(this->display, s->sync);
+
+    glDeleteFramebuffers(2, s->fbo);
+    glDeleteTextures(2, s->tex);
+  }
+
+  if (this->sampler)
+    glDeleteSamplers(1, &this->sampler);
+  egl_shaderFree(&this->luma);
+  egl_shaderFree(&this->chroma);
+
+  free(this);
+  *record = NULL;
+}
+
+static bool exportPlane(EGL_Record * this, struct RecordSurface * s, int plane,
+    GLenum format, unsigned int width, unsigned int height,
+    VideoRecordSurface * out)
+{
+  glBindTexture(GL_TEXTURE_2D, s->tex[plane]);
+  glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, s->fbo[plane]);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+      s->tex[plane], 0);
+  const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  if (status != GL_FRAMEBUFFER_COMPLETE)
+  {
+    DEBUG_ERROR("The record framebuffer is incomplete: 0x%x", status);
+    return false;
+  }
+
+  s->image[plane] = g_egl_dynProcs.eglCreateImage(this->display,
+      eglGetCurrentContext(), EGL_GL_TEXTURE_2D,
+      (EGLClientBuffer)(uintptr_t)s->tex[plane], NULL);
+  if (s->image[plane] == EGL_NO_IMAGE)
+  {
+    DEBUG_EGL_ERROR("Failed to create the record image");
+    return false;
+  }
+
+  int fourcc, planes;
+  EGLuint64KHR modifier;
+  if (!g_egl_dynProcs.eglExportDMABUFImageQueryMESA(this->display,
+        s->image[plane], &fourcc, &planes, &modifier) || planes != 1)
+  {
+    DEBUG_EGL_ERROR("Failed to query the record image");
+    return false;
+  }
+
+  int fd;
+  EGLint stride, offset;
+  if (!g_egl_dynProcs.eglExportDMABUFImageMESA(this->display,
+        s->image[plane], &fd, &stride, &offset))
+  {
+    DEBUG_EGL_ERROR("Failed to export the record image");
+    return false;
+  }
+
+  out->fd      [plane] = fd;
+  out->fourcc  [plane] = fourcc;
+  out->offset  [plane] = offset;
+  out->pitch   [plane] = stride;
+  out->modifier[plane] = modifier;
+  return true;
+}
+
+static bool setupSurfaces(EGL_Record * this, unsigned int width,
+    unsigned int height)
+{
+  // the chroma is subsampled so the size must be even
+  width  &= ~1U;
+  height &= ~1U;
+  if (width < 2 || height < 2)
+    return false;
+
+  VideoRecordSurface out[VIDEO_RECORD_SURFACES];
+  for(int i = 0; i < VIDEO_RECORD_SURFACES; ++i)
+    out[i].fd[0] = out[i].fd[1] = -1;
+
+  bool ok = true;
+  for(int i = 0; ok && i < VIDEO_RECORD_SURFACES; ++i)
+  {
+    struct RecordSurface * s = this->surfaces + i;
+    glGenTextures(2, s->tex);
+    glGenFramebuffers(2, s->fbo);
+
+    ok = exportPlane(this, s, 0, GL_R8 , width    , height    , out + i) &&
+         exportPlane(this, s, 1, GL_RG8, width / 2, height / 2, out + i);
+  }
+
+  if (ok)
+    ok = videoRecord_setSurfaces(width, height, out);
+
+  // the encoder keeps copies of the descriptors it was given
+  for(int i = 0; i < VIDEO_RECORD_SURFACES; ++i)
+    for(int j = 0; j < 2; ++j)
+      if (out[i].fd[j] >= 0)
+        close(out[i].fd[j]);
+
+  if (!ok)
+    return false;
+
+  this->width  = width;
+  this->height = height;
+  return true;
+}
+
+static void waitSurface(void * opaque)
+{
+  struct RecordSurface * s = opaque;
+  if (s->sync == EGL_NO_SYNC_KHR)
+    return;
+
+  g_egl_dynProcs.eglClientWaitSyncKHR(s->record->display, s->sync, 0,
+      EGL_FOREVER_KHR);
+  g_egl_dynProcs.eglDestroySyncKHR(s->record->display, s->sync);
+  s->sync = EGL_NO_SYNC_KHR;
+}
+
+static void drawPlane(EGL_Shader * shader, GLuint fbo, unsigned int width,
+    unsigned int height)
+{
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glViewport(0, 0, width, height);
+  egl_shaderUse(shader);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+void egl_recordFrame(EGL_Record * this, GLuint texture,
+    unsigned int width, unsigned int height)
+{
+  if (this->failed)
+    return;
+
+  if (!this->width && !setupSurfaces(this, width, height))
+  {
+    DEBUG_ERROR("Failed to set up the record surfaces, not encoding");
+    this->failed = true;
+    return;
+  }
+
+  const int index = videoRecord_acquire();
+  if (index < 0)
+    return;
+
+  struct RecordSurface * s = this->surfaces + index;
+
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glBindSampler(0, this->sampler);
+
+  drawPlane(this->luma  , s->fbo[0], this->width    , this->height    );
+  drawPlane(this->chroma, s->fbo[1], this->width / 2, this->height / 2);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+  // the encoder waits on this from its own thread, it must be flushed first
+  s->sync = g_egl_dynProcs.eglCreateSyncKHR(this->display, EGL_SYNC_FENCE_KHR,
+      NULL);
+  if (s->sync == EGL_NO_SYNC_KHR)
+    glFinish();
+  else
+    glFlush();
+
+  videoRecord_submit(index, waitSurface, s);
+}
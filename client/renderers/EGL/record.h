@@ -0,0 +1,38 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <EGL/egl.h>
+#include <GLES3/gl3.h>
+
+typedef struct EGL_Record EGL_Record;
+
+/* fails if the driver can not export textures as DMA-BUFs or wait on fences
+ * from another thread, the renderer then runs without recording */
+bool egl_recordInit(EGL_Record ** record, EGLDisplay display);
+void egl_recordFree(EGL_Record ** record);
+
+/* converts the texture to NV12 into a free video record surface and hands it
+ * to the encoder, the frame is dropped if none is free. The surfaces are sized
+ * by the first frame and later frames are scaled to fit */
+void egl_recordFrame(EGL_Record * record, GLuint texture,
+    unsigned int width, unsigned int height);
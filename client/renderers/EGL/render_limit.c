@@ -0,0 +1,147 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "render_limit.h"
+
+#include <GLES3/gl3.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "app.h"
+#include "egldebug.h"
+#include "common/ringbuffer.h"
+
+// how long to wait on a fence before giving up on the GPU, in nanoseconds
+#define RENDER_LIMIT_TIMEOUT 100000000
+
+static struct
+{
+  int          ahead;
+  GLsync       fences[RENDER_AHEAD_MAX];
+  unsigned int current;
+  RingBuffer   depth;
+  GraphHandle  graph;
+}
+l_limit = { 0 };
+
+bool egl_renderLimitValidate(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_int >= 0 && opt->value.x_int <= RENDER_AHEAD_MAX)
+    return true;
+
+  *error = "The render ahead must be between 0 and 8 frames";
+  return false;
+}
+
+static const char * depthFormatFn(const char * name,
+    float min, float max, float avg, float freq, float last)
+{
+  static char title[64];
+  snprintf(title, sizeof(title),
+      "%s: min:%1.0f max:%1.0f avg:%4.2f now:%1.0f",
+      name, min, max, avg, last);
+  return title;
+}
+
+void egl_renderLimitInit(int ahead)
+{
+  if (ahead <= 0)
+    return;
+
+  l_limit.ahead = ahead;
+  l_limit.depth = ringbuffer_new(256, sizeof(float));
+  l_limit.graph = app_registerGraph("GPU QUEUE", l_limit.depth,
+      0.0f, RENDER_AHEAD_MAX, depthFormatFn);
+
+  DEBUG_INFO("Limiting the render ahead to %d frame%s", ahead,
+      ahead == 1 ? "" : "s");
+}
+
+void egl_renderLimitFree(void)
+{
+  if (!l_limit.ahead)
+    return;
+
+  for(int i = 0; i < RENDER_AHEAD_MAX; ++i)
+    if (l_limit.fences[i])
+      glDeleteSync(l_limit.fences[i]);
+
+  app_unregisterGraph(l_limit.graph);
+  ringbuffer_free(&l_limit.depth);
+  memset(&l_limit, 0, sizeof(l_limit));
+}
+
+void egl_renderLimitWait(void)
+{
+  if (!l_limit.ahead)
+    return;
+
+  // the frames still queued, newest first, stopping at the first one done
+  float depth = 0.0f;
+  for(int i = 1; i <= l_limit.ahead; ++i)
+  {
+    GLsync fence = l_limit.fences[
+      (l_limit.current + RENDER_AHEAD_MAX - i) % RENDER_AHEAD_MAX];
+    if (!fence || glClientWaitSync(fence, 0, 0) != GL_TIMEOUT_EXPIRED)
+      break;
+    ++depth;
+  }
+  ringbuffer_push(l_limit.depth, &depth);
+
+  const unsigned int slot =
+    (l_limit.current + RENDER_AHEAD_MAX - l_limit.ahead) % RENDER_AHEAD_MAX;
+  GLsync fence = l_limit.fences[slot];
+  if (!fence)
+    return;
+
+  switch(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+        RENDER_LIMIT_TIMEOUT))
+  {
+    case GL_ALREADY_SIGNALED:
+    case GL_CONDITION_SATISFIED:
+      break;
+
+    case GL_TIMEOUT_EXPIRED:
+      DEBUG_WARN("Timed out waiting on the frame %d frames back",
+          l_limit.ahead);
+      break;
+
+    case GL_WAIT_FAILED:
+    case GL_INVALID_VALUE:
+      DEBUG_GL_ERROR("glClientWaitSync failed");
+      break;
+  }
+
+  glDeleteSync(fence);
+  l_limit.fences[slot] = NULL;
+}
+
+void egl_renderLimitFence(void)
+{
+  if (!l_limit.ahead)
+    return;
+
+  GLsync * fence = l_limit.fences + l_limit.current;
+  if (*fence)
+    glDeleteSync(*fence);
+
+  *fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  l_limit.current = (l_limit.current + 1) % RENDER_AHEAD_MAX;
+}
@@ -0,0 +1,39 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include "common/option.h"
+
+#define RENDER_AHEAD_MAX 8
+
+/* bounds how far the CPU may queue frames ahead of the GPU.
+ *
+ * A fence is placed after each swap and before a frame is started the fence
+ * from the frame ahead frames earlier is waited on, so at most ahead frames
+ * are ever queued in the driver. The depth of the queue when each frame is
+ * started is graphed. An ahead of zero disables the limiter */
+bool egl_renderLimitValidate(struct Option * opt, const char ** error);
+void egl_renderLimitInit(int ahead);
+void egl_renderLimitFree(void);
+
+void egl_renderLimitWait(void);
+void egl_renderLimitFence(void);
@@ -19,9 +19,12 @@
  */
 
 #include "shader.h"
+#include "shader_cache.h"
 #include "common/debug.h"
 #include "util.h"
 
+#include <GLES3/gl31.h>
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -94,6 +97,14 @@ bool egl_shaderLoad(EGL_Shader * this, const char * vertex_file, const char * fr
 
 bool egl_shaderCompile(EGL_Shader * this, const char * vertex_code,
     size_t vertex_size, const char * fragment_code, size_t fragment_size)
+{
+  return egl_shaderCompileDefines(this, vertex_code, vertex_size,
+      fragment_code, fragment_size, NULL);
+}
+
+bool egl_shaderCompileDefines(EGL_Shader * this, const char * vertex_code,
+    size_t vertex_size, const char * fragment_code, size_t fragment_size,
+    const char * defines)
 {
   if (this->hasShader)
   {
@@ -101,13 +112,43 @@ bool egl_shaderCompile(EGL_Shader * this, const char * vertex_code,
     this->hasShader = false;
   }
 
-  GLint  length;
-  GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
+  // the #version directive must come first so split the source after it
+  const char * body = memchr(fragment_code, '\n', fragment_size);
+  body = body ? body + 1 : fragment_code + fragment_size;
+
+  const char * sources[4] =
+  {
+    vertex_code,
+    fragment_code,
+    defines ? defines : "",
+    body
+  };
+
+  const GLint lengths[4] =
+  {
+    vertex_size,
+    body - fragment_code,
+    -1,
+    fragment_size - (body - fragment_code)
+  };
+
+  this->shader = egl_shaderCacheLoad(sources, lengths, 4);
+  if (this->shader)
+  {
+    this->hasShader = true;
+    return true;
+  }
 
-  length = vertex_size;
-  glShaderSource(vertexShader, 1, (const char**)&vertex_code, &length);
+  /* issue both compiles before waiting on either so that drivers with
+   * KHR_parallel_shader_compile can build them at the same time */
+  GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(vertexShader, 1, &sources[0], &lengths[0]);
   glCompileShader(vertexShader);
 
+  GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(fragmentShader, 3, &sources[1], &lengths[1]);
+  glCompileShader(fragmentShader);
+
   GLint result = GL_FALSE;
   glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &result);
   if (result == GL_FALSE)
@@ -130,16 +171,11 @@ bool egl_shaderCompile(EGL_Shader * this, const char * vertex_code,
       }
     }
 
-    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+    glDeleteShader(vertexShader  );
     return false;
   }
 
-  GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-
-  length = fragment_size;
-  glShaderSource(fragmentShader, 1, (const char**)&fragment_code, &length);
-  glCompileShader(fragmentShader);
-
   glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &result);
   if (result == GL_FALSE)
   {
@@ -169,6 +205,7 @@ bool egl_shaderCompile(EGL_Shader * this, const char * vertex_code,
   this->shader = glCreateProgram();
   glAttachShader(this->shader, vertexShader  );
   glAttachShader(this->shader, fragmentShader);
+  glProgramParameteri(this->shader, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
   glLinkProgram(this->shader);
 
   glGetProgramiv(this->shader, GL_LINK_STATUS, &result);
@@ -200,6 +237,106 @@ bool egl_shaderCompile(EGL_Shader * this, const char * vertex_code,
   glDeleteShader(fragmentShader);
   glDeleteShader(vertexShader  );
 
+  egl_shaderCacheStore(this->shader, sources, lengths, 4);
+  this->hasShader = true;
+  return true;
+}
+
+bool egl_shaderCompileCompute(EGL_Shader * this, const char * compute_code,
+    size_t compute_size, const char * defines)
+{
+  if (this->hasShader)
+  {
+    glDeleteProgram(this->shader);
+    this->hasShader = false;
+  }
+
+  // the #version directive must come first so split the source after it
+  const char * body = memchr(compute_code, '\n', compute_size);
+  body = body ? body + 1 : compute_code + compute_size;
+
+  const char * sources[3] =
+  {
+    compute_code,
+    defines ? defines : "",
+    body
+  };
+
+  const GLint lengths[3] =
+  {
+    body - compute_code,
+    -1,
+    compute_size - (body - compute_code)
+  };
+
+  this->shader = egl_shaderCacheLoad(sources, lengths, 3);
+  if (this->shader)
+  {
+    this->hasShader = true;
+    return true;
+  }
+
+  GLuint computeShader = glCreateShader(GL_COMPUTE_SHADER);
+  glShaderSource(computeShader, 3, sources, lengths);
+  glCompileShader(computeShader);
+
+  GLint result = GL_FALSE;
+  glGetShaderiv(computeShader, GL_COMPILE_STATUS, &result);
+  if (result == GL_FALSE)
+  {
+    DEBUG_ERROR("Failed to compile compute shader");
+
+    int logLength;
+    glGetShaderiv(computeShader, GL_INFO_LOG_LENGTH, &logLength);
+    if (logLength > 0)
+    {
+      char *log = malloc(logLength + 1);
+      if (!log)
+        DEBUG_ERROR("out of memory");
+      else
+      {
+        glGetShaderInfoLog(computeShader, logLength, NULL, log);
+        log[logLength] = 0;
+        DEBUG_ERROR("%s", log);
+        free(log);
+      }
+    }
+
+    glDeleteShader(computeShader);
+    return false;
+  }
+
+  this->shader = glCreateProgram();
+  glAttachShader(this->shader, computeShader);
+  glProgramParameteri(this->shader, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  glLinkProgram(this->shader);
+
+  glGetProgramiv(this->shader, GL_LINK_STATUS, &result);
+  if (result == GL_FALSE)
+  {
+    DEBUG_ERROR("Failed to link compute shader program");
+
+    int logLength;
+    glGetProgramiv(this->shader, GL_INFO_LOG_LENGTH, &logLength);
+    if (logLength > 0)
+    {
+      char *log = malloc(logLength + 1);
+      glGetProgramInfoLog(this->shader, logLength, NULL, log);
+      log[logLength] = 0;
+      DEBUG_ERROR("%s", log);
+      free(log);
+    }
+
+    glDetachShader(this->shader, computeShader);
+    glDeleteShader(computeShader);
+    glDeleteProgram(this->shader);
+    return false;
+  }
+
+  glDetachShader(this->shader, computeShader);
+  glDeleteShader(computeShader);
+
+  egl_shaderCacheStore(this->shader, sources, lengths, 3);
   this->hasShader = true;
   return true;
 }
@@ -102,6 +102,17 @@ bool egl_shaderLoad(EGL_Shader * model, const char * vertex_file,
 bool egl_shaderCompile(EGL_Shader * model, const char * vertex_code,
     size_t vertex_size, const char * fragment_code, size_t fragment_size);
 
+/* as above, defines is inserted after the fragment shader's #version line and
+ * may be NULL */
+bool egl_shaderCompileDefines(EGL_Shader * model, const char * vertex_code,
+    size_t vertex_size, const char * fragment_code, size_t fragment_size,
+    const char * defines);
+
+/* compile a GLES 3.1 compute shader, defines is inserted after the #version
+ * line and may be NULL */
+bool egl_shaderCompileCompute(EGL_Shader * model, const char * compute_code,
+    size_t compute_size, const char * defines);
+
 void egl_shaderSetUniforms(EGL_Shader * shader, EGL_Uniform * uniforms,
     int count);
 void egl_shaderFreeUniforms(EGL_Shader * shader);
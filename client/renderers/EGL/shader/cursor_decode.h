@@ -0,0 +1,29 @@
+// the shape types as cursor.c uploads them, the masked types are decoded here
+#define CURSOR_COLOR        0
+#define CURSOR_MASKED_COLOR 1
+#define CURSOR_MONOCHROME   2
+
+uniform int   mode;
+uniform ivec2 shape;
+
+// the pixel of the shape under uv, false if it falls outside of the shape
+bool cursorPixel(vec2 uv, float scale, out ivec2 px)
+{
+  vec2 ts = vec2(shape);
+  vec2 p  = scale > 1.0 ? (uv - (0.5 / ts)) * ts : uv * ts;
+  if (p.x < 0.0 || p.y < 0.0)
+    return false;
+
+  px = min(ivec2(p), shape - 1);
+  return true;
+}
+
+/* a monochrome shape is the AND plane followed by the XOR plane at one bit per
+ * pixel, packed four bytes to each RGBA8 texel */
+bool cursorMonoBit(sampler2D tex, ivec2 px, int plane)
+{
+  int  byte  = px.x / 8;
+  vec4 texel = texelFetch(tex, ivec2(byte / 4, px.y + plane * shape.y), 0);
+  int  value = int(texel[byte % 4] * 255.0 + 0.5);
+  return (value & (0x80 >> (px.x % 8))) != 0;
+}
@@ -1,26 +1,30 @@
 #version 300 es
 precision mediump float;
 
+#include "cursor_decode.h"
+
 in  vec2 uv;
 out vec4 color;
 
 uniform sampler2D sampler1;
 uniform float     scale;
 
+// the XOR pass of the masked shapes, black leaves the desktop as it is
 void main()
 {
+  ivec2 px;
+  if (!cursorPixel(uv, scale, px))
+    discard;
+
   vec4 tmp;
-  if (scale > 1.0)
+  if (mode == CURSOR_MONOCHROME)
+    tmp = cursorMonoBit(sampler1, px, 1) ?
+      vec4(1.0, 1.0, 1.0, 0.0) : vec4(0.0);
+  else
   {
-    vec2 ts = vec2(textureSize(sampler1, 0));
-    vec2 px = (uv - (0.5 / ts)) * ts;
-    if (px.x < 0.0 || px.y < 0.0)
-      discard;
-
-    tmp = texelFetch(sampler1, ivec2(px), 0);
+    tmp = texelFetch(sampler1, px, 0);
+    tmp = tmp.a > 0.0 ? vec4(tmp.rgb, 0.0) : vec4(0.0);
   }
-  else
-    tmp = texture(sampler1, uv);
 
   if (tmp.rgb == vec3(0.0, 0.0, 0.0))
     discard;
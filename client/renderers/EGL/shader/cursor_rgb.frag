@@ -2,6 +2,7 @@
 precision mediump float;
 
 #include "color_blind.h"
+#include "cursor_decode.h"
 
 in  vec2  uv;
 out vec4  color;
@@ -12,17 +13,36 @@ uniform int       cbMode;
 
 void main()
 {
-  if (scale > 1.0)
+  if (mode == CURSOR_COLOR)
   {
-    vec2 ts = vec2(textureSize(sampler1, 0));
-    vec2 px = (uv - (0.5 / ts)) * ts;
-    if (px.x < 0.0 || px.y < 0.0)
-      discard;
+    if (scale > 1.0)
+    {
+      vec2 ts = vec2(textureSize(sampler1, 0));
+      vec2 px = (uv - (0.5 / ts)) * ts;
+      if (px.x < 0.0 || px.y < 0.0)
+        discard;
 
-    color = texelFetch(sampler1, ivec2(px), 0);
+      color = texelFetch(sampler1, ivec2(px), 0);
+    }
+    else
+      color = texture(sampler1, uv);
   }
   else
-    color = texture(sampler1, uv);
+  {
+    ivec2 px;
+    if (!cursorPixel(uv, scale, px))
+      discard;
+
+    if (mode == CURSOR_MONOCHROME)
+      // the AND mask, multiplied into the desktop
+      color = vec4(vec3(cursorMonoBit(sampler1, px, 0) ? 1.0 : 0.0), 1.0);
+    else
+    {
+      // a set alpha marks the pixels that are XORed by the mono pass instead
+      vec4 tmp = texelFetch(sampler1, px, 0);
+      color = vec4(tmp.rgb, tmp.a > 0.0 ? 0.0 : 1.0);
+    }
+  }
 
   if (cbMode > 0)
     color = cbTransform(color, cbMode);
@@ -0,0 +1,26 @@
+#version 300 es
+precision highp float;
+
+in  vec2 fragCoord;
+out vec4 fragColor;
+
+uniform sampler2D texture;
+
+/* the texture holds the NV12 planes as RGBA8 texels of four luma samples, or
+ * two U,V pairs for the chroma rows that follow the luma rows. BT.709 at full
+ * range to match the host */
+void main()
+{
+  ivec2 ts   = textureSize(texture, 0);
+  int   rows = ts.y * 2 / 3;
+  ivec2 p    = ivec2(fragCoord * vec2(ts.x * 4, rows));
+
+  float y  = texelFetch(texture, ivec2(p.x >> 2, p.y), 0)[p.x & 3];
+  vec4  c  = texelFetch(texture, ivec2(p.x >> 2, rows + (p.y >> 1)), 0);
+  vec2  uv = ((p.x & 2) == 0 ? c.xy : c.zw) - 0.5;
+
+  fragColor.r = y + 1.5748 * uv.y;
+  fragColor.b = y + 1.8556 * uv.x;
+  fragColor.g = (y - 0.2126 * fragColor.r - 0.0722 * fragColor.b) / 0.7152;
+  fragColor.a = 1.0;
+}
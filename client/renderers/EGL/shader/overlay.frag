@@ -0,0 +1,14 @@
+#version 300 es
+precision mediump float;
+
+in vec2 fragUV;
+in vec4 fragColor;
+
+uniform sampler2D sampler1;
+
+out vec4 color;
+
+void main()
+{
+  color = fragColor * texture(sampler1, fragUV);
+}
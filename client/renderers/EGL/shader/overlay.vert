@@ -0,0 +1,18 @@
+#version 300 es
+
+layout(location = 0) in vec2 vertex;
+layout(location = 1) in vec2 uv;
+layout(location = 2) in vec4 color;
+
+// xy is the scale and zw the offset to normalized device coordinates
+uniform vec4 transform;
+
+out vec2 fragUV;
+out vec4 fragColor;
+
+void main()
+{
+  fragUV      = uv;
+  fragColor   = color;
+  gl_Position = vec4(vertex * transform.xy + transform.zw, 0.0, 1.0);
+}
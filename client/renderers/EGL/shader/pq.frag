@@ -0,0 +1,27 @@
+#version 300 es
+precision highp float;
+
+in  vec2 fragCoord;
+out vec4 fragColor;
+
+uniform sampler2D texture;
+
+const mat3 bt2020to709 = mat3(
+   1.6604910, -0.1245505, -0.0181508,
+  -0.5876411,  1.1328999, -0.1005789,
+  -0.0728499, -0.0083494,  1.1187297
+);
+
+/* decodes the BT.2100 PQ curve in BT.2020 primaries back to scRGB, linear
+ * BT.709 with 1.0 at 80 nits, which is what the FP16 frames carry */
+void main()
+{
+  ivec2 ts = textureSize(texture, 0);
+  vec3  e  = texelFetch(texture, ivec2(fragCoord * vec2(ts)), 0).rgb;
+
+  vec3 p = pow(e, vec3(1.0 / 78.84375));
+  vec3 l = pow(max(p - 0.8359375, 0.0) / (18.8515625 - 18.6875 * p),
+      vec3(1.0 / 0.1593017578125));
+
+  fragColor = vec4(bt2020to709 * (l * (10000.0 / 80.0)), 1.0);
+}
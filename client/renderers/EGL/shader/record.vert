@@ -0,0 +1,12 @@
+#version 300 es
+precision mediump float;
+
+out vec2 fragCoord;
+
+// a single triangle that covers the target
+void main()
+{
+  vec2 pos    = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+  gl_Position = vec4(pos * 2.0 - 1.0, 0.0, 1.0);
+  fragCoord   = pos;
+}
@@ -0,0 +1,23 @@
+#version 300 es
+precision highp float;
+
+in  vec2 fragCoord;
+out vec4 fragColor;
+
+uniform sampler2D source;
+
+/* BT.709 at limited range as the encoders expect. The chroma target is half
+ * the size so the linear sample at its texel centre averages the four pixels
+ * it covers */
+void main()
+{
+  vec3  rgb = texture(source, fragCoord).rgb;
+  float y   = dot(rgb, vec3(0.2126, 0.7152, 0.0722));
+
+#ifdef CHROMA
+  vec2 uv   = vec2((rgb.b - y) / 1.8556, (rgb.r - y) / 1.5748);
+  fragColor = vec4(uv * (224.0 / 255.0) + 128.0 / 255.0, 0.0, 1.0);
+#else
+  fragColor = vec4(y * (219.0 / 255.0) + 16.0 / 255.0, 0.0, 0.0, 1.0);
+#endif
+}
@@ -0,0 +1,260 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "shader_cache.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "common/debug.h"
+#include "common/paths.h"
+#include "common/stringutils.h"
+
+#define CACHE_MAGIC    0x4353474c // LGSC
+#define CACHE_MAX_SIZE (64 * 1024 * 1024)
+
+struct CacheHeader
+{
+  uint32_t magic;
+  uint32_t format;
+  uint32_t size;
+};
+
+static struct
+{
+  bool     enabled;
+  char   * dir;
+  uint64_t driverHash;
+}
+l_cache = { 0 };
+
+// FNV-1a, the cache only needs to tell sources apart, not resist collisions
+static uint64_t hashBytes(uint64_t hash, const void * data, size_t size)
+{
+  const uint8_t * p = data;
+  for(size_t i = 0; i < size; ++i)
+  {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static uint64_t hashString(uint64_t hash, const char * str)
+{
+  if (!str)
+    str = "";
+  return hashBytes(hash, str, strlen(str) + 1);
+}
+
+void egl_shaderCacheInit(bool enable)
+{
+  egl_shaderCacheFree();
+  if (!enable)
+    return;
+
+  GLint formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  if (formats <= 0)
+  {
+    DEBUG_INFO("Program binaries are not supported, shader cache disabled");
+    return;
+  }
+
+  if (alloc_sprintf(&l_cache.dir, "%s/shadercache", lgDataDir()) < 0)
+  {
+    DEBUG_ERROR("out of memory");
+    return;
+  }
+
+  if (mkdir(l_cache.dir, S_IRWXU) < 0 && errno != EEXIST)
+  {
+    DEBUG_WARN("Failed to create %s, shader cache disabled", l_cache.dir);
+    free(l_cache.dir);
+    l_cache.dir = NULL;
+    return;
+  }
+
+  // a driver update may change the binary format without changing its id
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  hash = hashString(hash, (const char *)glGetString(GL_VENDOR  ));
+  hash = hashString(hash, (const char *)glGetString(GL_RENDERER));
+  hash = hashString(hash, (const char *)glGetString(GL_VERSION ));
+
+  l_cache.driverHash = hash;
+  l_cache.enabled    = true;
+}
+
+void egl_shaderCacheFree(void)
+{
+  free(l_cache.dir);
+  memset(&l_cache, 0, sizeof(l_cache));
+}
+
+static char * cachePath(const char * const * sources, const GLint * lengths,
+    int count)
+{
+  uint64_t hash = hashBytes(l_cache.driverHash, &count, sizeof(count));
+  for(int i = 0; i < count; ++i)
+  {
+    const uint32_t len = lengths[i] < 0 ? strlen(sources[i]) : lengths[i];
+    hash = hashBytes(hash, &len, sizeof(len));
+    hash = hashBytes(hash, sources[i], len);
+  }
+
+  char * path;
+  if (alloc_sprintf(&path, "%s/%016llx.bin", l_cache.dir,
+        (unsigned long long)hash) < 0)
+    return NULL;
+
+  return path;
+}
+
+GLuint egl_shaderCacheLoad(const char * const * sources, const GLint * lengths,
+    int count)
+{
+  if (!l_cache.enabled)
+    return 0;
+
+  char * path = cachePath(sources, lengths, count);
+  if (!path)
+    return 0;
+
+  GLuint program = 0;
+  void * data    = NULL;
+  FILE * fp      = fopen(path, "rb");
+  if (!fp)
+    goto out;
+
+  struct CacheHeader header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      header.magic != CACHE_MAGIC ||
+      header.size == 0 || header.size > CACHE_MAX_SIZE)
+    goto stale;
+
+  data = malloc(header.size);
+  if (!data)
+  {
+    DEBUG_ERROR("out of memory");
+    goto out;
+  }
+
+  if (fread(data, header.size, 1, fp) != 1)
+    goto stale;
+
+  program = glCreateProgram();
+  glProgramBinary(program, header.format, data, header.size);
+
+  GLint result = GL_FALSE;
+  glGetProgramiv(program, GL_LINK_STATUS, &result);
+  if (result == GL_FALSE)
+  {
+    glDeleteProgram(program);
+    program = 0;
+    goto stale;
+  }
+
+  goto out;
+
+stale:
+  // the driver rejected it or it is damaged, it will be rebuilt on store
+  remove(path);
+
+out:
+  if (fp)
+    fclose(fp);
+  free(data);
+  free(path);
+  return program;
+}
+
+void egl_shaderCacheStore(GLuint program, const char * const * sources,
+    const GLint * lengths, int count)
+{
+  if (!l_cache.enabled)
+    return;
+
+  GLint size = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+  if (size <= 0 || size > CACHE_MAX_SIZE)
+    return;
+
+  void * data = malloc(size);
+  if (!data)
+  {
+    DEBUG_ERROR("out of memory");
+    return;
+  }
+
+  struct CacheHeader header =
+  {
+    .magic = CACHE_MAGIC
+  };
+
+  GLenum  format;
+  GLsizei length;
+  glGetProgramBinary(program, size, &length, &format, data);
+  if (length <= 0)
+    goto out;
+
+  header.format = format;
+  header.size   = length;
+
+  char * path = cachePath(sources, lengths, count);
+  if (!path)
+    goto out;
+
+  char * tmp;
+  if (alloc_sprintf(&tmp, "%s.tmp", path) < 0)
+  {
+    free(path);
+    goto out;
+  }
+
+  // write to a temporary so another instance never loads a partial file
+  FILE * fp = fopen(tmp, "wb");
+  if (!fp)
+    DEBUG_WARN("Failed to open %s for writing", tmp);
+  else
+  {
+    bool ok =
+      fwrite(&header, sizeof(header), 1, fp) == 1 &&
+      fwrite(data, length, 1, fp) == 1;
+
+    if (fclose(fp) != 0)
+      ok = false;
+
+    if (!ok || rename(tmp, path) < 0)
+    {
+      DEBUG_WARN("Failed to write %s", path);
+      remove(tmp);
+    }
+  }
+
+  free(tmp);
+  free(path);
+
+out:
+  free(data);
+}
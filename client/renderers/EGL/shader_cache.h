@@ -0,0 +1,38 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <GLES3/gl3.h>
+
+/* called once the context is current to enable the on disk program binary
+ * cache, the cache is keyed by the driver so an update invalidates it */
+void egl_shaderCacheInit(bool enable);
+void egl_shaderCacheFree(void);
+
+/* returns a linked program for the sources from the cache, or 0 on a miss */
+GLuint egl_shaderCacheLoad(const char * const * sources, const GLint * lengths,
+    int count);
+
+/* stores the binary of a program linked from the sources, the program must
+ * have been linked with GL_PROGRAM_BINARY_RETRIEVABLE_HINT set */
+void egl_shaderCacheStore(GLuint program, const char * const * sources,
+    const GLint * lengths, int count);
@@ -105,7 +105,43 @@ bool egl_textureSetup(EGL_Texture * this, enum EGL_PixelFormat pixFmt,
   if (!egl_texUtilGetFormat(&setup, &this->format))
     return false;
 
-  return this->ops.setup(this, &setup);
+  if (!this->ops.setup(this, &setup))
+    return false;
+
+  egl_textureInvalidate(this);
+  return true;
+}
+
+static void nextGeneration(EGL_Texture * this)
+{
+  // a global counter so a new texture at a freed address can not match
+  static _Atomic(uint64_t) generation = 0;
+  this->damageBase = atomic_load(&this->generation);
+  atomic_store(&this->generation, atomic_fetch_add(&generation, 1) + 1);
+}
+
+void egl_textureInvalidate(EGL_Texture * this)
+{
+  this->damage.count = -1;
+  nextGeneration(this);
+}
+
+void egl_textureInvalidateRects(EGL_Texture * this,
+    const struct TexDamage * damage)
+{
+  this->damage.count = damage->count;
+  if (damage->count > 0)
+    memcpy(this->damage.rects, damage->rects,
+        sizeof(*damage->rects) * damage->count);
+  nextGeneration(this);
+}
+
+const struct TexDamage * egl_textureGetDamage(EGL_Texture * this,
+    uint64_t generation)
+{
+  if (this->damageBase != generation || this->damage.count < 0)
+    return NULL;
+  return &this->damage;
 }
 
 bool egl_textureUpdate(EGL_Texture * this, const uint8_t * buffer, bool topDown)
@@ -156,7 +192,7 @@ bool egl_textureUpdateRect(EGL_Texture * this,
 
 bool egl_textureUpdateFromFrame(EGL_Texture * this,
     const FrameBuffer * frame, const FrameDamageRect * damageRects,
-    int damageRectsCount)
+    int damageRectsCount, const FrameDamageMap * damageMap, bool compressed)
 {
   const struct EGL_TexUpdate update =
   {
@@ -168,8 +204,10 @@ bool egl_textureUpdateFromFrame(EGL_Texture * this,
     .pitch     = this->format.pitch,
     .stride    = this->format.stride,
     .frame     = frame,
-    .rects     = damageRects,
-    .rectCount = damageRectsCount,
+    .rects      = damageRects,
+    .rectCount  = damageRectsCount,
+    .damageMap  = damageMap,
+    .compressed = compressed
   };
 
   return this->ops.update(this, &update);
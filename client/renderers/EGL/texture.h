@@ -21,11 +21,14 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include "egl.h"
 #include "egltypes.h"
 #include "shader.h"
 #include "model.h"
 #include "common/framebuffer.h"
+#include "common/KVMFR.h"
 #include "common/types.h"
 
 #include "util.h"
@@ -64,6 +67,8 @@ typedef struct EGL_TexUpdate
       const FrameBuffer * frame;
       const FrameDamageRect * rects;
       int rectCount;
+      const FrameDamageMap * damageMap; // NULL if the rects are exact
+      bool compressed;
     };
 
     /* EGL_TEXTYPE_DMABUF */
@@ -72,6 +77,13 @@ typedef struct EGL_TexUpdate
 }
 EGL_TexUpdate;
 
+// a count of -1 means the whole texture is damaged
+struct TexDamage
+{
+  int             count;
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+};
+
 typedef struct EGL_Texture EGL_Texture;
 
 typedef struct EGL_TextureOps
@@ -103,8 +115,27 @@ struct EGL_Texture
   GLuint sampler;
 
   EGL_TexFormat format;
+
+  /* changes whenever the content returned by get changes so consumers can
+   * cache work derived from it, unique across all textures */
+  _Atomic(uint64_t) generation;
+
+  /* the area that changed from the generation before the current one */
+  uint64_t         damageBase;
+  struct TexDamage damage;
 };
 
+/* called by the texture implementations when the content has changed */
+void egl_textureInvalidate(EGL_Texture * texture);
+
+/* as above when only the damaged area has changed */
+void egl_textureInvalidateRects(EGL_Texture * texture,
+    const struct TexDamage * damage);
+
+/* returns the area changed since generation, or NULL if it is not known */
+const struct TexDamage * egl_textureGetDamage(EGL_Texture * texture,
+    uint64_t generation);
+
 bool egl_textureInit(EGL_Texture ** texture, EGLDisplay * display,
     EGL_TexType type);
 void egl_textureFree(EGL_Texture ** tex);
@@ -121,7 +152,7 @@ bool egl_textureUpdateRect(EGL_Texture * texture,
 
 bool egl_textureUpdateFromFrame(EGL_Texture * texture,
     const FrameBuffer * frame, const FrameDamageRect * damageRects,
-    int damageRectsCount);
+    int damageRectsCount, const FrameDamageMap * damageMap, bool compressed);
 
 bool egl_textureUpdateFromDMA(EGL_Texture * texture,
     const FrameBuffer * frame, const int dmaFd);
@@ -149,6 +180,4 @@ void egl_textureEnableFilter(PostProcessHandle * handle, bool enable);
 void egl_textureSetFilterRes(PostProcessHandle * handle,
     unsigned int x, unsigned int y);
 
-void egl_textureInvalidate(EGL_Texture * texture);
-
 void egl_textureGetFinalSize(EGL_Texture * texture, struct Rect * rect);
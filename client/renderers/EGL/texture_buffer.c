@@ -19,8 +19,12 @@
  */
 
 #include "texture_buffer.h"
+#include "texture_upload.h"
 
 #include "egldebug.h"
+#include "egl_dynprocs.h"
+#include "common/time.h"
+#include "common/rects.h"
 
 #include <string.h>
 
@@ -28,10 +32,37 @@
 extern const EGL_TextureOps EGL_TextureBuffer;
 extern const EGL_TextureOps EGL_TextureBufferStream;
 
+static bool l_copySupported = false;
+
 // internal functions
 
+// add rects to the damage, a negative count is the whole texture
+static void addDamage(struct TexDamage * damage, const FrameDamageRect * rects,
+    int count)
+{
+  if (count < 0)
+    damage->count = -1;
+  else if (damage->count >= 0 && count > 0)
+  {
+    if (damage->count + count > KVMFR_MAX_DAMAGE_RECTS)
+      damage->count = rectsMergeOverlapping(damage->rects, damage->count);
+
+    if (damage->count + count > KVMFR_MAX_DAMAGE_RECTS)
+      damage->count = -1;
+    else
+    {
+      memcpy(damage->rects + damage->count, rects, count * sizeof(*rects));
+      damage->count += count;
+    }
+  }
+}
+
 static void egl_texBuffer_cleanup(TextureBuffer * this)
 {
+  // wait for the uploader to be done with the texture
+  if (this->threaded)
+    egl_texUploadRemove(this);
+
   egl_texUtilFreeBuffers(this->buf, this->texCount);
 
   if (this->tex[0])
@@ -42,10 +73,32 @@ static void egl_texBuffer_cleanup(TextureBuffer * this)
     glDeleteSync(this->sync);
     this->sync = 0;
   }
+
+  for(int i = 0; i < EGL_TEX_BUFFER_MAX; ++i)
+  {
+    if (this->fence[i])
+    {
+      glDeleteSync(this->fence[i]);
+      this->fence[i] = 0;
+    }
+    atomic_store(&this->state[i], EGL_TEX_SLOT_IDLE);
+    this->upload[i].count = -1;
+    this->copy[i].count   = 0;
+    this->seq[i]          = 0;
+  }
+  atomic_store(&this->latest  , -1);
+  atomic_store(&this->uploaded, -1);
+  this->uploadSeq = 0;
+  this->shownSeq  = 0;
 }
 
 // common functions
 
+void egl_texBufferCopyInit(bool enable)
+{
+  l_copySupported = enable && g_egl_dynProcs.glCopyImageSubData;
+}
+
 bool egl_texBufferInit(EGL_Texture ** texture, EGL_TexType type,
     EGLDisplay * display)
 {
@@ -98,6 +151,9 @@ bool egl_texBufferSetup(EGL_Texture * texture, const EGL_TexSetup * setup)
         texture->format.format,
         texture->format.dataType,
         NULL);
+
+    // without mipmaps the texture is incomplete, which the copies refuse
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
   }
 
   glBindTexture(GL_TEXTURE_2D, 0);
@@ -124,6 +180,7 @@ static bool egl_texBufferUpdate(EGL_Texture * texture, const EGL_TexUpdate * upd
       update->buffer);
   glBindTexture(GL_TEXTURE_2D, 0);
 
+  egl_textureInvalidate(texture);
   return true;
 }
 
@@ -151,10 +208,17 @@ bool egl_texBufferStreamInit(EGL_Texture ** texture, EGL_TexType type,
 
   switch(type)
   {
-    case EGL_TEXTYPE_BUFFER_STREAM:
     case EGL_TEXTYPE_FRAMEBUFFER:
+      this->threaded = egl_texUploadActive();
+      // fallthrough
+
+    case EGL_TEXTYPE_BUFFER_STREAM:
+      this->texCount = EGL_TEX_BUFFER_MAX;
+      break;
+
     case EGL_TEXTYPE_DMABUF:
-      this->texCount = 2;
+      // the imported images provide their own textures
+      this->texCount = 0;
       break;
 
     case EGL_TEXTYPE_BUFFER_MAP:
@@ -175,7 +239,127 @@ bool egl_texBufferStreamSetup(EGL_Texture * texture, const EGL_TexSetup * setup)
     return false;
 
   TextureBuffer * this = UPCAST(TextureBuffer, texture);
-  return egl_texUtilGenBuffers(&texture->format, this->buf, this->texCount);
+  if (!egl_texUtilGenBuffers(&texture->format, this->buf, this->texCount))
+    return false;
+
+  if (this->threaded)
+    egl_texUploadAdd(this);
+  return true;
+}
+
+static bool egl_texBufferStreamTryAcquire(TextureBuffer * this, int slot)
+{
+  int state = atomic_load(&this->state[slot]);
+  switch(state)
+  {
+    case EGL_TEX_SLOT_IDLE:
+    case EGL_TEX_SLOT_READY:
+      // a READY slot that was not uploaded yet has been superseded
+      return atomic_compare_exchange_strong(&this->state[slot], &state,
+          EGL_TEX_SLOT_WRITING);
+
+    case EGL_TEX_SLOT_INFLIGHT:
+      /* only the writer and, to show it, the render thread leave INFLIGHT
+       * and the render thread does not touch the fence until it has */
+      switch(glClientWaitSync(this->fence[slot], 0, 0))
+      {
+        case GL_TIMEOUT_EXPIRED:
+          return false;
+
+        case GL_WAIT_FAILED:
+        case GL_INVALID_VALUE:
+          DEBUG_GL_ERROR("glClientWaitSync failed");
+          break;
+      }
+
+      if (!atomic_compare_exchange_strong(&this->state[slot], &state,
+            EGL_TEX_SLOT_WRITING))
+        return false;
+
+      glDeleteSync(this->fence[slot]);
+      this->fence[slot] = 0;
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+void egl_texBufferStreamAcquire(TextureBuffer * this)
+{
+  const int last = atomic_load(&this->latest);
+  for(;;)
+  {
+    /* prefer the oldest slot, the last written slot is tried last as reusing
+     * it drops the frame that is still waiting to be uploaded */
+    for(int i = 1; i <= this->texCount; ++i)
+    {
+      const int slot = (last + i) % this->texCount;
+      if (egl_texBufferStreamTryAcquire(this, slot))
+      {
+        this->bufIndex = slot;
+        return;
+      }
+    }
+
+    // the GPU is behind on every slot, wait for the oldest copy to complete
+    const int slot = (last + 1) % this->texCount;
+    if (atomic_load(&this->state[slot]) == EGL_TEX_SLOT_INFLIGHT)
+      glClientWaitSync(this->fence[slot], 0, 1000000); // 1ms
+    else
+      nsleep(100000);
+  }
+}
+
+bool egl_texBufferStreamCopy(TextureBuffer * this,
+    const struct TexDamage * changed)
+{
+  if (!l_copySupported)
+    return false;
+
+  /* the slot published last holds the previous frame, its texture does too
+   * once the upload has taken it, as only this thread publishes any slot and
+   * the texture only changes again in an upload queued after this slot's */
+  const int src = atomic_load(&this->latest);
+  if (src < 0 || src == this->bufIndex)
+    return false;
+
+  switch(atomic_load(&this->state[src]))
+  {
+    case EGL_TEX_SLOT_UPLOADING:
+    case EGL_TEX_SLOT_INFLIGHT:
+    case EGL_TEX_SLOT_DISPLAYED:
+      break;
+
+    default:
+      return false;
+  }
+
+  /* what the slot had pending is older than the source, so take it from the
+   * source as well rather than from the PBO */
+  const int slot = this->bufIndex;
+  struct TexDamage * copy   = this->copy   + slot;
+  struct TexDamage * upload = this->upload + slot;
+  addDamage(copy, changed->rects, changed->count);
+  addDamage(copy, upload ->rects, upload ->count);
+  upload->count = 0;
+
+  this->copySrc[slot] = src;
+  return true;
+}
+
+void egl_texBufferStreamRelease(TextureBuffer * this,
+    const FrameDamageRect * rects, int count)
+{
+  addDamage(this->upload + this->bufIndex, rects,
+      rects && count > 0 ? count : -1);
+
+  atomic_store(&this->state[this->bufIndex], EGL_TEX_SLOT_READY);
+  atomic_store(&this->latest, this->bufIndex);
+
+  // the render thread is woken once this returns so the copy must be queued
+  if (this->threaded)
+    egl_texUploadWait(egl_texUploadKick());
 }
 
 static bool egl_texBufferStreamUpdate(EGL_Texture * texture,
@@ -184,18 +368,21 @@ static bool egl_texBufferStreamUpdate(EGL_Texture * texture,
   TextureBuffer * this = UPCAST(TextureBuffer, texture);
   DEBUG_ASSERT(update->type == EGL_TEXTYPE_BUFFER);
 
-  LG_LOCK(this->copyLock);
+  egl_texBufferStreamAcquire(this);
 
   uint8_t * dst = this->buf[this->bufIndex].map +
     texture->format.stride * update->y +
     update->x * texture->format.bpp;
 
+  // the source may be a rect of a wider image, only copy the rect's width
+  const size_t rowSize = update->width * texture->format.bpp;
+
   if (update->topDown)
   {
     const uint8_t * src = update->buffer;
     for(int y = 0; y < update->height; ++y)
     {
-      memcpy(dst, src, update->stride);
+      memcpy(dst, src, rowSize);
       dst += texture->format.stride;
       src += update->stride;
     }
@@ -206,42 +393,78 @@ static bool egl_texBufferStreamUpdate(EGL_Texture * texture,
     for(int y = 0; y < update->height; ++y)
     {
       src -= update->stride;
-      memcpy(dst, src, update->stride);
+      memcpy(dst, src, rowSize);
       dst += texture->format.stride;
     }
   }
 
-  this->buf[this->bufIndex].updated = true;
-  LG_UNLOCK(this->copyLock);
-
+  egl_texBufferStreamRelease(this, &(FrameDamageRect) {
+      .x      = update->x,
+      .y      = update->y,
+      .width  = update->width,
+      .height = update->height
+    }, 1);
   return true;
 }
 
-EGL_TexStatus egl_texBufferStreamProcess(EGL_Texture * texture)
+/* queues the copy of the newest published slot from its PBO to its texture,
+ * returning the slot, or -1 if there is nothing new. The slot's upload damage
+ * is left for the caller to consume */
+static int uploadLatest(TextureBuffer * this)
 {
-  TextureBuffer * this = UPCAST(TextureBuffer, texture);
+  EGL_Texture * texture = &this->base;
 
-  LG_LOCK(this->copyLock);
+  const int slot = atomic_load(&this->latest);
+  if (slot < 0)
+    return -1;
 
-  GLuint          tex    = this->tex[this->bufIndex];
-  EGL_TexBuffer * buffer = &this->buf[this->bufIndex];
+  // if the writer reclaimed the slot it will be published again shortly
+  int state = EGL_TEX_SLOT_READY;
+  if (!atomic_compare_exchange_strong(&this->state[slot], &state,
+        EGL_TEX_SLOT_UPLOADING))
+    return -1;
 
-  if (buffer->updated && this->sync == 0)
+  struct TexDamage * damage = this->upload + slot;
+  if (damage->count > 0)
   {
-    this->rIndex = this->bufIndex;
-    if (++this->bufIndex == this->texCount)
-      this->bufIndex = 0;
+    // many small uploads cost more than one large one
+    damage->count = rectsOptimize(damage->rects, damage->count,
+        KVMFR_MAX_DAMAGE_RECTS, texture->format.width, texture->format.height,
+        50);
+    if (damage->count == 0)
+      damage->count = -1;
   }
 
-  LG_UNLOCK(this->copyLock);
-
-  if (buffer->updated)
+  /* the copies come first as the PBO holds the newer content where the two
+   * overlap, they then count as uploaded damage */
+  struct TexDamage * copy = this->copy + slot;
+  if (copy->count != 0)
   {
-    buffer->updated = false;
+    const GLuint src = this->tex[this->copySrc[slot]];
+    if (copy->count < 0)
+      g_egl_dynProcs.glCopyImageSubData(
+          src           , GL_TEXTURE_2D, 0, 0, 0, 0,
+          this->tex[slot], GL_TEXTURE_2D, 0, 0, 0, 0,
+          texture->format.width, texture->format.height, 1);
+    else
+    {
+      copy->count = rectsMergeOverlapping(copy->rects, copy->count);
+      for(int i = 0; i < copy->count; ++i)
+      {
+        const FrameDamageRect * rect = copy->rects + i;
+        g_egl_dynProcs.glCopyImageSubData(
+            src           , GL_TEXTURE_2D, 0, rect->x, rect->y, 0,
+            this->tex[slot], GL_TEXTURE_2D, 0, rect->x, rect->y, 0,
+            rect->width, rect->height, 1);
+      }
+    }
+  }
 
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer->pbo);
-    glBindTexture(GL_TEXTURE_2D, tex);
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, texture->format.pitch);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->buf[slot].pbo);
+
+  glBindTexture(GL_TEXTURE_2D, this->tex[slot]);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, texture->format.pitch);
+  if (damage->count < 0)
     glTexSubImage2D(GL_TEXTURE_2D,
         0, 0, 0,
         texture->format.width,
@@ -249,13 +472,110 @@ EGL_TexStatus egl_texBufferStreamProcess(EGL_Texture * texture)
         texture->format.format,
         texture->format.dataType,
         (const void *)0);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  else
+    for(int i = 0; i < damage->count; ++i)
+    {
+      const FrameDamageRect * rect = damage->rects + i;
+      glTexSubImage2D(GL_TEXTURE_2D,
+          0, rect->x, rect->y,
+          rect->width,
+          rect->height,
+          texture->format.format,
+          texture->format.dataType,
+          (const void *)(uintptr_t)(rect->y * texture->format.stride +
+            rect->x * texture->format.bpp));
+    }
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  if (copy->count != 0)
+  {
+    addDamage(damage, copy->rects, copy->count);
+    copy->count = 0;
+  }
+  return slot;
+}
 
-    this->sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+void egl_texBufferStreamUpload(TextureBuffer * this)
+{
+  const int slot = uploadLatest(this);
+  if (slot < 0)
+    return;
+
+  this->shown[slot] = this->upload[slot];
+  this->upload[slot].count = 0;
+  this->seq[slot] = ++this->uploadSeq;
+
+  // flush so the fence can signal for the other contexts
+  this->fence[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  glFlush();
+
+  atomic_store(&this->state[slot], EGL_TEX_SLOT_INFLIGHT);
+  atomic_store(&this->uploaded, slot);
+}
+
+// picks up the newest slot the upload thread has finished with
+static EGL_TexStatus streamShowUploaded(TextureBuffer * this)
+{
+  EGL_Texture * texture = &this->base;
+
+  const int slot = atomic_load(&this->uploaded);
+  if (slot < 0 || slot == this->rIndex)
+    return EGL_TEX_STATUS_OK;
+
+  // the writer may have taken it back, then a newer upload follows
+  int state = EGL_TEX_SLOT_INFLIGHT;
+  if (!atomic_compare_exchange_strong(&this->state[slot], &state,
+        EGL_TEX_SLOT_DISPLAYED))
+    return EGL_TEX_STATUS_OK;
+
+  // the copy only has to be done before the GPU samples the texture
+  glWaitSync(this->fence[slot], 0, GL_TIMEOUT_IGNORED);
+
+  /* the slot's damage covers every frame since it was last uploaded, which is
+   * only a superset of the change from the slot shown last if that one was
+   * the upload just before it */
+  if (this->seq[slot] == this->shownSeq + 1)
+    egl_textureInvalidateRects(texture, this->shown + slot);
+  else
+    egl_textureInvalidate(texture);
+  this->shownSeq = this->seq[slot];
+
+  if (this->rIndex >= 0)
+  {
+    const int prev = this->rIndex;
+    glDeleteSync(this->fence[prev]);
+    this->fence[prev] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
     glFlush();
+    atomic_store(&this->state[prev], EGL_TEX_SLOT_INFLIGHT);
   }
 
+  this->rIndex = slot;
+  return EGL_TEX_STATUS_OK;
+}
+
+EGL_TexStatus egl_texBufferStreamProcess(EGL_Texture * texture)
+{
+  TextureBuffer * this = UPCAST(TextureBuffer, texture);
+  if (this->threaded)
+    return streamShowUploaded(this);
+
+  const int slot = uploadLatest(this);
+  if (slot < 0)
+    return EGL_TEX_STATUS_OK;
+
+  /* the slot's damage covers every frame since it was last uploaded, which is
+   * a superset of the change from the previous slot */
+  struct TexDamage * damage = this->upload + slot;
+  egl_textureInvalidateRects(texture, damage);
+  damage->count = 0;
+
+  // flush so the fence can signal for the writer in the other context
+  this->fence[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  glFlush();
+
+  this->rIndex = slot;
+  atomic_store(&this->state[slot], EGL_TEX_SLOT_INFLIGHT);
   return EGL_TEX_STATUS_OK;
 }
 
@@ -266,28 +586,7 @@ EGL_TexStatus egl_texBufferStreamGet(EGL_Texture * texture, GLuint * tex)
   if (this->rIndex == -1)
     return EGL_TEX_STATUS_NOTREADY;
 
-  if (this->sync)
-  {
-    switch(glClientWaitSync(this->sync, 0, 40000000)) // 40ms
-    {
-      case GL_ALREADY_SIGNALED:
-      case GL_CONDITION_SATISFIED:
-        glDeleteSync(this->sync);
-        this->sync = 0;
-        break;
-
-      case GL_TIMEOUT_EXPIRED:
-        return EGL_TEX_STATUS_NOTREADY;
-
-      case GL_WAIT_FAILED:
-      case GL_INVALID_VALUE:
-        glDeleteSync(this->sync);
-        this->sync = 0;
-        DEBUG_GL_ERROR("glClientWaitSync failed");
-        return EGL_TEX_STATUS_ERROR;
-    }
-  }
-
+  // the upload was queued on this context so sampling is already ordered
   *tex = this->tex[this->rIndex];
   return EGL_TEX_STATUS_OK;
 }
@@ -23,8 +23,29 @@
 #include "texture.h"
 #include "texture_util.h"
 #include "common/locking.h"
+#include "common/KVMFR.h"
 
-#define EGL_TEX_BUFFER_MAX 2
+#include <stdatomic.h>
+
+#define EGL_TEX_BUFFER_MAX 3
+
+/* the life cycle of a streaming slot, the writer moves a slot from IDLE, READY
+ * or a signalled INFLIGHT to WRITING, the render thread moves READY through
+ * UPLOADING to INFLIGHT once the PBO to texture copy has been queued.
+ *
+ * With the upload thread it does the copy instead, and the render thread
+ * holds the slot it is showing as DISPLAYED so the texture is not written
+ * while it is sampled. Leaving DISPLAYED the slot's fence is replaced by one
+ * placed after the last draw that sampled it */
+enum EGL_TexSlotState
+{
+  EGL_TEX_SLOT_IDLE,
+  EGL_TEX_SLOT_WRITING,
+  EGL_TEX_SLOT_READY,
+  EGL_TEX_SLOT_UPLOADING,
+  EGL_TEX_SLOT_INFLIGHT,
+  EGL_TEX_SLOT_DISPLAYED
+};
 
 typedef struct TextureBuffer
 {
@@ -34,14 +55,38 @@ typedef struct TextureBuffer
   int           texCount;
   GLuint        tex[EGL_TEX_BUFFER_MAX];
   EGL_TexBuffer buf[EGL_TEX_BUFFER_MAX];
-  int           bufFree;
   GLsync        sync;
   LG_Lock       copyLock;
   int           bufIndex;
   int           rIndex;
+
+  // streaming slot ring, the fences guard reuse of the persistent PBOs
+  _Atomic(int)  state[EGL_TEX_BUFFER_MAX];
+  GLsync        fence[EGL_TEX_BUFFER_MAX];
+  _Atomic(int)  latest;
+
+  // regions of each PBO that differ from its texture, owned with the slot
+  struct TexDamage upload[EGL_TEX_BUFFER_MAX];
+
+  /* regions copied into the slot's texture from the texture of copySrc before
+   * its upload, owned with the slot the same as the upload damage */
+  struct TexDamage copy[EGL_TEX_BUFFER_MAX];
+  int              copySrc[EGL_TEX_BUFFER_MAX];
+
+  /* set if the upload thread copies the slots, it stores the last slot it
+   * uploaded, the damage that upload covered and the count of uploads */
+  bool              threaded;
+  _Atomic(int)      uploaded;
+  struct TexDamage  shown[EGL_TEX_BUFFER_MAX];
+  uint64_t          seq[EGL_TEX_BUFFER_MAX];
+  uint64_t          uploadSeq, shownSeq;
 }
 TextureBuffer;
 
+/* enables copying the regions the writer did not rewrite between textures,
+ * the context must support glCopyImageSubData */
+void egl_texBufferCopyInit(bool enable);
+
 bool egl_texBufferInit(EGL_Texture ** texture_, EGL_TexType type,
     EGLDisplay * display);
 void egl_texBufferFree(EGL_Texture * texture_);
@@ -54,4 +99,23 @@ bool egl_texBufferStreamInit(EGL_Texture ** texture_, EGL_TexType type,
 bool egl_texBufferStreamSetup(EGL_Texture * texture_,
     const EGL_TexSetup * setup);
 EGL_TexStatus egl_texBufferStreamProcess(EGL_Texture * texture_);
+
+/* claim a slot to write into, it is returned in bufIndex. This only waits if
+ * the GPU still has every slot in flight */
+void egl_texBufferStreamAcquire(TextureBuffer * this);
+
+/* with the slot held, have the regions in changed copied into its texture
+ * from the texture of the previous frame, along with anything the slot has
+ * not uploaded yet. Returns false if that texture does not hold the frame in
+ * full yet, then the writer has to provide every region itself */
+bool egl_texBufferStreamCopy(TextureBuffer * this,
+    const struct TexDamage * changed);
+
+/* publish the slot, rects are the regions that were written, pass NULL for
+ * the whole texture */
+void egl_texBufferStreamRelease(TextureBuffer * this,
+    const FrameDamageRect * rects, int count);
 EGL_TexStatus egl_texBufferStreamGet(EGL_Texture * texture_, GLuint * tex);
+
+// called by the upload thread to copy the newest published slot
+void egl_texBufferStreamUpload(TextureBuffer * this);
@@ -23,13 +23,28 @@
 #include "util.h"
 
 #include "common/vector.h"
+#include "common/KVMFR.h"
 #include "egl_dynprocs.h"
 #include "egldebug.h"
 
+#include <sys/stat.h>
+
+/* a few formats worth of frame buffers, beyond this the least recently used
+ * image is released */
+#define DMABUF_CACHE_MAX (LGMP_Q_FRAME_LEN_MAX * 4)
+
 struct FdImage
 {
-  int fd;
+  // the fd number may be reused after a close so the inode identifies it
+  ino_t        ino;
+  int          fd;
+  unsigned int offset;
+  unsigned int fourcc;
+  unsigned int width, height, stride;
+
   EGLImage image;
+  GLuint   tex;
+  uint64_t lastUsed;
 };
 
 typedef struct TexDMABUF
@@ -39,6 +54,13 @@ typedef struct TexDMABUF
   EGLDisplay display;
   bool hasImportModifiers;
   Vector images;
+
+  uint64_t useCount;
+  unsigned int hits, misses;
+
+  // the texture of the last imported frame and the one handed to render
+  GLuint pending;
+  GLuint current;
 }
 TexDMABUF;
 
@@ -46,12 +68,134 @@ EGL_TextureOps EGL_TextureDMABUF;
 
 // internal functions
 
-static void egl_texDMABUFCleanup(TexDMABUF * this)
+static void egl_texDMABUFFreeImage(TexDMABUF * this, struct FdImage * image)
+{
+  glDeleteTextures(1, &image->tex);
+  g_egl_dynProcs.eglDestroyImage(this->display, image->image);
+}
+
+/* releases the images that can not be used with the current format, those of
+ * the same size are kept in case the format switches back */
+static void egl_texDMABUFCleanup(TexDMABUF * this, bool all)
+{
+  const EGL_TexFormat * format = &this->base.base.format;
+  for(int i = vector_size(&this->images) - 1; i >= 0; --i)
+  {
+    struct FdImage * image = vector_ptrTo(&this->images, i);
+    if (!all && image->width == format->width &&
+        image->height == format->height)
+      continue;
+
+    egl_texDMABUFFreeImage(this, image);
+    vector_remove(&this->images, i);
+  }
+
+  INTERLOCKED_SECTION(this->base.copyLock,
+  {
+    this->pending = 0;
+    this->current = 0;
+  });
+}
+
+static struct FdImage * egl_texDMABUFImport(TexDMABUF * this, int fd)
 {
+  const EGL_TexFormat * format = &this->base.base.format;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+  {
+    DEBUG_ERROR("Failed to stat the DMABUF fd");
+    return NULL;
+  }
+
   struct FdImage * image;
   vector_forEachRef(image, &this->images)
-    g_egl_dynProcs.eglDestroyImage(this->display, image->image);
-  vector_clear(&this->images);
+    if (image->ino    == st.st_ino      &&
+        image->fd     == fd             &&
+        image->offset == 0              &&
+        image->fourcc == format->fourcc &&
+        image->width  == format->width  &&
+        image->height == format->height &&
+        image->stride == format->stride)
+    {
+      ++this->hits;
+      image->lastUsed = ++this->useCount;
+      return image;
+    }
+
+  if (vector_size(&this->images) >= DMABUF_CACHE_MAX)
+  {
+    int oldest = 0;
+    for(int i = 1; i < vector_size(&this->images); ++i)
+      if (((struct FdImage *)vector_ptrTo(&this->images, i))->lastUsed <
+          ((struct FdImage *)vector_ptrTo(&this->images, oldest))->lastUsed)
+        oldest = i;
+
+    egl_texDMABUFFreeImage(this, vector_ptrTo(&this->images, oldest));
+    vector_remove(&this->images, oldest);
+  }
+
+  const uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
+  EGLAttrib attribs[] =
+  {
+    EGL_WIDTH                         , format->width,
+    EGL_HEIGHT                        , format->height,
+    EGL_LINUX_DRM_FOURCC_EXT          , format->fourcc,
+    EGL_DMA_BUF_PLANE0_FD_EXT         , fd,
+    EGL_DMA_BUF_PLANE0_OFFSET_EXT     , 0,
+    EGL_DMA_BUF_PLANE0_PITCH_EXT      , format->stride,
+    EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, (modifier & 0xffffffff),
+    EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT, (modifier >> 32),
+    EGL_NONE                          , EGL_NONE
+  };
+
+  if (!this->hasImportModifiers)
+    attribs[12] = attribs[13] =
+    attribs[14] = attribs[15] = EGL_NONE;
+
+  struct FdImage entry =
+  {
+    .ino      = st.st_ino,
+    .fd       = fd,
+    .offset   = 0,
+    .fourcc   = format->fourcc,
+    .width    = format->width,
+    .height   = format->height,
+    .stride   = format->stride,
+    .lastUsed = ++this->useCount
+  };
+
+  entry.image = g_egl_dynProcs.eglCreateImage(
+      this->display,
+      EGL_NO_CONTEXT,
+      EGL_LINUX_DMA_BUF_EXT,
+      (EGLClientBuffer)NULL,
+      attribs);
+
+  if (entry.image == EGL_NO_IMAGE)
+  {
+    DEBUG_EGL_ERROR("Failed to create EGLImage for DMA transfer");
+    return NULL;
+  }
+
+  // each image keeps its own texture so a hit does not need to rebind it
+  glGenTextures(1, &entry.tex);
+  glBindTexture(GL_TEXTURE_2D, entry.tex);
+  g_egl_dynProcs.glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, entry.image);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  image = vector_push(&this->images, &entry);
+  if (!image)
+  {
+    DEBUG_ERROR("Failed to store EGLImage");
+    egl_texDMABUFFreeImage(this, &entry);
+    return NULL;
+  }
+
+  ++this->misses;
+  DEBUG_INFO("DMABUF import cache miss, fd %d (%u hits, %u misses)",
+      fd, this->hits, this->misses);
+  return image;
 }
 
 // dmabuf functions
@@ -62,7 +206,7 @@ static bool egl_texDMABUFInit(EGL_Texture ** texture, EGL_TexType type,
   TexDMABUF * this = calloc(1, sizeof(*this));
   *texture = &this->base.base;
 
-  if (!vector_create(&this->images, sizeof(struct FdImage), 2))
+  if (!vector_create(&this->images, sizeof(struct FdImage), DMABUF_CACHE_MAX))
   {
     free(this);
     *texture = NULL;
@@ -92,7 +236,7 @@ static void egl_texDMABUFFree(EGL_Texture * texture)
   TextureBuffer * parent = UPCAST(TextureBuffer, texture);
   TexDMABUF     * this   = UPCAST(TexDMABUF    , parent);
 
-  egl_texDMABUFCleanup(this);
+  egl_texDMABUFCleanup(this, true);
   vector_destroy(&this->images);
 
   egl_texBufferFree(&parent->base);
@@ -104,9 +248,11 @@ static bool egl_texDMABUFSetup(EGL_Texture * texture, const EGL_TexSetup * setup
   TextureBuffer * parent = UPCAST(TextureBuffer, texture);
   TexDMABUF     * this   = UPCAST(TexDMABUF    , parent);
 
-  egl_texDMABUFCleanup(this);
+  if (!egl_texBufferSetup(&parent->base, setup))
+    return false;
 
-  return egl_texBufferSetup(&parent->base, setup);
+  egl_texDMABUFCleanup(this, false);
+  return true;
 }
 
 static bool egl_texDMABUFUpdate(EGL_Texture * texture,
@@ -117,64 +263,13 @@ static bool egl_texDMABUFUpdate(EGL_Texture * texture,
 
   DEBUG_ASSERT(update->type == EGL_TEXTYPE_DMABUF);
 
-  EGLImage image = EGL_NO_IMAGE;
-
-  struct FdImage * fdImage;
-  vector_forEachRef(fdImage, &this->images)
-    if (fdImage->fd == update->dmaFD)
-    {
-      image = fdImage->image;
-      break;
-    }
-
-  if (image == EGL_NO_IMAGE)
-  {
-    const uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
-    EGLAttrib attribs[] =
-    {
-      EGL_WIDTH                         , texture->format.width,
-      EGL_HEIGHT                        , texture->format.height,
-      EGL_LINUX_DRM_FOURCC_EXT          , texture->format.fourcc,
-      EGL_DMA_BUF_PLANE0_FD_EXT         , update->dmaFD,
-      EGL_DMA_BUF_PLANE0_OFFSET_EXT     , 0,
-      EGL_DMA_BUF_PLANE0_PITCH_EXT      , texture->format.stride,
-      EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, (modifier & 0xffffffff),
-      EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT, (modifier >> 32),
-      EGL_NONE                          , EGL_NONE
-    };
-
-    if (!this->hasImportModifiers)
-      attribs[12] = attribs[13] =
-      attribs[14] = attribs[15] = EGL_NONE;
-
-    image = g_egl_dynProcs.eglCreateImage(
-        this->display,
-        EGL_NO_CONTEXT,
-        EGL_LINUX_DMA_BUF_EXT,
-        (EGLClientBuffer)NULL,
-        attribs);
-
-    if (image == EGL_NO_IMAGE)
-    {
-      DEBUG_EGL_ERROR("Failed to create EGLImage for DMA transfer");
-      return false;
-    }
-
-    if (!vector_push(&this->images, &(struct FdImage) {
-      .fd    = update->dmaFD,
-      .image = image,
-    }))
-    {
-      DEBUG_ERROR("Failed to store EGLImage");
-      g_egl_dynProcs.eglDestroyImage(this->display, image);
-      return false;
-    }
-  }
+  struct FdImage * image = egl_texDMABUFImport(this, update->dmaFD);
+  if (!image)
+    return false;
 
   INTERLOCKED_SECTION(parent->copyLock,
   {
-    glBindTexture(GL_TEXTURE_2D, parent->tex[parent->bufIndex]);
-    g_egl_dynProcs.glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+    this->pending = image->tex;
 
     if (parent->sync)
       glDeleteSync(parent->sync);
@@ -193,48 +288,32 @@ static EGL_TexStatus egl_texDMABUFProcess(EGL_Texture * texture)
 static EGL_TexStatus egl_texDMABUFGet(EGL_Texture * texture, GLuint * tex)
 {
   TextureBuffer * parent = UPCAST(TextureBuffer, texture);
+  TexDMABUF     * this   = UPCAST(TexDMABUF    , parent);
   GLsync sync = 0;
 
   INTERLOCKED_SECTION(parent->copyLock,
   {
     if (parent->sync)
     {
-      sync           = parent->sync;
-      parent->sync   = 0;
-      parent->rIndex = parent->bufIndex;
-      if (++parent->bufIndex == parent->texCount)
-        parent->bufIndex = 0;
+      sync          = parent->sync;
+      parent->sync  = 0;
+      this->current = this->pending;
+      egl_textureInvalidate(texture);
     }
   });
 
+  /* have the GPU order the render after the import in the frame context
+   * instead of blocking this thread until it signals */
   if (sync)
   {
-    switch(glClientWaitSync(sync, 0, 20000000)) // 20ms
-    {
-      case GL_ALREADY_SIGNALED:
-      case GL_CONDITION_SATISFIED:
-        glDeleteSync(sync);
-        break;
-
-      case GL_TIMEOUT_EXPIRED:
-        INTERLOCKED_SECTION(parent->copyLock,
-        {
-          if (!parent->sync)
-            parent->sync = sync;
-          else
-            glDeleteSync(sync);
-        });
-        return EGL_TEX_STATUS_NOTREADY;
-
-      case GL_WAIT_FAILED:
-      case GL_INVALID_VALUE:
-        glDeleteSync(sync);
-        DEBUG_GL_ERROR("glClientWaitSync failed");
-        return EGL_TEX_STATUS_ERROR;
-    }
+    glWaitSync(sync, 0, GL_TIMEOUT_IGNORED);
+    glDeleteSync(sync);
   }
 
-  *tex = parent->tex[parent->rIndex];
+  if (!this->current)
+    return EGL_TEX_STATUS_NOTREADY;
+
+  *tex = this->current;
   return EGL_TEX_STATUS_OK;
 }
 
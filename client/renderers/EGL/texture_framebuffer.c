@@ -21,23 +21,72 @@
 #include "texture.h"
 
 #include "texture_buffer.h"
+#include "texture_pinned.h"
 #include "common/debug.h"
 #include "common/KVMFR.h"
 #include "common/rects.h"
 
-struct TexDamage
+/* each buffer also tracks its damage as tiles, which unlike the rects never
+ * run out of room, so scattered updates do not fall back to a full copy */
+struct TexFBMap
 {
-  int             count;
-  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+  bool    valid;
+  uint8_t bits[KVMFR_DAMAGE_MAP_SIZE];
 };
 
 typedef struct TexFB
 {
   TextureBuffer base;
+  // regions where each PBO is behind the frame
   struct TexDamage damage[EGL_TEX_BUFFER_MAX];
+  struct TexFBMap  map   [EGL_TEX_BUFFER_MAX];
+
+  // regions that changed since each buffer was last written
+  struct TexDamage changed[EGL_TEX_BUFFER_MAX];
+  unsigned int     tilesX, tilesY;
 }
 TexFB;
 
+// add the damage of an update to a buffer's map
+static void addMapDamage(TexFB * this, struct TexFBMap * map,
+    const EGL_TexUpdate * update, const FrameDamageMap * frameMap)
+{
+  if (!map->valid)
+    return;
+
+  if (frameMap)
+  {
+    const size_t size = rectsDamageMapStride(this->tilesX) * this->tilesY;
+    for (size_t i = 0; i < size; ++i)
+      map->bits[i] |= frameMap->bits[i];
+  }
+  else if (update->rects && update->rectCount > 0)
+    rectsDamageMapAdd(map->bits, this->tilesX, this->tilesY, update->rects,
+        update->rectCount);
+  else
+    map->valid = false;
+}
+
+// add the rects of an update to a buffer's damage
+static void addDamage(struct TexDamage * damage, const EGL_TexUpdate * update)
+{
+  if (update->rects && update->rectCount > 0 && damage->count >= 0 &&
+      damage->count + update->rectCount <= KVMFR_MAX_DAMAGE_RECTS)
+  {
+    memcpy(damage->rects + damage->count, update->rects,
+      update->rectCount * sizeof(FrameDamageRect));
+    damage->count += update->rectCount;
+  }
+  else
+    damage->count = -1;
+}
+
+static void resetMapDamage(TexFB * this, struct TexFBMap * map)
+{
+  map->valid = this->tilesX > 0;
+  memset(map->bits, 0, sizeof(map->bits));
+}
+
 static bool egl_texFBInit(EGL_Texture ** texture, EGL_TexType type,
     EGLDisplay * display)
 {
@@ -53,7 +102,10 @@ static bool egl_texFBInit(EGL_Texture ** texture, EGL_TexType type,
   }
 
   for (int i = 0; i < EGL_TEX_BUFFER_MAX; ++i)
-    this->damage[i].count = -1;
+  {
+    this->damage [i].count = -1;
+    this->changed[i].count = -1;
+  }
 
   return true;
 }
@@ -73,28 +125,76 @@ bool egl_texFBSetup(EGL_Texture * texture, const EGL_TexSetup * setup)
   TexFB         * this   = UPCAST(TexFB        , parent );
 
   for (int i = 0; i < EGL_TEX_BUFFER_MAX; ++i)
-    this->damage[i].count = -1;
+  {
+    this->damage [i].count = -1;
+    this->changed[i].count = -1;
+    this->map[i].valid     = false;
+  }
+
+  if (rectsDamageMapFits(setup->width, setup->height))
+  {
+    this->tilesX = rectsDamageMapTiles(setup->width );
+    this->tilesY = rectsDamageMapTiles(setup->height);
+  }
+  else
+    this->tilesX = this->tilesY = 0;
 
   return egl_texBufferStreamSetup(texture, setup);
 }
 
-static bool egl_texFBUpdate(EGL_Texture * texture, const EGL_TexUpdate * update)
+/* read the regions the PBO is behind by from the frame, on the GPU if the
+ * frame is pinned */
+static bool readFrame(TexFB * this, const EGL_TexUpdate * update,
+    const FrameDamageMap * frameMap, bool pinned, GLintptr pinnedOffset)
 {
-  TextureBuffer * parent = UPCAST(TextureBuffer, texture);
-  TexFB         * this   = UPCAST(TexFB        , parent );
+  TextureBuffer * parent  = &this->base;
+  EGL_Texture   * texture = &parent->base;
+  const int bufIndex = parent->bufIndex;
 
-  DEBUG_ASSERT(update->type == EGL_TEXTYPE_FRAMEBUFFER);
-
-  LG_LOCK(parent->copyLock);
-
-  struct TexDamage * damage = this->damage + parent->bufIndex;
+  struct TexDamage * damage = this->damage + bufIndex;
   bool damageAll = !update->rects || update->rectCount == 0 || damage->count < 0 ||
     damage->count + update->rectCount > KVMFR_MAX_DAMAGE_RECTS;
 
-  if (damageAll)
+  // the rects could not hold the damage, try building them from the map
+  struct TexFBMap * map = this->map + bufIndex;
+  if (damageAll && !update->compressed)
+  {
+    addMapDamage(this, map, update, frameMap);
+    if (map->valid)
+    {
+      damage->count = rectsFromDamageMap(damage->rects,
+          KVMFR_MAX_DAMAGE_RECTS, map->bits, this->tilesX, this->tilesY,
+          texture->format.width, texture->format.height);
+      damageAll = damage->count == 0;
+    }
+  }
+  else if (!damageAll)
+  {
+    memcpy(damage->rects + damage->count, update->rects,
+      update->rectCount * sizeof(FrameDamageRect));
+    damage->count += update->rectCount;
+  }
+
+  if (pinned)
+  {
+    if (!egl_texPinnedCopy(pinnedOffset, parent->buf[bufIndex].pbo,
+          &texture->format, damage->rects, damageAll ? -1 : damage->count))
+      return false;
+  }
+  else if (update->compressed)
+    framebuffer_read_compressed(
+      update->frame,
+      parent->buf[bufIndex].map,
+      texture->format.stride,
+      texture->format.height,
+      texture->format.width,
+      texture->format.bpp,
+      texture->format.stride
+    );
+  else if (damageAll)
     framebuffer_read(
       update->frame,
-      parent->buf[parent->bufIndex].map,
+      parent->buf[bufIndex].map,
       texture->format.stride,
       texture->format.height,
       texture->format.width,
@@ -103,13 +203,10 @@ static bool egl_texFBUpdate(EGL_Texture * texture, const EGL_TexUpdate * update)
     );
   else
   {
-    memcpy(damage->rects + damage->count, update->rects,
-      update->rectCount * sizeof(FrameDamageRect));
-    damage->count += update->rectCount;
     rectsFramebufferToBuffer(
       damage->rects,
       damage->count,
-      parent->buf[parent->bufIndex].map,
+      parent->buf[bufIndex].map,
       texture->format.stride,
       texture->format.height,
       update->frame,
@@ -117,25 +214,96 @@ static bool egl_texFBUpdate(EGL_Texture * texture, const EGL_TexUpdate * update)
     );
   }
 
-  parent->buf[parent->bufIndex].updated = true;
+  if (update->compressed || damageAll)
+    egl_texBufferStreamRelease(parent, NULL, 0);
+  else
+    egl_texBufferStreamRelease(parent, damage->rects, damage->count);
+  return true;
+}
 
-  for (int i = 0; i < EGL_TEX_BUFFER_MAX; ++i)
+static bool egl_texFBUpdate(EGL_Texture * texture, const EGL_TexUpdate * update)
+{
+  TextureBuffer * parent = UPCAST(TextureBuffer, texture);
+  TexFB         * this   = UPCAST(TexFB        , parent );
+
+  DEBUG_ASSERT(update->type == EGL_TEXTYPE_FRAMEBUFFER);
+
+  /* an uncompressed frame in the pinned memory is copied into the PBO by the
+   * GPU, which has finished reading it by the time the update returns */
+  GLintptr pinnedOffset;
+  const bool pinned = !update->compressed &&
+    egl_texPinnedLookup(framebuffer_get_buffer(update->frame),
+        texture->format.bufferSize, &pinnedOffset);
+
+  // the GPU reads the frame, so it has to have been written in full
+  if (pinned && !framebuffer_wait(update->frame, texture->format.bufferSize))
   {
-    struct TexDamage * damage = this->damage + i;
-    if (i == parent->bufIndex)
-      damage->count = 0;
-    else if (update->rects && update->rectCount > 0 && damage->count >= 0 &&
-             damage->count + update->rectCount <= KVMFR_MAX_DAMAGE_RECTS)
+    DEBUG_ERROR("Timed out waiting for the frame to be written");
+    return false;
+  }
+
+  egl_texBufferStreamAcquire(parent);
+
+  /* a map that does not match the texture is of no use, the rects still cover
+   * the damage without it */
+  const FrameDamageMap * frameMap = update->damageMap;
+  if (frameMap && (frameMap->width != this->tilesX ||
+        frameMap->height != this->tilesY))
+    frameMap = NULL;
+
+  const int bufIndex = parent->bufIndex;
+
+  /* if the texture of the previous frame is complete the regions that only
+   * changed before this frame are copied from it, so just this frame's damage
+   * is read. The PBO then stays behind in those regions */
+  bool copied = false;
+  if (!update->compressed && update->rects && update->rectCount > 0 &&
+      egl_texBufferStreamCopy(parent, this->changed + bufIndex))
+  {
+    copied = true;
+    if (pinned)
     {
-      memcpy(damage->rects + damage->count, update->rects,
-        update->rectCount * sizeof(FrameDamageRect));
-      damage->count += update->rectCount;
+      if (!egl_texPinnedCopy(pinnedOffset, parent->buf[bufIndex].pbo,
+            &texture->format, update->rects, update->rectCount))
+        return false;
     }
     else
-      damage->count = -1;
+      rectsFramebufferToBuffer(
+        (FrameDamageRect *)update->rects,
+        update->rectCount,
+        parent->buf[bufIndex].map,
+        texture->format.stride,
+        texture->format.height,
+        update->frame,
+        texture->format.stride
+      );
+    egl_texBufferStreamRelease(parent, update->rects, update->rectCount);
   }
+  else
+  {
+    // a copy that was never uploaded is covered by the PBO's damage
+    parent->copy[bufIndex].count = 0;
+    if (!readFrame(this, update, frameMap, pinned, pinnedOffset))
+      return false;
+  }
+
+  for (int i = 0; i < EGL_TEX_BUFFER_MAX; ++i)
+  {
+    if (i == bufIndex)
+    {
+      this->changed[i].count = 0;
+      if (!copied)
+      {
+        this->damage[i].count = 0;
+        resetMapDamage(this, this->map + i);
+      }
+      continue;
+    }
 
-  LG_UNLOCK(parent->copyLock);
+    addMapDamage(this, this->map + i, update, frameMap);
+    addDamage(this->damage  + i, update);
+    addDamage(this->changed + i, update);
+  }
 
   return true;
 }
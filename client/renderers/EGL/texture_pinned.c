@@ -0,0 +1,151 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "texture_pinned.h"
+
+#include "util.h"
+#include "egldebug.h"
+#include "common/debug.h"
+
+#include <GLES2/gl2ext.h>
+#include <stdint.h>
+
+#ifndef GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD
+#define GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD 0x9160
+#endif
+
+static struct
+{
+  GLuint      buffer;
+  uintptr_t   base;
+  size_t      size;
+}
+l_pinned = { 0 };
+
+bool egl_texPinnedInit(const char * gl_exts, void * mem, size_t size)
+{
+  if (!mem || !size)
+    return false;
+
+  if (!util_hasGLExt(gl_exts, "GL_AMD_pinned_memory"))
+  {
+    DEBUG_INFO("GL_AMD_pinned_memory unavailable, frames are copied into PBOs");
+    return false;
+  }
+
+  // clear anything pending so the error below is the pin's
+  while(glGetError() != GL_NO_ERROR) {}
+
+  glGenBuffers(1, &l_pinned.buffer);
+  glBindBuffer(GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD, l_pinned.buffer);
+  glBufferData(GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD, size, mem,
+      GL_STREAM_READ);
+  glBindBuffer(GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD, 0);
+
+  const GLenum error = glGetError();
+  if (error != GL_NO_ERROR)
+  {
+    DEBUG_WARN("Failed to pin the shared memory (0x%x), frames are copied into "
+        "PBOs", error);
+    glDeleteBuffers(1, &l_pinned.buffer);
+    l_pinned.buffer = 0;
+    return false;
+  }
+
+  l_pinned.base = (uintptr_t)mem;
+  l_pinned.size = size;
+
+  DEBUG_INFO("Uploading the frames straight from the pinned shared memory");
+  return true;
+}
+
+void egl_texPinnedFree(void)
+{
+  if (l_pinned.buffer)
+    glDeleteBuffers(1, &l_pinned.buffer);
+  l_pinned.buffer = 0;
+  l_pinned.base   = 0;
+  l_pinned.size   = 0;
+}
+
+bool egl_texPinnedLookup(const void * ptr, size_t size, GLintptr * offset)
+{
+  if (!l_pinned.buffer)
+    return false;
+
+  const uintptr_t pos = (uintptr_t)ptr;
+  if (pos < l_pinned.base || pos - l_pinned.base > l_pinned.size ||
+      size > l_pinned.size - (pos - l_pinned.base))
+    return false;
+
+  *offset = pos - l_pinned.base;
+  return true;
+}
+
+bool egl_texPinnedCopy(GLintptr offset, GLuint pbo, const EGL_TexFormat * fmt,
+    const FrameDamageRect * rects, int count)
+{
+  glBindBuffer(GL_COPY_READ_BUFFER , l_pinned.buffer);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, pbo);
+
+  if (count < 0)
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+        offset, 0, fmt->height * fmt->stride);
+  else
+    for(int i = 0; i < count; ++i)
+    {
+      /* the rows of a rect are copied as one span, the bytes between them are
+       * of the same frame so are still correct in the PBO */
+      const FrameDamageRect * rect = rects + i;
+      if (rect->width == 0 || rect->height == 0)
+        continue;
+
+      const GLintptr start = rect->y * fmt->stride + rect->x * fmt->bpp;
+      const GLsizeiptr size = (rect->height - 1) * fmt->stride +
+        rect->width * fmt->bpp;
+      glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+          offset + start, start, size);
+    }
+
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  glBindBuffer(GL_COPY_READ_BUFFER , 0);
+
+  // the frame may be rewritten as soon as its message is released
+  GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  if (!fence)
+  {
+    DEBUG_GL_ERROR("glFenceSync failed");
+    return false;
+  }
+
+  GLenum result;
+  do
+    result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000); // 1ms
+  while(result == GL_TIMEOUT_EXPIRED);
+  glDeleteSync(fence);
+
+  if (result == GL_WAIT_FAILED)
+  {
+    DEBUG_GL_ERROR("glClientWaitSync failed");
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,45 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <GLES3/gl3.h>
+
+#include "texture_util.h"
+#include "common/types.h"
+
+/* the IVSHMEM mapping registered with GL_AMD_pinned_memory as one buffer the
+ * GPU reads from directly, so uncompressed frames are copied into the PBOs by
+ * the GPU rather than the CPU. Only used without DMA-BUF, which already
+ * avoids the copy */
+bool egl_texPinnedInit(const char * gl_exts, void * mem, size_t size);
+void egl_texPinnedFree(void);
+
+/* returns true and the offset of ptr in the pinned buffer if the size bytes
+ * from ptr are all in the pinned mapping */
+bool egl_texPinnedLookup(const void * ptr, size_t size, GLintptr * offset);
+
+/* copies the rects of the frame at the offset in the pinned buffer into the
+ * PBO, or all of it if count < 0, and waits for the GPU to complete the copy
+ * so the host may reuse the frame once its message is released */
+bool egl_texPinnedCopy(GLintptr offset, GLuint pbo, const EGL_TexFormat * fmt,
+    const FrameDamageRect * rects, int count);
@@ -0,0 +1,190 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "texture_upload.h"
+
+#include "texture_buffer.h"
+#include "egldebug.h"
+#include "common/debug.h"
+#include "common/event.h"
+#include "common/locking.h"
+#include "common/thread.h"
+
+#include <EGL/eglext.h>
+#include <stdatomic.h>
+#include <string.h>
+
+// the desktop and each of the source previews
+#define UPLOAD_MAX_TEXTURES 8
+
+static struct
+{
+  EGLDisplay      display;
+  EGLContext      context;
+  LGThread      * thread;
+  LGEvent       * event;
+  LGEvent       * done;
+  atomic_bool     running;
+
+  // kicks requested and the newest kick a pass has been run for
+  _Atomic(uint64_t) kicks;
+  _Atomic(uint64_t) passed;
+
+  LG_Lock         lock;
+  TextureBuffer * textures[UPLOAD_MAX_TEXTURES];
+  int             count;
+}
+l_upload = { 0 };
+
+static int uploadThread(void * opaque)
+{
+  if (!eglMakeCurrent(l_upload.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+        l_upload.context))
+  {
+    DEBUG_EGL_ERROR("Failed to make the upload context current");
+    atomic_store(&l_upload.running, false);
+    return 0;
+  }
+
+  while(atomic_load(&l_upload.running))
+  {
+    lgWaitEvent(l_upload.event, TIMEOUT_INFINITE);
+    const uint64_t kicks = atomic_load(&l_upload.kicks);
+
+    LG_LOCK(l_upload.lock);
+    for(int i = 0; i < l_upload.count; ++i)
+      egl_texBufferStreamUpload(l_upload.textures[i]);
+    LG_UNLOCK(l_upload.lock);
+
+    atomic_store(&l_upload.passed, kicks);
+    lgSignalEvent(l_upload.done);
+  }
+
+  eglMakeCurrent(l_upload.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+      EGL_NO_CONTEXT);
+  return 0;
+}
+
+bool egl_texUploadInit(EGLDisplay display, EGLConfig config,
+    EGLContext share, EGLint priority)
+{
+  const EGLint attrs[] = {
+    EGL_CONTEXT_CLIENT_VERSION, 2,
+    priority ? EGL_CONTEXT_PRIORITY_LEVEL_IMG : EGL_NONE,
+    priority,
+    EGL_NONE
+  };
+
+  l_upload.display = display;
+  l_upload.context = eglCreateContext(display, config, share, attrs);
+  if (l_upload.context == EGL_NO_CONTEXT)
+  {
+    DEBUG_EGL_ERROR("Failed to create the upload context");
+    return false;
+  }
+
+  LG_LOCK_INIT(l_upload.lock);
+  l_upload.event = lgCreateEvent(true, 0);
+  l_upload.done  = lgCreateEvent(true, 0);
+  if (!l_upload.event || !l_upload.done)
+  {
+    DEBUG_ERROR("Failed to create the upload event");
+    goto err;
+  }
+
+  atomic_store(&l_upload.running, true);
+  if (!lgCreateThread("textureUpload", uploadThread, NULL, &l_upload.thread))
+  {
+    DEBUG_ERROR("Failed to create the upload thread");
+    atomic_store(&l_upload.running, false);
+    goto err;
+  }
+
+  DEBUG_INFO("Uploading the frame textures from a separate thread");
+  return true;
+
+err:
+  if (l_upload.event)
+    lgFreeEvent(l_upload.event);
+  if (l_upload.done)
+    lgFreeEvent(l_upload.done);
+  eglDestroyContext(display, l_upload.context);
+  memset(&l_upload, 0, sizeof(l_upload));
+  return false;
+}
+
+void egl_texUploadFree(void)
+{
+  if (!l_upload.thread)
+    return;
+
+  atomic_store(&l_upload.running, false);
+  lgSignalEvent(l_upload.event);
+  lgJoinThread(l_upload.thread, NULL);
+
+  lgFreeEvent(l_upload.event);
+  lgFreeEvent(l_upload.done);
+  eglDestroyContext(l_upload.display, l_upload.context);
+  LG_LOCK_FREE(l_upload.lock);
+  memset(&l_upload, 0, sizeof(l_upload));
+}
+
+bool egl_texUploadActive(void)
+{
+  return atomic_load(&l_upload.running);
+}
+
+void egl_texUploadAdd(TextureBuffer * texture)
+{
+  LG_LOCK(l_upload.lock);
+  if (l_upload.count < UPLOAD_MAX_TEXTURES)
+    l_upload.textures[l_upload.count++] = texture;
+  else
+    DEBUG_ERROR("Too many textures for the upload thread");
+  LG_UNLOCK(l_upload.lock);
+}
+
+// waits for the uploader to finish with the texture if it is busy with it
+void egl_texUploadRemove(TextureBuffer * texture)
+{
+  LG_LOCK(l_upload.lock);
+  for(int i = 0; i < l_upload.count; ++i)
+    if (l_upload.textures[i] == texture)
+    {
+      l_upload.textures[i] = l_upload.textures[--l_upload.count];
+      break;
+    }
+  LG_UNLOCK(l_upload.lock);
+}
+
+uint64_t egl_texUploadKick(void)
+{
+  const uint64_t kick = atomic_fetch_add(&l_upload.kicks, 1) + 1;
+  lgSignalEvent(l_upload.event);
+  return kick;
+}
+
+void egl_texUploadWait(uint64_t kick)
+{
+  /* the done event is shared by every waiter so it is only a hint to look
+   * again, the short timeout covers a signal taken by another waiter */
+  while(atomic_load(&l_upload.running) && atomic_load(&l_upload.passed) < kick)
+    lgWaitEvent(l_upload.done, 1);
+}
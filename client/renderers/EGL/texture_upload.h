@@ -0,0 +1,47 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <EGL/egl.h>
+
+typedef struct TextureBuffer TextureBuffer;
+
+/* a thread with its own context shared with the renderer's that copies the
+ * frame textures out of their PBOs, so the render thread only has to pick up
+ * the finished texture rather than queue the copy itself.
+ *
+ * The textures are registered by the streaming buffer when it is set up and
+ * removed before it is torn down, the uploader is kicked each time a slot is
+ * published. Waiting on a kick only waits for the copy to be queued, which is
+ * enough for the render thread to pick the texture up */
+bool egl_texUploadInit(EGLDisplay display, EGLConfig config,
+    EGLContext share, EGLint priority);
+void egl_texUploadFree(void);
+
+// true if the uploader is running and new frame textures should use it
+bool egl_texUploadActive(void);
+
+void     egl_texUploadAdd   (TextureBuffer * texture);
+void     egl_texUploadRemove(TextureBuffer * texture);
+uint64_t egl_texUploadKick  (void);
+void     egl_texUploadWait  (uint64_t kick);
@@ -49,6 +49,7 @@ bool egl_texUtilGetFormat(const EGL_TexSetup * setup, EGL_TexFormat * fmt)
       break;
 
     case EGL_PF_RGBA10:
+    case EGL_PF_RGBA10_PQ:
       fmt->bpp        = 4;
       fmt->format     = GL_RGBA;
       fmt->intFormat  = GL_RGB10_A2;
@@ -56,6 +57,14 @@ bool egl_texUtilGetFormat(const EGL_TexSetup * setup, EGL_TexFormat * fmt)
       fmt->fourcc     = DRM_FORMAT_BGRA1010102;
       break;
 
+    case EGL_PF_NV12:
+      fmt->bpp        = 4;
+      fmt->format     = GL_RGBA;
+      fmt->intFormat  = GL_RGBA;
+      fmt->dataType   = GL_UNSIGNED_BYTE;
+      fmt->fourcc     = DRM_FORMAT_ABGR8888;
+      break;
+
     case EGL_PF_RGBA16F:
       fmt->bpp        = 8;
       fmt->format     = GL_RGBA;
@@ -45,7 +45,6 @@ typedef struct EGL_TexBuffer
   size_t size;
   GLuint pbo;
   void * map;
-  bool   updated;
 }
 EGL_TexBuffer;
 
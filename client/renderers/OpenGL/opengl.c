@@ -35,6 +35,8 @@
 #include "common/option.h"
 #include "common/framebuffer.h"
 #include "common/locking.h"
+#include "common/rects.h"
+#include "common/KVMFR.h"
 #include "gl_dynprocs.h"
 #include "util.h"
 
@@ -100,6 +102,13 @@ struct OpenGL_Options
   bool amdPinnedMem;
 };
 
+/* the area of a buffer that is out of date, a negative count means all of it */
+struct OpenGL_Damage
+{
+  int             count;
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+};
+
 struct Inst
 {
   LG_Renderer base;
@@ -108,6 +117,7 @@ struct Inst
   struct OpenGL_Options opt;
 
   bool              amdPinnedMemSupport;
+  bool              bufferStorageSupport;
   bool              renderStarted;
   bool              configured;
   bool              reconfigure;
@@ -125,11 +135,14 @@ struct Inst
   size_t              texSize;
   size_t              texPos;
   const FrameBuffer * frame;
+  struct OpenGL_Damage frameDamage;
 
   uint64_t          drawStart;
   bool              hasBuffers;
   GLuint            vboID[BUFFER_COUNT];
   uint8_t         * texPixels[BUFFER_COUNT];
+  uint8_t         * vboMap   [BUFFER_COUNT];
+  struct OpenGL_Damage vboDamage[BUFFER_COUNT];
   LG_Lock           frameLock;
   bool              texReady;
   int               texWIndex, texRIndex;
@@ -318,7 +331,8 @@ void opengl_onResize(LG_Renderer * renderer, const int width, const int height,
 }
 
 bool opengl_onMouseShape(LG_Renderer * renderer, const LG_RendererCursor cursor,
-    const int width, const int height, const int pitch, const uint8_t * data)
+    const int width, const int height, const int pitch, const uint8_t * data,
+    const uint32_t id)
 {
   struct Inst * this = UPCAST(struct Inst, renderer);
 
@@ -378,12 +392,26 @@ bool opengl_onFrameFormat(LG_Renderer * renderer, const LG_RendererFormat format
 }
 
 bool opengl_onFrame(LG_Renderer * renderer, const FrameBuffer * frame, int dmaFd,
-    const FrameDamageRect * damage, int damageCount)
+    const FrameDamageRect * damage, int damageCount,
+    const FrameDamageMap * damageMap)
 {
   struct Inst * this = UPCAST(struct Inst, renderer);
 
   LG_LOCK(this->frameLock);
   this->frame = frame;
+
+  /* frames that were not drawn yet still need their damage uploaded, so
+   * accumulate it until drawFrame takes it */
+  struct OpenGL_Damage * fd = &this->frameDamage;
+  if (damageCount <= 0 || fd->count < 0 ||
+      fd->count + damageCount > KVMFR_MAX_DAMAGE_RECTS)
+    fd->count = -1;
+  else
+  {
+    memcpy(fd->rects + fd->count, damage, damageCount * sizeof(*damage));
+    fd->count += damageCount;
+  }
+
   atomic_store_explicit(&this->frameUpdate, true, memory_order_release);
   LG_UNLOCK(this->frameLock);
 
@@ -420,6 +448,15 @@ bool opengl_renderStartup(LG_Renderer * renderer, bool useDMA)
   glGetIntegerv(GL_MAJOR_VERSION, &maj);
   glGetIntegerv(GL_MINOR_VERSION, &min);
 
+  if (!this->amdPinnedMemSupport &&
+      g_gl_dynProcs.glBufferStorage && g_gl_dynProcs.glMapBufferRange &&
+      (maj > 4 || (maj == 4 && min >= 4) ||
+       util_hasGLExt(exts, "GL_ARB_buffer_storage")))
+  {
+    this->bufferStorageSupport = true;
+    DEBUG_INFO("Using GL_ARB_buffer_storage");
+  }
+
   if ((maj < 3 || (maj == 3 && min < 2)) && !util_hasGLExt(exts, "GL_ARB_sync"))
   {
     DEBUG_ERROR("Need OpenGL 3.2+ or GL_ARB_sync for sync objects");
@@ -777,6 +814,16 @@ static enum ConfigStatus configure(struct Inst * this)
       this->dataFormat = GL_HALF_FLOAT;
       break;
 
+    case FRAME_TYPE_NV12:
+      DEBUG_ERROR("NV12 frames require the EGL renderer, disable dxgi:nv12 on the host");
+      LG_UNLOCK(this->formatLock);
+      return CONFIG_STATUS_ERROR;
+
+    case FRAME_TYPE_RGBA10_PQ:
+      DEBUG_ERROR("PQ frames require the EGL renderer, disable dxgi:hdrPQ on the host");
+      LG_UNLOCK(this->formatLock);
+      return CONFIG_STATUS_ERROR;
+
     default:
       DEBUG_ERROR("Unknown/unsupported compression type");
       return CONFIG_STATUS_ERROR;
@@ -831,6 +878,43 @@ static enum ConfigStatus configure(struct Inst * this)
     }
     g_gl_dynProcs.glBindBuffer(GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD, 0);
   }
+  else if (this->bufferStorageSupport)
+  {
+    /* map the buffers once for their lifetime, the frames are copied straight
+     * into them and the fences stop us writing to one the GPU still reads */
+    const GLbitfield flags =
+      GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    for(int i = 0; i < BUFFER_COUNT; ++i)
+    {
+      g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->vboID[i]);
+      if (check_gl_error("glBindBuffer"))
+      {
+        LG_UNLOCK(this->formatLock);
+        return CONFIG_STATUS_ERROR;
+      }
+
+      g_gl_dynProcs.glBufferStorage(GL_PIXEL_UNPACK_BUFFER, this->texSize,
+          NULL, flags);
+      if (check_gl_error("glBufferStorage"))
+      {
+        LG_UNLOCK(this->formatLock);
+        return CONFIG_STATUS_ERROR;
+      }
+
+      this->vboMap[i] = g_gl_dynProcs.glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,
+          0, this->texSize, flags);
+      if (!this->vboMap[i])
+      {
+        check_gl_error("glMapBufferRange");
+        LG_UNLOCK(this->formatLock);
+        return CONFIG_STATUS_ERROR;
+      }
+
+      this->vboDamage[i].count = -1;
+    }
+    g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
   else
   {
     for(int i = 0; i < BUFFER_COUNT; ++i)
@@ -935,20 +1019,32 @@ static void deconfigure(struct Inst * this)
 
   if (this->hasBuffers)
   {
+    for(int i = 0; i < BUFFER_COUNT; ++i)
+    {
+      if (!this->vboMap[i])
+        continue;
+
+      g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->vboID[i]);
+      g_gl_dynProcs.glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      this->vboMap[i] = NULL;
+    }
+    g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
     g_gl_dynProcs.glDeleteBuffers(BUFFER_COUNT, this->vboID);
     this->hasBuffers = false;
   }
 
+  for(int i = 0; i < BUFFER_COUNT; ++i)
+    if (this->fences[i])
+    {
+      g_gl_dynProcs.glDeleteSync(this->fences[i]);
+      this->fences[i] = NULL;
+    }
+
   if (this->amdPinnedMemSupport)
   {
     for(int i = 0; i < BUFFER_COUNT; ++i)
     {
-      if (this->fences[i])
-      {
-        g_gl_dynProcs.glDeleteSync(this->fences[i]);
-        this->fences[i] = NULL;
-      }
-
       if (this->texPixels[i])
       {
         free(this->texPixels[i]);
@@ -1121,6 +1217,76 @@ static bool opengl_bufferFn(void * opaque, const void * data, size_t size)
   return true;
 }
 
+/* copies the frame into the persistently mapped buffer, only the area that
+ * changed since the buffer was last written where possible. Returns the damage
+ * the texture needs to upload, NULL if all of it */
+static const struct OpenGL_Damage * copyFrame(struct Inst * this, const int bpp)
+{
+  // every buffer is behind by the frames since it was last written
+  const struct OpenGL_Damage * fd = &this->frameDamage;
+  for(int i = 0; i < BUFFER_COUNT; ++i)
+  {
+    struct OpenGL_Damage * damage = this->vboDamage + i;
+    if (fd->count < 0 || damage->count < 0 ||
+        damage->count + fd->count > KVMFR_MAX_DAMAGE_RECTS)
+      damage->count = -1;
+    else
+    {
+      memcpy(damage->rects + damage->count, fd->rects,
+          fd->count * sizeof(*fd->rects));
+      damage->count += fd->count;
+    }
+  }
+
+  // the rect copies assume 32bpp
+  struct OpenGL_Damage * damage = this->vboDamage + this->texWIndex;
+  if (this->format.compressed || bpp != 4)
+    damage->count = -1;
+  else if (damage->count > 0)
+  {
+    // many small uploads cost more than one large one
+    damage->count = rectsOptimize(damage->rects, damage->count,
+        KVMFR_MAX_DAMAGE_RECTS, this->format.frameWidth,
+        this->format.frameHeight, 50);
+    if (damage->count == 0)
+      damage->count = -1;
+  }
+
+  uint8_t * map = this->vboMap[this->texWIndex];
+  if (this->format.compressed)
+    framebuffer_read_compressed(
+      this->frame,
+      map,
+      this->format.pitch,
+      this->format.frameHeight,
+      this->format.frameWidth,
+      bpp,
+      this->format.pitch
+    );
+  else if (damage->count < 0)
+    framebuffer_read(
+      this->frame,
+      map,
+      this->format.pitch,
+      this->format.frameHeight,
+      this->format.frameWidth,
+      bpp,
+      this->format.pitch
+    );
+  else
+    rectsFramebufferToBuffer(
+      damage->rects,
+      damage->count,
+      map,
+      this->format.pitch,
+      this->format.frameHeight,
+      this->frame,
+      this->format.pitch
+    );
+
+  return damage->count < 0 ? NULL : damage;
+}
+
 static bool drawFrame(struct Inst * this)
 {
   if (g_gl_dynProcs.glIsSync(this->fences[this->texWIndex]))
@@ -1164,34 +1330,76 @@ static bool drawFrame(struct Inst * this)
 
   const int bpp = this->format.bpp / 8;
   glPixelStorei(GL_UNPACK_ALIGNMENT , bpp);
-  glPixelStorei(GL_UNPACK_ROW_LENGTH, this->format.frameWidth);
-
-  this->texPos = 0;
-
-  framebuffer_read_fn(
-    this->frame,
-    this->format.frameHeight,
-    this->format.frameWidth,
-    bpp,
-    this->format.pitch,
-    opengl_bufferFn,
-    this
-  );
 
-  LG_UNLOCK(this->frameLock);
+  const struct OpenGL_Damage * damage = NULL;
+  if (this->bufferStorageSupport)
+  {
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, this->format.pitch / bpp);
+    damage = copyFrame(this, bpp);
+    this->frameDamage.count = 0;
+    LG_UNLOCK(this->frameLock);
+  }
+  else
+  {
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, this->format.frameWidth);
+    this->texPos = 0;
+    this->frameDamage.count = 0;
+
+    if (this->format.compressed)
+      framebuffer_read_compressed_fn(
+        this->frame,
+        this->format.frameHeight,
+        this->format.frameWidth,
+        bpp,
+        this->format.pitch,
+        opengl_bufferFn,
+        this
+      );
+    else
+      framebuffer_read_fn(
+        this->frame,
+        this->format.frameHeight,
+        this->format.frameWidth,
+        bpp,
+        this->format.pitch,
+        opengl_bufferFn,
+        this
+      );
+
+    LG_UNLOCK(this->frameLock);
+  }
 
   // update the texture
-  glTexSubImage2D(
-    GL_TEXTURE_2D,
-    0,
-    0,
-    0,
-    this->format.frameWidth ,
-    this->format.frameHeight,
-    this->vboFormat,
-    this->dataFormat,
-    (void*)0
-  );
+  if (damage)
+    for(int i = 0; i < damage->count; ++i)
+    {
+      const FrameDamageRect * rect = damage->rects + i;
+      glTexSubImage2D(
+        GL_TEXTURE_2D,
+        0,
+        rect->x,
+        rect->y,
+        rect->width,
+        rect->height,
+        this->vboFormat,
+        this->dataFormat,
+        (const void *)(uintptr_t)(rect->y * this->format.pitch +
+          rect->x * bpp)
+      );
+    }
+  else
+    glTexSubImage2D(
+      GL_TEXTURE_2D,
+      0,
+      0,
+      0,
+      this->format.frameWidth ,
+      this->format.frameHeight,
+      this->vboFormat,
+      this->dataFormat,
+      (void*)0
+    );
+
   if (check_gl_error("glTexSubImage2D"))
   {
     DEBUG_ERROR("texWIndex: %u, width: %u, height: %u, vboFormat: %x, texSize: %lu",
@@ -24,6 +24,7 @@
 #include "core.h"
 #include "util.h"
 #include "clipboard.h"
+#include "latency.h"
 #include "render_queue.h"
 
 #include "kb.h"
@@ -69,8 +70,7 @@ bool app_isOverlayMode(void)
 
   bool result = false;
   struct Overlay * overlay;
-  ll_lock(g_state.overlays);
-  ll_forEachNL(g_state.overlays, item, overlay)
+  vector_forEachRef(overlay, &g_state.overlays)
   {
     if (overlay->ops->needs_overlay && overlay->ops->needs_overlay(overlay))
     {
@@ -78,7 +78,6 @@ bool app_isOverlayMode(void)
       break;
     }
   }
-  ll_unlock(g_state.overlays);
 
   return result;
 }
@@ -131,6 +130,18 @@ void app_handleFocusEvent(bool focused)
   g_state.ds->realignPointer();
 }
 
+void app_handleVisibilityEvent(bool visible)
+{
+  if (atomic_exchange(&g_state.hidden, !visible) == !visible)
+    return;
+
+  DEBUG_INFO("Window %s", visible ? "shown, resuming frames" :
+      "hidden, pausing frames");
+
+  if (visible)
+    app_invalidateWindow(true);
+}
+
 void app_handleEnterEvent(bool entered)
 {
   if (entered)
@@ -160,7 +171,7 @@ void app_handleEnterEvent(bool entered)
 
     if (!g_params.alwaysShowCursor)
       g_cursor.draw = false;
-    g_cursor.redraw = true;
+    core_redrawCursor();
   }
 }
 
@@ -231,6 +242,10 @@ void app_clipboardRequest(const LG_ClipboardReplyFn replyFn, void * opaque)
   if (!g_params.clipboardToLocal)
     return;
 
+  // repeated pastes of the same guest clipboard do not need a round trip
+  if (cb_cacheReply(g_state.cbType, replyFn, opaque))
+    return;
+
   struct CBRequest * cbr = malloc(sizeof(*cbr));
   if (!cbr)
   {
@@ -238,9 +253,10 @@ void app_clipboardRequest(const LG_ClipboardReplyFn replyFn, void * opaque)
     return;
   }
 
-  cbr->type    = g_state.cbType;
-  cbr->replyFn = replyFn;
-  cbr->opaque  = opaque;
+  cbr->type       = g_state.cbType;
+  cbr->generation = g_state.cbGeneration;
+  cbr->replyFn    = replyFn;
+  cbr->opaque     = opaque;
   ll_push(g_state.cbRequestList, cbr);
 
   purespice_clipboardRequest(g_state.cbType);
@@ -276,6 +292,7 @@ void app_handleButtonPress(int button)
   if (!core_inputEnabled() || !g_cursor.inView)
     return;
 
+  core_flushMotion();
   if (!purespice_mousePress(button))
     DEBUG_ERROR("app_handleButtonPress: failed to send message");
 }
@@ -295,6 +312,7 @@ void app_handleButtonRelease(int button)
   if (!core_inputEnabled())
     return;
 
+  core_flushMotion();
   if (!purespice_mouseRelease(button))
     DEBUG_ERROR("app_handleButtonRelease: failed to send message");
 }
@@ -458,6 +476,16 @@ void app_handleMouseRelative(double normx, double normy,
 // cursor warp support. Instead, we attempt a best-effort emulation which works
 // with a 1:1 mouse movement patch applied in the guest. For anything fancy, use
 // capture mode.
+void app_beginInputBatch(void)
+{
+  core_beginMotionBatch();
+}
+
+void app_endInputBatch(void)
+{
+  core_endMotionBatch();
+}
+
 void app_handleMouseBasic(void)
 {
   /* do not pass mouse events to the guest if we do not have focus */
@@ -543,6 +571,9 @@ void app_invalidateWindow(bool full)
   if (full)
     atomic_store(&g_state.invalidateWindow, true);
 
+  // overlay state changes come through here, drop the cached ImGui frame
+  atomic_fetch_add(&g_state.overlayGeneration, 1);
+
   if (g_state.dsInitialized && g_state.jitRender && g_state.ds->stopWaitFrame)
     g_state.ds->stopWaitFrame();
 
@@ -755,6 +786,16 @@ GraphHandle app_registerGraph(const char * name, RingBuffer buffer,
   return overlayGraph_register(name, buffer, min, max, formatFn);
 }
 
+uint32_t app_getFrameSerial(void)
+{
+  return latency_renderSerial();
+}
+
+void app_framePresented(uint32_t serial, uint64_t presentUs)
+{
+  latency_framePresented(serial, presentUs);
+}
+
 void app_unregisterGraph(GraphHandle handle)
 {
   overlayGraph_unregister(handle);
@@ -769,19 +810,23 @@ void app_registerOverlay(const struct LG_OverlayOps * ops, const void * params)
 {
   ASSERT_LG_OVERLAY_VALID(ops);
 
-  struct Overlay * overlay = malloc(sizeof(*overlay));
-  if (!overlay)
+  /* overlays are only registered before any other thread is started so the
+   * render path can walk the vector without taking a lock */
+  struct Overlay overlay =
+  {
+    .ops            = ops,
+    .params         = params,
+    .udata          = NULL,
+    .lastRectCount  = 0,
+    .lastGeneration = 0,
+  };
+
+  if (!vector_push(&g_state.overlays, &overlay))
   {
     DEBUG_ERROR("out of ram");
     return;
   }
 
-  overlay->ops           = ops;
-  overlay->params        = params;
-  overlay->udata         = NULL;
-  overlay->lastRectCount = 0;
-  ll_push(g_state.overlays, overlay);
-
   if (ops->earlyInit)
     ops->earlyInit();
 }
@@ -789,8 +834,7 @@ void app_registerOverlay(const struct LG_OverlayOps * ops, const void * params)
 void app_initOverlays(void)
 {
   struct Overlay * overlay;
-  ll_lock(g_state.overlays);
-  ll_forEachNL(g_state.overlays, item, overlay)
+  vector_forEachRef(overlay, &g_state.overlays)
   {
     DEBUG_ASSERT(overlay->ops);
     if (!overlay->ops->init(&overlay->udata, overlay->params))
@@ -799,7 +843,6 @@ void app_initOverlays(void)
       overlay->ops = NULL;
     }
   }
-  ll_unlock(g_state.overlays);
 }
 
 static inline void mergeRect(struct Rect * dest, const struct Rect * a, const struct Rect * b)
@@ -849,8 +892,7 @@ bool app_overlayNeedsRender(void)
 
   bool result = false;
   struct Overlay * overlay;
-  ll_lock(g_state.overlays);
-  ll_forEachNL(g_state.overlays, item, overlay)
+  vector_forEachRef(overlay, &g_state.overlays)
   {
     if (!overlay->ops->needs_render)
       continue;
@@ -861,11 +903,49 @@ bool app_overlayNeedsRender(void)
       break;
     }
   }
-  ll_unlock(g_state.overlays);
 
   return result;
 }
 
+/* returns true if the ImGui draw data from the last frame can be reused as
+ * nothing that feeds into it has changed since */
+static bool overlayCacheValid(unsigned int generation)
+{
+  static unsigned int lastGeneration = 0;
+  static ImVec2       lastSize       = { 0 };
+
+  bool valid =
+    !app_isOverlayMode()                    &&
+    !g_state.renderImGuiTwice               &&
+    generation == lastGeneration            &&
+    g_state.io->DisplaySize.x == lastSize.x &&
+    g_state.io->DisplaySize.y == lastSize.y;
+
+  struct Overlay * overlay;
+  vector_forEachRef(overlay, &g_state.overlays)
+  {
+    if (!overlay->lastRectCount)
+      continue;
+
+    if (!overlay->ops->generation)
+    {
+      valid = false;
+      break;
+    }
+
+    const uint64_t gen = overlay->ops->generation(overlay->udata);
+    if (gen != overlay->lastGeneration)
+    {
+      overlay->lastGeneration = gen;
+      valid = false;
+    }
+  }
+
+  lastGeneration = generation;
+  lastSize       = g_state.io->DisplaySize;
+  return valid;
+}
+
 int app_renderOverlay(struct Rect * rects, int maxRects)
 {
   int  totalRects  = 0;
@@ -873,6 +953,24 @@ int app_renderOverlay(struct Rect * rects, int maxRects)
   struct Overlay * overlay;
   struct Rect buffer[MAX_OVERLAY_RECTS];
 
+  static struct Rect cachedRects[MAX_OVERLAY_RECTS];
+  static int         cachedResult = 0;
+  static bool        cached       = false;
+
+  const unsigned int generation =
+    atomic_load(&g_state.overlayGeneration);
+
+  if (overlayCacheValid(generation) && cached &&
+      cachedResult <= min(maxRects, MAX_OVERLAY_RECTS))
+  {
+    // igGetDrawData still holds the last frame as igNewFrame was not called
+    if (cachedResult > 0)
+      memcpy(rects, cachedRects, cachedResult * sizeof(struct Rect));
+    return cachedResult;
+  }
+
+  struct Rect * outRects = rects;
+
   g_state.io->KeyCtrl  = g_state.modCtrl;
   g_state.io->KeyShift = g_state.modShift;
   g_state.io->KeyAlt   = g_state.modAlt;
@@ -899,8 +997,7 @@ render_again:
   const bool msgModal = overlayMsg_modal();
 
   // render the overlays
-  ll_lock(g_state.overlays);
-  ll_forEachNL(g_state.overlays, item, overlay)
+  vector_forEachRef(overlay, &g_state.overlays)
   {
     if (msgModal && overlay->ops != &LGOverlayMsg)
       continue;
@@ -942,7 +1039,6 @@ render_again:
     memcpy(overlay->lastRects, buffer, sizeof(struct Rect) * written);
     overlay->lastRectCount = written;
   }
-  ll_unlock(g_state.overlays);
 
   if (overlayMode)
   {
@@ -966,17 +1062,23 @@ render_again:
     goto render_again;
   }
 
-  return totalDamage ? -1 : totalRects;
+  cachedResult = totalDamage ? -1 : totalRects;
+  cached       = cachedResult <= MAX_OVERLAY_RECTS;
+  if (cached && cachedResult > 0)
+    memcpy(cachedRects, outRects, cachedResult * sizeof(struct Rect));
+
+  return cachedResult;
 }
 
 void app_freeOverlays(void)
 {
-  struct Overlay * overlay;
-  while(ll_shift(g_state.overlays, (void **)&overlay))
-  {
-    overlay->ops->free(overlay->udata);
-    free(overlay);
-  }
+  // empty the vector before freeing so other threads stop seeing the overlays
+  struct Overlay * overlays = vector_data(&g_state.overlays);
+  const size_t     count    = vector_size(&g_state.overlays);
+  vector_clear(&g_state.overlays);
+
+  for(size_t i = 0; i < count; ++i)
+    overlays[i].ops->free(overlays[i].udata);
 }
 
 void app_setOverlay(bool enable)
@@ -22,17 +22,59 @@
 
 #include "audio.h"
 #include "main.h"
+#include "resamplers.h"
+#include "latency.h"
+#include "video_record.h"
 #include "common/array.h"
 #include "common/util.h"
 #include "common/ringbuffer.h"
+#include "common/thread.h"
+#include "common/event.h"
+#include "common/locking.h"
+#include "common/paths.h"
+#include "common/stringutils.h"
+#include "common/time.h"
+#include "common/metrics.h"
+#include "common/cpuinfo.h"
 
 #include "dynamic/audiodev.h"
 
 #include <float.h>
+#include <inttypes.h>
 #include <math.h>
-#include <samplerate.h>
 #include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AUDIO_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+// the most playback channels the software gain supports
+#define PLAYBACK_MAX_CHANNELS 8
+
+/* the largest chunk of Spice data converted and resampled at once in
+ * milliseconds, larger packets are processed in several chunks */
+#define PLAYBACK_MAX_CHUNK_MS 100
+
+/* limits of the resampling ratio the PI controller may request, the
+ * corrections it makes in practice are a fraction of a percent */
+#define PLAYBACK_MIN_RATIO 0.9
+#define PLAYBACK_MAX_RATIO 1.1
+
+// the most latency added to keep playback in sync with the video
+#define PLAYBACK_SYNC_MAX_MS 500
+
+// the size of the packets the recorded audio is sent to Spice in
+#define RECORD_PACKET_MS 10
+
+// limits of the drift correction applied to the recorded audio
+#define RECORD_MIN_RATIO 0.995
+#define RECORD_MAX_RATIO 1.005
 
 typedef enum
 {
@@ -62,8 +104,14 @@ typedef struct
 {
   float * framesIn;
   float * framesOut;
+  int     framesInSize;
   int     framesOutSize;
 
+  /* per channel gain including the s16 to f32 scale, repeated to a multiple
+   * of eight samples so it can be applied a vector at a time */
+  alignas(32) float gain[PLAYBACK_MAX_CHANNELS * 8];
+  int     gainLen;
+
   int     periodFrames;
   double  periodSec;
   int64_t nextTime;
@@ -82,13 +130,48 @@ typedef struct
 
   double  ratioIntegral;
 
-  SRC_STATE * src;
+  void * resampler;
+  bool    deviceRateMatch;
 }
 PlaybackSpiceData;
 
+#define AUDIO_HISTOGRAM_BUCKETS 16
+
+/* a fixed bucket histogram, values below the first bucket are counted in it
+ * and values above the last are counted in the last */
+typedef struct
+{
+  const char * name;
+  const char * unit;
+  double       base;
+  double       width;
+  uint64_t     buckets[AUDIO_HISTOGRAM_BUCKETS];
+  uint64_t     count;
+  double       sum;
+  double       min;
+  double       max;
+}
+AudioHistogram;
+
+typedef struct
+{
+  LG_Lock        lock;
+  AudioHistogram jitter;
+  AudioHistogram fill;
+  AudioHistogram latency;
+  AudioHistogram ratio;
+  atomic_ulong   underruns;
+  atomic_ulong   overruns;
+
+  // the playback latency in microseconds for the metrics export
+  StatsHistogram latencyStats;
+}
+AudioMetrics;
+
 typedef struct
 {
   struct LG_AudioDevOps * audioDev;
+  const struct LG_ResamplerOps * resampler;
 
   struct
   {
@@ -108,6 +191,24 @@ typedef struct
     RingBuffer  timings;
     GraphHandle graph;
 
+    /* the smoothed arrival time minus the host capture time of the packets,
+     * only known when the host timestamps the audio (INT64_MIN otherwise) */
+    _Atomic(int64_t) hostOffset;
+
+    /* When enabled the Spice thread only queues the raw packets along with
+     * their arrival time, and the worker thread converts and resamples them
+     * so that stalls on the Spice socket do not delay the audio processing */
+    struct
+    {
+      LGThread  * thread;
+      LGEvent   * event;
+      atomic_bool running;
+      RingBuffer  packets;
+      RingBuffer  samples;
+      int16_t   * staging;
+    }
+    worker;
+
     /* These two structs contain data specifically for use in the device and
      * Spice data threads respectively. Keep them on separate cache lines to
      * avoid false sharing. */
@@ -132,12 +233,75 @@ typedef struct
     int           confirmChannels;
     int           confirmSampleRate;
     PSAudioFormat confirmFormat;
+
+    /* The following are only used by the audio device thread while recording.
+     * The device clock is tracked against the system clock and the drift is
+     * corrected before the audio is sent to Spice in fixed size packets */
+    int           channels;
+    int           sampleRate;
+    int           packetFrames;
+    int           framesInSize;
+    int           framesOutSize;
+    float       * framesIn;
+    float       * framesOut;
+    int16_t     * packet;
+    RingBuffer    buffer;
+    void        * resampler;
+    alignas(32) float gain[PLAYBACK_MAX_CHANNELS * 8];
+    int           gainLen;
+
+    int           periodFrames;
+    double        periodSec;
+    int64_t       nextTime;
+    double        b;
+    double        c;
   }
   record;
+
+  AudioMetrics metrics;
 }
 AudioState;
 
-static AudioState audio = { 0 };
+static AudioState audio =
+{
+  .metrics =
+  {
+    .jitter  = { .name = "spiceJitter", .unit = "ms" , .base =     0.0, .width =    0.5 },
+    .fill    = { .name = "bufferFill" , .unit = "ms" , .base =     0.0, .width =    5.0 },
+    .latency = { .name = "latency"    , .unit = "ms" , .base =     0.0, .width =   10.0 },
+    .ratio   = { .name = "ratio"      , .unit = "ppm", .base = -8000.0, .width = 1000.0 }
+  }
+};
+
+static void histogramAdd(AudioHistogram * h, double value)
+{
+  const int bucket = clamp((int)floor((value - h->base) / h->width),
+      0, AUDIO_HISTOGRAM_BUCKETS - 1);
+  ++h->buckets[bucket];
+
+  if (h->count++ == 0)
+    h->min = h->max = value;
+  else
+  {
+    h->min = min(h->min, value);
+    h->max = max(h->max, value);
+  }
+  h->sum += value;
+}
+
+static void histogramWrite(FILE * fp, const AudioHistogram * h)
+{
+  fprintf(fp,
+      "\"%s\":{\"unit\":\"%s\",\"count\":%" PRIu64 ",\"min\":%.3f,"
+      "\"max\":%.3f,\"avg\":%.3f,\"base\":%.3f,\"width\":%.3f,"
+      "\"buckets\":[",
+      h->name, h->unit, h->count, h->min, h->max,
+      h->count ? h->sum / h->count : 0.0, h->base, h->width);
+
+  for(int i = 0; i < AUDIO_HISTOGRAM_BUCKETS; ++i)
+    fprintf(fp, "%s%" PRIu64, i ? "," : "", h->buckets[i]);
+  fputs("]}", fp);
+}
 
 typedef struct
 {
@@ -148,9 +312,118 @@ typedef struct
 PlaybackDeviceTick;
 
 static void playbackStop(void);
+static void playbackProcess(const int16_t * data, int frames, int64_t now);
+
+typedef struct
+{
+  int64_t time;
+  int     frames;
+}
+PlaybackPacket;
+
+typedef void (*PlaybackConvertFn)(float * restrict dst,
+    const int16_t * restrict src, int samples, const float * gain, int gainLen);
+
+static void playbackConvertScalar(float * restrict dst,
+    const int16_t * restrict src, int samples, const float * gain, int gainLen)
+{
+  for(int i = 0, g = 0; i < samples; ++i)
+  {
+    dst[i] = src[i] * gain[g];
+    if (++g == gainLen)
+      g = 0;
+  }
+}
+
+#ifdef AUDIO_X86
+static void playbackConvertSSE(float * restrict dst,
+    const int16_t * restrict src, int samples, const float * gain, int gainLen)
+{
+  int i = 0, g = 0;
+  for(; i + 8 <= samples; i += 8)
+  {
+    const __m128i s  = _mm_loadu_si128((const __m128i *)(src + i));
+    const __m128  lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+    const __m128  hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+    _mm_storeu_ps(dst + i    , _mm_mul_ps(lo, _mm_load_ps(gain + g    )));
+    _mm_storeu_ps(dst + i + 4, _mm_mul_ps(hi, _mm_load_ps(gain + g + 4)));
+    if ((g += 8) == gainLen)
+      g = 0;
+  }
+
+  for(; i < samples; ++i, ++g)
+    dst[i] = src[i] * gain[g];
+}
+
+__attribute__((target("avx2")))
+static void playbackConvertAVX2(float * restrict dst,
+    const int16_t * restrict src, int samples, const float * gain, int gainLen)
+{
+  int i = 0, g = 0;
+  for(; i + 8 <= samples; i += 8)
+  {
+    const __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(
+          _mm_loadu_si128((const __m128i *)(src + i))));
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(f, _mm256_load_ps(gain + g)));
+    if ((g += 8) == gainLen)
+      g = 0;
+  }
+
+  for(; i < samples; ++i, ++g)
+    dst[i] = src[i] * gain[g];
+}
+
+#endif
+
+static const struct
+{
+  unsigned int      features;
+  PlaybackConvertFn fn;
+}
+playbackConverters[] =
+{
+#ifdef AUDIO_X86
+  { CPU_FEATURE_AVX2, playbackConvertAVX2   },
+  { CPU_FEATURE_SSE2, playbackConvertSSE    },
+#endif
+  { 0               , playbackConvertScalar },
+};
+
+static PlaybackConvertFn playbackConvert = playbackConvertScalar;
+
+static double metricUnderruns(void * opaque)
+{
+  return atomic_load(&audio.metrics.underruns);
+}
+
+static double metricOverruns(void * opaque)
+{
+  return atomic_load(&audio.metrics.overruns);
+}
 
 void audio_init(void)
 {
+  LG_LOCK_INIT(audio.metrics.lock);
+  atomic_init(&audio.playback.hostOffset, INT64_MIN);
+
+  audio.metrics.latencyStats = stats_histogramNew();
+  if (audio.metrics.latencyStats)
+    metrics_registerHistogram("lg_client_audio_latency_seconds",
+        "Playback latency including the device", audio.metrics.latencyStats,
+        1e-6);
+  metrics_registerValue("lg_client_audio_underruns_total",
+      "Playback buffer underruns", true, metricUnderruns, NULL);
+  metrics_registerValue("lg_client_audio_overruns_total",
+      "Playback buffer overruns", true, metricOverruns, NULL);
+
+  playbackConvert = LG_CPU_DISPATCH(playbackConverters)->fn;
+
+  if (strcasecmp(g_params.audioResampler, LGResamplerPolyphase.code) == 0)
+    audio.resampler = &LGResamplerPolyphase;
+  else
+    audio.resampler = &LGResamplerSampleRate;
+  DEBUG_INFO("Using Resampler: %s", audio.resampler->name);
+
   // search for the best audiodev to use
   for(int i = 0; i < LG_AUDIODEV_COUNT; ++i)
     if (LG_AudioDevs[i]->init())
@@ -165,15 +438,20 @@ void audio_init(void)
 
 void audio_free(void)
 {
-  if (!audio.audioDev)
-    return;
+  if (audio.audioDev)
+  {
+    // immediate stop of the stream, do not wait for drain
+    playbackStop();
+    audio_recordStop();
 
-  // immediate stop of the stream, do not wait for drain
-  playbackStop();
-  audio_recordStop();
+    audio.audioDev->free();
+    audio.audioDev = NULL;
+  }
 
-  audio.audioDev->free();
-  audio.audioDev = NULL;
+  metrics_unregister("lg_client_audio_latency_seconds");
+  metrics_unregister("lg_client_audio_underruns_total");
+  metrics_unregister("lg_client_audio_overruns_total");
+  stats_histogramFree(&audio.metrics.latencyStats);
 }
 
 bool audio_supportsPlayback(void)
@@ -191,24 +469,132 @@ static const char * audioGraphFormatFn(const char * name,
   return title;
 }
 
+static int playbackWorkerThread(void * opaque)
+{
+  if (!lgThreadSetPriority(LG_THREAD_PRIORITY_PLAYBACK))
+    DEBUG_WARN("Unable to raise the priority of the audio worker");
+
+  PlaybackPacket packet;
+  while (atomic_load(&audio.playback.worker.running))
+  {
+    while (ringbuffer_consume(audio.playback.worker.packets, &packet, 1))
+    {
+      ringbuffer_consume(audio.playback.worker.samples,
+          audio.playback.worker.staging, packet.frames);
+      playbackProcess(audio.playback.worker.staging, packet.frames,
+          packet.time);
+    }
+
+    lgWaitEvent(audio.playback.worker.event, 100);
+  }
+
+  return 0;
+}
+
+static void playbackWorkerStop(void)
+{
+  if (!audio.playback.worker.thread)
+    return;
+
+  atomic_store(&audio.playback.worker.running, false);
+  lgSignalEvent(audio.playback.worker.event);
+  lgJoinThread(audio.playback.worker.thread, NULL);
+  audio.playback.worker.thread = NULL;
+
+  lgFreeEvent(audio.playback.worker.event);
+  audio.playback.worker.event = NULL;
+  ringbuffer_free(&audio.playback.worker.packets);
+  ringbuffer_free(&audio.playback.worker.samples);
+  free(audio.playback.worker.staging);
+  audio.playback.worker.staging = NULL;
+}
+
+static void playbackWorkerStart(void)
+{
+  if (!g_params.audioWorker || audio.playback.worker.thread)
+    return;
+
+  // allow up to a second of audio to be queued
+  const int frames = audio.playback.sampleRate;
+  const size_t stride = audio.playback.channels * sizeof(int16_t);
+
+  audio.playback.worker.event   = lgCreateEvent(true, 0);
+  audio.playback.worker.packets = ringbuffer_new(64, sizeof(PlaybackPacket));
+  audio.playback.worker.samples = ringbuffer_new(frames, stride);
+  audio.playback.worker.staging = malloc(frames * stride);
+
+  if (!audio.playback.worker.event   ||
+      !audio.playback.worker.packets ||
+      !audio.playback.worker.samples ||
+      !audio.playback.worker.staging)
+  {
+    DEBUG_ERROR("Failed to allocate the audio worker, using the Spice thread");
+    goto fail;
+  }
+
+  atomic_store(&audio.playback.worker.running, true);
+  if (!lgCreateThread("audioWorker", playbackWorkerThread, NULL,
+        &audio.playback.worker.thread))
+  {
+    DEBUG_ERROR("Failed to create the audio worker, using the Spice thread");
+    audio.playback.worker.thread = NULL;
+    goto fail;
+  }
+
+  return;
+
+fail:
+  if (audio.playback.worker.event)
+    lgFreeEvent(audio.playback.worker.event);
+  audio.playback.worker.event = NULL;
+  ringbuffer_free(&audio.playback.worker.packets);
+  ringbuffer_free(&audio.playback.worker.samples);
+  free(audio.playback.worker.staging);
+  audio.playback.worker.staging = NULL;
+}
+
+static void playbackWorkerQueue(const int16_t * data, int frames)
+{
+  RingBuffer samples = audio.playback.worker.samples;
+  RingBuffer packets = audio.playback.worker.packets;
+
+  // only this thread adds data so the free space can not shrink under us
+  if (frames > ringbuffer_getLength(samples) - ringbuffer_getCount(samples) ||
+      ringbuffer_getCount(packets) == ringbuffer_getLength(packets))
+  {
+    DEBUG_WARN("Audio worker queue full, dropping %d frames", frames);
+    return;
+  }
+
+  const PlaybackPacket packet =
+  {
+    .time   = nanotime(),
+    .frames = frames
+  };
+
+  ringbuffer_append(samples, data, frames);
+  ringbuffer_append(packets, &packet, 1);
+  lgSignalEvent(audio.playback.worker.event);
+}
+
 static void playbackStop(void)
 {
   if (audio.playback.state == STREAM_STATE_STOP)
     return;
 
+  playbackWorkerStop();
+
   audio.playback.state = STREAM_STATE_STOP;
   audio.audioDev->playback.stop();
   ringbuffer_free(&audio.playback.buffer);
   ringbuffer_free(&audio.playback.deviceTiming);
-  audio.playback.spiceData.src = src_delete(audio.playback.spiceData.src);
+  audio.resampler->free(audio.playback.spiceData.resampler);
+  audio.playback.spiceData.resampler = NULL;
 
-  if (audio.playback.spiceData.framesIn)
-  {
-    free(audio.playback.spiceData.framesIn);
-    free(audio.playback.spiceData.framesOut);
-    audio.playback.spiceData.framesIn = NULL;
-    audio.playback.spiceData.framesOut = NULL;
-  }
+  free(audio.playback.spiceData.framesIn);
+  free(audio.playback.spiceData.framesOut);
+  audio.playback.spiceData.framesIn  = NULL;
+  audio.playback.spiceData.framesOut = NULL;
 
   if (audio.playback.timings)
   {
@@ -217,6 +603,35 @@ static void playbackStop(void)
   }
 }
 
+/* Volume and mute are applied by the audio device where it supports it so the
+ * state is reflected in the system mixer, otherwise they are applied in
+ * software as part of the sample conversion */
+static void playbackUpdateGain(void)
+{
+  PlaybackSpiceData * spiceData = &audio.playback.spiceData;
+  const int channels = audio.playback.channels;
+  if (channels <= 0 || channels > PLAYBACK_MAX_CHANNELS)
+    return;
+
+  float gain[PLAYBACK_MAX_CHANNELS];
+  for(int i = 0; i < channels; ++i)
+  {
+    gain[i] = 1.0f;
+    if (!audio.audioDev->playback.mute && audio.playback.mute)
+      gain[i] = 0.0f;
+    else if (!audio.audioDev->playback.volume && audio.playback.volumeChannels)
+    {
+      const uint16_t volume = audio.playback.volume[
+        min(i, audio.playback.volumeChannels - 1)];
+      gain[i] = max(0.0, 9.3234e-7 * pow(1.000211902, volume) - 0.000172787);
+    }
+  }
+
+  spiceData->gainLen = channels * 8;
+  for(int i = 0; i < spiceData->gainLen; ++i)
+    spiceData->gain[i] = gain[i % channels] / 32768.0f;
+}
+
 static int playbackPullFrames(uint8_t * dst, int frames)
 {
   DEBUG_ASSERT(frames >= 0);
@@ -303,6 +718,10 @@ static int playbackPullFrames(uint8_t * dst, int frames)
     };
     ringbuffer_push(audio.playback.deviceTiming, &tick);
 
+    if (audio.playback.state == STREAM_STATE_RUN &&
+        ringbuffer_getCount(audio.playback.buffer) < frames)
+      atomic_fetch_add(&audio.metrics.underruns, 1);
+
     ringbuffer_consume(audio.playback.buffer, dst, frames);
   }
   else
@@ -323,23 +742,57 @@ static int playbackPullFrames(uint8_t * dst, int frames)
 void audio_playbackStart(int channels, int sampleRate, PSAudioFormat format,
   uint32_t time)
 {
+  // the encoder takes the audio even if there is no device to play it on
+  videoRecord_audioStart(channels, sampleRate);
+
   if (!audio.audioDev)
     return;
 
   static int lastChannels   = 0;
   static int lastSampleRate = 0;
 
+  atomic_store(&audio.playback.hostOffset, INT64_MIN);
+
   if (audio.playback.state == STREAM_STATE_KEEP_ALIVE &&
     channels == lastChannels && sampleRate == lastSampleRate)
+  {
+    playbackWorkerStart();
     return;
+  }
   if (audio.playback.state != STREAM_STATE_STOP)
     playbackStop();
 
-  int srcError;
-  audio.playback.spiceData.src = src_new(SRC_SINC_FASTEST, channels, &srcError);
-  if (!audio.playback.spiceData.src)
+  if (channels > PLAYBACK_MAX_CHANNELS)
+  {
+    DEBUG_ERROR("Unsupported channel count: %d", channels);
+    return;
+  }
+
+  audio.playback.spiceData.resampler = audio.resampler->create(channels);
+  if (!audio.playback.spiceData.resampler)
+    return;
+
+  /* allocate the conversion buffers up front so the Spice thread never has to
+   * allocate while audio is running, the output is sized for the largest
+   * ratio the resampler may be asked for */
+  PlaybackSpiceData * spiceData = &audio.playback.spiceData;
+  spiceData->framesInSize  =
+    max(sampleRate * PLAYBACK_MAX_CHUNK_MS / 1000, 1);
+  spiceData->framesOutSize =
+    (int)ceil(spiceData->framesInSize * PLAYBACK_MAX_RATIO) + 1;
+  spiceData->framesIn  = malloc(spiceData->framesInSize *
+      channels * sizeof(float));
+  spiceData->framesOut = malloc(spiceData->framesOutSize *
+      channels * sizeof(float));
+  if (!spiceData->framesIn || !spiceData->framesOut)
   {
-    DEBUG_ERROR("Failed to create resampler: %s", src_strerror(srcError));
+    DEBUG_ERROR("Failed to allocate the playback buffers");
+    free(spiceData->framesIn);
+    free(spiceData->framesOut);
+    spiceData->framesIn  = NULL;
+    spiceData->framesOut = NULL;
+    audio.resampler->free(spiceData->resampler);
+    spiceData->resampler = NULL;
     return;
   }
 
@@ -356,6 +809,7 @@ void audio_playbackStart(int channels, int sampleRate, PSAudioFormat format,
   audio.playback.sampleRate = sampleRate;
   audio.playback.stride     = channels * sizeof(float);
   audio.playback.state      = STREAM_STATE_SETUP_SPICE;
+  playbackUpdateGain();
 
   audio.playback.deviceData.periodFrames       = 0;
   audio.playback.deviceData.nextPosition       = 0;
@@ -391,6 +845,8 @@ void audio_playbackStart(int channels, int sampleRate, PSAudioFormat format,
   audio.playback.timings = ringbuffer_new(1200, sizeof(float));
   audio.playback.graph   = app_registerGraph("PLAYBACK",
       audio.playback.timings, 0.0f, 200.0f, audioGraphFormatFn);
+
+  playbackWorkerStart();
 }
 
 void audio_playbackStop(void)
@@ -398,6 +854,9 @@ void audio_playbackStop(void)
   if (!audio.audioDev)
     return;
 
+  // the worker must be idle before the stream state is changed under it
+  playbackWorkerStop();
+
   switch (audio.playback.state)
   {
     case STREAM_STATE_RUN:
@@ -407,12 +866,8 @@ void audio_playbackStop(void)
       audio.playback.state = STREAM_STATE_KEEP_ALIVE;
 
       // Reset the resampler so it is safe to use for the next playback
-      int error = src_reset(audio.playback.spiceData.src);
-      if (error)
-      {
-        DEBUG_ERROR("Failed to reset resampler: %s", src_strerror(error));
+      if (!audio.resampler->reset(audio.playback.spiceData.resampler))
         playbackStop();
-      }
 
       break;
     }
@@ -432,15 +887,16 @@ void audio_playbackStop(void)
 
 void audio_playbackVolume(int channels, const uint16_t volume[])
 {
-  if (!audio.audioDev || !audio.audioDev->playback.volume)
+  if (!audio.audioDev)
     return;
 
   // store the values so we can restore the state if the stream is restarted
   channels = min(ARRAY_LENGTH(audio.playback.volume), channels);
   memcpy(audio.playback.volume, volume, sizeof(uint16_t) * channels);
   audio.playback.volumeChannels = channels;
+  playbackUpdateGain();
 
-  if (!STREAM_ACTIVE(audio.playback.state))
+  if (!audio.audioDev->playback.volume || !STREAM_ACTIVE(audio.playback.state))
     return;
 
   audio.audioDev->playback.volume(channels, volume);
@@ -448,17 +904,41 @@ void audio_playbackVolume(int channels, const uint16_t volume[])
 
 void audio_playbackMute(bool mute)
 {
-  if (!audio.audioDev || !audio.audioDev->playback.mute)
+  if (!audio.audioDev)
     return;
 
   // store the value so we can restore it if the stream is restarted
   audio.playback.mute = mute;
-  if (!STREAM_ACTIVE(audio.playback.state))
+  playbackUpdateGain();
+
+  if (!audio.audioDev->playback.mute || !STREAM_ACTIVE(audio.playback.state))
     return;
 
   audio.audioDev->playback.mute(mute);
 }
 
+/* The latency needed to present the audio at the same time as the video it was
+ * captured with. When both streams carry host timestamps the unknown offset
+ * between the host and client clocks cancels out, otherwise the audio is
+ * assumed to arrive as soon as it was captured. */
+static double videoSyncFrames(void)
+{
+  int64_t videoUs;
+  int64_t videoOffset;
+  const int64_t audioOffset = atomic_load(&audio.playback.hostOffset);
+  if (audioOffset != INT64_MIN && latency_videoOffset(&videoOffset))
+    videoUs = videoOffset - audioOffset;
+  else
+    videoUs = latency_videoUs();
+
+  double frames = videoUs * audio.playback.sampleRate / 1.0e6;
+  if (audio.audioDev->playback.latency)
+    frames -= audio.audioDev->playback.latency();
+
+  return clamp(frames, 0.0,
+      PLAYBACK_SYNC_MAX_MS * audio.playback.sampleRate / 1000.0);
+}
+
 static double computeDevicePosition(int64_t curTime)
 {
   // Interpolate to calculate the current device position
@@ -469,49 +949,42 @@ static double computeDevicePosition(int64_t curTime)
         (spiceData->devNextTime - spiceData->devLastTime));
 }
 
+void audio_playbackHostTime(uint64_t captureTime)
+{
+  const int64_t offset = (int64_t)(microtime() - captureTime);
+  const int64_t old    = atomic_load(&audio.playback.hostOffset);
+
+  // packets arrive with scheduling jitter, smooth it out like the video side
+  atomic_store(&audio.playback.hostOffset, old == INT64_MIN ? offset :
+      old + (offset - old) / 16);
+}
+
 void audio_playbackData(uint8_t * data, size_t size)
 {
+  if (videoRecord_active())
+    videoRecord_audio((const int16_t *)data, size / sizeof(int16_t));
+
   if (audio.playback.state == STREAM_STATE_STOP || !audio.audioDev || size == 0)
     return;
 
+  int spiceStride = audio.playback.channels * sizeof(int16_t);
+  int frames      = size / spiceStride;
+
+  if (audio.playback.worker.thread)
+    playbackWorkerQueue((const int16_t *) data, frames);
+  else
+    playbackProcess((const int16_t *) data, frames, nanotime());
+}
+
+static void playbackProcess(const int16_t * data, int frames, int64_t now)
+{
   PlaybackSpiceData * spiceData = &audio.playback.spiceData;
-  int64_t now = nanotime();
 
-  // Convert from s16 to f32 samples
-  int spiceStride    = audio.playback.channels * sizeof(int16_t);
-  int frames         = size / spiceStride;
   bool periodChanged = frames != spiceData->periodFrames;
   bool init          = spiceData->periodFrames == 0;
 
   if (periodChanged)
-  {
-    if (spiceData->framesIn)
-    {
-      free(spiceData->framesIn);
-      free(spiceData->framesOut);
-    }
-    spiceData->periodFrames  = frames;
-    spiceData->framesIn      = malloc(frames * audio.playback.stride);
-    if (!spiceData->framesIn)
-    {
-      DEBUG_ERROR("Failed to malloc framesIn");
-      playbackStop();
-      return;
-    }
-
-    spiceData->framesOutSize = round(frames * 1.1);
-    spiceData->framesOut     =
-      malloc(spiceData->framesOutSize * audio.playback.stride);
-    if (!spiceData->framesOut)
-    {
-      DEBUG_ERROR("Failed to malloc framesOut");
-      playbackStop();
-      return;
-    }
-  }
-
-  src_short_to_float_array((int16_t *) data, spiceData->framesIn,
-    frames * audio.playback.channels);
+    spiceData->periodFrames = frames;
 
   // Receive timing information from the audio device thread
   PlaybackDeviceTick deviceTick;
@@ -573,6 +1046,11 @@ void audio_playbackData(uint8_t * data, size_t size)
     targetLatencyFrames +=
       audio.playback.deviceMaxPeriodFrames - spiceData->devPeriodFrames;
 
+  /* Audio can only be delayed to match the video, if it is already behind the
+   * picture there is nothing to be gained from lowering the target */
+  if (g_params.audioSyncVideo)
+    targetLatencyFrames = max(targetLatencyFrames, videoSyncFrames());
+
   // Measure the Spice audio clock
   int64_t curTime;
   int64_t curPosition;
@@ -596,6 +1074,11 @@ void audio_playbackData(uint8_t * data, size_t size)
   else
   {
     double error = (now - spiceData->nextTime) * 1.0e-9;
+    INTERLOCKED_SECTION(audio.metrics.lock,
+    {
+      histogramAdd(&audio.metrics.jitter, fabs(error) * 1000.0);
+    });
+
     if (fabs(error) >= 0.2 || audio.playback.state == STREAM_STATE_KEEP_ALIVE)
     {
       /* Clock error is too high or we are starting a new playback; slew the
@@ -676,36 +1159,54 @@ void audio_playbackData(uint8_t * data, size_t size)
   spiceData->ratioIntegral += offsetError * spiceData->periodSec;
 
   double piOutput = kp * offsetError + ki * spiceData->ratioIntegral;
-  double ratio = 1.0 + piOutput;
+  double ratio = clamp(1.0 + piOutput, PLAYBACK_MIN_RATIO, PLAYBACK_MAX_RATIO);
 
-  int consumed = 0;
-  while (consumed < frames)
+  // Let the device correct the drift if it resamples the stream anyway
+  const bool deviceRateMatch = audio.audioDev->playback.rateMatch &&
+    audio.audioDev->playback.rateMatch(ratio);
+  if (deviceRateMatch != spiceData->deviceRateMatch)
   {
-    SRC_DATA srcData =
-    {
-      .data_in           = spiceData->framesIn +
-        consumed * audio.playback.channels,
-      .data_out          = spiceData->framesOut,
-      .input_frames      = frames - consumed,
-      .output_frames     = spiceData->framesOutSize,
-      .input_frames_used = 0,
-      .output_frames_gen = 0,
-      .end_of_input      = 0,
-      .src_ratio         = ratio
-    };
+    DEBUG_INFO("Playback rate matching: %s",
+        deviceRateMatch ? "device" : audio.resampler->name);
+    spiceData->deviceRateMatch = deviceRateMatch;
+  }
 
-    int error = src_process(spiceData->src, &srcData);
-    if (error)
+  // Convert from s16 to f32 samples and resample in chunks that fit the buffers
+  const int16_t * samples = data;
+  for(int offset = 0; offset < frames; )
+  {
+    const int chunk = min(frames - offset, spiceData->framesInSize);
+    playbackConvert(spiceData->framesIn,
+      samples + offset * audio.playback.channels,
+      chunk * audio.playback.channels, spiceData->gain, spiceData->gainLen);
+
+    if (deviceRateMatch)
     {
-      DEBUG_ERROR("Resampling failed: %s", src_strerror(error));
-      return;
+      ringbuffer_append(audio.playback.buffer, spiceData->framesIn, chunk);
+      spiceData->nextPosition += chunk;
+      offset += chunk;
+      continue;
     }
 
-    ringbuffer_append(audio.playback.buffer, spiceData->framesOut,
-      srcData.output_frames_gen);
+    int consumed = 0;
+    while (consumed < chunk)
+    {
+      int used, generated;
+      if (!audio.resampler->process(spiceData->resampler,
+            spiceData->framesIn + consumed * audio.playback.channels,
+            chunk - consumed, &used,
+            spiceData->framesOut, spiceData->framesOutSize, &generated,
+            ratio))
+        return;
+
+      ringbuffer_append(audio.playback.buffer, spiceData->framesOut,
+        generated);
+
+      consumed += used;
+      spiceData->nextPosition += generated;
+    }
 
-    consumed += srcData.input_frames_used;
-    spiceData->nextPosition += srcData.output_frames_gen;
+    offset += chunk;
   }
 
   if (audio.playback.state == STREAM_STATE_SETUP_SPICE)
@@ -737,6 +1238,63 @@ void audio_playbackData(uint8_t * data, size_t size)
   const float latency = latencyFrames * 1000.0 / audio.playback.sampleRate;
   ringbuffer_push(audio.playback.timings, &latency);
   app_invalidateGraph(audio.playback.graph);
+
+  const int fill = ringbuffer_getCount(audio.playback.buffer);
+  if (fill > ringbuffer_getLength(audio.playback.buffer))
+    atomic_fetch_add(&audio.metrics.overruns, 1);
+
+  INTERLOCKED_SECTION(audio.metrics.lock,
+  {
+    histogramAdd(&audio.metrics.fill,
+        fill * 1000.0 / audio.playback.sampleRate);
+    histogramAdd(&audio.metrics.latency, latency);
+    histogramAdd(&audio.metrics.ratio, (ratio - 1.0) * 1.0e6);
+  });
+
+  if (audio.metrics.latencyStats)
+    stats_histogramRecord(audio.metrics.latencyStats, latency * 1000.0f);
+}
+
+void audio_dumpMetricsKeybind(int sc, void * opaque)
+{
+  char * path;
+  alloc_sprintf(&path, "%s/audio-metrics.json", lgConfigDir());
+  if (!path)
+    return;
+
+  // append one object per line so successive dumps can be compared
+  FILE * fp = fopen(path, "a");
+  if (!fp)
+  {
+    DEBUG_ERROR("Failed to open %s", path);
+    app_alert(LG_ALERT_ERROR, "Failed to write the audio metrics");
+    free(path);
+    return;
+  }
+
+  fprintf(fp, "{\"time\":%" PRIu64 ",\"periodSize\":%d,"
+      "\"bufferLatency\":%d,\"underruns\":%lu,\"overruns\":%lu,",
+      (uint64_t)time(NULL), g_params.audioPeriodSize,
+      g_params.audioBufferLatency,
+      atomic_load(&audio.metrics.underruns),
+      atomic_load(&audio.metrics.overruns));
+
+  INTERLOCKED_SECTION(audio.metrics.lock,
+  {
+    histogramWrite(fp, &audio.metrics.jitter);
+    fputc(',', fp);
+    histogramWrite(fp, &audio.metrics.fill);
+    fputc(',', fp);
+    histogramWrite(fp, &audio.metrics.latency);
+    fputc(',', fp);
+    histogramWrite(fp, &audio.metrics.ratio);
+  });
+  fputs("}\n", fp);
+  fclose(fp);
+
+  DEBUG_INFO("Audio metrics written to %s", path);
+  app_alert(LG_ALERT_INFO, "Audio metrics written");
+  free(path);
 }
 
 bool audio_supportsRecord(void)
@@ -744,16 +1302,183 @@ bool audio_supportsRecord(void)
   return audio.audioDev && audio.audioDev->record.start;
 }
 
+static void recordConvertS16(int16_t * restrict dst,
+    const float * restrict src, int samples)
+{
+  int i = 0;
+
+#ifdef AUDIO_X86
+  const __m128 scale = _mm_set1_ps(32768.0f);
+  const __m128 hi    = _mm_set1_ps( 32767.0f);
+  const __m128 lo    = _mm_set1_ps(-32768.0f);
+
+  for(; i + 8 <= samples; i += 8)
+  {
+    const __m128 a = _mm_mul_ps(_mm_loadu_ps(src + i    ), scale);
+    const __m128 b = _mm_mul_ps(_mm_loadu_ps(src + i + 4), scale);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(
+          _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(a, hi), lo)),
+          _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(b, hi), lo))));
+  }
+#endif
+
+  for(; i < samples; ++i)
+    dst[i] = lrintf(clamp(src[i] * 32768.0f, -32768.0f, 32767.0f));
+}
+
+static void recordFree(void)
+{
+  if (audio.record.resampler)
+    audio.resampler->free(audio.record.resampler);
+  audio.record.resampler = NULL;
+
+  ringbuffer_free(&audio.record.buffer);
+  free(audio.record.framesIn);
+  free(audio.record.framesOut);
+  free(audio.record.packet);
+  audio.record.framesIn  = NULL;
+  audio.record.framesOut = NULL;
+  audio.record.packet    = NULL;
+}
+
+static bool recordAlloc(int channels, int sampleRate)
+{
+  if (channels > PLAYBACK_MAX_CHANNELS)
+  {
+    DEBUG_ERROR("Unsupported record channel count: %d", channels);
+    return false;
+  }
+
+  audio.record.channels      = channels;
+  audio.record.sampleRate    = sampleRate;
+  audio.record.periodFrames  = 0;
+  audio.record.packetFrames  = max(sampleRate * RECORD_PACKET_MS / 1000, 1);
+  audio.record.framesInSize  =
+    max(sampleRate * PLAYBACK_MAX_CHUNK_MS / 1000, 1);
+  audio.record.framesOutSize =
+    (int)ceil(audio.record.framesInSize * RECORD_MAX_RATIO) + 1;
+
+  const size_t f32 = channels * sizeof(float);
+  audio.record.framesIn  = malloc(audio.record.framesInSize  * f32);
+  audio.record.framesOut = malloc(audio.record.framesOutSize * f32);
+  audio.record.packet    = malloc(audio.record.packetFrames  *
+      audio.record.stride);
+  audio.record.buffer    = ringbuffer_new(sampleRate, audio.record.stride);
+  audio.record.resampler = audio.resampler->create(channels);
+
+  if (!audio.record.framesIn || !audio.record.framesOut ||
+      !audio.record.packet   || !audio.record.buffer    ||
+      !audio.record.resampler)
+  {
+    DEBUG_ERROR("Failed to allocate the record buffers");
+    recordFree();
+    return false;
+  }
+
+  audio.record.gainLen = channels * 8;
+  for(int i = 0; i < audio.record.gainLen; ++i)
+    audio.record.gain[i] = 1.0f / 32768.0f;
+
+  return true;
+}
+
 static void recordPushFrames(uint8_t * data, int frames)
 {
-  purespice_writeAudio(data, frames * audio.record.stride, 0);
+  const int64_t now = nanotime();
+
+  /* Track the device period against the system clock with the same filter the
+   * playback uses for the Spice clock. The filtered period tells us how far
+   * the device sample clock has drifted from the nominal rate */
+  const double nominalSec = (double) frames / audio.record.sampleRate;
+  double error = (now - audio.record.nextTime) * 1.0e-9;
+  if (frames != audio.record.periodFrames || fabs(error) >= 0.2)
+  {
+    audio.record.periodFrames = frames;
+    audio.record.periodSec    = nominalSec;
+    audio.record.nextTime     = now + llrint(nominalSec * 1.0e9);
+
+    double bandwidth = 0.05;
+    double omega = 2.0 * M_PI * bandwidth * nominalSec;
+    audio.record.b = M_SQRT2 * omega;
+    audio.record.c = omega * omega;
+  }
+  else
+  {
+    audio.record.nextTime  +=
+      llrint((audio.record.b * error + audio.record.periodSec) * 1.0e9);
+    audio.record.periodSec += audio.record.c * error;
+  }
+
+  const double ratio = clamp(audio.record.periodSec / nominalSec,
+      RECORD_MIN_RATIO, RECORD_MAX_RATIO);
+
+  const int16_t * samples = (const int16_t *) data;
+  for(int offset = 0; offset < frames; )
+  {
+    const int chunk = min(frames - offset, audio.record.framesInSize);
+    playbackConvert(audio.record.framesIn,
+      samples + offset * audio.record.channels,
+      chunk * audio.record.channels, audio.record.gain, audio.record.gainLen);
+
+    int consumed = 0;
+    while (consumed < chunk)
+    {
+      int used, generated;
+      if (!audio.resampler->process(audio.record.resampler,
+            audio.record.framesIn + consumed * audio.record.channels,
+            chunk - consumed, &used,
+            audio.record.framesOut, audio.record.framesOutSize, &generated,
+            ratio))
+        return;
+
+      // convert straight into the buffer, in two spans if it wraps
+      for (int written = 0, span; written < generated; written += span)
+      {
+        void * dst;
+        span = ringbuffer_reserveWrite(audio.record.buffer, &dst,
+            generated - written);
+        if (!span)
+          break;
+
+        recordConvertS16(dst,
+            audio.record.framesOut + written * audio.record.channels,
+            span * audio.record.channels);
+        ringbuffer_commitWrite(audio.record.buffer, span);
+      }
+      consumed += used;
+    }
+
+    offset += chunk;
+  }
+
+  // send the audio in whole packets to reduce the per packet overhead
+  while (ringbuffer_getCount(audio.record.buffer) >= audio.record.packetFrames)
+  {
+    // send from the buffer itself unless the packet wraps around its end
+    const void * span;
+    if (ringbuffer_reserveRead(audio.record.buffer, &span,
+          audio.record.packetFrames) == audio.record.packetFrames)
+    {
+      purespice_writeAudio((void *)span,
+          audio.record.packetFrames * audio.record.stride, 0);
+      ringbuffer_commitRead(audio.record.buffer, audio.record.packetFrames);
+      continue;
+    }
+
+    ringbuffer_consume(audio.record.buffer, audio.record.packet,
+        audio.record.packetFrames);
+    purespice_writeAudio(audio.record.packet,
+        audio.record.packetFrames * audio.record.stride, 0);
+  }
 }
 
 static void realRecordStart(int channels, int sampleRate, PSAudioFormat format)
 {
-  audio.record.started = true;
   audio.record.stride  = channels * sizeof(uint16_t);
+  if (!recordAlloc(channels, sampleRate))
+    return;
 
+  audio.record.started = true;
   audio.audioDev->record.start(channels, sampleRate, recordPushFrames);
 
   // if a volume level was stored, set it before we return
@@ -805,7 +1530,10 @@ void audio_recordStart(int channels, int sampleRate, PSAudioFormat format)
   if (audio.record.started)
   {
     if (channels != lastChannels || sampleRate != lastSampleRate)
+    {
       audio.audioDev->record.stop();
+      recordFree();
+    }
     else
       return;
   }
@@ -843,6 +1571,7 @@ static void realRecordStop(void)
 {
   audio.audioDev->record.stop();
   audio.record.started = false;
+  recordFree();
 
   if (g_params.micShowIndicator)
     app_showRecord(false);
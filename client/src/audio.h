@@ -33,6 +33,8 @@ void audio_playbackStop(void);
 void audio_playbackVolume(int channels, const uint16_t volume[]);
 void audio_playbackMute(bool mute);
 void audio_playbackData(uint8_t * data, size_t size);
+void audio_playbackHostTime(uint64_t captureTime);
+void audio_dumpMetricsKeybind(int sc, void * opaque);
 
 bool audio_supportsRecord(void);
 void audio_recordStart(int channels, int sampleRate, PSAudioFormat format);
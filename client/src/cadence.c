@@ -0,0 +1,110 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "cadence.h"
+#include "main.h"
+
+#include "common/util.h"
+
+#include <string.h>
+
+// the frames the delay from the guest's present is judged over
+#define CADENCE_SAMPLES 32
+
+// frames needed before they are held at all
+#define CADENCE_MIN_SAMPLES 4
+
+// a gap longer than this is a pause or a seek and starts over
+#define CADENCE_GAP 250000
+
+// a frame is never held longer than this
+#define CADENCE_MAX_HOLD 50000
+
+static struct
+{
+  int64_t  delay[CADENCE_SAMPLES];
+  int      count, pos;
+  uint64_t lastPresent;
+  uint64_t interval;
+}
+l_cadence = { 0 };
+
+void cadence_reset(void)
+{
+  memset(&l_cadence, 0, sizeof(l_cadence));
+}
+
+uint64_t cadence_schedule(uint64_t presentTime, uint64_t now)
+{
+  if (!presentTime)
+    return 0;
+
+  if (presentTime <= l_cadence.lastPresent ||
+      presentTime - l_cadence.lastPresent > CADENCE_GAP)
+  {
+    cadence_reset();
+    l_cadence.lastPresent = presentTime;
+  }
+  else
+  {
+    const uint64_t interval = presentTime - l_cadence.lastPresent;
+    l_cadence.interval = l_cadence.interval ?
+      (l_cadence.interval * 7 + interval) / 8 : interval;
+    l_cadence.lastPresent = presentTime;
+  }
+
+  // the clocks differ, only how the delays spread matters
+  l_cadence.delay[l_cadence.pos] = (int64_t)(now - presentTime);
+  l_cadence.pos = (l_cadence.pos + 1) % CADENCE_SAMPLES;
+  if (l_cadence.count < CADENCE_SAMPLES)
+    ++l_cadence.count;
+
+  if (l_cadence.count < CADENCE_MIN_SAMPLES)
+    return 0;
+
+  int64_t minDelay = l_cadence.delay[0];
+  int64_t maxDelay = l_cadence.delay[0];
+  for (int i = 1; i < l_cadence.count; ++i)
+  {
+    minDelay = min(minDelay, l_cadence.delay[i]);
+    maxDelay = max(maxDelay, l_cadence.delay[i]);
+  }
+
+  /* allow for the jitter seen, but never a frame of it as the cadence would
+   * then just be kept a frame late */
+  const int64_t margin = min(maxDelay - minDelay,
+      (int64_t)l_cadence.interval / 2);
+  uint64_t target = presentTime + minDelay + margin;
+
+  uint64_t lastVBlank, periodNs;
+  if (g_state.ds->getVBlank && g_state.ds->getVBlank(&lastVBlank, &periodNs) &&
+      periodNs >= 1000 && target > lastVBlank)
+  {
+    const uint64_t period = periodNs / 1000;
+    const uint64_t vblank = lastVBlank +
+      ((target - lastVBlank + period / 2) / period) * period;
+    target = vblank - period / 2;
+  }
+
+  if (target <= now || target - now > CADENCE_MAX_HOLD)
+    return 0;
+
+  return target;
+}
@@ -0,0 +1,38 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_CADENCE_
+#define _H_LG_CADENCE_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Paces the frames to the guest's present cadence. A frame is held until it
+ * is as far behind its guest present time as the quickest recent frames were,
+ * plus the jitter seen, and then to half a refresh before the nearest vblank
+ * so that the swap lands on it. */
+void cadence_reset(void);
+
+/* presentTime is in host microseconds and only compared against the other
+ * frames, now is microtime(). Returns when to hand the frame to the renderer,
+ * zero for straight away */
+uint64_t cadence_schedule(uint64_t presentTime, uint64_t now);
+
+#endif
@@ -24,6 +24,9 @@
 
 #include "common/debug.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 LG_ClipboardData cb_spiceTypeToLGType(const PSDataType type)
 {
   switch(type)
@@ -54,6 +57,66 @@ PSDataType cb_lgTypeToSpiceType(const LG_ClipboardData type)
   }
 }
 
+/* keep the converted data of the most recent reply so that further requests
+ * for the same type reply immediately instead of having the guest encode it
+ * again, payloads above this size are not worth holding on to */
+#define CB_CACHE_MAX (32 * 1024 * 1024)
+
+void cb_cacheInvalidate(void)
+{
+  LG_LOCK(g_state.cbCacheLock);
+  ++g_state.cbGeneration;
+  free(g_state.cbCache);
+  g_state.cbCache     = NULL;
+  g_state.cbCacheSize = 0;
+  LG_UNLOCK(g_state.cbCacheLock);
+}
+
+static void cbCacheStore(unsigned int generation, const PSDataType type,
+    const uint8_t * buffer, uint32_t size)
+{
+  if (size > CB_CACHE_MAX)
+    return;
+
+  LG_LOCK(g_state.cbCacheLock);
+
+  // the clipboard changed while the request was in flight
+  if (generation != g_state.cbGeneration)
+    goto out;
+
+  uint8_t * data = realloc(g_state.cbCache, size ? size : 1);
+  if (!data)
+  {
+    DEBUG_ERROR("out of memory");
+    goto out;
+  }
+
+  memcpy(data, buffer, size);
+  g_state.cbCache     = data;
+  g_state.cbCacheType = type;
+  g_state.cbCacheSize = size;
+
+out:
+  LG_UNLOCK(g_state.cbCacheLock);
+}
+
+bool cb_cacheReply(const PSDataType type, const LG_ClipboardReplyFn replyFn,
+    void * opaque)
+{
+  LG_LOCK(g_state.cbCacheLock);
+  if (!g_state.cbCache || g_state.cbCacheType != type)
+  {
+    LG_UNLOCK(g_state.cbCacheLock);
+    return false;
+  }
+
+  // the display servers copy the data before returning
+  replyFn(opaque, cb_spiceTypeToLGType(type), g_state.cbCache,
+      g_state.cbCacheSize);
+  LG_UNLOCK(g_state.cbCacheLock);
+  return true;
+}
+
 void cb_spiceNotice(const PSDataType type)
 {
   if (!g_params.clipboardToLocal)
@@ -62,6 +125,7 @@ void cb_spiceNotice(const PSDataType type)
   if (!g_state.cbAvailable)
     return;
 
+  cb_cacheInvalidate();
   g_state.cbType = type;
   g_state.ds->cbNotice(cb_spiceTypeToLGType(type));
 }
@@ -92,6 +156,7 @@ void cb_spiceData(const PSDataType type, uint8_t * buffer, uint32_t size)
   struct CBRequest * cbr;
   if (ll_shift(g_state.cbRequestList, (void **)&cbr))
   {
+    cbCacheStore(cbr->generation, type, buffer, size);
     cbr->replyFn(cbr->opaque, cb_spiceTypeToLGType(type), buffer, size);
     free(cbr);
   }
@@ -103,7 +168,10 @@ void cb_spiceRelease(void)
     return;
 
   if (g_state.cbAvailable)
+  {
+    cb_cacheInvalidate();
     g_state.ds->cbRelease();
+  }
 }
 
 void cb_spiceRequest(const PSDataType type)
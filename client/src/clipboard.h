@@ -28,3 +28,7 @@ void cb_spiceNotice(const PSDataType type);
 void cb_spiceData(const PSDataType type, uint8_t * buffer, uint32_t size);
 void cb_spiceRelease(void);
 void cb_spiceRequest(const PSDataType type);
+
+bool cb_cacheReply(const PSDataType type, const LG_ClipboardReplyFn replyFn,
+    void * opaque);
+void cb_cacheInvalidate(void);
@@ -20,9 +20,12 @@
 
 #include "main.h"
 #include "config.h"
+#include "config_watch.h"
 #include "kb.h"
+#include "power.h"
 
 #include "common/option.h"
+#include "common/array.h"
 #include "common/debug.h"
 #include "common/paths.h"
 #include "common/stringutils.h"
@@ -47,11 +50,18 @@ static StringList optScancodeValues    (struct Option * opt);
 static bool       optScancodeValidate  (struct Option * opt, const char ** error);
 static char *     optScancodeToString  (struct Option * opt);
 static bool       optRotateValidate    (struct Option * opt, const char ** error);
+static bool       optCoalesceValidate  (struct Option * opt, const char ** error);
+static bool       optResamplerValidate (struct Option * opt, const char ** error);
+static bool       optSourceLayoutValidate(struct Option * opt, const char ** error);
+static bool       optPreviewFpsValidate(struct Option * opt, const char ** error);
+static bool       optPollScaleValidate (struct Option * opt, const char ** error);
+static bool       optPowersaveFpsValidate(struct Option * opt, const char ** error);
 static bool       optMicDefaultParse   (struct Option * opt, const char * str);
 static StringList optMicDefaultValues  (struct Option * opt);
 static char *     optMicDefaultToString(struct Option * opt);
 
 static void doLicense(void);
+static void watchLiveParams(void);
 
 static struct Option options[] =
 {
@@ -96,6 +106,20 @@ static struct Option options[] =
     .type          = OPTION_TYPE_INT,
     .value.x_int   = 1000
   },
+  {
+    .module        = "app",
+    .name          = "latestFrame",
+    .description   = "Always show the newest frame, passing over any queued behind it",
+    .type          = OPTION_TYPE_BOOL,
+    .value.x_bool  = false
+  },
+  {
+    .module        = "app",
+    .name          = "earlyRelease",
+    .description   = "Copy each frame to client memory and release it to the host before the upload",
+    .type          = OPTION_TYPE_BOOL,
+    .value.x_bool  = false
+  },
   {
     .module        = "app",
     .name          = "allowDMA",
@@ -103,6 +127,102 @@ static struct Option options[] =
     .type          = OPTION_TYPE_BOOL,
     .value.x_bool  = true
   },
+  {
+    .module         = "app",
+    .name           = "latencyLog",
+    .description    = "Write a per frame latency breakdown in CSV format to this file",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "app",
+    .name           = "metricsSocket",
+    .description    = "Publish the performance metrics on a UNIX socket at this path",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "app",
+    .name           = "recordFile",
+    .description    = "Record the frames and cursor updates to this file for the host's replay capture",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "app",
+    .name           = "extraShmFiles",
+    .description    = "A comma separated list of more shared memory files to show view only",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "app",
+    .name           = "sourceLayout",
+    .description    = "How the extra sources are shown (pip, tile)",
+    .type           = OPTION_TYPE_STRING,
+    .validator      = optSourceLayoutValidate,
+    .value.x_string = "pip"
+  },
+  {
+    .module         = "app",
+    .name           = "previewFps",
+    .description    = "The most frames a second to show of an extra source unless the pointer is over it (0 = all)",
+    .type           = OPTION_TYPE_INT,
+    .validator      = optPreviewFpsValidate,
+    .value.x_int    = 10
+  },
+  {
+    .module         = "app",
+    .name           = "powerProfile",
+    .description    = "When to save power (auto = on battery, performance, powersave)",
+    .type           = OPTION_TYPE_STRING,
+    .validator      = power_profileValidate,
+    .value.x_string = "auto"
+  },
+  {
+    .module         = "app",
+    .name           = "powersavePollScale",
+    .description    = "How many times longer the poll intervals are while saving power",
+    .type           = OPTION_TYPE_INT,
+    .validator      = optPollScaleValidate,
+    .value.x_int    = 4
+  },
+  {
+    .module         = "app",
+    .name           = "powersaveFps",
+    .description    = "The most frames a second to render while saving power (0 = unlimited)",
+    .type           = OPTION_TYPE_INT,
+    .validator      = optPowersaveFpsValidate,
+    .value.x_int    = 30
+  },
+  {
+    .module         = "app",
+    .name           = "powersaveFilters",
+    .description    = "Keep running the costly filters such as FSR and CAS while saving power",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false
+  },
+  {
+    .module         = "app",
+    .name           = "watchConfig",
+    .description    = "Apply changes to the config files while running where the setting allows it",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = true
+  },
+  {
+    .module         = "app",
+    .name           = "fbProfile",
+    .description    = "Profile the frame buffer copies, logged on exit and by the P keybind",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false
+  },
+  {
+    .module         = "app",
+    .name           = "copyThreads",
+    .description    = "The number of threads used to copy frames without DMA (0 = auto)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 0
+  },
 
   // window options
   {
@@ -295,6 +415,20 @@ static struct Option options[] =
     .type           = OPTION_TYPE_BOOL,
     .value.x_bool   = false,
   },
+  {
+    .module         = "win",
+    .name           = "guestCadence",
+    .description    = "Hold the frames to keep the spacing the guest presented them with",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
+  {
+    .module         = "win",
+    .name           = "vrr",
+    .description    = "Pace frames for adaptive sync if the display supports it",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = true,
+  },
 
   // input options
   {
@@ -367,6 +501,21 @@ static struct Option options[] =
     .type           = OPTION_TYPE_BOOL,
     .value.x_bool   = false,
   },
+  {
+    .module         = "input",
+    .name           = "mouseCoalesce",
+    .description    = "Combine relative mouse motion sent within this many microseconds (0 = off)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 0,
+    .validator      = optCoalesceValidate,
+  },
+  {
+    .module         = "input",
+    .name           = "predictCursor",
+    .description    = "Draw the cursor where local motion will move it in capture mode",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
   {
     .module         = "input",
     .name           = "mouseRedraw",
@@ -501,6 +650,35 @@ static struct Option options[] =
     .type           = OPTION_TYPE_INT,
     .value.x_int    = 13
   },
+  {
+    .module         = "audio",
+    .name           = "resampler",
+    .description    = "The playback resampler to use (samplerate, polyphase)",
+    .type           = OPTION_TYPE_STRING,
+    .validator      = optResamplerValidate,
+    .value.x_string = "samplerate"
+  },
+  {
+    .module         = "audio",
+    .name           = "worker",
+    .description    = "Resample playback on a dedicated realtime thread",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false
+  },
+  {
+    .module         = "audio",
+    .name           = "ivshmem",
+    .description    = "Receive guest audio over IVSHMEM when the host provides it",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false
+  },
+  {
+    .module         = "audio",
+    .name           = "syncVideo",
+    .description    = "Delay playback to match the video latency",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false
+  },
   {
     .module         = "audio",
     .name           = "micDefault",
@@ -538,6 +716,7 @@ bool config_load(int argc, char * argv[])
     DEBUG_INFO("Loading config from: /etc/looking-glass-client.ini");
     if (!option_load("/etc/looking-glass-client.ini"))
       return false;
+    configWatch_add("/etc/looking-glass-client.ini");
   }
 
   // load config from user's home directory
@@ -562,6 +741,7 @@ bool config_load(int argc, char * argv[])
         free(localFile);
         return false;
       }
+      configWatch_add(localFile);
     }
     free(localFile);
   }
@@ -583,6 +763,7 @@ bool config_load(int argc, char * argv[])
       free(xdgFile);
       return false;
     }
+    configWatch_add(xdgFile);
   }
   free(xdgFile);
 
@@ -603,6 +784,7 @@ bool config_load(int argc, char * argv[])
     DEBUG_INFO("Loading config from: %s", configFile);
     if (!option_load(configFile))
       return false;
+    configWatch_add(configFile);
   }
 
   // validate the values are sane
@@ -618,7 +800,25 @@ bool config_load(int argc, char * argv[])
   // setup the application params for the basic types
   g_params.cursorPollInterval = option_get_int   ("app"  , "cursorPollInterval");
   g_params.framePollInterval  = option_get_int   ("app"  , "framePollInterval" );
+  g_params.latestFrame        = option_get_bool  ("app"  , "latestFrame"       );
+  g_params.earlyRelease       = option_get_bool  ("app"  , "earlyRelease"      );
   g_params.allowDMA           = option_get_bool  ("app"  , "allowDMA"          );
+  g_params.latencyLog         = option_get_string("app"  , "latencyLog"        );
+  g_params.metricsSocket      = option_get_string("app"  , "metricsSocket"     );
+  g_params.recordFile         = option_get_string("app"  , "recordFile"        );
+  g_params.fbProfile          = option_get_bool  ("app"  , "fbProfile"         );
+  g_params.copyThreads        = option_get_int   ("app"  , "copyThreads"       );
+  g_params.extraShmFiles      = option_get_string("app"  , "extraShmFiles"     );
+  g_params.sourceLayout       =
+    strcmp(option_get_string("app", "sourceLayout"), "tile") == 0 ?
+    LG_SOURCES_TILE : LG_SOURCES_PIP;
+  g_params.previewFps         = option_get_int   ("app"  , "previewFps"        );
+  g_params.watchConfig        = option_get_bool  ("app"  , "watchConfig"       );
+  g_params.powerProfile       =
+    power_profileParse(option_get_string("app", "powerProfile"));
+  g_params.powersavePollScale = option_get_int   ("app"  , "powersavePollScale");
+  g_params.powersaveFps       = option_get_int   ("app"  , "powersaveFps"      );
+  g_params.powersaveFilters   = option_get_bool  ("app"  , "powersaveFilters"  );
 
   g_params.windowTitle     = option_get_string("win", "title"             );
   g_params.autoResize      = option_get_bool  ("win", "autoResize"        );
@@ -641,6 +841,8 @@ bool config_load(int argc, char * argv[])
   g_params.uiFont          = option_get_string("win", "uiFont"            );
   g_params.uiSize          = option_get_int   ("win", "uiSize"            );
   g_params.jitRender       = option_get_bool  ("win", "jitRender"         );
+  g_params.vrr             = option_get_bool  ("win", "vrr"               );
+  g_params.guestCadence    = option_get_bool  ("win", "guestCadence"      );
 
   if (g_params.noScreensaver && g_params.autoScreensaver)
   {
@@ -666,6 +868,8 @@ bool config_load(int argc, char * argv[])
   g_params.mouseSens              = option_get_int ("input", "mouseSens"             );
   g_params.mouseSmoothing         = option_get_bool("input", "mouseSmoothing"        );
   g_params.rawMouse               = option_get_bool("input", "rawMouse"              );
+  g_params.mouseCoalesce          = option_get_int ("input", "mouseCoalesce"         );
+  g_params.predictCursor          = option_get_bool("input", "predictCursor"         );
   g_params.mouseRedraw            = option_get_bool("input", "mouseRedraw"           );
   g_params.autoCapture            = option_get_bool("input", "autoCapture"           );
   g_params.captureInputOnly       = option_get_bool("input", "captureOnly"           );
@@ -709,13 +913,63 @@ bool config_load(int argc, char * argv[])
 
   g_params.audioPeriodSize = option_get_int("audio", "periodSize");
   g_params.audioBufferLatency = option_get_int("audio", "bufferLatency");
+  g_params.audioWorker        = option_get_bool("audio", "worker");
+  g_params.audioIVSHMEM       = option_get_bool("audio", "ivshmem");
+  g_params.audioSyncVideo     = option_get_bool("audio", "syncVideo");
+  g_params.audioResampler     = option_get_string("audio", "resampler");
   g_params.micShowIndicator   = option_get_bool("audio", "micShowIndicator");
 
+  watchLiveParams();
   return true;
 }
 
+static void liveBoolChanged(struct Option * opt, void * opaque)
+{
+  *(bool *)opaque = option_bool(opt);
+}
+
+static void liveUIntChanged(struct Option * opt, void * opaque)
+{
+  *(unsigned int *)opaque = option_int(opt);
+}
+
+static void liveMouseSensChanged(struct Option * opt, void * opaque)
+{
+  g_params.mouseSens = option_int(opt);
+  g_cursor.sens      = g_params.mouseSens;
+}
+
+/* the params that are read as they are used and so can follow the config files
+ * while running, anything read once at startup still needs a restart */
+static void watchLiveParams(void)
+{
+  static const struct
+  {
+    const char * module;
+    const char * name;
+    bool       * value;
+  }
+  bools[] =
+  {
+    { "win"  , "alerts"            , &g_params.showAlerts     },
+    { "win"  , "overlayDimsDesktop", &g_params.overlayDim     },
+    { "input", "mouseSmoothing"    , &g_params.mouseSmoothing },
+    { "audio", "syncVideo"         , &g_params.audioSyncVideo },
+  };
+
+  for(unsigned int i = 0; i < ARRAY_LENGTH(bools); ++i)
+    option_watch(option_get(bools[i].module, bools[i].name),
+        liveBoolChanged, bools[i].value);
+
+  option_watch(option_get("app", "previewFps"),
+      liveUIntChanged, &g_params.previewFps);
+  option_watch(option_get("input", "mouseSens"),
+      liveMouseSensChanged, NULL);
+}
+
 void config_free(void)
 {
+  configWatch_free();
   option_free();
 }
 
@@ -932,6 +1186,46 @@ static char * optScancodeToString(struct Option * opt)
   return str;
 }
 
+static bool optSourceLayoutValidate(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_string &&
+      (strcmp(opt->value.x_string, "pip" ) == 0 ||
+       strcmp(opt->value.x_string, "tile") == 0))
+    return true;
+
+  *error = "The source layout must be one of pip or tile";
+  return false;
+}
+
+static bool optPreviewFpsValidate(struct Option * opt, const char ** error)
+{
+  // a frame held for a second gets the client dropped by the host
+  if (opt->value.x_int == 0 ||
+      (opt->value.x_int >= 2 && opt->value.x_int <= 1000))
+    return true;
+
+  *error = "The preview rate must be 0 or between 2 and 1000";
+  return false;
+}
+
+static bool optPollScaleValidate(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_int >= 1 && opt->value.x_int <= 100)
+    return true;
+
+  *error = "The poll scale must be between 1 and 100";
+  return false;
+}
+
+static bool optPowersaveFpsValidate(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_int >= 0 && opt->value.x_int <= 1000)
+    return true;
+
+  *error = "The power save frame rate must be between 0 and 1000";
+  return false;
+}
+
 static bool optRotateValidate(struct Option * opt, const char ** error)
 {
   switch(opt->value.x_int)
@@ -947,6 +1241,25 @@ static bool optRotateValidate(struct Option * opt, const char ** error)
   return false;
 }
 
+static bool optCoalesceValidate(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_int >= 0 && opt->value.x_int <= 100000)
+    return true;
+
+  *error = "Mouse coalesce interval must be between 0 and 100000 microseconds";
+  return false;
+}
+
+static bool optResamplerValidate(struct Option * opt, const char ** error)
+{
+  if (strcasecmp(opt->value.x_string, "samplerate") == 0 ||
+      strcasecmp(opt->value.x_string, "polyphase" ) == 0)
+    return true;
+
+  *error = "Resampler must be one of samplerate or polyphase";
+  return false;
+}
+
 static bool optMicDefaultParse(struct Option * opt, const char * str)
 {
   if (!str)
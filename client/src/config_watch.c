@@ -0,0 +1,230 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "config_watch.h"
+#include "render_queue.h"
+#include "app.h"
+
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/stringlist.h"
+#include "common/thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+
+// editors write out a file in parts, wait for them to be quiet this long
+#define CONFIG_SETTLE_MS 100
+
+struct ConfigWatchState
+{
+  StringList   files;
+  int          fd;
+  int        * wd;
+  LGThread   * thread;
+  atomic_bool  running;
+};
+
+static struct ConfigWatchState cw = { .fd = -1 };
+
+void configWatch_add(const char * path)
+{
+  if (!cw.files && !(cw.files = stringlist_new(true)))
+  {
+    DEBUG_ERROR("out of memory");
+    return;
+  }
+
+  char * copy = strdup(path);
+  if (!copy)
+  {
+    DEBUG_ERROR("out of memory");
+    return;
+  }
+
+  stringlist_push(cw.files, copy);
+}
+
+void configWatch_free(void)
+{
+  configWatch_stop();
+  if (cw.files)
+    stringlist_free(&cw.files);
+}
+
+/* true if the event is for one of the files, the directories are watched as
+ * editors often replace the file rather than write to it */
+static bool isConfigEvent(const struct inotify_event * ev)
+{
+  if (!ev->len)
+    return false;
+
+  for(unsigned int i = 0; i < stringlist_count(cw.files); ++i)
+  {
+    if (cw.wd[i] != ev->wd)
+      continue;
+
+    const char * path = stringlist_at(cw.files, i);
+    const char * name = strrchr(path, '/');
+    if (strcmp(name ? name + 1 : path, ev->name) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+// drains the pending events, returns true if any were for a config file
+static bool readEvents(void)
+{
+  char buffer[4096]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  bool changed = false;
+  ssize_t len;
+  while((len = read(cw.fd, buffer, sizeof(buffer))) > 0)
+    for(char * p = buffer; p < buffer + len;)
+    {
+      const struct inotify_event * ev = (const struct inotify_event *)p;
+      changed |= isConfigEvent(ev);
+      p += sizeof(*ev) + ev->len;
+    }
+
+  return changed;
+}
+
+static int configWatchThread(void * opaque)
+{
+  struct pollfd pfd = { .fd = cw.fd, .events = POLLIN };
+  bool pending = false;
+
+  while(atomic_load(&cw.running))
+  {
+    const int ret = poll(&pfd, 1, pending ? CONFIG_SETTLE_MS : 250);
+    if (ret < 0)
+    {
+      DEBUG_ERROR("poll failed, no longer watching the config");
+      break;
+    }
+
+    if (ret > 0)
+    {
+      pending |= readEvents();
+      continue;
+    }
+
+    if (pending)
+    {
+      pending = false;
+      renderQueue_configReload();
+    }
+  }
+
+  return 0;
+}
+
+bool configWatch_start(void)
+{
+  const unsigned int count = cw.files ? stringlist_count(cw.files) : 0;
+  if (!count)
+    return true;
+
+  cw.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (cw.fd < 0)
+  {
+    DEBUG_WARN("inotify_init1 failed, config changes need a restart");
+    return false;
+  }
+
+  cw.wd = malloc(sizeof(*cw.wd) * count);
+  if (!cw.wd)
+  {
+    DEBUG_ERROR("out of memory");
+    goto err_fd;
+  }
+
+  for(unsigned int i = 0; i < count; ++i)
+  {
+    char * dir = strdup(stringlist_at(cw.files, i));
+    if (!dir)
+    {
+      DEBUG_ERROR("out of memory");
+      goto err_wd;
+    }
+
+    // watches of the same directory share the descriptor
+    cw.wd[i] = inotify_add_watch(cw.fd, dirname(dir),
+        IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (cw.wd[i] < 0)
+      DEBUG_WARN("Unable to watch: %s", stringlist_at(cw.files, i));
+    free(dir);
+  }
+
+  atomic_store(&cw.running, true);
+  if (!lgCreateThread("configWatch", configWatchThread, NULL, &cw.thread))
+  {
+    DEBUG_ERROR("Failed to create the config watch thread");
+    atomic_store(&cw.running, false);
+    goto err_wd;
+  }
+
+  return true;
+
+err_wd:
+  free(cw.wd);
+  cw.wd = NULL;
+
+err_fd:
+  close(cw.fd);
+  cw.fd = -1;
+  return false;
+}
+
+void configWatch_stop(void)
+{
+  if (!cw.thread)
+    return;
+
+  atomic_store(&cw.running, false);
+  lgJoinThread(cw.thread, NULL);
+  cw.thread = NULL;
+
+  close(cw.fd);
+  cw.fd = -1;
+  free(cw.wd);
+  cw.wd = NULL;
+}
+
+void configWatch_reload(void)
+{
+  for(unsigned int i = 0; i < stringlist_count(cw.files); ++i)
+  {
+    const char * path = stringlist_at(cw.files, i);
+    DEBUG_INFO("Reloading config from: %s", path);
+    if (!option_reload(path))
+      DEBUG_WARN("Failed to reload: %s", path);
+  }
+
+  app_invalidateWindow(true);
+}
@@ -0,0 +1,41 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_CONFIG_WATCH_
+#define _H_LG_CONFIG_WATCH_
+
+#include <stdbool.h>
+
+/* Watches the config files that were loaded at startup and applies a change on
+ * the render thread. Only options something has watched with option_watch are
+ * updated, everything else still needs a restart */
+
+// records a config file to watch, called by config_load
+void configWatch_add(const char * path);
+void configWatch_free(void);
+
+// start and stop the watch thread
+bool configWatch_start(void);
+void configWatch_stop(void);
+
+// reloads the files, from the render thread only
+void configWatch_reload(void);
+
+#endif
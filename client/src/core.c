@@ -22,6 +22,7 @@
 #include "main.h"
 #include "app.h"
 #include "util.h"
+#include "sources.h"
 
 #include "common/time.h"
 #include "common/debug.h"
@@ -31,6 +32,25 @@
 
 #define RESIZE_TIMEOUT (10 * 1000) // 10ms
 
+// drop motion the guest has not applied by now, it likely hit an edge
+#define PREDICT_TIMEOUT (100 * 1000) // 100ms
+
+// relative motion held back by input:mouseCoalesce
+// the longest a batch may hold motion back if it is never ended
+#define MOTION_BATCH_MAX_US 1000
+
+static struct
+{
+  bool      init;
+  LG_Lock   lock;
+  LGTimer * timer;
+  int       x, y;
+  uint64_t  lastSend;
+  bool      batch;
+  uint64_t  batchStart;
+}
+motion = { 0 };
+
 static bool isInView(void)
 {
   return
@@ -66,7 +86,7 @@ void core_invalidatePointer(bool detectInView)
 
   g_cursor.draw = (g_params.alwaysShowCursor || g_params.captureInputOnly)
     ? true : g_cursor.inView;
-  g_cursor.redraw = true;
+  core_redrawCursor();
 
   g_cursor.warpState = g_cursor.inView ? WARP_STATE_ON : WARP_STATE_OFF;
   if (g_cursor.inView)
@@ -206,76 +226,86 @@ void core_updatePositionInfo(void)
       DEBUG_UNREACHABLE();
   }
 
+  /* when tiled the primary is fit into the first cell of the grid the renderer
+   * lays the extra sources out in, the input is mapped to it the same way */
+  const unsigned int sources = sources_count();
+  const bool tiled = sources > 1 && g_params.sourceLayout == LG_SOURCES_TILE;
+  const LG_RendererRect area = tiled ?
+    lgSourceCell(LG_SOURCES_TILE, sources, 0, g_state.windowW, g_state.windowH) :
+    (LG_RendererRect){ true, 0, 0, g_state.windowW, g_state.windowH };
+  const int areaCX = area.x + area.w / 2;
+  const int areaCY = area.y + area.h / 2;
+
   if (g_params.keepAspect)
   {
     const float srcAspect = srcH / srcW;
-    const float wndAspect = (float)g_state.windowH / (float)g_state.windowW;
+    const float wndAspect = (float)area.h / (float)area.w;
     bool force = true;
 
     if (g_params.dontUpscale &&
-        srcW <= g_state.windowW &&
-        srcH <= g_state.windowH)
+        srcW <= area.w &&
+        srcH <= area.h)
     {
       force = false;
       g_state.dstRect.w = srcW;
       g_state.dstRect.h = srcH;
-      g_state.dstRect.x = g_state.windowCX - srcW / 2;
-      g_state.dstRect.y = g_state.windowCY - srcH / 2;
+      g_state.dstRect.x = areaCX - srcW / 2;
+      g_state.dstRect.y = areaCY - srcH / 2;
     }
     else
     if (g_params.intUpscale &&
-        srcW <= g_state.windowW &&
-        srcH <= g_state.windowH)
+        srcW <= area.w &&
+        srcH <= area.h)
     {
       force = false;
       const int scale = min(
-          floor(g_state.windowW / srcW),
-          floor(g_state.windowH / srcH));
+          floor(area.w / srcW),
+          floor(area.h / srcH));
       g_state.dstRect.w = srcW * scale;
       g_state.dstRect.h = srcH * scale;
-      g_state.dstRect.x = g_state.windowCX - g_state.dstRect.w / 2;
-      g_state.dstRect.y = g_state.windowCY - g_state.dstRect.h / 2;
+      g_state.dstRect.x = areaCX - g_state.dstRect.w / 2;
+      g_state.dstRect.y = areaCY - g_state.dstRect.h / 2;
     }
     else
     if ((int)(wndAspect * 1000) == (int)(srcAspect * 1000))
     {
       force           = false;
-      g_state.dstRect.w = g_state.windowW;
-      g_state.dstRect.h = g_state.windowH;
-      g_state.dstRect.x = 0;
-      g_state.dstRect.y = 0;
+      g_state.dstRect.w = area.w;
+      g_state.dstRect.h = area.h;
+      g_state.dstRect.x = area.x;
+      g_state.dstRect.y = area.y;
     }
     else
     if (wndAspect < srcAspect)
     {
-      g_state.dstRect.w = (float)g_state.windowH / srcAspect;
-      g_state.dstRect.h = g_state.windowH;
-      g_state.dstRect.x = (g_state.windowW >> 1) - (g_state.dstRect.w >> 1);
-      g_state.dstRect.y = 0;
+      g_state.dstRect.w = (float)area.h / srcAspect;
+      g_state.dstRect.h = area.h;
+      g_state.dstRect.x = area.x + (area.w >> 1) - (g_state.dstRect.w >> 1);
+      g_state.dstRect.y = area.y;
     }
     else
     {
-      g_state.dstRect.w = g_state.windowW;
-      g_state.dstRect.h = (float)g_state.windowW * srcAspect;
-      g_state.dstRect.x = 0;
-      g_state.dstRect.y = (g_state.windowH >> 1) - (g_state.dstRect.h >> 1);
+      g_state.dstRect.w = area.w;
+      g_state.dstRect.h = (float)area.w * srcAspect;
+      g_state.dstRect.x = area.x;
+      g_state.dstRect.y = area.y + (area.h >> 1) - (g_state.dstRect.h >> 1);
     }
 
     if (g_params.dontUpscale && g_params.shrinkOnUpscale)
     {
-      if (g_state.windowW > srcW)
+      if (area.w > srcW)
       {
         force = true;
         g_state.dstRect.w = (int) (srcW + 0.5);
       }
-      if (g_state.windowH > srcH)
+      if (area.h > srcH)
       {
         force = true;
         g_state.dstRect.h = (int) (srcH + 0.5);
       }
     }
 
-    if (force && g_params.forceAspect)
+    if (force && g_params.forceAspect && !tiled)
     {
       g_state.resizeTimeout = microtime() + RESIZE_TIMEOUT;
       g_state.resizeDone    = false;
@@ -283,10 +313,10 @@ void core_updatePositionInfo(void)
   }
   else
   {
-    g_state.dstRect.x = 0;
-    g_state.dstRect.y = 0;
-    g_state.dstRect.w = g_state.windowW;
-    g_state.dstRect.h = g_state.windowH;
+    g_state.dstRect.x = area.x;
+    g_state.dstRect.y = area.y;
+    g_state.dstRect.w = area.w;
+    g_state.dstRect.h = area.h;
   }
   g_state.dstRect.valid = true;
 
@@ -351,9 +381,21 @@ bool core_startCursorThread(void)
   return true;
 }
 
+void core_redrawCursor(void)
+{
+  g_cursor.redraw = true;
+
+  // the cursor thread only wakes for the host while it uses the doorbell
+  if (g_state.useDoorbell)
+    ivshmemWakeDoorbell(&g_state.shm, KVMFR_DOORBELL_POINTER);
+}
+
 void core_stopCursorThread(void)
 {
   g_state.stopVideo = true;
+  if (g_state.useDoorbell)
+    ivshmemWakeDoorbell(&g_state.shm, KVMFR_DOORBELL_POINTER);
+
   if (g_state.cursorThread)
     lgJoinThread(g_state.cursorThread, NULL);
 
@@ -378,6 +420,9 @@ bool core_startFrameThread(void)
 void core_stopFrameThread(void)
 {
   g_state.stopVideo = true;
+  if (g_state.useDoorbell)
+    ivshmemWakeDoorbell(&g_state.shm, KVMFR_DOORBELL_FRAME);
+
   if (g_state.frameThread)
     lgJoinThread(g_state.frameThread, NULL);
 
@@ -402,31 +447,251 @@ void core_handleGuestMouseUpdate(void)
   );
 }
 
+// call with motion.lock held
+static void flushMotion(uint64_t now)
+{
+  if ((!motion.x && !motion.y) ||
+      now - motion.lastSend < g_params.mouseCoalesce)
+    return;
+
+  if (!purespice_mouseMotion(motion.x, motion.y))
+    DEBUG_ERROR("failed to send mouse motion message");
+
+  motion.x        = 0;
+  motion.y        = 0;
+  motion.lastSend = now;
+}
+
+static bool motionTimerFn(void * unused)
+{
+  // sends the tail of a movement once the interval has passed
+  LG_LOCK(motion.lock);
+  flushMotion(microtime());
+  LG_UNLOCK(motion.lock);
+  return true;
+}
+
+bool core_startMotionCoalesce(void)
+{
+  // the lock is also needed for input batches from the display server
+  LG_LOCK_INIT(motion.lock);
+  motion.init = true;
+
+  if (!g_params.mouseCoalesce)
+    return true;
+
+  if (!lgCreateTimer(1, motionTimerFn, NULL, &motion.timer))
+  {
+    DEBUG_ERROR("Failed to create the mouse motion timer");
+    LG_LOCK_FREE(motion.lock);
+    motion.init = false;
+    return false;
+  }
+
+  return true;
+}
+
+void core_stopMotionCoalesce(void)
+{
+  if (!motion.init)
+    return;
+
+  if (motion.timer)
+  {
+    lgTimerDestroy(motion.timer);
+    motion.timer = NULL;
+  }
+
+  LG_LOCK_FREE(motion.lock);
+  motion.init = false;
+}
+
+void core_beginMotionBatch(void)
+{
+  if (!motion.init || motion.batch)
+    return;
+
+  LG_LOCK(motion.lock);
+  motion.batch      = true;
+  motion.batchStart = microtime();
+  LG_UNLOCK(motion.lock);
+}
+
+void core_endMotionBatch(void)
+{
+  if (!motion.init || !motion.batch)
+    return;
+
+  LG_LOCK(motion.lock);
+  motion.batch = false;
+  if (!motion.timer)
+    // without coalescing the whole batch goes out now as a single message
+    motion.lastSend = 0;
+  flushMotion(microtime());
+  LG_UNLOCK(motion.lock);
+}
+
+void core_flushMotion(void)
+{
+  // buttons must not overtake the motion that came before them
+  if (!motion.init)
+    return;
+
+  LG_LOCK(motion.lock);
+  if (motion.x || motion.y)
+  {
+    motion.lastSend = 0;
+    flushMotion(microtime());
+  }
+  LG_UNLOCK(motion.lock);
+}
+
 void core_handleMouseGrabbed(double ex, double ey)
 {
   if (!core_inputEnabled())
     return;
 
   int x, y;
-  if (g_params.rawMouse && !g_cursor.sens)
+  if (!g_cursor.sens && (g_params.rawMouse || !g_params.mouseSmoothing))
   {
-    /* raw unscaled input are always round numbers */
-    x = floor(ex);
-    y = floor(ey);
+    /* 1:1 without smoothing, raw input is almost always whole so the
+     * remainder normally stays zero but is still carried for devices that
+     * report fractional motion */
+    ex += g_cursor.acc.x;
+    ey += g_cursor.acc.y;
+    x = (int)ex;
+    y = (int)ey;
+    g_cursor.acc.x = ex - x;
+    g_cursor.acc.y = ey - y;
   }
   else
   {
     /* apply sensitivity */
-    ex = (ex / 10.0) * (g_cursor.sens + 10);
-    ey = (ey / 10.0) * (g_cursor.sens + 10);
-    util_cursorToInt(ex, ey, &x, &y);
+    const double scale = (g_cursor.sens + 10) / 10.0;
+    util_cursorToInt(ex * scale, ey * scale, &x, &y);
   }
 
   if (x == 0 && y == 0)
     return;
 
-  if (!purespice_mouseMotion(x, y))
+  if (g_params.mouseCoalesce || motion.batch)
+  {
+    /* the fractional part stays in g_cursor.acc so only whole pixels are
+     * held back here */
+    LG_LOCK(motion.lock);
+    motion.x += x;
+    motion.y += y;
+
+    const uint64_t now = microtime();
+    if (!motion.batch)
+      flushMotion(now);
+    else if (now - motion.batchStart >= MOTION_BATCH_MAX_US)
+    {
+      // a display server that is never idle must still send regularly
+      if (!motion.timer)
+        motion.lastSend = 0;
+      flushMotion(now);
+      motion.batchStart = now;
+    }
+    LG_UNLOCK(motion.lock);
+  }
+  else if (!purespice_mouseMotion(x, y))
+  {
     DEBUG_ERROR("failed to send mouse motion message");
+    return;
+  }
+
+  if (g_params.predictCursor && g_cursor.guest.valid)
+  {
+    LG_LOCK(g_cursor.predictLock);
+    g_cursor.predict.x  += x;
+    g_cursor.predict.y  += y;
+    g_cursor.predictTime = microtime();
+    LG_UNLOCK(g_cursor.predictLock);
+
+    core_redrawCursor();
+  }
+}
+
+static int consumePrediction(int pending, int moved)
+{
+  // only motion in the predicted direction can have come from us
+  if (pending > 0 && moved > 0)
+    return moved >= pending ? 0 : pending - moved;
+
+  if (pending < 0 && moved < 0)
+    return moved <= pending ? 0 : pending - moved;
+
+  return pending;
+}
+
+void core_reconcileCursor(int dx, int dy)
+{
+  if (!g_params.predictCursor)
+    return;
+
+  LG_LOCK(g_cursor.predictLock);
+  g_cursor.predict.x = consumePrediction(g_cursor.predict.x, dx);
+  g_cursor.predict.y = consumePrediction(g_cursor.predict.y, dy);
+  LG_UNLOCK(g_cursor.predictLock);
+}
+
+/* reads the seqlock protected position the host rewrites at input rate,
+ * giving up rather than spinning if the host stalls mid update */
+bool core_getLiveCursorPos(int * x, int * y, uint32_t * seq)
+{
+  const KVMFRCursorLive * live = atomic_load(&g_state.cursorLive);
+  if (!live)
+    return false;
+
+  for (int i = 0; i < 4; ++i)
+  {
+    const uint32_t start = live->seq;
+    atomic_thread_fence(memory_order_acquire);
+    const int lx = live->x;
+    const int ly = live->y;
+    atomic_thread_fence(memory_order_acquire);
+
+    if (start == 0)
+      return false;
+
+    if (!(start & 1) && start == live->seq)
+    {
+      *x   = lx;
+      *y   = ly;
+      *seq = start;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void core_getCursorDrawPos(int * x, int * y)
+{
+  *x = g_cursor.guest.x;
+  *y = g_cursor.guest.y;
+
+  /* the prediction is reconciled against the queued positions, so only draw
+   * the live position when it is not in use */
+  if (!g_params.predictCursor || !g_cursor.grab)
+  {
+    uint32_t seq;
+    if (g_cursor.guest.valid)
+      core_getLiveCursorPos(x, y, &seq);
+    return;
+  }
+
+  LG_LOCK(g_cursor.predictLock);
+  if (microtime() - g_cursor.predictTime > PREDICT_TIMEOUT)
+    g_cursor.predict = (struct Point){ 0 };
+
+  *x += g_cursor.predict.x;
+  *y += g_cursor.predict.y;
+  LG_UNLOCK(g_cursor.predictLock);
+
+  *x = clamp(*x, 0, g_state.srcSize.x - 1);
+  *y = clamp(*y, 0, g_state.srcSize.y - 1);
 }
 
 void core_handleMouseNormal(double ex, double ey)
@@ -527,7 +792,7 @@ void core_handleMouseNormal(double ex, double ey)
         g_cursor.guest.y    = msg.y;
         g_cursor.realign    = false;
         g_cursor.realigning = false;
-        g_cursor.redraw     = true;
+        core_redrawCursor();
 
         if (!g_cursor.inWindow)
           return;
@@ -33,12 +33,22 @@ void core_updatePositionInfo(void);
 void core_alignToGuest(void);
 bool core_isValidPointerPos(int x, int y);
 bool core_startCursorThread(void);
+/* flags the cursor to be drawn again and wakes the cursor thread to do it */
+void core_redrawCursor(void);
 void core_stopCursorThread(void);
 bool core_startFrameThread(void);
 void core_stopFrameThread(void);
 void core_handleGuestMouseUpdate(void);
+bool core_startMotionCoalesce(void);
+void core_stopMotionCoalesce(void);
+void core_beginMotionBatch(void);
+void core_endMotionBatch(void);
+void core_flushMotion(void);
 void core_handleMouseGrabbed(double ex, double ey);
 void core_handleMouseNormal(double ex, double ey);
+void core_reconcileCursor(int dx, int dy);
+bool core_getLiveCursorPos(int * x, int * y, uint32_t * seq);
+void core_getCursorDrawPos(int * x, int * y);
 void core_resetOverlayInputState(void);
 void core_updateOverlayState(void);
 
@@ -42,10 +42,35 @@ void egl_dynProcsInit(void)
     eglGetProcAddress("glDebugMessageCallbackKHR");
   g_egl_dynProcs.glBufferStorageEXT = (PFNGLBUFFERSTORAGEEXTPROC)
     eglGetProcAddress("glBufferStorageEXT");
+  g_egl_dynProcs.glDispatchCompute = (PFNGLDISPATCHCOMPUTEPROC)
+    eglGetProcAddress("glDispatchCompute");
+  g_egl_dynProcs.glBindImageTexture = (PFNGLBINDIMAGETEXTUREPROC)
+    eglGetProcAddress("glBindImageTexture");
+  g_egl_dynProcs.glMemoryBarrier = (PFNGLMEMORYBARRIERPROC)
+    eglGetProcAddress("glMemoryBarrier");
+  g_egl_dynProcs.glCopyImageSubData = (PFNGLCOPYIMAGESUBDATAEXTPROC)
+    eglGetProcAddress("glCopyImageSubData");
+  g_egl_dynProcs.glMaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)
+    eglGetProcAddress("glMaxShaderCompilerThreadsKHR");
+  g_egl_dynProcs.glQueryCounterEXT = (PFNGLQUERYCOUNTEREXTPROC)
+    eglGetProcAddress("glQueryCounterEXT");
+  g_egl_dynProcs.glGetQueryObjectui64vEXT = (PFNGLGETQUERYOBJECTUI64VEXTPROC)
+    eglGetProcAddress("glGetQueryObjectui64vEXT");
   g_egl_dynProcs.eglCreateImage = (PFNEGLCREATEIMAGEPROC)
     eglGetProcAddress("eglCreateImage");
   g_egl_dynProcs.eglDestroyImage = (PFNEGLDESTROYIMAGEPROC)
     eglGetProcAddress("eglDestroyImage");
+  g_egl_dynProcs.eglExportDMABUFImageQueryMESA =
+    (PFNEGLEXPORTDMABUFIMAGEQUERYMESAPROC)
+    eglGetProcAddress("eglExportDMABUFImageQueryMESA");
+  g_egl_dynProcs.eglExportDMABUFImageMESA = (PFNEGLEXPORTDMABUFIMAGEMESAPROC)
+    eglGetProcAddress("eglExportDMABUFImageMESA");
+  g_egl_dynProcs.eglCreateSyncKHR = (PFNEGLCREATESYNCKHRPROC)
+    eglGetProcAddress("eglCreateSyncKHR");
+  g_egl_dynProcs.eglDestroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC)
+    eglGetProcAddress("eglDestroySyncKHR");
+  g_egl_dynProcs.eglClientWaitSyncKHR = (PFNEGLCLIENTWAITSYNCKHRPROC)
+    eglGetProcAddress("eglClientWaitSyncKHR");
 
   if (!g_egl_dynProcs.eglCreateImage)
     g_egl_dynProcs.eglCreateImage = (PFNEGLCREATEIMAGEPROC)
@@ -53,6 +78,12 @@ void egl_dynProcsInit(void)
   if (!g_egl_dynProcs.eglDestroyImage)
     g_egl_dynProcs.eglDestroyImage = (PFNEGLDESTROYIMAGEPROC)
       eglGetProcAddress("eglDestroyImageKHR");
+  if (!g_egl_dynProcs.glCopyImageSubData)
+    g_egl_dynProcs.glCopyImageSubData = (PFNGLCOPYIMAGESUBDATAEXTPROC)
+      eglGetProcAddress("glCopyImageSubDataEXT");
+  if (!g_egl_dynProcs.glCopyImageSubData)
+    g_egl_dynProcs.glCopyImageSubData = (PFNGLCOPYIMAGESUBDATAEXTPROC)
+      eglGetProcAddress("glCopyImageSubDataOES");
 };
 
 #endif
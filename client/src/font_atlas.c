@@ -0,0 +1,261 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "font_atlas.h"
+#include "main.h"
+
+#include "common/debug.h"
+#include "common/event.h"
+#include "common/locking.h"
+#include "common/thread.h"
+#include "common/time.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+#define FONT_ATLAS_CACHE 4
+
+struct FontAtlasEntry
+{
+  float         scale;
+  ImFontAtlas * atlas;
+  ImFont      * fontLarge;
+  uint64_t      lastUsed;
+};
+
+struct FontAtlasState
+{
+  const char    * fontName;
+  float           size;
+  const ImWchar * ranges;
+
+  // the context's own atlas, put back before the context is destroyed
+  ImFontAtlas   * original;
+
+  LGThread      * thread;
+  LGEvent       * event;
+  atomic_bool     running;
+
+  // protects the cache and the pending request
+  LG_Lock               lock;
+  struct FontAtlasEntry cache[FONT_ATLAS_CACHE];
+  float                 pending;
+  uint64_t              useCount;
+
+  // render thread only
+  struct FontAtlasEntry * active;
+};
+
+static struct FontAtlasState fa = { 0 };
+
+static bool buildAtlas(float scale, struct FontAtlasEntry * entry)
+{
+  ImFontAtlas * atlas = ImFontAtlas_ImFontAtlas();
+  ImFontAtlas_AddFontFromFileTTF(atlas, fa.fontName,
+    fa.size * scale, NULL, fa.ranges);
+  ImFont * fontLarge = ImFontAtlas_AddFontFromFileTTF(atlas, fa.fontName,
+    1.3f * fa.size * scale, NULL, fa.ranges);
+
+  if (!ImFontAtlas_Build(atlas))
+  {
+    ImFontAtlas_destroy(atlas);
+    return false;
+  }
+
+  entry->scale     = scale;
+  entry->atlas     = atlas;
+  entry->fontLarge = fontLarge;
+  return true;
+}
+
+static struct FontAtlasEntry * findEntry(float scale)
+{
+  for (int i = 0; i < FONT_ATLAS_CACHE; ++i)
+    if (fa.cache[i].atlas && fa.cache[i].scale == scale)
+      return &fa.cache[i];
+  return NULL;
+}
+
+/* called with the lock held, the atlas in use is never evicted */
+static struct FontAtlasEntry * insertEntry(const struct FontAtlasEntry * entry)
+{
+  struct FontAtlasEntry * slot = NULL;
+  for (int i = 0; i < FONT_ATLAS_CACHE; ++i)
+  {
+    struct FontAtlasEntry * e = &fa.cache[i];
+    if (!e->atlas)
+    {
+      slot = e;
+      break;
+    }
+
+    if (e != fa.active && (!slot || e->lastUsed < slot->lastUsed))
+      slot = e;
+  }
+
+  if (slot->atlas)
+    ImFontAtlas_destroy(slot->atlas);
+
+  *slot = *entry;
+  slot->lastUsed = ++fa.useCount;
+  return slot;
+}
+
+static int fontAtlasThread(void * opaque)
+{
+  while (atomic_load(&fa.running))
+  {
+    if (!lgWaitEvent(fa.event, TIMEOUT_INFINITE))
+      break;
+
+    float scale;
+    LG_LOCK(fa.lock);
+    scale      = fa.pending;
+    fa.pending = 0.0f;
+    const bool cached = scale == 0.0f || findEntry(scale);
+    LG_UNLOCK(fa.lock);
+
+    if (cached)
+      continue;
+
+    // the atlas is private to this thread until it is in the cache
+    const uint64_t start = microtime();
+    struct FontAtlasEntry entry;
+    if (!buildAtlas(scale, &entry))
+      DEBUG_FATAL("Failed to build font atlas: %s", fa.fontName);
+
+    INTERLOCKED_SECTION(fa.lock, {
+      insertEntry(&entry);
+    });
+
+    DEBUG_INFO("Built the font atlas for scale %.2f in %.2fms", scale,
+        (microtime() - start) / 1000.0);
+
+    // have the render thread pick it up
+    atomic_fetch_add(&g_state.lgrResize, 1);
+  }
+
+  return 0;
+}
+
+bool fontAtlas_init(const char * fontName, float size, const ImWchar * ranges)
+{
+  fa.fontName = fontName;
+  fa.size     = size;
+  fa.ranges   = ranges;
+  fa.original = g_state.io->Fonts;
+  fa.active   = NULL;
+  memset(fa.cache, 0, sizeof(fa.cache));
+  LG_LOCK_INIT(fa.lock);
+
+  fa.event = lgCreateEvent(true, 0);
+  if (!fa.event)
+  {
+    DEBUG_ERROR("Failed to create the font atlas event");
+    return false;
+  }
+
+  atomic_store(&fa.running, true);
+  if (!lgCreateThread("fontAtlasThread", fontAtlasThread, NULL, &fa.thread))
+  {
+    DEBUG_ERROR("Failed to create the font atlas thread");
+    atomic_store(&fa.running, false);
+    lgFreeEvent(fa.event);
+    fa.event = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+void fontAtlas_free(void)
+{
+  if (fa.thread)
+  {
+    atomic_store(&fa.running, false);
+    lgSignalEvent(fa.event);
+    lgJoinThread(fa.thread, NULL);
+    fa.thread = NULL;
+  }
+
+  if (fa.event)
+  {
+    lgFreeEvent(fa.event);
+    fa.event = NULL;
+  }
+
+  // the context frees io->Fonts if it allocated it, and only that atlas
+  if (fa.original)
+    g_state.io->Fonts = fa.original;
+  fa.original = NULL;
+
+  for (int i = 0; i < FONT_ATLAS_CACHE; ++i)
+    if (fa.cache[i].atlas)
+      ImFontAtlas_destroy(fa.cache[i].atlas);
+  memset(fa.cache, 0, sizeof(fa.cache));
+  fa.active = NULL;
+
+  LG_LOCK_FREE(fa.lock);
+}
+
+static float useEntry(struct FontAtlasEntry * entry)
+{
+  if (entry != fa.active)
+  {
+    fa.active          = entry;
+    g_state.io->Fonts  = entry->atlas;
+    g_state.fontLarge  = entry->fontLarge;
+  }
+  return entry->scale;
+}
+
+float fontAtlas_select(float scale)
+{
+  struct FontAtlasEntry * entry;
+
+  LG_LOCK(fa.lock);
+  entry = findEntry(scale);
+  if (entry)
+  {
+    entry->lastUsed = ++fa.useCount;
+    const float ret = useEntry(entry);
+    LG_UNLOCK(fa.lock);
+    return ret;
+  }
+
+  /* nothing to draw with yet, this only happens for the first window size so
+   * build it here */
+  if (!fa.active || !fa.thread)
+  {
+    struct FontAtlasEntry build;
+    if (!buildAtlas(scale, &build))
+      DEBUG_FATAL("Failed to build font atlas: %s", fa.fontName);
+
+    const float ret = useEntry(insertEntry(&build));
+    LG_UNLOCK(fa.lock);
+    return ret;
+  }
+
+  fa.pending = scale;
+  LG_UNLOCK(fa.lock);
+
+  lgSignalEvent(fa.event);
+  return fa.active->scale;
+}
@@ -0,0 +1,40 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_FONT_ATLAS_
+#define _H_LG_FONT_ATLAS_
+
+#include <stdbool.h>
+
+#include "cimgui.h"
+
+/* The UI font atlases are rasterised for the window scale. Building one takes
+ * long enough to hitch the render thread, so atlases are built by a worker and
+ * kept per scale. The previous atlas stays in use until the new one is ready. */
+bool fontAtlas_init(const char * fontName, float size, const ImWchar * ranges);
+void fontAtlas_free(void);
+
+/* Render thread only, and must be called between frames. The atlas for the
+ * scale is put in io->Fonts if one is cached. Otherwise it is queued, and
+ * lgrResize is raised when the build is ready so that this is called again.
+ * Returns the scale of the atlas now in use. */
+float fontAtlas_select(float scale);
+
+#endif
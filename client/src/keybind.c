@@ -25,6 +25,9 @@
 #include "audio.h"
 #include "core.h"
 #include "kb.h"
+#include "power.h"
+
+#include "common/fbprofile.h"
 
 #include <purespice.h>
 #include <stdio.h>
@@ -39,6 +42,11 @@ static void bind_video(int sc, void * opaque)
   app_stopVideo(!g_state.stopVideo);
 }
 
+static void bind_power(int sc, void * opaque)
+{
+  power_cycleProfile();
+}
+
 static void bind_rotate(int sc, void * opaque)
 {
   if (g_params.winRotate == LG_ROTATE_MAX-1)
@@ -125,6 +133,12 @@ static void bind_toggleKey(int sc, void * opaque)
   purespice_keyUp((uintptr_t) opaque);
 }
 
+static void bind_fbProfile(int sc, void * opaque)
+{
+  fbprofile_log();
+  app_alert(LG_ALERT_INFO, "Frame buffer profile logged");
+}
+
 void keybind_commonRegister(void)
 {
   app_registerKeybind(0, 'F', bind_fullscreen   , NULL,
@@ -133,10 +147,16 @@ void keybind_commonRegister(void)
       "Video stream toggle");
   app_registerKeybind(0, 'R', bind_rotate       , NULL,
       "Rotate the output clockwise by 90° increments");
+  app_registerKeybind(0, 'B', bind_power        , NULL,
+      "Cycle the power profile");
   app_registerKeybind(0, 'Q', bind_quit         , NULL,
       "Quit");
   app_registerKeybind(0, 'O', bind_toggleOverlay, NULL,
       "Toggle overlay");
+
+  if (g_params.fbProfile)
+    app_registerKeybind(0, 'P', bind_fbProfile  , NULL,
+        "Log the frame buffer copy profile");
 }
 
 #if ENABLE_AUDIO
@@ -187,6 +207,10 @@ void keybind_spiceRegister(void)
         "Send RWin to the guest");
 
 #if ENABLE_AUDIO
+    if (audio_supportsPlayback())
+      app_registerKeybind(0, 'A', audio_dumpMetricsKeybind, NULL,
+          "Dump audio metrics");
+
     if (audio_supportsRecord())
     {
       app_registerKeybind(0, 'E', audio_recordToggleKeybind, NULL,
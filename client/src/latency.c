@@ -0,0 +1,312 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "latency.h"
+#include "app.h"
+
+#include "common/debug.h"
+#include "common/locking.h"
+#include "common/ringbuffer.h"
+#include "common/time.h"
+#include "common/util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <math.h>
+
+#define LATENCY_SLOTS 16
+
+/* the host and client clocks are unrelated so each side is stored relative to
+ * its own first timestamp, the host capture start and the client receive */
+struct FrameTimeline
+{
+  bool     valid;
+  uint32_t serial;
+
+  // host microtime() the capture started, and offsets from it in microseconds
+  uint64_t capture;
+  uint32_t copy;
+  uint32_t map;
+  uint32_t post;
+  uint32_t write;
+
+  // client microtime() stamps
+  uint64_t received;
+  uint64_t uploaded;
+  uint64_t rendered;
+  uint64_t presented;
+};
+
+struct LatencyState
+{
+  LG_Lock              lock;
+  struct FrameTimeline frames[LATENCY_SLOTS];
+  FILE               * log;
+
+  RingBuffer  hostTimings;
+  RingBuffer  clientTimings;
+  GraphHandle hostGraph;
+  GraphHandle clientGraph;
+
+  // the host's own counters, one sample per KVMFRHostStats period
+  KVMFRHostStats hostStats;
+  RingBuffer     hostRate;
+  RingBuffer     hostWrite;
+  GraphHandle    hostRateGraph;
+  GraphHandle    hostWriteGraph;
+
+  atomic_uint uploadedSerial;
+  atomic_uint renderSerial;
+
+  /* smoothed video latency for audio sync, the offset is the client present
+   * time minus the host capture time and so includes the clock difference */
+  _Atomic(int64_t) videoOffset;
+  atomic_uint      videoUs;
+};
+
+// the weight of a new sample in the smoothed video latency
+#define LATENCY_SMOOTHING (1.0 / 16.0)
+
+static struct LatencyState l = { 0 };
+
+static inline struct FrameTimeline * getFrame(uint32_t serial)
+{
+  struct FrameTimeline * f = &l.frames[serial % LATENCY_SLOTS];
+  return f->valid && f->serial == serial ? f : NULL;
+}
+
+static void flushFrame(struct FrameTimeline * f)
+{
+  f->valid = false;
+
+  // frames that were never drawn were superseded, there is nothing to report
+  if (!f->rendered)
+    return;
+
+  const uint64_t end  = f->presented ? f->presented : f->rendered;
+  const uint32_t host = f->write ? f->write : f->post;
+  ringbuffer_push(l.hostTimings  , &(float){ host * 1e-3f });
+  ringbuffer_push(l.clientTimings, &(float){ (end - f->received) * 1e-3f });
+
+  const int64_t offset    = (int64_t)(end - f->capture);
+  const int64_t oldOffset = atomic_load(&l.videoOffset);
+  atomic_store(&l.videoOffset, oldOffset == INT64_MIN ? offset :
+      oldOffset + llrint((offset - oldOffset) * LATENCY_SMOOTHING));
+
+  const unsigned int total    = host + (end - f->received);
+  const unsigned int oldTotal = atomic_load(&l.videoUs);
+  atomic_store(&l.videoUs, oldTotal == 0 ? total :
+      oldTotal + lrint(((double)total - oldTotal) * LATENCY_SMOOTHING));
+
+  if (!l.log)
+    return;
+
+  fprintf(l.log, "%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32
+      ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+      f->serial, f->copy, f->map, f->post, f->write,
+      f->uploaded - f->received,
+      f->rendered - f->received,
+      f->presented ? f->presented - f->received : 0);
+}
+
+static const char * hostRateFormatFn(const char * name,
+    float min, float max, float avg, float freq, float last)
+{
+  LG_LOCK(l.lock);
+  const KVMFRHostStats stats = l.hostStats;
+  LG_UNLOCK(l.lock);
+
+  static char title[80];
+  snprintf(title, sizeof(title),
+      "%s: min:%3.0f max:%3.0f now:%3.0f damage:%3u%% waits:%u",
+      name, min, max, last, (unsigned)stats.damage,
+      (unsigned)stats.queueWaits);
+  return title;
+}
+
+static const char * hostWriteFormatFn(const char * name,
+    float min, float max, float avg, float freq, float last)
+{
+  LG_LOCK(l.lock);
+  const KVMFRHostStats stats = l.hostStats;
+  LG_UNLOCK(l.lock);
+
+  static char title[80];
+  snprintf(title, sizeof(title),
+      "%s: min:%4.2f max:%4.2f now:%4.2f gpu:%4.2f",
+      name, min, max, last, stats.gpuCopyUs * 1e-3f);
+  return title;
+}
+
+bool latency_init(const char * logFile)
+{
+  LG_LOCK_INIT(l.lock);
+  atomic_init(&l.videoOffset, INT64_MIN);
+  atomic_init(&l.videoUs, 0);
+  l.hostTimings   = ringbuffer_new(256, sizeof(float));
+  l.clientTimings = ringbuffer_new(256, sizeof(float));
+  l.hostGraph     = app_registerGraph("HOST"   , l.hostTimings  ,
+      0.0f, 50.0f, NULL);
+  l.clientGraph   = app_registerGraph("LATENCY", l.clientTimings,
+      0.0f, 50.0f, NULL);
+  l.hostRate       = ringbuffer_new(60, sizeof(float));
+  l.hostWrite      = ringbuffer_new(60, sizeof(float));
+  l.hostRateGraph  = app_registerGraph("HOST UPS", l.hostRate,
+      0.0f, 240.0f, hostRateFormatFn);
+  l.hostWriteGraph = app_registerGraph("HOST COPY", l.hostWrite,
+      0.0f, 20.0f, hostWriteFormatFn);
+
+  if (!logFile)
+    return true;
+
+  l.log = fopen(logFile, "w");
+  if (!l.log)
+  {
+    DEBUG_ERROR("Failed to open the latency log %s: %s", logFile,
+        strerror(errno));
+    return false;
+  }
+
+  fputs("serial,host_copy_us,host_map_us,host_post_us,host_write_us,"
+      "upload_us,render_us,present_us\n", l.log);
+  DEBUG_INFO("Logging frame latency to: %s", logFile);
+  return true;
+}
+
+void latency_free(void)
+{
+  LG_LOCK(l.lock);
+  for(int i = 0; i < LATENCY_SLOTS; ++i)
+    if (l.frames[i].valid)
+      flushFrame(&l.frames[i]);
+
+  if (l.log)
+  {
+    fclose(l.log);
+    l.log = NULL;
+  }
+  LG_UNLOCK(l.lock);
+
+  app_unregisterGraph(l.hostGraph  );
+  app_unregisterGraph(l.clientGraph);
+  ringbuffer_free(&l.hostTimings  );
+  ringbuffer_free(&l.clientTimings);
+  app_unregisterGraph(l.hostRateGraph );
+  app_unregisterGraph(l.hostWriteGraph);
+  ringbuffer_free(&l.hostRate );
+  ringbuffer_free(&l.hostWrite);
+  LG_LOCK_FREE(l.lock);
+}
+
+void latency_frameReceived(const KVMFRFrame * frame)
+{
+  const uint64_t now = microtime();
+
+  LG_LOCK(l.lock);
+  struct FrameTimeline * f = &l.frames[frame->frameSerial % LATENCY_SLOTS];
+  if (f->valid)
+    flushFrame(f);
+
+  *f = (struct FrameTimeline)
+  {
+    .valid    = true,
+    .serial   = frame->frameSerial,
+    .capture  = frame->captureTime,
+    .copy     = frame->copyTime,
+    .map      = frame->mapTime,
+    .post     = frame->postTime,
+    .received = now
+  };
+
+  const bool newStats = frame->stats.period != l.hostStats.period;
+  if (newStats)
+    l.hostStats = frame->stats;
+  LG_UNLOCK(l.lock);
+
+  if (newStats)
+  {
+    ringbuffer_push(l.hostRate , &(float){ frame->stats.captureRate });
+    ringbuffer_push(l.hostWrite, &(float){ frame->stats.writeUs * 1e-3f });
+  }
+}
+
+void latency_frameUploaded(const KVMFRFrame * frame)
+{
+  const uint64_t now = microtime();
+
+  LG_LOCK(l.lock);
+  struct FrameTimeline * f = getFrame(frame->frameSerial);
+  if (f)
+  {
+    // the host stamps this once it has finished writing the frame buffer
+    f->write    = frame->writeTime;
+    f->uploaded = now;
+  }
+  LG_UNLOCK(l.lock);
+
+  atomic_store(&l.uploadedSerial, frame->frameSerial);
+}
+
+void latency_beginRender(void)
+{
+  atomic_store(&l.renderSerial, atomic_load(&l.uploadedSerial));
+}
+
+void latency_frameRendered(void)
+{
+  const uint64_t now = microtime();
+
+  LG_LOCK(l.lock);
+  struct FrameTimeline * f = getFrame(atomic_load(&l.renderSerial));
+  if (f && !f->rendered)
+    f->rendered = now;
+  LG_UNLOCK(l.lock);
+}
+
+uint32_t latency_renderSerial(void)
+{
+  return atomic_load(&l.renderSerial);
+}
+
+void latency_framePresented(uint32_t serial, uint64_t presentUs)
+{
+  LG_LOCK(l.lock);
+  struct FrameTimeline * f = getFrame(serial);
+  if (f && f->rendered && !f->presented)
+  {
+    f->presented = max(presentUs, f->rendered);
+    flushFrame(f);
+  }
+  LG_UNLOCK(l.lock);
+}
+
+bool latency_videoOffset(int64_t * offsetUs)
+{
+  *offsetUs = atomic_load(&l.videoOffset);
+  return *offsetUs != INT64_MIN;
+}
+
+unsigned int latency_videoUs(void)
+{
+  return atomic_load(&l.videoUs);
+}
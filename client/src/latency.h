@@ -0,0 +1,45 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_LATENCY_
+#define _H_LG_LATENCY_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/KVMFR.h"
+
+bool latency_init(const char * logFile);
+void latency_free(void);
+
+void latency_frameReceived(const KVMFRFrame * frame);
+void latency_frameUploaded(const KVMFRFrame * frame);
+void latency_beginRender(void);
+void latency_frameRendered(void);
+uint32_t latency_renderSerial(void);
+void latency_framePresented(uint32_t serial, uint64_t presentUs);
+
+/* The smoothed time from the host capture to the frame being presented. The
+ * offset is in the client clock minus the host clock so it is only meaningful
+ * when compared against another host timestamp, such as an audio packet's. */
+bool latency_videoOffset(int64_t * offsetUs);
+unsigned int latency_videoUs(void);
+
+#endif
@@ -51,6 +51,10 @@
 #include "common/paths.h"
 #include "common/cpuinfo.h"
 #include "common/ll.h"
+#include "common/backoff.h"
+#include "common/fbprofile.h"
+#include "common/rects.h"
+#include "common/metrics.h"
 
 #include "core.h"
 #include "app.h"
@@ -63,7 +67,23 @@
 #include "overlays.h"
 #include "overlay_utils.h"
 #include "util.h"
+#include "font_atlas.h"
 #include "render_queue.h"
+#include "config_watch.h"
+#include "cadence.h"
+#include "latency.h"
+#include "recorder.h"
+#include "video_record.h"
+#include "sources.h"
+#include "power.h"
+
+// the longest to block on the doorbell before checking the queue anyway (ms)
+#define DOORBELL_TIMEOUT 100
+
+/* how long the last frame is kept up while the host restarts, and how often
+ * its session is polled for in that time */
+#define HOST_RESTART_GRACE_MS 3000
+#define HOST_RESTART_POLL_MS  50
 
 // forwards
 static int renderThread(void * unused);
@@ -72,6 +92,7 @@ static LGEvent  *e_startup = NULL;
 static LGEvent  *e_spice   = NULL;
 static LGThread *t_spice   = NULL;
 static LGThread *t_render  = NULL;
+static LGThread *t_audio   = NULL;
 
 struct AppState g_state = { 0 };
 struct CursorState g_cursor;
@@ -79,6 +100,51 @@ struct CursorState g_cursor;
 // this structure is initialized in config.c
 struct AppParams g_params = { 0 };
 
+#define STARTUP_MAX_PHASES 16
+
+/* wall time spent in each startup step, reported once the host session is up
+ * so it can be compared against the time to the first frame */
+static struct
+{
+  uint64_t start;
+  uint64_t last;
+  int      count;
+  bool     reported;
+  struct
+  {
+    const char * name;
+    uint64_t     us;
+  }
+  phase[STARTUP_MAX_PHASES];
+}
+g_startup = { 0 };
+
+static void startupPhase(const char * name)
+{
+  const uint64_t now = microtime();
+  if (g_startup.count < STARTUP_MAX_PHASES)
+  {
+    g_startup.phase[g_startup.count].name = name;
+    g_startup.phase[g_startup.count].us   = now - g_startup.last;
+    ++g_startup.count;
+  }
+  g_startup.last = now;
+}
+
+static void startupReport(void)
+{
+  if (g_startup.reported)
+    return;
+  g_startup.reported = true;
+
+  DEBUG_INFO("Startup timing:");
+  for (int i = 0; i < g_startup.count; ++i)
+    DEBUG_INFO("  %-16s: %8.2fms", g_startup.phase[i].name,
+        g_startup.phase[i].us / 1000.0);
+  DEBUG_INFO("  %-16s: %8.2fms", "Total",
+      (g_startup.last - g_startup.start) / 1000.0);
+}
+
 static void lgInit(void)
 {
   g_state.formatValid   = false;
@@ -104,40 +170,28 @@ static void lgInit(void)
 
 static bool fpsTimerFn(void * unused)
 {
-  static uint64_t last;
-  if (!last)
-  {
-    last = nanotime();
-    return true;
-  }
-
-  const uint64_t renderCount = atomic_exchange_explicit(&g_state.renderCount, 0,
-      memory_order_acquire);
+  static uint64_t last, lastRenderCount, lastFrameCount;
 
-  float fps, ups;
-  if (renderCount > 0)
-  {
-    const uint64_t frameCount = atomic_exchange_explicit(&g_state.frameCount, 0,
-        memory_order_acquire);
-
-    const uint64_t time      = nanotime();
-    const uint64_t elapsedNs = time - last;
-    const float    elapsedMs = (float)elapsedNs / 1e6f;
+  const uint64_t time        = nanotime();
+  const uint64_t renderCount = atomic_load_explicit(
+      &g_state.renderStats.renderCount, memory_order_relaxed);
+  const uint64_t frameCount  = atomic_load_explicit(
+      &g_state.frameStats.frameCount, memory_order_relaxed);
 
-    last = time;
-    fps  = 1e3f / (elapsedMs / (float)renderCount);
-    ups  = 1e3f / (elapsedMs / (float)frameCount);
-  }
-  else
+  if (last)
   {
-    last = nanotime();
-    fps  = 0.0f;
-    ups  = 0.0f;
+    const float elapsedNs = (float)(time - last);
+    atomic_store_explicit(&g_state.fps,
+        (renderCount - lastRenderCount) * 1e9f / elapsedNs,
+        memory_order_relaxed);
+    atomic_store_explicit(&g_state.ups,
+        (frameCount - lastFrameCount) * 1e9f / elapsedNs,
+        memory_order_relaxed);
   }
 
-  atomic_store_explicit(&g_state.fps, fps, memory_order_relaxed);
-  atomic_store_explicit(&g_state.ups, ups, memory_order_relaxed);
-
+  last            = time;
+  lastRenderCount = renderCount;
+  lastFrameCount  = frameCount;
   return true;
 }
 
@@ -147,13 +201,11 @@ static bool tickTimerFn(void * unused)
 
   bool needsRender = false;
   struct Overlay * overlay;
-  ll_lock(g_state.overlays);
-  ll_forEachNL(g_state.overlays, item, overlay)
+  vector_forEachRef(overlay, &g_state.overlays)
   {
     if (overlay->ops->tick && overlay->ops->tick(overlay->udata, tickCount))
       needsRender = true;
   }
-  ll_unlock(g_state.overlays);
 
   if (needsRender)
     app_invalidateWindow(false);
@@ -165,12 +217,48 @@ static bool tickTimerFn(void * unused)
 static void preSwapCallback(void * udata)
 {
   const uint64_t * renderStart = (const uint64_t *)udata;
-  ringbuffer_push(g_state.renderDuration,
-      &(float) {(nanotime() - *renderStart) * 1e-6f});
+  const uint64_t duration = nanotime() - *renderStart;
+  ringbuffer_push(g_state.renderDuration, &(float) {duration * 1e-6f});
+  stats_histogramRecord(g_state.renderDurationStats, duration / 1000);
+}
+
+static void updateRendererCursor(void)
+{
+  int x, y;
+  core_getCursorDrawPos(&x, &y);
+  RENDERER(onMouseEvent,
+    g_cursor.guest.visible && (g_cursor.draw || !g_params.useSpiceInput),
+    x,
+    y,
+    g_cursor.guest.hx,
+    g_cursor.guest.hy
+  );
+}
+
+/* move the cursor to the host's latest position right before rendering so the
+ * queued intermediate positions are never drawn */
+static void updateLiveCursor(void)
+{
+  static uint32_t lastSeq = 0;
+
+  int x, y;
+  uint32_t seq;
+  if (!g_cursor.guest.valid || !core_getLiveCursorPos(&x, &y, &seq) ||
+      seq == lastSeq)
+    return;
+
+  lastSeq = seq;
+  updateRendererCursor();
 }
 
 static int renderThread(void * unused)
 {
+  lgThreadSetPriority(LG_THREAD_PRIORITY_HIGH);
+
+  /* the fpsMin and VRR pacing below are timed waits, the default 50μs of slack
+   * shows up directly as frame time jitter */
+  lgSetTimerSlack(1000);
+
   if (!RENDERER(renderStartup, g_state.useDMA))
   {
     DEBUG_ERROR("EGL render failed to start");
@@ -201,7 +289,7 @@ static int renderThread(void * unused)
     return 1;
   }
 
-  LG_LOCK_INIT(g_state.lgrLock);
+  sources_start();
 
   /* signal to other threads that the renderer is ready */
   lgSignalEvent(e_startup);
@@ -233,6 +321,23 @@ static int renderThread(void * unused)
       if (pending > 0)
         atomic_fetch_sub(&g_state.pendingCount, 1);
     }
+    else if (g_state.vrr)
+    {
+      /* present as soon as a frame lands, the timeout repeats the last frame
+       * before the display drops below its refresh window */
+      lgWaitEventAbs(g_state.frameEvent, &time);
+      clock_gettime(CLOCK_MONOTONIC, &time);
+      tsAdd(&time, app_isOverlayMode() ?
+          g_state.overlayFrameTime : g_state.frameTime);
+
+      /* and never faster than just under the maximum refresh, at the top of
+       * the window the swap would block on vblank and add a frame of latency */
+      static uint64_t lastPresent = 0;
+      const uint64_t now = nanotime();
+      if (now - lastPresent < g_state.vrrFrameTime)
+        nsleep(g_state.vrrFrameTime - (now - lastPresent));
+      lastPresent = nanotime();
+    }
     else if (g_params.fpsMin != 0)
     {
       float ups = atomic_load_explicit(&g_state.ups, memory_order_relaxed);
@@ -246,6 +351,9 @@ static int renderThread(void * unused)
       }
     }
 
+    if (power_throttleRender())
+      continue;
+
     int resize = atomic_load(&g_state.lgrResize);
     if (resize)
     {
@@ -257,15 +365,11 @@ static int renderThread(void * unused)
         .x = g_state.windowScale,
         .y = g_state.windowScale,
       };
-      g_state.io->FontGlobalScale = 1.0f / g_state.windowScale;
 
-      ImFontAtlas_Clear(g_state.io->Fonts);
-      ImFontAtlas_AddFontFromFileTTF(g_state.io->Fonts, g_state.fontName,
-        g_params.uiSize * g_state.windowScale, NULL, g_state.fontRange.Data);
-      g_state.fontLarge = ImFontAtlas_AddFontFromFileTTF(g_state.io->Fonts,
-        g_state.fontName, 1.3f * g_params.uiSize * g_state.windowScale, NULL, g_state.fontRange.Data);
-      if (!ImFontAtlas_Build(g_state.io->Fonts))
-        DEBUG_FATAL("Failed to build font atlas: %s (%s)", g_params.uiFont, g_state.fontName);
+      /* until the atlas for this scale is built the last one is scaled to
+       * keep the text the same size */
+      g_state.io->FontGlobalScale =
+        1.0f / fontAtlas_select(g_state.windowScale);
 
       if (g_state.lgr)
         RENDERER(onResize, g_state.windowW, g_state.windowH,
@@ -275,37 +379,54 @@ static int renderThread(void * unused)
 
     static uint64_t lastFrameCount = 0;
     const uint64_t frameCount =
-      atomic_load_explicit(&g_state.frameCount, memory_order_relaxed);
+      atomic_load_explicit(&g_state.frameStats.frameCount,
+          memory_order_relaxed);
     const bool newFrame = frameCount != lastFrameCount;
     lastFrameCount = frameCount;
 
     const bool invalidate = atomic_exchange(&g_state.invalidateWindow, false);
 
+    if (newFrame)
+      latency_beginRender();
+
     const uint64_t renderStart = nanotime();
-    LG_LOCK(g_state.lgrLock);
 
     renderQueue_process();
+    updateLiveCursor();
 
+    /* a new format from the frame thread is picked up by the renderer at the
+     * start of the render, neither thread waits on the other */
     if (!RENDERER(render, g_params.winRotate, newFrame, invalidate,
           preSwapCallback, (void *)&renderStart))
-    {
-      LG_UNLOCK(g_state.lgrLock);
       break;
+
+    if (newFrame)
+    {
+      latency_frameRendered();
+
+      static bool firstFrame = true;
+      if (firstFrame)
+      {
+        DEBUG_INFO("First frame rendered %.2fms after startup",
+            (microtime() - g_startup.start) / 1000.0);
+        firstFrame = false;
+      }
     }
-    LG_UNLOCK(g_state.lgrLock);
 
     const uint64_t t     = nanotime();
-    const uint64_t delta = t - g_state.lastRenderTime;
+    const uint64_t delta = t - g_state.renderStats.lastRenderTime;
 
-    g_state.lastRenderTime = t;
-    atomic_fetch_add_explicit(&g_state.renderCount, 1, memory_order_relaxed);
+    g_state.renderStats.lastRenderTime = t;
+    atomic_fetch_add_explicit(&g_state.renderStats.renderCount, 1,
+        memory_order_relaxed);
 
-    if (g_state.lastRenderTimeValid)
+    if (g_state.renderStats.lastRenderTimeValid)
     {
       const float fdelta = (float)delta / 1e6f;
       ringbuffer_push(g_state.renderTimings, &fdelta);
+      stats_histogramRecord(g_state.renderTimingStats, delta / 1000);
     }
-    g_state.lastRenderTimeValid = true;
+    g_state.renderStats.lastRenderTimeValid = true;
 
     const uint64_t now = microtime();
     if (!g_state.resizeDone && g_state.resizeTimeout < now)
@@ -323,26 +444,81 @@ static int renderThread(void * unused)
 
   g_state.state = APP_STATE_SHUTDOWN;
 
-  if (g_state.overlays)
-  {
-    app_freeOverlays();
-    ll_free(g_state.overlays);
-    g_state.overlays = NULL;
-  }
-
+  // the tick timer walks the overlays so it must be stopped first
   lgTimerDestroy(tickTimer);
+  app_freeOverlays();
   lgTimerDestroy(fpsTimer);
 
   core_stopCursorThread();
   core_stopFrameThread();
+  sources_stop();
+
+  // the encoder waits on the renderer's fences so it must stop first
+  videoRecord_free();
 
   RENDERER(deinitialize);
   g_state.lgr = NULL;
-  LG_LOCK_FREE(g_state.lgrLock);
 
   return 0;
 }
 
+/* waits for the host to post to a queue, either by blocking on the ivshmem
+ * doorbell if the host rings it, or by sleeping for the poll interval */
+static void waitForUpdate(uint16_t vector, long pollInterval,
+    unsigned int timeout)
+{
+  if (g_state.useDoorbell)
+  {
+    if (ivshmemWaitDoorbell(&g_state.shm, vector, timeout) >= 0)
+      return;
+
+    DEBUG_WARN("Doorbell wait failed, falling back to polling");
+    g_state.useDoorbell = false;
+  }
+
+  struct timespec req =
+  {
+    .tv_sec  = 0,
+    .tv_nsec = pollInterval * 1000L
+  };
+
+  struct timespec rem;
+  while(nanosleep(&req, &rem) < 0)
+  {
+    if (errno != -EINTR)
+    {
+      DEBUG_ERROR("nanosleep failed");
+      break;
+    }
+    req = rem;
+  }
+}
+
+static void registerDoorbell(void)
+{
+  if (!(g_state.kvmfrFeatures & KVMFR_FEATURE_DOORBELL) ||
+      !ivshmemHasDoorbell(&g_state.shm))
+    return;
+
+  const KVMFRDoorbell msg =
+  {
+    .msg.type = KVMFR_MESSAGE_DOORBELL,
+    .peerID   = ivshmemGetPeerID(&g_state.shm)
+  };
+
+  uint32_t serial;
+  LGMP_STATUS status;
+  if ((status = lgmpClientSendData(g_state.pointerQueue,
+        &msg, sizeof(msg), &serial)) != LGMP_OK)
+  {
+    DEBUG_WARN("Doorbell registration failed: %s", lgmpStatusString(status));
+    return;
+  }
+
+  DEBUG_INFO("Using the IVSHMEM doorbell");
+  g_state.useDoorbell = true;
+}
+
 int main_cursorThread(void * unused)
 {
   LGMP_STATUS         status;
@@ -350,6 +526,7 @@ int main_cursorThread(void * unused)
   KVMFRCursor *       cursor     = NULL;
   int                 cursorSize = 0;
 
+  lgThreadSetPriority(LG_THREAD_PRIORITY_HIGH);
   lgWaitEvent(e_startup, TIMEOUT_INFINITE);
 
   // subscribe to the pointer queue
@@ -371,6 +548,9 @@ int main_cursorThread(void * unused)
     break;
   }
 
+  if (g_state.state == APP_STATE_RUNNING)
+    registerDoorbell();
+
   while(g_state.state == APP_STATE_RUNNING && !g_state.stopVideo)
   {
     LGMPMessage msg;
@@ -381,35 +561,15 @@ int main_cursorThread(void * unused)
         if (g_cursor.redraw && g_cursor.guest.valid)
         {
           g_cursor.redraw = false;
-          RENDERER(onMouseEvent,
-            g_cursor.guest.visible && (g_cursor.draw || !g_params.useSpiceInput),
-            g_cursor.guest.x,
-            g_cursor.guest.y,
-            g_cursor.guest.hx,
-            g_cursor.guest.hy
-          );
+          updateRendererCursor();
 
           if (!g_state.stopVideo)
             lgSignalEvent(g_state.frameEvent);
         }
 
-        struct timespec req =
-        {
-          .tv_sec  = 0,
-          .tv_nsec = g_params.cursorPollInterval * 1000L
-        };
-
-        struct timespec rem;
-        while(nanosleep(&req, &rem) < 0)
-        {
-          if (errno != -EINTR)
-          {
-            DEBUG_ERROR("nanosleep failed");
-            break;
-          }
-          req = rem;
-        }
-
+        // local redraw requests ring the doorbell too, see core_redrawCursor
+        waitForUpdate(KVMFR_DOORBELL_POINTER,
+            power_pollInterval(g_params.cursorPollInterval), DOORBELL_TIMEOUT);
         continue;
       }
 
@@ -423,9 +583,24 @@ int main_cursorThread(void * unused)
       break;
     }
 
+    if (msg.udata & CURSOR_FLAG_LIVE)
+    {
+      atomic_store(&g_state.cursorLive, (const KVMFRCursorLive *)msg.mem);
+      lgmpClientMessageDone(g_state.pointerQueue);
+      continue;
+    }
+
     KVMFRCursor * tmp = (KVMFRCursor *)msg.mem;
+
+    /* shapes the renderer still holds only need the header */
+    bool shapeCached = false;
+    if ((msg.udata & CURSOR_FLAG_SHAPE) && tmp->shapeID &&
+        g_state.lgr->ops.onMouseShapeCached)
+      shapeCached = RENDERER(onMouseShapeCached, tmp->shapeID);
+
     const int neededSize = sizeof(*tmp) +
-      (msg.udata & CURSOR_FLAG_SHAPE ? tmp->height * tmp->pitch : 0);
+      (msg.udata & CURSOR_FLAG_SHAPE && !shapeCached ?
+       tmp->height * tmp->pitch : 0);
 
     if (cursor && neededSize > cursorSize)
     {
@@ -448,6 +623,7 @@ int main_cursorThread(void * unused)
 
     memcpy(cursor, msg.mem, neededSize);
     lgmpClientMessageDone(g_state.pointerQueue);
+    recorder_cursor(msg.udata, cursor, neededSize - sizeof(*cursor));
 
     g_cursor.guest.visible =
       msg.udata & CURSOR_FLAG_VISIBLE;
@@ -468,12 +644,13 @@ int main_cursorThread(void * unused)
       g_cursor.guest.hy = cursor->hy;
 
       const uint8_t * data = (const uint8_t *)(cursor + 1);
-      if (!RENDERER(onMouseShape,
+      if (!shapeCached && !RENDERER(onMouseShape,
         cursorType,
         cursor->width,
         cursor->height,
         cursor->pitch,
-        data)
+        data,
+        cursor->shapeID)
       )
       {
         DEBUG_ERROR("Failed to update mouse shape");
@@ -484,6 +661,11 @@ int main_cursorThread(void * unused)
     if (msg.udata & CURSOR_FLAG_POSITION)
     {
       bool valid = g_cursor.guest.valid;
+      if (valid)
+        core_reconcileCursor(
+          cursor->x - g_cursor.guest.x,
+          cursor->y - g_cursor.guest.y);
+
       g_cursor.guest.x     = cursor->x;
       g_cursor.guest.y     = cursor->y;
       g_cursor.guest.valid = true;
@@ -500,19 +682,14 @@ int main_cursorThread(void * unused)
     }
 
     g_cursor.redraw = false;
-
-    RENDERER(onMouseEvent,
-      g_cursor.guest.visible && (g_cursor.draw || !g_params.useSpiceInput),
-      g_cursor.guest.x,
-      g_cursor.guest.y,
-      g_cursor.guest.hx,
-      g_cursor.guest.hy
-    );
+    updateRendererCursor();
 
     if (g_params.mouseRedraw && g_cursor.guest.visible && !g_state.stopVideo)
       lgSignalEvent(g_state.frameEvent);
   }
 
+  atomic_store(&g_state.cursorLive, NULL);
+
   LG_LOCK(g_state.pointerQueueLock);
   lgmpClientUnsubscribe(&g_state.pointerQueue);
   LG_UNLOCK(g_state.pointerQueueLock);
@@ -526,6 +703,73 @@ int main_cursorThread(void * unused)
   return 0;
 }
 
+/* a client side copy of the newest frame so its slot can be handed back to
+ * the host before the renderer has taken the frame */
+struct FrameStaging
+{
+  KVMFRFrame  * frame;
+  FrameBuffer * fb;
+  size_t        size;
+  uint32_t      formatVer;
+  bool          valid;
+};
+
+static bool stageFrame(struct FrameStaging * staging, const KVMFRFrame * frame,
+    const FrameBuffer * fb, size_t dataSize, const LG_RendererFormat * format,
+    bool fullDamage)
+{
+  if (!staging->frame)
+  {
+    staging->frame = malloc(sizeof(*staging->frame));
+    if (!staging->frame)
+    {
+      DEBUG_ERROR("out of memory");
+      return false;
+    }
+  }
+
+  if (staging->size < dataSize)
+  {
+    free(staging->fb);
+    staging->fb    = malloc(sizeof(*staging->fb) + dataSize);
+    staging->size  = 0;
+    staging->valid = false;
+    if (!staging->fb)
+    {
+      DEBUG_ERROR("out of memory");
+      return false;
+    }
+    staging->size = dataSize;
+  }
+
+  if (staging->formatVer != frame->formatVer)
+    staging->valid = false;
+
+  /* the staged frame is the last one received so only the damage has to be
+   * copied, the rects are 32bpp and do not map onto the NV12 planes */
+  const bool partial = staging->valid && !fullDamage &&
+    frame->damageRectsCount > 0 && format->bpp == 32 &&
+    format->type != FRAME_TYPE_NV12;
+
+  memcpy(staging->frame, frame, sizeof(*staging->frame));
+  if (partial)
+    rectsFramebufferToBuffer(staging->frame->damageRects,
+        staging->frame->damageRectsCount, framebuffer_get_data(staging->fb),
+        format->pitch, format->frameHeight, fb, format->pitch);
+  else if (!framebuffer_read(fb, framebuffer_get_data(staging->fb),
+        format->pitch, dataSize / format->pitch, format->pitch / 4, 32,
+        format->pitch))
+  {
+    staging->valid = false;
+    return false;
+  }
+
+  framebuffer_set_write_ptr(staging->fb, dataSize);
+  staging->formatVer = frame->formatVer;
+  staging->valid     = true;
+  return true;
+}
+
 int main_frameThread(void * unused)
 {
   struct DMAFrameInfo
@@ -541,12 +785,25 @@ int main_frameThread(void * unused)
   uint32_t          frameSerial = 0;
   uint32_t          formatVer   = 0;
   size_t            dataSize    = 0;
-  LG_RendererFormat lgrFormat;
+  LG_RendererFormat lgrFormat   = { 0 };
 
-  struct DMAFrameInfo dmaInfo[LGMP_Q_FRAME_LEN] = {0};
+  // the format from before a host restart, to tell if the window must change
+  static LG_RendererFormat lastFormat = { 0 };
+
+  /* the newest frame passed over while the window was hidden, it stays intact
+   * in its slot until the host has posted a queue's worth of newer frames */
+  LGMPMessage skipped    = { 0 };
+  bool        skippedAny = false;
+
+  struct DMAFrameInfo dmaInfo[LGMP_Q_FRAME_LEN_MAX] = {0};
   if (g_state.useDMA)
     DEBUG_INFO("Using DMA buffer support");
 
+  // the DMA path imports the slot itself so it must stay held
+  struct FrameStaging staging = { 0 };
+  const bool earlyRelease = g_params.earlyRelease && !g_state.useDMA;
+
+  lgThreadSetPriority(LG_THREAD_PRIORITY_HIGH);
   lgWaitEvent(e_startup, TIMEOUT_INFINITE);
   if (g_state.state != APP_STATE_RUNNING)
     return 0;
@@ -571,30 +828,46 @@ int main_frameThread(void * unused)
 
   g_state.ds->requestActivation();
 
+  // a recording needs every frame so it is never passed over
+  const bool recording = g_params.recordFile && *g_params.recordFile;
+  const bool latestFrame = g_params.latestFrame && !recording;
+
+  // the host may have restarted with another clock
+  cadence_reset();
+
   while(g_state.state == APP_STATE_RUNNING && !g_state.stopVideo)
   {
     LGMPMessage msg;
-    if ((status = lgmpClientProcess(queue, &msg)) != LGMP_OK)
+
+    /* go straight to the newest frame, those passed over are released to the
+     * host without being read */
+    if (latestFrame)
     {
-      if (status == LGMP_ERR_QUEUE_EMPTY)
+      status = lgmpClientAdvanceToLast(queue);
+      if (status != LGMP_OK && status != LGMP_ERR_QUEUE_EMPTY)
       {
-        struct timespec req =
-        {
-          .tv_sec  = 0,
-          .tv_nsec = g_params.framePollInterval * 1000L
-        };
-
-        struct timespec rem;
-        while(nanosleep(&req, &rem) < 0)
+        if (status == LGMP_ERR_INVALID_SESSION)
+          g_state.state = APP_STATE_RESTART;
+        else
         {
-          if (errno != -EINTR)
-          {
-            DEBUG_ERROR("nanosleep failed");
-            break;
-          }
-          req = rem;
+          DEBUG_ERROR("lgmpClientAdvanceToLast Failed: %s",
+              lgmpStatusString(status));
+          g_state.state = APP_STATE_SHUTDOWN;
         }
+        break;
+      }
+    }
 
+    // shown again with nothing newer from the host, show what was skipped
+    bool catchUp = false;
+    if ((status = lgmpClientProcess(queue, &msg)) != LGMP_OK &&
+        !(catchUp = status == LGMP_ERR_QUEUE_EMPTY && skipped.mem &&
+          !atomic_load(&g_state.hidden)))
+    {
+      if (status == LGMP_ERR_QUEUE_EMPTY)
+      {
+        waitForUpdate(KVMFR_DOORBELL_FRAME,
+            power_pollInterval(g_params.framePollInterval), DOORBELL_TIMEOUT);
         continue;
       }
 
@@ -608,20 +881,43 @@ int main_frameThread(void * unused)
       break;
     }
 
+    if (catchUp)
+    {
+      msg         = skipped;
+      skipped.mem = NULL;
+    }
+
     KVMFRFrame * frame = (KVMFRFrame *)msg.mem;
 
     // ignore any repeated frames, this happens when a new client connects to
     // the same host application.
-    if (frame->frameSerial == frameSerial && g_state.formatValid)
+    if (frame->frameSerial == frameSerial && g_state.formatValid && !catchUp)
     {
       lgmpClientMessageDone(queue);
       continue;
     }
+
+    /* the damage of the frames advanced over is gone with them, so the union
+     * of it with this frame's can only be had by uploading the lot */
+    const uint32_t gap = frame->frameSerial - frameSerial - 1;
+    if (latestFrame && g_state.formatValid && !catchUp &&
+        gap > 0 && gap < LGMP_Q_FRAME_LEN_MAX)
+    {
+      skippedAny = true;
+      atomic_fetch_add_explicit(&g_state.frameStats.droppedCount, gap,
+          memory_order_relaxed);
+    }
+
     frameSerial = frame->frameSerial;
+    latency_frameReceived(frame);
 
     struct DMAFrameInfo *dma = NULL;
 
-    if (!g_state.formatValid || frame->formatVer != formatVer)
+    const bool compressed = frame->flags & FRAME_FLAG_COMPRESSED;
+    const bool hostScaled = frame->flags & FRAME_FLAG_HOST_SCALED;
+    if (!g_state.formatValid || frame->formatVer != formatVer ||
+        compressed != lgrFormat.compressed ||
+        hostScaled != lgrFormat.hostScaled)
     {
       // setup the renderer format with the frame format details
       lgrFormat.type         = frame->type;
@@ -631,11 +927,14 @@ int main_frameThread(void * unused)
       lgrFormat.frameHeight  = frame->frameHeight;
       lgrFormat.stride       = frame->stride;
       lgrFormat.pitch        = frame->pitch;
+      lgrFormat.compressed   = compressed;
+      lgrFormat.hostScaled   = hostScaled;
 
       if (frame->flags & FRAME_FLAG_TRUNCATED)
       {
         const float needed =
-          ((frame->screenHeight * frame->pitch * 2) / 1048576.0f) + 10.0f;
+          ((frame->screenHeight * frame->pitch * g_state.frameQueueLen) /
+           1048576.0f) + 10.0f;
         const int   size   = (int)powf(2.0f, ceilf(logf(needed) / logf(2.0f)));
 
         DEBUG_BREAK();
@@ -670,6 +969,7 @@ int main_frameThread(void * unused)
         case FRAME_TYPE_RGBA:
         case FRAME_TYPE_BGRA:
         case FRAME_TYPE_RGBA10:
+        case FRAME_TYPE_RGBA10_PQ:
           dataSize       = lgrFormat.frameHeight * lgrFormat.pitch;
           lgrFormat.bpp  = 32;
           break;
@@ -679,6 +979,13 @@ int main_frameThread(void * unused)
           lgrFormat.bpp  = 64;
           break;
 
+        // carried as 32bpp texels of four luma or two chroma pairs
+        case FRAME_TYPE_NV12:
+          dataSize       = kvmfrFrameRows(frame->type, lgrFormat.frameHeight) *
+            lgrFormat.pitch;
+          lgrFormat.bpp  = 32;
+          break;
+
         default:
           DEBUG_ERROR("Unsupported frameType");
           error = true;
@@ -687,7 +994,8 @@ int main_frameThread(void * unused)
 
       if (error)
       {
-        lgmpClientMessageDone(queue);
+        if (!catchUp)
+          lgmpClientMessageDone(queue);
         g_state.state = APP_STATE_SHUTDOWN;
         break;
       }
@@ -695,32 +1003,71 @@ int main_frameThread(void * unused)
       g_state.formatValid = true;
       formatVer = frame->formatVer;
 
-      DEBUG_INFO("Format: %s %ux%u stride:%u pitch:%u rotation:%d",
+      DEBUG_INFO("Format: %s %ux%u stride:%u pitch:%u rotation:%d%s",
           FrameTypeStr[frame->type],
           frame->frameWidth, frame->frameHeight,
           frame->stride, frame->pitch,
-          frame->rotation);
+          frame->rotation,
+          compressed ? " (compressed)" : "");
 
-      LG_LOCK(g_state.lgrLock);
       if (!RENDERER(onFrameFormat, lgrFormat))
       {
         DEBUG_ERROR("renderer failed to configure format");
         g_state.state = APP_STATE_SHUTDOWN;
-        LG_UNLOCK(g_state.lgrLock);
         break;
       }
-      LG_UNLOCK(g_state.lgrLock);
+
+      const bool unchanged =
+        memcmp(&lastFormat, &lgrFormat, sizeof(lgrFormat)) == 0;
+      memcpy(&lastFormat, &lgrFormat, sizeof(lgrFormat));
 
       g_state.srcSize.x = lgrFormat.screenWidth;
       g_state.srcSize.y = lgrFormat.screenHeight;
       g_state.haveSrcSize = true;
-      if (g_params.autoResize)
+      if (g_params.autoResize && !unchanged)
         g_state.ds->setWindowSize(lgrFormat.frameWidth, lgrFormat.frameHeight);
 
       core_updatePositionInfo();
     }
 
-    if (g_state.useDMA)
+    // nothing is shown while hidden, pass over the frame without reading it
+    if (atomic_load(&g_state.hidden) && !catchUp && !recording)
+    {
+      skipped    = msg;
+      skippedAny = true;
+      lgmpClientMessageDone(queue);
+      continue;
+    }
+    skipped.mem = NULL;
+
+    FrameBuffer * fb = (FrameBuffer *)(((uint8_t*)frame) + frame->offset);
+
+    /* copy the frame out and give the slot back to the host before the
+     * renderer takes it, compressed frames are decoded straight from the slot
+     * as their size is not known until the host has finished writing them */
+    bool released = catchUp;
+    if (earlyRelease && !compressed)
+    {
+      const bool staged =
+        stageFrame(&staging, frame, fb, dataSize, &lgrFormat, skippedAny);
+
+      if (!catchUp)
+        lgmpClientMessageDone(queue);
+      released = true;
+
+      if (!staged)
+      {
+        DEBUG_ERROR("Failed to copy the frame from the host");
+        g_state.state = APP_STATE_SHUTDOWN;
+        break;
+      }
+
+      frame = staging.frame;
+      fb    = staging.fb;
+    }
+
+    // compressed frames must be decoded by the CPU
+    if (g_state.useDMA && !compressed)
     {
       /* find the existing dma buffer if it exists */
       for(int i = 0; i < ARRAY_LENGTH(dmaInfo); ++i)
@@ -751,6 +1098,15 @@ int main_frameThread(void * unused)
           }
         }
 
+      if (!dma)
+      {
+        DEBUG_ERROR("More frame buffers in use than the negotiated queue length");
+        if (!released)
+          lgmpClientMessageDone(queue);
+        g_state.state = APP_STATE_SHUTDOWN;
+        break;
+      }
+
       /* open the buffer */
       if (dma->fd == -1)
       {
@@ -768,16 +1124,38 @@ int main_frameThread(void * unused)
       }
     }
 
-    FrameBuffer * fb = (FrameBuffer *)(((uint8_t*)frame) + frame->offset);
-    if (!RENDERER(onFrame, fb, g_state.useDMA ? dma->fd : -1,
-          frame->damageRects, frame->damageRectsCount))
+    const FrameDamageMap damageMap =
     {
-      lgmpClientMessageDone(queue);
+      .width  = frame->damageMapWidth,
+      .height = frame->damageMapHeight,
+      .bits   = frame->damageMap
+    };
+    const bool hasDamageMap = (frame->flags & FRAME_FLAG_DAMAGE_MAP) &&
+      damageMap.width  == rectsDamageMapTiles(frame->frameWidth ) &&
+      damageMap.height == rectsDamageMapTiles(frame->frameHeight);
+
+    // hold the frame until its place in the guest's cadence
+    if (g_params.guestCadence && !catchUp)
+    {
+      const uint64_t due = cadence_schedule(frame->presentTime, microtime());
+      if (due)
+        lgSleepUntil(due);
+    }
+
+    // the damage of the frames passed over is not known, upload all of it
+    if (!RENDERER(onFrame, fb, dma ? dma->fd : -1,
+          frame->damageRects, skippedAny ? 0 : frame->damageRectsCount,
+          hasDamageMap && !skippedAny ? &damageMap : NULL))
+    {
+      if (!released)
+        lgmpClientMessageDone(queue);
       DEBUG_ERROR("renderer on frame returned failure");
       g_state.state = APP_STATE_SHUTDOWN;
       break;
     }
 
+    latency_frameUploaded(frame);
+    recorder_frame(frame, fb, dataSize);
     overlaySplash_show(false);
 
     if (frame->flags & FRAME_FLAG_REQUEST_ACTIVATION)
@@ -794,14 +1172,18 @@ int main_frameThread(void * unused)
     }
 
     const uint64_t t      = nanotime();
-    const uint64_t delta  = t - g_state.lastFrameTime;
-    g_state.lastFrameTime = t;
+    const uint64_t delta  = t - g_state.frameStats.lastFrameTime;
+    g_state.frameStats.lastFrameTime = t;
 
-    if (g_state.lastFrameTimeValid)
+    if (g_state.frameStats.lastFrameTimeValid)
+    {
       ringbuffer_push(g_state.uploadTimings, &(float) { delta * 1e-6f });
-    g_state.lastFrameTimeValid = true;
+      stats_histogramRecord(g_state.uploadTimingStats, delta / 1000);
+    }
+    g_state.frameStats.lastFrameTimeValid = true;
 
-    atomic_fetch_add_explicit(&g_state.frameCount, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_state.frameStats.frameCount, 1,
+        memory_order_relaxed);
     if (g_state.jitRender)
     {
       if (atomic_load_explicit(&g_state.pendingCount, memory_order_acquire) < 10)
@@ -811,7 +1193,9 @@ int main_frameThread(void * unused)
     else
       lgSignalEvent(g_state.frameEvent);
 
-    lgmpClientMessageDone(queue);
+    if (!released)
+      lgmpClientMessageDone(queue);
+    skippedAny = false;
 
     // switch over to the LG stream
     app_useSpiceDisplay(false);
@@ -821,7 +1205,9 @@ int main_frameThread(void * unused)
 
   RENDERER(onRestart);
 
-  if (g_state.state != APP_STATE_SHUTDOWN)
+  // on a host restart lg_run decides when to stop showing the last frame
+  if (g_state.state != APP_STATE_SHUTDOWN &&
+      g_state.state != APP_STATE_RESTART)
   {
     if (!app_useSpiceDisplay(true))
       overlaySplash_show(true);
@@ -834,6 +1220,8 @@ int main_frameThread(void * unused)
         close(dmaInfo[i].fd);
   }
 
+  free(staging.frame);
+  free(staging.fb);
   return 0;
 }
 
@@ -884,9 +1272,6 @@ void spiceReady(void)
   }
   purespice_freeServerInfo(&info);
 
-  if (g_params.useSpiceInput)
-    keybind_spiceRegister();
-
   lgSignalEvent(e_spice);
 }
 
@@ -952,6 +1337,185 @@ static void spice_setCursorState(bool visible, int x, int y)
   renderQueue_cursorState(visible, x, y, g_state.spiceHotX, g_state.spiceHotY);
 }
 
+#if ENABLE_AUDIO
+/* SPICE playback is kept as the fallback and only gives way while audio is
+ * received over IVSHMEM, which needs a host that provides it. The SPICE stream
+ * is remembered so playback can return to it when the IVSHMEM audio stops. The
+ * lock is only held by the SPICE callbacks and as the source changes */
+static struct
+{
+  LG_Lock        lock;
+  bool           ivshmem;
+
+  // the open SPICE stream, started only while it is the source
+  bool           open, started;
+  int            channels, sampleRate;
+  PSAudioFormat  format;
+  uint32_t       time;
+}
+audioSource = { .lock = ATOMIC_FLAG_INIT };
+
+static void spice_playbackStart(int channels, int sampleRate,
+    PSAudioFormat format, uint32_t time)
+{
+  LG_LOCK(audioSource.lock);
+  audioSource.open       = true;
+  audioSource.started    = !audioSource.ivshmem;
+  audioSource.channels   = channels;
+  audioSource.sampleRate = sampleRate;
+  audioSource.format     = format;
+  audioSource.time       = time;
+  if (audioSource.started)
+    audio_playbackStart(channels, sampleRate, format, time);
+  LG_UNLOCK(audioSource.lock);
+}
+
+static void spice_playbackStop(void)
+{
+  LG_LOCK(audioSource.lock);
+  if (audioSource.started)
+    audio_playbackStop();
+  audioSource.open    = false;
+  audioSource.started = false;
+  LG_UNLOCK(audioSource.lock);
+}
+
+static void spice_playbackData(uint8_t * data, size_t size)
+{
+  LG_LOCK(audioSource.lock);
+  if (audioSource.open && !audioSource.ivshmem)
+  {
+    if (!audioSource.started)
+    {
+      audio_playbackStart(audioSource.channels, audioSource.sampleRate,
+          audioSource.format, audioSource.time);
+      audioSource.started = true;
+    }
+    audio_playbackData(data, size);
+  }
+  LG_UNLOCK(audioSource.lock);
+}
+
+// switches the playback between the SPICE and IVSHMEM audio
+static void setIVSHMEMAudio(bool enable)
+{
+  LG_LOCK(audioSource.lock);
+  if (enable && audioSource.started)
+  {
+    audio_playbackStop();
+    audioSource.started = false;
+  }
+  audioSource.ivshmem = enable;
+  LG_UNLOCK(audioSource.lock);
+}
+
+static int audioThread(void * unused)
+{
+  LGMP_STATUS      status;
+  PLGMPClientQueue queue;
+
+  while(g_state.state == APP_STATE_RUNNING)
+  {
+    status = lgmpClientSubscribe(g_state.lgmp, LGMP_Q_AUDIO, &queue);
+    if (status == LGMP_OK)
+      break;
+
+    if (status == LGMP_ERR_NO_SUCH_QUEUE)
+    {
+      usleep(1000);
+      continue;
+    }
+
+    // audio is optional, don't take the session down with it
+    DEBUG_ERROR("lgmpClientSubscribe Failed: %s", lgmpStatusString(status));
+    return 0;
+  }
+
+  if (g_state.state != APP_STATE_RUNNING)
+    return 0;
+
+  DEBUG_INFO("Receiving audio over IVSHMEM");
+  unsigned int channels   = 0;
+  unsigned int sampleRate = 0;
+
+  while(g_state.state == APP_STATE_RUNNING)
+  {
+    LGMPMessage msg;
+    if ((status = lgmpClientProcess(queue, &msg)) != LGMP_OK)
+    {
+      if (status == LGMP_ERR_QUEUE_EMPTY)
+      {
+        usleep(1000);
+        continue;
+      }
+
+      // an invalid session is picked up by the main loop
+      if (status != LGMP_ERR_INVALID_SESSION)
+        DEBUG_ERROR("lgmpClientProcess Failed: %s", lgmpStatusString(status));
+      break;
+    }
+
+    const KVMFRAudio * audio = (const KVMFRAudio *)msg.mem;
+    if (audio->channels   < 1 ||
+        audio->channels   > KVMFR_AUDIO_MAX_CHANNELS ||
+        audio->frames     > KVMFR_AUDIO_MAX_FRAMES   ||
+        audio->sampleRate == 0)
+    {
+      DEBUG_WARN("Invalid audio packet");
+      lgmpClientMessageDone(queue);
+      continue;
+    }
+
+    if (audio->channels != channels || audio->sampleRate != sampleRate)
+    {
+      if (channels)
+        audio_playbackStop();
+      else
+        setIVSHMEMAudio(true);
+
+      channels   = audio->channels;
+      sampleRate = audio->sampleRate;
+      audio_playbackStart(channels, sampleRate, PS_AUDIO_FMT_S16,
+          (uint32_t)(audio->captureTime / 1000));
+    }
+
+    audio_playbackHostTime(audio->captureTime);
+    audio_playbackData((uint8_t *)(audio + 1),
+        audio->frames * channels * sizeof(int16_t));
+    lgmpClientMessageDone(queue);
+  }
+
+  if (channels)
+  {
+    audio_playbackStop();
+    setIVSHMEMAudio(false);
+  }
+
+  lgmpClientUnsubscribe(&queue);
+  return 0;
+}
+
+static void startAudioThread(void)
+{
+  if (!g_params.audioIVSHMEM || !g_params.useSpiceAudio ||
+      !(g_state.kvmfrFeatures & KVMFR_FEATURE_AUDIO) ||
+      !audio_supportsPlayback())
+    return;
+
+  if (!lgCreateThread("audioThread", audioThread, NULL, &t_audio))
+    DEBUG_ERROR("audio create thread failed");
+}
+#endif
+
+static void stopAudioThread(void)
+{
+  if (!t_audio)
+    return;
+
+  lgJoinThread(t_audio, NULL);
+  t_audio = NULL;
+}
+
 int spiceThread(void * arg)
 {
   if (g_params.useSpiceAudio)
@@ -998,11 +1562,11 @@ int spiceThread(void * arg)
     {
       .enable      = audio_supportsPlayback(),
       .autoConnect = true,
-      .start       = audio_playbackStart,
+      .start       = spice_playbackStart,
       .volume      = audio_playbackVolume,
       .mute        = audio_playbackMute,
-      .stop        = audio_playbackStop,
-      .data        = audio_playbackData
+      .stop        = spice_playbackStop,
+      .data        = spice_playbackData
     },
     .record =
     {
@@ -1138,6 +1702,41 @@ static MsgBoxHandle showSpiceInputHelp(void)
     "through SPICE if you press the capture key.");
 }
 
+static double metricFPS(void * opaque)
+{
+  return atomic_load_explicit(&g_state.fps, memory_order_relaxed);
+}
+
+static double metricUPS(void * opaque)
+{
+  return atomic_load_explicit(&g_state.ups, memory_order_relaxed);
+}
+
+static double metricDropped(void * opaque)
+{
+  return atomic_load_explicit(&g_state.frameStats.droppedCount,
+      memory_order_relaxed);
+}
+
+static void startMetrics(void)
+{
+  metrics_registerValue("lg_client_fps", "Frames rendered per second",
+      false, metricFPS, NULL);
+  metrics_registerValue("lg_client_ups", "Frames received per second",
+      false, metricUPS, NULL);
+  metrics_registerValue("lg_client_frames_skipped_total",
+      "Frames passed over for a newer one", true, metricDropped, NULL);
+  metrics_registerHistogram("lg_client_frame_seconds",
+      "Time between rendered frames", g_state.renderTimingStats, 1e-6);
+  metrics_registerHistogram("lg_client_render_seconds",
+      "Time taken to render a frame", g_state.renderDurationStats, 1e-6);
+  metrics_registerHistogram("lg_client_upload_seconds",
+      "Time between received frames", g_state.uploadTimingStats, 1e-6);
+
+  if (!metrics_startExport(g_params.metricsSocket))
+    DEBUG_WARN("The metrics will not be exported");
+}
+
 static int lg_run(void)
 {
   g_cursor.sens = g_params.mouseSens;
@@ -1173,6 +1772,9 @@ static int lg_run(void)
   ImFontGlyphRangesBuilder_BuildRanges(rangeBuilder, &g_state.fontRange);
   ImFontGlyphRangesBuilder_destroy(rangeBuilder);
 
+  if (!fontAtlas_init(g_state.fontName, g_params.uiSize, g_state.fontRange.Data))
+    DEBUG_WARN("Font atlases will be built on the render thread");
+
   // initialize metrics ringbuffers
   g_state.renderTimings  = ringbuffer_new(256, sizeof(float));
   g_state.uploadTimings  = ringbuffer_new(256, sizeof(float));
@@ -1181,7 +1783,43 @@ static int lg_run(void)
   overlayGraph_register("UPLOAD", g_state.uploadTimings , 0.0f, 50.0f, NULL);
   overlayGraph_register("RENDER", g_state.renderDuration, 0.0f, 10.0f, NULL);
 
+  g_state.renderTimingStats   = stats_histogramNew();
+  g_state.renderDurationStats = stats_histogramNew();
+  g_state.uploadTimingStats   = stats_histogramNew();
+  if (!g_state.renderTimingStats || !g_state.renderDurationStats ||
+      !g_state.uploadTimingStats)
+    return -1;
+
+  if (g_params.metricsSocket && *g_params.metricsSocket)
+    startMetrics();
+
+  if (!latency_init(g_params.latencyLog))
+    return -1;
+
+  if (!recorder_init(g_params.recordFile))
+    return -1;
+
+  if (!videoRecord_init())
+    return -1;
+
+  if (g_params.fbProfile)
+    fbprofile_enable(true);
+
+  int copyThreads = g_params.copyThreads;
+  if (copyThreads <= 0)
+  {
+    int procs;
+    if (!lgCPUInfo(NULL, 0, &procs, NULL, NULL))
+      procs = 1;
+    copyThreads = min(procs / 2, 4);
+  }
+
+  // the thread reading the frame participates in the copy so needs one less
+  if (copyThreads > 1 && !framebuffer_start_workers(copyThreads - 1))
+    DEBUG_WARN("Failed to start the copy workers, using a single thread");
+
   initImGuiKeyMap(g_state.io->KeyMap);
+  startupPhase("ImGui");
 
   // unknown guest OS at this time
   g_state.guestOS = KVMFR_OS_OTHER;
@@ -1218,6 +1856,7 @@ static int lg_run(void)
     DEBUG_ERROR("Subsystem early init failed");
     return -1;
   }
+  startupPhase("Display server");
 
   // override the SIGINIT handler so that we can tell the difference between
   // SIGINT and the user sending a close event, such as ALT+F4
@@ -1231,6 +1870,21 @@ static int lg_run(void)
     return -1;
   }
 
+  /* attach to LGMP now, the host needs time to update the timestamp before a
+   * session can be validated and that can pass while the renderer starts */
+  LGMP_STATUS status;
+  if ((status = lgmpClientInit(g_state.shm.mem, g_state.shm.size,
+          &g_state.lgmp)) != LGMP_OK)
+  {
+    DEBUG_ERROR("lgmpClientInit Failed: %s", lgmpStatusString(status));
+    return -1;
+  }
+  const uint64_t lgmpInitTime = microtime();
+
+  if (!sources_init())
+    return -1;
+  startupPhase("IVSHMEM");
+
   // setup the spice startup condition
   if (!(e_spice = lgCreateEvent(false, 0)))
   {
@@ -1245,8 +1899,9 @@ static int lg_run(void)
     return -1;
   }
 
-  // setup the new frame event
-  if (!(g_state.frameEvent = lgCreateEvent(!g_state.jitRender, 0)))
+  /* setup the new frame event, a render thread that is waiting as the frame
+   * arrives spins for it rather than sleeping */
+  if (!(g_state.frameEvent = lgCreateEvent(!g_state.jitRender, 1)))
   {
     DEBUG_ERROR("failed to create the frame event");
     return -1;
@@ -1255,6 +1910,9 @@ static int lg_run(void)
   //setup the render command queue
   renderQueue_init();
 
+  if (g_params.watchConfig)
+    configWatch_start();
+
   const PSInit psInit =
   {
     .log =
@@ -1268,25 +1926,30 @@ static int lg_run(void)
 
   g_state.micDefaultState = g_params.micDefaultState;
 
+  if (g_params.useSpiceInput && !core_startMotionCoalesce())
+    return -1;
+
   if (g_params.useSpiceInput     ||
       g_params.useSpiceClipboard ||
       g_params.useSpiceAudio)
   {
+    /* the connection is waited for once the renderer and window are up, it
+     * is network bound and does not need to hold them up */
     if (!lgCreateThread("spiceThread", spiceThread, NULL, &t_spice))
     {
       DEBUG_ERROR("spice create thread failed");
       return -1;
     }
-
-    lgWaitEvent(e_spice, TIMEOUT_INFINITE);
-    if (!g_state.spiceReady)
-      return -1;
   }
 
   // select and init a renderer
   bool needsOpenGL = false;
   LG_RendererParams lgrParams;
-  lgrParams.quickSplash = g_params.quickSplash;
+  lgrParams.quickSplash  = g_params.quickSplash;
+  lgrParams.sources      = sources_count();
+  lgrParams.sourceLayout = g_params.sourceLayout;
+  lgrParams.frameMemory     = g_state.shm.mem;
+  lgrParams.frameMemorySize = g_state.shm.size;
 
   if (g_params.forceRenderer)
   {
@@ -1312,6 +1975,7 @@ static int lg_run(void)
     DEBUG_ERROR("Unable to find a suitable renderer");
     return -1;
   }
+  startupPhase("Renderer");
 
   g_state.useDMA =
     g_params.allowDMA &&
@@ -1337,7 +2001,8 @@ static int lg_run(void)
     .borderless          = g_params.borderless,
     .maximize            = g_params.maximize,
     .opengl              = needsOpenGL,
-    .jitRender           = g_params.jitRender
+    .jitRender           = g_params.jitRender,
+    .vblankTimes         = g_params.guestCadence
   };
 
   g_state.dsInitialized = g_state.ds->init(params);
@@ -1346,6 +2011,20 @@ static int lg_run(void)
     DEBUG_ERROR("Failed to initialize the displayserver backend");
     return -1;
   }
+  startupPhase("Window");
+
+  if (g_params.vrr)
+  {
+    bool vrr = false;
+    if (g_state.ds->getProp(LG_DS_VRR_CAPABLE, &vrr) && vrr)
+    {
+      if (g_state.jitRender)
+        DEBUG_INFO("Adaptive sync display found but JIT render keeps the "
+            "compositor's pacing, VRR pacing disabled");
+      else
+        g_state.vrr = true;
+    }
+  }
 
   if (g_params.noScreensaver)
     g_state.ds->inhibitIdle();
@@ -1368,11 +2047,36 @@ static int lg_run(void)
   // interactivity.
   g_state.overlayFrameTime = min(g_state.frameTime, 1000000000ULL / 60ULL);
 
+  if (g_state.vrr)
+  {
+    // cap a few Hz under the maximum refresh to stay inside the VRR window
+    int refresh = 0;
+    if (g_state.ds->getProp(LG_DS_REFRESH_RATE, &refresh) && refresh > 3)
+      g_state.vrrFrameTime = 1000000000ULL / (unsigned long long)(refresh - 3);
+
+    DEBUG_INFO("Using VRR pacing mode, refresh %d Hz", refresh);
+  }
+
   keybind_commonRegister();
 
+  if (t_spice)
+  {
+    lgWaitEvent(e_spice, TIMEOUT_INFINITE);
+    if (!g_state.spiceReady)
+      return -1;
+
+    // registered here as the keybind list is not locked
+    if (g_params.useSpiceInput)
+      keybind_spiceRegister();
+    startupPhase("SPICE");
+  }
+
   if (g_state.jitRender)
     DEBUG_INFO("Using JIT render mode");
 
+  if (!power_init(g_params.powerProfile))
+    return -1;
+
   lgInit();
 
   // start the renderThread so we don't just display junk
@@ -1385,26 +2089,21 @@ static int lg_run(void)
   // wait for startup to complete so that any error messages below are output at
   // the end of the output
   lgWaitEvent(e_startup, TIMEOUT_INFINITE);
+  startupPhase("Render thread");
 
   g_state.ds->startup();
   g_state.cbAvailable = g_state.ds->cbInit && g_state.ds->cbInit();
   if (g_state.cbAvailable)
-    g_state.cbRequestList = ll_new();
-
-  LGMP_STATUS status;
-
-  while(g_state.state == APP_STATE_RUNNING)
   {
-    if ((status = lgmpClientInit(g_state.shm.mem, g_state.shm.size, &g_state.lgmp)) == LGMP_OK)
-      break;
-
-    DEBUG_ERROR("lgmpClientInit Failed: %s", lgmpStatusString(status));
-    return -1;
+    g_state.cbRequestList = ll_new();
+    LG_LOCK_INIT(g_state.cbCacheLock);
   }
 
   /* this short timeout is to allow the LGMP host to update the timestamp before
-   * we start checking for a valid session */
-  g_state.ds->wait(200);
+   * we start checking for a valid session, most of it has usually passed */
+  const uint64_t lgmpWaited = (microtime() - lgmpInitTime) / 1000;
+  if (lgmpWaited < 200)
+    g_state.ds->wait(200 - lgmpWaited);
 
   if (g_params.captureOnStart)
     core_setGrab(true);
@@ -1415,12 +2114,14 @@ static int lg_run(void)
 
   MsgBoxHandle msgs[10];
   int msgsCount;
+  bool hostRestart = false;
 
 restart:
   msgsCount = 0;
   memset(msgs, 0, sizeof(msgs));
 
-  uint64_t initialSpiceEnable = microtime() + 1000 * 1000;
+  uint64_t initialSpiceEnable = microtime() +
+    (hostRestart ? HOST_RESTART_GRACE_MS : 1000) * 1000;
 
   while(g_state.state == APP_STATE_RUNNING)
   {
@@ -1429,8 +2130,10 @@ restart:
       /* use the spice display until we get frames from the LG host application
        * it is safe to call this before connect as it will be delayed until
        * spiceReady is called */
-      app_useSpiceDisplay(true);
+      if (!app_useSpiceDisplay(true) && hostRestart)
+        overlaySplash_show(true);
       initialSpiceEnable = 0;
+      hostRestart        = false;
     }
 
     status = lgmpClientSessionInit(g_state.lgmp, &udataSize, (uint8_t **)&udata,
@@ -1439,6 +2142,12 @@ restart:
     {
       case LGMP_OK:
         initialSpiceEnable = 0;
+        hostRestart        = false;
+        if (!g_startup.reported)
+        {
+          startupPhase("Host session");
+          startupReport();
+        }
         break;
 
       case LGMP_ERR_INVALID_VERSION:
@@ -1462,6 +2171,13 @@ restart:
       case LGMP_ERR_INVALID_SESSION:
       case LGMP_ERR_INVALID_MAGIC:
       {
+        // the host is expected back shortly, poll quickly and quietly
+        if (hostRestart)
+        {
+          g_state.ds->wait(HOST_RESTART_POLL_MS);
+          continue;
+        }
+
         if (waitCount++ == 0)
         {
           DEBUG_BREAK();
@@ -1662,14 +2378,29 @@ restart:
   }
 
   g_state.kvmfrFeatures = udata->features;
+  g_state.useDoorbell   = false;
+  g_state.frameQueueLen = udata->frameQueueLen;
+  if (g_state.frameQueueLen < 1 ||
+      g_state.frameQueueLen > LGMP_Q_FRAME_LEN_MAX)
+  {
+    DEBUG_ERROR("Invalid frame queue length: %u", g_state.frameQueueLen);
+    return -1;
+  }
+  DEBUG_INFO("Frame Buffers: %u", g_state.frameQueueLen);
 
   LG_LOCK_INIT(g_state.pointerQueueLock);
+  LG_LOCK_INIT(g_cursor.predictLock);
   if (!core_startCursorThread() || !core_startFrameThread())
   {
     LG_LOCK_FREE(g_state.pointerQueueLock);
+    LG_LOCK_FREE(g_cursor.predictLock);
     return -1;
   }
 
+#if ENABLE_AUDIO
+  startAudioThread();
+#endif
+
   while(g_state.state == APP_STATE_RUNNING)
   {
     if (!lgmpClientSessionValid(g_state.lgmp))
@@ -1689,13 +2420,16 @@ restart:
 
     core_stopFrameThread();
     core_stopCursorThread();
+    stopAudioThread();
 
     g_state.state = APP_STATE_RUNNING;
     lgInit();
+    hostRestart = true;
     goto restart;
   }
 
   LG_LOCK_FREE(g_state.pointerQueueLock);
+  LG_LOCK_FREE(g_cursor.predictLock);
   return 0;
 }
 
@@ -1703,6 +2437,11 @@ static void lg_shutdown(void)
 {
   g_state.state = APP_STATE_SHUTDOWN;
 
+  core_stopMotionCoalesce();
+  power_free();
+
+  // the audio thread must be gone before the spice thread frees the audio
+  stopAudioThread();
   if (t_spice)
     lgJoinThread(t_spice, NULL);
 
@@ -1716,6 +2455,7 @@ static void lg_shutdown(void)
   }
 
   lgmpClientFree(&g_state.lgmp);
+  sources_free();
 
   if (g_state.frameEvent)
   {
@@ -1742,6 +2482,9 @@ static void lg_shutdown(void)
   {
     ll_free(g_state.cbRequestList);
     g_state.cbRequestList = NULL;
+
+    cb_cacheInvalidate();
+    LG_LOCK_FREE(g_state.cbCacheLock);
   }
 
   app_releaseAllKeybinds();
@@ -1752,13 +2495,32 @@ static void lg_shutdown(void)
 
   ivshmemClose(&g_state.shm);
 
+  configWatch_stop();
   renderQueue_free();
+  latency_free();
+  recorder_free();
+  videoRecord_free();
+  framebuffer_stop_workers();
+  backoff_log_stats("Client");
+  if (g_params.fbProfile)
+    fbprofile_log();
+
+  metrics_stopExport();
+  metrics_unregister("lg_client_fps");
+  metrics_unregister("lg_client_ups");
+  metrics_unregister("lg_client_frame_seconds");
+  metrics_unregister("lg_client_render_seconds");
+  metrics_unregister("lg_client_upload_seconds");
 
   // free metrics ringbuffers
   ringbuffer_free(&g_state.renderTimings);
   ringbuffer_free(&g_state.uploadTimings);
   ringbuffer_free(&g_state.renderDuration);
+  stats_histogramFree(&g_state.renderTimingStats);
+  stats_histogramFree(&g_state.renderDurationStats);
+  stats_histogramFree(&g_state.uploadTimingStats);
 
+  fontAtlas_free();
   free(g_state.fontName);
   ImVector_ImWchar_UnInit(&g_state.fontRange);
   igDestroyContext(NULL);
@@ -1767,6 +2529,8 @@ static void lg_shutdown(void)
 
 int main(int argc, char * argv[])
 {
+  g_startup.start = g_startup.last = microtime();
+
   // initialize for DEBUG_* macros
   debug_init();
 
@@ -1785,6 +2549,7 @@ int main(int argc, char * argv[])
   DEBUG_INFO("Looking Glass (%s)", BUILD_VERSION);
   DEBUG_INFO("Locking Method: " LG_LOCK_MODE);
   lgDebugCPU();
+  framebuffer_init();
 
   if (!installCrashHandler("/proc/self/exe"))
     DEBUG_WARN("Failed to install the crash handler");
@@ -1797,7 +2562,12 @@ int main(int argc, char * argv[])
 
   g_state.bindings = ll_new();
 
-  g_state.overlays = ll_new();
+  if (!vector_create(&g_state.overlays, sizeof(struct Overlay), 16))
+  {
+    DEBUG_ERROR("Failed to allocate the overlay list");
+    return -1;
+  }
+
   app_registerOverlay(&LGOverlaySplash, NULL);
   app_registerOverlay(&LGOverlayConfig, NULL);
   app_registerOverlay(&LGOverlayAlert , NULL);
@@ -1818,13 +2588,17 @@ int main(int argc, char * argv[])
     if (LG_AudioDevs[i]->earlyInit)
       LG_AudioDevs[i]->earlyInit();
 
+  videoRecord_earlyInit();
+
   if (!config_load(argc, argv))
     return -1;
+  startupPhase("Configuration");
 
   const int ret = lg_run();
   lg_shutdown();
 
   config_free();
+  vector_destroy(&g_state.overlays);
 
   util_freeUIFonts();
   cleanupCrashHandler();
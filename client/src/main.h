@@ -20,19 +20,23 @@
 
 #include <stdbool.h>
 #include <stdatomic.h>
+#include <stdalign.h>
 #include <linux/input.h>
 
 #include "dynamic/displayservers.h"
 #include "dynamic/renderers.h"
 #include "dynamic/audiodev.h"
+#include "power.h"
 
 #include "common/thread.h"
 #include "common/types.h"
 #include "common/ivshmem.h"
 #include "common/locking.h"
 #include "common/ringbuffer.h"
+#include "common/stats.h"
 #include "common/event.h"
 #include "common/ll.h"
+#include "common/vector.h"
 
 #include <purespice.h>
 #include <lgmp/client.h>
@@ -53,13 +57,30 @@ enum MicDefaultState {
 };
 #define MIC_DEFAULT_MAX (MIC_DEFAULT_DENY + 1)
 
+/* The per frame counters, each block is written by one thread only. The
+ * counts only ever increase, the fps timer keeps the values it last read */
+struct FrameThreadStats
+{
+  atomic_uint_least64_t frameCount;
+  atomic_uint_least64_t droppedCount;
+  uint64_t              lastFrameTime;
+  bool                  lastFrameTimeValid;
+};
+
+struct RenderThreadStats
+{
+  atomic_uint_least64_t renderCount;
+  uint64_t              lastRenderTime;
+  bool                  lastRenderTimeValid;
+};
+
 struct AppState
 {
   enum RunState state;
 
   ImGuiIO        * io;
   ImGuiStyle     * style;
-  struct ll      * overlays;
+  Vector           overlays;
   char           * fontName;
   ImFont         * fontLarge;
   ImVector_ImWchar fontRange;
@@ -72,10 +93,12 @@ struct AppState
   bool             modSuper;
   uint64_t         lastImGuiFrame;
   bool             renderImGuiTwice;
+  atomic_uint      overlayGeneration;
 
   struct LG_DisplayServerOps * ds;
   bool                         dsInitialized;
   bool                         jitRender;
+  bool                         vrr;
 
   uint8_t spiceUUID[16];
   bool    spiceReady;
@@ -102,6 +125,7 @@ struct AppState
   double               windowScale;
   LG_RendererRotate    rotate;
   bool                 focused;
+  atomic_bool          hidden; // occluded or minimized, frames are not read
   struct Border        border;
   struct Point         srcSize;
   LG_RendererRect      dstRect;
@@ -111,8 +135,8 @@ struct AppState
 
   LG_Renderer        * lgr;
   atomic_int           lgrResize;
-  LG_Lock              lgrLock;
   bool                 useDMA;
+  bool                 useDoorbell;
 
   bool                 cbAvailable;
   PSDataType           cbType;
@@ -120,11 +144,22 @@ struct AppState
   size_t               cbXfer;
   struct ll          * cbRequestList;
 
+  // the last guest clipboard payload, valid for the current cbGeneration
+  LG_Lock              cbCacheLock;
+  unsigned int         cbGeneration;
+  PSDataType           cbCacheType;
+  uint8_t            * cbCache;
+  uint32_t             cbCacheSize;
+
   struct IVSHMEM       shm;
   PLGMPClient          lgmp;
   PLGMPClientQueue     pointerQueue;
   LG_Lock              pointerQueueLock;
+
+  // the host's live cursor position record, NULL until it is announced
+  _Atomic(const KVMFRCursorLive *) cursorLive;
   KVMFRFeatureFlags    kvmfrFeatures;
+  unsigned int         frameQueueLen;
 
   LGThread            * cursorThread;
   LGThread            * frameThread;
@@ -133,17 +168,24 @@ struct AppState
   bool                  formatValid;
   uint64_t              frameTime;
   uint64_t              overlayFrameTime;
-  uint64_t              lastFrameTime;
-  bool                  lastFrameTimeValid;
-  uint64_t              lastRenderTime;
-  bool                  lastRenderTimeValid;
+  uint64_t              vrrFrameTime;
   RingBuffer            renderTimings;
   RingBuffer            renderDuration;
   RingBuffer            uploadTimings;
 
-  atomic_uint_least64_t pendingCount;
-  atomic_uint_least64_t renderCount, frameCount;
-  _Atomic(float)        fps, ups;
+  // the same timings for the metrics export, in microseconds
+  StatsHistogram        renderTimingStats;
+  StatsHistogram        renderDurationStats;
+  StatsHistogram        uploadTimingStats;
+
+  /* The frame, render and fps timer threads update these at frame rate or
+   * more. Keep them on separate cache lines to avoid false sharing with each
+   * other and the rest of the state. */
+  alignas(64) struct FrameThreadStats  frameStats;
+  alignas(64) struct RenderThreadStats renderStats;
+  // raised by the frame thread and lowered by the render thread
+  alignas(64) atomic_uint_least64_t    pendingCount;
+  alignas(64) _Atomic(float)           fps, ups;
 
   uint64_t resizeTimeout;
   bool     resizeDone;
@@ -200,10 +242,27 @@ struct AppParams
   const char *         uiFont;
   int                  uiSize;
   bool                 jitRender;
+  bool                 vrr;
+  bool                 guestCadence;
 
   unsigned int         cursorPollInterval;
   unsigned int         framePollInterval;
+  bool                 latestFrame;
+  bool                 earlyRelease;
   bool                 allowDMA;
+  const char *         latencyLog;
+  const char *         metricsSocket;
+  const char *         recordFile;
+  bool                 fbProfile;
+  int                  copyThreads;
+  const char *         extraShmFiles;
+  LG_SourceLayout      sourceLayout;
+  unsigned int         previewFps;
+  bool                 watchConfig;
+  PowerProfile         powerProfile;
+  unsigned int         powersavePollScale;
+  unsigned int         powersaveFps;
+  bool                 powersaveFilters;
 
   bool                 forceRenderer;
   unsigned int         forceRendererIndex;
@@ -213,12 +272,18 @@ struct AppParams
   int                  mouseSens;
   bool                 mouseSmoothing;
   bool                 rawMouse;
+  bool                 predictCursor;
+  unsigned int         mouseCoalesce;
   bool                 autoCapture;
   bool                 captureInputOnly;
   bool                 showCursorDot;
 
   int                  audioPeriodSize;
   int                  audioBufferLatency;
+  bool                 audioWorker;
+  bool                 audioIVSHMEM;
+  bool                 audioSyncVideo;
+  const char *         audioResampler;
   bool                 micShowIndicator;
   enum MicDefaultState micDefaultState;
 };
@@ -226,6 +291,7 @@ struct AppParams
 struct CBRequest
 {
   PSDataType          type;
+  unsigned int        generation;
   LG_ClipboardReplyFn replyFn;
   void              * opaque;
 };
@@ -315,6 +381,11 @@ struct CursorState
 
   /* the projected position after move, for app_handleMouseBasic only */
   struct Point projected;
+
+  /* motion sent to the guest that it has not reported back yet */
+  LG_Lock      predictLock;
+  struct Point predict;
+  uint64_t     predictTime;
 };
 
 // forwards
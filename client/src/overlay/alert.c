@@ -115,6 +115,7 @@ struct LG_OverlayOps LGOverlayAlert =
   .free           = alert_free,
   .render         = alert_render,
   .tick           = alert_tick,
+  .generation     = overlayStaticGeneration,
 };
 
 void overlayAlert_show(LG_MsgAlert type, const char * fmt, va_list args)
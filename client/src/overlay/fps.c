@@ -94,11 +94,26 @@ static int fps_render(void * udata, bool interactive, struct Rect * windowRects,
   return 1;
 }
 
+static uint64_t fps_generation(void * udata)
+{
+  // the text only changes when the fps timer publishes new rates
+  union { float f[2]; uint64_t u; } rates =
+  {
+    .f =
+    {
+      atomic_load_explicit(&g_state.fps, memory_order_relaxed),
+      atomic_load_explicit(&g_state.ups, memory_order_relaxed)
+    }
+  };
+  return rates.u;
+}
+
 struct LG_OverlayOps LGOverlayFPS =
 {
   .name           = "FPS",
   .earlyInit      = fps_earlyInit,
   .init           = fps_init,
   .free           = fps_free,
-  .render         = fps_render
+  .render         = fps_render,
+  .generation     = fps_generation
 };
@@ -24,6 +24,7 @@
 #include "../main.h"
 
 #include "common/debug.h"
+#include "common/stats.h"
 #include "overlay_utils.h"
 
 struct GraphState
@@ -42,6 +43,7 @@ struct OverlayGraph
   float         min;
   float         max;
   GraphFormatFn formatFn;
+  StatsHistogram hist;
 };
 
 
@@ -87,7 +89,10 @@ static void graphs_free(void * udata)
 {
   struct OverlayGraph * graph;
   while(ll_shift(gs.graphs, (void **)&graph))
+  {
+    stats_histogramFree(&graph->hist);
     free(graph);
+  }
   ll_free(gs.graphs);
   gs.graphs = NULL;
 }
@@ -100,6 +105,8 @@ struct BufferMetrics
   float avg;
   float freq;
   float last;
+  float p99;
+  StatsHistogram hist;
 };
 
 static bool rbCalcMetrics(int index, void * value_, void * udata_)
@@ -107,6 +114,9 @@ static bool rbCalcMetrics(int index, void * value_, void * udata_)
   float * value = value_;
   struct BufferMetrics * udata = udata_;
 
+  // the values are in milliseconds, the histogram is kept in microseconds
+  stats_histogramRecord(udata->hist, (int64_t)(*value * 1000.0f));
+
   if (index == 0)
   {
     udata->min = *value;
@@ -169,7 +179,8 @@ static int graphs_render(void * udata, bool interactive,
     if (!graph->enabled)
       continue;
 
-    struct BufferMetrics metrics = {};
+    struct BufferMetrics metrics = { .hist = graph->hist };
+    stats_histogramReset(graph->hist);
     ringbuffer_forEach(graph->buffer, rbCalcMetrics, &metrics, false);
 
     if (metrics.sum > 0.0f)
@@ -177,6 +188,7 @@ static int graphs_render(void * udata, bool interactive,
       metrics.avg  = metrics.sum / ringbuffer_getCount(graph->buffer);
       metrics.freq = 1000.0f / metrics.avg;
     }
+    metrics.p99 = stats_histogramPercentile(graph->hist, 99.0) / 1000.0f;
 
     const char * title;
     if (graph->formatFn)
@@ -184,10 +196,11 @@ static int graphs_render(void * udata, bool interactive,
           metrics.min, metrics.max, metrics.avg, metrics.freq, metrics.last);
     else
     {
-      static char _title[64];
+      static char _title[80];
       snprintf(_title, sizeof(_title),
-          "%s: min:%4.2f max:%4.2f avg:%4.2f/%4.2fHz",
-          graph->name, metrics.min, metrics.max, metrics.avg, metrics.freq);
+          "%s: min:%4.2f max:%4.2f avg:%4.2f/%4.2fHz p99:%4.2f",
+          graph->name, metrics.min, metrics.max, metrics.avg, metrics.freq,
+          metrics.p99);
       title = _title;
     }
 
@@ -228,6 +241,13 @@ GraphHandle overlayGraph_register(const char * name, RingBuffer buffer,
     return NULL;
   }
 
+  graph->hist = stats_histogramNew();
+  if (!graph->hist)
+  {
+    free(graph);
+    return NULL;
+  }
+
   graph->name     = name;
   graph->buffer   = buffer;
   graph->enabled  = true;
@@ -244,6 +264,7 @@ void overlayGraph_unregister(GraphHandle handle)
     return;
 
   ll_removeData(gs.graphs, handle);
+  stats_histogramFree(&handle->hist);
   free(handle);
 
   if (gs.show)
@@ -92,5 +92,6 @@ struct LG_OverlayOps LGOverlayHelp =
   .name           = "Help",
   .init           = help_init,
   .free           = help_free,
-  .render         = help_render
+  .render         = help_render,
+  .generation     = overlayStaticGeneration
 };
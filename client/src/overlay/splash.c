@@ -247,11 +247,12 @@ static bool splash_tick(void * udata, unsigned long long tickCount)
 
 struct LG_OverlayOps LGOverlaySplash =
 {
-  .name   = "splash",
-  .init   = splash_init,
-  .free   = splash_free,
-  .render = splash_render,
-  .tick   = splash_tick,
+  .name       = "splash",
+  .init       = splash_init,
+  .free       = splash_free,
+  .render     = splash_render,
+  .tick       = splash_tick,
+  .generation = overlayStaticGeneration,
 };
 
 void overlaySplash_show(bool show)
@@ -28,6 +28,7 @@
 
 #include "resources/status/recording.svg.h"
 #include "resources/status/spice.svg.h"
+#include "resources/status/powersave.svg.h"
 
 //TODO: Make this user configurable?
 #define ICON_SIZE 32
@@ -53,6 +54,9 @@ static void status_loadIcons(double scale)
 
   status_loadImage(b_status_spice_svg, b_status_spice_svg_size,
       &l_image[LG_USER_STATUS_SPICE], iconSize, iconSize);
+
+  status_loadImage(b_status_powersave_svg, b_status_powersave_svg_size,
+      &l_image[LG_USER_STATUS_POWERSAVE], iconSize, iconSize);
 }
 
 static bool status_init(void ** udata, const void * params)
@@ -143,6 +147,7 @@ struct LG_OverlayOps LGOverlayStatus =
   .free           = status_free,
   .render         = status_render,
   .tick           = status_tick,
+  .generation     = overlayStaticGeneration,
 };
 
 void overlayStatus_set(LGUserStatus status, bool value)
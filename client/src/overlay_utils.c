@@ -173,3 +173,8 @@ void overlayFreeImage(OverlayImage * image)
 
   RENDERER(freeTexture, image->tex);
 }
+
+uint64_t overlayStaticGeneration(void * udata)
+{
+  return 0;
+}
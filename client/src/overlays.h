@@ -31,6 +31,7 @@ struct Overlay
   void       * udata;
   int          lastRectCount;
   struct Rect  lastRects[MAX_OVERLAY_RECTS];
+  uint64_t     lastGeneration;
 };
 
 extern struct LG_OverlayOps LGOverlaySplash;
@@ -61,6 +62,7 @@ typedef enum LG_UserStatus
 {
   LG_USER_STATUS_SPICE,
   LG_USER_STATUS_RECORDING,
+  LG_USER_STATUS_POWERSAVE,
   LG_USER_STATUS_MAX
 }
 LGUserStatus;
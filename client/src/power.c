@@ -0,0 +1,242 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "power.h"
+#include "main.h"
+#include "overlays.h"
+
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/time.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/* UPower reads the same attributes, reading them here saves a D-Bus client
+ * for what is a check every few seconds */
+#define POWER_SUPPLY_PATH "/sys/class/power_supply"
+#define POWER_CHECK_MS    5000
+
+// how long the render thread sleeps between checks while hidden
+#define POWER_HIDDEN_NS   50000000ULL
+
+static const char * l_profileNames[POWER_PROFILE_MAX] =
+{
+  [POWER_PROFILE_AUTO       ] = "auto",
+  [POWER_PROFILE_PERFORMANCE] = "performance",
+  [POWER_PROFILE_POWERSAVE  ] = "powersave"
+};
+
+static struct
+{
+  _Atomic(int)  profile;
+  _Atomic(bool) saving;
+  LGTimer     * timer;
+
+  // render thread state
+  bool          rendererSaving;
+  uint64_t      lastRender;
+}
+l_power = { 0 };
+
+bool power_profileValidate(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_string &&
+      power_profileParse(opt->value.x_string) != POWER_PROFILE_MAX)
+    return true;
+
+  *error = "The power profile must be one of auto, performance or powersave";
+  return false;
+}
+
+PowerProfile power_profileParse(const char * str)
+{
+  for(int i = 0; i < POWER_PROFILE_MAX; ++i)
+    if (strcmp(str, l_profileNames[i]) == 0)
+      return i;
+  return POWER_PROFILE_MAX;
+}
+
+static bool readSupply(const char * supply, const char * attr, char * value,
+    size_t size)
+{
+  char path[256];
+  snprintf(path, sizeof(path), POWER_SUPPLY_PATH "/%s/%s", supply, attr);
+
+  FILE * fp = fopen(path, "r");
+  if (!fp)
+    return false;
+
+  const bool ok = fgets(value, size, fp) != NULL;
+  fclose(fp);
+  if (ok)
+    value[strcspn(value, "\n")] = '\0';
+  return ok;
+}
+
+// true if a system battery is discharging and nothing else supplies power
+static bool onBattery(void)
+{
+  DIR * dir = opendir(POWER_SUPPLY_PATH);
+  if (!dir)
+    return false;
+
+  bool discharging = false;
+  bool external    = false;
+  char value[32];
+
+  struct dirent * ent;
+  while((ent = readdir(dir)))
+  {
+    if (ent->d_name[0] == '.' ||
+        !readSupply(ent->d_name, "type", value, sizeof(value)))
+      continue;
+
+    if (strcmp(value, "Battery") == 0)
+    {
+      // mice, keyboards and the like report their batteries here too
+      if (readSupply(ent->d_name, "scope", value, sizeof(value)) &&
+          strcmp(value, "Device") == 0)
+        continue;
+
+      if (readSupply(ent->d_name, "status", value, sizeof(value)) &&
+          strcmp(value, "Discharging") == 0)
+        discharging = true;
+    }
+    else if (readSupply(ent->d_name, "online", value, sizeof(value)) &&
+        strcmp(value, "1") == 0)
+      external = true;
+  }
+
+  closedir(dir);
+  return discharging && !external;
+}
+
+static void power_update(void)
+{
+  bool saving;
+  switch(atomic_load(&l_power.profile))
+  {
+    case POWER_PROFILE_PERFORMANCE:
+      saving = false;
+      break;
+
+    case POWER_PROFILE_POWERSAVE:
+      saving = true;
+      break;
+
+    default:
+      saving = onBattery();
+      break;
+  }
+
+  if (atomic_exchange(&l_power.saving, saving) == saving)
+    return;
+
+  DEBUG_INFO("Power profile %s, %s", l_profileNames[l_power.profile],
+      saving ? "saving power" : "full performance");
+  overlayStatus_set(LG_USER_STATUS_POWERSAVE, saving);
+  app_invalidateWindow(true);
+}
+
+static bool power_timerFn(void * udata)
+{
+  power_update();
+  return true;
+}
+
+bool power_init(PowerProfile profile)
+{
+  atomic_store(&l_power.profile, profile);
+  power_update();
+
+  /* the battery is watched whatever the profile so the override can switch
+   * back to auto */
+  if (!lgCreateTimerSlack(POWER_CHECK_MS, POWER_CHECK_MS / 2, power_timerFn,
+        NULL, &l_power.timer))
+  {
+    DEBUG_ERROR("Failed to create the power timer");
+    return false;
+  }
+
+  return true;
+}
+
+void power_free(void)
+{
+  if (l_power.timer)
+  {
+    lgTimerDestroy(l_power.timer);
+    l_power.timer = NULL;
+  }
+}
+
+void power_cycleProfile(void)
+{
+  const int profile = (atomic_load(&l_power.profile) + 1) % POWER_PROFILE_MAX;
+  atomic_store(&l_power.profile, profile);
+  app_alert(LG_ALERT_INFO, "Power profile: %s", l_profileNames[profile]);
+  power_update();
+}
+
+bool power_saving(void)
+{
+  return atomic_load_explicit(&l_power.saving, memory_order_relaxed);
+}
+
+unsigned int power_pollInterval(unsigned int interval)
+{
+  return power_saving() ? interval * g_params.powersavePollScale : interval;
+}
+
+bool power_throttleRender(void)
+{
+  const bool saving = power_saving();
+  if (saving != l_power.rendererSaving)
+  {
+    l_power.rendererSaving = saving;
+    if (g_state.lgr->ops.setPowerSave)
+      RENDERER(setPowerSave, saving && !g_params.powersaveFilters);
+  }
+
+  if (!saving)
+    return false;
+
+  /* nothing is seen while hidden, showing the window invalidates it. In JIT
+   * mode the display server already holds back the frames */
+  if (!g_state.jitRender && atomic_load(&g_state.hidden))
+  {
+    nsleep(POWER_HIDDEN_NS);
+    return true;
+  }
+
+  if (g_params.powersaveFps > 0)
+  {
+    const uint64_t interval = 1000000000ULL / g_params.powersaveFps;
+    const uint64_t elapsed  = nanotime() - l_power.lastRender;
+    if (elapsed < interval)
+      nsleep(interval - elapsed);
+    l_power.lastRender = nanotime();
+  }
+
+  return false;
+}
@@ -0,0 +1,59 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_POWER_
+#define _H_LG_POWER_
+
+#include <stdbool.h>
+
+/* The power profile decides if the client saves power, in which case the poll
+ * intervals are lengthened, the render rate is capped, the costly filters are
+ * skipped and nothing is drawn while the window is hidden. Auto saves power
+ * while the machine runs from its battery */
+typedef enum PowerProfile
+{
+  POWER_PROFILE_AUTO,
+  POWER_PROFILE_PERFORMANCE,
+  POWER_PROFILE_POWERSAVE,
+  POWER_PROFILE_MAX
+}
+PowerProfile;
+
+struct Option;
+bool power_profileValidate(struct Option * opt, const char ** error);
+PowerProfile power_profileParse(const char * str);
+
+// starts watching the battery if the profile is auto
+bool power_init(PowerProfile profile);
+void power_free(void);
+
+// the manual override, cycles through the profiles
+void power_cycleProfile(void);
+
+bool power_saving(void);
+
+// the poll interval to use in place of the configured one
+unsigned int power_pollInterval(unsigned int interval);
+
+/* called by the render thread ahead of each render, waits out the render rate
+ * cap. Returns true if the render is to be skipped */
+bool power_throttleRender(void);
+
+#endif
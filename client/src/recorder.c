@@ -0,0 +1,409 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "recorder.h"
+
+#include "common/debug.h"
+#include "common/event.h"
+#include "common/locking.h"
+#include "common/lz4.h"
+#include "common/recording.h"
+#include "common/thread.h"
+#include "common/time.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+
+// must be a power of two
+#define RECORDER_SLOTS 8
+
+struct RecorderSlot
+{
+  // set once the slot is filled, a slot of type zero was abandoned
+  atomic_bool ready;
+  LGRecRecord rec;
+  union
+  {
+    LGRecFrame  frame;
+    LGRecCursor cursor;
+  }
+  hdr;
+
+  uint8_t   * data;
+  size_t      dataSize;
+  size_t      capacity;
+};
+
+struct RecorderState
+{
+  FILE        * file;
+  LGThread    * thread;
+  LGEvent     * event;
+  atomic_bool   running;
+  atomic_bool   failed;
+  uint64_t      start;
+
+  /* slots from tail to head are owned by the writer once ready, a producer
+   * owns the slot it reserved until then */
+  LG_Lock             lock;
+  struct RecorderSlot slots[RECORDER_SLOTS];
+  unsigned int        head;
+  unsigned int        tail;
+  unsigned int        dropped;
+
+  // only used by the frame thread
+  bool          needFull;
+  uint32_t      formatVer;
+  uint8_t     * decoded;
+  size_t        decodedSize;
+
+  // only used by the writer
+  uint8_t     * compressed;
+  size_t        compressedSize;
+  uint64_t      records;
+  uint64_t      written;
+};
+
+static struct RecorderState r = { 0 };
+
+static bool writeRecord(struct RecorderSlot * slot)
+{
+  size_t hdrSize;
+  const void * data = slot->data;
+  size_t size       = slot->dataSize;
+
+  if (slot->rec.type == LGREC_FRAME)
+  {
+    const size_t bound = lz4_compress_bound(size);
+    if (bound > r.compressedSize)
+    {
+      free(r.compressed);
+      r.compressed     = malloc(bound);
+      r.compressedSize = r.compressed ? bound : 0;
+      if (!r.compressed)
+      {
+        DEBUG_ERROR("Out of memory");
+        return false;
+      }
+    }
+
+    size = lz4_compress(slot->data, size, r.compressed, r.compressedSize);
+    if (!size)
+    {
+      DEBUG_ERROR("Failed to compress the frame");
+      return false;
+    }
+
+    data    = r.compressed;
+    hdrSize = sizeof(slot->hdr.frame);
+    slot->hdr.frame.compressedSize = size;
+  }
+  else
+    hdrSize = sizeof(slot->hdr.cursor);
+
+  slot->rec.size = hdrSize + size;
+  if (fwrite(&slot->rec, sizeof(slot->rec), 1, r.file) != 1 ||
+      fwrite(&slot->hdr, hdrSize, 1, r.file) != 1 ||
+      (size && fwrite(data, size, 1, r.file) != 1))
+  {
+    DEBUG_ERROR("Failed to write the recording: %s", strerror(errno));
+    return false;
+  }
+
+  ++r.records;
+  r.written += sizeof(slot->rec) + slot->rec.size;
+  return true;
+}
+
+static int writerThread(void * opaque)
+{
+  while(true)
+  {
+    LG_LOCK(r.lock);
+    struct RecorderSlot * slot = NULL;
+    if (r.tail != r.head)
+    {
+      slot = r.slots + (r.tail & (RECORDER_SLOTS - 1));
+      if (!atomic_load_explicit(&slot->ready, memory_order_acquire))
+        slot = NULL;
+    }
+    LG_UNLOCK(r.lock);
+
+    if (!slot)
+    {
+      if (!atomic_load(&r.running))
+        break;
+
+      lgWaitEvent(r.event, 100);
+      continue;
+    }
+
+    if (slot->rec.type && !atomic_load(&r.failed) && !writeRecord(slot))
+    {
+      DEBUG_ERROR("Recording stopped");
+      atomic_store(&r.failed, true);
+    }
+
+    LG_LOCK(r.lock);
+    atomic_store_explicit(&slot->ready, false, memory_order_relaxed);
+    ++r.tail;
+    LG_UNLOCK(r.lock);
+  }
+
+  return 0;
+}
+
+/* returns a slot for the caller to fill with data of size bytes, or NULL if
+ * the writer is behind and the record must be dropped */
+static struct RecorderSlot * reserve(uint32_t type, size_t size)
+{
+  if (atomic_load_explicit(&r.failed, memory_order_relaxed))
+    return NULL;
+
+  struct RecorderSlot * slot = NULL;
+  LG_LOCK(r.lock);
+  if (r.head - r.tail < RECORDER_SLOTS)
+    slot = r.slots + (r.head++ & (RECORDER_SLOTS - 1));
+  else
+    ++r.dropped;
+  LG_UNLOCK(r.lock);
+
+  if (!slot)
+    return NULL;
+
+  slot->rec.type = type;
+  slot->rec.time = microtime() - r.start;
+  slot->dataSize = size;
+  if (size > slot->capacity)
+  {
+    free(slot->data);
+    slot->data     = malloc(size);
+    slot->capacity = slot->data ? size : 0;
+    if (!slot->data)
+    {
+      DEBUG_ERROR("Out of memory");
+      slot->rec.type = 0;
+      atomic_store_explicit(&slot->ready, true, memory_order_release);
+      return NULL;
+    }
+  }
+
+  return slot;
+}
+
+static void commit(struct RecorderSlot * slot)
+{
+  atomic_store_explicit(&slot->ready, true, memory_order_release);
+  lgSignalEvent(r.event);
+}
+
+bool recorder_init(const char * file)
+{
+  if (!file || !*file)
+    return true;
+
+  LG_LOCK_INIT(r.lock);
+  r.file = fopen(file, "wb");
+  if (!r.file)
+  {
+    DEBUG_ERROR("Failed to open the recording %s: %s", file, strerror(errno));
+    return false;
+  }
+
+  LGRecHeader header =
+  {
+    .magic        = LGREC_MAGIC,
+    .version      = LGREC_VERSION,
+    .kvmfrVersion = KVMFR_VERSION
+  };
+  if (fwrite(&header, sizeof(header), 1, r.file) != 1)
+  {
+    DEBUG_ERROR("Failed to write the recording: %s", strerror(errno));
+    goto fail;
+  }
+
+  r.event = lgCreateEvent(true, 0);
+  if (!r.event)
+  {
+    DEBUG_ERROR("Failed to create the recorder event");
+    goto fail;
+  }
+
+  r.start    = microtime();
+  r.needFull = true;
+  atomic_store(&r.running, true);
+  if (!lgCreateThread("recorder", writerThread, NULL, &r.thread))
+  {
+    DEBUG_ERROR("Failed to create the recorder thread");
+    goto fail;
+  }
+
+  DEBUG_INFO("Recording the stream to: %s", file);
+  return true;
+
+fail:
+  atomic_store(&r.running, false);
+  if (r.event)
+  {
+    lgFreeEvent(r.event);
+    r.event = NULL;
+  }
+  fclose(r.file);
+  r.file = NULL;
+  return false;
+}
+
+void recorder_free(void)
+{
+  if (!r.file)
+    return;
+
+  atomic_store(&r.running, false);
+  lgSignalEvent(r.event);
+  lgJoinThread(r.thread, NULL);
+  r.thread = NULL;
+
+  if (fclose(r.file) != 0)
+    DEBUG_ERROR("Failed to close the recording: %s", strerror(errno));
+  r.file = NULL;
+
+  DEBUG_INFO("Recorded %" PRIu64 " records, %" PRIu64 " bytes, %u dropped",
+      r.records, r.written, r.dropped);
+
+  lgFreeEvent(r.event);
+  r.event = NULL;
+  for(int i = 0; i < RECORDER_SLOTS; ++i)
+  {
+    free(r.slots[i].data);
+    r.slots[i].data     = NULL;
+    r.slots[i].capacity = 0;
+  }
+  free(r.decoded);
+  r.decoded     = NULL;
+  r.decodedSize = 0;
+  free(r.compressed);
+  r.compressed     = NULL;
+  r.compressedSize = 0;
+}
+
+void recorder_frame(const KVMFRFrame * frame, const FrameBuffer * fb,
+    size_t dataSize)
+{
+  if (!r.file)
+    return;
+
+  /* the rects only update the frame before them, after a drop or a format
+   * change the next frame is recorded whole */
+  const unsigned int bpp = recording_rectsBpp(frame->type);
+  const bool full = r.needFull || frame->formatVer != r.formatVer || !bpp ||
+    frame->damageRectsCount == 0;
+
+  const size_t size = full ? dataSize :
+    recording_rectsSize(frame->damageRects, frame->damageRectsCount, bpp);
+
+  struct RecorderSlot * slot = reserve(LGREC_FRAME, size);
+  if (!slot)
+  {
+    r.needFull = true;
+    return;
+  }
+
+  const size_t rows = dataSize / frame->pitch;
+  const uint8_t * src;
+  if (frame->flags & FRAME_FLAG_COMPRESSED)
+  {
+    if (dataSize > r.decodedSize)
+    {
+      free(r.decoded);
+      r.decoded     = malloc(dataSize);
+      r.decodedSize = r.decoded ? dataSize : 0;
+    }
+
+    if (!r.decoded || !framebuffer_read_compressed(fb, r.decoded, frame->pitch,
+          rows, frame->pitch, 1, frame->pitch))
+      goto abandon;
+    src = r.decoded;
+  }
+  else
+  {
+    if (!framebuffer_wait(fb, dataSize))
+      goto abandon;
+    src = framebuffer_get_buffer(fb);
+  }
+
+  if (full)
+    memcpy(slot->data, src, dataSize);
+  else
+    recording_packRects(slot->data, src, frame->pitch, bpp,
+        frame->damageRects, frame->damageRectsCount);
+
+  slot->hdr.frame = (LGRecFrame)
+  {
+    .formatVer        = frame->formatVer,
+    .type             = frame->type,
+    .screenWidth      = frame->screenWidth,
+    .screenHeight     = frame->screenHeight,
+    .frameWidth       = frame->frameWidth,
+    .frameHeight      = frame->frameHeight,
+    .rotation         = frame->rotation,
+    .stride           = frame->stride,
+    .pitch            = frame->pitch,
+    .flags            = full ? LGREC_FRAME_FULL : 0,
+    .damageRectsCount = frame->damageRectsCount,
+    .dataSize         = size
+  };
+  memcpy(slot->hdr.frame.damageRects, frame->damageRects,
+      frame->damageRectsCount * sizeof(*frame->damageRects));
+
+  r.needFull  = false;
+  r.formatVer = frame->formatVer;
+  commit(slot);
+  return;
+
+abandon:
+  slot->rec.type = 0;
+  r.needFull     = true;
+  commit(slot);
+}
+
+void recorder_cursor(uint32_t flags, const KVMFRCursor * cursor,
+    size_t shapeSize)
+{
+  if (!r.file)
+    return;
+
+  struct RecorderSlot * slot = reserve(LGREC_CURSOR, shapeSize);
+  if (!slot)
+    return;
+
+  slot->hdr.cursor = (LGRecCursor)
+  {
+    .flags     = flags,
+    .shapeSize = shapeSize,
+    .cursor    = *cursor
+  };
+  if (shapeSize)
+    memcpy(slot->data, cursor + 1, shapeSize);
+  commit(slot);
+}
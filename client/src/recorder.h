@@ -0,0 +1,43 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_RECORDER_
+#define _H_LG_RECORDER_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "common/KVMFR.h"
+#include "common/framebuffer.h"
+
+/* Records the frames and cursor messages received to a file for the host's
+ * replay capture, see common/recording.h. Frames are copied out before the
+ * message is released and compressed and written by a thread of their own,
+ * if it falls behind records are dropped rather than stalling the client */
+
+bool recorder_init(const char * file);
+void recorder_free(void);
+
+void recorder_frame(const KVMFRFrame * frame, const FrameBuffer * fb,
+    size_t dataSize);
+void recorder_cursor(uint32_t flags, const KVMFRCursor * cursor,
+    size_t shapeSize);
+
+#endif
@@ -20,160 +20,387 @@
 
 #include "render_queue.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
 
 #include "common/ll.h"
+#include "common/locking.h"
+#include "common/debug.h"
+#include "common/rects.h"
+#include "common/util.h"
 #include "main.h"
 #include "overlays.h"
+#include "config_watch.h"
 
-struct ll * l_renderQueue = NULL;
+// must be a power of two
+#define RENDER_QUEUE_LEN  1024
+
+// the dirty rects the spice surface tracks before it is flushed entirely
+#define SPICE_MAX_DIRTY   64
+
+/* single consumer ring of commands, the producers (mostly the spice thread)
+ * are serialized by a lock that the render thread only takes to flush the
+ * spice surface */
+static struct
+{
+  RenderCommand * cmds;
+  atomic_uint     head;
+  atomic_uint     tail;
+
+  LG_Lock         producerLock;
+
+  // used once the ring is full until the consumer has drained it
+  struct ll     * overflow;
+
+  /* the spice display is drawn into this on the cpu as the updates arrive and
+   * the merged dirty area is uploaded once per pass, a count of -1 is all of
+   * it. Guarded by producerLock */
+  struct
+  {
+    uint8_t       * data;
+    int             width, height;
+    int             dirtyCount;
+    FrameDamageRect dirty[SPICE_MAX_DIRTY];
+  }
+  spice;
+
+  // the size the renderer was last configured for, render thread only
+  int spiceWidth, spiceHeight;
+}
+rq = { 0 };
 
 void renderQueue_init(void)
 {
-  l_renderQueue = ll_new();
+  rq.cmds     = malloc(sizeof(*rq.cmds) * RENDER_QUEUE_LEN);
+  rq.overflow = ll_new();
+  if (!rq.cmds)
+    DEBUG_FATAL("Failed to allocate the render queue");
+
+  atomic_init(&rq.head, 0);
+  atomic_init(&rq.tail, 0);
+  LG_LOCK_INIT(rq.producerLock);
 }
 
 void renderQueue_free(void)
 {
-  if (!l_renderQueue)
+  if (!rq.overflow)
     return;
 
   renderQueue_clear();
-  ll_free(l_renderQueue);
+  ll_free(rq.overflow);
+  free(rq.spice.data);
+  free(rq.cmds);
+  LG_LOCK_FREE(rq.producerLock);
+  memset(&rq, 0, sizeof(rq));
+}
+
+static void freeCommandData(RenderCommand * cmd)
+{
+  switch(cmd->op)
+  {
+    case CURSOR_OP_IMAGE:
+      free(cmd->cursorImage.data);
+      break;
+
+    default:
+      break;
+  }
 }
 
 void renderQueue_clear(void)
 {
+  unsigned int tail = atomic_load_explicit(&rq.tail, memory_order_relaxed);
+  const unsigned int head =
+    atomic_load_explicit(&rq.head, memory_order_acquire);
+
+  for(; tail != head; ++tail)
+    freeCommandData(rq.cmds + (tail & (RENDER_QUEUE_LEN - 1)));
+  atomic_store_explicit(&rq.tail, tail, memory_order_release);
+
   RenderCommand * cmd;
-  while(ll_shift(l_renderQueue, (void **)&cmd))
+  while(ll_shift(rq.overflow, (void **)&cmd))
   {
-    if (cmd->op == SPICE_OP_DRAW_BITMAP)
-      free(cmd->spiceDrawBitmap.data);
+    freeCommandData(cmd);
     free(cmd);
   }
 }
 
+// call with producerLock held
+static void pushCommand(const RenderCommand * cmd)
+{
+  const unsigned int head =
+    atomic_load_explicit(&rq.head, memory_order_relaxed);
+  const unsigned int tail =
+    atomic_load_explicit(&rq.tail, memory_order_acquire);
+
+  /* once anything has overflowed everything must follow it there until the
+   * consumer catches up, or commands would be run out of order */
+  if (ll_count(rq.overflow) == 0 && head - tail < RENDER_QUEUE_LEN)
+  {
+    rq.cmds[head & (RENDER_QUEUE_LEN - 1)] = *cmd;
+    atomic_store_explicit(&rq.head, head + 1, memory_order_release);
+    return;
+  }
+
+  RenderCommand * copy = malloc(sizeof(*copy));
+  memcpy(copy, cmd, sizeof(*copy));
+  ll_push(rq.overflow, copy);
+}
+
+/* call with producerLock held, clips the rect to the surface and returns
+ * false if nothing of it is left */
+static bool spiceClip(int * x, int * y, int * width, int * height,
+    int * skipX, int * skipY)
+{
+  *skipX = *x < 0 ? -*x : 0;
+  *skipY = *y < 0 ? -*y : 0;
+  const int x1 = *x + *skipX;
+  const int y1 = *y + *skipY;
+  const int x2 = min(*x + *width , rq.spice.width );
+  const int y2 = min(*y + *height, rq.spice.height);
+  if (!rq.spice.data || x1 >= x2 || y1 >= y2)
+    return false;
+
+  *x      = x1;
+  *y      = y1;
+  *width  = x2 - x1;
+  *height = y2 - y1;
+  return true;
+}
+
+// call with producerLock held
+static void spiceAddDirty(int x, int y, int width, int height)
+{
+  if (rq.spice.dirtyCount < 0)
+    return;
+
+  if (rq.spice.dirtyCount == SPICE_MAX_DIRTY)
+  {
+    rq.spice.dirtyCount = rectsMergeOverlapping(rq.spice.dirty,
+        rq.spice.dirtyCount);
+    if (rq.spice.dirtyCount == SPICE_MAX_DIRTY)
+    {
+      rq.spice.dirtyCount = -1;
+      return;
+    }
+  }
+
+  rq.spice.dirty[rq.spice.dirtyCount++] = (FrameDamageRect)
+  {
+    .x      = x,
+    .y      = y,
+    .width  = width,
+    .height = height
+  };
+}
+
 void renderQueue_spiceConfigure(int width, int height)
 {
-  RenderCommand * cmd = malloc(sizeof(*cmd));
-  cmd->op                    = SPICE_OP_CONFIGURE;
-  cmd->spiceConfigure.width  = width;
-  cmd->spiceConfigure.height = height;
-  ll_push(l_renderQueue, cmd);
+  RenderCommand cmd;
+  cmd.op                    = SPICE_OP_CONFIGURE;
+  cmd.spiceConfigure.width  = width;
+  cmd.spiceConfigure.height = height;
+
+  LG_LOCK(rq.producerLock);
+  if (width != rq.spice.width || height != rq.spice.height)
+  {
+    free(rq.spice.data);
+    rq.spice.data   = calloc((size_t)width * height, 4);
+    rq.spice.width  = rq.spice.data ? width  : 0;
+    rq.spice.height = rq.spice.data ? height : 0;
+    if (!rq.spice.data)
+      DEBUG_ERROR("Failed to allocate the spice surface");
+  }
+  rq.spice.dirtyCount = -1;
+  pushCommand(&cmd);
+  LG_UNLOCK(rq.producerLock);
+
   app_invalidateWindow(true);
 }
 
 void renderQueue_spiceDrawFill(int x, int y, int width, int height,
     uint32_t color)
 {
-  RenderCommand * cmd = malloc(sizeof(*cmd));
-  cmd->op                   = SPICE_OP_DRAW_FILL;
-  cmd->spiceFillRect.x      = x;
-  cmd->spiceFillRect.y      = y;
-  cmd->spiceFillRect.width  = width;
-  cmd->spiceFillRect.height = height;
-  cmd->spiceFillRect.color  = color;
-  ll_push(l_renderQueue, cmd);
+  int skipX, skipY;
+  LG_LOCK(rq.producerLock);
+  if (spiceClip(&x, &y, &width, &height, &skipX, &skipY))
+  {
+    const size_t pitch = (size_t)rq.spice.width * 4;
+    uint32_t * row = (uint32_t *)(rq.spice.data + y * pitch) + x;
+    for(int i = 0; i < width; ++i)
+      row[i] = color;
+
+    for(int i = 1; i < height; ++i)
+      memcpy(rq.spice.data + (y + i) * pitch + x * 4, row, width * 4);
+
+    spiceAddDirty(x, y, width, height);
+  }
+  LG_UNLOCK(rq.producerLock);
+
   app_invalidateWindow(true);
 }
 
 void renderQueue_spiceDrawBitmap(int x, int y, int width, int height, int stride,
     void * data, bool topDown)
 {
-  RenderCommand * cmd = malloc(sizeof(*cmd));
-  cmd->op                      = SPICE_OP_DRAW_BITMAP;
-  cmd->spiceDrawBitmap.x       = x;
-  cmd->spiceDrawBitmap.y       = y;
-  cmd->spiceDrawBitmap.width   = width;
-  cmd->spiceDrawBitmap.height  = height;
-  cmd->spiceDrawBitmap.stride  = stride;
-  cmd->spiceDrawBitmap.data    = malloc(height * stride);
-  cmd->spiceDrawBitmap.topDown = topDown;
-  memcpy(cmd->spiceDrawBitmap.data, data, height * stride);
-  ll_push(l_renderQueue, cmd);
+  const int srcHeight = height;
+  int skipX, skipY;
+  LG_LOCK(rq.producerLock);
+  if (spiceClip(&x, &y, &width, &height, &skipX, &skipY))
+  {
+    const size_t pitch = (size_t)rq.spice.width * 4;
+    for(int i = 0; i < height; ++i)
+    {
+      const int srcRow = topDown ?
+        skipY + i : srcHeight - 1 - (skipY + i);
+      memcpy(rq.spice.data + (y + i) * pitch + x * 4,
+          (uint8_t *)data + (size_t)srcRow * stride + skipX * 4, width * 4);
+    }
+
+    spiceAddDirty(x, y, width, height);
+  }
+  LG_UNLOCK(rq.producerLock);
+
   app_invalidateWindow(true);
 }
 
 void renderQueue_spiceShow(bool show)
 {
-  RenderCommand * cmd = malloc(sizeof(*cmd));
-  cmd->op             = SPICE_OP_SHOW;
-  cmd->spiceShow.show = show;
-  ll_push(l_renderQueue, cmd);
+  RenderCommand cmd;
+  cmd.op             = SPICE_OP_SHOW;
+  cmd.spiceShow.show = show;
+  INTERLOCKED_SECTION(rq.producerLock, pushCommand(&cmd););
   app_invalidateWindow(true);
 }
 
 void renderQueue_cursorState(bool visible, int x, int y, int hx, int hy)
 {
-  RenderCommand * cmd      = malloc(sizeof(*cmd));
-  cmd->op                  = CURSOR_OP_STATE;
-  cmd->cursorState.visible = visible;
-  cmd->cursorState.x       = x;
-  cmd->cursorState.y       = y;
-  cmd->cursorState.hx      = hx;
-  cmd->cursorState.hy      = hy;
-  ll_push(l_renderQueue, cmd);
+  RenderCommand cmd;
+  cmd.op                  = CURSOR_OP_STATE;
+  cmd.cursorState.visible = visible;
+  cmd.cursorState.x       = x;
+  cmd.cursorState.y       = y;
+  cmd.cursorState.hx      = hx;
+  cmd.cursorState.hy      = hy;
+  INTERLOCKED_SECTION(rq.producerLock, pushCommand(&cmd););
 }
 
 void renderQueue_cursorImage(bool monochrome, int width, int height, int pitch,
     uint8_t * data)
 {
-  RenderCommand * cmd         = malloc(sizeof(*cmd));
-  cmd->op                     = CURSOR_OP_IMAGE;
-  cmd->cursorImage.monochrome = monochrome;
-  cmd->cursorImage.width      = width;
-  cmd->cursorImage.height     = height;
-  cmd->cursorImage.pitch      = pitch;
-  cmd->cursorImage.data       = data;
-  ll_push(l_renderQueue, cmd);
+  RenderCommand cmd;
+  cmd.op                     = CURSOR_OP_IMAGE;
+  cmd.cursorImage.monochrome = monochrome;
+  cmd.cursorImage.width      = width;
+  cmd.cursorImage.height     = height;
+  cmd.cursorImage.pitch      = pitch;
+  cmd.cursorImage.data       = data;
+  INTERLOCKED_SECTION(rq.producerLock, pushCommand(&cmd););
 }
 
-void renderQueue_process(void)
+void renderQueue_configReload(void)
 {
-  RenderCommand * cmd;
-  while(ll_shift(l_renderQueue, (void **)&cmd))
+  RenderCommand cmd;
+  cmd.op = CONFIG_OP_RELOAD;
+  INTERLOCKED_SECTION(rq.producerLock, pushCommand(&cmd););
+  app_invalidateWindow(true);
+}
+
+static void processCommand(RenderCommand * cmd)
+{
+  switch(cmd->op)
   {
-    switch(cmd->op)
+    case SPICE_OP_CONFIGURE:
+      RENDERER(spiceConfigure,
+          cmd->spiceConfigure.width, cmd->spiceConfigure.height);
+      rq.spiceWidth  = cmd->spiceConfigure.width;
+      rq.spiceHeight = cmd->spiceConfigure.height;
+      break;
+
+    case SPICE_OP_SHOW:
+      RENDERER(spiceShow, cmd->spiceShow.show);
+      if (cmd->spiceShow.show)
+        overlaySplash_show(false);
+      break;
+
+    case CURSOR_OP_STATE:
+      RENDERER(onMouseEvent, cmd->cursorState.visible, cmd->cursorState.x,
+          cmd->cursorState.y, cmd->cursorState.hx, cmd->cursorState.hy);
+      break;
+
+    case CURSOR_OP_IMAGE:
+      RENDERER(onMouseShape,
+          cmd->cursorImage.monochrome ? LG_CURSOR_MONOCHROME : LG_CURSOR_COLOR,
+          cmd->cursorImage.width, cmd->cursorImage.height,
+          cmd->cursorImage.pitch, cmd->cursorImage.data, 0);
+      free(cmd->cursorImage.data);
+      break;
+
+    case CONFIG_OP_RELOAD:
+      configWatch_reload();
+      break;
+  }
+}
+
+/* uploads everything drawn to the spice surface since the last pass as one
+ * batch of merged rects straight from the surface */
+static void flushSpice(void)
+{
+  LG_LOCK(rq.producerLock);
+
+  // wait for the renderer to be configured for a resize before uploading
+  if (!rq.spice.data || rq.spice.dirtyCount == 0 ||
+      rq.spice.width  != rq.spiceWidth ||
+      rq.spice.height != rq.spiceHeight)
+  {
+    LG_UNLOCK(rq.producerLock);
+    return;
+  }
+
+  const int pitch = rq.spice.width * 4;
+  int count = rq.spice.dirtyCount;
+  if (count > 0)
+    count = rectsOptimize(rq.spice.dirty, count, SPICE_MAX_DIRTY,
+        rq.spice.width, rq.spice.height, 75);
+
+  if (count <= 0)
+    RENDERER(spiceDrawBitmap, 0, 0, rq.spice.width, rq.spice.height, pitch,
+        rq.spice.data, true);
+  else
+    for(int i = 0; i < count; ++i)
     {
-      case SPICE_OP_CONFIGURE:
-        RENDERER(spiceConfigure,
-            cmd->spiceConfigure.width, cmd->spiceConfigure.height);
-        break;
-
-      case SPICE_OP_DRAW_FILL:
-        RENDERER(spiceDrawFill,
-            cmd->spiceFillRect.x    , cmd->spiceFillRect.y,
-            cmd->spiceFillRect.width, cmd->spiceFillRect.height,
-            cmd->spiceFillRect.color);
-        break;
-
-      case SPICE_OP_DRAW_BITMAP:
-        RENDERER(spiceDrawBitmap,
-            cmd->spiceDrawBitmap.x     , cmd->spiceDrawBitmap.y,
-            cmd->spiceDrawBitmap.width , cmd->spiceDrawBitmap.height,
-            cmd->spiceDrawBitmap.stride, cmd->spiceDrawBitmap.data,
-            cmd->spiceDrawBitmap.topDown);
-        free(cmd->spiceDrawBitmap.data);
-        break;
-
-      case SPICE_OP_SHOW:
-        RENDERER(spiceShow, cmd->spiceShow.show);
-        if (cmd->spiceShow.show)
-          overlaySplash_show(false);
-        break;
-
-      case CURSOR_OP_STATE:
-        RENDERER(onMouseEvent, cmd->cursorState.visible, cmd->cursorState.x,
-            cmd->cursorState.y, cmd->cursorState.hx, cmd->cursorState.hy);
-        break;
-
-      case CURSOR_OP_IMAGE:
-        RENDERER(onMouseShape,
-            cmd->cursorImage.monochrome ? LG_CURSOR_MONOCHROME : LG_CURSOR_COLOR,
-            cmd->cursorImage.width, cmd->cursorImage.height,
-            cmd->cursorImage.pitch, cmd->cursorImage.data);
-        free(cmd->cursorImage.data);
+      const FrameDamageRect * rect = rq.spice.dirty + i;
+      RENDERER(spiceDrawBitmap, rect->x, rect->y, rect->width, rect->height,
+          pitch, rq.spice.data + rect->y * pitch + rect->x * 4, true);
     }
+
+  rq.spice.dirtyCount = 0;
+  LG_UNLOCK(rq.producerLock);
+}
+
+void renderQueue_process(void)
+{
+  unsigned int tail = atomic_load_explicit(&rq.tail, memory_order_relaxed);
+  unsigned int head;
+
+  /* the ring must be seen empty before the overflow list is drained, anything
+   * pushed to the ring after that point is newer than the overflow */
+  while(tail != (head = atomic_load_explicit(&rq.head, memory_order_acquire)))
+  {
+    for(; tail != head; ++tail)
+      processCommand(rq.cmds + (tail & (RENDER_QUEUE_LEN - 1)));
+
+    // the slots are only handed back once the commands are done with
+    atomic_store_explicit(&rq.tail, tail, memory_order_release);
+  }
+
+  RenderCommand * cmd;
+  while(ll_shift(rq.overflow, (void **)&cmd))
+  {
+    processCommand(cmd);
     free(cmd);
   }
+
+  flushSpice();
 }
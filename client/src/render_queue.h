@@ -25,11 +25,10 @@ typedef struct
   enum
   {
     SPICE_OP_CONFIGURE,
-    SPICE_OP_DRAW_FILL,
-    SPICE_OP_DRAW_BITMAP,
     SPICE_OP_SHOW,
     CURSOR_OP_STATE,
     CURSOR_OP_IMAGE,
+    CONFIG_OP_RELOAD,
   }
   op;
 
@@ -41,24 +40,6 @@ typedef struct
     }
     spiceConfigure;
 
-    struct
-    {
-      int      x, y;
-      int      width, height;
-      uint32_t color;
-    }
-    spiceFillRect;
-
-    struct
-    {
-      int       x    , y;
-      int       width, height;
-      int       stride;
-      uint8_t * data;
-      bool      topDown;
-    }
-    spiceDrawBitmap;
-
     struct
     {
       bool show;
@@ -107,3 +88,5 @@ void renderQueue_cursorState(bool visible, int x, int y, int hx, int hy);
 
 void renderQueue_cursorImage(bool monochrome, int width, int height, int pitch,
     uint8_t * data);
+
+void renderQueue_configReload(void);
@@ -0,0 +1,361 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#if ENABLE_AUDIO
+
+#include "../resamplers.h"
+#include "common/debug.h"
+#include "common/util.h"
+#include "common/cpuinfo.h"
+
+#include <math.h>
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define POLYPHASE_X86
+#include <immintrin.h>
+#endif
+
+/* A windowed sinc polyphase resampler tuned for the small ratio corrections
+ * made by the playback clock recovery. The filter response does not depend
+ * on the ratio so it can change freely on every call at no cost, the
+ * fractional position between phases is linearly interpolated. */
+
+#define TAPS    32
+#define PHASES  256
+#define CUTOFF  0.90
+#define BETA    8.6
+#define BLOCK   1024
+
+// the frames of zeros the buffer starts with, the first output is centred
+// on the first input frame
+#define PRIMING (TAPS / 2 - 1)
+
+typedef void (*InterpFn)(float * restrict dst, const float * restrict a,
+    const float * restrict b, float frac);
+typedef float (*DotFn)(const float * restrict x, const float * restrict h);
+
+struct Kernel
+{
+  unsigned int features;
+  const char * name;
+  InterpFn     interp;
+  DotFn        dot;
+};
+
+struct Polyphase
+{
+  int    channels;
+  int    frames;
+  double pos;
+
+  // planar input history, TAPS + BLOCK frames per channel
+  float * buffer;
+};
+
+static bool initialized = false;
+static alignas(32) float coeffs[PHASES + 1][TAPS];
+static const struct Kernel * kernel = NULL;
+
+static void interpScalar(float * restrict dst, const float * restrict a,
+    const float * restrict b, float frac)
+{
+  for(int i = 0; i < TAPS; ++i)
+    dst[i] = a[i] + (b[i] - a[i]) * frac;
+}
+
+static float dotScalar(const float * restrict x, const float * restrict h)
+{
+  float acc = 0.0f;
+  for(int i = 0; i < TAPS; ++i)
+    acc += x[i] * h[i];
+  return acc;
+}
+
+#ifdef POLYPHASE_X86
+static void interpSSE(float * restrict dst, const float * restrict a,
+    const float * restrict b, float frac)
+{
+  const __m128 f = _mm_set1_ps(frac);
+  for(int i = 0; i < TAPS; i += 4)
+  {
+    const __m128 va = _mm_load_ps(a + i);
+    const __m128 vb = _mm_load_ps(b + i);
+    _mm_store_ps(dst + i, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), f)));
+  }
+}
+
+static float dotSSE(const float * restrict x, const float * restrict h)
+{
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  for(int i = 0; i < TAPS; i += 8)
+  {
+    acc0 = _mm_add_ps(acc0,
+        _mm_mul_ps(_mm_loadu_ps(x + i    ), _mm_load_ps(h + i    )));
+    acc1 = _mm_add_ps(acc1,
+        _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_load_ps(h + i + 4)));
+  }
+
+  __m128 acc = _mm_add_ps(acc0, acc1);
+  acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+  acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+  return _mm_cvtss_f32(acc);
+}
+
+__attribute__((target("avx2,fma")))
+static void interpAVX2(float * restrict dst, const float * restrict a,
+    const float * restrict b, float frac)
+{
+  const __m256 f = _mm256_set1_ps(frac);
+  for(int i = 0; i < TAPS; i += 8)
+  {
+    const __m256 va = _mm256_load_ps(a + i);
+    const __m256 vb = _mm256_load_ps(b + i);
+    _mm256_store_ps(dst + i, _mm256_fmadd_ps(_mm256_sub_ps(vb, va), f, va));
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static float dotAVX2(const float * restrict x, const float * restrict h)
+{
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  for(int i = 0; i < TAPS; i += 16)
+  {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i    ),
+        _mm256_load_ps(h + i    ), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8),
+        _mm256_load_ps(h + i + 8), acc1);
+  }
+
+  const __m256 acc = _mm256_add_ps(acc0, acc1);
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc),
+      _mm256_extractf128_ps(acc, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum);
+}
+
+#endif
+
+// ordered from the most to the least demanding for LG_CPU_DISPATCH
+static const struct Kernel kernels[] =
+{
+#ifdef POLYPHASE_X86
+  {
+    .features = CPU_FEATURE_AVX2 | CPU_FEATURE_FMA,
+    .name     = "AVX2",
+    .interp   = interpAVX2,
+    .dot      = dotAVX2
+  },
+  {
+    .features = CPU_FEATURE_SSE2,
+    .name     = "SSE",
+    .interp   = interpSSE,
+    .dot      = dotSSE
+  },
+#endif
+  {
+    .features = 0,
+    .name     = "Scalar",
+    .interp   = interpScalar,
+    .dot      = dotScalar
+  },
+};
+
+// zeroth order modified bessel function of the first kind for the window
+static double besselI0(double x)
+{
+  double sum  = 1.0;
+  double term = 1.0;
+  for(int k = 1; k < 32; ++k)
+  {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum  += term;
+  }
+  return sum;
+}
+
+static void buildCoeffs(void)
+{
+  const double half = TAPS / 2.0;
+  const double norm = besselI0(BETA);
+
+  for(int p = 0; p <= PHASES; ++p)
+  {
+    const double frac = (double)p / PHASES;
+    double sum = 0.0;
+    double row[TAPS];
+
+    for(int j = 0; j < TAPS; ++j)
+    {
+      // distance of this tap from the output position in input frames
+      const double u = j - (TAPS / 2 - 1) - frac;
+      const double x = M_PI * CUTOFF * u;
+      const double sinc = fabs(x) < 1e-9 ? 1.0 : sin(x) / x;
+      const double w = u / half;
+      const double window = fabs(w) >= 1.0 ? 0.0 :
+        besselI0(BETA * sqrt(1.0 - w * w)) / norm;
+
+      row[j] = sinc * window;
+      sum   += row[j];
+    }
+
+    // normalise each phase for unity gain at DC
+    for(int j = 0; j < TAPS; ++j)
+      coeffs[p][j] = row[j] / sum;
+  }
+
+  kernel = LG_CPU_DISPATCH(kernels);
+
+  DEBUG_INFO("Polyphase resampler : %s", kernel->name);
+  initialized = true;
+}
+
+static bool polyphase_reset(void * opaque)
+{
+  struct Polyphase * this = opaque;
+  memset(this->buffer, 0,
+      this->channels * (TAPS + BLOCK) * sizeof(*this->buffer));
+  this->frames = PRIMING;
+  this->pos    = 0.0;
+  return true;
+}
+
+static void * polyphase_create(int channels)
+{
+  if (!initialized)
+    buildCoeffs();
+
+  struct Polyphase * this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("out of memory");
+    return NULL;
+  }
+
+  this->channels = channels;
+  this->buffer   = malloc(channels * (TAPS + BLOCK) * sizeof(*this->buffer));
+  if (!this->buffer)
+  {
+    DEBUG_ERROR("out of memory");
+    free(this);
+    return NULL;
+  }
+
+  polyphase_reset(this);
+  return this;
+}
+
+static void polyphase_free(void * opaque)
+{
+  struct Polyphase * this = opaque;
+  if (!this)
+    return;
+
+  free(this->buffer);
+  free(this);
+}
+
+static bool polyphase_process(void * opaque, const float * in, int inFrames,
+    int * inUsed, float * out, int outFrames, int * outGen, double ratio)
+{
+  struct Polyphase * this = opaque;
+  const int    channels = this->channels;
+  const int    stride   = TAPS + BLOCK;
+  const double step     = 1.0 / ratio;
+
+  alignas(32) float h[TAPS];
+  int used = 0;
+  int gen  = 0;
+
+  for(;;)
+  {
+    // generate output while there is enough input buffered
+    while (gen < outFrames)
+    {
+      const int i = (int)this->pos;
+      if (i + TAPS > this->frames)
+        break;
+
+      const double phase = (this->pos - i) * PHASES;
+      const int    p     = (int)phase;
+      kernel->interp(h, coeffs[p], coeffs[p + 1], phase - p);
+
+      for(int c = 0; c < channels; ++c)
+        out[gen * channels + c] =
+          kernel->dot(this->buffer + c * stride + i, h);
+
+      ++gen;
+      this->pos += step;
+    }
+
+    if (gen == outFrames)
+      break;
+
+    // discard the input that is no longer needed
+    const int drop = min((int)this->pos, this->frames);
+    if (drop > 0)
+    {
+      for(int c = 0; c < channels; ++c)
+      {
+        float * buf = this->buffer + c * stride;
+        memmove(buf, buf + drop, (this->frames - drop) * sizeof(*buf));
+      }
+      this->frames -= drop;
+      this->pos    -= drop;
+    }
+
+    if (used == inFrames)
+      break;
+
+    // deinterleave as much new input as will fit
+    const int count = min(inFrames - used, stride - this->frames);
+    const float * src = in + used * channels;
+    for(int c = 0; c < channels; ++c)
+    {
+      float * dst = this->buffer + c * stride + this->frames;
+      for(int f = 0; f < count; ++f)
+        dst[f] = src[f * channels + c];
+    }
+
+    this->frames += count;
+    used         += count;
+  }
+
+  *inUsed = used;
+  *outGen = gen;
+  return true;
+}
+
+const struct LG_ResamplerOps LGResamplerPolyphase =
+{
+  .name    = "Polyphase",
+  .code    = "polyphase",
+  .create  = polyphase_create,
+  .free    = polyphase_free,
+  .reset   = polyphase_reset,
+  .process = polyphase_process
+};
+
+#endif
@@ -0,0 +1,92 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#if ENABLE_AUDIO
+
+#include "../resamplers.h"
+#include "common/debug.h"
+
+#include <samplerate.h>
+
+static void * samplerate_create(int channels)
+{
+  int error;
+  SRC_STATE * src = src_new(SRC_SINC_FASTEST, channels, &error);
+  if (!src)
+    DEBUG_ERROR("Failed to create resampler: %s", src_strerror(error));
+
+  return src;
+}
+
+static void samplerate_free(void * opaque)
+{
+  src_delete(opaque);
+}
+
+static bool samplerate_reset(void * opaque)
+{
+  int error = src_reset(opaque);
+  if (error)
+  {
+    DEBUG_ERROR("Failed to reset resampler: %s", src_strerror(error));
+    return false;
+  }
+
+  return true;
+}
+
+static bool samplerate_process(void * opaque, const float * in, int inFrames,
+    int * inUsed, float * out, int outFrames, int * outGen, double ratio)
+{
+  SRC_DATA srcData =
+  {
+    .data_in           = in,
+    .data_out          = out,
+    .input_frames      = inFrames,
+    .output_frames     = outFrames,
+    .input_frames_used = 0,
+    .output_frames_gen = 0,
+    .end_of_input      = 0,
+    .src_ratio         = ratio
+  };
+
+  int error = src_process(opaque, &srcData);
+  if (error)
+  {
+    DEBUG_ERROR("Resampling failed: %s", src_strerror(error));
+    return false;
+  }
+
+  *inUsed = srcData.input_frames_used;
+  *outGen = srcData.output_frames_gen;
+  return true;
+}
+
+const struct LG_ResamplerOps LGResamplerSampleRate =
+{
+  .name    = "libsamplerate",
+  .code    = "samplerate",
+  .create  = samplerate_create,
+  .free    = samplerate_free,
+  .reset   = samplerate_reset,
+  .process = samplerate_process
+};
+
+#endif
@@ -0,0 +1,51 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_RESAMPLERS_H
+#define _H_RESAMPLERS_H
+
+#include <stdbool.h>
+
+struct LG_ResamplerOps
+{
+  // human readable name and the value used to select it in the config
+  const char * name;
+  const char * code;
+
+  // create a resampler for interleaved float frames of the channel count
+  void * (*create)(int channels);
+  void   (*free)(void * opaque);
+
+  // discard any buffered input so it is ready for a new stream
+  bool   (*reset)(void * opaque);
+
+  /* resample inFrames of input into at most outFrames of output at the ratio
+   * (output rate / input rate), this is expected to change slightly on every
+   * call. Returns the number of input frames used and output frames generated,
+   * the caller must call again with the remaining input if not all was used */
+  bool   (*process)(void * opaque, const float * in, int inFrames,
+             int * inUsed, float * out, int outFrames, int * outGen,
+             double ratio);
+};
+
+extern const struct LG_ResamplerOps LGResamplerSampleRate;
+extern const struct LG_ResamplerOps LGResamplerPolyphase;
+
+#endif
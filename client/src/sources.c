@@ -0,0 +1,403 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "sources.h"
+#include "main.h"
+#include "power.h"
+
+#include "common/array.h"
+#include "common/util.h"
+#include "common/debug.h"
+#include "common/ivshmem.h"
+#include "common/KVMFR.h"
+#include "common/locking.h"
+#include "common/thread.h"
+#include "common/time.h"
+
+#include <lgmp/client.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+// how long to wait before trying a host that is not running again
+#define SOURCE_RETRY_MS 1000
+
+struct Source
+{
+  unsigned int   index;
+  struct IVSHMEM shm;
+  PLGMPClient    lgmp;
+  LGThread     * thread;
+  uint64_t       lastFrame;
+};
+
+struct SourcesState
+{
+  struct Source sources[LG_MAX_SOURCES - 1];
+  unsigned int  count;
+  atomic_bool   running;
+};
+
+static struct SourcesState s = { 0 };
+
+static bool sourceSleep(unsigned int ms)
+{
+  for (unsigned int i = 0; i < ms / 10 && atomic_load(&s.running); ++i)
+    usleep(10000);
+  return atomic_load(&s.running);
+}
+
+static bool sourceFormat(const KVMFRFrame * frame, LG_RendererFormat * format)
+{
+  format->type         = frame->type;
+  format->screenWidth  = frame->screenWidth;
+  format->screenHeight = frame->screenHeight;
+  format->frameWidth   = frame->frameWidth;
+  format->frameHeight  = frame->frameHeight;
+  format->stride       = frame->stride;
+  format->pitch        = frame->pitch;
+  format->compressed   = frame->flags & FRAME_FLAG_COMPRESSED;
+
+  switch(frame->rotation)
+  {
+    case FRAME_ROT_0  : format->rotate = LG_ROTATE_0  ; break;
+    case FRAME_ROT_90 : format->rotate = LG_ROTATE_90 ; break;
+    case FRAME_ROT_180: format->rotate = LG_ROTATE_180; break;
+    case FRAME_ROT_270: format->rotate = LG_ROTATE_270; break;
+    default:
+      format->rotate = LG_ROTATE_0;
+      break;
+  }
+
+  switch(frame->type)
+  {
+    case FRAME_TYPE_RGBA:
+    case FRAME_TYPE_BGRA:
+    case FRAME_TYPE_RGBA10:
+    case FRAME_TYPE_RGBA10_PQ:
+    case FRAME_TYPE_NV12:
+      format->bpp = 32;
+      return true;
+
+    case FRAME_TYPE_RGBA16F:
+      format->bpp = 64;
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+// true if the pointer is over the source's cell
+static bool sourceFocused(struct Source * src)
+{
+  if (!g_cursor.inWindow)
+    return false;
+
+  const LG_RendererRect cell = lgSourceCell(g_params.sourceLayout,
+      sources_count(), src->index, g_state.windowW, g_state.windowH);
+
+  return
+    g_cursor.pos.x >= cell.x && g_cursor.pos.x < cell.x + cell.w &&
+    g_cursor.pos.y >= cell.y && g_cursor.pos.y < cell.y + cell.h;
+}
+
+/* holds the frame back until the preview interval has passed. As the frame is
+ * not released yet the host waits too instead of capturing frames that would
+ * only be dropped here, and the damage of the frames it does not send is
+ * carried into the next */
+static void sourceThrottle(struct Source * src)
+{
+  // read once, a config reload may change it
+  const unsigned int fps = g_params.previewFps;
+  if (!fps)
+    return;
+
+  const uint64_t interval = 1000000000ULL / fps;
+  while(atomic_load(&s.running) && !sourceFocused(src))
+  {
+    const uint64_t now = nanotime();
+    if (now - src->lastFrame >= interval)
+      break;
+
+    usleep(min((src->lastFrame + interval - now) / 1000, 10000));
+  }
+}
+
+/* follows one host session of the source, returns false if the source can not
+ * be shown and its thread should exit */
+static bool sourceSession(struct Source * src)
+{
+  LGMP_STATUS status;
+  uint32_t    udataSize;
+  KVMFR     * udata;
+
+  while ((status = lgmpClientSessionInit(src->lgmp, &udataSize,
+          (uint8_t **)&udata, NULL)) != LGMP_OK)
+  {
+    if (status != LGMP_ERR_INVALID_SESSION &&
+        status != LGMP_ERR_INVALID_MAGIC   &&
+        status != LGMP_ERR_INVALID_VERSION)
+    {
+      DEBUG_ERROR("Source %u: lgmpClientSessionInit Failed: %s", src->index,
+          lgmpStatusString(status));
+      return false;
+    }
+
+    if (!sourceSleep(SOURCE_RETRY_MS))
+      return false;
+  }
+
+  if (udataSize < sizeof(*udata) ||
+      memcmp(udata->magic, KVMFR_MAGIC, sizeof(udata->magic)) != 0 ||
+      udata->version != KVMFR_VERSION)
+  {
+    DEBUG_ERROR("Source %u: the host application is not compatible",
+        src->index);
+    return false;
+  }
+
+  PLGMPClientQueue queue;
+  while(atomic_load(&s.running))
+  {
+    status = lgmpClientSubscribe(src->lgmp, LGMP_Q_FRAME, &queue);
+    if (status == LGMP_OK)
+      break;
+
+    if (status == LGMP_ERR_NO_SUCH_QUEUE)
+    {
+      usleep(1000);
+      continue;
+    }
+
+    DEBUG_ERROR("Source %u: lgmpClientSubscribe Failed: %s", src->index,
+        lgmpStatusString(status));
+    return false;
+  }
+
+  if (!atomic_load(&s.running))
+    return false;
+
+  DEBUG_INFO("Source %u: connected to the host", src->index);
+
+  bool              ok          = true;
+  bool              formatValid = false;
+  uint32_t          formatVer   = 0;
+  uint32_t          frameSerial = 0;
+  LG_RendererFormat format      = { 0 };
+
+  while(atomic_load(&s.running))
+  {
+    LGMPMessage msg;
+    if ((status = lgmpClientProcess(queue, &msg)) != LGMP_OK)
+    {
+      if (status == LGMP_ERR_QUEUE_EMPTY)
+      {
+        usleep(power_pollInterval(g_params.framePollInterval));
+        continue;
+      }
+
+      // the host restarted, wait for the new session
+      if (status != LGMP_ERR_INVALID_SESSION)
+      {
+        DEBUG_ERROR("Source %u: lgmpClientProcess Failed: %s", src->index,
+            lgmpStatusString(status));
+        ok = false;
+      }
+      break;
+    }
+
+    KVMFRFrame * frame = (KVMFRFrame *)msg.mem;
+    if (formatValid && frame->frameSerial == frameSerial)
+    {
+      lgmpClientMessageDone(queue);
+      continue;
+    }
+    frameSerial = frame->frameSerial;
+    sourceThrottle(src);
+
+    const bool compressed = frame->flags & FRAME_FLAG_COMPRESSED;
+    if (!formatValid || frame->formatVer != formatVer ||
+        compressed != format.compressed)
+    {
+      if (!sourceFormat(frame, &format))
+      {
+        DEBUG_ERROR("Source %u: unsupported frame type", src->index);
+        lgmpClientMessageDone(queue);
+        ok = false;
+        break;
+      }
+
+      formatValid = RENDERER(onSourceFormat, src->index, format);
+
+      if (!formatValid)
+      {
+        DEBUG_ERROR("Source %u: the renderer failed to configure the format",
+            src->index);
+        lgmpClientMessageDone(queue);
+        ok = false;
+        break;
+      }
+
+      formatVer = frame->formatVer;
+      DEBUG_INFO("Source %u format: %s %ux%u stride:%u pitch:%u%s",
+          src->index, FrameTypeStr[frame->type],
+          frame->frameWidth, frame->frameHeight, frame->stride, frame->pitch,
+          compressed ? " (compressed)" : "");
+    }
+
+    FrameBuffer * fb = (FrameBuffer *)(((uint8_t*)frame) + frame->offset);
+    if (!RENDERER(onSourceFrame, src->index, fb,
+          frame->damageRects, frame->damageRectsCount))
+    {
+      DEBUG_ERROR("Source %u: the renderer failed to take the frame",
+          src->index);
+      lgmpClientMessageDone(queue);
+      ok = false;
+      break;
+    }
+    lgmpClientMessageDone(queue);
+    src->lastFrame = nanotime();
+
+    if (g_state.jitRender)
+    {
+      if (atomic_load_explicit(&g_state.pendingCount, memory_order_acquire) < 10)
+        atomic_fetch_add_explicit(&g_state.pendingCount, 1,
+            memory_order_release);
+    }
+    else
+      lgSignalEvent(g_state.frameEvent);
+  }
+
+  lgmpClientUnsubscribe(&queue);
+  return ok && atomic_load(&s.running);
+}
+
+static int sourceThread(void * opaque)
+{
+  struct Source * src = (struct Source *)opaque;
+
+  while(sourceSession(src))
+    DEBUG_INFO("Source %u: the host has restarted", src->index);
+
+  RENDERER(onSourceStop, src->index);
+  return 0;
+}
+
+bool sources_init(void)
+{
+  const char * list = g_params.extraShmFiles;
+  if (!list || !*list)
+    return true;
+
+  char * files = strdup(list);
+  if (!files)
+  {
+    DEBUG_ERROR("Out of memory");
+    return false;
+  }
+
+  char * save;
+  for(char * file = strtok_r(files, ",", &save); file;
+      file = strtok_r(NULL, ",", &save))
+  {
+    if (s.count == ARRAY_LENGTH(s.sources))
+    {
+      DEBUG_WARN("At most %d sources can be shown, ignoring: %s",
+          LG_MAX_SOURCES, file);
+      continue;
+    }
+
+    struct Source * src = s.sources + s.count;
+    if (!ivshmemOpenDev(&src->shm, file))
+    {
+      DEBUG_ERROR("Failed to map the source: %s", file);
+      goto fail;
+    }
+
+    LGMP_STATUS status;
+    if ((status = lgmpClientInit(src->shm.mem, src->shm.size,
+            &src->lgmp)) != LGMP_OK)
+    {
+      DEBUG_ERROR("Source %s: lgmpClientInit Failed: %s", file,
+          lgmpStatusString(status));
+      ivshmemClose(&src->shm);
+      goto fail;
+    }
+
+    src->index = ++s.count;
+  }
+
+  free(files);
+  return true;
+
+fail:
+  free(files);
+  sources_free();
+  return false;
+}
+
+void sources_free(void)
+{
+  for(unsigned int i = 0; i < s.count; ++i)
+  {
+    lgmpClientFree(&s.sources[i].lgmp);
+    ivshmemClose(&s.sources[i].shm);
+  }
+  s.count = 0;
+}
+
+unsigned int sources_count(void)
+{
+  return s.count + 1;
+}
+
+void sources_start(void)
+{
+  if (!s.count)
+    return;
+
+  if (!g_state.lgr->ops.onSourceFormat ||
+      !g_state.lgr->ops.onSourceFrame  ||
+      !g_state.lgr->ops.onSourceStop)
+  {
+    DEBUG_WARN("The renderer can not show the extra sources");
+    return;
+  }
+
+  atomic_store(&s.running, true);
+  for(unsigned int i = 0; i < s.count; ++i)
+    if (!lgCreateThread("sourceThread", sourceThread, s.sources + i,
+          &s.sources[i].thread))
+      DEBUG_ERROR("Failed to create the thread for source %u", i + 1);
+}
+
+void sources_stop(void)
+{
+  atomic_store(&s.running, false);
+  for(unsigned int i = 0; i < s.count; ++i)
+    if (s.sources[i].thread)
+    {
+      lgJoinThread(s.sources[i].thread, NULL);
+      s.sources[i].thread = NULL;
+    }
+}
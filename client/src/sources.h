@@ -0,0 +1,41 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_SOURCES_
+#define _H_LG_SOURCES_
+
+#include <stdbool.h>
+
+/* Extra KVMFR sources shown view only next to the primary. Each is mapped and
+ * read by a thread of its own and shares the one renderer, input, the cursor
+ * and SPICE stay with the primary */
+
+// maps the devices given by app:extraShmFiles, before the renderer is created
+bool sources_init(void);
+void sources_free(void);
+
+// the number of sources including the primary
+unsigned int sources_count(void);
+
+// start and stop the source threads, from the render thread
+void sources_start(void);
+void sources_stop(void);
+
+#endif
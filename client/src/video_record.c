@@ -0,0 +1,818 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#if ENABLE_VIDEO_RECORD
+
+#include "video_record.h"
+
+#include "common/debug.h"
+#include "common/event.h"
+#include "common/locking.h"
+#include "common/option.h"
+#include "common/ringbuffer.h"
+#include "common/thread.h"
+#include "common/time.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_drm.h>
+
+enum SurfaceState
+{
+  SURFACE_FREE,   // the renderer may acquire it
+  SURFACE_DRAW,   // the renderer is drawing it
+  SURFACE_QUEUED, // waiting on the encoder thread
+  SURFACE_ENCODE  // held by the encoder until its frame is released
+};
+
+struct QueuedFrame
+{
+  int        surface;
+  uint64_t   time;
+  void     (*wait)(void * opaque);
+  void     * opaque;
+};
+
+static struct
+{
+  const char * file;
+  const char * device;
+  const char * codec;
+  int          bitrate;
+  bool         filtered;
+
+  atomic_bool  active;
+  atomic_bool  running;
+  LGThread   * thread;
+  LGEvent    * event;
+  uint64_t     start;
+
+  // set once by the renderer before the first acquire
+  atomic_bool        haveSurfaces;
+  unsigned int       width, height;
+  VideoRecordSurface surfaces[VIDEO_RECORD_SURFACES];
+  atomic_int         state[VIDEO_RECORD_SURFACES];
+
+  // there are never more frames queued than surfaces
+  LG_Lock            queueLock;
+  struct QueuedFrame queue[VIDEO_RECORD_SURFACES];
+  unsigned int       queueHead, queueTail;
+  atomic_uint        dropped;
+
+  /* written by the audio thread once the muxer has an audio stream of
+   * streamChannels at streamRate, audioUsers keeps the ring alive meanwhile.
+   * It holds a second of whole frames, audio past that is dropped */
+  atomic_int   audioChannels;
+  atomic_int   audioRate;
+  atomic_bool  audioOpen;
+  atomic_int   audioUsers;
+  int          streamChannels, streamRate;
+  RingBuffer   audio;
+
+  // only used by the encoder thread
+  bool              open;
+  AVFormatContext * fmt;
+  AVBufferRef     * hwDevice;
+  AVBufferRef     * hwFrames;
+  AVFrame         * mapped[VIDEO_RECORD_SURFACES];
+  AVCodecContext  * video;
+  AVStream        * videoStream;
+  AVCodecContext  * audioCtx;
+  AVStream        * audioStream;
+  AVFrame         * audioFrame;
+  int16_t         * audioPending;
+  int               audioFill;
+  int64_t           audioPts;
+  AVPacket        * packet;
+  uint64_t          frames;
+}
+vr = { 0 };
+
+static bool codecValidate(struct Option * opt, const char ** error)
+{
+  if (strcmp(opt->value.x_string, "h264") == 0 ||
+      strcmp(opt->value.x_string, "hevc") == 0)
+    return true;
+
+  *error = "The codec must be h264 or hevc";
+  return false;
+}
+
+static struct Option options[] =
+{
+  {
+    .module         = "encode",
+    .name           = "file",
+    .description    = "Encode the rendered desktop and the audio to this video "
+      "file, the container is chosen by the extension",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "encode",
+    .name           = "codec",
+    .description    = "The video codec (h264, hevc)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "h264",
+    .validator      = codecValidate
+  },
+  {
+    .module         = "encode",
+    .name           = "device",
+    .description    = "The VA-API render node to encode with",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "/dev/dri/renderD128"
+  },
+  {
+    .module         = "encode",
+    .name           = "bitrate",
+    .description    = "The video bitrate in kbit/s",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 20000
+  },
+  {
+    .module         = "encode",
+    .name           = "filtered",
+    .description    = "Encode the desktop after the post process filters",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = true
+  },
+  {0}
+};
+
+void videoRecord_earlyInit(void)
+{
+  option_register(options);
+}
+
+static bool writePackets(AVCodecContext * ctx, AVStream * stream)
+{
+  int ret;
+  while((ret = avcodec_receive_packet(ctx, vr.packet)) == 0)
+  {
+    av_packet_rescale_ts(vr.packet, ctx->time_base, stream->time_base);
+    vr.packet->stream_index = stream->index;
+    if ((ret = av_interleaved_write_frame(vr.fmt, vr.packet)) < 0)
+    {
+      DEBUG_ERROR("Failed to write the packet: %s", av_err2str(ret));
+      return false;
+    }
+  }
+
+  if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+  {
+    DEBUG_ERROR("Failed to encode: %s", av_err2str(ret));
+    return false;
+  }
+  return true;
+}
+
+static void freeDescriptor(void * opaque, uint8_t * data)
+{
+  AVDRMFrameDescriptor * desc = (AVDRMFrameDescriptor *)data;
+  for(int i = 0; i < desc->nb_objects; ++i)
+    close(desc->objects[i].fd);
+  av_free(desc);
+}
+
+/* imports the surface into a VA surface, this is done once and the mapping
+ * stays valid as the renderer draws into the same buffers each time */
+static AVFrame * mapSurface(VideoRecordSurface * s)
+{
+  AVDRMFrameDescriptor * desc = av_mallocz(sizeof(*desc));
+  AVFrame * drm = av_frame_alloc();
+  AVFrame * dst = av_frame_alloc();
+  if (!desc || !drm || !dst)
+  {
+    DEBUG_ERROR("Out of memory");
+    goto fail;
+  }
+
+  // the luma and chroma planes are separate objects and layers
+  desc->nb_objects = 2;
+  desc->nb_layers  = 2;
+  for(int i = 0; i < 2; ++i)
+  {
+    desc->objects[i].fd              = s->fd[i];
+    desc->objects[i].size            = lseek(s->fd[i], 0, SEEK_END);
+    desc->objects[i].format_modifier = s->modifier[i];
+    desc->layers[i].format           = s->fourcc[i];
+    desc->layers[i].nb_planes        = 1;
+    desc->layers[i].planes[0]        = (AVDRMPlaneDescriptor)
+    {
+      .object_index = i,
+      .offset       = s->offset[i],
+      .pitch        = s->pitch[i]
+    };
+    s->fd[i] = -1;
+  }
+
+  drm->format  = AV_PIX_FMT_DRM_PRIME;
+  drm->width   = vr.width;
+  drm->height  = vr.height;
+  drm->data[0] = (uint8_t *)desc;
+  drm->buf [0] = av_buffer_create((uint8_t *)desc, sizeof(*desc),
+      freeDescriptor, NULL, 0);
+  if (!drm->buf[0])
+  {
+    DEBUG_ERROR("Out of memory");
+    goto fail;
+  }
+  desc = NULL;
+
+  dst->format        = AV_PIX_FMT_VAAPI;
+  dst->hw_frames_ctx = av_buffer_ref(vr.hwFrames);
+  const int ret = av_hwframe_map(dst, drm,
+      AV_HWFRAME_MAP_READ | AV_HWFRAME_MAP_DIRECT);
+  if (ret < 0)
+  {
+    DEBUG_ERROR("Failed to import the surface: %s", av_err2str(ret));
+    goto fail;
+  }
+
+  // the mapping holds its own reference to the descriptor
+  av_frame_free(&drm);
+  return dst;
+
+fail:
+  if (desc)
+  {
+    for(int i = 0; i < desc->nb_objects; ++i)
+      if (desc->objects[i].fd >= 0)
+        close(desc->objects[i].fd);
+    av_free(desc);
+  }
+  av_frame_free(&drm);
+  av_frame_free(&dst);
+  return NULL;
+}
+
+static bool openVideo(void)
+{
+  int ret;
+  if ((ret = av_hwdevice_ctx_create(&vr.hwDevice, AV_HWDEVICE_TYPE_VAAPI,
+          vr.device, NULL, 0)) < 0)
+  {
+    DEBUG_ERROR("Failed to open VA-API on %s: %s", vr.device, av_err2str(ret));
+    return false;
+  }
+
+  vr.hwFrames = av_hwframe_ctx_alloc(vr.hwDevice);
+  if (!vr.hwFrames)
+  {
+    DEBUG_ERROR("Out of memory");
+    return false;
+  }
+
+  AVHWFramesContext * frames = (AVHWFramesContext *)vr.hwFrames->data;
+  frames->format    = AV_PIX_FMT_VAAPI;
+  frames->sw_format = AV_PIX_FMT_NV12;
+  frames->width     = vr.width;
+  frames->height    = vr.height;
+  if ((ret = av_hwframe_ctx_init(vr.hwFrames)) < 0)
+  {
+    DEBUG_ERROR("Failed to create the frames context: %s", av_err2str(ret));
+    return false;
+  }
+
+  for(int i = 0; i < VIDEO_RECORD_SURFACES; ++i)
+    if (!(vr.mapped[i] = mapSurface(vr.surfaces + i)))
+      return false;
+
+  const char * name = strcmp(vr.codec, "hevc") == 0 ?
+    "hevc_vaapi" : "h264_vaapi";
+  const AVCodec * codec = avcodec_find_encoder_by_name(name);
+  if (!codec)
+  {
+    DEBUG_ERROR("The %s encoder is not available", name);
+    return false;
+  }
+
+  vr.video = avcodec_alloc_context3(codec);
+  if (!vr.video)
+  {
+    DEBUG_ERROR("Out of memory");
+    return false;
+  }
+
+  // the frames are timed as they are rendered, in microseconds
+  vr.video->width           = vr.width;
+  vr.video->height          = vr.height;
+  vr.video->time_base       = (AVRational){ 1, 1000000 };
+  vr.video->pix_fmt         = AV_PIX_FMT_VAAPI;
+  vr.video->hw_frames_ctx   = av_buffer_ref(vr.hwFrames);
+  vr.video->bit_rate        = (int64_t)vr.bitrate * 1000;
+  vr.video->max_b_frames    = 0;
+  vr.video->gop_size        = 120;
+  vr.video->color_range     = AVCOL_RANGE_MPEG;
+  vr.video->colorspace      = AVCOL_SPC_BT709;
+  vr.video->color_primaries = AVCOL_PRI_BT709;
+  vr.video->color_trc       = AVCOL_TRC_BT709;
+  if (vr.fmt->oformat->flags & AVFMT_GLOBALHEADER)
+    vr.video->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+  if ((ret = avcodec_open2(vr.video, codec, NULL)) < 0)
+  {
+    DEBUG_ERROR("Failed to open the %s encoder: %s", name, av_err2str(ret));
+    return false;
+  }
+
+  vr.videoStream = avformat_new_stream(vr.fmt, NULL);
+  if (!vr.videoStream)
+  {
+    DEBUG_ERROR("Failed to add the video stream");
+    return false;
+  }
+
+  vr.videoStream->time_base = vr.video->time_base;
+  avcodec_parameters_from_context(vr.videoStream->codecpar, vr.video);
+  return true;
+}
+
+static bool openAudio(int channels, int rate)
+{
+  const AVCodec * codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+  if (!codec)
+  {
+    DEBUG_ERROR("The AAC encoder is not available");
+    return false;
+  }
+
+  vr.audioCtx = avcodec_alloc_context3(codec);
+  if (!vr.audioCtx)
+  {
+    DEBUG_ERROR("Out of memory");
+    return false;
+  }
+
+  vr.audioCtx->sample_fmt  = AV_SAMPLE_FMT_FLTP;
+  vr.audioCtx->sample_rate = rate;
+  vr.audioCtx->time_base   = (AVRational){ 1, rate };
+  vr.audioCtx->bit_rate    = 64000 * channels;
+  av_channel_layout_default(&vr.audioCtx->ch_layout, channels);
+  if (vr.fmt->oformat->flags & AVFMT_GLOBALHEADER)
+    vr.audioCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+  int ret;
+  if ((ret = avcodec_open2(vr.audioCtx, codec, NULL)) < 0)
+  {
+    DEBUG_ERROR("Failed to open the audio encoder: %s", av_err2str(ret));
+    return false;
+  }
+
+  vr.audioFrame   = av_frame_alloc();
+  vr.audioPending = malloc(vr.audioCtx->frame_size * channels *
+      sizeof(*vr.audioPending));
+  vr.audio        = ringbuffer_new(rate, channels * sizeof(int16_t));
+  if (!vr.audioFrame || !vr.audioPending || !vr.audio)
+  {
+    DEBUG_ERROR("Out of memory");
+    return false;
+  }
+
+  vr.audioFrame->format      = AV_SAMPLE_FMT_FLTP;
+  vr.audioFrame->nb_samples  = vr.audioCtx->frame_size;
+  vr.audioFrame->sample_rate = rate;
+  av_channel_layout_copy(&vr.audioFrame->ch_layout, &vr.audioCtx->ch_layout);
+  if ((ret = av_frame_get_buffer(vr.audioFrame, 0)) < 0)
+  {
+    DEBUG_ERROR("Failed to allocate the audio frame: %s", av_err2str(ret));
+    return false;
+  }
+
+  vr.audioStream = avformat_new_stream(vr.fmt, NULL);
+  if (!vr.audioStream)
+  {
+    DEBUG_ERROR("Failed to add the audio stream");
+    return false;
+  }
+
+  vr.audioStream->time_base = vr.audioCtx->time_base;
+  avcodec_parameters_from_context(vr.audioStream->codecpar, vr.audioCtx);
+  return true;
+}
+
+/* the streams are set up with the first frame as the size is not known before
+ * then, audio is only recorded if the guest has started playback by then */
+static bool openOutput(void)
+{
+  int ret;
+  if ((ret = avformat_alloc_output_context2(&vr.fmt, NULL, NULL,
+          vr.file)) < 0)
+  {
+    DEBUG_ERROR("Failed to pick a container for %s: %s", vr.file,
+        av_err2str(ret));
+    return false;
+  }
+
+  vr.packet = av_packet_alloc();
+  if (!vr.packet || !openVideo())
+    return false;
+
+  const int channels = atomic_load(&vr.audioChannels);
+  const int rate     = atomic_load(&vr.audioRate);
+  if (channels && !openAudio(channels, rate))
+    return false;
+
+  if (!(vr.fmt->oformat->flags & AVFMT_NOFILE) &&
+      (ret = avio_open(&vr.fmt->pb, vr.file, AVIO_FLAG_WRITE)) < 0)
+  {
+    DEBUG_ERROR("Failed to open %s: %s", vr.file, av_err2str(ret));
+    return false;
+  }
+
+  if ((ret = avformat_write_header(vr.fmt, NULL)) < 0)
+  {
+    DEBUG_ERROR("Failed to write the header: %s", av_err2str(ret));
+    return false;
+  }
+
+  vr.open = true;
+  if (vr.audioCtx)
+  {
+    vr.streamChannels = channels;
+    vr.streamRate     = rate;
+    atomic_store(&vr.audioOpen, true);
+  }
+
+  DEBUG_INFO("Encoding %ux%u %s%s to: %s", vr.width, vr.height, vr.codec,
+      vr.audioCtx ? " with audio" : "", vr.file);
+  return true;
+}
+
+static void releaseSurface(void * opaque, uint8_t * data)
+{
+  atomic_store((atomic_int *)opaque, SURFACE_FREE);
+}
+
+// the surface is released by the time this returns false
+static bool encodeFrame(const struct QueuedFrame * qf)
+{
+  qf->wait(qf->opaque);
+
+  AVFrame * frame = av_frame_clone(vr.mapped[qf->surface]);
+  if (frame)
+    frame->opaque_ref = av_buffer_create(NULL, 0, releaseSurface,
+        vr.state + qf->surface, 0);
+
+  if (!frame || !frame->opaque_ref)
+  {
+    DEBUG_ERROR("Out of memory");
+    av_frame_free(&frame);
+    atomic_store(&vr.state[qf->surface], SURFACE_FREE);
+    return false;
+  }
+
+  // the encoder drops its reference once done with the surface
+  frame->pts = qf->time;
+  atomic_store(&vr.state[qf->surface], SURFACE_ENCODE);
+  const int ret = avcodec_send_frame(vr.video, frame);
+  av_frame_free(&frame);
+  if (ret < 0)
+  {
+    DEBUG_ERROR("Failed to encode the frame: %s", av_err2str(ret));
+    return false;
+  }
+
+  ++vr.frames;
+  return writePackets(vr.video, vr.videoStream);
+}
+
+static bool encodeAudio(bool flush)
+{
+  const int channels = vr.audioCtx->ch_layout.nb_channels;
+  const int size     = vr.audioCtx->frame_size;
+
+  while(true)
+  {
+    vr.audioFill += ringbuffer_consume(vr.audio,
+        vr.audioPending + vr.audioFill * channels, size - vr.audioFill);
+
+    if (vr.audioFill < size)
+      break;
+
+    /* the guest stops the playback when it is silent, a gap shows as the
+     * audio falling behind the clock and is skipped over */
+    const int64_t now = (int64_t)(microtime() - vr.start) *
+      vr.audioCtx->sample_rate / 1000000;
+    if (vr.audioPts < now - vr.audioCtx->sample_rate / 5)
+      vr.audioPts = now - size;
+
+    int ret;
+    if ((ret = av_frame_make_writable(vr.audioFrame)) < 0)
+    {
+      DEBUG_ERROR("Failed to write the audio frame: %s", av_err2str(ret));
+      return false;
+    }
+
+    for(int c = 0; c < channels; ++c)
+    {
+      float * dst = (float *)vr.audioFrame->data[c];
+      for(int i = 0; i < size; ++i)
+        dst[i] = vr.audioPending[i * channels + c] * (1.0f / 32768.0f);
+    }
+
+    vr.audioFrame->pts = vr.audioPts;
+    vr.audioPts  += size;
+    vr.audioFill  = 0;
+
+    if ((ret = avcodec_send_frame(vr.audioCtx, vr.audioFrame)) < 0)
+    {
+      DEBUG_ERROR("Failed to encode the audio: %s", av_err2str(ret));
+      return false;
+    }
+
+    if (!writePackets(vr.audioCtx, vr.audioStream))
+      return false;
+  }
+
+  if (flush)
+  {
+    avcodec_send_frame(vr.audioCtx, NULL);
+    return writePackets(vr.audioCtx, vr.audioStream);
+  }
+
+  return true;
+}
+
+static void closeOutput(void)
+{
+  if (vr.open)
+  {
+    atomic_store(&vr.audioOpen, false);
+    avcodec_send_frame(vr.video, NULL);
+    writePackets(vr.video, vr.videoStream);
+    if (vr.audioCtx)
+      encodeAudio(true);
+
+    av_write_trailer(vr.fmt);
+    DEBUG_INFO("Encoded %" PRIu64 " frames, %u dropped", vr.frames,
+        atomic_load(&vr.dropped));
+  }
+
+  avcodec_free_context(&vr.video);
+  avcodec_free_context(&vr.audioCtx);
+  av_frame_free(&vr.audioFrame);
+  free(vr.audioPending);
+  vr.audioPending = NULL;
+
+  for(int i = 0; i < VIDEO_RECORD_SURFACES; ++i)
+    av_frame_free(&vr.mapped[i]);
+  av_buffer_unref(&vr.hwFrames);
+  av_buffer_unref(&vr.hwDevice);
+  av_packet_free(&vr.packet);
+
+  if (vr.fmt)
+  {
+    if (!(vr.fmt->oformat->flags & AVFMT_NOFILE))
+      avio_closep(&vr.fmt->pb);
+    avformat_free_context(vr.fmt);
+    vr.fmt = NULL;
+  }
+  vr.open = false;
+}
+
+static bool takeFrame(struct QueuedFrame * qf)
+{
+  bool ok = false;
+  LG_LOCK(vr.queueLock);
+  if (vr.queueTail != vr.queueHead)
+  {
+    *qf = vr.queue[vr.queueTail++ % VIDEO_RECORD_SURFACES];
+    ok  = true;
+  }
+  LG_UNLOCK(vr.queueLock);
+  return ok;
+}
+
+static int encoderThread(void * opaque)
+{
+  bool failed = false;
+  while(atomic_load(&vr.running))
+  {
+    lgWaitEvent(vr.event, 10);
+
+    struct QueuedFrame qf;
+    while(takeFrame(&qf))
+    {
+      if (!failed && !vr.open && !openOutput())
+        failed = true;
+
+      // a frame not given to the encoder must still be waited on and freed
+      if (failed)
+      {
+        qf.wait(qf.opaque);
+        atomic_store(&vr.state[qf.surface], SURFACE_FREE);
+        continue;
+      }
+
+      if (!encodeFrame(&qf))
+        failed = true;
+    }
+
+    if (!failed && atomic_load(&vr.audioOpen) && !encodeAudio(false))
+      failed = true;
+
+    if (failed && atomic_exchange(&vr.active, false))
+      DEBUG_ERROR("Encoding stopped");
+  }
+
+  closeOutput();
+  return 0;
+}
+
+bool videoRecord_init(void)
+{
+  vr.file     = option_get_string("encode", "file"    );
+  vr.device   = option_get_string("encode", "device"  );
+  vr.codec    = option_get_string("encode", "codec"   );
+  vr.bitrate  = option_get_int   ("encode", "bitrate" );
+  vr.filtered = option_get_bool  ("encode", "filtered");
+
+  if (!vr.file || !*vr.file)
+    return true;
+
+  for(int i = 0; i < VIDEO_RECORD_SURFACES; ++i)
+  {
+    atomic_init(&vr.state[i], SURFACE_FREE);
+    vr.surfaces[i].fd[0] = vr.surfaces[i].fd[1] = -1;
+  }
+
+  LG_LOCK_INIT(vr.queueLock);
+  vr.event = lgCreateEvent(true, 0);
+  if (!vr.event)
+  {
+    DEBUG_ERROR("Failed to allocate the encoder state");
+    goto fail;
+  }
+
+  vr.start = microtime();
+  atomic_store(&vr.running, true);
+  if (!lgCreateThread("videoEncode", encoderThread, NULL, &vr.thread))
+  {
+    DEBUG_ERROR("Failed to create the encoder thread");
+    goto fail;
+  }
+
+  atomic_store(&vr.active, true);
+  return true;
+
+fail:
+  atomic_store(&vr.running, false);
+  if (vr.event)
+  {
+    lgFreeEvent(vr.event);
+    vr.event = NULL;
+  }
+  LG_LOCK_FREE(vr.queueLock);
+  return false;
+}
+
+void videoRecord_free(void)
+{
+  if (!vr.thread)
+    return;
+
+  atomic_store(&vr.active , false);
+  atomic_store(&vr.running, false);
+  lgSignalEvent(vr.event);
+  lgJoinThread(vr.thread, NULL);
+  vr.thread = NULL;
+
+  // the surfaces that were never mapped are still ours
+  for(int i = 0; i < VIDEO_RECORD_SURFACES; ++i)
+    for(int j = 0; j < 2; ++j)
+      if (vr.surfaces[i].fd[j] >= 0)
+      {
+        close(vr.surfaces[i].fd[j]);
+        vr.surfaces[i].fd[j] = -1;
+      }
+
+  // the output closed the audio, wait out an append that was under way
+  while(atomic_load(&vr.audioUsers))
+    ;
+
+  ringbuffer_free(&vr.audio);
+  lgFreeEvent(vr.event);
+  vr.event = NULL;
+  LG_LOCK_FREE(vr.queueLock);
+}
+
+bool videoRecord_active(void)
+{
+  return atomic_load_explicit(&vr.active, memory_order_relaxed);
+}
+
+bool videoRecord_filtered(void)
+{
+  return vr.filtered;
+}
+
+bool videoRecord_setSurfaces(unsigned int width, unsigned int height,
+    const VideoRecordSurface surfaces[VIDEO_RECORD_SURFACES])
+{
+  if (!videoRecord_active() || atomic_load(&vr.haveSurfaces))
+    return false;
+
+  vr.width  = width;
+  vr.height = height;
+  for(int i = 0; i < VIDEO_RECORD_SURFACES; ++i)
+  {
+    vr.surfaces[i] = surfaces[i];
+    for(int j = 0; j < 2; ++j)
+      if ((vr.surfaces[i].fd[j] = dup(surfaces[i].fd[j])) < 0)
+      {
+        DEBUG_ERROR("Failed to duplicate the surface");
+        atomic_store(&vr.active, false);
+        return false;
+      }
+  }
+
+  atomic_store(&vr.haveSurfaces, true);
+  return true;
+}
+
+int videoRecord_acquire(void)
+{
+  if (!videoRecord_active() || !atomic_load(&vr.haveSurfaces))
+    return -1;
+
+  for(int i = 0; i < VIDEO_RECORD_SURFACES; ++i)
+  {
+    int expected = SURFACE_FREE;
+    if (atomic_compare_exchange_strong(&vr.state[i], &expected, SURFACE_DRAW))
+      return i;
+  }
+
+  atomic_fetch_add(&vr.dropped, 1);
+  return -1;
+}
+
+void videoRecord_submit(int surface, void (*wait)(void * opaque),
+    void * opaque)
+{
+  const struct QueuedFrame qf =
+  {
+    .surface = surface,
+    .time    = microtime() - vr.start,
+    .wait    = wait,
+    .opaque  = opaque
+  };
+
+  atomic_store(&vr.state[surface], SURFACE_QUEUED);
+  LG_LOCK(vr.queueLock);
+  vr.queue[vr.queueHead++ % VIDEO_RECORD_SURFACES] = qf;
+  LG_UNLOCK(vr.queueLock);
+  lgSignalEvent(vr.event);
+}
+
+void videoRecord_audioStart(int channels, int sampleRate)
+{
+  if (!videoRecord_active())
+    return;
+
+  atomic_store(&vr.audioChannels, channels);
+  atomic_store(&vr.audioRate    , sampleRate);
+}
+
+void videoRecord_audio(const int16_t * samples, int count)
+{
+  if (!atomic_load_explicit(&vr.audioOpen, memory_order_relaxed))
+    return;
+
+  atomic_fetch_add(&vr.audioUsers, 1);
+
+  // the stream is fixed when it is opened, later format changes are dropped
+  if (atomic_load(&vr.audioOpen) &&
+      atomic_load(&vr.audioChannels) == vr.streamChannels &&
+      atomic_load(&vr.audioRate)     == vr.streamRate)
+    ringbuffer_append(vr.audio, samples, count / vr.streamChannels);
+
+  atomic_fetch_sub(&vr.audioUsers, 1);
+}
+
+#endif
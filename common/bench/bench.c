@@ -0,0 +1,469 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/* Micro-benchmarks of the common primitives on the frame and audio paths.
+ * Each case is run BENCH_RUNS times after a warm up and the median and best
+ * time per operation are printed, one line per case, so that runs before and
+ * after a change can be compared with diff. An argument limits the run to the
+ * cases whose name contains it. */
+
+#include "common/array.h"
+#include "common/debug.h"
+#include "common/framebuffer.h"
+#include "common/rects.h"
+#include "common/ringbuffer.h"
+#include "common/vector.h"
+#include "common/event.h"
+#include "common/thread.h"
+#include "common/time.h"
+#include "common/util.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_RUNS     9
+#define BENCH_TARGET   20000000 // ns each run should take
+#define BENCH_MAX_RECTS 64
+
+typedef void (*BenchFn)(void * opaque);
+
+static const char * l_filter;
+
+static int compareU64(const void * a, const void * b)
+{
+  const uint64_t x = *(const uint64_t *)a;
+  const uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* times fn, bytes is the data moved by one call for the throughput column and
+ * may be zero */
+static void bench(const char * name, const char * param, size_t bytes,
+    BenchFn fn, void * opaque)
+{
+  if (l_filter && !strstr(name, l_filter))
+    return;
+
+  // warm up and find how many calls fill a run
+  uint64_t iters = 1;
+  for(;;)
+  {
+    const uint64_t start = nanotime();
+    for(uint64_t i = 0; i < iters; ++i)
+      fn(opaque);
+    const uint64_t elapsed = nanotime() - start;
+    if (elapsed >= BENCH_TARGET / 4 || iters >= (1ULL << 30))
+    {
+      iters = max(iters * BENCH_TARGET / max(elapsed, 1), 1);
+      break;
+    }
+    iters *= 4;
+  }
+
+  uint64_t runs[BENCH_RUNS];
+  for(int r = 0; r < BENCH_RUNS; ++r)
+  {
+    const uint64_t start = nanotime();
+    for(uint64_t i = 0; i < iters; ++i)
+      fn(opaque);
+    runs[r] = nanotime() - start;
+  }
+  qsort(runs, BENCH_RUNS, sizeof(*runs), compareU64);
+
+  const double median = (double)runs[BENCH_RUNS / 2] / iters;
+  const double best   = (double)runs[0] / iters;
+  printf("%-26s %-28s %12.1f ns %12.1f ns", name, param, median, best);
+  if (bytes)
+    printf(" %9.2f GB/s", bytes / median);
+  printf("\n");
+  fflush(stdout);
+}
+
+// fixed seed so every run sees the same damage
+static uint32_t l_seed = 0x4C474C47;
+static uint32_t rnd(uint32_t range)
+{
+  l_seed = l_seed * 1664525 + 1013904223;
+  return (uint32_t)(((uint64_t)(l_seed >> 8) * range) >> 24);
+}
+
+struct Mode
+{
+  const char * name;
+  unsigned int width, height, pitch;
+};
+
+static const struct Mode l_modes[] =
+{
+  { "1920x1080"       , 1920, 1080, 1920 * 4 },
+  { "2560x1440"       , 2560, 1440, 2560 * 4 },
+  { "3840x2160"       , 3840, 2160, 3840 * 4 },
+  // a pitch padded past the row the way some GPUs align their surfaces
+  { "1920x1080+pad256", 1920, 1080, 1920 * 4 + 256 }
+};
+
+struct FBCase
+{
+  const struct Mode * mode;
+  FrameBuffer       * fb;
+  uint8_t           * src;
+  uint8_t           * dst;
+  FrameDamageRect     rects[BENCH_MAX_RECTS];
+  int                 count;
+};
+
+static void fbWrite(void * opaque)
+{
+  struct FBCase * c = opaque;
+  framebuffer_prepare(c->fb);
+  framebuffer_write(c->fb, c->src, (size_t)c->mode->height * c->mode->pitch);
+}
+
+static void fbRead(void * opaque)
+{
+  struct FBCase * c = opaque;
+  framebuffer_read(c->fb, c->dst, c->mode->pitch, c->mode->height,
+      c->mode->width, 4, c->mode->pitch);
+}
+
+static void rectsToFB(void * opaque)
+{
+  struct FBCase * c = opaque;
+  FrameDamageRect rects[BENCH_MAX_RECTS];
+  memcpy(rects, c->rects, c->count * sizeof(*rects));
+  framebuffer_prepare(c->fb);
+  rectsBufferToFramebuffer(rects, c->count, c->fb, c->mode->pitch,
+      c->mode->height, c->src, c->mode->pitch);
+}
+
+static void rectsFromFB(void * opaque)
+{
+  struct FBCase * c = opaque;
+  FrameDamageRect rects[BENCH_MAX_RECTS];
+  memcpy(rects, c->rects, c->count * sizeof(*rects));
+  rectsFramebufferToBuffer(rects, c->count, c->dst, c->mode->pitch,
+      c->mode->height, c->fb, c->mode->pitch);
+}
+
+static void rectsMerge(void * opaque)
+{
+  struct FBCase * c = opaque;
+  FrameDamageRect rects[BENCH_MAX_RECTS];
+  memcpy(rects, c->rects, c->count * sizeof(*rects));
+  rectsMergeOverlapping(rects, c->count);
+}
+
+enum Damage
+{
+  DAMAGE_CURSOR,
+  DAMAGE_SCATTERED,
+  DAMAGE_STRIPS,
+  DAMAGE_FULL,
+  DAMAGE_MAX
+};
+
+static const char * l_damageNames[DAMAGE_MAX] =
+{
+  "cursor",
+  "scattered",
+  "strips",
+  "full"
+};
+
+static size_t makeDamage(struct FBCase * c, enum Damage damage)
+{
+  const unsigned int w = c->mode->width;
+  const unsigned int h = c->mode->height;
+
+  c->count = 0;
+  switch(damage)
+  {
+    case DAMAGE_CURSOR:
+      c->rects[c->count++] = (FrameDamageRect){ w / 2, h / 2, 64, 64 };
+      break;
+
+    case DAMAGE_SCATTERED:
+      for(int i = 0; i < 32; ++i)
+        c->rects[c->count++] = (FrameDamageRect)
+        {
+          .x      = rnd(w - 128) & ~3,
+          .y      = rnd(h - 128),
+          .width  = 32 + rnd(96),
+          .height = 32 + rnd(96)
+        };
+      break;
+
+    case DAMAGE_STRIPS:
+      for(unsigned int y = 0; y < h; y += h / 8)
+        c->rects[c->count++] = (FrameDamageRect){ 0, y, w, 32 };
+      break;
+
+    case DAMAGE_FULL:
+      c->rects[c->count++] = (FrameDamageRect){ 0, 0, w, h };
+      break;
+
+    default:
+      break;
+  }
+
+  size_t bytes = 0;
+  for(int i = 0; i < c->count; ++i)
+    bytes += (size_t)c->rects[i].width * c->rects[i].height * 4;
+  return bytes;
+}
+
+static bool benchFramebuffer(void)
+{
+  for(int m = 0; m < ARRAY_LENGTH(l_modes); ++m)
+  {
+    struct FBCase c = { .mode = &l_modes[m] };
+    const size_t size = (size_t)c.mode->height * c.mode->pitch;
+
+    c.fb  = aligned_alloc(64, ALIGN_PAD(sizeof(FrameBuffer) + size, 64));
+    c.src = aligned_alloc(64, size);
+    c.dst = aligned_alloc(64, size);
+    if (!c.fb || !c.src || !c.dst)
+    {
+      fprintf(stderr, "out of memory\n");
+      free(c.fb);
+      free(c.src);
+      free(c.dst);
+      return false;
+    }
+
+    for(size_t i = 0; i < size; ++i)
+      c.src[i] = rnd(256);
+
+    bench("framebuffer_write", c.mode->name, size, fbWrite, &c);
+    bench("framebuffer_read" , c.mode->name, size, fbRead , &c);
+
+    for(int d = 0; d < DAMAGE_MAX; ++d)
+    {
+      char param[64];
+      snprintf(param, sizeof(param), "%s/%s", c.mode->name,
+          l_damageNames[d]);
+
+      const size_t bytes = makeDamage(&c, d);
+      bench("rectsBufferToFramebuffer", param, bytes, rectsToFB  , &c);
+      bench("rectsFramebufferToBuffer", param, bytes, rectsFromFB, &c);
+      if (m == 0)
+        bench("rectsMergeOverlapping", l_damageNames[d], 0, rectsMerge, &c);
+    }
+
+    free(c.fb);
+    free(c.src);
+    free(c.dst);
+  }
+  return true;
+}
+
+struct RBCase
+{
+  RingBuffer rb;
+  int        count;
+  float      values[4096 * 2];
+};
+
+static void rbAppendConsume(void * opaque)
+{
+  struct RBCase * c = opaque;
+  ringbuffer_append (c->rb, c->values, c->count);
+  ringbuffer_consume(c->rb, c->values, c->count);
+}
+
+// the same transfer in place, as a writer converting straight into the buffer
+static void rbReserveCommit(void * opaque)
+{
+  struct RBCase * c = opaque;
+  for(int done = 0, span; done < c->count; done += span)
+  {
+    void * dst;
+    span = ringbuffer_reserveWrite(c->rb, &dst, c->count - done);
+    memcpy(dst, c->values + done * 2, span * sizeof(float) * 2);
+    ringbuffer_commitWrite(c->rb, span);
+  }
+
+  for(int done = 0, span; done < c->count; done += span)
+  {
+    const void * src;
+    span = ringbuffer_reserveRead(c->rb, &src, c->count - done);
+    memcpy(c->values + done * 2, src, span * sizeof(float) * 2);
+    ringbuffer_commitRead(c->rb, span);
+  }
+}
+
+static void benchRingbuffer(void)
+{
+  // stereo float frames in the period sizes the audio devices use
+  static struct RBCase c;
+  const int periods[] = { 64, 480, 2048 };
+  for(int i = 0; i < ARRAY_LENGTH(periods); ++i)
+  {
+    char param[32];
+    snprintf(param, sizeof(param), "%d frames", periods[i]);
+
+    c.count = periods[i];
+    c.rb    = ringbuffer_new(4096, sizeof(float) * 2);
+    bench("ringbuffer_append+consume", param,
+        c.count * sizeof(float) * 2 * 2, rbAppendConsume, &c);
+    bench("ringbuffer_reserve+commit", param,
+        c.count * sizeof(float) * 2 * 2, rbReserveCommit, &c);
+    ringbuffer_free(&c.rb);
+
+    c.rb = ringbuffer_newUnbounded(4096, sizeof(float) * 2);
+    snprintf(param, sizeof(param), "%d frames unbounded", periods[i]);
+    bench("ringbuffer_append+consume", param,
+        c.count * sizeof(float) * 2 * 2, rbAppendConsume, &c);
+    ringbuffer_free(&c.rb);
+  }
+}
+
+struct VecCase
+{
+  Vector vector;
+  int    count;
+};
+
+static void vecPushClear(void * opaque)
+{
+  struct VecCase * c = opaque;
+  FrameDamageRect rect = { 0 };
+  for(int i = 0; i < c->count; ++i)
+  {
+    rect.x = i;
+    vector_push(&c->vector, &rect);
+  }
+  vector_clear(&c->vector);
+}
+
+static void vecRemove(void * opaque)
+{
+  struct VecCase * c = opaque;
+  FrameDamageRect rect = { 0 };
+  for(int i = 0; i < c->count; ++i)
+    vector_push(&c->vector, &rect);
+  while(vector_size(&c->vector))
+    vector_remove(&c->vector, 0);
+}
+
+static bool benchVector(void)
+{
+  const int counts[] = { 16, 256, 4096 };
+  for(int i = 0; i < ARRAY_LENGTH(counts); ++i)
+  {
+    char param[32];
+    snprintf(param, sizeof(param), "%d items", counts[i]);
+
+    struct VecCase c = { .count = counts[i] };
+    if (!vector_create(&c.vector, sizeof(FrameDamageRect), 0))
+      return false;
+
+    bench("vector_push+clear", param, 0, vecPushClear, &c);
+    if (c.count <= 256)
+      bench("vector_push+remove", param, 0, vecRemove, &c);
+    vector_destroy(&c.vector);
+  }
+  return true;
+}
+
+struct EventCase
+{
+  LGEvent   * ping;
+  LGEvent   * pong;
+  atomic_bool running;
+};
+
+static int eventThread(void * opaque)
+{
+  struct EventCase * c = opaque;
+  while(atomic_load(&c->running))
+    if (lgWaitEvent(c->ping, 100))
+      lgSignalEvent(c->pong);
+  return 0;
+}
+
+static void eventRoundTrip(void * opaque)
+{
+  struct EventCase * c = opaque;
+  lgSignalEvent(c->ping);
+  lgWaitEvent(c->pong, TIMEOUT_INFINITE);
+}
+
+static void eventSignal(void * opaque)
+{
+  struct EventCase * c = opaque;
+  lgSignalEvent(c->ping);
+  lgWaitEvent(c->ping, 0);
+}
+
+static bool benchEvent(void)
+{
+  const unsigned int spins[] = { 0, 1 };
+  for(int i = 0; i < ARRAY_LENGTH(spins); ++i)
+  {
+    char param[32];
+    snprintf(param, sizeof(param), "spin %ums", spins[i]);
+
+    struct EventCase c = { .running = true };
+    c.ping = lgCreateEvent(true, spins[i]);
+    c.pong = lgCreateEvent(true, spins[i]);
+    if (!c.ping || !c.pong)
+      return false;
+
+    bench("lgEvent signal+wait", param, 0, eventSignal, &c);
+
+    LGThread * thread;
+    if (!lgCreateThread("benchEvent", eventThread, &c, &thread))
+      return false;
+
+    bench("lgEvent round trip", param, 0, eventRoundTrip, &c);
+
+    atomic_store(&c.running, false);
+    lgSignalEvent(c.ping);
+    lgJoinThread(thread, NULL);
+    lgFreeEvent(c.ping);
+    lgFreeEvent(c.pong);
+  }
+  return true;
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc > 1)
+    l_filter = argv[1];
+
+  debug_init();
+  framebuffer_init();
+  printf("%-26s %-28s %15s %15s %14s\n", "case", "param", "median/op",
+      "best/op", "throughput");
+
+  if (!benchFramebuffer())
+    return -1;
+
+  benchRingbuffer();
+
+  if (!benchVector() || !benchEvent())
+    return -1;
+
+  return 0;
+}
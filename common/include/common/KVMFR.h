@@ -28,35 +28,55 @@
 #include "types.h"
 
 #define KVMFR_MAGIC   "KVMFR---"
-#define KVMFR_VERSION 19
+#define KVMFR_VERSION 29
 
 #define KVMFR_MAX_DAMAGE_RECTS 64
 
+// the optional damage map, one bit per 64x64 tile, enough tiles for 8K
+#define KVMFR_DAMAGE_TILE_SHIFT 6
+#define KVMFR_DAMAGE_MAP_SIZE   1024
+
 #define LGMP_Q_POINTER     1
 #define LGMP_Q_FRAME       2
+#define LGMP_Q_AUDIO       3
 
-#define LGMP_Q_FRAME_LEN   2
+#define LGMP_Q_FRAME_LEN     2 // default frame queue length
+#define LGMP_Q_FRAME_LEN_MAX 4 // upper bound of the negotiated length
 #define LGMP_Q_POINTER_LEN 20
+#define LGMP_Q_AUDIO_LEN   16
+
+#define KVMFR_AUDIO_MAX_CHANNELS 8
+#define KVMFR_AUDIO_MAX_FRAMES   2048
+#define KVMFR_AUDIO_MAX_SIZE     (sizeof(KVMFRAudio) + \
+    KVMFR_AUDIO_MAX_FRAMES * KVMFR_AUDIO_MAX_CHANNELS * sizeof(int16_t))
+
+// ivshmem-doorbell vectors rung by the host after posting to a queue
+#define KVMFR_DOORBELL_FRAME   0
+#define KVMFR_DOORBELL_POINTER 1
 
 enum
 {
   CURSOR_FLAG_POSITION = 0x1,
   CURSOR_FLAG_VISIBLE  = 0x2,
-  CURSOR_FLAG_SHAPE    = 0x4
+  CURSOR_FLAG_SHAPE    = 0x4,
+  CURSOR_FLAG_LIVE     = 0x8  // the message memory is the KVMFRCursorLive record
 };
 
 typedef uint32_t KVMFRCursorFlags;
 
 enum
 {
-  KVMFR_FEATURE_SETCURSORPOS = 0x1
+  KVMFR_FEATURE_SETCURSORPOS = 0x1,
+  KVMFR_FEATURE_DOORBELL     = 0x2,
+  KVMFR_FEATURE_AUDIO        = 0x4
 };
 
 typedef uint32_t KVMFRFeatureFlags;
 
 enum
 {
-  KVMFR_MESSAGE_SETCURSORPOS
+  KVMFR_MESSAGE_SETCURSORPOS,
+  KVMFR_MESSAGE_DOORBELL
 };
 
 typedef uint32_t KVMFRMessageType;
@@ -67,6 +87,7 @@ typedef struct KVMFR
   uint32_t          version;
   char              hostver[32];
   KVMFRFeatureFlags features;
+  uint32_t          frameQueueLen; // in use frame buffers, <= LGMP_Q_FRAME_LEN_MAX
   //KVMFRRecords start here if there are any
 }
 KVMFR;
@@ -121,18 +142,53 @@ typedef struct KVMFRCursor
   uint32_t   width;       // width of the shape
   uint32_t   height;      // height of the shape
   uint32_t   pitch;       // row length in bytes of the shape
+  uint32_t   shapeID;     // content hash of the shape, zero if unknown
 }
 KVMFRCursor;
 
+/* the latest cursor position, rewritten in place by the host at input rate.
+ * seq is odd while an update is in progress and zero until the first one */
+typedef struct KVMFRCursorLive
+{
+  volatile uint32_t seq;
+  volatile int16_t  x, y;
+}
+KVMFRCursorLive;
+
 enum
 {
   FRAME_FLAG_BLOCK_SCREENSAVER  = 0x1,
   FRAME_FLAG_REQUEST_ACTIVATION = 0x2,
-  FRAME_FLAG_TRUNCATED          = 0x4 // ivshmem was too small for the frame
+  FRAME_FLAG_TRUNCATED          = 0x4, // ivshmem was too small for the frame
+  FRAME_FLAG_COMPRESSED         = 0x8, // LZ4 blocks, see framebuffer_write_compressed
+  FRAME_FLAG_DAMAGE_MAP         = 0x10, // damageMap is valid, see rectsFromDamageMap
+  FRAME_FLAG_HOST_SCALED        = 0x20  // lowered to keep up, worth upscaling
 };
 
 typedef uint32_t KVMFRFrameFlags;
 
+/* host performance counters over its last full second, carried by every frame
+ * and replaced once per second, the client can tell by period changing */
+typedef struct KVMFRHostStats
+{
+  uint32_t period;      // incremented each time the counters are published
+  uint16_t captureRate; // frames captured per second
+  uint16_t damage;      // mean damaged area, percent of the frame
+  uint32_t writeUs;     // mean frame buffer write time
+  uint32_t gpuCopyUs;   // mean time from the copy being issued to it mapping
+  uint32_t queueWaits;  // captures that waited on a full frame queue
+}
+KVMFRHostStats;
+
+/* FRAME_TYPE_NV12 frames hold the Y plane followed by the U,V plane at half
+ * resolution, and are carried as one 32bpp image of frameWidth / 4 texels by
+ * frameHeight * 3 / 2 rows, which stride and pitch describe. The width and
+ * height are multiples of 4 and 2, the damage rects remain in frame pixels */
+static inline uint32_t kvmfrFrameRows(FrameType type, uint32_t height)
+{
+  return type == FRAME_TYPE_NV12 ? height + height / 2 : height;
+}
+
 typedef struct KVMFRFrame
 {
   uint32_t        formatVer;          // the frame format version number
@@ -143,15 +199,40 @@ typedef struct KVMFRFrame
   uint32_t        frameWidth;         // the frame width
   uint32_t        frameHeight;        // the frame height
   FrameRotation   rotation;           // the frame rotation
-  uint32_t        stride;             // the row stride (zero if compressed data)
-  uint32_t        pitch;              // the row pitch  (stride in bytes or the compressed frame size)
+  uint32_t        stride;             // the row stride
+  uint32_t        pitch;              // the row pitch  (stride in bytes, before compression)
   uint32_t        offset;             // offset from the start of this header to the FrameBuffer header
   uint32_t        damageRectsCount;   // the number of damage rectangles (zero for full-frame damage)
   FrameDamageRect damageRects[KVMFR_MAX_DAMAGE_RECTS];
   KVMFRFrameFlags flags;              // bit field combination of FRAME_FLAG_*
+
+  /* the damage at tile granularity for updates too scattered for the rects,
+   * which then only approximate it. Rows are (damageMapWidth + 7) / 8 bytes */
+  uint16_t        damageMapWidth;     // tiles per row
+  uint16_t        damageMapHeight;    // rows of tiles
+  uint8_t         damageMap[KVMFR_DAMAGE_MAP_SIZE];
+
+  // latency tracing, all in host microseconds, offsets are from captureTime
+  uint64_t        captureTime;        // when the capture was started
+  uint32_t        copyTime;           // the frame was acquired and the copy issued
+  uint32_t        mapTime;            // the copy completed and was mapped
+  uint32_t        postTime;           // the frame was posted to the queue
+  volatile uint32_t writeTime;        // the frame buffer write completed, zero until then
+  uint64_t        presentTime;        // when the guest presented the frame, zero if not known
+
+  KVMFRHostStats  stats;              // the host counters as of this frame
 }
 KVMFRFrame;
 
+typedef struct KVMFRAudio
+{
+  uint32_t channels;    // the number of interleaved channels
+  uint32_t sampleRate;  // the sample rate in Hz
+  uint32_t frames;      // the number of S16 frames that follow this header
+  uint64_t captureTime; // host microseconds, the same clock as KVMFRFrame
+}
+KVMFRAudio;
+
 typedef struct KVMFRMessage
 {
   KVMFRMessageType type;
@@ -165,4 +246,11 @@ typedef struct KVMFRSetCursorPos
 }
 KVMFRSetCursorPos;
 
+typedef struct KVMFRDoorbell
+{
+  KVMFRMessage msg;
+  uint16_t     peerID; // the ivshmem peer id of the client to ring
+}
+KVMFRDoorbell;
+
 #endif
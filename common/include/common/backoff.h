@@ -0,0 +1,65 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_COMMON_BACKOFF_
+#define _H_LG_COMMON_BACKOFF_
+
+#include <stdint.h>
+
+/* The tiers a backoff moves through as a wait takes longer. Short waits are
+ * spun out with a pause so the result is seen as soon as possible, longer ones
+ * give up the CPU, first by yielding and then by sleeping. A plain usleep(1)
+ * does not work for the short waits as Windows rounds it up to the timer
+ * resolution. */
+enum
+{
+  BACKOFF_SPIN,
+  BACKOFF_YIELD,
+  BACKOFF_SLEEP,
+
+  BACKOFF_TIERS
+};
+
+typedef struct Backoff
+{
+  uint64_t     start; // nanotime of the first wait
+  unsigned int count; // number of waits so far
+}
+Backoff;
+
+#define BACKOFF_INIT (Backoff){ 0 }
+
+/**
+ * Wait once, each call on the same Backoff waits the same or longer than the
+ * last. Returns the nanoseconds since the first call.
+ */
+uint64_t backoff_wait(Backoff * backoff);
+
+/**
+ * Get the number of times each tier has been used by all callers
+ */
+void backoff_stats(uint64_t counts[BACKOFF_TIERS]);
+
+/**
+ * Log the tier counts, prefixed with name
+ */
+void backoff_log_stats(const char * name);
+
+#endif
@@ -28,4 +28,36 @@ bool lgCPUInfo(char * model, size_t modelSize, int * procs, int * cores,
   int * sockets);
 void lgDebugCPU(void);
 
+enum CPUFeature
+{
+  CPU_FEATURE_SSE2     = 1 << 0,
+  CPU_FEATURE_SSE41    = 1 << 1,
+  CPU_FEATURE_AVX      = 1 << 2,
+  CPU_FEATURE_AVX2     = 1 << 3,
+  CPU_FEATURE_FMA      = 1 << 4,
+  CPU_FEATURE_AVX512F  = 1 << 5,
+  CPU_FEATURE_AVX512BW = 1 << 6,
+  CPU_FEATURE_NEON     = 1 << 7
+};
+
+// the CPUFeature bits of the running CPU, detected on first use
+unsigned int lgCPUFeatures(void);
+
+static inline bool lgCPUHas(unsigned int features)
+{
+  return (lgCPUFeatures() & features) == features;
+}
+
+/* the index of the first entry whose features are all present, the entries
+ * are stride bytes apart starting with the features of the first. A table
+ * should end with an entry that needs no features so one always matches */
+size_t lgCPUSelect(const unsigned int * features, size_t stride, size_t count);
+
+/* selects from a table of structs that have an unsigned int features member,
+ * ordered from the most to the least demanding. Evaluates to a pointer to the
+ * chosen entry */
+#define LG_CPU_DISPATCH(table) \
+  (&(table)[lgCPUSelect(&(table)[0].features, sizeof((table)[0]), \
+      sizeof(table) / sizeof((table)[0]))])
+
 #endif
@@ -42,8 +42,21 @@ enum DebugLevel
 
 extern const char ** debug_lookup;
 
+/**
+ * Sets up the output and starts the thread that writes the queued records,
+ * until then, and after exit, the DEBUG_* macros write directly
+ */
 void debug_init(void);
 
+// implemented per platform and called by debug_init
+void debug_platformInit(void);
+
+/**
+ * Writes out the queued records and logs directly from then on, for fatal
+ * paths where the flush thread may never run again
+ */
+void debug_sync(void);
+
 #ifdef ENABLE_BACKTRACE
 void printBacktrace(void);
 #define DEBUG_PRINT_BACKTRACE() printBacktrace()
@@ -87,11 +100,9 @@ void printBacktrace(void);
   sizeof(s) > 20 && (s)[sizeof(s)-21] == DIRECTORY_SEPARATOR ? (s) + sizeof(s) - 20 : \
   sizeof(s) > 21 && (s)[sizeof(s)-22] == DIRECTORY_SEPARATOR ? (s) + sizeof(s) - 21 : (s))
 
-#define DEBUG_PRINT(level, fmt, ...) do { \
-  fprintf(stderr, "%s%12" PRId64 "%20s:%-4u | %-30s | " fmt "%s\n", \
-      debug_lookup[level], microtime(), STRIPPATH(__FILE__), \
-      __LINE__, __FUNCTION__, ##__VA_ARGS__, debug_lookup[DEBUG_LEVEL_NONE]); \
-} while (0)
+#define DEBUG_PRINT(level, fmt, ...) \
+  debug_print(level, STRIPPATH(__FILE__), __LINE__, __FUNCTION__, fmt, \
+      ##__VA_ARGS__)
 
 #define DEBUG_BREAK() DEBUG_PRINT(DEBUG_LEVEL_INFO, "================================================================================")
 #define DEBUG_INFO(fmt, ...) DEBUG_PRINT(DEBUG_LEVEL_INFO, fmt, ##__VA_ARGS__)
@@ -131,6 +142,10 @@ void printBacktrace(void);
   #define DEBUG_PROTO(fmt, ...) do {} while(0)
 #endif
 
+void debug_print(enum DebugLevel level, const char * file, unsigned int line,
+    const char * function, const char * format, ...)
+    __attribute__((format (printf, 5, 6)));
+
 void debug_info(const char * file, unsigned int line, const char * function,
     const char * format, ...) __attribute__((format (printf, 4, 5)));
 
@@ -28,6 +28,8 @@
 
 typedef struct LGEvent LGEvent;
 
+/* msSpinTime allows a wait to spin for the signal before it sleeps, the spin
+ * is capped at tens of microseconds and adapts to how long the waits take */
 LGEvent * lgCreateEvent(bool autoReset, unsigned int msSpinTime);
 void      lgFreeEvent  (LGEvent * handle);
 bool      lgWaitEvent  (LGEvent * handle, unsigned int timeout);
@@ -35,7 +37,7 @@ bool      lgSignalEvent(LGEvent * handle);
 bool      lgResetEvent (LGEvent * handle);
 
 // os specific method to wrap/convert a native event into a LGEvent
-// for windows this is an event HANDLE
+// for windows this is an event HANDLE, lgFreeEvent does not close it
 LGEvent * lgWrapEvent(void * handle);
 
 // Posix specific, not implmented/possible in windows
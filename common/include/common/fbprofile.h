@@ -0,0 +1,103 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_COMMON_FBPROFILE_
+#define _H_LG_COMMON_FBPROFILE_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include "common/time.h"
+#endif
+
+/* copy latency histograms for the frame buffer paths. Disabled by default,
+ * when enabled each call costs two counter reads and a few relaxed atomics */
+
+typedef enum FBProfileOp
+{
+  FB_PROFILE_READ,  // framebuffer_read and framebuffer_read_fn
+  FB_PROFILE_WRITE, // framebuffer_write
+  FB_PROFILE_RECTS, // rectsFramebufferToBuffer
+
+  FB_PROFILE_OP_MAX
+}
+FBProfileOp;
+
+typedef struct FBProfileStats
+{
+  uint64_t count;
+  double   avgUs;
+  double   p50Us;
+  double   p90Us;
+  double   p99Us;
+  double   maxUs;
+}
+FBProfileStats;
+
+extern atomic_bool fbprofile_enabled;
+
+void fbprofile_enable(bool enable);
+void fbprofile_reset(void);
+
+/**
+ * Summarise the samples collected for op so far, the percentiles are the lower
+ * bound of the histogram bucket they fall in, which is within 25%
+ */
+bool fbprofile_query(FBProfileOp op, FBProfileStats * stats);
+
+/**
+ * Log the summary of every op that has samples
+ */
+void fbprofile_log(void);
+
+void fbprofile_record(FBProfileOp op, uint64_t ticks);
+
+// a cheap monotonic counter, the rate is calibrated against nanotime
+static inline uint64_t fbprofile_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#else
+  return nanotime();
+#endif
+}
+
+static inline uint64_t fbprofile_begin(void)
+{
+  if (!atomic_load_explicit(&fbprofile_enabled, memory_order_relaxed))
+    return 0;
+  return fbprofile_ticks();
+}
+
+static inline void fbprofile_end(FBProfileOp op, uint64_t start)
+{
+  if (start)
+    fbprofile_record(op, fbprofile_ticks() - start);
+}
+
+#endif
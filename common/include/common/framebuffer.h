@@ -27,7 +27,7 @@
 #include <stdatomic.h>
 
 #define FB_CHUNK_SIZE           1048576 // 1MB
-#define FB_SPIN_LIMIT           10000   // 10ms
+#define FB_STALL_LIMIT          1000000 // 1s without progress, in microseconds
 #define FB_WP_TYPE              atomic_uint_least32_t
 #define FB_WP_SIZE              sizeof(FB_WP_TYPE)
 
@@ -39,6 +39,26 @@ typedef struct stFrameBuffer
 
 typedef bool (*FrameBufferReadFn)(void * opaque, const void * src, size_t size);
 
+/**
+ * Select the fastest copy kernel supported by the CPU and log the choice.
+ * This is called on first use if it has not been called already.
+ */
+void framebuffer_init(void);
+
+/**
+ * Start a pool of worker threads that framebuffer_write and framebuffer_read
+ * use to copy large frames in parallel. The write pointer is still advanced
+ * in order so that readers can consume the frame progressively, and a read
+ * waits for it per band. One thread at a time uses the pool, any other copies
+ * alone. A count of zero disables the pool.
+ */
+bool framebuffer_start_workers(int count);
+
+/**
+ * Stop and free the worker pool started by framebuffer_start_workers
+ */
+void framebuffer_stop_workers(void);
+
 /**
  * Wait for the framebuffer to fill to the specified size
  */
@@ -66,6 +86,30 @@ void framebuffer_prepare(FrameBuffer * frame);
  */
 bool framebuffer_write(FrameBuffer * frame, const void * src, size_t size);
 
+/**
+ * Returns the worst case size of a compressed frame
+ */
+size_t framebuffer_compress_bound(size_t height, size_t pitch);
+
+/**
+ * Compress the src buffer into the KVMFRFrame, size is the capacity of the
+ * framebuffer and must be at least framebuffer_compress_bound
+ */
+bool framebuffer_write_compressed(FrameBuffer * frame, const void * src,
+    size_t height, size_t pitch, size_t size);
+
+/**
+ * Decompress data from the KVMFRFrame into the dst buffer
+ */
+bool framebuffer_read_compressed(const FrameBuffer * frame, void * dst,
+    size_t dstpitch, size_t height, size_t width, size_t bpp, size_t pitch);
+
+/**
+ * Decompress data from the KVMFRFrame using a callback
+ */
+bool framebuffer_read_compressed_fn(const FrameBuffer * frame, size_t height,
+    size_t width, size_t bpp, size_t pitch, FrameBufferReadFn fn, void * opaque);
+
 /**
  * Gets the underlying data buffer of the framebuffer.
  * For custom read routines only.
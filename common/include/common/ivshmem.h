@@ -44,4 +44,14 @@ void ivshmemFree(struct IVSHMEM * dev);
 bool ivshmemHasDMA   (struct IVSHMEM * dev);
 int  ivshmemGetDMABuf(struct IVSHMEM * dev, uint64_t offset, uint64_t size);
 
+/* Doorbell support, requires an ivshmem-doorbell device (ivshmem-server).
+ * The guest rings a peer's vector, the peer blocks on it until rung.
+ * ivshmemWaitDoorbell returns 1 if rung, 0 on timeout (ms) or -1 on failure,
+ * ivshmemWakeDoorbell wakes a local waiter on the vector as if it was rung */
+bool ivshmemHasDoorbell (struct IVSHMEM * dev);
+int  ivshmemGetPeerID   (struct IVSHMEM * dev);
+bool ivshmemRingDoorbell(struct IVSHMEM * dev, uint16_t peerID, uint16_t vector);
+int  ivshmemWaitDoorbell(struct IVSHMEM * dev, uint16_t vector, unsigned int timeout);
+void ivshmemWakeDoorbell(struct IVSHMEM * dev, uint16_t vector);
+
 #endif
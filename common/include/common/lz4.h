@@ -0,0 +1,55 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_COMMON_LZ4_
+#define _H_LG_COMMON_LZ4_
+
+#include <stddef.h>
+
+/* Minimal LZ4 block format codec, the output is compatible with liblz4's
+ * LZ4_compress_default/LZ4_decompress_safe */
+
+/**
+ * Returns the worst case compressed size of srcSize bytes
+ */
+
+static inline size_t lz4_compress_bound(size_t srcSize)
+{
+  return srcSize + srcSize / 255 + 16;
+}
+
+/**
+ * Compress srcSize bytes from src into dst.
+ * Returns the compressed size, or zero if it would not fit in dstSize
+ */
+
+size_t lz4_compress(const void * src, size_t srcSize, void * dst,
+    size_t dstSize);
+
+/**
+ * Decompress an LZ4 block of srcSize bytes into dst.
+ * Returns the decompressed size, or zero if the block is malformed or would
+ * overflow dstSize
+ */
+
+size_t lz4_decompress(const void * src, size_t srcSize, void * dst,
+    size_t dstSize);
+
+#endif
@@ -0,0 +1,80 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_COMMON_METRICS_
+#define _H_LG_COMMON_METRICS_
+
+#include "common/stats.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A registry of named values and histograms that can be published for
+ * monitoring outside of the application. The output is the Prometheus text
+ * format, values as "name value" lines and histograms as summaries with the
+ * 0.5, 0.9 and 0.99 quantiles plus _count and _sum.
+ *
+ * On Linux the export is a UNIX socket that writes a snapshot to each client
+ * that connects, on Windows a named shared memory page holding a MetricsPage
+ * that is rewritten every second.
+ */
+
+#define METRICS_MAX         64
+#define METRICS_PAGE_SIZE   (64 * 1024)
+#define METRICS_PAGE_MAGIC  0x544D474C // "LGMT"
+#define METRICS_PAGE_VER    1
+
+typedef struct MetricsPage
+{
+  uint32_t          magic;
+  uint32_t          version;
+  volatile uint32_t seq;  // odd while the text is being rewritten
+  uint32_t          size; // the length of the text
+  char              text[];
+}
+MetricsPage;
+
+// called from the export thread, must be safe to call from any thread
+typedef double (*MetricsValueFn)(void * opaque);
+
+/**
+ * The name and help strings must remain valid until unregistered. Counters
+ * only ever increase, everything else is reported as a gauge.
+ */
+bool metrics_registerValue(const char * name, const char * help, bool counter,
+    MetricsValueFn fn, void * opaque);
+
+// the histogram values are multiplied by scale when written
+bool metrics_registerHistogram(const char * name, const char * help,
+    StatsHistogram histogram, double scale);
+
+// once this returns the value function will not be called again
+void metrics_unregister(const char * name);
+
+// returns the length of the text written, truncated to fit in size
+size_t metrics_format(char * buffer, size_t size);
+
+// implemented per platform, location is a socket path or a mapping name
+bool metrics_startExport(const char * location);
+void metrics_stopExport(void);
+
+#endif
@@ -43,6 +43,10 @@ enum doHelpMode
 };
 
 struct Option;
+struct OptionWatch;
+
+// called after the value of a watched option has changed
+typedef void (*OptionChangeFn)(struct Option * opt, void * opaque);
 
 struct Option
 {
@@ -72,6 +76,8 @@ struct Option
 
   // internal use only
   bool failed_set;
+  bool cmdline;
+  struct OptionWatch * watches;
 };
 
 // register an NULL terminated array of options
@@ -84,6 +90,22 @@ const char *    option_get_string(const char * module, const char * name);
 bool            option_get_bool  (const char * module, const char * name);
 float           option_get_float (const char * module, const char * name);
 
+/* the value of an option by the handle option_get returned, for code that
+ * reads it often enough to keep the handle, it stays valid until option_free */
+int          option_int   (const struct Option * opt);
+const char * option_string(const struct Option * opt);
+bool         option_bool  (const struct Option * opt);
+float        option_float (const struct Option * opt);
+
+/* calls fn from the thread that changed the value, each time the option is
+ * set, parsed or toggled to a value that differs from the last */
+bool option_watch  (struct Option * opt, OptionChangeFn fn, void * opaque);
+void option_unwatch(struct Option * opt, OptionChangeFn fn, void * opaque);
+
+// watch every option of a module, for consumers that reload them as a set
+bool option_watchModule  (const char * module, OptionChangeFn fn, void * opaque);
+void option_unwatchModule(const char * module, OptionChangeFn fn, void * opaque);
+
 // update the value of an option
 void option_set_int   (const char * module, const char * name, int value);
 void option_set_string(const char * module, const char * name, const char * value);
@@ -96,6 +118,11 @@ bool option_parse(int argc, char * argv[]);
 // called by the main application to load configuration from a file
 bool option_load(const char * filename);
 
+/* loads a file again into the running options, only watched options are
+ * updated as nothing else would see the change, values given on the command
+ * line are kept and values the validator rejects are ignored */
+bool option_reload(const char * filename);
+
 // called by the main application to validate the option values
 bool option_validate(void);
 
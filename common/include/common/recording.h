@@ -0,0 +1,122 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_COMMON_RECORDING_
+#define _H_LG_COMMON_RECORDING_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "KVMFR.h"
+
+/* A recording of a KVMFR stream as seen by the client, written by its
+ * app:recordFile option and played back by the host's replay capture.
+ *
+ * The file is an LGRecHeader followed by records, each an LGRecRecord and
+ * size bytes of payload. The payload of a frame is an LGRecFrame and an LZ4
+ * block of its data, which is either the whole frame or the damaged rects in
+ * order, each packed row after row. A cursor is an LGRecCursor and the shape
+ * if the message carried one. All values are in the host's byte order */
+
+#define LGREC_MAGIC   "LGREC---"
+#define LGREC_VERSION 1
+
+typedef struct LGRecHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t kvmfrVersion; // the KVMFR_VERSION of the recorded stream
+}
+LGRecHeader;
+
+enum
+{
+  LGREC_FRAME  = 1,
+  LGREC_CURSOR = 2
+};
+
+typedef struct LGRecRecord
+{
+  uint32_t type; // LGREC_*
+  uint32_t size; // bytes of payload that follow
+  uint64_t time; // microseconds since the recording started
+}
+LGRecRecord;
+
+enum
+{
+  LGREC_FRAME_FULL = 0x1 // the data is the whole frame, not the damaged rects
+};
+
+typedef struct LGRecFrame
+{
+  uint32_t        formatVer;
+  FrameType       type;
+  uint32_t        screenWidth;
+  uint32_t        screenHeight;
+  uint32_t        frameWidth;
+  uint32_t        frameHeight;
+  FrameRotation   rotation;
+  uint32_t        stride;
+  uint32_t        pitch;
+  uint32_t        flags;            // LGREC_FRAME_*
+  uint32_t        damageRectsCount; // as sent, zero for full frame damage
+  FrameDamageRect damageRects[KVMFR_MAX_DAMAGE_RECTS];
+  uint32_t        dataSize;         // the data size before compression
+  uint32_t        compressedSize;   // the size of the LZ4 block that follows
+}
+LGRecFrame;
+
+typedef struct LGRecCursor
+{
+  uint32_t    flags;     // the CURSOR_FLAG_* of the message
+  uint32_t    shapeSize; // zero if the shape is one sent before with shapeID
+  KVMFRCursor cursor;
+}
+LGRecCursor;
+
+/**
+ * Returns the bytes per pixel used to pack the damaged rects of a frame, or
+ * zero if the frame type can only be recorded whole
+ */
+unsigned int recording_rectsBpp(FrameType type);
+
+/**
+ * Returns the size of the damaged rects when packed
+ */
+size_t recording_rectsSize(const FrameDamageRect * rects, unsigned int count,
+    unsigned int bpp);
+
+/**
+ * Pack the damaged rects of the frame in src into dst, which must hold
+ * recording_rectsSize bytes
+ */
+void recording_packRects(void * dst, const void * src, size_t pitch,
+    unsigned int bpp, const FrameDamageRect * rects, unsigned int count);
+
+/**
+ * Unpack the damaged rects in src over the frame in dst.
+ * Returns false if the rects are outside of the frame or src is too short
+ */
+bool recording_unpackRects(void * dst, size_t pitch, unsigned int width,
+    unsigned int height, unsigned int bpp, const void * src, size_t srcSize,
+    const FrameDamageRect * rects, unsigned int count);
+
+#endif
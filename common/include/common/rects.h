@@ -21,10 +21,12 @@
 #ifndef _LG_COMMON_RECTS_H_
 #define _LG_COMMON_RECTS_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
 #include "common/framebuffer.h"
+#include "common/KVMFR.h"
 #include "common/types.h"
 
 inline static void rectCopyUnaligned(uint8_t * dest, const uint8_t * src,
@@ -49,4 +51,91 @@ void rectsFramebufferToBuffer(FrameDamageRect * rects, int count,
 int rectsMergeOverlapping(FrameDamageRect * rects, int count);
 int rectsRejectContained(FrameDamageRect * rects, int count);
 
+/* the fixed cost of copying a rect, in pixels. Rects are merged when their
+ * bounding box copies fewer extra pixels than this */
+#define RECTS_MERGE_COST 4096
+
+/* merges overlapping rects, then those cheaper to copy as one, and then the
+ * cheapest pairs until no more than maxRects remain. Returns the new count, or
+ * 0 (full damage) if the rects cover fullPercent of the width x height frame */
+int rectsOptimize(FrameDamageRect * rects, int count, int maxRects,
+  unsigned int width, unsigned int height, unsigned int fullPercent);
+
+// the damage a frame slot is behind by, a negative count is the whole frame
+struct FrameDamage
+{
+  int             count;
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+};
+
+/* accumulates damage into a frame slot, merging the cheapest rects of the
+ * width x height frame when the slot runs out of room. Returns false if the
+ * slot must be fully re-written */
+bool rectsAddFrameDamage(struct FrameDamage * damage,
+  const FrameDamageRect * rects, int count, unsigned int width,
+  unsigned int height);
+
+/* the slot must receive the damage of this frame plus any damage from frames
+ * that were written into other slots since it was last written. Adds the rects
+ * to the slot and optimizes them down to maxRects, returns false if the whole
+ * frame must be written instead */
+bool rectsBeginFrameDamage(struct FrameDamage * damage,
+  const FrameDamageRect * rects, int count, int maxRects, unsigned int width,
+  unsigned int height);
+
+/* once a frame is written into slots[index] that slot is up to date and every
+ * other slot of the count is behind by the frame's rects */
+void rectsEndFrameDamage(struct FrameDamage * slots, int slotCount, int index,
+  const FrameDamageRect * rects, int count, unsigned int width,
+  unsigned int height);
+
+/* returns the index of the first cell in [x, w) of a diff map row that is set
+ * (or clear if set is false), or w if there is none */
+unsigned int rectsDiffScan(const uint8_t * row, unsigned int x, unsigned int w,
+  bool set);
+
+/* builds the damage rects for a diff map of mapWidth x mapHeight cells that
+ * are (1 << shift) pixels square, clipped to width x height pixels. Returns
+ * the number of rects, or 0 (full damage) if they do not fit in maxRects */
+int rectsFromDiffMap(FrameDamageRect * rects, int maxRects,
+  const uint8_t * map, unsigned int mapWidth, unsigned int mapHeight,
+  int shift, unsigned int width, unsigned int height);
+
+/* damage maps hold one bit per KVMFR_DAMAGE_TILE_SHIFT tile, least significant
+ * bit first, with each row of tiles padded to whole bytes */
+inline static unsigned int rectsDamageMapTiles(unsigned int pixels)
+{
+  return (pixels + (1U << KVMFR_DAMAGE_TILE_SHIFT) - 1) >>
+    KVMFR_DAMAGE_TILE_SHIFT;
+}
+
+inline static unsigned int rectsDamageMapStride(unsigned int tilesX)
+{
+  return (tilesX + 7) / 8;
+}
+
+/* returns false if a width x height frame needs more than
+ * KVMFR_DAMAGE_MAP_SIZE bytes of map */
+inline static bool rectsDamageMapFits(unsigned int width, unsigned int height)
+{
+  return (size_t)rectsDamageMapStride(rectsDamageMapTiles(width)) *
+    rectsDamageMapTiles(height) <= KVMFR_DAMAGE_MAP_SIZE;
+}
+
+// sets the tiles touched by the rects
+void rectsDamageMapAdd(uint8_t * map, unsigned int tilesX, unsigned int tilesY,
+  const FrameDamageRect * rects, int count);
+
+/* builds at most maxRects damage rects covering the set tiles of a damage map
+ * clipped to width x height pixels, merging where needed. Returns the number
+ * of rects, or 0 (full damage) if the tiles are too scattered to decode */
+int rectsFromDamageMap(FrameDamageRect * rects, int maxRects,
+  const uint8_t * map, unsigned int tilesX, unsigned int tilesY,
+  unsigned int width, unsigned int height);
+
+/* converts frame space rects of a FRAME_TYPE_NV12 frame in place into rects
+ * over its 32bpp texel image, one for each plane. The array must have room
+ * for twice the count, the new count is returned */
+int rectsToNV12(FrameDamageRect * rects, int count, unsigned int height);
+
 #endif
@@ -23,6 +23,8 @@
 
 typedef struct RingBuffer * RingBuffer;
 
+/* The length is rounded up to a power of two, ringbuffer_getLength returns the
+ * rounded length */
 RingBuffer ringbuffer_new(int length, size_t valueSize);
 
 /* In an unbounded ring buffer, the read and write pointers are free to move
@@ -67,6 +69,19 @@ int ringbuffer_append(const RingBuffer rb, const void * values, int count);
  * Note: This function is thread-safe */
 int ringbuffer_consume(const RingBuffer rb, void * values, int count);
 
+/* Zero-copy access for one reader and one writer of a bounded buffer. The
+ * reserve functions return how many of up to count values are available as
+ * one contiguous span in values, which can be fewer than are available in
+ * total when the span reaches the end of the buffer. The caller fills in or
+ * reads the span in place, then commits the number of values it used, which can
+ * not be more than were reserved.
+ * Note: These functions are thread-safe for a single reader and writer */
+int  ringbuffer_reserveWrite(const RingBuffer rb, void ** values, int count);
+void ringbuffer_commitWrite (const RingBuffer rb, int count);
+int  ringbuffer_reserveRead (const RingBuffer rb, const void ** values,
+    int count);
+void ringbuffer_commitRead  (const RingBuffer rb, int count);
+
 typedef bool (*RingBufferIterator)(int index, void * value, void * udata);
 void ringbuffer_forEach(const RingBuffer rb, RingBufferIterator fn,
     void * udata, bool reverse);
@@ -0,0 +1,74 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_COMMON_STATS_
+#define _H_LG_COMMON_STATS_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * A fixed size histogram with log-linear buckets, 32 per power of two, so
+ * any value is placed within about 3% of itself. Recording is lock-free and
+ * may happen from any number of threads while another queries it.
+ */
+typedef struct StatsHistogram * StatsHistogram;
+
+typedef struct StatsSummary
+{
+  uint64_t count;
+  int64_t  min, max;
+  double   mean;
+  int64_t  p50, p90, p99;
+}
+StatsSummary;
+
+StatsHistogram stats_histogramNew(void);
+void stats_histogramFree(StatsHistogram * h);
+
+// negative values are recorded as zero
+void stats_histogramRecord(StatsHistogram h, int64_t value);
+void stats_histogramReset(StatsHistogram h);
+uint64_t stats_histogramCount(StatsHistogram h);
+
+/**
+ * Returns the value at or below which the percentile of the recorded values
+ * falls, to the precision of the bucket it lands in, or 0 if empty
+ */
+int64_t stats_histogramPercentile(StatsHistogram h, double percentile);
+
+void stats_histogramSummary(StatsHistogram h, StatsSummary * summary);
+
+/**
+ * An exponentially weighted moving average, alpha is the weight of each new
+ * value. Not thread-safe.
+ */
+typedef struct StatsEWMA
+{
+  double alpha;
+  double value;
+  bool   valid;
+}
+StatsEWMA;
+
+void stats_ewmaInit(StatsEWMA * ewma, double alpha);
+double stats_ewmaPush(StatsEWMA * ewma, double value);
+
+#endif
@@ -30,4 +30,25 @@ bool lgCreateThread(const char * name, LGThreadFunction function, void * opaque,
     LGThread ** handle);
 bool lgJoinThread  (LGThread * handle, int * resultCode);
 
+typedef enum LGThreadPriority
+{
+  LG_THREAD_PRIORITY_NORMAL,
+  LG_THREAD_PRIORITY_HIGH,     // latency sensitive, ie. render and input
+  LG_THREAD_PRIORITY_CAPTURE,  // MMCSS "Capture", or SCHED_FIFO on Linux
+  LG_THREAD_PRIORITY_PLAYBACK  // MMCSS "Playback", or SCHED_FIFO on Linux
+}
+LGThreadPriority;
+
+/**
+ * Set the scheduling priority of the calling thread. If the realtime classes
+ * are not permitted this falls back to the highest priority that is, and
+ * returns false if the priority could not be raised at all, which is not fatal
+ */
+bool lgThreadSetPriority(LGThreadPriority priority);
+
+/**
+ * Pin the calling thread to a CPU, or allow it to run on any if cpu is -1
+ */
+bool lgThreadSetAffinity(int cpu);
+
 #endif
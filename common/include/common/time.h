@@ -125,9 +125,35 @@ static inline void tsAdd(struct timespec *a, uint64_t ns)
   a->tv_nsec = ns;
 }
 
+/**
+ * Sleep until microtime() reaches deadline. On Windows this uses a high
+ * resolution waitable timer where the OS provides one, on Linux an absolute
+ * clock_nanosleep so the sleep does not drift with the time spent setting it up
+ */
+void lgSleepUntil(uint64_t deadline);
+
+/**
+ * Set how far the kernel may defer the calling thread's timed waits so it can
+ * coalesce wakeups. Frame pacing threads want this small, it is a no-op on
+ * platforms without the control
+ */
+void lgSetTimerSlack(uint64_t ns);
+
 typedef bool (*LGTimerFn)(void * udata);
 
+/**
+ * Call fn every intervalMS until it returns false. The timers share one
+ * thread, or the message window on Windows, so fn must not block
+ */
 bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
     void * udata, LGTimer ** result);
 
+/**
+ * As lgCreateTimer, but the timer may run up to slackMS late so that its
+ * wakeup can be shared with other timers. lgCreateTimer allows an eighth of
+ * the interval
+ */
+bool lgCreateTimerSlack(const unsigned int intervalMS,
+    const unsigned int slackMS, LGTimerFn fn, void * udata, LGTimer ** result);
+
 void lgTimerDestroy(LGTimer * timer);
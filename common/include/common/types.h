@@ -55,6 +55,8 @@ typedef enum FrameType
   FRAME_TYPE_RGBA      , // RGBA interleaved: R,G,B,A 32bpp
   FRAME_TYPE_RGBA10    , // RGBA interleaved: R,G,B,A 10,10,10,2 bpp
   FRAME_TYPE_RGBA16F   , // RGBA interleaved: R,G,B,A 16,16,16,16 bpp float
+  FRAME_TYPE_NV12      , // NV12 planar: Y plane then interleaved U,V 12bpp
+  FRAME_TYPE_RGBA10_PQ , // as RGBA10 holding scRGB as BT.2100 PQ in BT.2020
   FRAME_TYPE_MAX       , // sentinel value
 }
 FrameType;
@@ -77,6 +79,15 @@ typedef struct FrameDamageRect
 }
 FrameDamageRect;
 
+// a KVMFR damage map, see rectsFromDamageMap
+typedef struct FrameDamageMap
+{
+  unsigned int    width;  // in tiles
+  unsigned int    height; // in tiles
+  const uint8_t * bits;
+}
+FrameDamageMap;
+
 extern const char * FrameTypeStr[FRAME_TYPE_MAX];
 
 typedef enum CursorType
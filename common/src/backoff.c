@@ -0,0 +1,98 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/backoff.h"
+#include "common/debug.h"
+#include "common/time.h"
+
+#include <stdatomic.h>
+#include <inttypes.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define cpuRelax() _mm_pause()
+#elif defined(__aarch64__)
+#define cpuRelax() __asm__ volatile("yield")
+#else
+#define cpuRelax() do {} while(0)
+#endif
+
+#define BACKOFF_SPIN_WAITS 16     // pause bursts before yielding
+#define BACKOFF_YIELD_NS   50000  // yield for up to 50us before sleeping
+#define BACKOFF_SLEEP_NS   100000 // then sleep 100us at a time
+
+static atomic_uint_fast64_t tierCounts[BACKOFF_TIERS];
+
+uint64_t backoff_wait(Backoff * backoff)
+{
+  const uint64_t now = nanotime();
+  if (backoff->count++ == 0)
+    backoff->start = now;
+
+  const uint64_t elapsed = now - backoff->start;
+
+  if (backoff->count <= BACKOFF_SPIN_WAITS)
+  {
+    // double the burst on each wait up to 64 pauses
+    const unsigned int shift = backoff->count - 1;
+    for (unsigned int i = 1U << (shift < 6 ? shift : 6); i; --i)
+      cpuRelax();
+    atomic_fetch_add_explicit(tierCounts + BACKOFF_SPIN, 1,
+        memory_order_relaxed);
+  }
+  else if (elapsed < BACKOFF_YIELD_NS)
+  {
+#if defined(_WIN32)
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+    atomic_fetch_add_explicit(tierCounts + BACKOFF_YIELD, 1,
+        memory_order_relaxed);
+  }
+  else
+  {
+    nsleep(BACKOFF_SLEEP_NS);
+    atomic_fetch_add_explicit(tierCounts + BACKOFF_SLEEP, 1,
+        memory_order_relaxed);
+  }
+
+  return elapsed;
+}
+
+void backoff_stats(uint64_t counts[BACKOFF_TIERS])
+{
+  for (int i = 0; i < BACKOFF_TIERS; ++i)
+    counts[i] = atomic_load_explicit(tierCounts + i, memory_order_relaxed);
+}
+
+void backoff_log_stats(const char * name)
+{
+  uint64_t counts[BACKOFF_TIERS];
+  backoff_stats(counts);
+  DEBUG_INFO("%s backoff: %" PRIu64 " spin, %" PRIu64 " yield, %" PRIu64 " sleep",
+      name, counts[BACKOFF_SPIN], counts[BACKOFF_YIELD], counts[BACKOFF_SLEEP]);
+}
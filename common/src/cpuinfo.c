@@ -21,6 +21,83 @@
 #include "common/cpuinfo.h"
 #include "common/debug.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+// set in the cache once the features have been detected
+#define CPU_FEATURES_VALID (1U << 31)
+
+static atomic_uint cpuFeatures = 0;
+
+static const struct
+{
+  unsigned int feature;
+  const char * name;
+}
+featureNames[] =
+{
+  { CPU_FEATURE_SSE2    , "SSE2"      },
+  { CPU_FEATURE_SSE41   , "SSE4.1"    },
+  { CPU_FEATURE_AVX     , "AVX"       },
+  { CPU_FEATURE_AVX2    , "AVX2"      },
+  { CPU_FEATURE_FMA     , "FMA"       },
+  { CPU_FEATURE_AVX512F , "AVX-512F"  },
+  { CPU_FEATURE_AVX512BW, "AVX-512BW" },
+  { CPU_FEATURE_NEON    , "NEON"      },
+};
+
+static unsigned int detectFeatures(void)
+{
+  unsigned int features = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+  // these also check the OS saves the wider registers
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"    )) features |= CPU_FEATURE_SSE2;
+  if (__builtin_cpu_supports("sse4.1"  )) features |= CPU_FEATURE_SSE41;
+  if (__builtin_cpu_supports("avx"     )) features |= CPU_FEATURE_AVX;
+  if (__builtin_cpu_supports("avx2"    )) features |= CPU_FEATURE_AVX2;
+  if (__builtin_cpu_supports("fma"     )) features |= CPU_FEATURE_FMA;
+  if (__builtin_cpu_supports("avx512f" )) features |= CPU_FEATURE_AVX512F;
+  if (__builtin_cpu_supports("avx512bw")) features |= CPU_FEATURE_AVX512BW;
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+  // Advanced SIMD is part of the AArch64 baseline
+  features |= CPU_FEATURE_NEON;
+#endif
+
+  return features;
+}
+
+unsigned int lgCPUFeatures(void)
+{
+  unsigned int features = atomic_load_explicit(&cpuFeatures,
+      memory_order_relaxed);
+
+  // racing callers all detect and store the same value
+  if (!(features & CPU_FEATURES_VALID))
+  {
+    features = detectFeatures() | CPU_FEATURES_VALID;
+    atomic_store_explicit(&cpuFeatures, features, memory_order_relaxed);
+  }
+
+  return features & ~CPU_FEATURES_VALID;
+}
+
+size_t lgCPUSelect(const unsigned int * features, size_t stride, size_t count)
+{
+  const unsigned int have = lgCPUFeatures();
+  for(size_t i = 0; i < count; ++i)
+  {
+    const unsigned int need =
+      *(const unsigned int *)((const char *)features + i * stride);
+    if ((have & need) == need)
+      return i;
+  }
+
+  DEBUG_FATAL("No implementation for the features of this CPU");
+}
+
 void lgDebugCPU(void)
 {
   char model[1024];
@@ -36,4 +113,16 @@ void lgDebugCPU(void)
 
   DEBUG_INFO("CPU Model: %s", model);
   DEBUG_INFO("CPU: %d sockets, %d cores, %d threads", sockets, cores, procs);
+
+  char features[128] = "";
+  const unsigned int have = lgCPUFeatures();
+  for(int i = 0; i < sizeof(featureNames) / sizeof(*featureNames); ++i)
+    if (have & featureNames[i].feature)
+    {
+      if (*features)
+        strcat(features, " ");
+      strcat(features, featureNames[i].name);
+    }
+
+  DEBUG_INFO("CPU Features: %s", *features ? features : "none");
 }
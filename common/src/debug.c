@@ -19,29 +19,295 @@
  */
 
 #include "common/debug.h"
+#include "common/thread.h"
+#include "common/event.h"
 
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdatomic.h>
 
-inline static void debug_level(enum DebugLevel level, const char * file,
+// must be a power of two
+#define DEBUG_RECORDS     256
+#define DEBUG_RECORD_LEN  512
+#define DEBUG_FLUSH_LEN   8192
+
+// warnings and errors past this many a second from one call site are dropped
+#define DEBUG_RATE_SLOTS  64
+#define DEBUG_RATE_LIMIT  10
+
+struct DebugRecord
+{
+  atomic_uint seq;
+  unsigned int len;
+  char         text[DEBUG_RECORD_LEN];
+};
+
+struct DebugRate
+{
+  _Atomic(uintptr_t) key;
+  _Atomic(uint64_t)  window;
+  atomic_uint        count;
+  atomic_uint        suppressed;
+};
+
+static struct
+{
+  /* a bounded queue of formatted records, any thread may add to it and only
+   * the holder of flushLock takes from it */
+  struct DebugRecord records[DEBUG_RECORDS];
+  atomic_uint        head;
+  unsigned int       tail;
+  atomic_flag        flushLock;
+  atomic_uint        dropped;
+
+  atomic_bool        async;
+  atomic_bool        running;
+  LGThread         * thread;
+  LGEvent          * event;
+
+  struct DebugRate   rate[DEBUG_RATE_SLOTS];
+}
+debug = { .flushLock = ATOMIC_FLAG_INIT };
+
+static void flushRecords(bool wait)
+{
+  while (atomic_flag_test_and_set_explicit(&debug.flushLock,
+        memory_order_acquire))
+    if (!wait)
+      return;
+
+  char buffer[DEBUG_FLUSH_LEN];
+  size_t len = 0;
+
+  while (true)
+  {
+    struct DebugRecord * rec = debug.records + (debug.tail & (DEBUG_RECORDS - 1));
+    const unsigned int seq = atomic_load_explicit(&rec->seq,
+        memory_order_acquire);
+    if (seq != debug.tail + 1)
+      break;
+
+    if (len + rec->len > sizeof(buffer))
+    {
+      fwrite(buffer, 1, len, stderr);
+      len = 0;
+    }
+
+    memcpy(buffer + len, rec->text, rec->len);
+    len += rec->len;
+
+    atomic_store_explicit(&rec->seq, debug.tail + DEBUG_RECORDS,
+        memory_order_release);
+    ++debug.tail;
+  }
+
+  if (len)
+    fwrite(buffer, 1, len, stderr);
+
+  const unsigned int dropped = atomic_exchange(&debug.dropped, 0);
+  if (dropped)
+    fprintf(stderr, "%s%12" PRId64 " | %u log messages were dropped%s\n",
+        debug_lookup[DEBUG_LEVEL_WARN], microtime(), dropped,
+        debug_lookup[DEBUG_LEVEL_NONE]);
+
+  atomic_flag_clear_explicit(&debug.flushLock, memory_order_release);
+}
+
+static int flushThread(void * opaque)
+{
+  while (atomic_load(&debug.running))
+  {
+    lgWaitEvent(debug.event, 100);
+    flushRecords(true);
+  }
+  return 0;
+}
+
+static void debug_stop(void)
+{
+  if (!debug.thread)
+    return;
+
+  atomic_store(&debug.async  , false);
+  atomic_store(&debug.running, false);
+  lgSignalEvent(debug.event);
+  lgJoinThread(debug.thread, NULL);
+  debug.thread = NULL;
+
+  // anything queued after the thread's last pass
+  flushRecords(true);
+  lgFreeEvent(debug.event);
+  debug.event = NULL;
+}
+
+void debug_init(void)
+{
+  debug_platformInit();
+
+  if (debug.thread)
+    return;
+
+  for (unsigned int i = 0; i < DEBUG_RECORDS; ++i)
+    atomic_init(&debug.records[i].seq, i);
+
+  debug.event = lgCreateEvent(true, 0);
+  if (!debug.event)
+    return;
+
+  atomic_store(&debug.running, true);
+  if (!lgCreateThread("debugFlush", flushThread, NULL, &debug.thread))
+  {
+    atomic_store(&debug.running, false);
+    lgFreeEvent(debug.event);
+    debug.event = NULL;
+    return;
+  }
+
+  atomic_store(&debug.async, true);
+  atexit(debug_stop);
+}
+
+void debug_sync(void)
+{
+  if (!atomic_exchange(&debug.async, false))
+    return;
+
+  // the flush may be what crashed, in which case what is queued is lost
+  flushRecords(false);
+}
+
+/* returns false if the call site has logged too often this second. The slots
+ * are shared by call sites that hash alike and updated without a lock, so the
+ * limit is approximate, which is all it needs to be */
+static bool rateLimit(const char * file, unsigned int line,
+    unsigned int * suppressed)
+{
+  const uintptr_t key  = (uintptr_t)file ^ ((uintptr_t)line << 20);
+  struct DebugRate * r = debug.rate + ((key ^ (key >> 6)) % DEBUG_RATE_SLOTS);
+  const uint64_t window = microtime() / 1000000;
+
+  if (atomic_load(&r->key) != key)
+  {
+    atomic_store(&r->key       , key);
+    atomic_store(&r->window    , window);
+    atomic_store(&r->count     , 0);
+    atomic_store(&r->suppressed, 0);
+  }
+  else if (atomic_exchange(&r->window, window) != window)
+    atomic_store(&r->count, 0);
+
+  if (atomic_fetch_add(&r->count, 1) >= DEBUG_RATE_LIMIT)
+  {
+    atomic_fetch_add(&r->suppressed, 1);
+    return false;
+  }
+
+  *suppressed = atomic_exchange(&r->suppressed, 0);
+  return true;
+}
+
+static void writeSync(enum DebugLevel level, const char * file,
     unsigned int line, const char * function, const char * format, va_list va)
 {
-  const char * f = strrchr(file, DIRECTORY_SEPARATOR) + 1;
   fprintf(stderr, "%s%12" PRId64 "%20s:%-4u | %-30s | ",
-      debug_lookup[level], microtime(), f,
+      debug_lookup[level], microtime(), file,
       line, function);
   vfprintf(stderr, format, va);
   fprintf(stderr, "%s\n", debug_lookup[DEBUG_LEVEL_NONE]);
 }
 
+static void queueRecord(enum DebugLevel level, const char * file,
+    unsigned int line, const char * function, unsigned int suppressed,
+    const char * format, va_list va)
+{
+  unsigned int pos = atomic_load_explicit(&debug.head, memory_order_relaxed);
+  struct DebugRecord * rec;
+  while (true)
+  {
+    rec = debug.records + (pos & (DEBUG_RECORDS - 1));
+    const int diff = (int)(atomic_load_explicit(&rec->seq,
+          memory_order_acquire) - pos);
+
+    if (diff == 0)
+    {
+      if (atomic_compare_exchange_weak_explicit(&debug.head, &pos, pos + 1,
+            memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+    {
+      // the flush is not keeping up, never stall the caller on it
+      atomic_fetch_add(&debug.dropped, 1);
+      return;
+    }
+    else
+      pos = atomic_load_explicit(&debug.head, memory_order_relaxed);
+  }
+
+  const int max = DEBUG_RECORD_LEN - 1;
+  int len = snprintf(rec->text, max, "%s%12" PRId64 "%20s:%-4u | %-30s | ",
+      debug_lookup[level], microtime(), file, line, function);
+
+  if (len < max)
+    len += vsnprintf(rec->text + len, max - len, format, va);
+
+  if (suppressed && len < max)
+    len += snprintf(rec->text + len, max - len,
+        " (%u repeats suppressed)", suppressed);
+
+  if (len < max)
+    len += snprintf(rec->text + len, max - len, "%s\n",
+        debug_lookup[DEBUG_LEVEL_NONE]);
+
+  // the record must still be released, overlong messages are truncated
+  if (len >= max)
+  {
+    len = max;
+    rec->text[len - 1] = '\n';
+  }
+
+  rec->len = len;
+  atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+  lgSignalEvent(debug.event);
+}
+
+static void debug_level(enum DebugLevel level, const char * file,
+    unsigned int line, const char * function, const char * format, va_list va)
+{
+  if (level == DEBUG_LEVEL_FATAL)
+    debug_sync();
+
+  if (!atomic_load_explicit(&debug.async, memory_order_relaxed))
+  {
+    writeSync(level, file, line, function, format, va);
+    return;
+  }
+
+  unsigned int suppressed = 0;
+  if ((level == DEBUG_LEVEL_WARN || level == DEBUG_LEVEL_ERROR) &&
+      !rateLimit(file, line, &suppressed))
+    return;
+
+  queueRecord(level, file, line, function, suppressed, format, va);
+}
+
+void debug_print(enum DebugLevel level, const char * file, unsigned int line,
+    const char * function, const char * format, ...)
+{
+  va_list va;
+  va_start(va, format);
+  debug_level(level, file, line, function, format, va);
+  va_end(va);
+}
 
 void debug_info(const char * file, unsigned int line, const char * function,
     const char * format, ...)
 {
   va_list va;
   va_start(va, format);
-  debug_level(DEBUG_LEVEL_INFO, file, line, function, format, va);
+  debug_level(DEBUG_LEVEL_INFO, strrchr(file, DIRECTORY_SEPARATOR) + 1,
+      line, function, format, va);
   va_end(va);
 }
 
@@ -50,7 +316,8 @@ void debug_warn(const char * file, unsigned int line, const char * function,
 {
   va_list va;
   va_start(va, format);
-  debug_level(DEBUG_LEVEL_WARN, file, line, function, format, va);
+  debug_level(DEBUG_LEVEL_WARN, strrchr(file, DIRECTORY_SEPARATOR) + 1,
+      line, function, format, va);
   va_end(va);
 }
 
@@ -59,6 +326,7 @@ void debug_error(const char * file, unsigned int line, const char * function,
 {
   va_list va;
   va_start(va, format);
-  debug_level(DEBUG_LEVEL_ERROR, file, line, function, format, va);
+  debug_level(DEBUG_LEVEL_ERROR, strrchr(file, DIRECTORY_SEPARATOR) + 1,
+      line, function, format, va);
   va_end(va);
 }
@@ -0,0 +1,179 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/fbprofile.h"
+#include "common/debug.h"
+#include "common/time.h"
+
+#include <inttypes.h>
+
+/* each power of two is split into four linear buckets, values below four
+ * ticks get a bucket each */
+#define FBP_SUB_BITS 2
+#define FBP_SUB      (1 << FBP_SUB_BITS)
+#define FBP_BUCKETS  ((64 - FBP_SUB_BITS) * FBP_SUB + FBP_SUB)
+
+struct FBProfileHist
+{
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t sum;
+  atomic_uint_fast64_t max;
+  atomic_uint_fast64_t buckets[FBP_BUCKETS];
+};
+
+atomic_bool fbprofile_enabled = false;
+
+static struct FBProfileHist l_hist[FB_PROFILE_OP_MAX];
+
+// the TSC and the clock when profiling was enabled, used to convert to time
+static uint64_t l_startTSC;
+static uint64_t l_startNS;
+
+static const char * l_opNames[FB_PROFILE_OP_MAX] =
+{
+  [FB_PROFILE_READ ] = "read",
+  [FB_PROFILE_WRITE] = "write",
+  [FB_PROFILE_RECTS] = "rects"
+};
+
+static inline unsigned int bucketIndex(uint64_t ticks)
+{
+  if (ticks < FBP_SUB)
+    return ticks;
+
+  const unsigned int msb = 63 - __builtin_clzll(ticks);
+  return (msb - FBP_SUB_BITS + 1) * FBP_SUB +
+    ((ticks >> (msb - FBP_SUB_BITS)) & (FBP_SUB - 1));
+}
+
+static inline uint64_t bucketFloor(unsigned int index)
+{
+  if (index < FBP_SUB)
+    return index;
+
+  const unsigned int msb = index / FBP_SUB + FBP_SUB_BITS - 1;
+  return (uint64_t)(FBP_SUB + index % FBP_SUB) << (msb - FBP_SUB_BITS);
+}
+
+void fbprofile_enable(bool enable)
+{
+  if (enable && !atomic_load(&fbprofile_enabled))
+  {
+    l_startNS  = nanotime();
+    l_startTSC = fbprofile_ticks();
+  }
+
+  atomic_store(&fbprofile_enabled, enable);
+}
+
+void fbprofile_reset(void)
+{
+  for(int op = 0; op < FB_PROFILE_OP_MAX; ++op)
+  {
+    struct FBProfileHist * h = &l_hist[op];
+    atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->sum  , 0, memory_order_relaxed);
+    atomic_store_explicit(&h->max  , 0, memory_order_relaxed);
+    for(int i = 0; i < FBP_BUCKETS; ++i)
+      atomic_store_explicit(&h->buckets[i], 0, memory_order_relaxed);
+  }
+}
+
+void fbprofile_record(FBProfileOp op, uint64_t ticks)
+{
+  struct FBProfileHist * h = &l_hist[op];
+  atomic_fetch_add_explicit(&h->buckets[bucketIndex(ticks)], 1,
+      memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum, ticks, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+
+  uint_fast64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+  while(ticks > max && !atomic_compare_exchange_weak_explicit(&h->max, &max,
+        ticks, memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+static double ticksPerUs(void)
+{
+  // give the calibration at least 10ms to keep its error small
+  uint64_t elapsed = nanotime() - l_startNS;
+  if (elapsed < 10000000)
+  {
+    nsleep(10000000 - elapsed);
+    elapsed = nanotime() - l_startNS;
+  }
+
+  return (double)(fbprofile_ticks() - l_startTSC) * 1000.0 / elapsed;
+}
+
+bool fbprofile_query(FBProfileOp op, FBProfileStats * stats)
+{
+  if (op >= FB_PROFILE_OP_MAX)
+    return false;
+
+  struct FBProfileHist * h = &l_hist[op];
+  uint64_t counts[FBP_BUCKETS];
+  uint64_t total = 0;
+  for(int i = 0; i < FBP_BUCKETS; ++i)
+    total += counts[i] =
+      atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+
+  *stats = (FBProfileStats){ .count = total };
+  if (!total)
+    return true;
+
+  const double scale = 1.0 / ticksPerUs();
+  stats->avgUs =
+    atomic_load_explicit(&h->sum, memory_order_relaxed) * scale /
+    atomic_load_explicit(&h->count, memory_order_relaxed);
+  stats->maxUs = atomic_load_explicit(&h->max, memory_order_relaxed) * scale;
+
+  const uint64_t p50 = (total * 50 + 99) / 100;
+  const uint64_t p90 = (total * 90 + 99) / 100;
+  const uint64_t p99 = (total * 99 + 99) / 100;
+  uint64_t seen = 0;
+  for(int i = 0; i < FBP_BUCKETS; ++i)
+  {
+    if (!counts[i])
+      continue;
+
+    const uint64_t before = seen;
+    seen += counts[i];
+    const double us = bucketFloor(i) * scale;
+    if (before < p50 && seen >= p50) stats->p50Us = us;
+    if (before < p90 && seen >= p90) stats->p90Us = us;
+    if (before < p99 && seen >= p99) stats->p99Us = us;
+  }
+
+  return true;
+}
+
+void fbprofile_log(void)
+{
+  for(int op = 0; op < FB_PROFILE_OP_MAX; ++op)
+  {
+    FBProfileStats s;
+    if (!fbprofile_query(op, &s) || !s.count)
+      continue;
+
+    DEBUG_INFO("Frame buffer %-5s: %8" PRIu64 " calls, avg:%.2fμs "
+        "p50:%.2fμs p90:%.2fμs p99:%.2fμs max:%.2fμs",
+        l_opNames[op], s.count, s.avgUs, s.p50Us, s.p90Us, s.p99Us, s.maxUs);
+  }
+}
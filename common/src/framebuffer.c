@@ -20,28 +20,573 @@
 
 #include "common/framebuffer.h"
 #include "common/debug.h"
+#include "common/thread.h"
+#include "common/event.h"
+#include "common/locking.h"
+#include "common/lz4.h"
+#include "common/backoff.h"
+#include "common/fbprofile.h"
+#include "common/array.h"
+#include "common/util.h"
 
-//#define FB_PROFILE
-#ifdef FB_PROFILE
-#include "common/runningavg.h"
-#endif
+#include "common/cpuinfo.h"
 
 #include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FB_X86
 #include <emmintrin.h>
 #include <smmintrin.h>
-#include <unistd.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#define FB_NEON
+#include <arm_neon.h>
+#endif
+
+typedef void (*FBCopyFn)(void * restrict dst, const void * restrict src,
+    size_t size);
+
+typedef struct FBKernel
+{
+  unsigned int features;
+  const char * name;
+  size_t       align;
+  size_t       block;
+  FBCopyFn     write;
+  FBCopyFn     read;
+}
+FBKernel;
+
+static void copyMemcpy(void * restrict dst, const void * restrict src,
+    size_t size)
+{
+  memcpy(dst, src, size);
+}
+
+// the non-temporal stores must be fenced before the data is published
+static inline void streamFence(void)
+{
+#ifdef FB_X86
+  _mm_sfence();
+#endif
+}
+
+#ifdef FB_X86
+/* streaming loads from the (possibly write-combined) source, this is the
+ * baseline kernel on x86 */
+__attribute__((target("sse4.1")))
+static void copySSE(void * restrict dst, const void * restrict src,
+    size_t size)
+{
+  __m128i * restrict s = (__m128i *)src;
+  __m128i * restrict d = (__m128i *)dst;
+
+  for(; size; size -= 64, s += 4, d += 4)
+  {
+    __m128i v1 = _mm_stream_load_si128(s + 0);
+    __m128i v2 = _mm_stream_load_si128(s + 1);
+    __m128i v3 = _mm_stream_load_si128(s + 2);
+    __m128i v4 = _mm_stream_load_si128(s + 3);
+
+    _mm_store_si128(d + 0, v1);
+    _mm_store_si128(d + 1, v2);
+    _mm_store_si128(d + 2, v3);
+    _mm_store_si128(d + 3, v4);
+  }
+}
+
+__attribute__((target("avx2")))
+static void writeAVX2(void * restrict dst, const void * restrict src,
+    size_t size)
+{
+  __m256i * restrict s = (__m256i *)src;
+  __m256i * restrict d = (__m256i *)dst;
+
+  for(; size; size -= 128, s += 4, d += 4)
+  {
+    __m256i v1 = _mm256_stream_load_si256(s + 0);
+    __m256i v2 = _mm256_stream_load_si256(s + 1);
+    __m256i v3 = _mm256_stream_load_si256(s + 2);
+    __m256i v4 = _mm256_stream_load_si256(s + 3);
+
+    _mm256_stream_si256(d + 0, v1);
+    _mm256_stream_si256(d + 1, v2);
+    _mm256_stream_si256(d + 2, v3);
+    _mm256_stream_si256(d + 3, v4);
+  }
+}
+
+__attribute__((target("avx2")))
+static void readAVX2(void * restrict dst, const void * restrict src,
+    size_t size)
+{
+  const __m256i * restrict s = (const __m256i *)src;
+  __m256i * restrict d = (__m256i *)dst;
+
+  for(; size; size -= 128, s += 4, d += 4)
+  {
+    __m256i v1 = _mm256_load_si256(s + 0);
+    __m256i v2 = _mm256_load_si256(s + 1);
+    __m256i v3 = _mm256_load_si256(s + 2);
+    __m256i v4 = _mm256_load_si256(s + 3);
+
+    _mm256_stream_si256(d + 0, v1);
+    _mm256_stream_si256(d + 1, v2);
+    _mm256_stream_si256(d + 2, v3);
+    _mm256_stream_si256(d + 3, v4);
+  }
+}
+
+__attribute__((target("avx512f")))
+static void writeAVX512(void * restrict dst, const void * restrict src,
+    size_t size)
+{
+  __m512i * restrict s = (__m512i *)src;
+  __m512i * restrict d = (__m512i *)dst;
+
+  for(; size; size -= 256, s += 4, d += 4)
+  {
+    __m512i v1 = _mm512_stream_load_si512(s + 0);
+    __m512i v2 = _mm512_stream_load_si512(s + 1);
+    __m512i v3 = _mm512_stream_load_si512(s + 2);
+    __m512i v4 = _mm512_stream_load_si512(s + 3);
+
+    _mm512_stream_si512(d + 0, v1);
+    _mm512_stream_si512(d + 1, v2);
+    _mm512_stream_si512(d + 2, v3);
+    _mm512_stream_si512(d + 3, v4);
+  }
+}
+
+__attribute__((target("avx512f")))
+static void readAVX512(void * restrict dst, const void * restrict src,
+    size_t size)
+{
+  const __m512i * restrict s = (const __m512i *)src;
+  __m512i * restrict d = (__m512i *)dst;
+
+  for(; size; size -= 256, s += 4, d += 4)
+  {
+    __m512i v1 = _mm512_load_si512(s + 0);
+    __m512i v2 = _mm512_load_si512(s + 1);
+    __m512i v3 = _mm512_load_si512(s + 2);
+    __m512i v4 = _mm512_load_si512(s + 3);
+
+    _mm512_stream_si512(d + 0, v1);
+    _mm512_stream_si512(d + 1, v2);
+    _mm512_stream_si512(d + 2, v3);
+    _mm512_stream_si512(d + 3, v4);
+  }
+}
+
+#endif
+
+#ifdef FB_NEON
+/* a cache line per iteration with the next few prefetched, the loads are kept
+ * ahead of the stores so the copy is bound by the memory bandwidth rather than
+ * the load latency */
+static void copyNEON(void * restrict dst, const void * restrict src,
+    size_t size)
+{
+  const uint8_t * restrict s = (const uint8_t *)src;
+  uint8_t       * restrict d = (uint8_t *)dst;
+
+  for(; size; size -= 64, s += 64, d += 64)
+  {
+    __builtin_prefetch(s + 256);
+    const uint8x16_t v1 = vld1q_u8(s +  0);
+    const uint8x16_t v2 = vld1q_u8(s + 16);
+    const uint8x16_t v3 = vld1q_u8(s + 32);
+    const uint8x16_t v4 = vld1q_u8(s + 48);
+
+    vst1q_u8(d +  0, v1);
+    vst1q_u8(d + 16, v2);
+    vst1q_u8(d + 32, v3);
+    vst1q_u8(d + 48, v4);
+  }
+}
+#endif
+
+/* align is the required pointer alignment, block is the number of bytes each
+ * kernel processes per iteration. Ordered from the most to the least demanding
+ * for LG_CPU_DISPATCH */
+static const FBKernel kernels[] =
+{
+#ifdef FB_X86
+  { CPU_FEATURE_AVX512F, "AVX-512", 64, 256, writeAVX512, readAVX512 },
+  { CPU_FEATURE_AVX2   , "AVX2"   , 32, 128, writeAVX2  , readAVX2   },
+  { CPU_FEATURE_SSE41  , "SSE4.1" , 16, 64 , copySSE    , copyMemcpy },
+#endif
+#ifdef FB_NEON
+  { CPU_FEATURE_NEON   , "NEON"   , 16, 64 , copyNEON   , copyNEON   },
+#endif
+  { 0                  , "memcpy" , 1 , 64 , copyMemcpy , copyMemcpy },
+};
+
+static const FBKernel * kernel = NULL;
+
+void framebuffer_init(void)
+{
+  if (kernel)
+    return;
+
+  kernel = LG_CPU_DISPATCH(kernels);
+  DEBUG_INFO("Framebuffer Copy : %s", kernel->name);
+}
+
+static inline const FBKernel * getKernel(const void * dst, const void * src)
+{
+  if (!kernel)
+    framebuffer_init();
+
+  // fall back to the next kernel the buffers are suitably aligned for
+  const uintptr_t addr = (uintptr_t)dst | (uintptr_t)src;
+  const FBKernel * k = kernel;
+  while((addr & (k->align - 1)) || !lgCPUHas(k->features))
+    ++k;
+
+  return k;
+}
+
+/* frames smaller than this are not worth waking the copy workers for */
+#define FB_PARALLEL_MIN (FB_CHUNK_SIZE * 4)
+
+/* a read is split into bands of about a chunk, each waits for the write
+ * pointer to pass its own end so the bands can be copied in any order */
+typedef struct FBReadJob
+{
+  const FrameBuffer * frame;
+  uint8_t           * dst;
+  const FBKernel    * kernel;
+  size_t              dstpitch, pitch, height, linewidth;
+
+  // per line copies, the pitches differ
+  size_t              lines, block, tail;
+
+  size_t              bands;
+}
+FBReadJob;
+
+typedef struct FBWorker
+{
+  LGThread * thread;
+  LGEvent  * start;
+}
+FBWorker;
+
+static struct
+{
+  int          count;
+  FBWorker   * workers;
+  LGEvent    * done;
+  atomic_int   active;
+  atomic_bool  quit;
+
+  // held by the thread that owns the workers for its job, others copy alone
+  atomic_bool  busy;
+
+  // the current job, a read if set, otherwise a write
+  bool              read;
+  FBReadJob         readJob;
+  atomic_bool       readFailed;
+
+  FrameBuffer     * frame;
+  const uint8_t   * src;
+  size_t            size;
+  size_t            chunks;
+  const FBKernel  * kernel;
+  atomic_size_t     next;
+
+  // chunk completion state for in-order publishing of the write pointer
+  atomic_bool * complete;
+  size_t        completeSize;
+  size_t        published;
+  LG_Lock       publishLock;
+}
+pool = { 0 };
+
+static inline void readLines(const FBKernel * k, uint8_t * restrict d,
+    const uint8_t * restrict s, size_t lines, size_t dstpitch, size_t pitch,
+    size_t block, size_t tail)
+{
+  for(size_t y = 0; y < lines; ++y, d += dstpitch, s += pitch)
+  {
+    k->read(d, s, block);
+    if (tail)
+      memcpy(d + block, s + block, tail);
+  }
+}
+
+static bool readBand(const FBReadJob * job, size_t i)
+{
+  const FBKernel * k = job->kernel;
+  if (job->dstpitch == job->pitch)
+  {
+    const size_t size   = job->height * job->pitch;
+    const size_t offset = i * FB_CHUNK_SIZE;
+    const size_t copy   = min(size - offset, (size_t)FB_CHUNK_SIZE);
+    if (!framebuffer_wait(job->frame, offset + copy))
+      return false;
+
+    const size_t block = copy & ~(k->block - 1);
+    k->read(job->dst + offset, job->frame->data + offset, block);
+    if (block != copy)
+      memcpy(job->dst + offset + block, job->frame->data + offset + block,
+          copy - block);
+    return true;
+  }
+
+  const size_t y     = i * job->lines;
+  const size_t lines = min(job->height - y, job->lines);
+  const size_t rp    = y * job->pitch;
+  if (!framebuffer_wait(job->frame,
+        rp + (lines - 1) * job->pitch + job->linewidth))
+    return false;
+
+  uint8_t       * restrict d = job->dst + y * job->dstpitch;
+  const uint8_t * restrict s = job->frame->data + rp;
+
+  // the constant tail lets the common case drop the memcpy
+  if (job->tail)
+    readLines(k, d, s, lines, job->dstpitch, job->pitch, job->block,
+        job->tail);
+  else
+    readLines(k, d, s, lines, job->dstpitch, job->pitch, job->block, 0);
+  return true;
+}
+
+static void writeChunk(FrameBuffer * frame, const FBKernel * k,
+    const uint8_t * src, size_t offset, size_t size)
+{
+  const size_t block = size & ~(k->block - 1);
+  k->write(frame->data + offset, src + offset, block);
+  if (block != size)
+    memcpy(frame->data + offset + block, src + offset + block, size - block);
+
+  // ensure the non-temporal stores are visible before the chunk is marked
+  streamFence();
+}
+
+static void poolRead(void)
+{
+  size_t i;
+  while((i = atomic_fetch_add_explicit(&pool.next, 1,
+          memory_order_relaxed)) < pool.readJob.bands)
+  {
+    // once a band times out the frame is lost, skip the rest
+    if (atomic_load_explicit(&pool.readFailed, memory_order_relaxed) ||
+        !readBand(&pool.readJob, i))
+    {
+      atomic_store_explicit(&pool.readFailed, true, memory_order_relaxed);
+      continue;
+    }
+  }
+  streamFence();
+}
+
+static void poolProcess(void)
+{
+  if (pool.read)
+  {
+    poolRead();
+    return;
+  }
+
+  size_t i;
+  while((i = atomic_fetch_add_explicit(&pool.next, 1,
+          memory_order_relaxed)) < pool.chunks)
+  {
+    const size_t offset = i * FB_CHUNK_SIZE;
+    const size_t remain = pool.size - offset;
+    writeChunk(pool.frame, pool.kernel, pool.src, offset,
+        remain < FB_CHUNK_SIZE ? remain : FB_CHUNK_SIZE);
+
+    atomic_store_explicit(&pool.complete[i], true, memory_order_release);
+
+    /* a chunk can only be published once all the chunks before it are done as
+     * the reader consumes the frame progressively */
+    LG_LOCK(pool.publishLock);
+    size_t p = pool.published;
+    while(p < pool.chunks &&
+        atomic_load_explicit(&pool.complete[p], memory_order_acquire))
+      ++p;
+
+    if (p != pool.published)
+    {
+      pool.published = p;
+      const size_t wp = p * FB_CHUNK_SIZE;
+      atomic_store_explicit(&pool.frame->wp,
+          wp < pool.size ? wp : pool.size, memory_order_release);
+    }
+    LG_UNLOCK(pool.publishLock);
+  }
+}
+
+static int poolWorker(void * opaque)
+{
+  FBWorker * worker = (FBWorker *)opaque;
+  while(true)
+  {
+    lgWaitEvent(worker->start, TIMEOUT_INFINITE);
+    if (atomic_load_explicit(&pool.quit, memory_order_acquire))
+      break;
+
+    poolProcess();
+
+    if (atomic_fetch_sub_explicit(&pool.active, 1, memory_order_acq_rel) == 1)
+      lgSignalEvent(pool.done);
+  }
+
+  return 0;
+}
+
+bool framebuffer_start_workers(int count)
+{
+  if (pool.workers)
+    framebuffer_stop_workers();
+
+  if (count < 1)
+    return true;
+
+  pool.done = lgCreateEvent(true, 0);
+  if (!pool.done)
+  {
+    DEBUG_ERROR("Failed to create the copy done event");
+    return false;
+  }
+
+  pool.workers = calloc(count, sizeof(*pool.workers));
+  if (!pool.workers)
+  {
+    DEBUG_ERROR("out of memory");
+    goto err;
+  }
+
+  LG_LOCK_INIT(pool.publishLock);
+  atomic_store(&pool.quit, false);
+
+  for(pool.count = 0; pool.count < count; ++pool.count)
+  {
+    FBWorker * worker = &pool.workers[pool.count];
+    if (!(worker->start = lgCreateEvent(true, 0)))
+    {
+      DEBUG_ERROR("Failed to create the copy worker event");
+      goto err;
+    }
+
+    if (!lgCreateThread("FBCopyWorker", poolWorker, worker, &worker->thread))
+    {
+      DEBUG_ERROR("Failed to create the copy worker thread");
+      lgFreeEvent(worker->start);
+      goto err;
+    }
+  }
+
+  DEBUG_INFO("Copy Workers     : %d", pool.count);
+  return true;
+
+err:
+  framebuffer_stop_workers();
+  return false;
+}
+
+void framebuffer_stop_workers(void)
+{
+  atomic_store(&pool.quit, true);
+  for(int i = 0; i < pool.count; ++i)
+  {
+    lgSignalEvent(pool.workers[i].start);
+    lgJoinThread(pool.workers[i].thread, NULL);
+    lgFreeEvent(pool.workers[i].start);
+  }
+
+  free(pool.workers);
+  pool.workers = NULL;
+  pool.count   = 0;
 
+  if (pool.done)
+  {
+    lgFreeEvent(pool.done);
+    pool.done = NULL;
+  }
+
+  free(pool.complete);
+  pool.complete     = NULL;
+  pool.completeSize = 0;
+}
+
+static inline bool poolAcquire(void)
+{
+  return pool.count &&
+    !atomic_exchange_explicit(&pool.busy, true, memory_order_acquire);
+}
+
+static inline void poolRelease(void)
+{
+  atomic_store_explicit(&pool.busy, false, memory_order_release);
+}
+
+static void poolRun(void)
+{
+  atomic_store_explicit(&pool.next  , 0         , memory_order_relaxed);
+  atomic_store_explicit(&pool.active, pool.count, memory_order_release);
+
+  for(int i = 0; i < pool.count; ++i)
+    lgSignalEvent(pool.workers[i].start);
+
+  // the calling thread participates in the copy too
+  poolProcess();
+  lgWaitEvent(pool.done, TIMEOUT_INFINITE);
+}
+
+static bool writeParallel(FrameBuffer * frame, const FBKernel * k,
+    const uint8_t * src, size_t size)
+{
+  const size_t chunks = (size + FB_CHUNK_SIZE - 1) / FB_CHUNK_SIZE;
+  if (chunks > pool.completeSize)
+  {
+    atomic_bool * complete = realloc(pool.complete, chunks * sizeof(*complete));
+    if (!complete)
+      return false;
+
+    pool.complete     = complete;
+    pool.completeSize = chunks;
+  }
+
+  for(size_t i = 0; i < chunks; ++i)
+    atomic_init(&pool.complete[i], false);
+
+  pool.read      = false;
+  pool.frame     = frame;
+  pool.src       = src;
+  pool.size      = size;
+  pool.chunks    = chunks;
+  pool.kernel    = k;
+  pool.published = 0;
+  poolRun();
+  return true;
+}
+
+/* the writer may pause for a while between chunks, such as to wait on a GPU
+ * copy, so only a writer that has made no progress for FB_STALL_LIMIT is
+ * given up on. Progress also restarts the backoff as the next chunk is likely
+ * to follow soon */
 bool framebuffer_wait(const FrameBuffer * frame, size_t size)
 {
-  while(atomic_load_explicit(&frame->wp, memory_order_acquire) < size)
+  Backoff backoff = BACKOFF_INIT;
+  uint_least32_t last = 0;
+  uint_least32_t wp;
+  while((wp = atomic_load_explicit(&frame->wp, memory_order_acquire)) < size)
   {
-    int spinCount = 0;
-    while(frame->wp < size)
+    if (wp != last)
     {
-      if (++spinCount == FB_SPIN_LIMIT)
-        return false;
-      usleep(1);
+      last    = wp;
+      backoff = BACKOFF_INIT;
     }
+
+    if (backoff_wait(&backoff) >= FB_STALL_LIMIT * 1000ULL)
+      return false;
   }
 
   return true;
@@ -50,53 +595,67 @@ bool framebuffer_wait(const FrameBuffer * frame, size_t size)
 bool framebuffer_read(const FrameBuffer * frame, void * restrict dst,
     size_t dstpitch, size_t height, size_t width, size_t bpp, size_t pitch)
 {
-#ifdef FB_PROFILE
-  static RunningAvg ra = NULL;
-  static int raCount = 0;
-  const uint64_t ts = microtime();
-  if (!ra)
-    ra = runningavg_new(100);
-#endif
+  const uint64_t profile = fbprofile_begin();
 
-  uint8_t * restrict d     = (uint8_t*)dst;
-  uint_least32_t rp        = 0;
+  FBReadJob job =
+  {
+    .frame     = frame,
+    .dst       = (uint8_t *)dst,
+    .dstpitch  = dstpitch,
+    .pitch     = pitch,
+    .height    = height,
+    .linewidth = width * bpp
+  };
 
   // copy in large 1MB chunks if the pitches match
   if (dstpitch == pitch)
   {
-    size_t remaining = height * pitch;
-    while(remaining)
-    {
-      const size_t copy = remaining < FB_CHUNK_SIZE ? remaining : FB_CHUNK_SIZE;
-      if (!framebuffer_wait(frame, rp + copy))
-        return false;
+    job.kernel = getKernel(dst, frame->data);
+    job.bands  = (height * pitch + FB_CHUNK_SIZE - 1) / FB_CHUNK_SIZE;
+  }
+  else
+  {
+    // copy per line to match the pitch of the destination buffer, the pitches
+    // are part of the alignment as every line must suit the kernel
+    job.kernel = getKernel(
+        (const void *)((uintptr_t)dst         | dstpitch),
+        (const void *)((uintptr_t)frame->data | pitch   ));
+
+    /* only the pixels are needed, rounded up to whole kernel blocks where the
+     * padding of both pitches allows so aligned formats have no tail */
+    const size_t span = min(ALIGN_PAD(job.linewidth, job.kernel->block),
+        min(dstpitch, pitch));
+    job.block = span & ~(job.kernel->block - 1);
+    job.tail  = span - job.block;
+
+    // wait for several lines at once, no more than a chunk apart
+    job.lines = max(FB_CHUNK_SIZE / pitch, (size_t)1);
+    job.bands = (height + job.lines - 1) / job.lines;
+  }
 
-      memcpy(d, frame->data + rp, copy);
-      remaining -= copy;
-      rp        += copy;
-      d         += copy;
-    }
+  /* one core can not read as fast as the memory allows, large frames are
+   * split between the workers when they are free */
+  if (height * pitch >= FB_PARALLEL_MIN && poolAcquire())
+  {
+    pool.read    = true;
+    pool.readJob = job;
+    atomic_store_explicit(&pool.readFailed, false, memory_order_relaxed);
+    poolRun();
+
+    const bool failed = atomic_load(&pool.readFailed);
+    poolRelease();
+    if (failed)
+      return false;
   }
   else
   {
-    // copy per line to match the pitch of the destination buffer
-    const size_t linewidth = width * bpp;
-    for(size_t y = 0; y < height; ++y)
-    {
-      if (!framebuffer_wait(frame, rp + linewidth))
+    for(size_t i = 0; i < job.bands; ++i)
+      if (!readBand(&job, i))
         return false;
-
-      memcpy(d, frame->data + rp, dstpitch);
-      rp += pitch;
-      d  += dstpitch;
-    }
+    streamFence();
   }
 
-#ifdef FB_PROFILE
-  runningavg_push(ra, microtime() - ts);
-  if (++raCount % 100 == 0)
-    DEBUG_INFO("Average Copy Time: %.2fμs", runningavg_calc(ra));
-#endif
+  fbprofile_end(FB_PROFILE_READ, profile);
 
   return true;
 }
@@ -104,13 +663,7 @@ bool framebuffer_read(const FrameBuffer * frame, void * restrict dst,
 bool framebuffer_read_fn(const FrameBuffer * frame, size_t height, size_t width,
     size_t bpp, size_t pitch, FrameBufferReadFn fn, void * opaque)
 {
-#ifdef FB_PROFILE
-  static RunningAvg ra = NULL;
-  static int raCount = 0;
-  const uint64_t ts = microtime();
-  if (!ra)
-    ra = runningavg_new(100);
-#endif
+  const uint64_t profile = fbprofile_begin();
 
   uint_least32_t rp        = 0;
   size_t         y         = 0;
@@ -128,11 +681,7 @@ bool framebuffer_read_fn(const FrameBuffer * frame, size_t height, size_t width,
     ++y;
   }
 
-#ifdef FB_PROFILE
-  runningavg_push(ra, microtime() - ts);
-  if (++raCount % 100 == 0)
-    DEBUG_INFO("Average Copy Time: %.2fμs", runningavg_calc(ra));
-#endif
+  fbprofile_end(FB_PROFILE_READ, profile);
 
   return true;
 }
@@ -147,42 +696,41 @@ void framebuffer_prepare(FrameBuffer * frame)
 
 bool framebuffer_write(FrameBuffer * frame, const void * restrict src, size_t size)
 {
-#ifdef FB_PROFILE
-  static RunningAvg ra = NULL;
-  static int raCount = 0;
-  const uint64_t ts = microtime();
-  if (!ra)
-    ra = runningavg_new(100);
-#endif
+  const uint64_t profile = fbprofile_begin();
 
-  __m128i * restrict s = (__m128i *)src;
-  __m128i * restrict d = (__m128i *)frame->data;
+  const FBKernel * k = getKernel(frame->data, src);
+  const uint8_t * restrict s = (const uint8_t *)src;
   size_t wp = 0;
 
-  _mm_mfence();
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if (size >= FB_PARALLEL_MIN && poolAcquire())
+  {
+    const bool ok = writeParallel(frame, k, s, size);
+    poolRelease();
+    if (ok)
+    {
+      fbprofile_end(FB_PROFILE_WRITE, profile);
+      return true;
+    }
+  }
 
   /* copy in chunks */
-  while(size > 63)
+  while(size >= k->block)
   {
-    __m128i *_d = (__m128i *)d;
-    __m128i *_s = (__m128i *)s;
-    __m128i v1 = _mm_stream_load_si128(_s + 0);
-    __m128i v2 = _mm_stream_load_si128(_s + 1);
-    __m128i v3 = _mm_stream_load_si128(_s + 2);
-    __m128i v4 = _mm_stream_load_si128(_s + 3);
+    size_t copy = size < FB_CHUNK_SIZE ? size : FB_CHUNK_SIZE;
+    copy &= ~(k->block - 1);
 
-    _mm_store_si128(_d + 0, v1);
-    _mm_store_si128(_d + 1, v2);
-    _mm_store_si128(_d + 2, v3);
-    _mm_store_si128(_d + 3, v4);
+    k->write(frame->data + wp, s, copy);
 
-    s    += 4;
-    d    += 4;
-    size -= 64;
-    wp   += 64;
+    s    += copy;
+    size -= copy;
+    wp   += copy;
 
-    if (wp % FB_CHUNK_SIZE == 0)
-      atomic_store_explicit(&frame->wp, wp, memory_order_release);
+    // the wider kernels use non-temporal stores which must be fenced before
+    // the write pointer is published
+    streamFence();
+    atomic_store_explicit(&frame->wp, wp, memory_order_release);
   }
 
   if(size)
@@ -193,15 +741,199 @@ bool framebuffer_write(FrameBuffer * frame, const void * restrict src, size_t si
 
   atomic_store_explicit(&frame->wp, wp, memory_order_release);
 
-#ifdef FB_PROFILE
-  runningavg_push(ra, microtime() - ts);
-  if (++raCount % 100 == 0)
-    DEBUG_INFO("Average Copy Time: %.2fμs", runningavg_calc(ra));
-#endif
+  fbprofile_end(FB_PROFILE_WRITE, profile);
 
   return true;
 }
 
+/* compressed frames are a sequence of LZ4 blocks each covering whole rows so
+ * that the reader can decode progressively. Each block is prefixed with its
+ * size, blocks that don't compress are stored raw */
+#define FB_BLOCK_RAW 0x80000000U
+
+static inline size_t blockRows(size_t pitch)
+{
+  return pitch >= FB_CHUNK_SIZE ? 1 : FB_CHUNK_SIZE / pitch;
+}
+
+size_t framebuffer_compress_bound(size_t height, size_t pitch)
+{
+  const size_t rows = blockRows(pitch);
+  return height * pitch + ((height + rows - 1) / rows) * sizeof(uint32_t);
+}
+
+bool framebuffer_write_compressed(FrameBuffer * frame, const void * restrict src,
+    size_t height, size_t pitch, size_t size)
+{
+  if (framebuffer_compress_bound(height, pitch) > size)
+  {
+    DEBUG_ERROR("The compressed frame may not fit in the framebuffer");
+    return false;
+  }
+
+  const size_t rows = blockRows(pitch);
+  const uint8_t * restrict s = (const uint8_t *)src;
+  size_t wp = 0;
+
+  for(size_t y = 0; y < height; y += rows)
+  {
+    const size_t blockSize = (height - y < rows ? height - y : rows) * pitch;
+    uint8_t * out = frame->data + wp + sizeof(uint32_t);
+
+    // only keep the compressed block if it is smaller
+    uint32_t hdr = lz4_compress(s, blockSize, out, blockSize - 1);
+    if (!hdr)
+    {
+      memcpy(out, s, blockSize);
+      hdr = blockSize | FB_BLOCK_RAW;
+    }
+
+    memcpy(frame->data + wp, &hdr, sizeof(hdr));
+    wp += sizeof(hdr) + (hdr & ~FB_BLOCK_RAW);
+    s  += blockSize;
+
+    atomic_store_explicit(&frame->wp, wp, memory_order_release);
+  }
+
+  return true;
+}
+
+/* decodes each block of the compressed frame in turn, passing the rows to fn */
+typedef bool (*FBBlockFn)(void * opaque, const uint8_t * block, size_t lines);
+
+static bool readCompressed(const FrameBuffer * frame, size_t height,
+    size_t pitch, FBBlockFn fn, void * opaque)
+{
+  /* the destination is usually write-combined, decode into a cached buffer as
+   * LZ4 reads back what it has already written */
+  static _Thread_local uint8_t * scratch     = NULL;
+  static _Thread_local size_t    scratchSize = 0;
+
+  const size_t rows = blockRows(pitch);
+  size_t rp         = 0;
+
+  if (scratchSize < rows * pitch)
+  {
+    free(scratch);
+    scratchSize = rows * pitch;
+    if (!(scratch = malloc(scratchSize)))
+    {
+      scratchSize = 0;
+      DEBUG_ERROR("Out of memory");
+      return false;
+    }
+  }
+
+  for(size_t y = 0; y < height; y += rows)
+  {
+    const size_t lines     = height - y < rows ? height - y : rows;
+    const size_t blockSize = lines * pitch;
+
+    uint32_t hdr;
+    if (!framebuffer_wait(frame, rp + sizeof(hdr)))
+      return false;
+
+    memcpy(&hdr, frame->data + rp, sizeof(hdr));
+    rp += sizeof(hdr);
+
+    const size_t len = hdr & ~FB_BLOCK_RAW;
+    if (!framebuffer_wait(frame, rp + len))
+      return false;
+
+    const uint8_t * block;
+    if (hdr & FB_BLOCK_RAW)
+    {
+      if (len != blockSize)
+      {
+        DEBUG_ERROR("Invalid raw block size in the compressed frame");
+        return false;
+      }
+      block = frame->data + rp;
+    }
+    else
+    {
+      if (lz4_decompress(frame->data + rp, len, scratch, blockSize) != blockSize)
+      {
+        DEBUG_ERROR("Failed to decompress the frame");
+        return false;
+      }
+      block = scratch;
+    }
+
+    if (!fn(opaque, block, lines))
+      return false;
+
+    rp += len;
+  }
+
+  return true;
+}
+
+struct FBReadCompressed
+{
+  uint8_t         * dst;
+  size_t            dstpitch;
+  size_t            pitch;
+  size_t            linewidth;
+  FrameBufferReadFn fn;
+  void            * opaque;
+};
+
+static bool readCompressedBuffer(void * opaque, const uint8_t * block,
+    size_t lines)
+{
+  struct FBReadCompressed * rc = opaque;
+
+  if (rc->dstpitch == rc->pitch)
+    memcpy(rc->dst, block, lines * rc->pitch);
+  else
+    for(size_t i = 0; i < lines; ++i)
+      memcpy(rc->dst + i * rc->dstpitch, block + i * rc->pitch, rc->linewidth);
+
+  rc->dst += lines * rc->dstpitch;
+  return true;
+}
+
+static bool readCompressedFn(void * opaque, const uint8_t * block,
+    size_t lines)
+{
+  struct FBReadCompressed * rc = opaque;
+
+  for(size_t i = 0; i < lines; ++i)
+    if (!rc->fn(rc->opaque, block + i * rc->pitch, rc->linewidth))
+      return false;
+
+  return true;
+}
+
+bool framebuffer_read_compressed(const FrameBuffer * frame, void * restrict dst,
+    size_t dstpitch, size_t height, size_t width, size_t bpp, size_t pitch)
+{
+  struct FBReadCompressed rc =
+  {
+    .dst       = (uint8_t *)dst,
+    .dstpitch  = dstpitch,
+    .pitch     = pitch,
+    .linewidth = width * bpp
+  };
+
+  return readCompressed(frame, height, pitch, readCompressedBuffer, &rc);
+}
+
+bool framebuffer_read_compressed_fn(const FrameBuffer * frame, size_t height,
+    size_t width, size_t bpp, size_t pitch, FrameBufferReadFn fn, void * opaque)
+{
+  struct FBReadCompressed rc =
+  {
+    .pitch     = pitch,
+    .linewidth = width * bpp,
+    .fn        = fn,
+    .opaque    = opaque
+  };
+
+  return readCompressed(frame, height, pitch, readCompressedFn, &rc);
+}
+
 const uint8_t * framebuffer_get_buffer(const FrameBuffer * frame)
 {
   return frame->data;
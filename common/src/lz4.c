@@ -0,0 +1,239 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/lz4.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define LZ4_MINMATCH     4
+#define LZ4_LASTLITERALS 5  // the last 5 bytes must always be literals
+#define LZ4_MFLIMIT      12 // the last match must start 12 bytes before the end
+#define LZ4_MAX_OFFSET   65535
+#define LZ4_HASH_LOG     12
+
+static inline uint32_t read32(const uint8_t * p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t read64(const uint8_t * p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t hash(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static inline uint8_t * writeLength(uint8_t * op, size_t len)
+{
+  for(; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+/* emit a sequence of literals optionally followed by a match, the token is
+ * assembled before it is written as dst may be write-combined memory */
+static inline uint8_t * writeSequence(uint8_t * op, const uint8_t * oend,
+    const uint8_t * literals, size_t litLen, size_t offset, size_t matchLen)
+{
+  if ((size_t)(oend - op) < 1 + litLen + litLen / 255 + 1 + 2 +
+      matchLen / 255 + 1)
+    return NULL;
+
+  *op++ =
+    (litLen   >= 15 ? 15 : litLen) << 4 |
+    (matchLen >= 15 ? 15 : matchLen);
+
+  if (litLen >= 15)
+    op = writeLength(op, litLen - 15);
+
+  memcpy(op, literals, litLen);
+  op += litLen;
+
+  if (!offset)
+    return op;
+
+  *op++ = offset & 0xFF;
+  *op++ = offset >> 8;
+
+  if (matchLen >= 15)
+    op = writeLength(op, matchLen - 15);
+
+  return op;
+}
+
+size_t lz4_compress(const void * src, size_t srcSize, void * dst,
+    size_t dstSize)
+{
+  const uint8_t * const base   = (const uint8_t *)src;
+  const uint8_t * const iend   = base + srcSize;
+  const uint8_t *       ip     = base;
+  const uint8_t *       anchor = base;
+  uint8_t       *       op     = (uint8_t *)dst;
+  const uint8_t * const oend   = op + dstSize;
+
+  if (srcSize > LZ4_MFLIMIT)
+  {
+    const uint8_t * const mflimit    = iend - LZ4_MFLIMIT;
+    const uint8_t * const matchlimit = iend - LZ4_LASTLITERALS;
+    uint32_t table[1 << LZ4_HASH_LOG] = { 0 };
+
+    ++ip;
+    while(ip < mflimit)
+    {
+      const uint32_t  seq = read32(ip);
+      const uint32_t  h   = hash(seq);
+      const uint8_t * ref = base + table[h];
+      table[h] = ip - base;
+
+      if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq)
+      {
+        // skip faster through data that doesn't compress
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      while(ip > anchor && ref > base && ip[-1] == ref[-1])
+      {
+        --ip;
+        --ref;
+      }
+
+      const uint8_t * mp = ip  + LZ4_MINMATCH;
+      const uint8_t * rp = ref + LZ4_MINMATCH;
+      while(mp + 8 <= matchlimit)
+      {
+        const uint64_t diff = read64(mp) ^ read64(rp);
+        if (diff)
+        {
+          mp += __builtin_ctzll(diff) >> 3;
+          goto matched;
+        }
+        mp += 8;
+        rp += 8;
+      }
+
+      while(mp < matchlimit && *mp == *rp)
+      {
+        ++mp;
+        ++rp;
+      }
+
+matched:
+      op = writeSequence(op, oend, anchor, ip - anchor, ip - ref,
+          mp - ip - LZ4_MINMATCH);
+      if (!op)
+        return 0;
+
+      ip = anchor = mp;
+      if (ip < mflimit)
+        table[hash(read32(ip - 2))] = ip - 2 - base;
+    }
+  }
+
+  op = writeSequence(op, oend, anchor, iend - anchor, 0, 0);
+  if (!op)
+    return 0;
+
+  return op - (uint8_t *)dst;
+}
+
+static inline bool readLength(const uint8_t ** ip, const uint8_t * iend,
+    size_t * len)
+{
+  uint8_t b;
+  do
+  {
+    if (*ip >= iend)
+      return false;
+    b     = *(*ip)++;
+    *len += b;
+  }
+  while(b == 255);
+  return true;
+}
+
+size_t lz4_decompress(const void * src, size_t srcSize, void * dst,
+    size_t dstSize)
+{
+  const uint8_t *       ip   = (const uint8_t *)src;
+  const uint8_t * const iend = ip + srcSize;
+  uint8_t       *       op   = (uint8_t *)dst;
+  uint8_t       * const oend = op + dstSize;
+
+  while(ip < iend)
+  {
+    const unsigned int token = *ip++;
+
+    size_t len = token >> 4;
+    if (len == 15 && !readLength(&ip, iend, &len))
+      return 0;
+
+    if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+      return 0;
+
+    memcpy(op, ip, len);
+    ip += len;
+    op += len;
+
+    // the last sequence has no match
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return 0;
+
+    const size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+
+    if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst))
+      return 0;
+
+    len = token & 0xF;
+    if (len == 15 && !readLength(&ip, iend, &len))
+      return 0;
+
+    len += LZ4_MINMATCH;
+    if (len > (size_t)(oend - op))
+      return 0;
+
+    /* overlapping matches repeat the pattern, copy in non-overlapping runs
+     * that double in length as the distance to the reference grows */
+    const uint8_t * ref = op - offset;
+    while(len)
+    {
+      const size_t run = (size_t)(op - ref) < len ? (size_t)(op - ref) : len;
+      memcpy(op, ref, run);
+      op  += run;
+      len -= run;
+    }
+  }
+
+  return op - (uint8_t *)dst;
+}
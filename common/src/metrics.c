@@ -0,0 +1,171 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/metrics.h"
+#include "common/debug.h"
+#include "common/locking.h"
+#include "common/array.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+struct Metric
+{
+  const char   * name;
+  const char   * help;
+  bool           counter;
+  MetricsValueFn fn;
+  void         * opaque;
+  StatsHistogram histogram;
+  double         scale;
+};
+
+static struct
+{
+  LG_Lock       lock;
+  int           count;
+  struct Metric metrics[METRICS_MAX];
+}
+registry = { .lock = ATOMIC_FLAG_INIT };
+
+static bool addMetric(const struct Metric * metric)
+{
+  bool ok = false;
+  LG_LOCK(registry.lock);
+  if (registry.count < METRICS_MAX)
+  {
+    registry.metrics[registry.count++] = *metric;
+    ok = true;
+  }
+  LG_UNLOCK(registry.lock);
+
+  if (!ok)
+    DEBUG_ERROR("Too many metrics, %s was not registered", metric->name);
+  return ok;
+}
+
+bool metrics_registerValue(const char * name, const char * help, bool counter,
+    MetricsValueFn fn, void * opaque)
+{
+  return addMetric(&(struct Metric)
+  {
+    .name    = name,
+    .help    = help,
+    .counter = counter,
+    .fn      = fn,
+    .opaque  = opaque
+  });
+}
+
+bool metrics_registerHistogram(const char * name, const char * help,
+    StatsHistogram histogram, double scale)
+{
+  return addMetric(&(struct Metric)
+  {
+    .name      = name,
+    .help      = help,
+    .histogram = histogram,
+    .scale     = scale
+  });
+}
+
+void metrics_unregister(const char * name)
+{
+  LG_LOCK(registry.lock);
+  for (int i = 0; i < registry.count; ++i)
+    if (strcmp(registry.metrics[i].name, name) == 0)
+    {
+      memmove(registry.metrics + i, registry.metrics + i + 1,
+          (registry.count - i - 1) * sizeof(*registry.metrics));
+      --registry.count;
+      break;
+    }
+  LG_UNLOCK(registry.lock);
+}
+
+static void append(char * buffer, size_t size, size_t * len,
+    const char * format, ...) __attribute__((format (printf, 4, 5)));
+
+static void append(char * buffer, size_t size, size_t * len,
+    const char * format, ...)
+{
+  if (*len >= size)
+    return;
+
+  va_list va;
+  va_start(va, format);
+  const int n = vsnprintf(buffer + *len, size - *len, format, va);
+  va_end(va);
+
+  if (n > 0)
+    *len = *len + n < size ? *len + n : size - 1;
+}
+
+static void formatMetric(const struct Metric * m, char * buffer, size_t size,
+    size_t * len)
+{
+  append(buffer, size, len, "# HELP %s %s\n", m->name, m->help);
+
+  if (!m->histogram)
+  {
+    append(buffer, size, len, "# TYPE %s %s\n%s %g\n", m->name,
+        m->counter ? "counter" : "gauge", m->name, m->fn(m->opaque));
+    return;
+  }
+
+  StatsSummary s;
+  stats_histogramSummary(m->histogram, &s);
+  const struct
+  {
+    const char * quantile;
+    int64_t      value;
+  }
+  quantiles[] =
+  {
+    { "0.5" , s.p50 },
+    { "0.9" , s.p90 },
+    { "0.99", s.p99 }
+  };
+
+  append(buffer, size, len, "# TYPE %s summary\n", m->name);
+  for (int i = 0; i < ARRAY_LENGTH(quantiles); ++i)
+    append(buffer, size, len, "%s{quantile=\"%s\"} %g\n", m->name,
+        quantiles[i].quantile, quantiles[i].value * m->scale);
+
+  append(buffer, size, len, "%s_sum %g\n%s_count %" PRIu64 "\n",
+      m->name, s.mean * s.count * m->scale, m->name, s.count);
+}
+
+size_t metrics_format(char * buffer, size_t size)
+{
+  if (!size)
+    return 0;
+
+  size_t len = 0;
+  buffer[0] = '\0';
+
+  LG_LOCK(registry.lock);
+  for (int i = 0; i < registry.count; ++i)
+    formatMetric(registry.metrics + i, buffer, size, &len);
+  LG_UNLOCK(registry.lock);
+
+  return len;
+}
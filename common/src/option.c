@@ -25,6 +25,7 @@
 #include <ctype.h>
 #include <math.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -37,6 +38,13 @@ struct OptionGroup
   int              pad;
 };
 
+struct OptionWatch
+{
+  OptionChangeFn       fn;
+  void               * opaque;
+  struct OptionWatch * next;
+};
+
 struct State
 {
   enum doHelpMode      doHelp;
@@ -44,6 +52,13 @@ struct State
   int                  oCount;
   struct OptionGroup * groups;
   int                  gCount;
+
+  // open addressed on module:name, never more than half full
+  struct Option     ** index;
+  unsigned int         indexSize;
+
+  // set while option_reload is applying a file
+  bool                 reloading;
 };
 
 static struct State state =
@@ -55,6 +70,67 @@ static struct State state =
   .gCount  = 0
 };
 
+// FNV-1a of the lower cased module:name, the lookup ignores case
+static unsigned int option_hash(const char * module, const char * name)
+{
+  uint32_t hash = 2166136261u;
+  for(const char * p = module; *p; ++p)
+    hash = (hash ^ (uint8_t)tolower(*p)) * 16777619u;
+  hash = (hash ^ ':') * 16777619u;
+  for(const char * p = name; *p; ++p)
+    hash = (hash ^ (uint8_t)tolower(*p)) * 16777619u;
+  return hash;
+}
+
+static struct Option ** option_slot(const char * module, const char * name)
+{
+  const unsigned int mask = state.indexSize - 1;
+  for(unsigned int i = option_hash(module, name) & mask; ; i = (i + 1) & mask)
+  {
+    struct Option ** slot = state.index + i;
+    if (!*slot || (strcasecmp((*slot)->module, module) == 0 &&
+          strcasecmp((*slot)->name, name) == 0))
+      return slot;
+  }
+}
+
+static bool option_reindex(int count)
+{
+  unsigned int size = 64;
+  while(size < (unsigned int)count * 2)
+    size <<= 1;
+
+  if (size == state.indexSize)
+    return true;
+
+  struct Option ** index = calloc(size, sizeof(*index));
+  if (!index)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  free(state.index);
+  state.index     = index;
+  state.indexSize = size;
+
+  // the first registered of a duplicated name is the one found
+  for(int i = 0; i < state.oCount; ++i)
+  {
+    struct Option ** slot =
+      option_slot(state.options[i]->module, state.options[i]->name);
+    if (!*slot)
+      *slot = state.options[i];
+  }
+  return true;
+}
+
+static void option_notify(struct Option * opt)
+{
+  for(struct OptionWatch * w = opt->watches; w; w = w->next)
+    w->fn(opt, w->opaque);
+}
+
 static bool int_parser(struct Option * opt, const char * str)
 {
   opt->value.x_int = atol(str);
@@ -142,6 +218,9 @@ bool option_register(struct Option options[])
     return false;
   }
 
+  if (!option_reindex(state.oCount + new))
+    return false;
+
   for(int i = 0; options[i].type != OPTION_TYPE_NONE; ++i)
   {
     struct Option * o =
@@ -153,6 +232,12 @@ bool option_register(struct Option options[])
     }
 
     memcpy(o, &options[i], sizeof(*o));
+    o->cmdline = false;
+    o->watches = NULL;
+
+    struct Option ** slot = option_slot(o->module, o->name);
+    if (!*slot)
+      *slot = o;
 
     if (!o->parser)
     {
@@ -282,12 +367,23 @@ void option_free(void)
     struct Option * o = state.options[i];
     if (o->type == OPTION_TYPE_STRING && o->value.x_string)
       free(o->value.x_string);
+
+    while(o->watches)
+    {
+      struct OptionWatch * next = o->watches->next;
+      free(o->watches);
+      o->watches = next;
+    }
     free(o);
   }
   free(state.options);
   state.options = NULL;
   state.oCount  = 0;
 
+  free(state.index);
+  state.index     = NULL;
+  state.indexSize = 0;
+
   for(int g = 0; g < state.gCount; ++g)
   {
     struct OptionGroup * group = &state.groups[g];
@@ -299,15 +395,63 @@ void option_free(void)
   state.gCount  = 0;
 }
 
+// puts back the value option_set replaced during a reload
+static void option_restore(struct Option * opt, const char * before)
+{
+  if (before)
+    opt->parser(opt, before);
+  else if (opt->type == OPTION_TYPE_STRING)
+  {
+    free(opt->value.x_string);
+    opt->value.x_string = NULL;
+  }
+}
+
 static bool option_set(struct Option * opt, const char * value)
 {
+  if (state.reloading && (!opt->watches || opt->cmdline))
+    return true;
+
+  /* a parsed value is compared by its string form, which also covers the
+   * custom types */
+  char * before = opt->watches ? opt->toString(opt) : NULL;
+
   if (!opt->parser(opt, value))
   {
+    if (state.reloading)
+    {
+      option_restore(opt, before);
+      free(before);
+      return false;
+    }
+
+    free(before);
     opt->failed_set = true;
     return false;
   }
 
+  if (state.reloading && opt->validator)
+  {
+    const char * error = NULL;
+    if (!opt->validator(opt, &error))
+    {
+      DEBUG_WARN("Ignored invalid value for %s:%s%s%s", opt->module, opt->name,
+          error ? ": " : "", error ? error : "");
+      option_restore(opt, before);
+      free(before);
+      return true;
+    }
+  }
+
   opt->failed_set = false;
+  if (opt->watches)
+  {
+    char * after = opt->toString(opt);
+    if (!before || !after || strcmp(before, after) != 0)
+      option_notify(opt);
+    free(after);
+  }
+  free(before);
   return true;
 }
 
@@ -381,11 +525,13 @@ bool option_parse(int argc, char * argv[])
       continue;
     }
 
+    o->cmdline = true;
     if (!value)
     {
       if (o->type == OPTION_TYPE_BOOL)
       {
         o->value.x_bool = !o->value.x_bool;
+        option_notify(o);
         continue;
       }
       else if (o->type != OPTION_TYPE_CUSTOM)
@@ -647,6 +793,14 @@ exit:
   return result;
 }
 
+bool option_reload(const char * filename)
+{
+  state.reloading = true;
+  const bool result = option_load(filename);
+  state.reloading = false;
+  return result;
+}
+
 bool option_validate(void)
 {
   if (state.doHelp != DOHELP_MODE_NO)
@@ -865,13 +1019,81 @@ bool option_dump_preset(FILE * file)
 
 struct Option * option_get(const char * module, const char * name)
 {
-  for(int i = 0; i < state.oCount; ++i)
+  if (!state.indexSize)
+    return NULL;
+
+  return *option_slot(module, name);
+}
+
+int option_int(const struct Option * opt)
+{
+  DEBUG_ASSERT(opt->type == OPTION_TYPE_INT);
+  return opt->value.x_int;
+}
+
+const char * option_string(const struct Option * opt)
+{
+  DEBUG_ASSERT(opt->type == OPTION_TYPE_STRING);
+  return opt->value.x_string;
+}
+
+bool option_bool(const struct Option * opt)
+{
+  DEBUG_ASSERT(opt->type == OPTION_TYPE_BOOL);
+  return opt->value.x_bool;
+}
+
+float option_float(const struct Option * opt)
+{
+  DEBUG_ASSERT(opt->type == OPTION_TYPE_FLOAT);
+  return opt->value.x_float;
+}
+
+bool option_watch(struct Option * opt, OptionChangeFn fn, void * opaque)
+{
+  struct OptionWatch * w = malloc(sizeof(*w));
+  if (!w)
   {
-    struct Option * o = state.options[i];
-    if ((strcasecmp(o->module, module) == 0) && (strcasecmp(o->name, name) == 0))
-      return o;
+    DEBUG_ERROR("out of memory");
+    return false;
   }
-  return NULL;
+
+  w->fn        = fn;
+  w->opaque    = opaque;
+  w->next      = opt->watches;
+  opt->watches = w;
+  return true;
+}
+
+void option_unwatch(struct Option * opt, OptionChangeFn fn, void * opaque)
+{
+  for(struct OptionWatch ** w = &opt->watches; *w; w = &(*w)->next)
+    if ((*w)->fn == fn && (*w)->opaque == opaque)
+    {
+      struct OptionWatch * next = (*w)->next;
+      free(*w);
+      *w = next;
+      return;
+    }
+}
+
+bool option_watchModule(const char * module, OptionChangeFn fn, void * opaque)
+{
+  for(int i = 0; i < state.oCount; ++i)
+    if (strcasecmp(state.options[i]->module, module) == 0 &&
+        !option_watch(state.options[i], fn, opaque))
+    {
+      option_unwatchModule(module, fn, opaque);
+      return false;
+    }
+  return true;
+}
+
+void option_unwatchModule(const char * module, OptionChangeFn fn, void * opaque)
+{
+  for(int i = 0; i < state.oCount; ++i)
+    if (strcasecmp(state.options[i]->module, module) == 0)
+      option_unwatch(state.options[i], fn, opaque);
 }
 
 int option_get_int(const char * module, const char * name)
@@ -931,7 +1153,11 @@ void option_set_int(const char * module, const char * name, int value)
     return;
   }
   DEBUG_ASSERT(o->type == OPTION_TYPE_INT);
+  if (o->value.x_int == value)
+    return;
+
   o->value.x_int = value;
+  option_notify(o);
 }
 
 void option_set_string(const char * module, const char * name, const char * value)
@@ -943,8 +1169,12 @@ void option_set_string(const char * module, const char * name, const char * valu
     return;
   }
   DEBUG_ASSERT(o->type == OPTION_TYPE_STRING);
+  if (o->value.x_string && value && strcmp(o->value.x_string, value) == 0)
+    return;
+
   free(o->value.x_string);
-  o->value.x_string = strdup(value);
+  o->value.x_string = value ? strdup(value) : NULL;
+  option_notify(o);
 }
 
 void option_set_bool(const char * module, const char * name, bool value)
@@ -956,7 +1186,11 @@ void option_set_bool(const char * module, const char * name, bool value)
     return;
   }
   DEBUG_ASSERT(o->type == OPTION_TYPE_BOOL);
+  if (o->value.x_bool == value)
+    return;
+
   o->value.x_bool = value;
+  option_notify(o);
 }
 
 void option_set_float(const char * module, const char * name, float value)
@@ -968,5 +1202,9 @@ void option_set_float(const char * module, const char * name, float value)
     return;
   }
   DEBUG_ASSERT(o->type == OPTION_TYPE_FLOAT);
+  if (o->value.x_float == value)
+    return;
+
   o->value.x_float = value;
+  option_notify(o);
 }
@@ -212,6 +212,7 @@ void printBacktrace(void)
 
 static void crit_err_hdlr(int sig_num, siginfo_t * info, void * ucontext)
 {
+  debug_sync();
   DEBUG_ERROR("==== FATAL CRASH (%s) ====", BUILD_VERSION);
   DEBUG_ERROR("signal %d (%s), address is %p", sig_num, strsignal(sig_num), info->si_addr);
   printBacktrace();
@@ -30,7 +30,7 @@
 
 const char ** debug_lookup = NULL;
 
-void debug_init(void)
+void debug_platformInit(void)
 {
   static const char * colorLookup[] =
   {
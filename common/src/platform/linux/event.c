@@ -21,22 +21,51 @@
 #include "common/event.h"
 
 #include "common/debug.h"
+#include "common/time.h"
+#include "common/util.h"
 
 #include <stdlib.h>
-#include <pthread.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdatomic.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define cpuRelax() _mm_pause()
+#elif defined(__aarch64__)
+#define cpuRelax() __asm__ volatile("yield")
+#else
+#define cpuRelax() do {} while(0)
+#endif
+
+/* however long the caller asks for a wait never spins longer than this, past
+ * it the wake is no longer what the latency is made of */
+#define EVENT_SPIN_MAX_NS 50000
+#define EVENT_SPIN_MIN_NS 1000
 
 struct LGEvent
 {
-  pthread_mutex_t mutex;
-  pthread_cond_t  cond;
-  atomic_int      waiting;
-  atomic_bool     signaled;
-  bool            autoReset;
+  // the futex word, one while signaled
+  atomic_uint  signaled;
+  atomic_int   waiting;
+  bool         autoReset;
+
+  /* the spin before sleeping adapts to how long the recent waits took, it
+   * grows while they are shorter than the limit and backs off when not */
+  unsigned int spinMax;
+  atomic_uint  spin;
 };
 
+static long futex(atomic_uint * word, int op, unsigned int val,
+    const struct timespec * ts)
+{
+  return syscall(SYS_futex, word, op, val, ts, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
 LGEvent * lgCreateEvent(bool autoReset, unsigned int msSpinTime)
 {
   LGEvent * handle = calloc(1, sizeof(*handle));
@@ -46,32 +75,15 @@ LGEvent * lgCreateEvent(bool autoReset, unsigned int msSpinTime)
     return NULL;
   }
 
-  if (pthread_mutex_init(&handle->mutex, NULL) != 0)
-  {
-    DEBUG_ERROR("Failed to create the mutex");
-    free(handle);
-    return NULL;
-  }
-
-  pthread_condattr_t cattr;
-  pthread_condattr_init(&cattr);
-
-  if (pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC) != 0)
-  {
-    DEBUG_ERROR("Failed to set the condition clock to realtime");
-    pthread_mutex_destroy(&handle->mutex);
-    free(handle);
-    return NULL;
-  }
-
-  if (pthread_cond_init(&handle->cond, &cattr) != 0)
-  {
-    pthread_mutex_destroy(&handle->mutex);
-    free(handle);
-    return NULL;
-  }
+  // spinning on a single CPU only delays the thread that would signal us
+  static long cpus = 0;
+  if (!cpus)
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
   handle->autoReset = autoReset;
+  handle->spinMax   = cpus > 1 ?
+    min((uint64_t)msSpinTime * 1000000ULL, EVENT_SPIN_MAX_NS) : 0;
+  atomic_init(&handle->spin, handle->spinMax);
   return handle;
 }
 
@@ -82,63 +94,83 @@ void lgFreeEvent(LGEvent * handle)
   if (atomic_load_explicit(&handle->waiting, memory_order_acquire) != 0)
     DEBUG_ERROR("BUG: Freeing an event that still has threads waiting on it");
 
-  pthread_cond_destroy (&handle->cond );
-  pthread_mutex_destroy(&handle->mutex);
   free(handle);
 }
 
+// takes the signal if set, auto reset events release a single waiter
+static inline bool tryConsume(LGEvent * handle)
+{
+  if (!handle->autoReset)
+    return atomic_load_explicit(&handle->signaled, memory_order_acquire);
+
+  unsigned int expected = 1;
+  return atomic_compare_exchange_strong_explicit(&handle->signaled, &expected,
+      0, memory_order_acquire, memory_order_relaxed);
+}
+
+static void adaptSpin(LGEvent * handle, uint64_t waited)
+{
+  const unsigned int spin = atomic_load_explicit(&handle->spin,
+      memory_order_relaxed);
+
+  unsigned int next;
+  if (waited <= handle->spinMax)
+    next = min(max(spin * 2, EVENT_SPIN_MIN_NS), handle->spinMax);
+  else
+    next = spin / 2;
+
+  if (next != spin)
+    atomic_store_explicit(&handle->spin, next, memory_order_relaxed);
+}
+
 bool lgWaitEventAbs(LGEvent * handle, struct timespec * ts)
 {
   DEBUG_ASSERT(handle);
 
-  bool ret   = true;
-  int  res;
+  if (tryConsume(handle))
+    return true;
 
-  if (pthread_mutex_lock(&handle->mutex) != 0)
-  {
-    DEBUG_ERROR("Failed to lock the mutex");
-    return false;
-  }
+  const uint64_t start = handle->spinMax ? nanotime() : 0;
+  const unsigned int spin = atomic_load_explicit(&handle->spin,
+      memory_order_relaxed);
 
-  atomic_fetch_add_explicit(&handle->waiting, 1, memory_order_release);
-  while(ret && !atomic_load_explicit(&handle->signaled, memory_order_acquire))
-  {
-    if (!ts)
+  if (spin)
+    do
     {
-      if ((res = pthread_cond_wait(&handle->cond, &handle->mutex)) != 0)
+      for(int i = 0; i < 16; ++i)
+        cpuRelax();
+
+      if (tryConsume(handle))
       {
-        DEBUG_ERROR("Failed to wait on the condition (err: %d)", res);
-        ret = false;
+        adaptSpin(handle, nanotime() - start);
+        return true;
       }
     }
-    else
-    {
-      switch((res = pthread_cond_timedwait(&handle->cond, &handle->mutex, ts)))
-      {
-        case 0:
-          break;
+    while(nanotime() - start < spin);
 
-        case ETIMEDOUT:
-          ret = false;
-          break;
+  /* the waiter count is raised before the last check so a signal after it
+   * sees the waiter, and one before it is seen by the check */
+  bool ret = true;
+  atomic_fetch_add_explicit(&handle->waiting, 1, memory_order_seq_cst);
+  while(!tryConsume(handle))
+  {
+    // the timeout is an absolute CLOCK_MONOTONIC time for FUTEX_WAIT_BITSET
+    if (futex(&handle->signaled, FUTEX_WAIT_BITSET_PRIVATE, 0, ts) == 0)
+      continue;
 
-        default:
-          ret = false;
-          DEBUG_ERROR("Timed wait failed (err: %d)", res);
-          break;
-      }
-    }
-  }
+    if (errno == EAGAIN || errno == EINTR)
+      continue;
 
-  atomic_fetch_sub_explicit(&handle->waiting, 1, memory_order_release);
-  if (pthread_mutex_unlock(&handle->mutex) != 0)
-  {
-    DEBUG_ERROR("Failed to unlock the mutex");
-    return false;
+    if (errno != ETIMEDOUT)
+      DEBUG_ERROR("Failed to wait on the event (err: %d)", errno);
+
+    ret = tryConsume(handle);
+    break;
   }
+  atomic_fetch_sub_explicit(&handle->waiting, 1, memory_order_release);
 
-  if (ret && handle->autoReset)
-    atomic_store_explicit(&handle->signaled, false, memory_order_release);
+  if (handle->spinMax)
+    adaptSpin(handle, nanotime() - start);
 
   return ret;
 }
@@ -150,15 +182,7 @@ bool lgWaitEventNS(LGEvent * handle, unsigned int timeout)
 
   struct timespec ts;
   clock_gettime(CLOCK_MONOTONIC, &ts);
-  uint64_t nsec = ts.tv_nsec + timeout;
-  if(nsec > 1000000000UL)
-  {
-    ts.tv_nsec = nsec - 1000000000UL;
-    ++ts.tv_sec;
-  }
-  else
-    ts.tv_nsec = nsec;
-
+  tsAdd(&ts, timeout);
   return lgWaitEventAbs(handle, &ts);
 }
 
@@ -167,32 +191,25 @@ bool lgWaitEvent(LGEvent * handle, unsigned int timeout)
   if (timeout == TIMEOUT_INFINITE)
     return lgWaitEventAbs(handle, NULL);
 
-  return lgWaitEventNS(handle, timeout * 1000000U);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  tsAdd(&ts, (uint64_t)timeout * 1000000ULL);
+  return lgWaitEventAbs(handle, &ts);
 }
 
 bool lgSignalEvent(LGEvent * handle)
 {
   DEBUG_ASSERT(handle);
 
-  if (pthread_mutex_lock(&handle->mutex) != 0)
-  {
-    DEBUG_ERROR("Failed to lock the mutex");
-    return false;
-  }
-
-  const bool signaled = atomic_exchange_explicit(&handle->signaled, true,
-      memory_order_release);
-
-  if (!signaled)
-    if (pthread_cond_broadcast(&handle->cond) != 0)
-    {
-      DEBUG_ERROR("Failed to signal the condition");
-      return false;
-    }
+  if (atomic_exchange_explicit(&handle->signaled, 1, memory_order_seq_cst))
+    return true;
 
-  if (pthread_mutex_unlock(&handle->mutex) != 0)
+  // only enter the kernel if there is someone asleep to wake
+  if (atomic_load_explicit(&handle->waiting, memory_order_seq_cst) &&
+      futex(&handle->signaled, FUTEX_WAKE_PRIVATE,
+        handle->autoReset ? 1 : INT_MAX, NULL) < 0)
   {
-    DEBUG_ERROR("Failed to unlock the mutex");
+    DEBUG_ERROR("Failed to wake the event waiters (err: %d)", errno);
     return false;
   }
 
@@ -202,5 +219,5 @@ bool lgSignalEvent(LGEvent * handle)
 bool lgResetEvent(LGEvent * handle)
 {
   DEBUG_ASSERT(handle);
-  return atomic_exchange_explicit(&handle->signaled, false, memory_order_release);
+  return atomic_exchange_explicit(&handle->signaled, 0, memory_order_release);
 }
@@ -26,9 +26,17 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
 
 #include "common/array.h"
 #include "common/debug.h"
@@ -37,11 +45,25 @@
 #include "common/stringutils.h"
 #include "module/kvmfr.h"
 
+#define IVSHMEM_SERVER_PROTOCOL 0
+#define IVSHMEM_MAX_VECTORS     8
+
 struct IVSHMEMInfo
 {
   int  devFd;
   int  size;
   bool hasDMA;
+
+  // ivshmem-server doorbell state
+  int         sockFd;
+  int         peerID;
+  int         vectors;
+  int         eventFd[IVSHMEM_MAX_VECTORS];
+  atomic_bool serverLost;
+
+  /* set while a waiter is reading the server socket, the others only wait on
+   * their vector so no two threads read the socket at once */
+  atomic_bool serverReader;
 };
 
 static bool ivshmemDeviceValidator(struct Option * opt, const char ** error)
@@ -98,6 +120,41 @@ void ivshmemOptionsInit(void)
       .validator      = ivshmemDeviceValidator,
       .getValues      = ivshmemDeviceGetValues
     },
+    {
+      .module         = "app",
+      .name           = "shmServer",
+      .description    = "The ivshmem-server socket to use for doorbell notifications (overrides shmFile)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = ""
+    },
+    {
+      .module         = "app",
+      .name           = "shmPopulate",
+      .description    = "Fault in the whole shared memory mapping when it is opened",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "app",
+      .name           = "shmHugePages",
+      .description    = "Ask the kernel to back the shared memory mapping with huge pages",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "app",
+      .name           = "shmNumaNode",
+      .description    = "Prefer this NUMA node for the shared memory, e.g. the GPU's node (-1 = off)",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = -1
+    },
+    {
+      .module         = "app",
+      .name           = "shmLock",
+      .description    = "Lock the shared memory mapping into RAM",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
     {0}
   };
 
@@ -110,8 +167,276 @@ bool ivshmemInit(struct IVSHMEM * dev)
   return true;
 }
 
+/* reads a single ivshmem-server message, a 64bit value with an optional fd
+ * returns 1 on success, 0 on timeout or -1 if the connection failed */
+static int serverRead(int sockFd, int timeout, int64_t * value, int * fd)
+{
+  struct pollfd pfd = { .fd = sockFd, .events = POLLIN };
+  const int ret = poll(&pfd, 1, timeout);
+  if (ret <= 0)
+    return ret < 0 && errno != EINTR ? -1 : 0;
+
+  union
+  {
+    struct cmsghdr cmsg;
+    char           buffer[CMSG_SPACE(sizeof(int))];
+  }
+  control;
+
+  struct iovec iov =
+  {
+    .iov_base = value,
+    .iov_len  = sizeof(*value)
+  };
+
+  struct msghdr msg =
+  {
+    .msg_iov        = &iov,
+    .msg_iovlen     = 1,
+    .msg_control    = &control.buffer,
+    .msg_controllen = sizeof(control.buffer)
+  };
+
+  if (recvmsg(sockFd, &msg, MSG_CMSG_CLOEXEC) != sizeof(*value))
+    return -1;
+
+  *fd = -1;
+  for(struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+      cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+      memcpy(fd, CMSG_DATA(cmsg), sizeof(*fd));
+      break;
+    }
+  }
+
+  return 1;
+}
+
+/* applies the placement options, these are best effort as not every kind of
+ * shared memory supports them, e.g. a PCI BAR can not be moved */
+static void tuneMapping(void * map, size_t size)
+{
+  const int node = option_get_int("app", "shmNumaNode");
+  if (node >= 0)
+  {
+    unsigned long mask[(node / (8 * sizeof(unsigned long))) + 1];
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] =
+      1UL << (node % (8 * sizeof(unsigned long)));
+
+    // moves pages already allocated elsewhere, the rest follow the policy
+    if (syscall(SYS_mbind, map, size, MPOL_PREFERRED, mask,
+          sizeof(mask) * 8, MPOL_MF_MOVE) != 0)
+      DEBUG_WARN("Failed to bind the shared memory to NUMA node %d: %s",
+          node, strerror(errno));
+  }
+
+  if (option_get_bool("app", "shmHugePages") &&
+      madvise(map, size, MADV_HUGEPAGE) != 0)
+    DEBUG_WARN("Failed to enable huge pages for the shared memory: %s",
+        strerror(errno));
+
+  // populate after the policy is set so the pages land on the right node
+  if (option_get_bool("app", "shmPopulate"))
+  {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(map, size, MADV_POPULATE_WRITE) != 0)
+#endif
+    {
+      const long pageSize = sysinfo_getPageSize();
+      for(size_t i = 0; i < size; i += pageSize)
+        (void)((volatile uint8_t *)map)[i];
+    }
+  }
+
+  if (option_get_bool("app", "shmLock") && mlock(map, size) != 0)
+    DEBUG_WARN("Failed to lock the shared memory, check RLIMIT_MEMLOCK: %s",
+        strerror(errno));
+}
+
+static bool mapDevice(struct IVSHMEM * dev, struct IVSHMEMInfo * info,
+    const char * shmDevice)
+{
+  void * map = mmap(0, info->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+      info->devFd, 0);
+  if (map == MAP_FAILED)
+  {
+    DEBUG_ERROR("Failed to map the shared memory device: %s", shmDevice);
+    DEBUG_ERROR("%s", strerror(errno));
+    return false;
+  }
+
+  tuneMapping(map, info->size);
+
+  dev->opaque = info;
+  dev->size   = info->size;
+  dev->mem    = map;
+  return true;
+}
+
+static struct IVSHMEMInfo * newInfo(int devFd, int size, bool hasDMA)
+{
+  struct IVSHMEMInfo * info = malloc(sizeof(*info));
+  info->size    = size;
+  info->devFd   = devFd;
+  info->hasDMA  = hasDMA;
+  info->sockFd  = -1;
+  info->peerID  = -1;
+  info->vectors = 0;
+  atomic_init(&info->serverLost, false);
+  atomic_init(&info->serverReader, false);
+  return info;
+}
+
+/* binds an eventfd to each of the kvmfr device's doorbell vectors, the
+ * devices without MSI-X, such as static ones, report no vectors */
+static void kvmfrBindDoorbell(struct IVSHMEMInfo * info)
+{
+  int vectors = ioctl(info->devFd, KVMFR_GET_VECTORS, 0);
+  if (vectors <= 0)
+    return;
+
+  const int peerID = ioctl(info->devFd, KVMFR_GET_PEERID, 0);
+  if (peerID < 0)
+    return;
+
+  if (vectors > IVSHMEM_MAX_VECTORS)
+    vectors = IVSHMEM_MAX_VECTORS;
+
+  for(int i = 0; i < vectors; ++i)
+  {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+    {
+      DEBUG_ERROR("Failed to create the doorbell eventfd: %s", strerror(errno));
+      break;
+    }
+
+    const struct kvmfr_eventfd efd =
+    {
+      .vector = i,
+      .fd     = fd
+    };
+
+    if (ioctl(info->devFd, KVMFR_SET_EVENTFD, &efd) < 0)
+    {
+      DEBUG_ERROR("Failed to bind the doorbell eventfd: %s", strerror(errno));
+      close(fd);
+      break;
+    }
+
+    info->eventFd[info->vectors++] = fd;
+  }
+
+  if (info->vectors)
+  {
+    info->peerID = peerID;
+    DEBUG_INFO("KVMFR Doorbell   : %d vectors, peer %d", info->vectors, peerID);
+  }
+}
+
+static bool ivshmemOpenServer(struct IVSHMEM * dev, const char * path)
+{
+  DEBUG_INFO("IVSHMEM Server   : %s", path);
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    DEBUG_ERROR("The ivshmem-server socket path is too long");
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+
+  int sockFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sockFd < 0)
+  {
+    DEBUG_ERROR("Failed to create the socket: %s", strerror(errno));
+    return false;
+  }
+
+  if (connect(sockFd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    DEBUG_ERROR("Failed to connect to: %s", path);
+    DEBUG_ERROR("%s", strerror(errno));
+    goto err_sock;
+  }
+
+  // the server sends the protocol version, our peer id and then the shm fd
+  int64_t version, peerID, value;
+  int fd, shmFd = -1;
+  if (serverRead(sockFd, 1000, &version, &fd   ) != 1 || fd >= 0 ||
+      serverRead(sockFd, 1000, &peerID , &fd   ) != 1 || fd >= 0 ||
+      serverRead(sockFd, 1000, &value  , &shmFd) != 1 || shmFd < 0 ||
+      value != -1)
+  {
+    DEBUG_ERROR("Invalid response from the ivshmem-server");
+    goto err_shm;
+  }
+
+  if (version != IVSHMEM_SERVER_PROTOCOL || peerID < 0 || peerID > UINT16_MAX)
+  {
+    DEBUG_ERROR("Unsupported ivshmem-server protocol %" PRId64
+        " or peer id %" PRId64, version, peerID);
+    goto err_shm;
+  }
+
+  struct stat st;
+  if (fstat(shmFd, &st) != 0)
+  {
+    DEBUG_ERROR("Failed to stat the shared memory: %s", strerror(errno));
+    goto err_shm;
+  }
+
+  struct IVSHMEMInfo * info = newInfo(shmFd, st.st_size, false);
+  info->sockFd = sockFd;
+  info->peerID = peerID;
+
+  /* existing peers are announced first followed by one eventfd per vector for
+   * us, all sent in a single burst. We only need our own eventfds, the other
+   * peers' eventfds are only needed to ring them which the client never does */
+  while(serverRead(sockFd, info->vectors ? 10 : 1000, &value, &fd) == 1)
+  {
+    if (fd < 0)
+      continue;
+
+    if (value != peerID || info->vectors == IVSHMEM_MAX_VECTORS)
+    {
+      close(fd);
+      continue;
+    }
+
+    info->eventFd[info->vectors++] = fd;
+  }
+
+  DEBUG_INFO("IVSHMEM Peer ID  : %d", info->peerID);
+  DEBUG_INFO("IVSHMEM Vectors  : %d", info->vectors);
+
+  if (!mapDevice(dev, info, path))
+  {
+    for(int i = 0; i < info->vectors; ++i)
+      close(info->eventFd[i]);
+    free(info);
+    goto err_shm;
+  }
+
+  return true;
+
+err_shm:
+  if (shmFd >= 0)
+    close(shmFd);
+err_sock:
+  close(sockFd);
+  return false;
+}
+
 bool ivshmemOpen(struct IVSHMEM * dev)
 {
+  const char * server = option_get_string("app", "shmServer");
+  if (server && *server)
+    return ivshmemOpenServer(dev, server);
+
   return ivshmemOpenDev(dev, option_get_string("app", "shmFile"));
 }
 
@@ -163,22 +488,17 @@ bool ivshmemOpenDev(struct IVSHMEM * dev, const char * shmDevice)
     hasDMA = false;
   }
 
-  void * map = mmap(0, devSize, PROT_READ | PROT_WRITE, MAP_SHARED, devFd, 0);
-  if (map == MAP_FAILED)
+  struct IVSHMEMInfo * info = newInfo(devFd, devSize, hasDMA);
+  if (!mapDevice(dev, info, shmDevice))
   {
-    DEBUG_ERROR("Failed to map the shared memory device: %s", shmDevice);
-    DEBUG_ERROR("%s", strerror(errno));
+    free(info);
+    close(devFd);
     return false;
   }
 
-  struct IVSHMEMInfo * info = malloc(sizeof(*info));
-  info->size   = devSize;
-  info->devFd  = devFd;
-  info->hasDMA = hasDMA;
+  if (hasDMA)
+    kvmfrBindDoorbell(info);
 
-  dev->opaque = info;
-  dev->size   = devSize;
-  dev->mem    = map;
   return true;
 }
 
@@ -195,6 +515,12 @@ void ivshmemClose(struct IVSHMEM * dev)
   munmap(dev->mem, info->size);
   close(info->devFd);
 
+  for(int i = 0; i < info->vectors; ++i)
+    close(info->eventFd[i]);
+
+  if (info->sockFd >= 0)
+    close(info->sockFd);
+
   free(info);
   dev->mem    = NULL;
   dev->size   = 0;
@@ -246,3 +572,118 @@ int ivshmemGetDMABuf(struct IVSHMEM * dev, uint64_t offset, uint64_t size)
 
   return fd;
 }
+
+bool ivshmemHasDoorbell(struct IVSHMEM * dev)
+{
+  DEBUG_ASSERT(dev && dev->opaque);
+
+  struct IVSHMEMInfo * info =
+    (struct IVSHMEMInfo *)dev->opaque;
+
+  return info->vectors > 0 && !atomic_load(&info->serverLost);
+}
+
+int ivshmemGetPeerID(struct IVSHMEM * dev)
+{
+  DEBUG_ASSERT(dev && dev->opaque);
+
+  struct IVSHMEMInfo * info =
+    (struct IVSHMEMInfo *)dev->opaque;
+
+  return info->peerID;
+}
+
+bool ivshmemRingDoorbell(struct IVSHMEM * dev, uint16_t peerID,
+    uint16_t vector)
+{
+  // the client only ever waits for notifications from the guest
+  return false;
+}
+
+void ivshmemWakeDoorbell(struct IVSHMEM * dev, uint16_t vector)
+{
+  DEBUG_ASSERT(dev && dev->opaque);
+
+  struct IVSHMEMInfo * info =
+    (struct IVSHMEMInfo *)dev->opaque;
+
+  if (vector >= info->vectors)
+    return;
+
+  const uint64_t count = 1;
+  if (write(info->eventFd[vector], &count, sizeof(count)) != sizeof(count) &&
+      errno != EAGAIN)
+    DEBUG_ERROR("Failed to wake the doorbell eventfd: %s", strerror(errno));
+}
+
+int ivshmemWaitDoorbell(struct IVSHMEM * dev, uint16_t vector,
+    unsigned int timeout)
+{
+  DEBUG_ASSERT(dev && dev->opaque);
+
+  struct IVSHMEMInfo * info =
+    (struct IVSHMEMInfo *)dev->opaque;
+
+  if (vector >= info->vectors || atomic_load(&info->serverLost))
+    return -1;
+
+  const bool reader = info->sockFd >= 0 &&
+    !atomic_exchange(&info->serverReader, true);
+
+  struct pollfd pfd[2] =
+  {
+    { .fd = info->eventFd[vector]      , .events = POLLIN },
+    { .fd = reader ? info->sockFd : -1 , .events = POLLIN }
+  };
+
+  int ret = poll(pfd, 2, timeout);
+  if (ret < 0)
+  {
+    if (reader)
+      atomic_store(&info->serverReader, false);
+
+    if (errno == EINTR)
+      return 0;
+
+    DEBUG_ERROR("poll failed: %s", strerror(errno));
+    return -1;
+  }
+
+  /* peer connect/disconnect notifications, we don't track the other peers so
+   * just release any eventfds we were sent */
+  if (pfd[1].revents)
+  {
+    int64_t value;
+    int fd, status;
+    while((status = serverRead(info->sockFd, 0, &value, &fd)) == 1)
+      if (fd >= 0)
+        close(fd);
+
+    if (status < 0)
+    {
+      DEBUG_WARN("Lost the connection to the ivshmem-server, doorbell disabled");
+      atomic_store(&info->serverLost, true);
+
+      // the other waiters are not watching the socket, wake them to see it
+      for(int i = 0; i < info->vectors; ++i)
+        if (i != vector)
+          ivshmemWakeDoorbell(dev, i);
+    }
+  }
+
+  if (reader)
+    atomic_store(&info->serverReader, false);
+
+  if (!(pfd[0].revents & POLLIN))
+    return 0;
+
+  uint64_t count;
+  if (read(info->eventFd[vector], &count, sizeof(count)) != sizeof(count) &&
+      errno != EAGAIN)
+  {
+    DEBUG_ERROR("Failed to read the doorbell eventfd: %s", strerror(errno));
+    return -1;
+  }
+
+  return 1;
+}
@@ -0,0 +1,141 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/metrics.h"
+#include "common/debug.h"
+#include "common/thread.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static struct
+{
+  int          fd;
+  char       * path;
+  LGThread   * thread;
+  atomic_bool  running;
+}
+metricsExport = { .fd = -1 };
+
+static int exportThread(void * opaque)
+{
+  char * buffer = malloc(METRICS_PAGE_SIZE);
+  if (!buffer)
+  {
+    DEBUG_ERROR("out of memory");
+    return 1;
+  }
+
+  struct pollfd pfd = { .fd = metricsExport.fd, .events = POLLIN };
+  while (atomic_load(&metricsExport.running))
+  {
+    // wake up regularly to check if the export was stopped
+    if (poll(&pfd, 1, 250) <= 0)
+      continue;
+
+    const int client = accept(metricsExport.fd, NULL, NULL);
+    if (client < 0)
+      continue;
+
+    const size_t len = metrics_format(buffer, METRICS_PAGE_SIZE);
+    for (size_t done = 0; done < len; )
+    {
+      const ssize_t n = send(client, buffer + done, len - done, MSG_NOSIGNAL);
+      if (n <= 0)
+        break;
+      done += n;
+    }
+    close(client);
+  }
+
+  free(buffer);
+  return 0;
+}
+
+bool metrics_startExport(const char * location)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(location) >= sizeof(addr.sun_path))
+  {
+    DEBUG_ERROR("The metrics socket path is too long: %s", location);
+    return false;
+  }
+  strcpy(addr.sun_path, location);
+
+  metricsExport.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (metricsExport.fd < 0)
+  {
+    DEBUG_ERROR("Failed to create the metrics socket: %s", strerror(errno));
+    return false;
+  }
+
+  // a stale socket from an earlier run would make the bind fail
+  unlink(location);
+  if (bind(metricsExport.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(metricsExport.fd, 4) < 0)
+  {
+    DEBUG_ERROR("Failed to listen on %s: %s", location, strerror(errno));
+    goto fail;
+  }
+
+  metricsExport.path = strdup(location);
+  atomic_store(&metricsExport.running, true);
+  if (!lgCreateThread("metricsExport", exportThread, NULL,
+        &metricsExport.thread))
+  {
+    DEBUG_ERROR("Failed to create the metrics export thread");
+    atomic_store(&metricsExport.running, false);
+    unlink(location);
+    free(metricsExport.path);
+    metricsExport.path = NULL;
+    goto fail;
+  }
+
+  DEBUG_INFO("Metrics exported at %s", location);
+  return true;
+
+fail:
+  close(metricsExport.fd);
+  metricsExport.fd = -1;
+  return false;
+}
+
+void metrics_stopExport(void)
+{
+  if (!metricsExport.thread)
+    return;
+
+  atomic_store(&metricsExport.running, false);
+  lgJoinThread(metricsExport.thread, NULL);
+  metricsExport.thread = NULL;
+
+  close(metricsExport.fd);
+  metricsExport.fd = -1;
+
+  unlink(metricsExport.path);
+  free(metricsExport.path);
+  metricsExport.path = NULL;
+}
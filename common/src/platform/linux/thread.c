@@ -22,8 +22,15 @@
 
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include "common/debug.h"
+#include "common/util.h"
 
 struct LGThread
 {
@@ -81,3 +88,97 @@ bool lgJoinThread(LGThread * handle, int * resultCode)
   free(handle);
   return true;
 }
+
+/* the realtime priorities are kept low so they only need a small RLIMIT_RTPRIO
+ * and never compete with the kernel's own threads */
+#define THREAD_FIFO_CAPTURE  1
+#define THREAD_FIFO_PLAYBACK 2
+#define THREAD_NICE_HIGH    -10
+
+static bool setNice(int nice)
+{
+  // on Linux the nice value is per thread when given a thread id
+  const id_t tid = syscall(SYS_gettid);
+  if (setpriority(PRIO_PROCESS, tid, nice) == 0)
+    return true;
+
+  // unprivileged threads may still go as low as RLIMIT_NICE permits
+  struct rlimit rlim;
+  if (nice >= 0 || getrlimit(RLIMIT_NICE, &rlim) != 0 ||
+      rlim.rlim_cur == RLIM_INFINITY)
+    return false;
+
+  const int floor = 20 - (int)rlim.rlim_cur;
+  if (floor >= 0)
+    return false;
+
+  return setpriority(PRIO_PROCESS, tid, max(nice, floor)) == 0;
+}
+
+bool lgThreadSetPriority(LGThreadPriority priority)
+{
+  int fifo = 0;
+  switch(priority)
+  {
+    case LG_THREAD_PRIORITY_NORMAL:
+    {
+      struct sched_param param = { .sched_priority = 0 };
+      pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+      return setNice(0);
+    }
+
+    case LG_THREAD_PRIORITY_HIGH:
+      break;
+
+    case LG_THREAD_PRIORITY_CAPTURE:
+      fifo = THREAD_FIFO_CAPTURE;
+      break;
+
+    case LG_THREAD_PRIORITY_PLAYBACK:
+      fifo = THREAD_FIFO_PLAYBACK;
+      break;
+  }
+
+  if (fifo)
+  {
+    struct sched_param param = { .sched_priority = fifo };
+    const int ret = pthread_setschedparam(pthread_self(),
+        SCHED_FIFO | SCHED_RESET_ON_FORK, &param);
+    if (ret == 0)
+      return true;
+
+    if (ret != EPERM)
+      DEBUG_WARN("pthread_setschedparam failed: %s", strerror(ret));
+  }
+
+  if (setNice(THREAD_NICE_HIGH))
+    return true;
+
+  DEBUG_INFO("Unable to raise the thread priority, RLIMIT_RTPRIO or "
+      "RLIMIT_NICE may need to be raised");
+  return false;
+}
+
+bool lgThreadSetAffinity(int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+
+  if (cpu < 0)
+  {
+    const long count = sysconf(_SC_NPROCESSORS_CONF);
+    for(long i = 0; i < count && i < CPU_SETSIZE; ++i)
+      CPU_SET(i, &set);
+  }
+  else
+    CPU_SET(cpu, &set);
+
+  const int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (ret != 0)
+  {
+    DEBUG_ERROR("pthread_setaffinity_np failed: %s", strerror(ret));
+    return false;
+  }
+
+  return true;
+}
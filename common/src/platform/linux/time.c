@@ -21,99 +21,139 @@
 #include "common/time.h"
 #include "common/debug.h"
 #include "common/thread.h"
-#include "common/ll.h"
+#include "common/event.h"
 
 #include <errno.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/prctl.h>
 
+/* all timers are run by one thread that sleeps until the earliest time one of
+ * them must run, and then runs every timer that is due by then. A timer's
+ * slack lets it run late so it can share the wakeup of another */
 struct LGTimerState
 {
-  bool              running;
+  // held by create and destroy, so the thread is not restarted while stopping
+  pthread_mutex_t   control;
+  pthread_mutex_t   lock;
   struct LGThread * thread;
-  struct ll       * timers;
+  // the thread runs until this changes
+  unsigned int      generation;
+  LGEvent         * wake;
+
+  struct LGTimer ** timers;
+  unsigned int      count;
+  unsigned int      size;
 };
 
 struct LGTimer
 {
-  unsigned int   interval;
-  unsigned int   count;
+  uint64_t       interval; // ns
+  uint64_t       slack;    // ns
+  uint64_t       due;      // CLOCK_MONOTONIC ns
+  bool           active;
   LGTimerFn      fn;
   void         * udata;
 };
 
-static struct LGTimerState l_ts = { 0 };
+static struct LGTimerState l_ts =
+{
+  .control = PTHREAD_MUTEX_INITIALIZER,
+  .lock    = PTHREAD_MUTEX_INITIALIZER
+};
 
-static int timerFn(void * fn)
+static inline uint64_t monotonicNS(void)
 {
-  struct LGTimer * timer;
   struct timespec time;
-
   clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+static void removeTimer(unsigned int index)
+{
+  l_ts.timers[index]->active = false;
+  l_ts.timers[index] = l_ts.timers[--l_ts.count];
+}
 
-  while(l_ts.running)
+static int timerFn(void * opaque)
+{
+  const unsigned int generation = (uintptr_t)opaque;
+  pthread_mutex_lock(&l_ts.lock);
+  while(l_ts.generation == generation)
   {
-    ll_lock(l_ts.timers);
-    ll_forEachNL(l_ts.timers, item, timer)
+    const uint64_t now = monotonicNS();
+    for(unsigned int i = 0; i < l_ts.count;)
     {
-      if (timer->count++ == timer->interval)
+      struct LGTimer * timer = l_ts.timers[i];
+      if (timer->due > now)
+      {
+        ++i;
+        continue;
+      }
+
+      if (!timer->fn(timer->udata))
       {
-        timer->count = 0;
-        if (!timer->fn(timer->udata))
-          ll_removeNL(l_ts.timers, item);
+        removeTimer(i);
+        continue;
       }
+
+      // keep to the original cadence unless a whole interval was missed
+      timer->due += timer->interval;
+      if (timer->due <= now)
+        timer->due = now + timer->interval;
+      ++i;
     }
-    ll_unlock(l_ts.timers);
 
-    tsAdd(&time, 1000000);
-    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, NULL) != 0) {}
+    uint64_t wake = UINT64_MAX;
+    for(unsigned int i = 0; i < l_ts.count; ++i)
+    {
+      const uint64_t latest = l_ts.timers[i]->due + l_ts.timers[i]->slack;
+      if (latest < wake)
+        wake = latest;
+    }
+    pthread_mutex_unlock(&l_ts.lock);
+
+    struct timespec ts =
+    {
+      .tv_sec  = wake / 1000000000ULL,
+      .tv_nsec = wake % 1000000000ULL
+    };
+    lgWaitEventAbs(l_ts.wake, wake == UINT64_MAX ? NULL : &ts);
+
+    pthread_mutex_lock(&l_ts.lock);
   }
+  pthread_mutex_unlock(&l_ts.lock);
 
   return 0;
 }
 
-static inline bool setupTimerThread(void)
+// called with the lock held
+static bool setupTimerThread(void)
 {
   if (l_ts.thread)
     return true;
 
-  l_ts.timers  = ll_new();
-  l_ts.running = true;
-  if (!l_ts.timers)
+  if (!l_ts.wake && !(l_ts.wake = lgCreateEvent(true, 0)))
   {
-    DEBUG_ERROR("failed to create linked list");
-    goto err;
+    DEBUG_ERROR("failed to create the timer event");
+    return false;
   }
 
-  if (!lgCreateThread("TimerThread", timerFn, NULL, &l_ts.thread))
+  if (!lgCreateThread("TimerThread", timerFn,
+        (void *)(uintptr_t)l_ts.generation, &l_ts.thread))
   {
     DEBUG_ERROR("failed to create the timer thread");
-    goto err_thread;
+    return false;
   }
 
   return true;
-
-err_thread:
-  ll_free(l_ts.timers);
-
-err:
-  return false;
-}
-
-static void destroyTimerThread(void)
-{
-  if (ll_count(l_ts.timers))
-    return;
-
-  l_ts.running = false;
-  lgJoinThread(l_ts.thread, NULL);
-  l_ts.thread = NULL;
 }
 
-bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
-    void * udata, LGTimer ** result)
+bool lgCreateTimerSlack(const unsigned int intervalMS,
+    const unsigned int slackMS, LGTimerFn fn, void * udata, LGTimer ** result)
 {
   struct LGTimer * timer = malloc(sizeof(*timer));
   if (!timer)
@@ -122,33 +162,102 @@ bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
     return false;
   }
 
-  timer->interval = intervalMS;
-  timer->count    = 0;
+  timer->interval = (uint64_t)intervalMS * 1000000ULL;
+  timer->slack    = (uint64_t)slackMS    * 1000000ULL;
+  timer->due      = monotonicNS() + timer->interval;
+  timer->active   = true;
   timer->fn       = fn;
   timer->udata    = udata;
 
+  pthread_mutex_lock(&l_ts.control);
+  pthread_mutex_lock(&l_ts.lock);
   if (!setupTimerThread())
   {
     DEBUG_ERROR("failed to setup the timer thread");
-    goto err_thread;
+    goto err;
+  }
+
+  if (l_ts.count == l_ts.size)
+  {
+    const unsigned int size = l_ts.size ? l_ts.size * 2 : 8;
+    struct LGTimer ** timers = realloc(l_ts.timers, size * sizeof(*timers));
+    if (!timers)
+    {
+      DEBUG_ERROR("out of memory");
+      goto err;
+    }
+    l_ts.timers = timers;
+    l_ts.size   = size;
   }
 
-  ll_push(l_ts.timers, timer);
+  l_ts.timers[l_ts.count++] = timer;
+  pthread_mutex_unlock(&l_ts.lock);
+
+  // the new timer may be due before the thread would next wake
+  lgSignalEvent(l_ts.wake);
+  pthread_mutex_unlock(&l_ts.control);
   *result = timer;
   return true;
 
-err_thread:
+err:
+  pthread_mutex_unlock(&l_ts.lock);
+  pthread_mutex_unlock(&l_ts.control);
   free(timer);
   return false;
 }
 
+bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
+    void * udata, LGTimer ** result)
+{
+  return lgCreateTimerSlack(intervalMS, intervalMS / 8, fn, udata, result);
+}
+
 void lgTimerDestroy(LGTimer * timer)
 {
-  if (!l_ts.thread)
-    return;
+  // the lock is held while the timers run so this waits for a running one
+  pthread_mutex_lock(&l_ts.control);
+  pthread_mutex_lock(&l_ts.lock);
+  if (timer->active)
+    for(unsigned int i = 0; i < l_ts.count; ++i)
+      if (l_ts.timers[i] == timer)
+      {
+        removeTimer(i);
+        break;
+      }
 
-  ll_removeData(l_ts.timers, timer);
+  const bool stop = l_ts.thread && l_ts.count == 0;
+  struct LGThread * thread = l_ts.thread;
+  if (stop)
+  {
+    ++l_ts.generation;
+    l_ts.thread = NULL;
+  }
+  pthread_mutex_unlock(&l_ts.lock);
   free(timer);
 
-  destroyTimerThread();
+  if (stop)
+  {
+    lgSignalEvent(l_ts.wake);
+    lgJoinThread(thread, NULL);
+  }
+  pthread_mutex_unlock(&l_ts.control);
+}
+
+void lgSleepUntil(uint64_t deadline)
+{
+  const struct timespec ts =
+  {
+    .tv_sec  = deadline / 1000000LL,
+    .tv_nsec = (deadline % 1000000LL) * 1000LL
+  };
+
+  // microtime() is CLOCK_MONOTONIC so the deadline can be used as is
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+void lgSetTimerSlack(uint64_t ns)
+{
+  // zero would reset the thread to the process default instead
+  if (prctl(PR_SET_TIMERSLACK, ns ? ns : 1, 0, 0, 0) != 0)
+    DEBUG_WARN("PR_SET_TIMERSLACK failed: %s", strerror(errno));
 }
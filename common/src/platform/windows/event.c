@@ -21,38 +21,138 @@
 #include "common/event.h"
 #include "common/windebug.h"
 #include "common/time.h"
+#include "common/util.h"
 
 #include <windows.h>
+#include <stdlib.h>
 #include <stdatomic.h>
+#include <intrin.h>
+
+/* however long the caller asks for a wait never spins longer than this, past
+ * it the wake is no longer what the latency is made of */
+#define EVENT_SPIN_MAX_NS 50000
+#define EVENT_SPIN_MIN_NS 1000
+
+/* WaitOnAddress is Windows 8 and later, it is looked up at runtime so that on
+ * Windows 7 the events fall back to kernel event objects */
+typedef BOOL (WINAPI * WaitOnAddressFn)(volatile VOID * address,
+    PVOID compareAddress, SIZE_T addressSize, DWORD dwMilliseconds);
+typedef VOID (WINAPI * WakeByAddressFn)(PVOID address);
+
+static struct
+{
+  INIT_ONCE       once;
+  WaitOnAddressFn waitOnAddress;
+  WakeByAddressFn wakeSingle;
+  WakeByAddressFn wakeAll;
+  long            cpus;
+}
+waitApi = { .once = INIT_ONCE_STATIC_INIT };
+
+struct LGEvent
+{
+  // a wrapped event, or the event on systems without WaitOnAddress
+  HANDLE       handle;
+  bool         wrapped;
+
+  // the address waited on, one while signaled
+  atomic_uint  signaled;
+  atomic_int   waiting;
+  bool         autoReset;
+
+  /* the spin before sleeping adapts to how long the recent waits took, it
+   * grows while they are shorter than the limit and backs off when not */
+  unsigned int spinMax;
+  atomic_uint  spin;
+};
+
+static BOOL CALLBACK initSync(PINIT_ONCE once, PVOID param, PVOID * context)
+{
+  HMODULE mod = LoadLibraryA("api-ms-win-core-synch-l1-2-0.dll");
+  if (mod)
+  {
+    waitApi.waitOnAddress = (WaitOnAddressFn)GetProcAddress(mod,
+        "WaitOnAddress");
+    waitApi.wakeSingle    = (WakeByAddressFn)GetProcAddress(mod,
+        "WakeByAddressSingle");
+    waitApi.wakeAll       = (WakeByAddressFn)GetProcAddress(mod,
+        "WakeByAddressAll");
+
+    if (!waitApi.waitOnAddress || !waitApi.wakeSingle || !waitApi.wakeAll)
+      waitApi.waitOnAddress = NULL;
+  }
+
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  waitApi.cpus = si.dwNumberOfProcessors;
+  return TRUE;
+}
 
 LGEvent * lgCreateEvent(bool autoReset, unsigned int msSpinTime)
 {
-  HANDLE handle = CreateEvent(NULL, autoReset ? FALSE : TRUE, FALSE, NULL);
-  if (!handle)
+  InitOnceExecuteOnce(&waitApi.once, initSync, NULL, NULL);
+
+  LGEvent * event = calloc(1, sizeof(*event));
+  if (!event)
   {
-    DEBUG_WINERROR("Failed to create the event", GetLastError());
+    DEBUG_ERROR("Failed to allocate memory");
     return NULL;
   }
 
-  return (LGEvent *)handle;
+  if (!waitApi.waitOnAddress)
+  {
+    event->handle = CreateEvent(NULL, autoReset ? FALSE : TRUE, FALSE, NULL);
+    if (!event->handle)
+    {
+      DEBUG_WINERROR("Failed to create the event", GetLastError());
+      free(event);
+      return NULL;
+    }
+    return event;
+  }
+
+  // spinning on a single CPU only delays the thread that would signal us
+  event->autoReset = autoReset;
+  event->spinMax   = waitApi.cpus > 1 ?
+    min((uint64_t)msSpinTime * 1000000ULL, EVENT_SPIN_MAX_NS) : 0;
+  atomic_init(&event->spin, event->spinMax);
+  return event;
 }
 
 LGEvent * lgWrapEvent(void * handle)
 {
-  return (LGEvent *)handle;
+  LGEvent * event = calloc(1, sizeof(*event));
+  if (!event)
+  {
+    DEBUG_ERROR("Failed to allocate memory");
+    return NULL;
+  }
+
+  event->handle  = (HANDLE)handle;
+  event->wrapped = true;
+  return event;
 }
 
+// the owner of a wrapped event closes it
 void lgFreeEvent(LGEvent * event)
 {
-  CloseHandle((HANDLE)event);
+  if (event->handle)
+  {
+    if (!event->wrapped)
+      CloseHandle(event->handle);
+  }
+  else if (atomic_load_explicit(&event->waiting, memory_order_acquire) != 0)
+    DEBUG_ERROR("BUG: Freeing an event that still has threads waiting on it");
+
+  free(event);
 }
 
-bool lgWaitEvent(LGEvent * event, unsigned int timeout)
+static bool waitHandle(LGEvent * event, unsigned int timeout)
 {
   const DWORD to = (timeout == TIMEOUT_INFINITE) ? INFINITE : (DWORD)timeout;
   do
   {
-    switch(WaitForSingleObject((HANDLE)event, to))
+    switch(WaitForSingleObject(event->handle, to))
     {
       case WAIT_OBJECT_0:
         return true;
@@ -77,12 +177,120 @@ bool lgWaitEvent(LGEvent * event, unsigned int timeout)
   return false;
 }
 
+// takes the signal if set, auto reset events release a single waiter
+static inline bool tryConsume(LGEvent * event)
+{
+  if (!event->autoReset)
+    return atomic_load_explicit(&event->signaled, memory_order_acquire);
+
+  unsigned int expected = 1;
+  return atomic_compare_exchange_strong_explicit(&event->signaled, &expected,
+      0, memory_order_acquire, memory_order_relaxed);
+}
+
+static void adaptSpin(LGEvent * event, uint64_t waited)
+{
+  const unsigned int spin = atomic_load_explicit(&event->spin,
+      memory_order_relaxed);
+
+  unsigned int next;
+  if (waited <= event->spinMax)
+    next = min(max(spin * 2, EVENT_SPIN_MIN_NS), event->spinMax);
+  else
+    next = spin / 2;
+
+  if (next != spin)
+    atomic_store_explicit(&event->spin, next, memory_order_relaxed);
+}
+
+bool lgWaitEvent(LGEvent * event, unsigned int timeout)
+{
+  if (event->handle)
+    return waitHandle(event, timeout);
+
+  if (tryConsume(event))
+    return true;
+
+  const uint64_t start = nanotime();
+  const unsigned int spin = atomic_load_explicit(&event->spin,
+      memory_order_relaxed);
+
+  if (spin)
+    do
+    {
+      for(int i = 0; i < 16; ++i)
+        _mm_pause();
+
+      if (tryConsume(event))
+      {
+        adaptSpin(event, nanotime() - start);
+        return true;
+      }
+    }
+    while(nanotime() - start < spin);
+
+  /* the waiter count is raised before the last check so a signal after it
+   * sees the waiter, and one before it is seen by the check */
+  const uint64_t deadline = timeout == TIMEOUT_INFINITE ? 0 :
+    start + (uint64_t)timeout * 1000000ULL;
+  bool ret = true;
+  atomic_fetch_add_explicit(&event->waiting, 1, memory_order_seq_cst);
+  while(!tryConsume(event))
+  {
+    DWORD ms = INFINITE;
+    if (deadline)
+    {
+      const uint64_t now = nanotime();
+      if (now >= deadline)
+      {
+        ret = false;
+        break;
+      }
+      ms = (DWORD)((deadline - now + 999999) / 1000000);
+    }
+
+    unsigned int zero = 0;
+    if (!waitApi.waitOnAddress(&event->signaled, &zero, sizeof(zero), ms) &&
+        GetLastError() != ERROR_TIMEOUT)
+    {
+      DEBUG_WINERROR("Wait for event failed", GetLastError());
+      ret = false;
+      break;
+    }
+  }
+  atomic_fetch_sub_explicit(&event->waiting, 1, memory_order_release);
+
+  if (event->spinMax)
+    adaptSpin(event, nanotime() - start);
+
+  return ret;
+}
+
 bool lgSignalEvent(LGEvent * event)
 {
-  return SetEvent((HANDLE)event);
+  if (event->handle)
+    return SetEvent(event->handle);
+
+  if (atomic_exchange_explicit(&event->signaled, 1, memory_order_seq_cst))
+    return true;
+
+  // only enter the kernel if there is someone asleep to wake
+  if (atomic_load_explicit(&event->waiting, memory_order_seq_cst))
+  {
+    if (event->autoReset)
+      waitApi.wakeSingle(&event->signaled);
+    else
+      waitApi.wakeAll(&event->signaled);
+  }
+
+  return true;
 }
 
 bool lgResetEvent(LGEvent * event)
 {
-  return ResetEvent((HANDLE)event);
+  if (event->handle)
+    return ResetEvent(event->handle);
+
+  atomic_store_explicit(&event->signaled, 0, memory_order_release);
+  return true;
 }
@@ -18,6 +18,7 @@
  * Temple Place, Suite 330, Boston, MA 02111-1307 USA
  */
 
+#include "common/array.h"
 #include "common/ivshmem.h"
 #include "common/option.h"
 #include "common/vector.h"
@@ -28,12 +29,47 @@
 
 #include <setupapi.h>
 #include <io.h>
+#include <string.h>
 
 struct IVSHMEMInfo
 {
-  HANDLE handle;
+  HANDLE         handle;
+  IVSHMEM_PEERID peerID;
+  UINT16         vectors;
 };
 
+static const struct
+{
+  const char * name;
+  UINT8        mode;
+}
+cacheModes[] =
+{
+  { "writecombined", IVSHMEM_CACHE_WRITECOMBINED },
+  { "cached"       , IVSHMEM_CACHE_CACHED        },
+  { "uncached"     , IVSHMEM_CACHE_NONCACHED     }
+};
+
+static bool cacheModeValidator(struct Option * opt, const char ** error)
+{
+  for (int i = 0; i < ARRAY_LENGTH(cacheModes); ++i)
+    if (strcmp(opt->value.x_string, cacheModes[i].name) == 0)
+      return true;
+
+  *error = "Invalid cache mode, must be one of writecombined, cached or uncached";
+  return false;
+}
+
+static UINT8 getCacheMode(void)
+{
+  const char * name = option_get_string("os", "shmCacheMode");
+  for (int i = 0; i < ARRAY_LENGTH(cacheModes); ++i)
+    if (strcmp(name, cacheModes[i].name) == 0)
+      return cacheModes[i].mode;
+
+  return IVSHMEM_CACHE_WRITECOMBINED;
+}
+
 void ivshmemOptionsInit(void)
 {
   static struct Option options[] = {
@@ -44,6 +80,14 @@ void ivshmemOptionsInit(void)
       .type           = OPTION_TYPE_INT,
       .value.x_int    = 0
     },
+    {
+      .module         = "os",
+      .name           = "shmCacheMode",
+      .description    = "The caching mode of the IVSHMEM mapping (writecombined, cached or uncached)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "writecombined",
+      .validator      = cacheModeValidator
+    },
     {0}
   };
 
@@ -181,8 +225,10 @@ bool ivshmemInit(struct IVSHMEM * dev)
 
   struct IVSHMEMInfo * info = malloc(sizeof(*info));
 
-  info->handle = handle;
-  dev->opaque  = info;
+  info->handle  = handle;
+  info->peerID  = 0;
+  info->vectors = 0;
+  dev->opaque   = info;
   dev->size    = 0;
   dev->mem     = NULL;
 
@@ -202,7 +248,9 @@ bool ivshmemOpen(struct IVSHMEM * dev)
     return 0;
   }
 
-  IVSHMEM_MMAP_CONFIG config = { .cacheMode = IVSHMEM_CACHE_WRITECOMBINED };
+  /* the framebuffer copies use full line non-temporal stores which suit a
+   * write-combined mapping, the other modes are for troubleshooting */
+  IVSHMEM_MMAP_CONFIG config = { .cacheMode = getCacheMode() };
   IVSHMEM_MMAP map = { 0 };
   if (!DeviceIoControl(
     info->handle,
@@ -215,6 +263,12 @@ bool ivshmemOpen(struct IVSHMEM * dev)
     return false;
   }
 
+  if (config.cacheMode != IVSHMEM_CACHE_WRITECOMBINED)
+    DEBUG_WARN("IVSHMEM is not mapped write-combined, performance will suffer");
+
+  info->peerID  = map.peerID;
+  info->vectors = map.vectors;
+
   dev->size   = (unsigned int)size;
   dev->mem    = map.ptr;
   return true;
@@ -242,3 +296,52 @@ void ivshmemFree(struct IVSHMEM * dev)
   free(info);
   dev->opaque = NULL;
 }
+
+bool ivshmemHasDoorbell(struct IVSHMEM * dev)
+{
+  DEBUG_ASSERT(dev && dev->opaque);
+
+  struct IVSHMEMInfo * info = (struct IVSHMEMInfo *)dev->opaque;
+  return info->vectors > 0;
+}
+
+int ivshmemGetPeerID(struct IVSHMEM * dev)
+{
+  DEBUG_ASSERT(dev && dev->opaque);
+
+  struct IVSHMEMInfo * info = (struct IVSHMEMInfo *)dev->opaque;
+  return info->peerID;
+}
+
+bool ivshmemRingDoorbell(struct IVSHMEM * dev, uint16_t peerID, uint16_t vector)
+{
+  DEBUG_ASSERT(dev && dev->opaque);
+
+  struct IVSHMEMInfo * info = (struct IVSHMEMInfo *)dev->opaque;
+
+  IVSHMEM_RING ring =
+  {
+    .peerID = peerID,
+    .vector = vector
+  };
+
+  if (!DeviceIoControl(info->handle, IOCTL_IVSHMEM_RING_DOORBELL,
+        &ring, sizeof(IVSHMEM_RING), NULL, 0, NULL, NULL))
+  {
+    DEBUG_WINERROR("DeviceIoControl failed", GetLastError());
+    return false;
+  }
+
+  return true;
+}
+
+int ivshmemWaitDoorbell(struct IVSHMEM * dev, uint16_t vector, unsigned int timeout)
+{
+  // the host only ever rings the client
+  return -1;
+}
+
+void ivshmemWakeDoorbell(struct IVSHMEM * dev, uint16_t vector)
+{
+  // the host never waits on the doorbell
+}
@@ -0,0 +1,138 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/metrics.h"
+#include "common/debug.h"
+#include "common/windebug.h"
+#include "common/thread.h"
+#include "common/event.h"
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct
+{
+  HANDLE        mapping;
+  MetricsPage * page;
+  char        * buffer;
+  LGThread    * thread;
+  LGEvent     * stopEvent;
+}
+metricsExport = { 0 };
+
+static int exportThread(void * opaque)
+{
+  MetricsPage * page = metricsExport.page;
+  const size_t maxText = METRICS_PAGE_SIZE - sizeof(*page);
+
+  do
+  {
+    /* format outside of the page so readers only see it change for as long
+     * as the copy takes */
+    const size_t len = metrics_format(metricsExport.buffer, maxText);
+
+    InterlockedIncrement((LONG volatile *)&page->seq);
+    memcpy(page->text, metricsExport.buffer, len);
+    page->size = len;
+    InterlockedIncrement((LONG volatile *)&page->seq);
+  }
+  while (!lgWaitEvent(metricsExport.stopEvent, 1000));
+
+  return 0;
+}
+
+bool metrics_startExport(const char * location)
+{
+  metricsExport.mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL,
+      PAGE_READWRITE, 0, METRICS_PAGE_SIZE, location);
+  if (!metricsExport.mapping)
+  {
+    DEBUG_WINERROR("Failed to create the metrics mapping", GetLastError());
+    return false;
+  }
+
+  metricsExport.page = MapViewOfFile(metricsExport.mapping, FILE_MAP_WRITE,
+      0, 0, METRICS_PAGE_SIZE);
+  if (!metricsExport.page)
+  {
+    DEBUG_WINERROR("Failed to map the metrics page", GetLastError());
+    goto fail;
+  }
+
+  metricsExport.buffer    = malloc(METRICS_PAGE_SIZE);
+  metricsExport.stopEvent = lgCreateEvent(false, 0);
+  if (!metricsExport.buffer || !metricsExport.stopEvent)
+  {
+    DEBUG_ERROR("out of memory");
+    goto fail;
+  }
+
+  MetricsPage * page = metricsExport.page;
+  page->magic   = METRICS_PAGE_MAGIC;
+  page->version = METRICS_PAGE_VER;
+  page->seq     = 0;
+  page->size    = 0;
+
+  if (!lgCreateThread("metricsExport", exportThread, NULL,
+        &metricsExport.thread))
+  {
+    DEBUG_ERROR("Failed to create the metrics export thread");
+    goto fail;
+  }
+
+  DEBUG_INFO("Metrics exported at %s", location);
+  return true;
+
+fail:
+  metrics_stopExport();
+  return false;
+}
+
+void metrics_stopExport(void)
+{
+  if (metricsExport.thread)
+  {
+    lgSignalEvent(metricsExport.stopEvent);
+    lgJoinThread(metricsExport.thread, NULL);
+    metricsExport.thread = NULL;
+  }
+
+  if (metricsExport.stopEvent)
+  {
+    lgFreeEvent(metricsExport.stopEvent);
+    metricsExport.stopEvent = NULL;
+  }
+
+  free(metricsExport.buffer);
+  metricsExport.buffer = NULL;
+
+  if (metricsExport.page)
+  {
+    UnmapViewOfFile(metricsExport.page);
+    metricsExport.page = NULL;
+  }
+
+  if (metricsExport.mapping)
+  {
+    CloseHandle(metricsExport.mapping);
+    metricsExport.mapping = NULL;
+  }
+}
@@ -23,6 +23,7 @@
 #include "common/windebug.h"
 
 #include <windows.h>
+#include <avrt.h>
 
 struct LGThread
 {
@@ -92,3 +93,86 @@ bool lgJoinThread(LGThread * handle, int * resultCode)
   return false;
 }
 
+
+bool lgThreadSetPriority(LGThreadPriority priority)
+{
+  const char * task = NULL;
+  AVRT_PRIORITY avPriority = AVRT_PRIORITY_NORMAL;
+  switch(priority)
+  {
+    case LG_THREAD_PRIORITY_NORMAL:
+      if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL))
+      {
+        DEBUG_WINERROR("SetThreadPriority failed", GetLastError());
+        return false;
+      }
+      return true;
+
+    case LG_THREAD_PRIORITY_HIGH:
+      break;
+
+    case LG_THREAD_PRIORITY_CAPTURE:
+      task       = "Capture";
+      avPriority = AVRT_PRIORITY_CRITICAL;
+      break;
+
+    case LG_THREAD_PRIORITY_PLAYBACK:
+      task       = "Playback";
+      avPriority = AVRT_PRIORITY_HIGH;
+      break;
+  }
+
+  if (task)
+  {
+    // the MMCSS registration lives as long as the thread does
+    DWORD taskIndex = 0;
+    HANDLE task_h = AvSetMmThreadCharacteristicsA(task, &taskIndex);
+    if (task_h)
+    {
+      if (!AvSetMmThreadPriority(task_h, avPriority))
+        DEBUG_WINERROR("AvSetMmThreadPriority failed", GetLastError());
+      return true;
+    }
+
+    DEBUG_WINERROR("AvSetMmThreadCharacteristicsA failed", GetLastError());
+  }
+
+  if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST))
+  {
+    DEBUG_WINERROR("SetThreadPriority failed", GetLastError());
+    return false;
+  }
+
+  return true;
+}
+
+bool lgThreadSetAffinity(int cpu)
+{
+  DWORD_PTR mask;
+  if (cpu < 0)
+  {
+    DWORD_PTR system;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &mask, &system))
+    {
+      DEBUG_WINERROR("GetProcessAffinityMask failed", GetLastError());
+      return false;
+    }
+  }
+  else
+  {
+    if (cpu >= (int)(sizeof(mask) * 8))
+    {
+      DEBUG_ERROR("CPU %d is out of range", cpu);
+      return false;
+    }
+    mask = (DWORD_PTR)1 << cpu;
+  }
+
+  if (!SetThreadAffinityMask(GetCurrentThread(), mask))
+  {
+    DEBUG_WINERROR("SetThreadAffinityMask failed", GetLastError());
+    return false;
+  }
+
+  return true;
+}
@@ -42,9 +42,23 @@ static void TimerProc(HWND Arg1, UINT Arg2, UINT_PTR Arg3, DWORD Arg4)
   }
 }
 
-bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
-    void * udata, LGTimer ** result)
+/* SetCoalescableTimer is Windows 8 and later, without it the slack is not
+ * passed on */
+typedef UINT_PTR (WINAPI * SetCoalescableTimerFn)(HWND hWnd, UINT_PTR nIDEvent,
+    UINT uElapse, TIMERPROC lpTimerFunc, ULONG uToleranceDelay);
+
+bool lgCreateTimerSlack(const unsigned int intervalMS,
+    const unsigned int slackMS, LGTimerFn fn, void * udata, LGTimer ** result)
 {
+  static SetCoalescableTimerFn setCoalescableTimer = NULL;
+  static bool resolved = false;
+  if (!resolved)
+  {
+    setCoalescableTimer = (SetCoalescableTimerFn)GetProcAddress(
+        GetModuleHandleA("user32.dll"), "SetCoalescableTimer");
+    resolved = true;
+  }
+
   LGTimer * ret = malloc(sizeof(*ret));
   if (!ret)
   {
@@ -55,12 +69,23 @@ bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
   ret->fn      = fn;
   ret->udata   = udata;
   ret->running = true;
-  ret->handle  = SetTimer(MessageHWND, (UINT_PTR)ret, intervalMS, TimerProc);
+  if (setCoalescableTimer)
+    // zero would be the system default, not no coalescing
+    ret->handle = setCoalescableTimer(MessageHWND, (UINT_PTR)ret, intervalMS,
+        TimerProc, slackMS ? slackMS : 0xFFFFFFFF);
+  else
+    ret->handle = SetTimer(MessageHWND, (UINT_PTR)ret, intervalMS, TimerProc);
 
   *result = ret;
   return true;
 }
 
+bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
+    void * udata, LGTimer ** result)
+{
+  return lgCreateTimerSlack(intervalMS, intervalMS / 8, fn, udata, result);
+}
+
 void lgTimerDestroy(LGTimer * timer)
 {
   if (timer->running)
@@ -84,3 +109,45 @@ void windowsSetTimerResolution(void)
   NtSetTimerResolution(1, true, &actualResolution);
   DEBUG_INFO("System timer resolution: %.1f μs", actualResolution / 10.0);
 }
+
+// only defined by newer SDKs, supported from Windows 10 1803
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+void lgSleepUntil(uint64_t deadline)
+{
+  /* waitable timers can not be shared between threads that wait on them at the
+   * same time, so each sleeping thread gets its own for its lifetime */
+  static __thread HANDLE timer       = NULL;
+  static __thread bool   timerFailed = false;
+
+  const uint64_t now = microtime();
+  if (now >= deadline)
+    return;
+
+  // negative is relative, absolute due times are in wall clock time
+  LARGE_INTEGER due = { .QuadPart = -(int64_t)((deadline - now) * 10LL) };
+
+  if (!timer && !timerFailed)
+  {
+    timer = CreateWaitableTimerExW(NULL, NULL,
+        CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (!timer)
+    {
+      DEBUG_WARN("High resolution timers are not available, sleeps will "
+          "depend on the system timer resolution");
+      timerFailed = true;
+    }
+  }
+
+  if (timer && SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE) &&
+      WaitForSingleObject(timer, INFINITE) == WAIT_OBJECT_0)
+    return;
+
+  NtDelayExecution(FALSE, &due);
+}
+
+void lgSetTimerSlack(uint64_t ns)
+{
+}
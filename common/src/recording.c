@@ -0,0 +1,89 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/recording.h"
+
+#include <string.h>
+
+unsigned int recording_rectsBpp(FrameType type)
+{
+  switch(type)
+  {
+    case FRAME_TYPE_BGRA:
+    case FRAME_TYPE_RGBA:
+    case FRAME_TYPE_RGBA10:
+    case FRAME_TYPE_RGBA10_PQ:
+      return 4;
+
+    case FRAME_TYPE_RGBA16F:
+      return 8;
+
+    // the chroma plane does not follow the rects
+    default:
+      return 0;
+  }
+}
+
+size_t recording_rectsSize(const FrameDamageRect * rects, unsigned int count,
+    unsigned int bpp)
+{
+  size_t size = 0;
+  for(unsigned int i = 0; i < count; ++i)
+    size += (size_t)rects[i].width * rects[i].height * bpp;
+  return size;
+}
+
+void recording_packRects(void * dst, const void * src, size_t pitch,
+    unsigned int bpp, const FrameDamageRect * rects, unsigned int count)
+{
+  uint8_t * out = dst;
+  for(unsigned int i = 0; i < count; ++i)
+  {
+    const FrameDamageRect * r = rects + i;
+    const size_t    rowSize = (size_t)r->width * bpp;
+    const uint8_t * in      = (const uint8_t *)src + r->y * pitch + r->x * bpp;
+    for(unsigned int y = 0; y < r->height; ++y, in += pitch, out += rowSize)
+      memcpy(out, in, rowSize);
+  }
+}
+
+bool recording_unpackRects(void * dst, size_t pitch, unsigned int width,
+    unsigned int height, unsigned int bpp, const void * src, size_t srcSize,
+    const FrameDamageRect * rects, unsigned int count)
+{
+  const uint8_t * in = src;
+  for(unsigned int i = 0; i < count; ++i)
+  {
+    const FrameDamageRect * r = rects + i;
+    if (r->x + r->width > width || r->y + r->height > height)
+      return false;
+
+    const size_t rowSize = (size_t)r->width * bpp;
+    if (rowSize * r->height > srcSize)
+      return false;
+    srcSize -= rowSize * r->height;
+
+    uint8_t * out = (uint8_t *)dst + r->y * pitch + r->x * bpp;
+    for(unsigned int y = 0; y < r->height; ++y, in += rowSize, out += pitch)
+      memcpy(out, in, rowSize);
+  }
+
+  return true;
+}
@@ -19,10 +19,24 @@
  */
 
 #include "common/rects.h"
+#include "common/fbprofile.h"
 #include "common/util.h"
+#include "common/cpuinfo.h"
 
 #include <stdlib.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define RECTS_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#define RECTS_NEON
+#include <arm_neon.h>
+#endif
+
+// the damaged bytes copied between progress updates within a band
+#define RECTS_BAND_BYTES    262144
+#define RECTS_BAND_ROWS_MIN 16
+
 struct Corner
 {
   int x;
@@ -83,9 +97,81 @@ static int cornerCompare(const void * a_, const void * b_)
   return 0;
 }
 
+typedef void (*RectCopyFn)(uint8_t * dest, const uint8_t * src,
+    int ystart, int yend, int dx, int dstStride, int srcStride, int width);
+
+#ifdef RECTS_X86
+// d must be 16 byte aligned
+inline static void rowStream(uint8_t * d, const uint8_t * s, int n)
+{
+  for (; n >= 64; n -= 64, d += 64, s += 64)
+  {
+    const __m128i v1 = _mm_loadu_si128((const __m128i *)s + 0);
+    const __m128i v2 = _mm_loadu_si128((const __m128i *)s + 1);
+    const __m128i v3 = _mm_loadu_si128((const __m128i *)s + 2);
+    const __m128i v4 = _mm_loadu_si128((const __m128i *)s + 3);
+    _mm_stream_si128((__m128i *)d + 0, v1);
+    _mm_stream_si128((__m128i *)d + 1, v2);
+    _mm_stream_si128((__m128i *)d + 2, v3);
+    _mm_stream_si128((__m128i *)d + 3, v4);
+  }
+
+  for (; n >= 16; n -= 16, d += 16, s += 16)
+    _mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+
+  memcpy(d, s, n);
+}
+#endif
+
+/* copies into the (usually write-combined) shared memory with non-temporal
+ * stores so each 64 byte line is written out whole and does not pollute the
+ * cache, the caller must fence before publishing the rows */
+inline static void rectCopyStream(uint8_t * dest, const uint8_t * src,
+    int ystart, int yend, int dx, int dstStride, int srcStride, int width)
+{
+#ifdef RECTS_X86
+  // with a 16 byte aligned stride every row starts at the same alignment
+  if (!(dstStride & 15))
+  {
+    const int head = min(width,
+        (int)(-(uintptr_t)(dest + ystart * dstStride + dx) & 15));
+    if (!head)
+    {
+      for (int i = ystart; i < yend; ++i)
+        rowStream(dest + i * dstStride + dx, src + i * srcStride + dx, width);
+      return;
+    }
+
+    for (int i = ystart; i < yend; ++i)
+    {
+      uint8_t       * d = dest + i * dstStride + dx;
+      const uint8_t * s = src  + i * srcStride + dx;
+      memcpy(d, s, head);
+      rowStream(d + head, s + head, width - head);
+    }
+    return;
+  }
+#endif
+
+  for (int i = ystart; i < yend; ++i)
+  {
+    uint8_t       * d = dest + i * dstStride + dx;
+    const uint8_t * s = src  + i * srcStride + dx;
+    int             n = width;
+
+#ifdef RECTS_X86
+    const int head = min(n, (int)(-(uintptr_t)d & 15));
+    memcpy(d, s, head);
+    rowStream(d + head, s + head, n - head);
+#else
+    memcpy(d, s, n);
+#endif
+  }
+}
+
 inline static void rectsBufferCopy(FrameDamageRect * rects, int count,
   uint8_t * dst, int dstStride, int height,
-  const uint8_t * src, int srcStride, void * opaque,
+  const uint8_t * src, int srcStride, void * opaque, RectCopyFn copy,
   void (*rowCopyStart)(int y, void * opaque),
   void (*rowCopyFinish)(int y, void * opaque))
 {
@@ -136,20 +222,59 @@ inline static void rectsBufferCopy(FrameDamageRect * rects, int count,
       change[changes++] = (struct Edge) { .x = x, .delta = delta };
     }
 
-    if (rowCopyStart)
-      rowCopyStart(y, opaque);
-
     struct Edge * active = active_[activeRow];
-    int x1 = 0;
-    int in_rect = 0;
-    for (int i = 0; i < actives; ++i)
+    if (actives == 0)
     {
-      if (!in_rect)
-        x1 = active[i].x;
-      in_rect += active[i].delta;
-      if (!in_rect)
-        rectCopyUnaligned(dst, src, prev_y, y, x1 * 4, dstStride, srcStride,
-            (active[i].x - x1) * 4);
+      if (rowCopyStart)
+        rowCopyStart(y, opaque);
+    }
+    else
+    {
+      /* split tall bands so progress is published, and can be consumed, while
+       * the band is still being copied rather than only once it is done */
+      int rowBytes = 0;
+      int in_rect  = 0;
+      for (int i = 0; i < actives; ++i)
+      {
+        if (!in_rect)
+          rowBytes -= active[i].x * 4;
+        in_rect += active[i].delta;
+        if (!in_rect)
+          rowBytes += active[i].x * 4;
+      }
+
+      const int bandRows = max(RECTS_BAND_ROWS_MIN, RECTS_BAND_BYTES / max(rowBytes, 1));
+      for (int y0 = prev_y; y0 < y; )
+      {
+        const int y1 = min(y, y0 + bandRows);
+        if (rowCopyStart)
+          rowCopyStart(y1, opaque);
+
+        int x1 = 0;
+        in_rect = 0;
+        for (int i = 0; i < actives; ++i)
+        {
+          if (!in_rect)
+            x1 = active[i].x;
+          in_rect += active[i].delta;
+          if (in_rect)
+            continue;
+
+          // a span of whole rows is contiguous, copy the band as one row
+          const int width = (active[i].x - x1) * 4;
+          if (width == dstStride && dstStride == srcStride)
+            copy(dst, src, y0, y0 + 1, 0, dstStride, srcStride,
+                (y1 - y0) * dstStride);
+          else
+            copy(dst, src, y0, y1, x1 * 4, dstStride, srcStride, width);
+        }
+
+        // the end of the band is published below, or by the caller
+        if (rowCopyFinish && y1 < y)
+          rowCopyFinish(y1, opaque);
+
+        y0 = y1;
+      }
     }
 
     if (re >= cornerCount || y == height)
@@ -191,6 +316,14 @@ inline static void rectsBufferCopy(FrameDamageRect * rects, int count,
   }
 }
 
+// the non-temporal stores must be fenced before the rows are published
+static inline void streamFence(void)
+{
+#ifdef RECTS_X86
+  _mm_sfence();
+#endif
+}
+
 struct ToFramebufferData
 {
   FrameBuffer * frame;
@@ -200,6 +333,7 @@ struct ToFramebufferData
 static void fbRowFinish(int y, void * opaque)
 {
   struct ToFramebufferData * data = opaque;
+  streamFence();
   framebuffer_set_write_ptr(data->frame, y * data->stride);
 }
 
@@ -209,10 +343,60 @@ void rectsBufferToFramebuffer(FrameDamageRect * rects, int count,
 {
   struct ToFramebufferData data = { .frame = frame, .stride = dstStride };
   rectsBufferCopy(rects, count, framebuffer_get_data(frame), dstStride, height,
-    src, srcStride, &data, NULL, fbRowFinish);
+    src, srcStride, &data, rectCopyStream, NULL, fbRowFinish);
+  streamFence();
   framebuffer_set_write_ptr(frame, height * dstStride);
 }
 
+#ifdef RECTS_NEON
+/* the rows read from the shared memory, the next row is prefetched while the
+ * current one is copied as the rects are usually tall and narrow */
+static void rectCopyNEON(uint8_t * dest, const uint8_t * src,
+    int ystart, int yend, int dx, int dstStride, int srcStride, int width)
+{
+  for (int i = ystart; i < yend; ++i)
+  {
+    uint8_t       * d = dest + i * dstStride + dx;
+    const uint8_t * s = src  + i * srcStride + dx;
+    int             n = width;
+
+    if (i + 1 < yend)
+      for (int p = 0; p < width; p += 64)
+        __builtin_prefetch(s + srcStride + p);
+
+    for (; n >= 64; n -= 64, d += 64, s += 64)
+    {
+      const uint8x16_t v1 = vld1q_u8(s +  0);
+      const uint8x16_t v2 = vld1q_u8(s + 16);
+      const uint8x16_t v3 = vld1q_u8(s + 32);
+      const uint8x16_t v4 = vld1q_u8(s + 48);
+      vst1q_u8(d +  0, v1);
+      vst1q_u8(d + 16, v2);
+      vst1q_u8(d + 32, v3);
+      vst1q_u8(d + 48, v4);
+    }
+
+    for (; n >= 16; n -= 16, d += 16, s += 16)
+      vst1q_u8(d, vld1q_u8(s));
+
+    memcpy(d, s, n);
+  }
+}
+#endif
+
+static const struct
+{
+  unsigned int features;
+  RectCopyFn   fn;
+}
+fromFramebufferKernels[] =
+{
+#ifdef RECTS_NEON
+  { CPU_FEATURE_NEON, rectCopyNEON      },
+#endif
+  { 0               , rectCopyUnaligned },
+};
+
 struct FromFramebufferData
 {
   const FrameBuffer * frame;
@@ -229,16 +413,51 @@ void rectsFramebufferToBuffer(FrameDamageRect * rects, int count,
   uint8_t * dst, int dstStride, int height,
   const FrameBuffer * frame, int srcStride)
 {
+  // racing callers all store the same pointer
+  static RectCopyFn copy = NULL;
+  if (!copy)
+    copy = LG_CPU_DISPATCH(fromFramebufferKernels)->fn;
+
+  const uint64_t profile = fbprofile_begin();
   struct FromFramebufferData data = { .frame = frame, .stride = srcStride };
   rectsBufferCopy(rects, count, dst, dstStride, height,
-    framebuffer_get_buffer(frame), srcStride, &data, fbRowStart, NULL);
+    framebuffer_get_buffer(frame), srcStride, &data, copy, fbRowStart, NULL);
+  fbprofile_end(FB_PROFILE_RECTS, profile);
 }
 
+static int rectXCompare(const void * a_, const void * b_)
+{
+  const FrameDamageRect * a = a_;
+  const FrameDamageRect * b = b_;
+
+  if (a->x < b->x) return -1;
+  if (a->x > b->x) return +1;
+  if (a->y < b->y) return -1;
+  if (a->y > b->y) return +1;
+  return 0;
+}
+
+inline static void rectMerge(FrameDamageRect * dst, const FrameDamageRect * src)
+{
+  const uint32_t x2 = max(dst->x + dst->width , src->x + src->width );
+  const uint32_t y2 = max(dst->y + dst->height, src->y + src->height);
+
+  dst->x      = min(dst->x, src->x);
+  dst->y      = min(dst->y, src->y);
+  dst->width  = x2 - dst->x;
+  dst->height = y2 - dst->y;
+}
+
+/* the rects are sorted by x so each sweep only needs to look at those that
+ * start before the current one ends. Merging never moves a rect's left edge
+ * as the other rect starts at or after it, so the order is kept */
 int rectsMergeOverlapping(FrameDamageRect * rects, int count)
 {
   if (count == 0)
     return 0;
 
+  qsort(rects, count, sizeof(*rects), rectXCompare);
+
   bool removed[count];
   bool changed;
 
@@ -252,21 +471,13 @@ int rectsMergeOverlapping(FrameDamageRect * rects, int count)
       if (removed[i])
         continue;
 
-      for (int j = i + 1; j < count; ++j)
+      for (int j = i + 1; j < count &&
+          rects[j].x <= rects[i].x + rects[i].width; ++j)
       {
         if (removed[j] || !rectIntersects(rects + i, rects + j))
           continue;
 
-        const uint32_t x2 = max(rects[i].x + rects[i].width,
-            rects[j].x + rects[j].width);
-        const uint32_t y2 = max(rects[i].y + rects[i].height,
-            rects[j].y + rects[j].height);
-
-        rects[i].x      = min(rects[i].x, rects[j].x);
-        rects[i].y      = min(rects[i].y, rects[j].y);
-        rects[i].width  = x2 - rects[i].x;
-        rects[i].height = y2 - rects[i].y;
-
+        rectMerge(rects + i, rects + j);
         removed[j] = true;
         changed    = true;
       }
@@ -279,6 +490,11 @@ int rectsMergeOverlapping(FrameDamageRect * rects, int count)
 
 int rectsRejectContained(FrameDamageRect * rects, int count)
 {
+  if (count == 0)
+    return 0;
+
+  qsort(rects, count, sizeof(*rects), rectXCompare);
+
   bool removed[count];
   memset(removed, 0, sizeof(removed));
 
@@ -287,14 +503,479 @@ int rectsRejectContained(FrameDamageRect * rects, int count)
     if (removed[i])
       continue;
 
-    for (int j = 0; j < count; ++j)
+    for (int j = i + 1; j < count &&
+        rects[j].x <= rects[i].x + rects[i].width; ++j)
     {
-      if (j == i || removed[j])
+      if (removed[j])
         continue;
 
-      removed[j] = rectContains(rects + i, rects + j);
+      if (rectContains(rects + i, rects + j))
+        removed[j] = true;
+      else if (rectContains(rects + j, rects + i))
+      {
+        removed[i] = true;
+        break;
+      }
     }
   }
 
   return removeRects(rects, count, removed);
 }
+
+inline static uint64_t rectArea(const FrameDamageRect * r)
+{
+  return (uint64_t)r->width * r->height;
+}
+
+// the area a merge would copy that neither rect needed
+inline static int64_t rectMergeWaste(const FrameDamageRect * a,
+    const FrameDamageRect * b)
+{
+  const int64_t x1 = min(a->x, b->x);
+  const int64_t y1 = min(a->y, b->y);
+  const int64_t x2 = max(a->x + a->width , b->x + b->width );
+  const int64_t y2 = max(a->y + a->height, b->y + b->height);
+
+  const int64_t ix = (int64_t)min(a->x + a->width , b->x + b->width ) -
+    max(a->x, b->x);
+  const int64_t iy = (int64_t)min(a->y + a->height, b->y + b->height) -
+    max(a->y, b->y);
+  const int64_t overlap = ix > 0 && iy > 0 ? ix * iy : 0;
+
+  return (x2 - x1) * (y2 - y1) - rectArea(a) - rectArea(b) + overlap;
+}
+
+/* find the pair of x sorted rects that wastes the least area below limit. A
+ * pair separated by a horizontal gap wastes at least gap * height of the
+ * first, so the sweep stops once that reaches the best found */
+static bool rectsCheapestPair(const FrameDamageRect * rects, int count,
+    int64_t limit, int * bestI, int * bestJ)
+{
+  int64_t best  = limit;
+  bool    found = false;
+
+  for (int i = 0; i < count; ++i)
+  {
+    const int64_t right = rects[i].x + rects[i].width;
+    for (int j = i + 1; j < count; ++j)
+    {
+      const int64_t gap = (int64_t)rects[j].x - right;
+      if (gap > 0 && gap * rects[i].height >= best)
+        break;
+
+      const int64_t waste = rectMergeWaste(rects + i, rects + j);
+      if (waste < best)
+      {
+        best   = waste;
+        *bestI = i;
+        *bestJ = j;
+        found  = true;
+      }
+    }
+  }
+
+  return found;
+}
+
+inline static int rectsMergePair(FrameDamageRect * rects, int count, int i,
+    int j)
+{
+  rectMerge(rects + i, rects + j);
+  memmove(rects + j, rects + j + 1, (count - j - 1) * sizeof(*rects));
+  return count - 1;
+}
+
+int rectsOptimize(FrameDamageRect * rects, int count, int maxRects,
+    unsigned int width, unsigned int height, unsigned int fullPercent)
+{
+  if (count <= 0)
+    return 0;
+
+  count = rectsMergeOverlapping(rects, count);
+
+  int i, j;
+  while (count > 1 &&
+      rectsCheapestPair(rects, count, RECTS_MERGE_COST, &i, &j))
+    count = rectsMergePair(rects, count, i, j);
+
+  while (count > maxRects &&
+      rectsCheapestPair(rects, count, INT64_MAX, &i, &j))
+    count = rectsMergePair(rects, count, i, j);
+
+  uint64_t area = 0;
+  for (i = 0; i < count; ++i)
+    area += rectArea(rects + i);
+
+  if (area * 100 >= (uint64_t)width * height * fullPercent)
+    return 0;
+
+  return count;
+}
+
+bool rectsAddFrameDamage(struct FrameDamage * damage,
+    const FrameDamageRect * rects, int count, unsigned int width,
+    unsigned int height)
+{
+  if (damage->count < 0 || count == 0 || count >= KVMFR_MAX_DAMAGE_RECTS)
+    return false;
+
+  if (damage->count + count > KVMFR_MAX_DAMAGE_RECTS)
+  {
+    damage->count = rectsOptimize(damage->rects, damage->count,
+        KVMFR_MAX_DAMAGE_RECTS - count, width, height, 100);
+    if (damage->count == 0)
+      return false;
+  }
+
+  memcpy(damage->rects + damage->count, rects, count * sizeof(*rects));
+  damage->count += count;
+  return true;
+}
+
+bool rectsBeginFrameDamage(struct FrameDamage * damage,
+    const FrameDamageRect * rects, int count, int maxRects, unsigned int width,
+    unsigned int height)
+{
+  if (!rectsAddFrameDamage(damage, rects, count, width, height))
+    return false;
+
+  // past 75% coverage a single copy of the whole frame is cheaper
+  damage->count = rectsOptimize(damage->rects, damage->count, maxRects,
+      width, height, 75);
+  return damage->count > 0;
+}
+
+void rectsEndFrameDamage(struct FrameDamage * slots, int slotCount, int index,
+    const FrameDamageRect * rects, int count, unsigned int width,
+    unsigned int height)
+{
+  for (int i = 0; i < slotCount; ++i)
+  {
+    struct FrameDamage * damage = slots + i;
+    if (i == index)
+      damage->count = 0;
+    else if (!rectsAddFrameDamage(damage, rects, count, width, height))
+      damage->count = -1;
+  }
+}
+
+typedef unsigned int (*DiffScanFn)(const uint8_t * row, unsigned int x,
+    unsigned int w, bool set);
+
+static unsigned int diffScanScalar(const uint8_t * row, unsigned int x,
+    unsigned int w, bool set)
+{
+  for (; x < w; ++x)
+    if ((row[x] != 0) == set)
+      return x;
+
+  return w;
+}
+
+#ifdef RECTS_X86
+static unsigned int diffScanSSE2(const uint8_t * row, unsigned int x,
+    unsigned int w, bool set)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const int     flip = set ? 0xFFFF : 0;
+
+  for (; x + 16 <= w; x += 16)
+  {
+    const __m128i v = _mm_loadu_si128((const __m128i *)(row + x));
+    const int mask  = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) ^ flip;
+    if (mask)
+      return x + __builtin_ctz(mask);
+  }
+
+  return diffScanScalar(row, x, w, set);
+}
+
+__attribute__((target("avx2")))
+static unsigned int diffScanAVX2(const uint8_t * row, unsigned int x,
+    unsigned int w, bool set)
+{
+  const __m256i  zero = _mm256_setzero_si256();
+  const uint32_t flip = set ? 0xFFFFFFFF : 0;
+
+  for (; x + 32 <= w; x += 32)
+  {
+    const __m256i  v    = _mm256_loadu_si256((const __m256i *)(row + x));
+    const uint32_t mask =
+      (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) ^ flip;
+    if (mask)
+      return x + __builtin_ctz(mask);
+  }
+
+  return diffScanSSE2(row, x, w, set);
+}
+#endif
+
+static const struct
+{
+  unsigned int features;
+  DiffScanFn   fn;
+}
+diffScanKernels[] =
+{
+#ifdef RECTS_X86
+  { CPU_FEATURE_AVX2, diffScanAVX2   },
+  { CPU_FEATURE_SSE2, diffScanSSE2   },
+#endif
+  { 0               , diffScanScalar },
+};
+
+static unsigned int diffScanResolve(const uint8_t * row, unsigned int x,
+    unsigned int w, bool set);
+
+static DiffScanFn diffScan = diffScanResolve;
+
+// picks the kernel on first use, racing callers all store the same pointer
+static unsigned int diffScanResolve(const uint8_t * row, unsigned int x,
+    unsigned int w, bool set)
+{
+  diffScan = LG_CPU_DISPATCH(diffScanKernels)->fn;
+  return diffScan(row, x, w, set);
+}
+
+unsigned int rectsDiffScan(const uint8_t * row, unsigned int x, unsigned int w,
+  bool set)
+{
+  return diffScan(row, x, w, set);
+}
+
+// a damaged region in diff map cells, all bounds are inclusive
+struct DiffRect
+{
+  unsigned int x1, y1, x2, y2;
+};
+
+struct DiffOutput
+{
+  FrameDamageRect * rects;
+  int               count;
+  int               max;
+  int               shift;
+  unsigned int      width;
+  unsigned int      height;
+};
+
+static bool emitDiffRect(struct DiffOutput * out, const struct DiffRect * r)
+{
+  if (out->count == out->max)
+    return false;
+
+  const unsigned int x1 = r->x1 << out->shift;
+  const unsigned int y1 = r->y1 << out->shift;
+  const unsigned int x2 = min((r->x2 + 1) << out->shift, out->width );
+  const unsigned int y2 = min((r->y2 + 1) << out->shift, out->height);
+  out->rects[out->count++] = (FrameDamageRect) {
+    .x      = x1,
+    .y      = y1,
+    .width  = x2 - x1,
+    .height = y2 - y1,
+  };
+  return true;
+}
+
+/* Builds the bounding rect of each 8-connected region of the map in one pass.
+ * The runs of each row are merged with the rects still open from the row
+ * above, rects that are not continued are emitted. Both lists are sorted and
+ * disjoint so this is linear in the number of runs. */
+int rectsFromDiffMap(FrameDamageRect * rects, int maxRects,
+  const uint8_t * map, unsigned int mapWidth, unsigned int mapHeight,
+  int shift, unsigned int width, unsigned int height)
+{
+  const unsigned int w = mapWidth;
+  struct DiffOutput out =
+  {
+    .rects  = rects,
+    .max    = maxRects,
+    .shift  = shift,
+    .width  = width,
+    .height = height
+  };
+
+  // a row can not contain more than this many disjoint runs
+  struct DiffRect bufA[(w + 1) / 2], bufB[(w + 1) / 2];
+  struct DiffRect * active = bufA, * next = bufB;
+  unsigned int activeCount = 0;
+
+  for (unsigned int y = 0; y < mapHeight; ++y)
+  {
+    const uint8_t * row = map + y * w;
+    unsigned int nextCount = 0;
+    unsigned int a         = 0;
+    bool         taken     = false; // active[a] is already part of a next rect
+
+    for (unsigned int x = diffScan(row, 0, w, true); x < w;
+        x = diffScan(row, x, w, true))
+    {
+      const unsigned int x2 = diffScan(row, x, w, false) - 1;
+      struct DiffRect r = { .x1 = x, .y1 = y, .x2 = x2, .y2 = y };
+
+      // emit the rects that can no longer be reached from this row
+      for (; a < activeCount && active[a].x2 + 1 < x; ++a, taken = false)
+        if (!taken && !emitDiffRect(&out, active + a))
+          return 0;
+
+      // the rect above also touched the prior run, join onto it
+      const bool join = a < activeCount && taken;
+
+      for (; a < activeCount && active[a].x1 <= x2 + 1; ++a, taken = false)
+      {
+        r.x1 = min(r.x1, active[a].x1);
+        r.x2 = max(r.x2, active[a].x2);
+        r.y1 = min(r.y1, active[a].y1);
+
+        // it may also touch the next run
+        if (active[a].x2 > x2)
+        {
+          taken = true;
+          break;
+        }
+      }
+
+      if (join)
+      {
+        struct DiffRect * p = next + nextCount - 1;
+        p->x1 = min(p->x1, r.x1);
+        p->x2 = max(p->x2, r.x2);
+        p->y1 = min(p->y1, r.y1);
+      }
+      else
+        next[nextCount++] = r;
+
+      x = x2 + 1;
+    }
+
+    for (; a < activeCount; ++a, taken = false)
+      if (!taken && !emitDiffRect(&out, active + a))
+        return 0;
+
+    struct DiffRect * tmp = active;
+    active      = next;
+    next        = tmp;
+    activeCount = nextCount;
+  }
+
+  for (unsigned int a = 0; a < activeCount; ++a)
+    if (!emitDiffRect(&out, active + a))
+      return 0;
+
+  return rectsMergeOverlapping(rects, out.count);
+}
+
+void rectsDamageMapAdd(uint8_t * map, unsigned int tilesX, unsigned int tilesY,
+  const FrameDamageRect * rects, int count)
+{
+  const unsigned int stride = rectsDamageMapStride(tilesX);
+  for (int i = 0; i < count; ++i)
+  {
+    const FrameDamageRect * r = rects + i;
+    if (r->width == 0 || r->height == 0)
+      continue;
+
+    const unsigned int x1 = r->x >> KVMFR_DAMAGE_TILE_SHIFT;
+    const unsigned int y1 = r->y >> KVMFR_DAMAGE_TILE_SHIFT;
+    const unsigned int x2 = min((r->x + r->width  - 1) >> KVMFR_DAMAGE_TILE_SHIFT,
+        tilesX - 1);
+    const unsigned int y2 = min((r->y + r->height - 1) >> KVMFR_DAMAGE_TILE_SHIFT,
+        tilesY - 1);
+
+    for (unsigned int y = y1; y <= y2; ++y)
+    {
+      uint8_t * row = map + y * stride;
+      for (unsigned int x = x1; x <= x2; ++x)
+        row[x / 8] |= 1 << (x & 7);
+    }
+  }
+}
+
+// decoding works on a copy of the rects so larger counts can be merged down
+#define RECTS_MAP_DECODE_MAX 256
+
+int rectsFromDamageMap(FrameDamageRect * rects, int maxRects,
+  const uint8_t * map, unsigned int tilesX, unsigned int tilesY,
+  unsigned int width, unsigned int height)
+{
+  const unsigned int stride = rectsDamageMapStride(tilesX);
+
+  // expand to a cell per tile for the diff map decoder, skipping clean bytes
+  uint8_t cells[tilesX * tilesY];
+  bool    any = false;
+  for (unsigned int y = 0; y < tilesY; ++y)
+  {
+    const uint8_t * row = map + y * stride;
+    uint8_t       * out = cells + y * tilesX;
+    for (unsigned int x = 0; x < tilesX; x += 8)
+    {
+      const uint8_t bits = row[x / 8];
+      const unsigned int n = min(tilesX - x, 8U);
+      if (!bits)
+      {
+        memset(out + x, 0, n);
+        continue;
+      }
+
+      any = true;
+      for (unsigned int b = 0; b < n; ++b)
+        out[x + b] = (bits >> b) & 1;
+    }
+  }
+
+  // nothing changed, but no rects means full damage so damage one tile
+  if (!any)
+  {
+    rects[0] = (FrameDamageRect)
+    {
+      .x      = 0,
+      .y      = 0,
+      .width  = min(1U << KVMFR_DAMAGE_TILE_SHIFT, width ),
+      .height = min(1U << KVMFR_DAMAGE_TILE_SHIFT, height)
+    };
+    return 1;
+  }
+
+  FrameDamageRect tmp[RECTS_MAP_DECODE_MAX];
+  int count = rectsFromDiffMap(tmp, RECTS_MAP_DECODE_MAX, cells, tilesX,
+      tilesY, KVMFR_DAMAGE_TILE_SHIFT, width, height);
+  if (count == 0)
+    return 0;
+
+  count = rectsOptimize(tmp, count, maxRects, width, height, 100);
+  memcpy(rects, tmp, count * sizeof(*rects));
+  return count;
+}
+
+int rectsToNV12(FrameDamageRect * rects, int count, unsigned int height)
+{
+  // work backwards so the expanded pairs never overwrite an unread rect
+  for (int i = count - 1; i >= 0; --i)
+  {
+    const FrameDamageRect r = rects[i];
+
+    // a texel holds four luma or two chroma pairs, align to whole texels
+    const unsigned int x1 = r.x & ~3U;
+    const unsigned int x2 = (r.x + r.width  + 3) & ~3U;
+    const unsigned int y1 = r.y & ~1U;
+    const unsigned int y2 = (r.y + r.height + 1) & ~1U;
+
+    rects[i * 2] = (FrameDamageRect)
+    {
+      .x      = x1 / 4,
+      .y      = y1,
+      .width  = (x2 - x1) / 4,
+      .height = y2 - y1
+    };
+
+    rects[i * 2 + 1] = (FrameDamageRect)
+    {
+      .x      = x1 / 4,
+      .y      = height + y1 / 2,
+      .width  = (x2 - x1) / 4,
+      .height = (y2 - y1) / 2
+    };
+  }
+
+  return count * 2;
+}
@@ -26,13 +26,22 @@
 #include <stdlib.h>
 #include <string.h>
 
+// the reader and the writer each update their own position on its own line
+#define RB_CACHE_LINE 64
+
 struct RingBuffer
 {
   uint32_t          length;
+  uint32_t          mask;
   uint32_t          valueSize;
+  bool              unbounded;
+
+  char              pad0[RB_CACHE_LINE];
   _Atomic(uint32_t) readPos;
+  char              pad1[RB_CACHE_LINE - sizeof(uint32_t)];
   _Atomic(uint32_t) writePos;
-  bool              unbounded;
+  char              pad2[RB_CACHE_LINE - sizeof(uint32_t)];
+
   char              values[0];
 };
 
@@ -40,15 +49,22 @@ RingBuffer ringbuffer_newInternal(int length, size_t valueSize,
     bool unbounded)
 {
   DEBUG_ASSERT(valueSize > 0 && valueSize < UINT32_MAX);
+  DEBUG_ASSERT(length > 0 && length <= (1 << 30));
+
+  // a power of two so the positions wrap at the end of the buffer by masking
+  uint32_t pow2 = 1;
+  while (pow2 < (uint32_t)length)
+    pow2 <<= 1;
 
-  struct RingBuffer * rb = calloc(1, sizeof(*rb) + valueSize * length);
+  struct RingBuffer * rb = calloc(1, sizeof(*rb) + valueSize * pow2);
   if (!rb)
   {
     DEBUG_ERROR("out of memory");
     return NULL;
   }
 
-  rb->length    = length;
+  rb->length    = pow2;
+  rb->mask      = pow2 - 1;
   rb->valueSize = valueSize;
   atomic_store(&rb->readPos , 0);
   atomic_store(&rb->writePos, 0);
@@ -96,7 +112,7 @@ int ringbuffer_getLength(const RingBuffer rb)
 
 int ringbuffer_getStart(const RingBuffer rb)
 {
-  return atomic_load(&rb->readPos) % rb->length;
+  return atomic_load(&rb->readPos) & rb->mask;
 }
 
 int ringbuffer_getCount(const RingBuffer rb)
@@ -157,7 +173,7 @@ int ringbuffer_append(const RingBuffer rb, const void * values, int count)
       // the reader
       uint32_t writeLen = 0;
       if (writeOffset < rb->length) {
-        uint32_t writeIndex = newWritePos % rb->length;
+        uint32_t writeIndex = newWritePos & rb->mask;
         uint32_t writeAvailable = rb->length - writeOffset;
         uint32_t writeAvailableBack =
           min(rb->length - writeIndex, writeAvailable);
@@ -227,7 +243,7 @@ int ringbuffer_consume(const RingBuffer rb, void * values, int count)
     }
     else
     {
-      uint32_t readIndex = newReadPos % rb->length;
+      uint32_t readIndex = newReadPos & rb->mask;
       uint32_t readAvailable = min(writeOffset, rb->length);
       uint32_t readLen = min(count, readAvailable);
 
@@ -266,6 +282,54 @@ int ringbuffer_consume(const RingBuffer rb, void * values, int count)
   return newReadPos - readPos;
 }
 
+int ringbuffer_reserveWrite(const RingBuffer rb, void ** values, int count)
+{
+  DEBUG_ASSERT(!rb->unbounded);
+
+  const uint32_t readPos  =
+    atomic_load_explicit(&rb->readPos , memory_order_acquire);
+  const uint32_t writePos =
+    atomic_load_explicit(&rb->writePos, memory_order_relaxed);
+
+  const uint32_t writeIndex = writePos & rb->mask;
+  const uint32_t available  = min(rb->length - (writePos - readPos),
+      rb->length - writeIndex);
+
+  *values = rb->values + writeIndex * rb->valueSize;
+  return count > 0 ? min((uint32_t)count, available) : 0;
+}
+
+void ringbuffer_commitWrite(const RingBuffer rb, int count)
+{
+  const uint32_t writePos =
+    atomic_load_explicit(&rb->writePos, memory_order_relaxed);
+  atomic_store_explicit(&rb->writePos, writePos + count, memory_order_release);
+}
+
+int ringbuffer_reserveRead(const RingBuffer rb, const void ** values,
+    int count)
+{
+  DEBUG_ASSERT(!rb->unbounded);
+
+  const uint32_t readPos  =
+    atomic_load_explicit(&rb->readPos , memory_order_relaxed);
+  const uint32_t writePos =
+    atomic_load_explicit(&rb->writePos, memory_order_acquire);
+
+  const uint32_t readIndex = readPos & rb->mask;
+  const uint32_t available = min(writePos - readPos, rb->length - readIndex);
+
+  *values = rb->values + readIndex * rb->valueSize;
+  return count > 0 ? min((uint32_t)count, available) : 0;
+}
+
+void ringbuffer_commitRead(const RingBuffer rb, int count)
+{
+  const uint32_t readPos =
+    atomic_load_explicit(&rb->readPos, memory_order_relaxed);
+  atomic_store_explicit(&rb->readPos, readPos + count, memory_order_release);
+}
+
 void ringbuffer_forEach(const RingBuffer rb, RingBufferIterator fn,
     void * udata, bool reverse)
 {
@@ -286,7 +350,7 @@ void ringbuffer_forEach(const RingBuffer rb, RingBufferIterator fn,
     readPos = readPos + readAvailable - 1;
     for (int i = 0; i < readAvailable; ++i, --readPos)
     {
-      uint32_t readIndex = readPos % rb->length;
+      uint32_t readIndex = readPos & rb->mask;
       void * value = rb->values + readIndex * rb->valueSize;
       if (!fn(i, value, udata))
         break;
@@ -296,7 +360,7 @@ void ringbuffer_forEach(const RingBuffer rb, RingBufferIterator fn,
   {
     for (int i = 0; i < readAvailable; ++i, ++readPos)
     {
-      uint32_t readIndex = readPos % rb->length;
+      uint32_t readIndex = readPos & rb->mask;
       void * value = rb->values + readIndex * rb->valueSize;
       if (!fn(i, value, udata))
         break;
@@ -0,0 +1,180 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/stats.h"
+#include "common/debug.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#define SUB_BITS    5
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define BUCKETS     ((63 - SUB_BITS + 1) * SUB_BUCKETS)
+
+struct StatsHistogram
+{
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t sum;
+  _Atomic(int64_t)     min;
+  _Atomic(int64_t)     max;
+  atomic_uint          buckets[BUCKETS];
+};
+
+/* values below SUB_BUCKETS have a bucket each, past that each power of two is
+ * split into SUB_BUCKETS linear steps */
+static inline int bucketIndex(uint64_t value)
+{
+  if (value < SUB_BUCKETS)
+    return value;
+
+  const int exp = 63 - __builtin_clzll(value);
+  const int sub = (value >> (exp - SUB_BITS)) - SUB_BUCKETS;
+  return (exp - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+static inline uint64_t bucketLower(int index)
+{
+  if (index < SUB_BUCKETS)
+    return index;
+
+  const int group = index / SUB_BUCKETS;
+  return (uint64_t)(index % SUB_BUCKETS + SUB_BUCKETS) << (group - 1);
+}
+
+StatsHistogram stats_histogramNew(void)
+{
+  struct StatsHistogram * h = malloc(sizeof(*h));
+  if (!h)
+  {
+    DEBUG_ERROR("out of memory");
+    return NULL;
+  }
+
+  stats_histogramReset(h);
+  return h;
+}
+
+void stats_histogramFree(StatsHistogram * h)
+{
+  free(*h);
+  *h = NULL;
+}
+
+void stats_histogramRecord(StatsHistogram h, int64_t value)
+{
+  if (value < 0)
+    value = 0;
+
+  atomic_fetch_add_explicit(&h->buckets[bucketIndex(value)], 1,
+      memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+
+  int64_t cur = atomic_load_explicit(&h->min, memory_order_relaxed);
+  while (value < cur && !atomic_compare_exchange_weak_explicit(&h->min, &cur,
+        value, memory_order_relaxed, memory_order_relaxed)) {}
+
+  cur = atomic_load_explicit(&h->max, memory_order_relaxed);
+  while (value > cur && !atomic_compare_exchange_weak_explicit(&h->max, &cur,
+        value, memory_order_relaxed, memory_order_relaxed)) {}
+
+  // last so a reader never sees more samples counted than are in the buckets
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_release);
+}
+
+void stats_histogramReset(StatsHistogram h)
+{
+  atomic_store(&h->count, 0);
+  atomic_store(&h->sum  , 0);
+  atomic_store(&h->min  , INT64_MAX);
+  atomic_store(&h->max  , 0);
+  for (int i = 0; i < BUCKETS; ++i)
+    atomic_store_explicit(&h->buckets[i], 0, memory_order_relaxed);
+}
+
+uint64_t stats_histogramCount(StatsHistogram h)
+{
+  return atomic_load_explicit(&h->count, memory_order_acquire);
+}
+
+int64_t stats_histogramPercentile(StatsHistogram h, double percentile)
+{
+  const uint64_t count = stats_histogramCount(h);
+  if (!count)
+    return 0;
+
+  uint64_t target = (uint64_t)(percentile / 100.0 * count + 0.5);
+  if (target < 1)
+    target = 1;
+  else if (target > count)
+    target = count;
+
+  const int64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+  uint64_t seen = 0;
+  for (int i = 0; i < BUCKETS; ++i)
+  {
+    seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    if (seen < target)
+      continue;
+
+    // the highest value the bucket holds, but never past what was recorded
+    const int64_t upper = bucketLower(i + 1) - 1;
+    return upper < max ? upper : max;
+  }
+
+  return max;
+}
+
+void stats_histogramSummary(StatsHistogram h, StatsSummary * summary)
+{
+  summary->count = stats_histogramCount(h);
+  if (!summary->count)
+  {
+    *summary = (StatsSummary){ 0 };
+    return;
+  }
+
+  summary->min  = atomic_load_explicit(&h->min, memory_order_relaxed);
+  summary->max  = atomic_load_explicit(&h->max, memory_order_relaxed);
+  summary->mean = (double)atomic_load_explicit(&h->sum, memory_order_relaxed) /
+    summary->count;
+  summary->p50  = stats_histogramPercentile(h, 50.0);
+  summary->p90  = stats_histogramPercentile(h, 90.0);
+  summary->p99  = stats_histogramPercentile(h, 99.0);
+}
+
+void stats_ewmaInit(StatsEWMA * ewma, double alpha)
+{
+  ewma->alpha = alpha;
+  ewma->value = 0.0;
+  ewma->valid = false;
+}
+
+double stats_ewmaPush(StatsEWMA * ewma, double value)
+{
+  if (!ewma->valid)
+  {
+    ewma->value = value;
+    ewma->valid = true;
+  }
+  else
+    ewma->value += ewma->alpha * (value - ewma->value);
+
+  return ewma->value;
+}
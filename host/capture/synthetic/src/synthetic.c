@@ -0,0 +1,746 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "interface/capture.h"
+#include "common/array.h"
+#include "common/util.h"
+#include "common/option.h"
+#include "common/debug.h"
+#include "common/time.h"
+#include "common/rects.h"
+#include "common/KVMFR.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// the random rects pattern changes between these sizes of rect
+#define SYNTH_RECT_MIN 16
+#define SYNTH_RECT_MAX 256
+
+// the pointer shape posted, a square with a border
+#define SYNTH_POINTER_SIZE 32
+
+enum SynthPattern
+{
+  SYNTH_STATIC,
+  SYNTH_SCROLL,
+  SYNTH_VIDEO,
+  SYNTH_RECTS,
+
+  SYNTH_PATTERN_MAX
+};
+
+static const char * PatternStr[SYNTH_PATTERN_MAX] =
+{
+  "static",
+  "scroll",
+  "video",
+  "rects"
+};
+
+static const struct
+{
+  const char    * name;
+  CaptureFormat   format;
+  unsigned int    bpp;
+}
+Formats[] =
+{
+  { "bgra"   , CAPTURE_FMT_BGRA   , 4 },
+  { "rgba"   , CAPTURE_FMT_RGBA   , 4 },
+  { "rgba10" , CAPTURE_FMT_RGBA10 , 4 },
+  { "rgba16f", CAPTURE_FMT_RGBA16F, 8 }
+};
+
+struct synthetic
+{
+  bool                     initialized;
+  bool                     stop;
+
+  CaptureGetPointerBuffer  getPointerBufferFn;
+  CapturePostPointerBuffer postPointerBufferFn;
+
+  unsigned int             baseWidth, baseHeight;
+  CaptureFormat            format;
+  unsigned int             bpp;
+  enum SynthPattern        pattern;
+  unsigned int             rectCount;
+  unsigned int             scrollSpeed;
+  bool                     pointer;
+  uint64_t                 interval;
+  uint64_t                 reportInterval;
+
+  atomic_uint              requestedScale;
+  unsigned int             scaleLevel;
+
+  // the generated desktop
+  unsigned int             width, height, pitch;
+  unsigned int             formatVer;
+  uint8_t                * data;
+  bool                     sent;
+  uint32_t                 seed;
+  unsigned int             scrolled;
+  uint16_t                 half[256];
+
+  // the damage of the frame, none for the full frame
+  int                      damageRectsCount;
+  FrameDamageRect          damageRects[KVMFR_MAX_DAMAGE_RECTS];
+
+  // damage each frame slot is missing since it was last written
+  struct FrameDamage       frameDamage[LGMP_Q_FRAME_LEN_MAX];
+
+  // when the next frame is due, and the last frame was "presented"
+  uint64_t                 next;
+  uint64_t                 presentTime;
+
+  bool                     shapeSent;
+  int                      px, py, dx, dy;
+
+  // the throughput since the last report
+  uint64_t                 reportStart;
+  unsigned int             frames;
+  unsigned int             missed;
+  uint64_t                 bytes;
+  uint64_t                 writeTime;
+  uint64_t                 writeMax;
+};
+
+static struct synthetic * this = NULL;
+
+// forwards
+
+static bool synthetic_deinit(void);
+
+// implementation
+
+static const char * synthetic_getName(void)
+{
+  return "Synthetic";
+}
+
+static int findFormat(const char * name)
+{
+  for (int i = 0; i < ARRAY_LENGTH(Formats); ++i)
+    if (!strcasecmp(name, Formats[i].name))
+      return i;
+  return -1;
+}
+
+static int findPattern(const char * name)
+{
+  for (int i = 0; i < SYNTH_PATTERN_MAX; ++i)
+    if (!strcasecmp(name, PatternStr[i]))
+      return i;
+  return -1;
+}
+
+static bool validateFormat(struct Option * opt, const char ** error)
+{
+  if (findFormat(opt->value.x_string) >= 0)
+    return true;
+
+  *error = "The format must be one of bgra, rgba, rgba10 or rgba16f";
+  return false;
+}
+
+static bool validatePattern(struct Option * opt, const char ** error)
+{
+  if (findPattern(opt->value.x_string) >= 0)
+    return true;
+
+  *error = "The pattern must be one of static, scroll, video or rects";
+  return false;
+}
+
+static bool validateSize(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_int >= 64 && opt->value.x_int <= 16384)
+    return true;
+
+  *error = "The size must be between 64 and 16384";
+  return false;
+}
+
+static bool validateRate(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_int >= 1 && opt->value.x_int <= 1000)
+    return true;
+
+  *error = "The frame rate must be between 1 and 1000";
+  return false;
+}
+
+static bool validateRects(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_int >= 1 && opt->value.x_int <= KVMFR_MAX_DAMAGE_RECTS)
+    return true;
+
+  *error = "The rect count must be between 1 and 64";
+  return false;
+}
+
+static void synthetic_initOptions(void)
+{
+  struct Option options[] =
+  {
+    {
+      .module         = "synthetic",
+      .name           = "width",
+      .description    = "The width of the generated frames",
+      .type           = OPTION_TYPE_INT,
+      .validator      = validateSize,
+      .value.x_int    = 1920
+    },
+    {
+      .module         = "synthetic",
+      .name           = "height",
+      .description    = "The height of the generated frames",
+      .type           = OPTION_TYPE_INT,
+      .validator      = validateSize,
+      .value.x_int    = 1080
+    },
+    {
+      .module         = "synthetic",
+      .name           = "format",
+      .description    = "The frame format (bgra, rgba, rgba10, rgba16f)",
+      .type           = OPTION_TYPE_STRING,
+      .validator      = validateFormat,
+      .value.x_string = "bgra"
+    },
+    {
+      .module         = "synthetic",
+      .name           = "fps",
+      .description    = "The rate the frames are generated at",
+      .type           = OPTION_TYPE_INT,
+      .validator      = validateRate,
+      .value.x_int    = 60
+    },
+    {
+      .module         = "synthetic",
+      .name           = "pattern",
+      .description    = "What changes each frame (static, scroll, video, rects)",
+      .type           = OPTION_TYPE_STRING,
+      .validator      = validatePattern,
+      .value.x_string = "rects"
+    },
+    {
+      .module         = "synthetic",
+      .name           = "rects",
+      .description    = "The number of rects the rects pattern changes a frame",
+      .type           = OPTION_TYPE_INT,
+      .validator      = validateRects,
+      .value.x_int    = 8
+    },
+    {
+      .module         = "synthetic",
+      .name           = "scrollSpeed",
+      .description    = "The rows the scroll pattern moves a frame",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 8
+    },
+    {
+      .module         = "synthetic",
+      .name           = "pointer",
+      .description    = "Move a fake pointer around the frame",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {
+      .module         = "synthetic",
+      .name           = "reportInterval",
+      .description    = "Seconds between the throughput reports (0 = never)",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 5
+    },
+    {0}
+  };
+
+  option_register(options);
+}
+
+static bool synthetic_create(CaptureGetPointerBuffer getPointerBufferFn,
+    CapturePostPointerBuffer postPointerBufferFn)
+{
+  DEBUG_ASSERT(!this);
+  this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("Out of memory");
+    return false;
+  }
+
+  const int format = findFormat(option_get_string("synthetic", "format"));
+  this->baseWidth      = option_get_int   ("synthetic", "width"      );
+  this->baseHeight     = option_get_int   ("synthetic", "height"     );
+  this->format         = Formats[format].format;
+  this->bpp            = Formats[format].bpp;
+  this->pattern        = findPattern(option_get_string("synthetic", "pattern"));
+  this->rectCount      = option_get_int   ("synthetic", "rects"      );
+  this->scrollSpeed    = max(1, option_get_int("synthetic", "scrollSpeed"));
+  this->pointer        = option_get_bool  ("synthetic", "pointer"    );
+  this->interval       = 1000000 / option_get_int("synthetic", "fps");
+  this->reportInterval =
+    (uint64_t)max(0, option_get_int("synthetic", "reportInterval")) * 1000000;
+
+  this->getPointerBufferFn  = getPointerBufferFn;
+  this->postPointerBufferFn = postPointerBufferFn;
+
+  // the frame channels are 8 bit values scaled to [0, 1]
+  for (unsigned int c = 1; c < 256; ++c)
+  {
+    float f = c / 255.0f;
+    int   e = 15;
+    while (f < 1.0f)
+    {
+      f *= 2.0f;
+      --e;
+    }
+    this->half[c] = e << 10 | (uint16_t)((f - 1.0f) * 1024.0f);
+  }
+
+  return true;
+}
+
+static uint32_t nextRandom(void)
+{
+  // xorshift32, the patterns only have to look random
+  uint32_t x = this->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return this->seed = x;
+}
+
+// rgb is 0xRRGGBB
+static uint64_t makePixel(uint32_t rgb)
+{
+  const uint32_t r = (rgb >> 16) & 0xff;
+  const uint32_t g = (rgb >>  8) & 0xff;
+  const uint32_t b = (rgb      ) & 0xff;
+
+  switch(this->format)
+  {
+    case CAPTURE_FMT_RGBA:
+      return r | g << 8 | b << 16 | 0xffU << 24;
+
+    case CAPTURE_FMT_RGBA10:
+      return r << 2 | g << 12 | b << 22 | 0x3U << 30;
+
+    case CAPTURE_FMT_RGBA16F:
+      return (uint64_t)this->half[r]       |
+             (uint64_t)this->half[g] << 16 |
+             (uint64_t)this->half[b] << 32 |
+             (uint64_t)0x3c00        << 48;
+
+    default:
+      return b | g << 8 | r << 16 | 0xffU << 24;
+  }
+}
+
+static inline void setPixel(uint8_t * row, unsigned int x, uint64_t pixel)
+{
+  if (this->bpp == 4)
+    ((uint32_t *)row)[x] = (uint32_t)pixel;
+  else
+    ((uint64_t *)row)[x] = pixel;
+}
+
+static void fillRect(const FrameDamageRect * r, uint32_t rgb)
+{
+  const uint64_t pixel = makePixel(rgb);
+  uint8_t * row = this->data + r->y * this->pitch + r->x * this->bpp;
+  for (unsigned int y = 0; y < r->height; ++y, row += this->pitch)
+    for (unsigned int x = 0; x < r->width; ++x)
+      setPixel(row, x, pixel);
+}
+
+// video changes every pixel in a way that does not compress or diff well
+static void noiseRect(const FrameDamageRect * r)
+{
+  uint8_t * row = this->data + r->y * this->pitch + r->x * this->bpp;
+  for (unsigned int y = 0; y < r->height; ++y, row += this->pitch)
+    for (unsigned int x = 0; x < r->width; ++x)
+      setPixel(row, x, makePixel(nextRandom()));
+}
+
+static uint32_t rowColor(unsigned int y)
+{
+  // bands a few rows high, so each scroll visibly moves the frame
+  const unsigned int band = y / 24;
+  return ((band * 37) & 0xff) << 16 | ((band * 91) & 0xff) << 8 |
+    ((band * 53) & 0xff);
+}
+
+static void fillGradient(void)
+{
+  uint8_t * row = this->data;
+  for (unsigned int y = 0; y < this->height; ++y, row += this->pitch)
+    for (unsigned int x = 0; x < this->width; ++x)
+      setPixel(row, x, makePixel(
+            (x * 255 / this->width) << 16 | (y * 255 / this->height) << 8 |
+            0x80));
+}
+
+static bool synthetic_init(void)
+{
+  DEBUG_ASSERT(this);
+  DEBUG_ASSERT(!this->initialized);
+
+  // only used when asked for, it must never stand in for a real capture
+  if (strcasecmp(option_get_string("app", "capture"), "synthetic"))
+    return false;
+
+  this->scaleLevel = atomic_load(&this->requestedScale);
+  this->width      = max(64U, (this->baseWidth  >> this->scaleLevel) & ~3U);
+  this->height     = max(64U,  this->baseHeight >> this->scaleLevel);
+  this->pitch      = this->width * this->bpp;
+
+  this->data = malloc((size_t)this->height * this->pitch);
+  if (!this->data)
+  {
+    DEBUG_ERROR("Out of memory");
+    goto fail;
+  }
+
+  ++this->formatVer;
+  this->seed     = 0x12345678;
+  this->scrolled = 0;
+  this->sent     = false;
+  this->stop     = false;
+  fillGradient();
+
+  for (int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
+    this->frameDamage[i].count = -1;
+
+  this->shapeSent = false;
+  this->px = this->width  / 2;
+  this->py = this->height / 2;
+  this->dx = 7;
+  this->dy = 5;
+
+  this->next        = microtime();
+  this->reportStart = this->next;
+  this->frames      = 0;
+  this->missed      = 0;
+  this->bytes       = 0;
+  this->writeTime   = 0;
+  this->writeMax    = 0;
+
+  DEBUG_INFO("Frames           : %ux%u %s at %u fps", this->width,
+      this->height, option_get_string("synthetic", "format"),
+      (unsigned int)(1000000 / this->interval));
+  DEBUG_INFO("Pattern          : %s", PatternStr[this->pattern]);
+
+  this->initialized = true;
+  return true;
+
+fail:
+  synthetic_deinit();
+  return false;
+}
+
+static bool synthetic_start(void)
+{
+  this->stop = false;
+  return true;
+}
+
+static void synthetic_stop(void)
+{
+  this->stop = true;
+}
+
+static bool synthetic_deinit(void)
+{
+  DEBUG_ASSERT(this);
+
+  free(this->data);
+  this->data        = NULL;
+  this->initialized = false;
+  return true;
+}
+
+static void synthetic_free(void)
+{
+  free(this);
+  this = NULL;
+}
+
+static void synthetic_setScaleLevel(unsigned int level)
+{
+  atomic_store(&this->requestedScale, level);
+}
+
+static void postPointer(void)
+{
+  CapturePointer pointer =
+  {
+    .positionUpdate = true,
+    .visible        = true
+  };
+
+  const int w = this->width  - SYNTH_POINTER_SIZE;
+  const int h = this->height - SYNTH_POINTER_SIZE;
+  this->px += this->dx;
+  this->py += this->dy;
+  if (this->px < 0 || this->px > w)
+  {
+    this->dx = -this->dx;
+    this->px = clamp(this->px, 0, w);
+  }
+  if (this->py < 0 || this->py > h)
+  {
+    this->dy = -this->dy;
+    this->py = clamp(this->py, 0, h);
+  }
+
+  pointer.x = this->px;
+  pointer.y = this->py;
+
+  void   * data;
+  uint32_t size = SYNTH_POINTER_SIZE * SYNTH_POINTER_SIZE * 4;
+  if (!this->shapeSent && this->getPointerBufferFn(&data, &size) &&
+      size >= SYNTH_POINTER_SIZE * SYNTH_POINTER_SIZE * 4)
+  {
+    uint32_t * pixel = data;
+    for (int y = 0; y < SYNTH_POINTER_SIZE; ++y)
+      for (int x = 0; x < SYNTH_POINTER_SIZE; ++x)
+      {
+        const bool border = x < 2 || y < 2 ||
+          x >= SYNTH_POINTER_SIZE - 2 || y >= SYNTH_POINTER_SIZE - 2;
+        *pixel++ = border ? 0xff000000 : 0xffffffff;
+      }
+
+    pointer.shapeUpdate = true;
+    pointer.format      = CAPTURE_FMT_COLOR;
+    pointer.width       = SYNTH_POINTER_SIZE;
+    pointer.height      = SYNTH_POINTER_SIZE;
+    pointer.pitch       = SYNTH_POINTER_SIZE * 4;
+    this->shapeSent     = true;
+  }
+
+  this->postPointerBufferFn(pointer);
+}
+
+static void report(uint64_t now)
+{
+  if (!this->reportInterval || now - this->reportStart < this->reportInterval)
+    return;
+
+  const double secs = (now - this->reportStart) / 1000000.0;
+  DEBUG_INFO("%.1f fps, %u missed, %.1f MiB/s written, write avg %.3f ms "
+      "max %.3f ms",
+      this->frames / secs,
+      this->missed,
+      this->bytes / secs / (1024.0 * 1024.0),
+      this->frames ? this->writeTime / 1000.0 / this->frames : 0.0,
+      this->writeMax / 1000.0);
+
+  this->reportStart = now;
+  this->frames      = 0;
+  this->missed      = 0;
+  this->bytes       = 0;
+  this->writeTime   = 0;
+  this->writeMax    = 0;
+}
+
+static void generate(void)
+{
+  this->damageRectsCount = 0;
+
+  // the first frame after a format change is sent whole
+  if (!this->sent)
+  {
+    this->sent = true;
+    return;
+  }
+
+  switch(this->pattern)
+  {
+    case SYNTH_STATIC:
+      break;
+
+    case SYNTH_SCROLL:
+    {
+      const unsigned int rows = min(this->scrollSpeed, this->height);
+      memmove(this->data, this->data + rows * this->pitch,
+          (size_t)(this->height - rows) * this->pitch);
+
+      for (unsigned int y = this->height - rows; y < this->height; ++y)
+      {
+        const FrameDamageRect r = { .x = 0, .y = y, .width = this->width,
+          .height = 1 };
+        fillRect(&r, rowColor(this->scrolled + y));
+      }
+      this->scrolled += rows;
+      break;
+    }
+
+    case SYNTH_VIDEO:
+    {
+      FrameDamageRect * r = this->damageRects;
+      r->width  = this->width  / 2;
+      r->height = this->height / 2;
+      r->x      = (this->width  - r->width ) / 2;
+      r->y      = (this->height - r->height) / 2;
+      noiseRect(r);
+      this->damageRectsCount = 1;
+      break;
+    }
+
+    case SYNTH_RECTS:
+      for (unsigned int i = 0; i < this->rectCount; ++i)
+      {
+        FrameDamageRect * r = this->damageRects + i;
+        const unsigned int range = SYNTH_RECT_MAX - SYNTH_RECT_MIN;
+        r->width  = min(this->width , SYNTH_RECT_MIN + nextRandom() % range);
+        r->height = min(this->height, SYNTH_RECT_MIN + nextRandom() % range);
+        r->x      = nextRandom() % (this->width  - r->width  + 1);
+        r->y      = nextRandom() % (this->height - r->height + 1);
+        fillRect(r, nextRandom());
+      }
+      this->damageRectsCount = this->rectCount;
+      break;
+
+    default:
+      break;
+  }
+}
+
+static CaptureResult synthetic_capture(void)
+{
+  DEBUG_ASSERT(this);
+  DEBUG_ASSERT(this->initialized);
+
+  if (atomic_load(&this->requestedScale) != this->scaleLevel)
+    return CAPTURE_RESULT_REINIT;
+
+  /* pace to the configured rate, a deadline missed by more than a frame is
+   * counted and dropped rather than caught up on with a burst */
+  uint64_t now = microtime();
+  if (this->next > now)
+  {
+    lgSleepUntil(this->next);
+    now = this->next;
+  }
+  else if (now - this->next >= this->interval)
+  {
+    this->missed += (now - this->next) / this->interval;
+    this->next    = now;
+  }
+  this->next       += this->interval;
+  this->presentTime = now;
+
+  if (this->pointer)
+    postPointer();
+
+  report(now);
+
+  // a static desktop only sends its first frame
+  if (this->stop || (this->pattern == SYNTH_STATIC && this->sent))
+    return CAPTURE_RESULT_TIMEOUT;
+
+  generate();
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult synthetic_waitFrame(CaptureFrame * frame,
+    const size_t maxFrameSize)
+{
+  const unsigned int maxHeight = maxFrameSize / this->pitch;
+
+  frame->formatVer      = this->formatVer;
+  frame->presentTime    = this->presentTime;
+  frame->screenWidth    = this->width;
+  frame->screenHeight   = this->height;
+  frame->frameWidth     = this->width;
+  frame->frameHeight    = min(maxHeight, this->height);
+  frame->truncated      = maxHeight < this->height;
+  frame->pitch          = this->pitch;
+  frame->stride         = this->width;
+  frame->format         = this->format;
+  frame->rotation       = CAPTURE_ROT_0;
+  frame->damageMapValid = false;
+
+  frame->damageRectsCount = this->damageRectsCount;
+  memcpy(frame->damageRects, this->damageRects,
+      this->damageRectsCount * sizeof(*this->damageRects));
+
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult synthetic_getFrame(FrameBuffer * frame,
+    const unsigned int height, int frameIndex)
+{
+  DEBUG_ASSERT(this);
+  DEBUG_ASSERT(this->initialized);
+
+  const uint64_t start = nanotime();
+
+  // the rect copy is for 32bpp frames only
+  struct FrameDamage * damage = this->frameDamage + frameIndex;
+  const bool damageAll = this->bpp != 4 ||
+    !rectsBeginFrameDamage(damage, this->damageRects, this->damageRectsCount,
+        KVMFR_MAX_DAMAGE_RECTS, this->width, height);
+
+  if (damageAll)
+  {
+    framebuffer_write(frame, this->data, (size_t)height * this->pitch);
+    this->bytes += (size_t)height * this->pitch;
+  }
+  else
+  {
+    rectsBufferToFramebuffer(damage->rects, damage->count, frame, this->pitch,
+        height, this->data, this->pitch);
+    for (int i = 0; i < damage->count; ++i)
+      this->bytes += (size_t)damage->rects[i].width *
+        damage->rects[i].height * this->bpp;
+  }
+
+  rectsEndFrameDamage(this->frameDamage, LGMP_Q_FRAME_LEN_MAX, frameIndex,
+      this->damageRects, this->damageRectsCount, this->width, height);
+
+  const uint64_t elapsed = (nanotime() - start) / 1000;
+  this->writeTime += elapsed;
+  this->writeMax   = max(this->writeMax, elapsed);
+  ++this->frames;
+
+  return CAPTURE_RESULT_OK;
+}
+
+struct CaptureInterface Capture_synthetic =
+{
+  .shortName       = "synthetic",
+  .asyncCapture    = false,
+  .initOptions     = synthetic_initOptions,
+  .getName         = synthetic_getName,
+  .create          = synthetic_create,
+  .init            = synthetic_init,
+  .start           = synthetic_start,
+  .stop            = synthetic_stop,
+  .deinit          = synthetic_deinit,
+  .free            = synthetic_free,
+  .capture         = synthetic_capture,
+  .waitFrame       = synthetic_waitFrame,
+  .getFrame        = synthetic_getFrame,
+  .setScaleLevel   = synthetic_setScaleLevel
+};
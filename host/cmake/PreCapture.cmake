@@ -9,8 +9,16 @@ file(APPEND ${CAPTURE_C} "#include <stddef.h>\n\n")
 
 set(CAPTURE "_")
 set(CAPTURE_LINK "_")
+# the backends shared by the platforms live outside of them
+set(CAPTURE_COMMON "${CMAKE_CURRENT_LIST_DIR}/../capture")
+
+# add_capture(name [source dir]), the directory defaults to name
 function(add_capture name)
   set(CAPTURE      "${CAPTURE};${name}" PARENT_SCOPE)
   set(CAPTURE_LINK "${CAPTURE_LINK};capture_${name}" PARENT_SCOPE)
-  add_subdirectory(${name})
+  if (ARGC GREATER 1)
+    add_subdirectory(${ARGV1} "${CMAKE_CURRENT_BINARY_DIR}/${name}")
+  else()
+    add_subdirectory(${name})
+  endif()
 endfunction()
@@ -44,10 +44,12 @@ CaptureResult;
 typedef enum CaptureFormat
 {
   // frame formats
-  CAPTURE_FMT_BGRA   ,
-  CAPTURE_FMT_RGBA   ,
-  CAPTURE_FMT_RGBA10 ,
-  CAPTURE_FMT_RGBA16F,
+  CAPTURE_FMT_BGRA     ,
+  CAPTURE_FMT_RGBA     ,
+  CAPTURE_FMT_RGBA10   ,
+  CAPTURE_FMT_RGBA16F  ,
+  CAPTURE_FMT_NV12     ,
+  CAPTURE_FMT_RGBA10_PQ,
 
   // pointer formats
   CAPTURE_FMT_COLOR ,
@@ -81,6 +83,15 @@ typedef struct CaptureFrame
   CaptureRotation rotation;
   uint32_t        damageRectsCount;
   FrameDamageRect damageRects[KVMFR_MAX_DAMAGE_RECTS];
+
+  // when the guest presented the frame in microtime(), zero if not known
+  uint64_t        presentTime;
+
+  // optional tile damage, the rects must still cover it, see KVMFRFrame
+  bool            damageMapValid;
+  uint16_t        damageMapWidth;
+  uint16_t        damageMapHeight;
+  uint8_t         damageMap[KVMFR_DAMAGE_MAP_SIZE];
 }
 CaptureFrame;
 
@@ -98,6 +109,8 @@ typedef struct CapturePointer
 }
 CapturePointer;
 
+/* size is passed in as the bytes the shape needs, zero if not known, and
+ * returns what the buffer can hold which may still be less */
 typedef bool (*CaptureGetPointerBuffer )(void ** data, uint32_t * size);
 typedef void (*CapturePostPointerBuffer)(CapturePointer pointer);
 
@@ -122,5 +135,10 @@ typedef struct CaptureInterface
   CaptureResult (*capture   )(void);
   CaptureResult (*waitFrame )(CaptureFrame * frame, const size_t maxFrameSize);
   CaptureResult (*getFrame  )(FrameBuffer  * frame, const unsigned int height, int frameIndex);
+
+  /* optional, asks for the output to be reduced by 2^level in each dimension
+   * on top of any configured downsampling. Called from the frame thread, the
+   * backend applies it by returning CAPTURE_RESULT_REINIT from capture */
+  void          (*setScaleLevel)(unsigned int level);
 }
 CaptureInterface;
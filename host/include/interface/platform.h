@@ -21,6 +21,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "common/KVMFR.h"
 
 // exit code for user opted to exit looking-glass-host
@@ -49,6 +50,15 @@ bool os_blockScreensaver(void);
 bool os_hasSetCursorPos(void);
 void os_setCursorPos(int x, int y);
 
+// optional loopback capture of the audio being played, returns false if not
+// supported. The callback is invoked from the capture thread with interleaved
+// S16 samples and the microtime the first frame was captured at.
+typedef void (*OSAudioFn)(const int16_t * samples, unsigned int frames,
+    unsigned int channels, unsigned int sampleRate, uint64_t captureTime);
+
+bool os_audioStart(OSAudioFn fn);
+void os_audioStop(void);
+
 // return the KVMFR OS type
 KVMFROS os_getKVMFRType(void);
 
@@ -0,0 +1,970 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "interface/capture.h"
+#include "interface/platform.h"
+#include "common/util.h"
+#include "common/array.h"
+#include "common/option.h"
+#include "common/debug.h"
+#include "common/event.h"
+#include "common/time.h"
+#include "common/KVMFR.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES3/gl3.h>
+#include <GLES2/gl2ext.h>
+
+/* a framebuffer that has not been flipped away from can still be drawn to,
+ * such as by the console, so it is captured again this often (ms) */
+#define IDLE_INTERVAL 100
+
+// how long to wait for the GPU to draw the frame (ns)
+#define GPU_TIMEOUT 100000000
+
+/* one frame may be taken ahead of the copy, it is taken into one image while
+ * the last is still being copied out of the other */
+#define KMS_IMAGES 2
+
+struct KMSImage
+{
+  // a mapping of a linear framebuffer, or the pixel buffer the GPU drew into
+  int        fd;
+  void     * map;
+  size_t     mapSize;
+  GLuint     pbo;
+
+  uint8_t  * data;
+  unsigned int pitch;
+};
+
+struct kms
+{
+  bool         initialized;
+  bool         stop;
+  int          fd;
+  uint32_t     crtcId;
+  unsigned int crtcIndex;
+  bool         vblank;
+  LGEvent    * frameEvent;
+  unsigned int formatVer;
+
+  unsigned int  width, height;
+  uint32_t      drmFormat;
+  unsigned int  pitch;
+  CaptureFormat format;
+  uint32_t      lastFb;
+  uint64_t      lastTime;
+
+  /* linear framebuffers in a format the client takes are read directly,
+   * anything else is drawn by the GPU into a linear RGBA buffer */
+  bool           gpu;
+  EGLDisplay     display;
+  EGLContext     context;
+  GLuint         program;
+  GLuint         texture;
+  GLuint         target;
+  GLuint         fbo;
+  PFNEGLCREATEIMAGEKHRPROC             eglCreateImageKHR;
+  PFNEGLDESTROYIMAGEKHRPROC            eglDestroyImageKHR;
+  PFNGLEGLIMAGETARGETTEXTURE2DOESPROC  glEGLImageTargetTexture2DOES;
+
+  struct KMSImage images[KMS_IMAGES];
+  int             captureIdx;
+  atomic_int      readIdx;
+  atomic_bool     ready;
+
+  CaptureGetPointerBuffer  getPointerBufferFn;
+  CapturePostPointerBuffer postPointerBufferFn;
+};
+
+static struct kms * this = NULL;
+
+// forwards
+
+static bool kms_deinit(void);
+static void freeGPU(void);
+
+// implementation
+
+static const char * kms_getName(void)
+{
+  return "KMS";
+}
+
+static void kms_initOptions(void)
+{
+  struct Option options[] =
+  {
+    {
+      .module         = "kms",
+      .name           = "device",
+      .description    = "The DRM device to capture the scanout of",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "/dev/dri/card0"
+    },
+    {
+      .module         = "kms",
+      .name           = "crtc",
+      .description    = "The index of the CRTC to capture, -1 for the first active one",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = -1
+    },
+    {0}
+  };
+
+  option_register(options);
+}
+
+static bool kms_create(CaptureGetPointerBuffer getPointerBufferFn, CapturePostPointerBuffer postPointerBufferFn)
+{
+  DEBUG_ASSERT(!this);
+  this             = calloc(1, sizeof(*this));
+  this->fd         = -1;
+  this->frameEvent = lgCreateEvent(true, 20);
+
+  this->getPointerBufferFn  = getPointerBufferFn;
+  this->postPointerBufferFn = postPointerBufferFn;
+
+  if (!this->frameEvent)
+  {
+    DEBUG_ERROR("Failed to create the frame event");
+    free(this);
+    this = NULL;
+    return false;
+  }
+
+  for (int i = 0; i < KMS_IMAGES; ++i)
+    this->images[i].fd = -1;
+
+  return true;
+}
+
+static bool findCrtc(int want)
+{
+  drmModeRes * res = drmModeGetResources(this->fd);
+  if (!res)
+  {
+    DEBUG_ERROR("drmModeGetResources failed: %s", strerror(errno));
+    return false;
+  }
+
+  bool found = false;
+  for (int i = 0; i < res->count_crtcs && !found; ++i)
+  {
+    if (want >= 0 && i != want)
+      continue;
+
+    drmModeCrtc * crtc = drmModeGetCrtc(this->fd, res->crtcs[i]);
+    if (!crtc)
+      continue;
+
+    if (crtc->mode_valid && crtc->buffer_id)
+    {
+      this->crtcId    = crtc->crtc_id;
+      this->crtcIndex = i;
+      found           = true;
+    }
+    drmModeFreeCrtc(crtc);
+  }
+
+  drmModeFreeResources(res);
+  return found;
+}
+
+static drmModeFB2 * getFB(void)
+{
+  drmModeCrtc * crtc = drmModeGetCrtc(this->fd, this->crtcId);
+  if (!crtc)
+    return NULL;
+
+  const uint32_t fbId = crtc->buffer_id;
+  drmModeFreeCrtc(crtc);
+  if (!fbId)
+    return NULL;
+
+  // needs CAP_SYS_ADMIN for the handles, without them the fb is of no use
+  drmModeFB2 * fb = drmModeGetFB2(this->fd, fbId);
+  if (fb && !fb->handles[0])
+  {
+    DEBUG_ERROR("No framebuffer handles, capture needs CAP_SYS_ADMIN");
+    drmModeFreeFB2(fb);
+    return NULL;
+  }
+  return fb;
+}
+
+// the handles are new references which must be closed, planes may share one
+static void freeFB(drmModeFB2 * fb)
+{
+  for (int i = 0; i < 4; ++i)
+  {
+    if (!fb->handles[i])
+      continue;
+
+    bool dup = false;
+    for (int j = 0; j < i; ++j)
+      dup = dup || fb->handles[j] == fb->handles[i];
+
+    if (!dup)
+    {
+      struct drm_gem_close close = { .handle = fb->handles[i] };
+      drmIoctl(this->fd, DRM_IOCTL_GEM_CLOSE, &close);
+    }
+  }
+  drmModeFreeFB2(fb);
+}
+
+static bool directFormat(uint32_t drmFormat, CaptureFormat * format)
+{
+  switch (drmFormat)
+  {
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_ARGB8888:
+      *format = CAPTURE_FMT_BGRA;
+      return true;
+
+    case DRM_FORMAT_XBGR8888:
+    case DRM_FORMAT_ABGR8888:
+      *format = CAPTURE_FMT_RGBA;
+      return true;
+
+    case DRM_FORMAT_XBGR2101010:
+    case DRM_FORMAT_ABGR2101010:
+      *format = CAPTURE_FMT_RGBA10;
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+static const char vertexShader[] =
+  "#version 300 es\n"
+  "out vec2 uv;\n"
+  "void main()\n"
+  "{\n"
+  "  vec2 p   = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));\n"
+  "  uv          = p;\n"
+  "  gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);\n"
+  "}\n";
+
+/* the external sampler detiles and converts whatever the scanout is in, the
+ * rows are read back bottom up which undoes the flip of the texture */
+static const char fragmentShader[] =
+  "#version 300 es\n"
+  "#extension GL_OES_EGL_image_external_essl3 : require\n"
+  "precision mediump float;\n"
+  "uniform samplerExternalOES tex;\n"
+  "in  vec2 uv;\n"
+  "out vec4 color;\n"
+  "void main()\n"
+  "{\n"
+  "  color = texture(tex, uv);\n"
+  "}\n";
+
+static GLuint compileShader(GLenum type, const char * src)
+{
+  GLuint shader = glCreateShader(type);
+  glShaderSource(shader, 1, &src, NULL);
+  glCompileShader(shader);
+
+  GLint ok;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok)
+  {
+    char log[512];
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    DEBUG_ERROR("Failed to compile the shader: %s", log);
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+/* the display is the EGL device for the DRM device when that can be found, so
+ * the import happens on the GPU that scans out */
+static EGLDisplay getDisplay(const char * path)
+{
+  const char * exts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (!exts)
+    return EGL_NO_DISPLAY;
+
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+      eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (!getPlatformDisplay)
+    return EGL_NO_DISPLAY;
+
+  if (strstr(exts, "EGL_EXT_device_enumeration") &&
+      strstr(exts, "EGL_EXT_platform_device"))
+  {
+    PFNEGLQUERYDEVICESEXTPROC queryDevices = (PFNEGLQUERYDEVICESEXTPROC)
+      eglGetProcAddress("eglQueryDevicesEXT");
+    PFNEGLQUERYDEVICESTRINGEXTPROC queryDeviceString =
+      (PFNEGLQUERYDEVICESTRINGEXTPROC)
+        eglGetProcAddress("eglQueryDeviceStringEXT");
+
+    EGLDeviceEXT devices[16];
+    EGLint count = 0;
+    if (queryDevices && queryDeviceString &&
+        queryDevices(ARRAY_LENGTH(devices), devices, &count))
+      for (int i = 0; i < count; ++i)
+      {
+        const char * file = queryDeviceString(devices[i],
+            EGL_DRM_DEVICE_FILE_EXT);
+        if (file && strcmp(file, path) == 0)
+          return getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, devices[i], NULL);
+      }
+  }
+
+  if (strstr(exts, "EGL_MESA_platform_surfaceless"))
+  {
+    DEBUG_WARN("No EGL device for %s, using the default GPU", path);
+    return getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+        EGL_DEFAULT_DISPLAY, NULL);
+  }
+
+  return EGL_NO_DISPLAY;
+}
+
+static bool initGPU(const char * path)
+{
+  this->display = getDisplay(path);
+  if (this->display == EGL_NO_DISPLAY || !eglInitialize(this->display, NULL,
+        NULL))
+  {
+    DEBUG_ERROR("Failed to get an EGL display");
+    return false;
+  }
+
+  const char * exts = eglQueryString(this->display, EGL_EXTENSIONS);
+  if (!strstr(exts, "EGL_EXT_image_dma_buf_import") ||
+      !strstr(exts, "EGL_KHR_surfaceless_context") ||
+      !strstr(exts, "EGL_KHR_no_config_context"))
+  {
+    DEBUG_ERROR("EGL is missing DMA-BUF import or surfaceless contexts");
+    return false;
+  }
+
+  this->eglCreateImageKHR = (PFNEGLCREATEIMAGEKHRPROC)
+    eglGetProcAddress("eglCreateImageKHR");
+  this->eglDestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC)
+    eglGetProcAddress("eglDestroyImageKHR");
+  this->glEGLImageTargetTexture2DOES = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)
+    eglGetProcAddress("glEGLImageTargetTexture2DOES");
+  if (!this->eglCreateImageKHR || !this->eglDestroyImageKHR ||
+      !this->glEGLImageTargetTexture2DOES)
+  {
+    DEBUG_ERROR("Failed to get the EGL image functions");
+    return false;
+  }
+
+  eglBindAPI(EGL_OPENGL_ES_API);
+  const EGLint ctxAttr[] =
+  {
+    EGL_CONTEXT_MAJOR_VERSION, 3,
+    EGL_NONE
+  };
+
+  this->context = eglCreateContext(this->display, EGL_NO_CONFIG_KHR,
+      EGL_NO_CONTEXT, ctxAttr);
+  if (this->context == EGL_NO_CONTEXT)
+  {
+    DEBUG_ERROR("Failed to create the EGL context");
+    return false;
+  }
+
+  eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE, this->context);
+
+  GLuint vs = compileShader(GL_VERTEX_SHADER  , vertexShader  );
+  GLuint fs = compileShader(GL_FRAGMENT_SHADER, fragmentShader);
+  bool ok = vs && fs;
+  if (ok)
+  {
+    this->program = glCreateProgram();
+    glAttachShader(this->program, vs);
+    glAttachShader(this->program, fs);
+    glLinkProgram(this->program);
+
+    GLint linked;
+    glGetProgramiv(this->program, GL_LINK_STATUS, &linked);
+    if (!linked)
+    {
+      DEBUG_ERROR("Failed to link the shader program");
+      ok = false;
+    }
+  }
+
+  if (vs)
+    glDeleteShader(vs);
+  if (fs)
+    glDeleteShader(fs);
+
+  if (ok)
+  {
+    glGenTextures(1, &this->texture);
+    glBindTexture(GL_TEXTURE_EXTERNAL_OES, this->texture);
+    glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &this->target);
+    glBindTexture(GL_TEXTURE_2D, this->target);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, this->width, this->height);
+
+    glGenFramebuffers(1, &this->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, this->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        GL_TEXTURE_2D, this->target, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+      DEBUG_ERROR("The framebuffer is incomplete");
+      ok = false;
+    }
+
+    const size_t size = (size_t)this->width * this->height * 4;
+    for (int i = 0; i < KMS_IMAGES && ok; ++i)
+    {
+      struct KMSImage * image = this->images + i;
+      glGenBuffers(1, &image->pbo);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, image->pbo);
+      glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+      image->pitch = this->width * 4;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+
+  /* capture and the init may be called from different threads, the context
+   * is only current while it is in use */
+  eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  return ok;
+}
+
+static bool kms_init(void)
+{
+  DEBUG_ASSERT(this);
+  DEBUG_ASSERT(!this->initialized);
+
+  lgResetEvent(this->frameEvent);
+  this->stop = false;
+
+  const char * path = option_get_string("kms", "device");
+  this->fd = open(path, O_RDWR | O_CLOEXEC);
+  if (this->fd < 0)
+  {
+    DEBUG_ERROR("Failed to open %s: %s", path, strerror(errno));
+    goto fail;
+  }
+
+  drmSetClientCap(this->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+  if (!findCrtc(option_get_int("kms", "crtc")))
+  {
+    DEBUG_ERROR("No active CRTC on %s", path);
+    goto fail;
+  }
+
+  drmModeFB2 * fb = getFB();
+  if (!fb)
+  {
+    DEBUG_ERROR("Failed to get the scanout framebuffer");
+    goto fail;
+  }
+
+  this->width     = fb->width;
+  this->height    = fb->height;
+  this->drmFormat = fb->pixel_format;
+  this->pitch     = fb->pitches[0];
+
+  const bool modifiers = fb->flags & DRM_MODE_FB_MODIFIERS;
+  const bool linear    = modifiers ? fb->modifier == DRM_FORMAT_MOD_LINEAR : true;
+  this->gpu = !linear || !directFormat(fb->pixel_format, &this->format);
+  freeFB(fb);
+
+  // without modifiers the layout is implicit, prefer the GPU that knows it
+  if (!modifiers && !this->gpu)
+  {
+    this->gpu = initGPU(path);
+    if (!this->gpu)
+    {
+      DEBUG_WARN("Reading the framebuffer as linear");
+      freeGPU();
+    }
+  }
+  else if (this->gpu && !initGPU(path))
+    goto fail;
+
+  if (this->gpu)
+    this->format = CAPTURE_FMT_RGBA;
+
+  drmVBlank vbl =
+  {
+    .request =
+    {
+      .type     = DRM_VBLANK_RELATIVE |
+        ((this->crtcIndex << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+          DRM_VBLANK_HIGH_CRTC_MASK),
+      .sequence = 0
+    }
+  };
+  this->vblank = drmWaitVBlank(this->fd, &vbl) == 0;
+
+  DEBUG_INFO("Device           : %s", path);
+  DEBUG_INFO("CRTC             : %u (%u)", this->crtcIndex, this->crtcId);
+  DEBUG_INFO("Frame Size       : %u x %u", this->width, this->height);
+  DEBUG_INFO("Frame Format     : %.4s", (const char *)&this->drmFormat);
+  DEBUG_INFO("Conversion       : %s", this->gpu ? "GPU" : "none");
+  DEBUG_INFO("VBlank Wait      : %s", this->vblank ? "yes" : "no");
+
+  ++this->formatVer;
+  this->lastFb     = 0;
+  this->captureIdx = 0;
+  atomic_store(&this->readIdx, -1);
+  atomic_store(&this->ready  , false);
+
+  this->initialized = true;
+  return true;
+
+fail:
+  kms_deinit();
+  return false;
+}
+
+static void releaseImage(struct KMSImage * image)
+{
+  if (image->map)
+  {
+    munmap(image->map, image->mapSize);
+    image->map = NULL;
+  }
+
+  if (image->fd >= 0)
+  {
+    close(image->fd);
+    image->fd = -1;
+  }
+
+  else if (image->pbo && image->data)
+  {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, image->pbo);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+
+  image->data = NULL;
+}
+
+static void kms_stop(void)
+{
+  this->stop = true;
+  lgSignalEvent(this->frameEvent);
+}
+
+static void freeGPU(void)
+{
+  if (this->context != EGL_NO_CONTEXT && this->context)
+  {
+    eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+        this->context);
+    for (int i = 0; i < KMS_IMAGES; ++i)
+    {
+      releaseImage(this->images + i);
+      if (this->images[i].pbo)
+        glDeleteBuffers(1, &this->images[i].pbo);
+      this->images[i].pbo = 0;
+    }
+
+    if (this->fbo)
+      glDeleteFramebuffers(1, &this->fbo);
+    if (this->target)
+      glDeleteTextures(1, &this->target);
+    if (this->texture)
+      glDeleteTextures(1, &this->texture);
+    if (this->program)
+      glDeleteProgram(this->program);
+
+    this->fbo     = 0;
+    this->target  = 0;
+    this->texture = 0;
+    this->program = 0;
+
+    eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+        EGL_NO_CONTEXT);
+    eglDestroyContext(this->display, this->context);
+    this->context = EGL_NO_CONTEXT;
+  }
+
+  if (this->display != EGL_NO_DISPLAY && this->display)
+  {
+    eglTerminate(this->display);
+    this->display = EGL_NO_DISPLAY;
+  }
+}
+
+static bool kms_deinit(void)
+{
+  DEBUG_ASSERT(this);
+
+  if (this->gpu)
+    freeGPU();
+  else
+    for (int i = 0; i < KMS_IMAGES; ++i)
+      releaseImage(this->images + i);
+
+  if (this->fd >= 0)
+  {
+    close(this->fd);
+    this->fd = -1;
+  }
+
+  this->initialized = false;
+  return true;
+}
+
+static void kms_free(void)
+{
+  lgFreeEvent(this->frameEvent);
+  free(this);
+  this = NULL;
+}
+
+// maps the framebuffer as it is, the frame thread copies straight out of it
+static bool takeDirect(struct KMSImage * image, drmModeFB2 * fb)
+{
+  if (drmPrimeHandleToFD(this->fd, fb->handles[0], DRM_CLOEXEC,
+        &image->fd) != 0)
+  {
+    DEBUG_ERROR("Failed to export the framebuffer: %s", strerror(errno));
+    return false;
+  }
+
+  image->mapSize = (size_t)fb->offsets[0] + (size_t)fb->pitches[0] * fb->height;
+  image->map     = mmap(NULL, image->mapSize, PROT_READ, MAP_SHARED,
+      image->fd, 0);
+  if (image->map == MAP_FAILED)
+  {
+    DEBUG_ERROR("Failed to map the framebuffer: %s", strerror(errno));
+    image->map = NULL;
+    return false;
+  }
+
+  image->data  = (uint8_t *)image->map + fb->offsets[0];
+  image->pitch = fb->pitches[0];
+  return true;
+}
+
+// imports the framebuffer and has the GPU draw it into the pixel buffer
+static bool takeGPU(struct KMSImage * image, drmModeFB2 * fb)
+{
+  static const EGLint planeAttr[4][5] =
+  {
+    {
+      EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+      EGL_DMA_BUF_PLANE0_PITCH_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+      EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT
+    },
+    {
+      EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+      EGL_DMA_BUF_PLANE1_PITCH_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+      EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT
+    },
+    {
+      EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+      EGL_DMA_BUF_PLANE2_PITCH_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+      EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT
+    },
+    {
+      EGL_DMA_BUF_PLANE3_FD_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT,
+      EGL_DMA_BUF_PLANE3_PITCH_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT,
+      EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT
+    }
+  };
+
+  int fds[4] = { -1, -1, -1, -1 };
+  EGLint attr[6 + 4 * 10 + 1];
+  int n = 0;
+  attr[n++] = EGL_WIDTH;
+  attr[n++] = fb->width;
+  attr[n++] = EGL_HEIGHT;
+  attr[n++] = fb->height;
+  attr[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+  attr[n++] = fb->pixel_format;
+
+  bool ok = true;
+  for (int i = 0; i < 4 && fb->handles[i]; ++i)
+  {
+    if (drmPrimeHandleToFD(this->fd, fb->handles[i], DRM_CLOEXEC,
+          fds + i) != 0)
+    {
+      DEBUG_ERROR("Failed to export the framebuffer: %s", strerror(errno));
+      ok = false;
+      break;
+    }
+
+    attr[n++] = planeAttr[i][0];
+    attr[n++] = fds[i];
+    attr[n++] = planeAttr[i][1];
+    attr[n++] = fb->offsets[i];
+    attr[n++] = planeAttr[i][2];
+    attr[n++] = fb->pitches[i];
+    if (fb->flags & DRM_MODE_FB_MODIFIERS)
+    {
+      attr[n++] = planeAttr[i][3];
+      attr[n++] = fb->modifier & 0xffffffff;
+      attr[n++] = planeAttr[i][4];
+      attr[n++] = fb->modifier >> 32;
+    }
+  }
+  attr[n] = EGL_NONE;
+
+  EGLImage img = EGL_NO_IMAGE;
+  if (ok)
+  {
+    img = this->eglCreateImageKHR(this->display, EGL_NO_CONTEXT,
+        EGL_LINUX_DMA_BUF_EXT, NULL, attr);
+    if (img == EGL_NO_IMAGE)
+    {
+      DEBUG_ERROR("Failed to import the framebuffer: 0x%x", eglGetError());
+      ok = false;
+    }
+  }
+
+  // the image holds its own references to the buffers
+  for (int i = 0; i < 4; ++i)
+    if (fds[i] >= 0)
+      close(fds[i]);
+
+  if (!ok)
+    return false;
+
+  glBindTexture(GL_TEXTURE_EXTERNAL_OES, this->texture);
+  this->glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, img);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, this->fbo);
+  glViewport(0, 0, this->width, this->height);
+  glUseProgram(this->program);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, image->pbo);
+  glReadPixels(0, 0, this->width, this->height, GL_RGBA, GL_UNSIGNED_BYTE,
+      NULL);
+
+  GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  const GLenum wait = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+      GPU_TIMEOUT);
+  glDeleteSync(fence);
+  this->eglDestroyImageKHR(this->display, img);
+
+  if (wait == GL_TIMEOUT_EXPIRED || wait == GL_WAIT_FAILED)
+  {
+    DEBUG_ERROR("Timed out waiting for the GPU");
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return false;
+  }
+
+  image->data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+      (size_t)this->width * this->height * 4, GL_MAP_READ_BIT);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  if (!image->data)
+  {
+    DEBUG_ERROR("Failed to map the pixel buffer");
+    return false;
+  }
+
+  return true;
+}
+
+static void waitVBlank(void)
+{
+  if (this->vblank)
+  {
+    drmVBlank vbl =
+    {
+      .request =
+      {
+        .type     = DRM_VBLANK_RELATIVE |
+          ((this->crtcIndex << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+            DRM_VBLANK_HIGH_CRTC_MASK),
+        .sequence = 1
+      }
+    };
+
+    if (drmWaitVBlank(this->fd, &vbl) == 0)
+      return;
+  }
+
+  // virtual devices may not have vblank events
+  usleep(16000);
+}
+
+static CaptureResult kms_capture(void)
+{
+  DEBUG_ASSERT(this);
+  DEBUG_ASSERT(this->initialized);
+
+  const int target = (this->captureIdx + 1) % KMS_IMAGES;
+  if (atomic_load(&this->ready) || atomic_load(&this->readIdx) == target)
+    return CAPTURE_RESULT_OK;
+
+  waitVBlank();
+  if (this->stop)
+    return CAPTURE_RESULT_TIMEOUT;
+
+  drmModeFB2 * fb = getFB();
+  if (!fb)
+    return CAPTURE_RESULT_REINIT;
+
+  if (fb->width != this->width || fb->height != this->height ||
+      fb->pixel_format != this->drmFormat)
+  {
+    DEBUG_INFO("The scanout framebuffer has changed");
+    freeFB(fb);
+    return CAPTURE_RESULT_REINIT;
+  }
+
+  // nothing has been flipped, the same buffer is only taken now and then
+  const uint64_t now = microtime();
+  if (fb->fb_id == this->lastFb &&
+      now - this->lastTime < IDLE_INTERVAL * 1000)
+  {
+    freeFB(fb);
+    return CAPTURE_RESULT_TIMEOUT;
+  }
+
+  struct KMSImage * image = this->images + target;
+  bool ok;
+  if (this->gpu)
+  {
+    eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+        this->context);
+    releaseImage(image);
+    ok = takeGPU(image, fb);
+    eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+        EGL_NO_CONTEXT);
+  }
+  else
+  {
+    // the pitch is part of the format the client was told about
+    if (fb->pitches[0] != this->pitch)
+    {
+      freeFB(fb);
+      return CAPTURE_RESULT_REINIT;
+    }
+
+    releaseImage(image);
+    ok = takeDirect(image, fb);
+  }
+
+  this->lastFb   = fb->fb_id;
+  this->lastTime = now;
+  freeFB(fb);
+
+  if (!ok)
+  {
+    releaseImage(image);
+    return CAPTURE_RESULT_ERROR;
+  }
+
+  this->captureIdx = target;
+  atomic_store(&this->ready, true);
+  lgSignalEvent(this->frameEvent);
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult kms_waitFrame(CaptureFrame * frame,
+    const size_t maxFrameSize)
+{
+  lgWaitEvent(this->frameEvent, TIMEOUT_INFINITE);
+  if (this->stop)
+    return CAPTURE_RESULT_REINIT;
+
+  const struct KMSImage * image = this->images + this->captureIdx;
+  const unsigned int maxHeight = maxFrameSize / image->pitch;
+
+  frame->formatVer    = this->formatVer;
+  frame->screenWidth  = this->width;
+  frame->screenHeight = this->height;
+  frame->frameWidth   = this->width;
+  frame->frameHeight  = min(maxHeight, this->height);
+  frame->truncated    = maxHeight < this->height;
+  frame->pitch        = image->pitch;
+  frame->stride       = image->pitch / 4;
+  frame->format       = this->format;
+  frame->rotation     = CAPTURE_ROT_0;
+
+  // there is no damage to be had from the scanout, every frame is in full
+  frame->damageRectsCount = 0;
+
+  // take the frame, capture may now take the next into the other image
+  atomic_store(&this->readIdx, this->captureIdx);
+  atomic_store(&this->ready  , false);
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult kms_getFrame(FrameBuffer * frame,
+    const unsigned int height, int frameIndex)
+{
+  DEBUG_ASSERT(this);
+  DEBUG_ASSERT(this->initialized);
+
+  const struct KMSImage * image = this->images + atomic_load(&this->readIdx);
+
+  struct dma_buf_sync sync = { .flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ };
+  if (image->fd >= 0 && ioctl(image->fd, DMA_BUF_IOCTL_SYNC, &sync) < 0)
+    DEBUG_WARN("DMA_BUF_IOCTL_SYNC failed: %s", strerror(errno));
+
+  framebuffer_write(frame, image->data, image->pitch * height);
+
+  if (image->fd >= 0)
+  {
+    sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+    ioctl(image->fd, DMA_BUF_IOCTL_SYNC, &sync);
+  }
+
+  atomic_store(&this->readIdx, -1);
+  return CAPTURE_RESULT_OK;
+}
+
+struct CaptureInterface Capture_KMS =
+{
+  .shortName       = "KMS",
+  .asyncCapture    = true,
+  .initOptions     = kms_initOptions,
+  .getName         = kms_getName,
+  .create          = kms_create,
+  .init            = kms_init,
+  .stop            = kms_stop,
+  .deinit          = kms_deinit,
+  .free            = kms_free,
+  .capture         = kms_capture,
+  .waitFrame       = kms_waitFrame,
+  .getFrame        = kms_getFrame
+};
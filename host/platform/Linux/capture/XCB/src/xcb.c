@@ -25,15 +25,38 @@
 #include "common/debug.h"
 #include "common/event.h"
 #include "common/thread.h"
+#include "common/rects.h"
+#include "common/KVMFR.h"
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <xcb/shm.h>
 #include <xcb/xfixes.h>
+#include <xcb/damage.h>
+#include <xcb/xinput.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 
+// how long capture waits for damage before reporting a timeout (ms)
+#define DAMAGE_TIMEOUT 100
+
+/* the screen images in the SHM segment, the next frame is fetched into one
+ * while the last is still being copied out of the other */
+#define XCB_IMAGES 2
+
+struct XCBImage
+{
+  uint8_t       * data;
+  size_t          offset; // into the SHM segment
+
+  // the rects of the frame fetched into it, none for the full frame
+  int             damageRectsCount;
+  FrameDamageRect damageRects[KVMFR_MAX_DAMAGE_RECTS];
+};
+
 struct xcb
 {
   bool                        initialized;
@@ -45,6 +68,28 @@ struct xcb
   void                      * data;
   LGEvent                   * frameEvent;
 
+  /* the SHM segment holds the screen images followed by a scratch area that
+   * damaged rects are fetched into before being copied over an image */
+  struct XCBImage             images[XCB_IMAGES];
+  uint8_t                   * scratch;
+  size_t                      scratchOffset;
+  size_t                      scratchSize;
+
+  // the image last fetched, and the image getFrame is reading or -1
+  int                         captureIdx;
+  atomic_int                  readIdx;
+  atomic_bool                 ready;
+
+  bool                        hasDamage;
+  xcb_damage_damage_t         damage;
+  xcb_xfixes_region_t         region;
+  const xcb_query_extension_reply_t * damageExt;
+
+  bool                        fullDamage;
+
+  // damage each frame slot is missing since it was last written
+  struct FrameDamage          frameDamage[LGMP_Q_FRAME_LEN_MAX];
+
   CaptureGetPointerBuffer     getPointerBufferFn;
   CapturePostPointerBuffer    postPointerBufferFn;
   LGThread                  * pointerThread;
@@ -53,10 +98,6 @@ struct xcb
   unsigned int height;
 
   int mouseX, mouseY, mouseHotX, mouseHotY;
-
-  bool                                 hasFrame;
-  xcb_shm_get_image_cookie_t           imgC;
-  xcb_xfixes_get_cursor_image_cookie_t curC;
 };
 
 static struct xcb * this = NULL;
@@ -135,7 +176,10 @@ static bool xcb_init(void)
 
   this->seg   = xcb_generate_id(this->xcb);
   const size_t maxFrameSize = this->width * this->height * 4;
-  this->shmID = shmget(IPC_PRIVATE, maxFrameSize, IPC_CREAT | 0777);
+  this->scratchOffset = maxFrameSize * XCB_IMAGES;
+  this->scratchSize   = maxFrameSize;
+  this->shmID = shmget(IPC_PRIVATE, this->scratchOffset + this->scratchSize,
+      IPC_CREAT | 0777);
   if (this->shmID == -1)
   {
     DEBUG_ERROR("shmget failed");
@@ -150,6 +194,16 @@ static bool xcb_init(void)
     goto fail;
   }
   DEBUG_INFO("Frame Data       : 0x%" PRIXPTR, (uintptr_t)this->data);
+  for (int i = 0; i < XCB_IMAGES; ++i)
+  {
+    this->images[i].offset = maxFrameSize * i;
+    this->images[i].data   = (uint8_t *)this->data + this->images[i].offset;
+    this->images[i].damageRectsCount = 0;
+  }
+  this->scratch    = (uint8_t *)this->data + this->scratchOffset;
+  this->captureIdx = 0;
+  atomic_store(&this->readIdx, -1);
+  atomic_store(&this->ready  , false);
 
   xcb_query_extension_cookie_t extension_cookie =
 		xcb_query_extension(this->xcb, strlen("XFIXES"), "XFIXES");
@@ -175,6 +229,34 @@ static bool xcb_init(void)
   }
   free(version_reply);
 
+  /* without XDamage every frame is a full capture, with it only the damaged
+   * rects are fetched */
+  this->damageExt = xcb_get_extension_data(this->xcb, &xcb_damage_id);
+  if (this->damageExt && this->damageExt->present)
+  {
+    xcb_damage_query_version_reply_t * damageVersion =
+      xcb_damage_query_version_reply(this->xcb,
+          xcb_damage_query_version(this->xcb, XCB_DAMAGE_MAJOR_VERSION,
+            XCB_DAMAGE_MINOR_VERSION), NULL);
+
+    if (damageVersion)
+    {
+      free(damageVersion);
+      this->damage = xcb_generate_id(this->xcb);
+      this->region = xcb_generate_id(this->xcb);
+      xcb_damage_create(this->xcb, this->damage, this->xcbScreen->root,
+          XCB_DAMAGE_REPORT_LEVEL_NON_EMPTY);
+      xcb_xfixes_create_region(this->xcb, this->region, 0, NULL);
+      xcb_flush(this->xcb);
+      this->hasDamage = true;
+    }
+  }
+  DEBUG_INFO("Damage Tracking  : %s", this->hasDamage ? "XDamage" : "none");
+
+  this->fullDamage = true;
+  for (int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
+    this->frameDamage[i].count = -1;
+
   this->initialized = true;
   return true;
 fail:
@@ -210,6 +292,13 @@ static bool xcb_deinit(void)
 {
   DEBUG_ASSERT(this);
 
+  if (this->hasDamage && this->xcb)
+  {
+    xcb_damage_destroy(this->xcb, this->damage);
+    xcb_xfixes_destroy_region(this->xcb, this->region);
+    this->hasDamage = false;
+  }
+
   if ((uintptr_t)this->data != -1)
   {
     shmdt(this->data);
@@ -239,28 +328,228 @@ static void xcb_free(void)
   this = NULL;
 }
 
+/* drains the damage notifies, which only say there is damage to take, waiting
+ * up to timeout ms for one. The pointer thread also reads from the connection
+ * so the socket is only polled in short steps between checks of the queue */
+static bool waitDamageNotify(int timeout)
+{
+  bool notified = false;
+  for(;;)
+  {
+    xcb_generic_event_t * event;
+    while ((event = xcb_poll_for_event(this->xcb)))
+    {
+      if ((event->response_type & 0x7f) ==
+          this->damageExt->first_event + XCB_DAMAGE_NOTIFY)
+        notified = true;
+      free(event);
+    }
+
+    if (notified || timeout <= 0 || this->stop)
+      return notified;
+
+    struct pollfd pfd =
+    {
+      .fd     = xcb_get_file_descriptor(this->xcb),
+      .events = POLLIN
+    };
+    poll(&pfd, 1, min(timeout, 5));
+    timeout -= 5;
+  }
+}
+
+/* takes the accumulated damage from the server, returns the rect count, 0 for
+ * none or -1 if the whole frame should be fetched */
+static int takeDamage(FrameDamageRect * rects)
+{
+  xcb_damage_subtract(this->xcb, this->damage, XCB_NONE, this->region);
+  xcb_xfixes_fetch_region_reply_t * reply = xcb_xfixes_fetch_region_reply(
+      this->xcb, xcb_xfixes_fetch_region(this->xcb, this->region), NULL);
+  if (!reply)
+    return -1;
+
+  const int count = xcb_xfixes_fetch_region_rectangles_length(reply);
+  if (count > KVMFR_MAX_DAMAGE_RECTS * 4)
+  {
+    free(reply);
+    return -1;
+  }
+
+  FrameDamageRect tmp[count > 0 ? count : 1];
+  const xcb_rectangle_t * src = xcb_xfixes_fetch_region_rectangles(reply);
+  int n = 0;
+  for (int i = 0; i < count; ++i)
+  {
+    const int x1 = max(src[i].x, 0);
+    const int y1 = max(src[i].y, 0);
+    const int x2 = min(src[i].x + (int)src[i].width , (int)this->width );
+    const int y2 = min(src[i].y + (int)src[i].height, (int)this->height);
+    if (x2 <= x1 || y2 <= y1)
+      continue;
+
+    tmp[n++] = (FrameDamageRect)
+    {
+      .x      = x1,
+      .y      = y1,
+      .width  = x2 - x1,
+      .height = y2 - y1
+    };
+  }
+  free(reply);
+
+  if (n == 0)
+    return 0;
+
+  // past 75% of the screen a single full fetch is cheaper
+  n = rectsOptimize(tmp, n, KVMFR_MAX_DAMAGE_RECTS, this->width, this->height,
+      75);
+  if (n == 0)
+    return -1;
+
+  memcpy(rects, tmp, n * sizeof(*rects));
+  return n;
+}
+
+/* fetches the rects into the scratch area and copies them over the screen
+ * image, the requests are all sent before waiting on the first reply */
+static bool fetchRects(struct XCBImage * image, const FrameDamageRect * rects,
+    int count)
+{
+  xcb_shm_get_image_cookie_t cookies[KVMFR_MAX_DAMAGE_RECTS];
+  size_t offsets[KVMFR_MAX_DAMAGE_RECTS];
+  size_t offset = 0;
+
+  for (int i = 0; i < count; ++i)
+  {
+    offsets[i] = offset;
+    offset    += (size_t)rects[i].width * rects[i].height * 4;
+    if (offset > this->scratchSize)
+      return false;
+  }
+
+  for (int i = 0; i < count; ++i)
+  {
+    const FrameDamageRect * r = rects + i;
+    cookies[i] = xcb_shm_get_image_unchecked(this->xcb, this->xcbScreen->root,
+        r->x, r->y, r->width, r->height, ~0, XCB_IMAGE_FORMAT_Z_PIXMAP,
+        this->seg, this->scratchOffset + offsets[i]);
+  }
+
+  bool ok = true;
+  const size_t pitch = this->width * 4;
+  for (int i = 0; i < count; ++i)
+  {
+    xcb_shm_get_image_reply_t * img =
+      xcb_shm_get_image_reply(this->xcb, cookies[i], NULL);
+    if (!img)
+    {
+      ok = false;
+      continue;
+    }
+    free(img);
+
+    const FrameDamageRect * r = rects + i;
+    const size_t    rowSize = r->width * 4;
+    const uint8_t * src     = this->scratch + offsets[i];
+    uint8_t       * dst     = image->data + r->y * pitch + r->x * 4;
+    for (unsigned int y = 0; y < r->height; ++y, src += rowSize, dst += pitch)
+      memcpy(dst, src, rowSize);
+  }
+
+  return ok;
+}
+
+/* brings an image up to date with the last fetched one by copying what that
+ * frame changed, the last image may be being read by getFrame at the time */
+static void syncImage(struct XCBImage * image, const struct XCBImage * last)
+{
+  if (last->damageRectsCount == 0)
+  {
+    memcpy(image->data, last->data, this->width * this->height * 4);
+    return;
+  }
+
+  const size_t pitch = this->width * 4;
+  for (int i = 0; i < last->damageRectsCount; ++i)
+  {
+    const FrameDamageRect * r = last->damageRects + i;
+    const size_t    rowSize = r->width * 4;
+    const size_t    offset  = r->y * pitch + r->x * 4;
+    const uint8_t * src     = last->data  + offset;
+    uint8_t       * dst     = image->data + offset;
+    for (unsigned int y = 0; y < r->height; ++y, src += pitch, dst += pitch)
+      memcpy(dst, src, rowSize);
+  }
+}
+
 static CaptureResult xcb_capture(void)
 {
   DEBUG_ASSERT(this);
   DEBUG_ASSERT(this->initialized);
 
-  if (!this->hasFrame)
+  /* one frame may be fetched ahead of the copy, it waits until the frame
+   * thread takes it and the other image is free */
+  const int target = (this->captureIdx + 1) % XCB_IMAGES;
+  if (atomic_load(&this->ready) || atomic_load(&this->readIdx) == target)
+    return CAPTURE_RESULT_OK;
+
+  struct XCBImage * image = this->images + target;
+  struct XCBImage * last  = this->images + this->captureIdx;
+
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+  int count = -1;
+  if (this->hasDamage)
   {
-    this->imgC = xcb_shm_get_image_unchecked(
-        this->xcb,
-        this->xcbScreen->root,
-        0, 0,
-        this->width,
-        this->height,
-        ~0,
-        XCB_IMAGE_FORMAT_Z_PIXMAP,
-        this->seg,
-        0);
+    if (!this->fullDamage && !waitDamageNotify(DAMAGE_TIMEOUT))
+      return CAPTURE_RESULT_TIMEOUT;
+
+    // the first frame is always fetched in full, the damage up to it dropped
+    count = takeDamage(rects);
+    if (this->fullDamage)
+      count = -1;
+    else if (count == 0)
+      return CAPTURE_RESULT_TIMEOUT;
+  }
 
-    this->hasFrame  = true;
-    lgSignalEvent(this->frameEvent);
+  if (count > 0)
+  {
+    syncImage(image, last);
+    if (!fetchRects(image, rects, count))
+      count = -1;
   }
 
+  if (count > 0)
+  {
+    image->damageRectsCount = count;
+    memcpy(image->damageRects, rects, count * sizeof(*rects));
+  }
+  else
+  {
+    xcb_shm_get_image_reply_t * img = xcb_shm_get_image_reply(this->xcb,
+        xcb_shm_get_image_unchecked(
+          this->xcb,
+          this->xcbScreen->root,
+          0, 0,
+          this->width,
+          this->height,
+          ~0,
+          XCB_IMAGE_FORMAT_Z_PIXMAP,
+          this->seg,
+          image->offset), NULL);
+
+    if (!img)
+    {
+      DEBUG_ERROR("Failed to get image reply");
+      return CAPTURE_RESULT_ERROR;
+    }
+    free(img);
+    image->damageRectsCount = 0;
+  }
+
+  this->fullDamage = false;
+  this->captureIdx = target;
+  atomic_store(&this->ready, true);
+  lgSignalEvent(this->frameEvent);
   return CAPTURE_RESULT_OK;
 }
 
@@ -281,6 +570,15 @@ static CaptureResult xcb_waitFrame(CaptureFrame * frame,
   frame->format       = CAPTURE_FMT_BGRA;
   frame->rotation     = CAPTURE_ROT_0;
 
+  // take the frame, capture may now fetch the next into the other image
+  const struct XCBImage * image = this->images + this->captureIdx;
+  atomic_store(&this->readIdx, this->captureIdx);
+  atomic_store(&this->ready  , false);
+
+  frame->damageRectsCount = image->damageRectsCount;
+  memcpy(frame->damageRects, image->damageRects,
+      image->damageRectsCount * sizeof(*image->damageRects));
+
   return CAPTURE_RESULT_OK;
 }
 
@@ -290,89 +588,217 @@ static CaptureResult xcb_getFrame(FrameBuffer * frame,
   DEBUG_ASSERT(this);
   DEBUG_ASSERT(this->initialized);
 
-  xcb_shm_get_image_reply_t * img;
-  img = xcb_shm_get_image_reply(this->xcb, this->imgC, NULL);
-  if (!img)
-  {
-    DEBUG_ERROR("Failed to get image reply");
-    return CAPTURE_RESULT_ERROR;
-  }
+  const struct XCBImage * image = this->images + atomic_load(&this->readIdx);
+  struct FrameDamage * damage = this->frameDamage + frameIndex;
+  const bool damageAll = !rectsBeginFrameDamage(damage, image->damageRects,
+      image->damageRectsCount, KVMFR_MAX_DAMAGE_RECTS, this->width, height);
+
+  const int pitch = this->width * 4;
+  if (damageAll)
+    framebuffer_write(frame, image->data, pitch * height);
+  else
+    rectsBufferToFramebuffer(damage->rects, damage->count, frame, pitch,
+        height, image->data, pitch);
 
-  framebuffer_write(frame, this->data, this->width * height * 4);
-  free(img);
+  rectsEndFrameDamage(this->frameDamage, LGMP_Q_FRAME_LEN_MAX, frameIndex,
+      image->damageRects, image->damageRectsCount, this->width, height);
 
-  this->hasFrame = false;
+  atomic_store(&this->readIdx, -1);
   return CAPTURE_RESULT_OK;
 }
 
-static int pointerThread(void * unused)
+/* sends the cursor image, which carries the position too. The shape is only
+ * copied when the serial says it changed */
+static void postCursorImage(xcb_connection_t * xcb, uint32_t * serial)
 {
-  while (!this->stop)
+  xcb_xfixes_get_cursor_image_reply_t * cursor =
+    xcb_xfixes_get_cursor_image_reply(xcb,
+        xcb_xfixes_get_cursor_image_unchecked(xcb), NULL);
+  if (!cursor)
   {
-    if (this->stop)
-      break;
-
-    CapturePointer pointer = { 0 };
+    DEBUG_WARN("Failed to get cursor reply");
+    return;
+  }
 
-    this->curC = xcb_xfixes_get_cursor_image_unchecked(this->xcb);
+  CapturePointer pointer = { 0 };
+  if (cursor->cursor_serial != *serial)
+  {
+    const uint32_t shapeSize = cursor->width * cursor->height * sizeof(uint32_t);
 
     void * data;
-    uint32_t size;
+    uint32_t size = shapeSize;
     if (!this->getPointerBufferFn(&data, &size))
     {
       DEBUG_WARN("failed to get a pointer buffer");
-      continue;
+      free(cursor);
+      return;
     }
 
-    xcb_xfixes_get_cursor_image_reply_t * curReply;
-    curReply = xcb_xfixes_get_cursor_image_reply(this->xcb, this->curC, NULL);
-    if (curReply == NULL)
+    if (shapeSize <= size)
     {
-      DEBUG_WARN("Failed to get cursor reply");
-      continue;
+      memcpy(data, xcb_xfixes_get_cursor_image_cursor_image(cursor), shapeSize);
+      pointer.shapeUpdate = true;
     }
+    else
+      DEBUG_WARN("Cursor shape too large: %ux%u", cursor->width, cursor->height);
+
+    *serial         = cursor->cursor_serial;
+    this->mouseHotX = cursor->xhot;
+    this->mouseHotY = cursor->yhot;
+  }
+
+  if (cursor->x != this->mouseX || cursor->y != this->mouseY)
+  {
+    pointer.positionUpdate = true;
+    this->mouseX = cursor->x;
+    this->mouseY = cursor->y;
+  }
 
-    if(curReply->xhot != this->mouseHotX || curReply->yhot != this->mouseHotY)
+  if (pointer.positionUpdate || pointer.shapeUpdate)
+  {
+    pointer.hx      = cursor->xhot;
+    pointer.hy      = cursor->yhot;
+    pointer.visible = true;
+    pointer.x       = cursor->x - cursor->xhot;
+    pointer.y       = cursor->y - cursor->yhot;
+    pointer.format  = CAPTURE_FMT_COLOR;
+    pointer.width   = cursor->width;
+    pointer.height  = cursor->height;
+    pointer.pitch   = cursor->width * 4;
+
+    this->postPointerBufferFn(pointer);
+  }
+
+  free(cursor);
+}
+
+static void postCursorPosition(xcb_connection_t * xcb)
+{
+  xcb_query_pointer_reply_t * reply = xcb_query_pointer_reply(xcb,
+      xcb_query_pointer(xcb, this->xcbScreen->root), NULL);
+  if (!reply)
+    return;
+
+  if (reply->root_x != this->mouseX || reply->root_y != this->mouseY)
+  {
+    this->mouseX = reply->root_x;
+    this->mouseY = reply->root_y;
+
+    CapturePointer pointer =
     {
-      pointer.shapeUpdate = true;
-      this->mouseHotX = curReply->xhot;
-      this->mouseHotY = curReply->yhot;
+      .positionUpdate = true,
+      .visible        = true,
+      .x              = this->mouseX - this->mouseHotX,
+      .y              = this->mouseY - this->mouseHotY
+    };
+    this->postPointerBufferFn(pointer);
+  }
+
+  free(reply);
+}
+
+/* follows the cursor from events on a connection of its own, so they are not
+ * taken by the capture which drains the damage events. XFixes reports shape
+ * changes and XInput2 raw motion says when to read the position. Without
+ * XInput2 the position is polled */
+static int pointerThread(void * unused)
+{
+  xcb_connection_t * xcb = xcb_connect(NULL, NULL);
+  if (!xcb || xcb_connection_has_error(xcb))
+  {
+    DEBUG_ERROR("Unable to open the X display for the cursor");
+    if (xcb)
+      xcb_disconnect(xcb);
+    return 0;
+  }
+
+  xcb_xfixes_query_version_reply_t * version = xcb_xfixes_query_version_reply(
+      xcb, xcb_xfixes_query_version(xcb, XCB_XFIXES_MAJOR_VERSION,
+        XCB_XFIXES_MINOR_VERSION), NULL);
+  free(version);
 
-      uint32_t * src = xcb_xfixes_get_cursor_image_cursor_image(curReply);
-      uint32_t * dst = (uint32_t *) (data);
-      memcpy(dst, src, curReply->width * curReply->height * sizeof(uint32_t));
+  const xcb_query_extension_reply_t * xfixesExt =
+    xcb_get_extension_data(xcb, &xcb_xfixes_id);
+  xcb_xfixes_select_cursor_input(xcb, this->xcbScreen->root,
+      XCB_XFIXES_CURSOR_NOTIFY_MASK_DISPLAY_CURSOR);
+
+  bool rawMotion = false;
+  const xcb_query_extension_reply_t * inputExt =
+    xcb_get_extension_data(xcb, &xcb_input_id);
+  if (inputExt && inputExt->present)
+  {
+    xcb_input_xi_query_version_reply_t * xi = xcb_input_xi_query_version_reply(
+        xcb, xcb_input_xi_query_version(xcb, 2, 0), NULL);
+    if (xi && xi->major_version >= 2)
+    {
+      struct
+      {
+        xcb_input_event_mask_t head;
+        uint32_t               mask;
+      }
+      mask =
+      {
+        .head =
+        {
+          .deviceid = XCB_INPUT_DEVICE_ALL_MASTER,
+          .mask_len = 1
+        },
+        .mask = XCB_INPUT_XI_EVENT_MASK_RAW_MOTION
+      };
+      xcb_input_xi_select_events(xcb, this->xcbScreen->root, 1, &mask.head);
+      rawMotion = true;
     }
-    else
-      pointer.shapeUpdate = false;
+    free(xi);
+  }
+  DEBUG_INFO("Cursor Position  : %s", rawMotion ? "XInput2" : "polled");
+
+  // the initial shape and position
+  uint32_t serial = 0;
+  postCursorImage(xcb, &serial);
+  xcb_flush(xcb);
 
-    if(curReply->x != this->mouseX || curReply->y != this->mouseY)
+  struct pollfd pfd =
+  {
+    .fd     = xcb_get_file_descriptor(xcb),
+    .events = POLLIN
+  };
+
+  while (!this->stop)
+  {
+    // wake now and then to see if we are stopping
+    poll(&pfd, 1, rawMotion ? 100 : 1);
+
+    bool shape  = false;
+    bool motion = !rawMotion;
+    xcb_generic_event_t * event;
+    while ((event = xcb_poll_for_event(xcb)))
     {
-      pointer.positionUpdate = true;
-      this->mouseX = curReply->x;
-      this->mouseY = curReply->y;
+      const uint8_t type = event->response_type & 0x7f;
+      if (type == xfixesExt->first_event + XCB_XFIXES_CURSOR_NOTIFY)
+        shape = true;
+      else if (rawMotion && type == XCB_GE_GENERIC &&
+          ((xcb_ge_generic_event_t *)event)->extension ==
+            inputExt->major_opcode &&
+          ((xcb_ge_generic_event_t *)event)->event_type ==
+            XCB_INPUT_RAW_MOTION)
+        motion = true;
+      free(event);
     }
-    else
-      pointer.positionUpdate = false;
 
-    if(pointer.positionUpdate || pointer.shapeUpdate)
+    if (xcb_connection_has_error(xcb))
     {
-      pointer.hx      = curReply->xhot;
-      pointer.hy      = curReply->yhot;
-      pointer.visible = true;
-      pointer.x       = curReply->x - curReply->xhot;
-      pointer.y       = curReply->y - curReply->yhot;
-      pointer.format  = CAPTURE_FMT_COLOR;
-      pointer.width   = curReply->width;
-      pointer.height  = curReply->height;
-      pointer.pitch   = curReply->width * 4;
-
-      this->postPointerBufferFn(pointer);
+      DEBUG_ERROR("The cursor connection to the X display failed");
+      break;
     }
 
-    free(curReply);
-    usleep(1000);
+    // many motion events are merged into one read of the position
+    if (shape)
+      postCursorImage(xcb, &serial);
+    else if (motion)
+      postCursorPosition(xcb);
   }
 
+  xcb_disconnect(xcb);
   return 0;
 }
 
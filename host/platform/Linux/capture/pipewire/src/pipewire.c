@@ -24,19 +24,67 @@
 #include "common/util.h"
 #include "common/debug.h"
 #include "common/stringutils.h"
+#include "common/option.h"
+#include "common/event.h"
+#include "common/locking.h"
+#include "common/time.h"
+#include "common/rects.h"
+#include "common/KVMFR.h"
 #include <string.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
 
 #include <pipewire/pipewire.h>
+#include <spa/buffer/meta.h>
 #include <spa/pod/builder.h>
 #include <spa/param/format.h>
 #include <spa/param/video/format-utils.h>
 
+#ifndef DRM_FORMAT_MOD_LINEAR
+#define DRM_FORMAT_MOD_LINEAR 0
+#endif
+
+// the most damage regions requested per buffer
+#define MAX_BUFFER_REGIONS 16
+
+#define RESTORE_TOKEN_FILE ".looking-glass-host-portal-token"
+
+// the meta holds the cursor, the bitmap header and the pixels after each other
+#define CURSOR_META_SIZE(w, h) (sizeof(struct spa_meta_cursor) + \
+    sizeof(struct spa_meta_bitmap) + (w) * (h) * 4)
+
+/* the format the stream last settled on, offered first when reconnecting so
+ * the negotiation is over in one round */
+struct CachedFormat
+{
+  bool                  valid;
+  enum spa_video_format format;
+  struct spa_rectangle  size;
+  bool                  isDMABuf;
+};
+
+struct StreamFormat
+{
+  int           width, height;
+  CaptureFormat format;
+  bool          isDMABuf;
+};
+
 struct pipewire
 {
+  /* the portal session outlives a reinit, a new one is only negotiated if
+   * reconnecting to its node fails */
   struct Portal         * portal;
   char                  * sessionHandle;
+  uint32_t                node;
+  bool                    sessionLost;
+  struct CachedFormat     cachedFormat;
+
   struct pw_thread_loop * threadLoop;
   struct pw_context     * context;
   struct pw_core        * core;
@@ -44,13 +92,49 @@ struct pipewire
   struct pw_stream      * stream;
   struct spa_hook         streamListener;
 
+  CaptureGetPointerBuffer  getPointerBufferFn;
+  CapturePostPointerBuffer postPointerBufferFn;
+  bool                     cursorMetadata;
+  bool                     cursorVisible;
+  bool                     cursorEmpty;
+  int                      cursorX, cursorY;
+  int                      cursorHotX, cursorHotY;
+
   bool          stop;
   bool          hasFormat;
-  bool          formatChanged;
+
+  /* the format as negotiated, written by the PipeWire thread under the thread
+   * loop lock and taken by the frame thread once formatChanged is set */
+  struct StreamFormat streamFormat;
+  atomic_bool         formatChanged;
+
+  // the format of the frames the frame thread is copying
   int           width, height;
   CaptureFormat format;
-  uint8_t     * frameData;
+  bool          isDMABuf;
   unsigned int  formatVer;
+
+  /* the process callback only holds on to the latest buffer, the frame
+   * thread takes it from pending and returns it to the stream once copied */
+  LG_Lock            bufferLock;
+  struct pw_buffer * pending;
+  struct pw_buffer * current;
+  LGEvent          * bufferEvent;
+  LGEvent          * frameEvent;
+  unsigned int       dropped;
+  uint64_t           lastDropReport;
+
+  /* the damage of every buffer since the last one the frame thread took,
+   * including those that were dropped, -1 if the whole frame changed */
+  struct FrameDamage pendingDamage;
+
+  uint8_t     * frameData;
+  int           frameStride;
+  int           frameFd;
+
+  int                damageRectsCount;
+  FrameDamageRect    damageRects[KVMFR_MAX_DAMAGE_RECTS];
+  struct FrameDamage frameDamage[LGMP_Q_FRAME_LEN_MAX];
 };
 
 static struct pipewire * this = NULL;
@@ -66,11 +150,53 @@ static const char * pipewire_getName(void)
   return "PipeWire";
 }
 
+static void pipewire_initOptions(void)
+{
+  struct Option options[] =
+  {
+    {
+      .module         = "pipewire",
+      .name           = "dmabuf",
+      .description    = "Request linear DMA-BUF frames to avoid a copy in the compositor",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {
+      .module         = "pipewire",
+      .name           = "restoreToken",
+      .description    = "The file to keep the ScreenCast restore token in so the "
+                        "source is selected without asking on the next start, "
+                        "\"none\" to always ask (default: ~/" RESTORE_TOKEN_FILE ")",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = ""
+    },
+    {0}
+  };
+
+  option_register(options);
+}
+
 static bool pipewire_create(CaptureGetPointerBuffer getPointerBufferFn, CapturePostPointerBuffer postPointerBufferFn)
 {
   DEBUG_ASSERT(!this);
   pw_init(NULL, NULL);
   this = calloc(1, sizeof(*this));
+  this->getPointerBufferFn  = getPointerBufferFn;
+  this->postPointerBufferFn = postPointerBufferFn;
+
+  this->bufferEvent = lgCreateEvent(true, 0);
+  this->frameEvent  = lgCreateEvent(true, 20);
+  if (!this->bufferEvent || !this->frameEvent)
+  {
+    DEBUG_ERROR("Failed to create the frame events");
+    if (this->bufferEvent)
+      lgFreeEvent(this->bufferEvent);
+    free(this);
+    this = NULL;
+    return false;
+  }
+
+  LG_LOCK_INIT(this->bufferLock);
   return true;
 }
 
@@ -85,25 +211,247 @@ static const struct pw_core_events coreEvents = {
   .error = coreErrorCallback,
 };
 
+static const struct spa_pod * buildFormat(struct spa_pod_builder * builder,
+    bool linearDMABuf, const struct CachedFormat * cached)
+{
+  struct spa_pod_frame frame;
+  spa_pod_builder_push_object(builder, &frame,
+    SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+
+  if (cached)
+    spa_pod_builder_add(builder,
+      SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+      SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+      SPA_FORMAT_VIDEO_format, SPA_POD_Id(cached->format),
+      SPA_FORMAT_VIDEO_size, SPA_POD_Rectangle(&cached->size),
+      SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction(
+        &SPA_FRACTION(60, 1), &SPA_FRACTION(0, 1), &SPA_FRACTION(360, 1)),
+      0);
+  else
+    spa_pod_builder_add(builder,
+      SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+      SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+      SPA_FORMAT_VIDEO_format, SPA_POD_CHOICE_ENUM_Id(6,
+        SPA_VIDEO_FORMAT_BGRA, SPA_VIDEO_FORMAT_RGBA,
+        SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_RGBx,
+        SPA_VIDEO_FORMAT_xBGR_210LE, SPA_VIDEO_FORMAT_RGBA_F16),
+      SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(
+        &SPA_RECTANGLE(1920, 1080), &SPA_RECTANGLE(1, 1), &SPA_RECTANGLE(8192, 4320)),
+      SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction(
+        &SPA_FRACTION(60, 1), &SPA_FRACTION(0, 1), &SPA_FRACTION(360, 1)),
+      0);
+
+  /* only linear buffers can be read directly by the CPU, the compositor then
+   * skips the download into shared memory it does for MemPtr buffers */
+  if (linearDMABuf)
+  {
+    spa_pod_builder_prop(builder, SPA_FORMAT_VIDEO_modifier,
+      SPA_POD_PROP_FLAG_MANDATORY);
+    spa_pod_builder_long(builder, DRM_FORMAT_MOD_LINEAR);
+  }
+
+  return spa_pod_builder_pop(builder, &frame);
+}
+
 static bool startStream(struct pw_stream * stream, uint32_t node)
 {
-  char buffer[1024];
+  char buffer[2048];
   struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
-  const struct spa_pod * param = spa_pod_builder_add_object(
-    &builder, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
-    SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
-    SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
-    SPA_FORMAT_VIDEO_format, SPA_POD_CHOICE_ENUM_Id(6,
-      SPA_VIDEO_FORMAT_BGRA, SPA_VIDEO_FORMAT_RGBA,
-      SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_RGBx,
-      SPA_VIDEO_FORMAT_xBGR_210LE, SPA_VIDEO_FORMAT_RGBA_F16),
-    SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(
-      &SPA_RECTANGLE(1920, 1080), &SPA_RECTANGLE(1, 1), &SPA_RECTANGLE(8192, 4320)),
-    SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction(
-      &SPA_FRACTION(60, 1), &SPA_FRACTION(0, 1), &SPA_FRACTION(360, 1)));
+
+  /* formats are listed in order of preference, the last one negotiated goes
+   * first as the compositor will most likely take it again, if the output
+   * has changed since it just does not match and the others are tried */
+  const struct spa_pod * params[3];
+  int count = 0;
+  const bool dmabuf = option_get_bool("pipewire", "dmabuf");
+  const struct CachedFormat * cached = &this->cachedFormat;
+  if (cached->valid && (dmabuf || !cached->isDMABuf))
+    params[count++] = buildFormat(&builder, cached->isDMABuf, cached);
+  if (dmabuf)
+    params[count++] = buildFormat(&builder, true, NULL);
+  params[count++] = buildFormat(&builder, false, NULL);
 
   return pw_stream_connect(stream, PW_DIRECTION_INPUT, node,
-    PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS, &param, 1) >= 0;
+    PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS, params, count) >= 0;
+}
+
+/* merges the damage of the buffer into the pending damage, this must be done
+ * for every buffer dequeued, even those that are dropped */
+static void addBufferDamage(struct pw_buffer * pwBuffer)
+{
+  FrameDamageRect rects[MAX_BUFFER_REGIONS];
+  int count = 0;
+
+  struct spa_meta * meta =
+    spa_buffer_find_meta(pwBuffer->buffer, SPA_META_VideoDamage);
+  if (meta)
+  {
+    struct spa_meta_region * region;
+    spa_meta_for_each(region, meta)
+    {
+      // the list is terminated by an empty region
+      if (!spa_meta_region_is_valid(region))
+        break;
+
+      if (count == MAX_BUFFER_REGIONS)
+      {
+        count = 0;
+        break;
+      }
+
+      const struct spa_rectangle * size = &region->region.size;
+      const int x1 = max(region->region.position.x, 0);
+      const int y1 = max(region->region.position.y, 0);
+      const int x2 = min(region->region.position.x + (int)size->width,
+          this->streamFormat.width);
+      const int y2 = min(region->region.position.y + (int)size->height,
+          this->streamFormat.height);
+      if (x2 <= x1 || y2 <= y1)
+        continue;
+
+      rects[count++] = (FrameDamageRect)
+      {
+        .x      = x1,
+        .y      = y1,
+        .width  = x2 - x1,
+        .height = y2 - y1
+      };
+    }
+  }
+
+  /* producers that do not fill in the meta leave it empty, which is no
+   * different from having no meta at all */
+  LG_LOCK(this->bufferLock);
+  if (!rectsAddFrameDamage(&this->pendingDamage, rects, count,
+        this->streamFormat.width, this->streamFormat.height))
+    this->pendingDamage.count = -1;
+  LG_UNLOCK(this->bufferLock);
+}
+
+/* copies the cursor bitmap into the pointer buffer as BGRA, returns false if
+ * it can not be sent */
+static bool copyCursorBitmap(const struct spa_meta_bitmap * bitmap,
+    CapturePointer * pointer)
+{
+  bool swap;
+  switch (bitmap->format)
+  {
+    case SPA_VIDEO_FORMAT_BGRA:
+    case SPA_VIDEO_FORMAT_BGRx:
+      swap = false;
+      break;
+
+    case SPA_VIDEO_FORMAT_RGBA:
+    case SPA_VIDEO_FORMAT_RGBx:
+      swap = true;
+      break;
+
+    default:
+      DEBUG_WARN("Unsupported cursor format: %u", bitmap->format);
+      return false;
+  }
+
+  const unsigned int width  = bitmap->size.width;
+  const unsigned int height = bitmap->size.height;
+  const unsigned int pitch  = width * 4;
+
+  void * data;
+  uint32_t size = pitch * height;
+  if (!this->getPointerBufferFn(&data, &size))
+  {
+    DEBUG_WARN("failed to get a pointer buffer");
+    return false;
+  }
+
+  if (pitch * height > size)
+  {
+    DEBUG_WARN("Cursor shape too large: %ux%u", width, height);
+    return false;
+  }
+
+  const int srcPitch = bitmap->stride > 0 ? bitmap->stride : (int)pitch;
+  const uint8_t * src = SPA_PTROFF(bitmap, bitmap->offset, const uint8_t);
+  uint8_t * dst = data;
+  for (unsigned int y = 0; y < height; ++y, src += srcPitch, dst += pitch)
+  {
+    if (!swap)
+    {
+      memcpy(dst, src, pitch);
+      continue;
+    }
+
+    for (unsigned int x = 0; x < pitch; x += 4)
+    {
+      dst[x + 0] = src[x + 2];
+      dst[x + 1] = src[x + 1];
+      dst[x + 2] = src[x + 0];
+      dst[x + 3] = src[x + 3];
+    }
+  }
+
+  pointer->shapeUpdate = true;
+  pointer->format      = CAPTURE_FMT_COLOR;
+  pointer->width       = width;
+  pointer->height      = height;
+  pointer->pitch       = pitch;
+  return true;
+}
+
+/* posts the cursor carried on the buffer, the bitmap is only present when the
+ * shape changed and an invalid cursor means it is not over the stream */
+static void postBufferCursor(struct pw_buffer * pwBuffer)
+{
+  struct spa_meta_cursor * cursor = spa_buffer_find_meta_data(
+      pwBuffer->buffer, SPA_META_Cursor, sizeof(*cursor));
+  if (!cursor)
+    return;
+
+  CapturePointer pointer = { 0 };
+  if (!spa_meta_cursor_is_valid(cursor))
+  {
+    if (!this->cursorVisible)
+      return;
+
+    this->cursorVisible    = false;
+    pointer.positionUpdate = true;
+    pointer.visible        = false;
+    pointer.x              = this->cursorX - this->cursorHotX;
+    pointer.y              = this->cursorY - this->cursorHotY;
+    this->postPointerBufferFn(pointer);
+    return;
+  }
+
+  if (cursor->bitmap_offset)
+  {
+    const struct spa_meta_bitmap * bitmap =
+      SPA_PTROFF(cursor, cursor->bitmap_offset, const struct spa_meta_bitmap);
+
+    // an empty bitmap is a hidden cursor
+    this->cursorEmpty = bitmap->size.width == 0 || bitmap->size.height == 0;
+    if (!this->cursorEmpty && copyCursorBitmap(bitmap, &pointer))
+    {
+      this->cursorHotX = cursor->hotspot.x;
+      this->cursorHotY = cursor->hotspot.y;
+    }
+  }
+
+  const bool visible = !this->cursorEmpty;
+
+  if (pointer.shapeUpdate || visible != this->cursorVisible ||
+      cursor->position.x != this->cursorX ||
+      cursor->position.y != this->cursorY)
+  {
+    this->cursorVisible    = visible;
+    this->cursorX          = cursor->position.x;
+    this->cursorY          = cursor->position.y;
+    pointer.positionUpdate = true;
+    pointer.visible        = visible;
+    pointer.hx             = this->cursorHotX;
+    pointer.hy             = this->cursorHotY;
+    pointer.x              = this->cursorX - this->cursorHotX;
+    pointer.y              = this->cursorY - this->cursorHotY;
+    this->postPointerBufferFn(pointer);
+  }
 }
 
 static void streamProcessCallback(void * opaque)
@@ -119,6 +467,9 @@ static void streamProcessCallback(void * opaque)
     struct pw_buffer * tmp = pw_stream_dequeue_buffer(this->stream);
     if (!tmp)
       break;
+    addBufferDamage(tmp);
+    if (this->cursorMetadata)
+      postBufferCursor(tmp);
     if (pwBuffer)
       pw_stream_queue_buffer(this->stream, pwBuffer);
     pwBuffer = tmp;
@@ -130,14 +481,34 @@ static void streamProcessCallback(void * opaque)
     return;
   }
 
-  struct spa_buffer * buffer = pwBuffer->buffer;
-  if (!buffer->datas[0].chunk->size)
+  struct spa_data * data = &pwBuffer->buffer->datas[0];
+  if (!data->chunk->size || !data->data)
+  {
+    pw_stream_queue_buffer(this->stream, pwBuffer);
     return;
+  }
 
-  this->frameData = buffer->datas[0].data;
+  // a buffer the frame thread has yet to pick up is stale by now
+  LG_LOCK(this->bufferLock);
+  struct pw_buffer * stale = this->pending;
+  this->pending = pwBuffer;
+  if (stale)
+    ++this->dropped;
+  LG_UNLOCK(this->bufferLock);
 
-  pw_thread_loop_signal(this->threadLoop, true);
-  pw_stream_queue_buffer(this->stream, pwBuffer);
+  if (stale)
+    pw_stream_queue_buffer(this->stream, stale);
+
+  lgSignalEvent(this->bufferEvent);
+}
+
+// called by the frame thread with the thread loop lock held
+static void takeStreamFormat(void)
+{
+  this->width    = this->streamFormat.width;
+  this->height   = this->streamFormat.height;
+  this->format   = this->streamFormat.format;
+  this->isDMABuf = this->streamFormat.isDMABuf;
 }
 
 static CaptureFormat convertSpaFormat(enum spa_video_format spa)
@@ -182,23 +553,62 @@ static void streamParamChangedCallback(void * opaque, uint32_t id,
     return;
   }
 
-  this->width  = info.size.width;
-  this->height = info.size.height;
-  this->format = convertSpaFormat(info.format);
+  // the callbacks run with the thread loop lock held
+  struct StreamFormat * sf = &this->streamFormat;
+  sf->width    = info.size.width;
+  sf->height   = info.size.height;
+  sf->format   = convertSpaFormat(info.format);
+  sf->isDMABuf =
+    spa_pod_find_prop(param, NULL, SPA_FORMAT_VIDEO_modifier) != NULL;
+
+  this->cachedFormat = (struct CachedFormat)
+  {
+    .valid    = sf->format >= 0,
+    .format   = info.format,
+    .size     = info.size,
+    .isDMABuf = sf->isDMABuf
+  };
+
+  LG_LOCK(this->bufferLock);
+  this->pendingDamage.count = -1;
+  LG_UNLOCK(this->bufferLock);
 
   if (this->hasFormat)
   {
-    this->formatChanged = true;
+    atomic_store(&this->formatChanged, true);
     return;
   }
 
   char buffer[1024];
   struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 
-  param = spa_pod_builder_add_object(
+  const struct spa_pod * params[3];
+  int count = 0;
+  params[count++] = spa_pod_builder_add_object(
     &builder, SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-    SPA_PARAM_BUFFERS_dataType, SPA_POD_Int(1 << SPA_DATA_MemPtr));
-  pw_stream_update_params(this->stream, &param, 1);
+    SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(4, 3, 16),
+    SPA_PARAM_BUFFERS_dataType, SPA_POD_Int(sf->isDMABuf ?
+      1 << SPA_DATA_DmaBuf : 1 << SPA_DATA_MemPtr));
+
+  // ask for the damage so only the changed regions need to be copied
+  params[count++] = spa_pod_builder_add_object(
+    &builder, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+    SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+    SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+      sizeof(struct spa_meta_region) * MAX_BUFFER_REGIONS,
+      sizeof(struct spa_meta_region) * 1,
+      sizeof(struct spa_meta_region) * MAX_BUFFER_REGIONS));
+
+  if (this->cursorMetadata)
+    params[count++] = spa_pod_builder_add_object(
+      &builder, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+      SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Cursor),
+      SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+        CURSOR_META_SIZE(64, 64),
+        CURSOR_META_SIZE(1, 1),
+        CURSOR_META_SIZE(256, 256)));
+
+  pw_stream_update_params(this->stream, params, count);
 
   this->hasFormat = true;
   pw_thread_loop_signal(this->threadLoop, true);
@@ -212,7 +622,11 @@ static void streamStateChangedCallback(void * opaque,
     pw_stream_state_as_string(oldState), pw_stream_state_as_string(newState));
 
   if (newState == PW_STREAM_STATE_ERROR)
+  {
     DEBUG_ERROR("PipeWire stream error: %s", error);
+    this->sessionLost = true;
+    pw_thread_loop_signal(this->threadLoop, false);
+  }
 }
 
 static const struct pw_stream_events streamEvents = {
@@ -222,46 +636,165 @@ static const struct pw_stream_events streamEvents = {
   .param_changed = streamParamChangedCallback,
 };
 
-static bool pipewire_init(void)
+static char * getRestoreTokenFile(void)
 {
-  DEBUG_ASSERT(this);
-  this->stop = false;
+  const char * path = option_get_string("pipewire", "restoreToken");
+  if (path && !strcmp(path, "none"))
+    return NULL;
+
+  char * file = NULL;
+  if (path && *path)
+    file = strdup(path);
+  else
+  {
+    const char * dataPath = os_getDataPath();
+    if (dataPath)
+      alloc_sprintf(&file, "%s%s", dataPath, RESTORE_TOKEN_FILE);
+  }
+
+  return file;
+}
+
+static char * loadRestoreToken(void)
+{
+  char * file = getRestoreTokenFile();
+  if (!file)
+    return NULL;
+
+  char * token = NULL;
+  FILE * fp = fopen(file, "r");
+  free(file);
+  if (!fp)
+    return NULL;
+
+  char buffer[256];
+  if (fgets(buffer, sizeof(buffer), fp))
+  {
+    buffer[strcspn(buffer, "\r\n")] = '\0';
+    if (*buffer)
+      token = strdup(buffer);
+  }
+
+  fclose(fp);
+  return token;
+}
 
-  this->portal = portal_create();
+static void saveRestoreToken(const char * token)
+{
+  char * file = getRestoreTokenFile();
+  if (!file)
+    return;
+
+  // the token lets anyone with it capture the screen without asking
+  int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+  {
+    DEBUG_WARN("Failed to save the restore token to %s: %s", file,
+      strerror(errno));
+    free(file);
+    return;
+  }
+
+  const size_t len = strlen(token);
+  if (write(fd, token, len) != (ssize_t)len || write(fd, "\n", 1) != 1)
+    DEBUG_WARN("Failed to write the restore token to %s", file);
+
+  close(fd);
+  free(file);
+}
+
+static bool openSession(void)
+{
   if (!this->portal)
   {
-    DEBUG_ERROR("Failed to create xdg-desktop-portal for screencasting");
-    goto fail;
+    this->portal = portal_create();
+    if (!this->portal)
+    {
+      DEBUG_ERROR("Failed to create xdg-desktop-portal for screencasting");
+      return false;
+    }
   }
 
   if (!portal_createScreenCastSession(this->portal, &this->sessionHandle))
   {
     DEBUG_ERROR("Failed to create ScreenCast session");
-    goto fail;
+    return false;
   }
 
   DEBUG_INFO("Got session handle: %s", this->sessionHandle);
 
-  if (!portal_selectSource(this->portal, this->sessionHandle))
+  char * restoreToken = loadRestoreToken();
+  const bool selected = portal_selectSource(this->portal, this->sessionHandle,
+      restoreToken, &this->cursorMetadata);
+  free(restoreToken);
+
+  if (!selected)
   {
     DEBUG_ERROR("Failed to select source");
-    goto fail;
+    return false;
+  }
+
+  restoreToken = NULL;
+  this->node = portal_getPipewireNode(this->portal, this->sessionHandle,
+      &restoreToken);
+  if (restoreToken)
+  {
+    saveRestoreToken(restoreToken);
+    free(restoreToken);
   }
 
-  uint32_t pipewireNode = portal_getPipewireNode(this->portal, this->sessionHandle);
-  if (!pipewireNode)
+  if (!this->node)
   {
     DEBUG_ERROR("Failed to get pipewire node");
-    goto fail;
+    return false;
+  }
+
+  return true;
+}
+
+static void closeSession(void)
+{
+  if (this->sessionHandle)
+    portal_destroySession(this->portal, &this->sessionHandle);
+
+  this->node        = 0;
+  this->sessionLost = false;
+}
+
+static bool pipewire_init(void)
+{
+  DEBUG_ASSERT(this);
+  this->stop        = false;
+  this->sessionLost = false;
+
+  int pipewireFd = -1;
+  if (this->sessionHandle)
+  {
+    pipewireFd = portal_openPipewireRemote(this->portal, this->sessionHandle);
+    if (pipewireFd < 0)
+    {
+      DEBUG_WARN("The ScreenCast session is gone, negotiating a new one");
+      closeSession();
+    }
+    else
+      DEBUG_INFO("Reusing session handle: %s", this->sessionHandle);
   }
 
-  int pipewireFd = portal_openPipewireRemote(this->portal, this->sessionHandle);
   if (pipewireFd < 0)
   {
-    DEBUG_ERROR("Failed to get pipewire fd");
-    goto fail;
+    if (!openSession())
+      goto fail;
+
+    pipewireFd = portal_openPipewireRemote(this->portal, this->sessionHandle);
+    if (pipewireFd < 0)
+    {
+      DEBUG_ERROR("Failed to get pipewire fd");
+      goto fail;
+    }
   }
 
+  const uint32_t pipewireNode = this->node;
+
   this->threadLoop = pw_thread_loop_new("lg-pipewire-capture", NULL);
   if (!this->threadLoop)
   {
@@ -310,8 +843,26 @@ static bool pipewire_init(void)
   }
 
   this->hasFormat     = false;
-  this->formatChanged = false;
+  atomic_store(&this->formatChanged, false);
+  this->pending       = NULL;
+  this->current       = NULL;
+  this->dropped       = 0;
   this->frameData     = NULL;
+  this->frameFd       = -1;
+
+  this->cursorVisible = false;
+  this->cursorEmpty   = false;
+  this->cursorX       = 0;
+  this->cursorY       = 0;
+  this->cursorHotX    = 0;
+  this->cursorHotY    = 0;
+
+  this->pendingDamage.count = -1;
+  for (int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
+    this->frameDamage[i].count = -1;
+
+  lgResetEvent(this->bufferEvent);
+  lgResetEvent(this->frameEvent);
   pw_stream_add_listener(this->stream, &this->streamListener, &streamEvents, NULL);
 
   if (!startStream(this->stream, pipewireNode))
@@ -321,37 +872,56 @@ static bool pipewire_init(void)
     goto fail;
   }
 
-  pw_thread_loop_unlock(this->threadLoop);
+  /* a reused session may have lost its node, in which case the stream never
+   * gets a format and the session has to be negotiated again */
+  while (!this->hasFormat && !this->sessionLost)
+    if (pw_thread_loop_timed_wait(this->threadLoop, 5) != 0)
+      break;
 
-  while (!this->hasFormat)
-    pw_thread_loop_wait(this->threadLoop);
+  if (!this->hasFormat)
+  {
+    DEBUG_ERROR("The stream did not negotiate a format");
+    pw_thread_loop_unlock(this->threadLoop);
+    goto fail;
+  }
 
+  takeStreamFormat();
   if (this->format < 0)
   {
     DEBUG_ERROR("Unknown frame format");
     pw_thread_loop_accept(this->threadLoop);
+    pw_thread_loop_unlock(this->threadLoop);
     goto fail;
   }
 
   DEBUG_INFO("Frame size       : %dx%d", this->width, this->height);
+  DEBUG_INFO("Buffer type      : %s", this->isDMABuf ? "DMA-BUF" : "MemPtr");
 
   pw_thread_loop_accept(this->threadLoop);
+  pw_thread_loop_unlock(this->threadLoop);
 
   return true;
 fail:
   pipewire_deinit();
+  closeSession();
   return false;
 }
 
 static void pipewire_stop(void)
 {
+  /* the stream is disconnected in deinit once the frame thread has stopped
+   * as it may still be copying from the current buffer */
   this->stop = true;
-  pw_stream_disconnect(this->stream);
-  pw_thread_loop_signal(this->threadLoop, false);
+  lgSignalEvent(this->bufferEvent);
+  lgSignalEvent(this->frameEvent);
 }
 
 static bool pipewire_deinit(void)
 {
+  // the buffers are released by the stream on disconnect
+  this->pending = NULL;
+  this->current = NULL;
+
   if (this->stream)
   {
     pw_stream_disconnect(this->stream);
@@ -371,14 +941,9 @@ static bool pipewire_deinit(void)
     this->threadLoop = NULL;
   }
 
-  if (this->sessionHandle)
-    portal_destroySession(this->portal, &this->sessionHandle);
-
-  if (this->portal)
-  {
-    portal_free(this->portal);
-    this->portal = NULL;
-  }
+  // a session the stream failed on will not work the next time either
+  if (this->sessionLost)
+    closeSession();
 
   return true;
 }
@@ -386,43 +951,97 @@ static bool pipewire_deinit(void)
 static void pipewire_free(void)
 {
   DEBUG_ASSERT(this);
+  closeSession();
+  if (this->portal)
+  {
+    portal_free(this->portal);
+    this->portal = NULL;
+  }
+
   pw_deinit();
+  lgFreeEvent(this->bufferEvent);
+  lgFreeEvent(this->frameEvent);
+  LG_LOCK_FREE(this->bufferLock);
   free(this);
   this = NULL;
 }
 
 static CaptureResult pipewire_capture(void)
 {
-  int result;
-
-restart:
-  result = pw_thread_loop_timed_wait(this->threadLoop, 1);
-
   if (this->stop)
     return CAPTURE_RESULT_REINIT;
 
-  if (result == ETIMEDOUT)
+  if (!lgWaitEvent(this->bufferEvent, 1000))
     return CAPTURE_RESULT_TIMEOUT;
 
-  if (this->formatChanged)
-  {
-    ++this->formatVer;
-    this->formatChanged = false;
-    pw_thread_loop_accept(this->threadLoop);
-    goto restart;
-  }
+  if (this->stop)
+    return CAPTURE_RESULT_REINIT;
 
+  lgSignalEvent(this->frameEvent);
   return CAPTURE_RESULT_OK;
 }
 
+static void releaseCurrent(void)
+{
+  pw_thread_loop_lock(this->threadLoop);
+  pw_stream_queue_buffer(this->stream, this->current);
+  pw_thread_loop_unlock(this->threadLoop);
+  this->current = NULL;
+}
+
 static CaptureResult pipewire_waitFrame(CaptureFrame * frame,
     const size_t maxFrameSize)
 {
+  if (!lgWaitEvent(this->frameEvent, 1000))
+    return CAPTURE_RESULT_TIMEOUT;
+
   if (this->stop)
     return CAPTURE_RESULT_REINIT;
 
+  struct FrameDamage damage = { .count = 0 };
+  LG_LOCK(this->bufferLock);
+  this->current = this->pending;
+  this->pending = NULL;
+  const unsigned int dropped = this->dropped;
+  this->dropped = 0;
+  if (this->current)
+  {
+    damage = this->pendingDamage;
+    this->pendingDamage.count = 0;
+  }
+  LG_UNLOCK(this->bufferLock);
+
+  if (dropped)
+  {
+    const uint64_t now = microtime();
+    if (now - this->lastDropReport > 1000000)
+    {
+      DEBUG_INFO("Dropped %u frames, the frame copy is not keeping up", dropped);
+      this->lastDropReport = now;
+    }
+  }
+
+  // the frame was superseded and picked up already
+  if (!this->current)
+    return CAPTURE_RESULT_TIMEOUT;
+
+  // the buffer was queued after the format change that applies to it
+  if (atomic_exchange(&this->formatChanged, false))
+  {
+    pw_thread_loop_lock(this->threadLoop);
+    takeStreamFormat();
+    pw_thread_loop_unlock(this->threadLoop);
+    ++this->formatVer;
+  }
+
   const int bpp = this->format == CAPTURE_FMT_RGBA16F ? 8 : 4;
-  const unsigned int maxHeight = maxFrameSize / (this->width * bpp);
+  struct spa_data * data = &this->current->buffer->datas[0];
+  this->frameData   = SPA_PTROFF(data->data, data->chunk->offset, uint8_t);
+  this->frameStride = data->chunk->stride > 0 ?
+    data->chunk->stride : this->width * bpp;
+  this->frameFd     = data->type == SPA_DATA_DmaBuf ? data->fd : -1;
+
+  const unsigned int maxHeight = maxFrameSize / this->frameStride;
 
   frame->formatVer    = this->formatVer;
   frame->format       = this->format;
@@ -431,12 +1050,22 @@ static CaptureResult pipewire_waitFrame(CaptureFrame * frame,
   frame->frameWidth   = this->width;
   frame->frameHeight  = min(maxHeight, this->height);
   frame->truncated    = maxHeight < this->height;
-  frame->pitch        = this->width * bpp;
-  frame->stride       = this->width;
+  frame->pitch        = this->frameStride;
+  frame->stride       = this->frameStride / bpp;
   frame->rotation     = CAPTURE_ROT_0;
 
-  // TODO: implement damage.
-  frame->damageRectsCount = 0;
+  // past 75% of the screen a single full copy is cheaper
+  if (damage.count > 0)
+    damage.count = rectsOptimize(damage.rects, damage.count,
+        KVMFR_MAX_DAMAGE_RECTS, this->width, this->height, 75);
+
+  this->damageRectsCount = max(damage.count, 0);
+  memcpy(this->damageRects, damage.rects,
+      this->damageRectsCount * sizeof(*damage.rects));
+
+  frame->damageRectsCount = this->damageRectsCount;
+  memcpy(frame->damageRects, this->damageRects,
+      this->damageRectsCount * sizeof(*this->damageRects));
 
   return CAPTURE_RESULT_OK;
 }
@@ -444,20 +1073,48 @@ static CaptureResult pipewire_waitFrame(CaptureFrame * frame,
 static CaptureResult pipewire_getFrame(FrameBuffer * frame,
     const unsigned int height, int frameIndex)
 {
-  if (this->stop || !this->frameData)
+  if (!this->current)
     return CAPTURE_RESULT_REINIT;
 
-  const int bpp = this->format == CAPTURE_FMT_RGBA16F ? 8 : 4;
-  framebuffer_write(frame, this->frameData, height * this->width * bpp);
+  if (this->stop)
+  {
+    this->current = NULL;
+    return CAPTURE_RESULT_REINIT;
+  }
 
-  pw_thread_loop_accept(this->threadLoop);
+  // DMA-BUFs must be synchronised with the GPU before the CPU reads them
+  struct dma_buf_sync sync = { .flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ };
+  if (this->frameFd >= 0 && ioctl(this->frameFd, DMA_BUF_IOCTL_SYNC, &sync) < 0)
+    DEBUG_WARN("DMA_BUF_IOCTL_SYNC failed: %s", strerror(errno));
+
+  struct FrameDamage * damage = this->frameDamage + frameIndex;
+  const bool damageAll = !rectsBeginFrameDamage(damage, this->damageRects,
+      this->damageRectsCount, KVMFR_MAX_DAMAGE_RECTS, this->width, height);
+
+  if (damageAll)
+    framebuffer_write(frame, this->frameData, height * this->frameStride);
+  else
+    rectsBufferToFramebuffer(damage->rects, damage->count, frame,
+        this->frameStride, height, this->frameData, this->frameStride);
+
+  rectsEndFrameDamage(this->frameDamage, LGMP_Q_FRAME_LEN_MAX, frameIndex,
+      this->damageRects, this->damageRectsCount, this->width, height);
+
+  if (this->frameFd >= 0)
+  {
+    sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+    ioctl(this->frameFd, DMA_BUF_IOCTL_SYNC, &sync);
+  }
+
+  releaseCurrent();
   return CAPTURE_RESULT_OK;
 }
 
 struct CaptureInterface Capture_pipewire =
 {
   .shortName       = "pipewire",
-  .asyncCapture    = false,
+  .asyncCapture    = true,
+  .initOptions     = pipewire_initOptions,
   .getName         = pipewire_getName,
   .create          = pipewire_create,
   .init            = pipewire_init,
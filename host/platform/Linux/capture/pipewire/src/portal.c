@@ -32,6 +32,7 @@ struct Portal
   GDBusConnection * conn;
   GDBusProxy      * screenCast;
   char            * senderName;
+  uint32_t          version;
 };
 
 struct DBusCallback
@@ -86,6 +87,11 @@ struct Portal * portal_create(void)
     goto fail;
   }
 
+  g_autoptr(GVariant) version = g_dbus_proxy_get_cached_property(
+    portal->screenCast, "version");
+  portal->version = version ? g_variant_get_uint32(version) : 0;
+  DEBUG_INFO("ScreenCast portal version: %" PRIu32, portal->version);
+
   return portal;
 
 fail:
@@ -230,7 +236,7 @@ void portal_destroySession(struct Portal * portal, char ** sessionHandle)
     *sessionHandle, "org.freedesktop.portal.Session", "Close", NULL, NULL,
     G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
   g_free(*sessionHandle);
-  sessionHandle = NULL;
+  *sessionHandle = NULL;
 }
 
 static void selectSourceCallback(GDBusConnection * conn, const char * senderName,
@@ -250,7 +256,8 @@ static void selectSourceCallback(GDBusConnection * conn, const char * senderName
   callback->completed = true;
 }
 
-bool portal_selectSource(struct Portal * portal, const char * sessionHandle)
+bool portal_selectSource(struct Portal * portal, const char * sessionHandle,
+    const char * restoreToken, bool * cursorMetadata)
 {
   g_autoptr(GError) err = NULL;
   bool result = false;
@@ -272,12 +279,33 @@ bool portal_selectSource(struct Portal * portal, const char * sessionHandle)
   g_variant_builder_add(&builder, "{sv}", "multiple", g_variant_new_boolean(FALSE));
   g_variant_builder_add(&builder, "{sv}", "handle_token", g_variant_new_string(requestToken));
 
+  /* version 4 can hand back a token on start that selects the same source
+   * again next time without asking the user, it is only good for one use */
+  if (portal->version >= 4)
+  {
+    g_variant_builder_add(&builder, "{sv}", "persist_mode", g_variant_new_uint32(2));
+    if (restoreToken && *restoreToken)
+    {
+      DEBUG_INFO("Restoring the previously selected source");
+      g_variant_builder_add(&builder, "{sv}", "restore_token",
+        g_variant_new_string(restoreToken));
+    }
+  }
+
   g_autoptr(GVariant) cursorModes_ = g_dbus_proxy_get_cached_property(
     portal->screenCast, "AvailableCursorModes");
   uint32_t cursorModes = cursorModes_ ? g_variant_get_uint32(cursorModes_) : 0;
 
-  // TODO: support mode 4 (separate cursor)
-  if (cursorModes & 2)
+  /* metadata keeps the cursor out of the frames so moving it does not damage
+   * them, it is sent alongside on the buffers instead */
+  *cursorMetadata = false;
+  if (cursorModes & 4)
+  {
+    DEBUG_INFO("Cursor mode      : metadata");
+    g_variant_builder_add(&builder, "{sv}", "cursor_mode", g_variant_new_uint32(4));
+    *cursorMetadata = true;
+  }
+  else if (cursorModes & 2)
   {
     DEBUG_INFO("Cursor mode      : embedded");
     g_variant_builder_add(&builder, "{sv}", "cursor_mode", g_variant_new_uint32(2));
@@ -314,11 +342,18 @@ cleanup:
   return result;
 }
 
+struct StartResult
+{
+  uint32_t node;
+  char   * restoreToken;
+};
+
 static void pipewireNodeCallback(GDBusConnection * conn, const char * senderName,
   const char *objectPath, const char * interfaceName, const char * signalName,
   GVariant * params, void * opaque)
 {
   struct DBusCallback * callback = opaque;
+  struct StartResult  * start    = callback->opaque;
   callback->completed = true;
 
   uint32_t status;
@@ -349,16 +384,21 @@ static void pipewireNodeCallback(GDBusConnection * conn, const char * senderName
   }
 
   g_autoptr(GVariant) prop = NULL;
-  g_variant_iter_loop(&iter, "(u@a{sv})", callback->opaque, &prop);
+  g_variant_iter_loop(&iter, "(u@a{sv})", &start->node, &prop);
+
+  const char * token;
+  if (g_variant_lookup(result, "restore_token", "&s", &token))
+    start->restoreToken = strdup(token);
 }
 
-uint32_t portal_getPipewireNode(struct Portal * portal, const char * sessionHandle)
+uint32_t portal_getPipewireNode(struct Portal * portal, const char * sessionHandle,
+    char ** restoreToken)
 {
   g_autoptr(GError) err = NULL;
   char * requestPath = NULL;
   char * requestToken = NULL;
-  uint32_t result = 0;
-  struct DBusCallback callback = {0, .opaque = &result};
+  struct StartResult start = {0};
+  struct DBusCallback callback = {0, .opaque = &start};
 
   if (!getRequestPath(portal, &requestPath, &requestToken))
   {
@@ -388,7 +428,13 @@ cleanup:
   callbackUnregister(portal, &callback);
   free(requestPath);
   free(requestToken);
-  return result;
+
+  if (restoreToken)
+    *restoreToken = start.restoreToken;
+  else
+    free(start.restoreToken);
+
+  return start.node;
 }
 
 int portal_openPipewireRemote(struct Portal * portal, const char * sessionHandle)
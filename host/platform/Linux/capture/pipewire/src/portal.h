@@ -35,6 +35,8 @@ struct Portal * portal_create(void);
 void portal_free(struct Portal * portal);
 bool portal_createScreenCastSession(struct Portal * portal, char ** handle);
 void portal_destroySession(struct Portal * portal, char ** sessionHandle);
-bool portal_selectSource(struct Portal * portal, const char * sessionHandle);
-uint32_t portal_getPipewireNode(struct Portal * portal, const char * sessionHandle);
+bool portal_selectSource(struct Portal * portal, const char * sessionHandle,
+    const char * restoreToken, bool * cursorMetadata);
+uint32_t portal_getPipewireNode(struct Portal * portal, const char * sessionHandle,
+    char ** restoreToken);
 int portal_openPipewireRemote(struct Portal * portal, const char * sessionHandle);
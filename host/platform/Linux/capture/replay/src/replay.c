@@ -0,0 +1,649 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "interface/capture.h"
+#include "common/util.h"
+#include "common/option.h"
+#include "common/debug.h"
+#include "common/time.h"
+#include "common/rects.h"
+#include "common/lz4.h"
+#include "common/recording.h"
+#include "common/KVMFR.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+// the longest capture sleeps for the next record before reporting a timeout
+#define REPLAY_MAX_WAIT 100000
+
+// the largest record read, anything bigger is taken as a corrupt file
+#define REPLAY_MAX_RECORD (256 * 1024 * 1024)
+
+// shapes the recording only refers to by their ID after the first time
+#define REPLAY_SHAPES 16
+
+struct ReplayShape
+{
+  uint32_t  id;
+  size_t    size;
+  uint8_t * data;
+};
+
+struct replay
+{
+  bool                     initialized;
+  bool                     stop;
+  const char             * path;
+  bool                     loop;
+  FILE                   * file;
+
+  CaptureGetPointerBuffer  getPointerBufferFn;
+  CapturePostPointerBuffer postPointerBufferFn;
+
+  // the next record, kept while capture waits for its time
+  bool                     pending;
+  LGRecRecord              rec;
+  uint8_t                * payload;
+  size_t                   payloadSize;
+
+  // the microtime() the recording time timeBase is played at
+  bool                     rebase;
+  uint64_t                 playStart;
+  uint64_t                 timeBase;
+  bool                     played;
+  bool                     finished;
+
+  /* the frame built from the records, until a whole frame is seen again after
+   * a bad record the rects have nothing to apply over */
+  bool                     haveFrame;
+  LGRecFrame               frame;
+  unsigned int             formatVer;
+  bool                     fullDamage;
+  uint8_t                * data;
+  size_t                   dataSize;
+  uint8_t                * decoded;
+  size_t                   decodedSize;
+
+  // the damage of the frame, none for the full frame
+  int                      damageRectsCount;
+  FrameDamageRect          damageRects[KVMFR_MAX_DAMAGE_RECTS];
+
+  // damage each frame slot is missing since it was last written
+  struct FrameDamage       frameDamage[LGMP_Q_FRAME_LEN_MAX];
+
+  struct ReplayShape       shapes[REPLAY_SHAPES];
+  unsigned int             nextShape;
+};
+
+static struct replay * this = NULL;
+
+// forwards
+
+static bool replay_deinit(void);
+
+// implementation
+
+static const char * replay_getName(void)
+{
+  return "Replay";
+}
+
+static void replay_initOptions(void)
+{
+  struct Option options[] =
+  {
+    {
+      .module         = "replay",
+      .name           = "file",
+      .description    = "The client recording to play back (see the client's app:recordFile)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = ""
+    },
+    {
+      .module         = "replay",
+      .name           = "loop",
+      .description    = "Start the recording again when it ends",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {0}
+  };
+
+  option_register(options);
+}
+
+static bool replay_create(CaptureGetPointerBuffer getPointerBufferFn,
+    CapturePostPointerBuffer postPointerBufferFn)
+{
+  DEBUG_ASSERT(!this);
+  this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("Out of memory");
+    return false;
+  }
+
+  this->path = option_get_string("replay", "file");
+  this->loop = option_get_bool  ("replay", "loop");
+
+  this->getPointerBufferFn  = getPointerBufferFn;
+  this->postPointerBufferFn = postPointerBufferFn;
+  return true;
+}
+
+static bool replay_init(void)
+{
+  DEBUG_ASSERT(this);
+  DEBUG_ASSERT(!this->initialized);
+
+  // only used when a recording is given, so it is skipped when probing
+  if (!*this->path)
+    return false;
+
+  this->file = fopen(this->path, "rb");
+  if (!this->file)
+  {
+    DEBUG_ERROR("Failed to open the recording %s: %s", this->path,
+        strerror(errno));
+    goto fail;
+  }
+
+  LGRecHeader header;
+  if (fread(&header, sizeof(header), 1, this->file) != 1 ||
+      memcmp(header.magic, LGREC_MAGIC, sizeof(header.magic)) != 0)
+  {
+    DEBUG_ERROR("%s is not a recording", this->path);
+    goto fail;
+  }
+
+  if (header.version != LGREC_VERSION)
+  {
+    DEBUG_ERROR("Unsupported recording version %u, expected %u",
+        header.version, LGREC_VERSION);
+    goto fail;
+  }
+
+  if (header.kvmfrVersion != KVMFR_VERSION)
+  {
+    DEBUG_ERROR("The recording is of KVMFR version %u, expected %u",
+        header.kvmfrVersion, KVMFR_VERSION);
+    goto fail;
+  }
+
+  DEBUG_INFO("Recording        : %s", this->path);
+
+  this->stop       = false;
+  this->pending    = false;
+  this->rebase     = true;
+  this->played     = false;
+  this->finished   = false;
+  this->haveFrame  = false;
+  this->fullDamage = true;
+  for (int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
+    this->frameDamage[i].count = -1;
+
+  this->initialized = true;
+  return true;
+
+fail:
+  replay_deinit();
+  return false;
+}
+
+static bool replay_start(void)
+{
+  this->stop = false;
+  return true;
+}
+
+static void replay_stop(void)
+{
+  this->stop = true;
+}
+
+static bool replay_deinit(void)
+{
+  DEBUG_ASSERT(this);
+
+  if (this->file)
+  {
+    fclose(this->file);
+    this->file = NULL;
+  }
+
+  this->initialized = false;
+  return true;
+}
+
+static void replay_free(void)
+{
+  free(this->payload);
+  free(this->data);
+  free(this->decoded);
+  for (int i = 0; i < REPLAY_SHAPES; ++i)
+    free(this->shapes[i].data);
+  free(this);
+  this = NULL;
+}
+
+static bool ensureBuffer(uint8_t ** buffer, size_t * size, size_t needed)
+{
+  if (needed <= *size)
+    return true;
+
+  free(*buffer);
+  *buffer = malloc(needed);
+  *size   = *buffer ? needed : 0;
+  if (!*buffer)
+  {
+    DEBUG_ERROR("Out of memory");
+    return false;
+  }
+  return true;
+}
+
+// returns false at the end of the recording
+static bool readRecord(void)
+{
+  if (fread(&this->rec, sizeof(this->rec), 1, this->file) != 1)
+    return false;
+
+  if (this->rec.size > REPLAY_MAX_RECORD ||
+      !ensureBuffer(&this->payload, &this->payloadSize, this->rec.size))
+  {
+    DEBUG_ERROR("Invalid record size %u, treating as the end",
+        this->rec.size);
+    return false;
+  }
+
+  if (this->rec.size &&
+      fread(this->payload, this->rec.size, 1, this->file) != 1)
+  {
+    DEBUG_WARN("The recording is truncated");
+    return false;
+  }
+
+  return true;
+}
+
+static bool sameFormat(const LGRecFrame * a, const LGRecFrame * b)
+{
+  return
+    a->type         == b->type         &&
+    a->screenWidth  == b->screenWidth  &&
+    a->screenHeight == b->screenHeight &&
+    a->frameWidth   == b->frameWidth   &&
+    a->frameHeight  == b->frameHeight  &&
+    a->rotation     == b->rotation     &&
+    a->stride       == b->stride       &&
+    a->pitch        == b->pitch;
+}
+
+static bool applyFrame(void)
+{
+  LGRecFrame hdr;
+  if (this->rec.size < sizeof(hdr))
+  {
+    DEBUG_WARN("Frame record too small");
+    return false;
+  }
+
+  memcpy(&hdr, this->payload, sizeof(hdr));
+  const bool full = hdr.flags & LGREC_FRAME_FULL;
+  if (hdr.compressedSize != this->rec.size - sizeof(hdr) ||
+      hdr.damageRectsCount > KVMFR_MAX_DAMAGE_RECTS)
+  {
+    DEBUG_WARN("Invalid frame record");
+    goto bad;
+  }
+
+  // the rects update the frame before, skip them until a whole frame
+  if (!full && (!this->haveFrame || !sameFormat(&hdr, &this->frame)))
+    return false;
+
+  const size_t frameSize =
+    (size_t)kvmfrFrameRows(hdr.type, hdr.frameHeight) * hdr.pitch;
+  if (!frameSize || (full && hdr.dataSize != frameSize))
+  {
+    DEBUG_WARN("Invalid frame size");
+    goto bad;
+  }
+
+  if (!ensureBuffer(&this->decoded, &this->decodedSize, hdr.dataSize) ||
+      lz4_decompress(this->payload + sizeof(hdr), hdr.compressedSize,
+        this->decoded, hdr.dataSize) != hdr.dataSize)
+  {
+    DEBUG_WARN("Failed to decompress the frame");
+    goto bad;
+  }
+
+  if (full)
+  {
+    if (!this->haveFrame || !sameFormat(&hdr, &this->frame))
+    {
+      if (!ensureBuffer(&this->data, &this->dataSize, frameSize))
+        goto bad;
+
+      ++this->formatVer;
+      this->fullDamage = true;
+      DEBUG_INFO("Format: %s %ux%u stride:%u pitch:%u",
+          FrameTypeStr[hdr.type], hdr.frameWidth, hdr.frameHeight,
+          hdr.stride, hdr.pitch);
+    }
+    memcpy(this->data, this->decoded, frameSize);
+  }
+  else if (!recording_unpackRects(this->data, hdr.pitch, hdr.frameWidth,
+        hdr.frameHeight, recording_rectsBpp(hdr.type), this->decoded,
+        hdr.dataSize, hdr.damageRects, hdr.damageRectsCount))
+  {
+    DEBUG_WARN("Invalid damage rects");
+    goto bad;
+  }
+
+  this->frame     = hdr;
+  this->haveFrame = true;
+  this->played    = true;
+
+  // a new format or a restart of the recording must be sent whole
+  if (this->fullDamage || hdr.damageRectsCount == 0)
+    this->damageRectsCount = 0;
+  else
+  {
+    this->damageRectsCount = hdr.damageRectsCount;
+    memcpy(this->damageRects, hdr.damageRects,
+        hdr.damageRectsCount * sizeof(*hdr.damageRects));
+  }
+  this->fullDamage = false;
+  return true;
+
+bad:
+  this->haveFrame = false;
+  return false;
+}
+
+static const uint8_t * findShape(uint32_t id)
+{
+  if (!id)
+    return NULL;
+
+  for (int i = 0; i < REPLAY_SHAPES; ++i)
+    if (this->shapes[i].data && this->shapes[i].id == id)
+      return this->shapes[i].data;
+
+  return NULL;
+}
+
+static void keepShape(uint32_t id, const uint8_t * data, uint32_t size)
+{
+  if (!id || findShape(id))
+    return;
+
+  struct ReplayShape * shape = this->shapes + this->nextShape;
+  if (!ensureBuffer(&shape->data, &shape->size, size))
+    return;
+
+  this->nextShape = (this->nextShape + 1) % REPLAY_SHAPES;
+  shape->id = id;
+  memcpy(shape->data, data, size);
+}
+
+static void postCursor(void)
+{
+  LGRecCursor c;
+  if (this->rec.size < sizeof(c))
+  {
+    DEBUG_WARN("Cursor record too small");
+    return;
+  }
+
+  memcpy(&c, this->payload, sizeof(c));
+  if (c.shapeSize != this->rec.size - sizeof(c))
+  {
+    DEBUG_WARN("Invalid cursor record");
+    return;
+  }
+
+  CapturePointer pointer =
+  {
+    .visible = c.flags & CURSOR_FLAG_VISIBLE
+  };
+
+  if (c.flags & CURSOR_FLAG_POSITION)
+  {
+    pointer.positionUpdate = true;
+    pointer.x              = c.cursor.x;
+    pointer.y              = c.cursor.y;
+  }
+
+  if (c.flags & CURSOR_FLAG_SHAPE)
+  {
+    const uint8_t * shape = c.shapeSize ?
+      this->payload + sizeof(c) : findShape(c.cursor.shapeID);
+    const uint32_t shapeSize = c.cursor.height * c.cursor.pitch;
+
+    switch(c.cursor.type)
+    {
+      case CURSOR_TYPE_COLOR       : pointer.format = CAPTURE_FMT_COLOR ; break;
+      case CURSOR_TYPE_MONOCHROME  : pointer.format = CAPTURE_FMT_MONO  ; break;
+      case CURSOR_TYPE_MASKED_COLOR: pointer.format = CAPTURE_FMT_MASKED; break;
+      default:
+        shape = NULL;
+        break;
+    }
+
+    void   * data;
+    uint32_t size = shapeSize;
+    if (!shape || (c.shapeSize && c.shapeSize < shapeSize))
+      DEBUG_WARN("Cursor shape %08x is missing from the recording",
+          c.cursor.shapeID);
+    else if (!this->getPointerBufferFn(&data, &size) || shapeSize > size)
+      DEBUG_WARN("Cursor shape too large: %ux%u", c.cursor.width,
+          c.cursor.height);
+    else
+    {
+      memcpy(data, shape, shapeSize);
+      if (c.shapeSize)
+        keepShape(c.cursor.shapeID, shape, shapeSize);
+
+      pointer.shapeUpdate = true;
+      pointer.hx          = c.cursor.hx;
+      pointer.hy          = c.cursor.hy;
+      pointer.width       = c.cursor.width;
+      pointer.height      = c.cursor.height;
+      pointer.pitch       = c.cursor.pitch;
+    }
+  }
+
+  this->postPointerBufferFn(pointer);
+}
+
+/* plays the records until the next frame, sleeping until each is due */
+static CaptureResult replay_capture(void)
+{
+  DEBUG_ASSERT(this);
+  DEBUG_ASSERT(this->initialized);
+
+  while(!this->stop)
+  {
+    if (!this->pending)
+    {
+      if (!readRecord())
+      {
+        // a recording without a frame to show is not looped
+        if (this->loop && this->played)
+        {
+          fseek(this->file, sizeof(LGRecHeader), SEEK_SET);
+          this->played     = false;
+          this->rebase     = true;
+          this->fullDamage = true;
+          continue;
+        }
+
+        if (!this->finished)
+        {
+          DEBUG_INFO("The recording has ended");
+          this->finished = true;
+        }
+        usleep(REPLAY_MAX_WAIT);
+        return CAPTURE_RESULT_TIMEOUT;
+      }
+
+      this->pending = true;
+      if (this->rebase)
+      {
+        this->timeBase  = this->rec.time;
+        this->playStart = microtime();
+        this->rebase    = false;
+      }
+    }
+
+    const uint64_t due = this->playStart +
+      (this->rec.time > this->timeBase ? this->rec.time - this->timeBase : 0);
+    const uint64_t now = microtime();
+    if (due > now)
+    {
+      if (due - now > REPLAY_MAX_WAIT)
+      {
+        usleep(REPLAY_MAX_WAIT);
+        return CAPTURE_RESULT_TIMEOUT;
+      }
+      lgSleepUntil(due);
+    }
+
+    this->pending = false;
+    switch(this->rec.type)
+    {
+      case LGREC_CURSOR:
+        postCursor();
+        break;
+
+      case LGREC_FRAME:
+        if (applyFrame())
+          return CAPTURE_RESULT_OK;
+        break;
+
+      // records from a newer recorder
+      default:
+        break;
+    }
+  }
+
+  return CAPTURE_RESULT_TIMEOUT;
+}
+
+static CaptureResult replay_waitFrame(CaptureFrame * frame,
+    const size_t maxFrameSize)
+{
+  const LGRecFrame * f = &this->frame;
+
+  switch(f->type)
+  {
+    case FRAME_TYPE_BGRA     : frame->format = CAPTURE_FMT_BGRA     ; break;
+    case FRAME_TYPE_RGBA     : frame->format = CAPTURE_FMT_RGBA     ; break;
+    case FRAME_TYPE_RGBA10   : frame->format = CAPTURE_FMT_RGBA10   ; break;
+    case FRAME_TYPE_RGBA16F  : frame->format = CAPTURE_FMT_RGBA16F  ; break;
+    case FRAME_TYPE_NV12     : frame->format = CAPTURE_FMT_NV12     ; break;
+    case FRAME_TYPE_RGBA10_PQ: frame->format = CAPTURE_FMT_RGBA10_PQ; break;
+    default:
+      DEBUG_ERROR("Unsupported frame type %d in the recording", f->type);
+      return CAPTURE_RESULT_ERROR;
+  }
+
+  switch(f->rotation)
+  {
+    case FRAME_ROT_0  : frame->rotation = CAPTURE_ROT_0  ; break;
+    case FRAME_ROT_90 : frame->rotation = CAPTURE_ROT_90 ; break;
+    case FRAME_ROT_180: frame->rotation = CAPTURE_ROT_180; break;
+    case FRAME_ROT_270: frame->rotation = CAPTURE_ROT_270; break;
+    default:
+      frame->rotation = CAPTURE_ROT_0;
+      break;
+  }
+
+  // the chroma plane follows the luma so NV12 can not be truncated
+  const unsigned int maxHeight = maxFrameSize / f->pitch;
+  if (f->type == FRAME_TYPE_NV12 &&
+      kvmfrFrameRows(f->type, f->frameHeight) > maxHeight)
+  {
+    DEBUG_ERROR("The recorded frame does not fit in IVSHMEM");
+    return CAPTURE_RESULT_ERROR;
+  }
+
+  frame->formatVer    = this->formatVer;
+  frame->screenWidth  = f->screenWidth;
+  frame->screenHeight = f->screenHeight;
+  frame->frameWidth   = f->frameWidth;
+  frame->frameHeight  = min(maxHeight, f->frameHeight);
+  frame->truncated    = maxHeight < f->frameHeight;
+  frame->pitch        = f->pitch;
+  frame->stride       = f->stride;
+
+  frame->damageRectsCount = this->damageRectsCount;
+  memcpy(frame->damageRects, this->damageRects,
+      this->damageRectsCount * sizeof(*this->damageRects));
+
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult replay_getFrame(FrameBuffer * frame,
+    const unsigned int height, int frameIndex)
+{
+  DEBUG_ASSERT(this);
+  DEBUG_ASSERT(this->initialized);
+
+  // the rect copy is for 32bpp frames only
+  const LGRecFrame * f = &this->frame;
+  struct FrameDamage * damage = this->frameDamage + frameIndex;
+  const bool damageAll = recording_rectsBpp(f->type) != 4 ||
+    !rectsBeginFrameDamage(damage, this->damageRects, this->damageRectsCount,
+        KVMFR_MAX_DAMAGE_RECTS, f->frameWidth, height);
+
+  if (damageAll)
+    framebuffer_write(frame, this->data,
+        (size_t)kvmfrFrameRows(f->type, height) * f->pitch);
+  else
+    rectsBufferToFramebuffer(damage->rects, damage->count, frame, f->pitch,
+        height, this->data, f->pitch);
+
+  rectsEndFrameDamage(this->frameDamage, LGMP_Q_FRAME_LEN_MAX, frameIndex,
+      this->damageRects, this->damageRectsCount, f->frameWidth, height);
+
+  return CAPTURE_RESULT_OK;
+}
+
+struct CaptureInterface Capture_replay =
+{
+  .shortName       = "replay",
+  .asyncCapture    = false,
+  .initOptions     = replay_initOptions,
+  .getName         = replay_getName,
+  .create          = replay_create,
+  .init            = replay_init,
+  .start           = replay_start,
+  .stop            = replay_stop,
+  .deinit          = replay_deinit,
+  .free            = replay_free,
+  .capture         = replay_capture,
+  .waitFrame       = replay_waitFrame,
+  .getFrame        = replay_getFrame
+};
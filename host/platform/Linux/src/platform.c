@@ -106,6 +106,15 @@ void os_setCursorPos(int x, int y)
 {
 }
 
+bool os_audioStart(OSAudioFn fn)
+{
+  return false;
+}
+
+void os_audioStop(void)
+{
+}
+
 KVMFROS os_getKVMFRType(void)
 {
   return KVMFR_OS_LINUX;
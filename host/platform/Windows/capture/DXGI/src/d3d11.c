@@ -19,17 +19,150 @@
  */
 
 #include "dxgi_capture.h"
+#include "downsample.h"
 
 #include <assert.h>
+#include <string.h>
 #include <unistd.h>
 #include "common/debug.h"
+#include "common/rects.h"
 #include "common/runningavg.h"
 #include "common/windebug.h"
 
+/* converts a 4x2 block of pixels per thread into NV12 stored as 32bpp texels,
+ * two rows of four luma samples and then their two chroma pairs at row
+ * size.y + y / 2. Uses BT.709 at full range as desktop content is */
+static const char nv12Shader[] =
+  "Texture2D<float4>         src : register(t0);\n"
+  "RWTexture2D<unorm float4> dst : register(u0);\n"
+  "\n"
+  "cbuffer Params : register(b0)\n"
+  "{\n"
+  "  uint2 offset;\n"
+  "  uint2 size;\n"
+  "};\n"
+  "\n"
+  "static const float3 luma = float3(0.2126, 0.7152, 0.0722);\n"
+  "\n"
+  "[numthreads(8, 8, 1)]\n"
+  "void main(uint3 id : SV_DispatchThreadID)\n"
+  "{\n"
+  "  uint2 base = uint2(id.x * 4, id.y * 2);\n"
+  "  if (base.x >= size.x || base.y >= size.y)\n"
+  "    return;\n"
+  "\n"
+  "  float4 row0, row1, chroma;\n"
+  "  [unroll] for(uint i = 0; i < 2; ++i)\n"
+  "  {\n"
+  "    int2 p = offset + base + uint2(i * 2, 0);\n"
+  "    float3 a = src.Load(int3(p             , 0)).rgb;\n"
+  "    float3 b = src.Load(int3(p + int2(1, 0), 0)).rgb;\n"
+  "    float3 c = src.Load(int3(p + int2(0, 1), 0)).rgb;\n"
+  "    float3 d = src.Load(int3(p + int2(1, 1), 0)).rgb;\n"
+  "\n"
+  "    row0[i * 2] = dot(a, luma); row0[i * 2 + 1] = dot(b, luma);\n"
+  "    row1[i * 2] = dot(c, luma); row1[i * 2 + 1] = dot(d, luma);\n"
+  "\n"
+  "    float3 m = (a + b + c + d) * 0.25;\n"
+  "    float  y = dot(m, luma);\n"
+  "    chroma[i * 2    ] = (m.b - y) / 1.8556 + 0.5;\n"
+  "    chroma[i * 2 + 1] = (m.r - y) / 1.5748 + 0.5;\n"
+  "  }\n"
+  "\n"
+  "  dst[uint2(id.x, base.y       )] = row0;\n"
+  "  dst[uint2(id.x, base.y + 1   )] = row1;\n"
+  "  dst[uint2(id.x, size.y + id.y)] = chroma;\n"
+  "}\n";
+
+/* encodes scRGB, linear BT.709 with 1.0 at 80 nits, with the BT.2100 PQ curve
+ * in BT.2020 primaries which covers the wider gamut scRGB reaches with values
+ * outside of 0..1 */
+static const char pqShader[] =
+  "Texture2D<float4>         src : register(t0);\n"
+  "RWTexture2D<unorm float4> dst : register(u0);\n"
+  "\n"
+  "cbuffer Params : register(b0)\n"
+  "{\n"
+  "  uint2 offset;\n"
+  "  uint2 size;\n"
+  "};\n"
+  "\n"
+  "static const float3x3 bt709to2020 =\n"
+  "{\n"
+  "  0.6274040, 0.3292820, 0.0433136,\n"
+  "  0.0690970, 0.9195400, 0.0113612,\n"
+  "  0.0163916, 0.0880132, 0.8955950\n"
+  "};\n"
+  "\n"
+  "[numthreads(8, 8, 1)]\n"
+  "void main(uint3 id : SV_DispatchThreadID)\n"
+  "{\n"
+  "  if (id.x >= size.x || id.y >= size.y)\n"
+  "    return;\n"
+  "\n"
+  "  float4 c = src.Load(int3(offset + id.xy, 0));\n"
+  "  float3 l = saturate(mul(bt709to2020, c.rgb) * (80.0 / 10000.0));\n"
+  "  float3 p = pow(l, 0.1593017578125);\n"
+  "  float3 e = pow((0.8359375 + 18.8515625 * p) / (1.0 + 18.6875 * p),\n"
+  "      78.84375);\n"
+  "  dst[id.xy] = float4(e, 1.0);\n"
+  "}\n";
+
+/* a single triangle that covers the viewport */
+static const char cursorVS[] =
+  "float4 main(uint id : SV_VertexID) : SV_Position\n"
+  "{\n"
+  "  float2 uv = float2((id << 1) & 2, id & 2);\n"
+  "  return float4(uv * float2(2.0, -2.0) + float2(-1.0, 1.0), 0.0, 1.0);\n"
+  "}\n";
+
+/* composites the pointer over a copy of the desktop under it. Colour shapes
+ * blend by their alpha, masked and monochrome shapes apply the AND mask held
+ * in the alpha and then XOR the colour, which is exact for 8-bit frames */
+static const char cursorPS[] =
+  "Texture2D<float4> desktop : register(t0);\n"
+  "Texture2D<uint4>  shape   : register(t1);\n"
+  "\n"
+  "cbuffer Params : register(b0)\n"
+  "{\n"
+  "  int2 offset;\n"
+  "  uint masked;\n"
+  "};\n"
+  "\n"
+  "float4 main(float4 pos : SV_Position) : SV_Target\n"
+  "{\n"
+  "  int2   p = int2(pos.xy);\n"
+  "  float4 d = desktop.Load(int3(p, 0));\n"
+  "  uint4  s = shape.Load(int3(p + offset, 0));\n"
+  "\n"
+  "  if (!masked)\n"
+  "    return float4(lerp(d.rgb, s.rgb / 255.0, s.a / 255.0), d.a);\n"
+  "\n"
+  "  uint3 c = uint3(d.rgb * 255.0 + 0.5);\n"
+  "  return float4(((c & s.a) ^ s.rgb) / 255.0, d.a);\n"
+  "}\n";
+
 struct D3D11Backend
 {
   RunningAvg avgMapTime;
   uint64_t   usleepMapTime;
+
+  // the format conversion for NV12 or PQ frames
+  ID3D11ComputeShader * convShader;
+  ID3D11Buffer        * convParams;
+
+  // the pointer composited into the frame
+  ID3D11VertexShader       * cursorVS;
+  ID3D11PixelShader        * cursorPS;
+  ID3D11Buffer             * cursorParams;
+  bool                       cursorMasked;
+  unsigned int               cursorWidth, cursorHeight;
+  ID3D11Texture2D          * cursorShape;
+  ID3D11ShaderResourceView * cursorShapeSRV;
+  ID3D11Texture2D          * cursorSrc;
+  ID3D11ShaderResourceView * cursorSrcSRV;
+  ID3D11Texture2D          * cursorOut;
+  ID3D11RenderTargetView   * cursorOutRTV;
 };
 
 struct D3D11TexImpl
@@ -37,6 +170,10 @@ struct D3D11TexImpl
   ID3D11Texture2D          * gpu;
   ID3D11Texture2D          * cpu;
   ID3D11ShaderResourceView * srv;
+
+  // the format conversion output, copied to the staging texture
+  ID3D11Texture2D           * conv;
+  ID3D11UnorderedAccessView * convUAV;
 };
 
 #define TEXIMPL(x) ((struct D3D11TexImpl *)(x).impl)
@@ -46,6 +183,285 @@ static struct D3D11Backend  * this = NULL;
 
 static void d3d11_free(void);
 
+/* converted frames are produced from a copy of the source that the shader
+ * can read, or the downsampled source, into a texture in the frame's format
+ * that is staged as the frame.
+ * NV12 is a 32bpp texture of a quarter of the width and one and a half times
+ * the height, PQ is RGB10A2 at the frame size */
+static bool createConvert(D3D11_TEXTURE2D_DESC * cpuTexDesc)
+{
+  const bool nv12 = dxgi->format == CAPTURE_FMT_NV12;
+  const char * code = nv12 ? nv12Shader : pqShader;
+  const size_t size = nv12 ? sizeof(nv12Shader) : sizeof(pqShader);
+
+  if (!CompileComputeShader(dxgi->device, nv12 ? "nv12" : "pq", code,
+        size - 1, &this->convShader))
+    return false;
+
+  const UINT params[4] =
+  {
+    dxgi->crop ? dxgi->cropX : 0,
+    dxgi->crop ? dxgi->cropY : 0,
+    dxgi->targetWidth,
+    dxgi->targetHeight
+  };
+
+  D3D11_BUFFER_DESC paramsDesc =
+  {
+    .ByteWidth = sizeof(params),
+    .Usage     = D3D11_USAGE_IMMUTABLE,
+    .BindFlags = D3D11_BIND_CONSTANT_BUFFER
+  };
+  D3D11_SUBRESOURCE_DATA paramsData = { .pSysMem = params };
+
+  HRESULT status = ID3D11Device_CreateBuffer(dxgi->device, &paramsDesc,
+      &paramsData, &this->convParams);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the conversion params buffer", status);
+    return false;
+  }
+
+  if (nv12)
+  {
+    cpuTexDesc->Width  = dxgi->targetWidth / 4;
+    cpuTexDesc->Height = kvmfrFrameRows(FRAME_TYPE_NV12, dxgi->targetHeight);
+    cpuTexDesc->Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+  }
+  else
+    cpuTexDesc->Format = DXGI_FORMAT_R10G10B10A2_UNORM;
+
+  return true;
+}
+
+static void freeCursorTextures(void)
+{
+  if (this->cursorOutRTV)
+    ID3D11RenderTargetView_Release(this->cursorOutRTV);
+  if (this->cursorOut)
+    ID3D11Texture2D_Release(this->cursorOut);
+  if (this->cursorSrcSRV)
+    ID3D11ShaderResourceView_Release(this->cursorSrcSRV);
+  if (this->cursorSrc)
+    ID3D11Texture2D_Release(this->cursorSrc);
+  if (this->cursorShapeSRV)
+    ID3D11ShaderResourceView_Release(this->cursorShapeSRV);
+  if (this->cursorShape)
+    ID3D11Texture2D_Release(this->cursorShape);
+
+  this->cursorOutRTV   = NULL;
+  this->cursorOut      = NULL;
+  this->cursorSrcSRV   = NULL;
+  this->cursorSrc      = NULL;
+  this->cursorShapeSRV = NULL;
+  this->cursorShape    = NULL;
+  this->cursorWidth    = 0;
+  this->cursorHeight   = 0;
+}
+
+static bool createCursorShaders(void)
+{
+  if (this->cursorPS)
+    return true;
+
+  if (!CompileVertexShader(dxgi->device, "cursor_vs", cursorVS,
+        sizeof(cursorVS) - 1, &this->cursorVS) ||
+      !CompilePixelShader(dxgi->device, "cursor_ps", cursorPS,
+        sizeof(cursorPS) - 1, &this->cursorPS))
+    return false;
+
+  D3D11_BUFFER_DESC paramsDesc =
+  {
+    .ByteWidth = 16,
+    .Usage     = D3D11_USAGE_DEFAULT,
+    .BindFlags = D3D11_BIND_CONSTANT_BUFFER
+  };
+
+  HRESULT status = ID3D11Device_CreateBuffer(dxgi->device, &paramsDesc, NULL,
+      &this->cursorParams);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the cursor params buffer", status);
+    return false;
+  }
+
+  return true;
+}
+
+/* the shape is converted to RGBA with the AND mask in the alpha for masked
+ * and monochrome pointers so one shader handles every type */
+static bool d3d11_updateCursor(const DXGI_OUTDUPL_POINTER_SHAPE_INFO * info,
+    const void * shape)
+{
+  freeCursorTextures();
+  if (!createCursorShaders())
+    return false;
+
+  const bool mono     = info->Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MONOCHROME;
+  const UINT width    = info->Width;
+  const UINT height   = mono ? info->Height / 2 : info->Height;
+  const uint8_t * src = shape;
+
+  if (!width || !height)
+    return false;
+
+  uint8_t * rgba = malloc(width * height * 4);
+  if (!rgba)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  for (UINT y = 0; y < height; ++y)
+    for (UINT x = 0; x < width; ++x)
+    {
+      uint8_t * d = rgba + (y * width + x) * 4;
+      if (mono)
+      {
+        const uint8_t bit    = 0x80 >> (x & 7);
+        const bool    andBit = src[ y           * info->Pitch + x / 8] & bit;
+        const bool    xorBit = src[(y + height) * info->Pitch + x / 8] & bit;
+        d[0] = d[1] = d[2] = xorBit ? 0xff : 0x00;
+        d[3] = andBit ? 0xff : 0x00;
+        continue;
+      }
+
+      const uint8_t * s = src + y * info->Pitch + x * 4;
+      d[0] = s[2];
+      d[1] = s[1];
+      d[2] = s[0];
+      // a masked pixel with an alpha of zero replaces the desktop
+      d[3] = info->Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MASKED_COLOR ?
+        (s[3] ? 0xff : 0x00) : s[3];
+    }
+
+  D3D11_TEXTURE2D_DESC desc =
+  {
+    .Width              = width,
+    .Height             = height,
+    .MipLevels          = 1,
+    .ArraySize          = 1,
+    .SampleDesc.Count   = 1,
+    .Usage              = D3D11_USAGE_IMMUTABLE,
+    .Format             = DXGI_FORMAT_R8G8B8A8_UINT,
+    .BindFlags          = D3D11_BIND_SHADER_RESOURCE
+  };
+  D3D11_SUBRESOURCE_DATA data = { .pSysMem = rgba, .SysMemPitch = width * 4 };
+
+  HRESULT status = ID3D11Device_CreateTexture2D(dxgi->device, &desc, &data,
+      &this->cursorShape);
+  free(rgba);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the cursor shape texture", status);
+    goto fail;
+  }
+
+  status = ID3D11Device_CreateShaderResourceView(dxgi->device,
+      (ID3D11Resource *)this->cursorShape, NULL, &this->cursorShapeSRV);
+  if (FAILED(status))
+    goto fail;
+
+  // the desktop under the pointer and the composited result
+  desc.Usage     = D3D11_USAGE_DEFAULT;
+  desc.Format    = dxgi->dxgiFormat;
+  desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+  status = ID3D11Device_CreateTexture2D(dxgi->device, &desc, NULL,
+      &this->cursorSrc);
+  if (FAILED(status))
+    goto fail;
+
+  status = ID3D11Device_CreateShaderResourceView(dxgi->device,
+      (ID3D11Resource *)this->cursorSrc, NULL, &this->cursorSrcSRV);
+  if (FAILED(status))
+    goto fail;
+
+  desc.BindFlags = D3D11_BIND_RENDER_TARGET;
+  status = ID3D11Device_CreateTexture2D(dxgi->device, &desc, NULL,
+      &this->cursorOut);
+  if (FAILED(status))
+    goto fail;
+
+  status = ID3D11Device_CreateRenderTargetView(dxgi->device,
+      (ID3D11Resource *)this->cursorOut, NULL, &this->cursorOutRTV);
+  if (FAILED(status))
+    goto fail;
+
+  this->cursorMasked = info->Type != DXGI_OUTDUPL_POINTER_SHAPE_TYPE_COLOR;
+  this->cursorWidth  = width;
+  this->cursorHeight = height;
+  return true;
+
+fail:
+  DEBUG_WINERROR("Failed to create the cursor resources", status);
+  freeCursorTextures();
+  return false;
+}
+
+static void compositeCursor(ID3D11Texture2D * dst, ID3D11Texture2D * src)
+{
+  if (!dxgi->cursor.visible || !this->cursorWidth)
+    return;
+
+  const int x1 = max(dxgi->cursor.x, 0);
+  const int y1 = max(dxgi->cursor.y, 0);
+  const int x2 = min(dxgi->cursor.x + (int)this->cursorWidth , (int)dxgi->width );
+  const int y2 = min(dxgi->cursor.y + (int)this->cursorHeight, (int)dxgi->height);
+  if (x1 >= x2 || y1 >= y2)
+    return;
+
+  ID3D11DeviceContext * ctx = dxgi->deviceContext;
+  const D3D11_BOX srcBox =
+  {
+    .left = x1, .top = y1, .front = 0, .right = x2, .bottom = y2, .back = 1
+  };
+  ID3D11DeviceContext_CopySubresourceRegion(ctx,
+    (ID3D11Resource *)this->cursorSrc, 0, 0, 0, 0,
+    (ID3D11Resource *)src, 0, &srcBox);
+
+  const INT params[4] =
+  {
+    x1 - dxgi->cursor.x,
+    y1 - dxgi->cursor.y,
+    this->cursorMasked
+  };
+  ID3D11DeviceContext_UpdateSubresource(ctx,
+    (ID3D11Resource *)this->cursorParams, 0, NULL, params, 0, 0);
+
+  const D3D11_VIEWPORT viewport =
+  {
+    .Width    = x2 - x1,
+    .Height   = y2 - y1,
+    .MaxDepth = 1.0f
+  };
+  ID3D11ShaderResourceView * srvs[2] =
+    { this->cursorSrcSRV, this->cursorShapeSRV };
+
+  ID3D11DeviceContext_OMSetRenderTargets(ctx, 1, &this->cursorOutRTV, NULL);
+  ID3D11DeviceContext_RSSetViewports(ctx, 1, &viewport);
+  ID3D11DeviceContext_IASetInputLayout(ctx, NULL);
+  ID3D11DeviceContext_IASetPrimitiveTopology(ctx,
+    D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+  ID3D11DeviceContext_VSSetShader(ctx, this->cursorVS, NULL, 0);
+  ID3D11DeviceContext_PSSetShader(ctx, this->cursorPS, NULL, 0);
+  ID3D11DeviceContext_PSSetShaderResources(ctx, 0, 2, srvs);
+  ID3D11DeviceContext_PSSetConstantBuffers(ctx, 0, 1, &this->cursorParams);
+  ID3D11DeviceContext_Draw(ctx, 3, 0);
+
+  ID3D11ShaderResourceView * nullSRVs[2] = { NULL, NULL };
+  ID3D11DeviceContext_PSSetShaderResources(ctx, 0, 2, nullSRVs);
+  ID3D11DeviceContext_OMSetRenderTargets(ctx, 0, NULL, NULL);
+
+  const D3D11_BOX outBox =
+  {
+    .left = 0, .top = 0, .front = 0, .right = x2 - x1, .bottom = y2 - y1,
+    .back = 1
+  };
+  ID3D11DeviceContext_CopySubresourceRegion(ctx,
+    (ID3D11Resource *)dst, 0, x1, y1, 0,
+    (ID3D11Resource *)this->cursorOut, 0, &outBox);
+}
+
 static bool d3d11_create(struct DXGIInterface * intf)
 {
   HRESULT status;
@@ -65,15 +481,15 @@ static bool d3d11_create(struct DXGIInterface * intf)
   {
     .Width              = dxgi->width,
     .Height             = dxgi->height,
-    .MipLevels          = dxgi->downsampleLevel + 1,
+    .MipLevels          = 1,
     .ArraySize          = 1,
     .SampleDesc.Count   = 1,
     .SampleDesc.Quality = 0,
     .Usage              = D3D11_USAGE_DEFAULT,
     .Format             = dxgi->dxgiFormat,
-    .BindFlags          = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE,
+    .BindFlags          = D3D11_BIND_SHADER_RESOURCE,
     .CPUAccessFlags     = 0,
-    .MiscFlags          = D3D11_RESOURCE_MISC_GENERATE_MIPS
+    .MiscFlags          = 0
   };
 
   D3D11_TEXTURE2D_DESC cpuTexDesc =
@@ -91,6 +507,27 @@ static bool d3d11_create(struct DXGIInterface * intf)
     .MiscFlags          = 0
   };
 
+  const bool convert =
+    dxgi->format == CAPTURE_FMT_NV12 ||
+    dxgi->format == CAPTURE_FMT_RGBA10_PQ;
+  if (convert && !createConvert(&cpuTexDesc))
+    goto fail;
+
+  if (dxgi->downsample)
+  {
+    if (!dxgi_downsampleInit(dxgi, convert, false))
+      goto fail;
+
+    // the output is staged as-is when there is no conversion after it
+    if (!convert)
+      cpuTexDesc.Format = dxgi_downsampleFormat();
+  }
+
+  D3D11_TEXTURE2D_DESC convTexDesc = cpuTexDesc;
+  convTexDesc.Usage          = D3D11_USAGE_DEFAULT;
+  convTexDesc.BindFlags      = D3D11_BIND_UNORDERED_ACCESS;
+  convTexDesc.CPUAccessFlags = 0;
+
   for (int i = 0; i < dxgi->maxTextures; ++i)
   {
     if (!(dxgi->texture[i].impl =
@@ -111,7 +548,29 @@ static bool d3d11_create(struct DXGIInterface * intf)
       goto fail;
     }
 
-    if (!dxgi->downsampleLevel)
+    if (convert)
+    {
+      status = ID3D11Device_CreateTexture2D(dxgi->device, &convTexDesc, NULL,
+        &teximpl->conv);
+
+      if (FAILED(status))
+      {
+        DEBUG_WINERROR("Failed to create the conversion texture", status);
+        goto fail;
+      }
+
+      status = ID3D11Device_CreateUnorderedAccessView(dxgi->device,
+        (ID3D11Resource *)teximpl->conv, NULL, &teximpl->convUAV);
+
+      if (FAILED(status))
+      {
+        DEBUG_WINERROR("Failed to create the conversion texture view", status);
+        goto fail;
+      }
+    }
+
+    // the shader's copy of the source, the downsampler keeps its own
+    if (!convert || dxgi->downsample)
       continue;
 
     status = ID3D11Device_CreateTexture2D(dxgi->device, &gpuTexDesc, NULL,
@@ -171,9 +630,34 @@ static void d3d11_free(void)
     if (teximpl->srv)
       ID3D11ShaderResourceView_Release(teximpl->srv);
 
+    if (teximpl->convUAV)
+      ID3D11UnorderedAccessView_Release(teximpl->convUAV);
+
+    if (teximpl->conv)
+      ID3D11Texture2D_Release(teximpl->conv);
+
     free(teximpl);
   }
 
+  dxgi_downsampleFree();
+
+  if (this->convParams)
+    ID3D11Buffer_Release(this->convParams);
+
+  if (this->convShader)
+    ID3D11ComputeShader_Release(this->convShader);
+
+  freeCursorTextures();
+
+  if (this->cursorParams)
+    ID3D11Buffer_Release(this->cursorParams);
+
+  if (this->cursorPS)
+    ID3D11PixelShader_Release(this->cursorPS);
+
+  if (this->cursorVS)
+    ID3D11VertexShader_Release(this->cursorVS);
+
   runningavg_free(&this->avgMapTime);
   free(this);
   this = NULL;
@@ -184,40 +668,49 @@ static void copyFrameFull(Texture * tex, ID3D11Texture2D * src)
   struct D3D11TexImpl * teximpl = TEXIMPL(*tex);
   ID3D11Texture2D * dst = teximpl->cpu;
 
-  if (tex->texDamageCount < 0)
-    ID3D11DeviceContext_CopyResource(dxgi->deviceContext,
-      (ID3D11Resource *)dst, (ID3D11Resource *)src);
-  else
+  if (dxgi->crop)
   {
+    // the damage is in destination coordinates, offset the source box into
+    // the region of interest
+    if (tex->texDamageCount < 0)
+    {
+      D3D11_BOX box =
+      {
+        .left   = dxgi->cropX,
+        .top    = dxgi->cropY,
+        .front  = 0,
+        .back   = 1,
+        .right  = dxgi->cropX + dxgi->targetWidth,
+        .bottom = dxgi->cropY + dxgi->targetHeight,
+      };
+      ID3D11DeviceContext_CopySubresourceRegion(dxgi->deviceContext,
+        (ID3D11Resource *)dst, 0, 0, 0, 0,
+        (ID3D11Resource *)src, 0, &box);
+      return;
+    }
+
     for (int i = 0; i < tex->texDamageCount; ++i)
     {
       FrameDamageRect * rect = tex->texDamageRects + i;
       D3D11_BOX box =
       {
-        .left   = rect->x,
-        .top    = rect->y,
+        .left   = dxgi->cropX + rect->x,
+        .top    = dxgi->cropY + rect->y,
         .front  = 0,
         .back   = 1,
-        .right  = rect->x + rect->width ,
-        .bottom = rect->y + rect->height,
+        .right  = dxgi->cropX + rect->x + rect->width ,
+        .bottom = dxgi->cropY + rect->y + rect->height,
       };
       ID3D11DeviceContext_CopySubresourceRegion(dxgi->deviceContext,
-        (ID3D11Resource *)dst, 0, box.left, box.top, 0,
+        (ID3D11Resource *)dst, 0, rect->x, rect->y, 0,
         (ID3D11Resource *)src, 0, &box);
     }
+    return;
   }
-}
-
-static void copyFrameDownsampled(Texture * tex, ID3D11Texture2D * src)
-{
-  struct D3D11TexImpl * teximpl = TEXIMPL(*tex);
-  ID3D11Texture2D * dst = teximpl->gpu;
 
   if (tex->texDamageCount < 0)
-    ID3D11DeviceContext_ResolveSubresource(dxgi->deviceContext,
-      (ID3D11Resource *)dst, 0,
-      (ID3D11Resource *)src, 0,
-      dxgi->dxgiFormat);
+    ID3D11DeviceContext_CopyResource(dxgi->deviceContext,
+      (ID3D11Resource *)dst, (ID3D11Resource *)src);
   else
   {
     for (int i = 0; i < tex->texDamageCount; ++i)
@@ -225,24 +718,37 @@ static void copyFrameDownsampled(Texture * tex, ID3D11Texture2D * src)
       FrameDamageRect * rect = tex->texDamageRects + i;
       D3D11_BOX box =
       {
-        .left   = rect->x << dxgi->downsampleLevel,
-        .top    = rect->y << dxgi->downsampleLevel,
+        .left   = rect->x,
+        .top    = rect->y,
         .front  = 0,
         .back   = 1,
-        .right  = (rect->x + rect->width ) << dxgi->downsampleLevel,
-        .bottom = (rect->y + rect->height) << dxgi->downsampleLevel,
+        .right  = rect->x + rect->width ,
+        .bottom = rect->y + rect->height,
       };
       ID3D11DeviceContext_CopySubresourceRegion(dxgi->deviceContext,
         (ID3D11Resource *)dst, 0, box.left, box.top, 0,
         (ID3D11Resource *)src, 0, &box);
     }
   }
+}
 
-  ID3D11DeviceContext_GenerateMips(dxgi->deviceContext, teximpl->srv);
-  if (tex->texDamageCount < 0)
-    ID3D11DeviceContext_CopySubresourceRegion(dxgi->deviceContext,
-      (ID3D11Resource *)teximpl->cpu, 0, 0, 0, 0,
-      (ID3D11Resource *)dst         , dxgi->downsampleLevel, NULL);
+static void copyFrameConvert(Texture * tex, ID3D11Texture2D * src)
+{
+  struct D3D11TexImpl * teximpl = TEXIMPL(*tex);
+  ID3D11DeviceContext * ctx = dxgi->deviceContext;
+
+  /* bring the shader's copy of the source up to date, it is kept in source
+   * coordinates so the damage from a crop is offset back into it */
+  const unsigned int offsetX = dxgi->crop ? dxgi->cropX : 0;
+  const unsigned int offsetY = dxgi->crop ? dxgi->cropY : 0;
+  ID3D11ShaderResourceView * srv = teximpl->srv;
+
+  if (dxgi->downsample)
+    dxgi_downsample(tex, src, &srv);
+  else if (tex->texDamageCount < 0)
+    ID3D11DeviceContext_CopySubresourceRegion(ctx,
+      (ID3D11Resource *)teximpl->gpu, 0, 0, 0, 0,
+      (ID3D11Resource *)src, 0, NULL);
   else
   {
     for (int i = 0; i < tex->texDamageCount; ++i)
@@ -250,19 +756,68 @@ static void copyFrameDownsampled(Texture * tex, ID3D11Texture2D * src)
       FrameDamageRect * rect = tex->texDamageRects + i;
       D3D11_BOX box =
       {
-        .left   = rect->x,
-        .top    = rect->y,
+        .left   = offsetX + rect->x,
+        .top    = offsetY + rect->y,
         .front  = 0,
         .back   = 1,
-        .right  = rect->x + rect->width ,
-        .bottom = rect->y + rect->height,
+        .right  = offsetX + rect->x + rect->width ,
+        .bottom = offsetY + rect->y + rect->height,
       };
-
-      ID3D11DeviceContext_CopySubresourceRegion(dxgi->deviceContext,
-        (ID3D11Resource *)teximpl->cpu, 0, box.left, box.top, 0,
-        (ID3D11Resource *)dst         , dxgi->downsampleLevel, &box);
+      ID3D11DeviceContext_CopySubresourceRegion(ctx,
+        (ID3D11Resource *)teximpl->gpu, 0, box.left, box.top, 0,
+        (ID3D11Resource *)src, 0, &box);
     }
   }
+
+  /* converting the whole frame is far cheaper than the transfer it saves, the
+   * conversion texture keeps the result so only the damage needs staging. An
+   * NV12 thread converts a 4x2 block */
+  const bool nv12 = dxgi->format == CAPTURE_FMT_NV12;
+  ID3D11DeviceContext_CSSetShader(ctx, this->convShader, NULL, 0);
+  ID3D11DeviceContext_CSSetShaderResources(ctx, 0, 1, &srv);
+  ID3D11DeviceContext_CSSetUnorderedAccessViews(ctx, 0, 1, &teximpl->convUAV,
+    NULL);
+  ID3D11DeviceContext_CSSetConstantBuffers(ctx, 0, 1, &this->convParams);
+  ID3D11DeviceContext_Dispatch(ctx,
+    (dxgi->targetWidth  / (nv12 ? 4 : 1) + 7) / 8,
+    (dxgi->targetHeight / (nv12 ? 2 : 1) + 7) / 8, 1);
+
+  ID3D11ShaderResourceView  * nullSRV = NULL;
+  ID3D11UnorderedAccessView * nullUAV = NULL;
+  ID3D11DeviceContext_CSSetShaderResources(ctx, 0, 1, &nullSRV);
+  ID3D11DeviceContext_CSSetUnorderedAccessViews(ctx, 0, 1, &nullUAV, NULL);
+  ID3D11DeviceContext_CSSetShader(ctx, NULL, NULL, 0);
+
+  if (tex->texDamageCount < 0 ||
+      (nv12 && tex->texDamageCount > KVMFR_MAX_DAMAGE_RECTS / 2))
+  {
+    ID3D11DeviceContext_CopyResource(ctx,
+      (ID3D11Resource *)teximpl->cpu, (ID3D11Resource *)teximpl->conv);
+    return;
+  }
+
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+  int count = tex->texDamageCount;
+  memcpy(rects, tex->texDamageRects, count * sizeof(*rects));
+  if (nv12)
+    count = rectsToNV12(rects, count, dxgi->targetHeight);
+
+  for (int i = 0; i < count; ++i)
+  {
+    FrameDamageRect * rect = rects + i;
+    D3D11_BOX box =
+    {
+      .left   = rect->x,
+      .top    = rect->y,
+      .front  = 0,
+      .back   = 1,
+      .right  = rect->x + rect->width ,
+      .bottom = rect->y + rect->height,
+    };
+    ID3D11DeviceContext_CopySubresourceRegion(ctx,
+      (ID3D11Resource *)teximpl->cpu, 0, box.left, box.top, 0,
+      (ID3D11Resource *)teximpl->conv, 0, &box);
+  }
 }
 
 static bool d3d11_copyFrame(Texture * tex, ID3D11Texture2D * src)
@@ -273,10 +828,16 @@ static bool d3d11_copyFrame(Texture * tex, ID3D11Texture2D * src)
   {
     tex->copyTime = microtime();
 
-    if (teximpl->gpu)
-      copyFrameDownsampled(tex, src);
+    if (teximpl->conv)
+      copyFrameConvert(tex, src);
+    else if (dxgi->downsample)
+      copyFrameFull(tex, dxgi_downsample(tex, src, NULL));
     else
+    {
       copyFrameFull(tex, src);
+      if (dxgi->compositeCursorActive)
+        compositeCursor(teximpl->cpu, src);
+    }
 
     ID3D11DeviceContext_Flush(dxgi->deviceContext);
   });
@@ -353,4 +914,5 @@ struct DXGICopyBackend copyBackendD3D11 = {
   .mapTexture   = d3d11_mapTexture,
   .unmapTexture = d3d11_unmapTexture,
   .preRelease   = d3d11_preRelease,
+  .updateCursor = d3d11_updateCursor,
 };
@@ -19,8 +19,10 @@
  */
 
 #include "dxgi_capture.h"
+#include "downsample.h"
 
 #include <assert.h>
+#include <d3d11_4.h>
 #include <d3d12.h>
 #include <d3d12sdklayers.h>
 #include "common/time.h"
@@ -55,6 +57,13 @@ struct D3D12Backend
   ID3D12Fence         * fence;
   HANDLE                event;
 
+  // shared fence used to order the copy after the D3D11 work that produced
+  // the desktop texture, when unavailable copySleep is used instead
+  ID3D11DeviceContext4 * d3d11Context;
+  ID3D11Fence          * d3d11Fence;
+  ID3D12Fence          * syncFence;
+  UINT64                 syncValue;
+
   // shared handle cache
   struct
   {
@@ -82,6 +91,75 @@ typedef HRESULT (*D3D12GetDebugInterface_t)(
 
 static void d3d12_free(void);
 
+static bool d3d12_initSyncFence(void)
+{
+  HRESULT status;
+  ID3D11Device5 * device5 = NULL;
+  HANDLE          handle  = NULL;
+  bool            result  = false;
+
+  status = ID3D11Device_QueryInterface(dxgi->device,
+      &IID_ID3D11Device5, (void **)&device5);
+  if (FAILED(status))
+    return false;
+
+  status = ID3D11DeviceContext_QueryInterface(dxgi->deviceContext,
+      &IID_ID3D11DeviceContext4, (void **)&this->d3d11Context);
+  if (FAILED(status))
+    goto exit;
+
+  status = ID3D11Device5_CreateFence(device5, 0, D3D11_FENCE_FLAG_SHARED,
+      &IID_ID3D11Fence, (void **)&this->d3d11Fence);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the D3D11 sync fence", status);
+    goto exit;
+  }
+
+  status = ID3D11Fence_CreateSharedHandle(this->d3d11Fence, NULL,
+      GENERIC_ALL, NULL, &handle);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the sync fence shared handle", status);
+    goto exit;
+  }
+
+  status = ID3D12Device_OpenSharedHandle(this->device, handle,
+      &IID_ID3D12Fence, (void **)&this->syncFence);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to open the sync fence", status);
+    goto exit;
+  }
+
+  this->syncValue = 0;
+  result = true;
+
+exit:
+  if (handle)
+    CloseHandle(handle);
+
+  if (!result)
+  {
+    if (this->d3d11Fence)
+    {
+      ID3D11Fence_Release(this->d3d11Fence);
+      this->d3d11Fence = NULL;
+    }
+
+    if (this->d3d11Context)
+    {
+      ID3D11DeviceContext4_Release(this->d3d11Context);
+      this->d3d11Context = NULL;
+    }
+  }
+
+  if (device5)
+    ID3D11Device5_Release(device5);
+
+  return result;
+}
+
 static bool d3d12_create(struct DXGIInterface * intf)
 {
   HRESULT status;
@@ -91,14 +169,6 @@ static bool d3d12_create(struct DXGIInterface * intf)
   if (!d3d12)
     return false;
 
-  if (dxgi->downsampleLevel > 0)
-  {
-    DEBUG_WARN("The D3D12 backend does not support downsampling yet");
-    dxgi->downsampleLevel = 0;
-    dxgi->targetWidth     = dxgi->width;
-    dxgi->targetHeight    = dxgi->height;
-  }
-
   if (dxgi->debug)
   {
     D3D12GetDebugInterface_t D3D12GetDebugInterface = (D3D12GetDebugInterface_t)
@@ -129,9 +199,6 @@ static bool d3d12_create(struct DXGIInterface * intf)
     return false;
   }
 
-  this->copySleep = option_get_float("dxgi", "d3d12CopySleep");
-  DEBUG_INFO("Sleep before copy : %f ms", this->copySleep);
-
   status = D3D12CreateDevice((IUnknown *) dxgi->adapter, D3D_FEATURE_LEVEL_11_0,
     &IID_ID3D12Device, (void **)&this->device);
 
@@ -164,7 +231,21 @@ static bool d3d12_create(struct DXGIInterface * intf)
     }
   }
 
-  dxgi->pitch  = ALIGN_TO(dxgi->width * dxgi->bpp,
+  if (d3d12_initSyncFence())
+    DEBUG_INFO("Copy sync         : shared fence");
+  else
+  {
+    this->copySleep = option_get_float("dxgi", "d3d12CopySleep");
+    DEBUG_WARN("Shared fences are not supported, falling back to copySleep");
+    DEBUG_INFO("Sleep before copy : %f ms", this->copySleep);
+  }
+
+  /* the copy queue can not run the downsampler, it runs on the D3D11 device
+   * into shareable textures that are copied from in place of the desktop */
+  if (dxgi->downsample && !dxgi_downsampleInit(dxgi, false, true))
+    goto fail;
+
+  dxgi->pitch  = ALIGN_TO(dxgi->targetWidth * dxgi->bpp,
       D3D12_TEXTURE_DATA_PITCH_ALIGNMENT);
   dxgi->stride = dxgi->pitch / dxgi->bpp;
 
@@ -200,7 +281,7 @@ static bool d3d12_create(struct DXGIInterface * intf)
   {
     .Dimension          = D3D12_RESOURCE_DIMENSION_BUFFER,
     .Alignment          = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT,
-    .Width              = dxgi->pitch * dxgi->height,
+    .Width              = dxgi->pitch * dxgi->targetHeight,
     .Height             = 1,
     .DepthOrArraySize   = 1,
     .MipLevels          = 1,
@@ -324,12 +405,23 @@ static void d3d12_free(void)
   if (this->fence)
     ID3D12Fence_Release(this->fence);
 
+  dxgi_downsampleFree();
+
   if (this->event)
     CloseHandle(this->event);
 
   if (this->src)
     ID3D12Resource_Release(this->src);
 
+  if (this->syncFence)
+    ID3D12Fence_Release(this->syncFence);
+
+  if (this->d3d11Fence)
+    ID3D11Fence_Release(this->d3d11Fence);
+
+  if (this->d3d11Context)
+    ID3D11DeviceContext4_Release(this->d3d11Context);
+
   for(int i = 0; i < this->handleCacheCount; ++i)
     CloseHandle(this->handleCache[i].handle);
 
@@ -354,6 +446,17 @@ static bool d3d12_copyFrame(Texture * parent, ID3D11Texture2D * src)
   IDXGIResource1 * res1 = NULL;
   HRESULT status;
 
+  DXGI_FORMAT format = dxgi->dxgiFormat;
+  if (dxgi->downsample)
+  {
+    INTERLOCKED_SECTION(dxgi->deviceContextLock,
+    {
+      src = dxgi_downsample(parent, src, NULL);
+      ID3D11DeviceContext_Flush(dxgi->deviceContext);
+    });
+    format = dxgi_downsampleFormat();
+  }
+
   if (this->copySleep > 0)
     nsleep((uint64_t)(this->copySleep * 1000000));
 
@@ -436,9 +539,9 @@ static bool d3d12_copyFrame(Texture * parent, ID3D11Texture2D * src)
       .Offset    = 0,
       .Footprint =
       {
-        .Format   = dxgi->dxgiFormat,
-        .Width    = dxgi->width,
-        .Height   = dxgi->height,
+        .Format   = format,
+        .Width    = dxgi->targetWidth,
+        .Height   = dxgi->targetHeight,
         .Depth    = 1,
         .RowPitch = dxgi->pitch,
       }
@@ -446,8 +549,20 @@ static bool d3d12_copyFrame(Texture * parent, ID3D11Texture2D * src)
   };
 
   if (parent->texDamageCount < 0)
+  {
+    // offset the source into the region of interest when cropping
+    D3D12_BOX box =
+    {
+      .left   = dxgi->cropX,
+      .top    = dxgi->cropY,
+      .front  = 0,
+      .back   = 1,
+      .right  = dxgi->cropX + dxgi->targetWidth,
+      .bottom = dxgi->cropY + dxgi->targetHeight,
+    };
     ID3D12GraphicsCommandList_CopyTextureRegion(tex->graphicsCommandList,
-        &destLoc, 0, 0, 0, &srcLoc, NULL);
+        &destLoc, 0, 0, 0, &srcLoc, dxgi->crop ? &box : NULL);
+  }
   else
   {
     for (int i = 0; i < parent->texDamageCount; ++i)
@@ -455,12 +570,12 @@ static bool d3d12_copyFrame(Texture * parent, ID3D11Texture2D * src)
       FrameDamageRect * rect = parent->texDamageRects + i;
       D3D12_BOX box =
       {
-        .left   = rect->x,
-        .top    = rect->y,
+        .left   = dxgi->cropX + rect->x,
+        .top    = dxgi->cropY + rect->y,
         .front  = 0,
         .back   = 1,
-        .right  = rect->x + rect->width,
-        .bottom = rect->y + rect->height,
+        .right  = dxgi->cropX + rect->x + rect->width,
+        .bottom = dxgi->cropY + rect->y + rect->height,
       };
       ID3D12GraphicsCommandList_CopyTextureRegion(tex->graphicsCommandList,
           &destLoc, rect->x, rect->y, 0, &srcLoc, &box);
@@ -475,6 +590,36 @@ static bool d3d12_copyFrame(Texture * parent, ID3D11Texture2D * src)
     goto cleanup;
   }
 
+  if (this->syncFence)
+  {
+    /* have the copy queue wait on the GPU for the D3D11 work that produced the
+     * desktop texture instead of sleeping on the CPU and hoping it is done */
+    const UINT64 value = ++this->syncValue;
+    INTERLOCKED_SECTION(dxgi->deviceContextLock,
+    {
+      status = ID3D11DeviceContext4_Signal(this->d3d11Context,
+          this->d3d11Fence, value);
+      if (SUCCEEDED(status))
+        ID3D11DeviceContext4_Flush(this->d3d11Context);
+    });
+
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to signal the D3D11 sync fence", status);
+      fail = true;
+      goto cleanup;
+    }
+
+    status = ID3D12CommandQueue_Wait(this->commandQueue,
+        this->syncFence, value);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to wait on the sync fence", status);
+      fail = true;
+      goto cleanup;
+    }
+  }
+
   ID3D12CommandQueue_ExecuteCommandLists(this->commandQueue,
       1, &tex->commandList);
 
@@ -546,7 +691,7 @@ static CaptureResult d3d12_mapTexture(Texture * parent)
   D3D12_RANGE range =
   {
     .Begin = 0,
-    .End   = dxgi->pitch * dxgi->height
+    .End   = dxgi->pitch * dxgi->targetHeight
   };
   status = ID3D12Resource_Map(tex->tex, 0, &range, &parent->map);
 
@@ -0,0 +1,406 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "downsample.h"
+
+#include "common/debug.h"
+#include "common/windebug.h"
+#include "common/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* averages taps.x by taps.y bilinear samples evenly spread over the footprint
+ * of the output pixel, at whole ratios each sample lands between four source
+ * pixels so every pixel of the footprint is weighed equally */
+static const char scaleShader[] =
+  "Texture2D<float4>     src : register(t0);\n"
+  "RWTexture2D<DST_TYPE> dst : register(u0);\n"
+  "SamplerState          smp : register(s0);\n"
+  "\n"
+  "cbuffer Params : register(b0)\n"
+  "{\n"
+  "  float2 scale;\n"
+  "  float2 texel;\n"
+  "  uint2  size;\n"
+  "  uint2  taps;\n"
+  "  uint   swap;\n"
+  "};\n"
+  "\n"
+  "[numthreads(8, 8, 1)]\n"
+  "void main(uint3 id : SV_DispatchThreadID)\n"
+  "{\n"
+  "  if (id.x >= size.x || id.y >= size.y)\n"
+  "    return;\n"
+  "\n"
+  "  float2 step = scale / taps;\n"
+  "  float2 base = id.xy * scale + step * 0.5;\n"
+  "  float4 sum  = 0;\n"
+  "  for(uint y = 0; y < taps.y; ++y)\n"
+  "    for(uint x = 0; x < taps.x; ++x)\n"
+  "      sum += src.SampleLevel(smp, (base + float2(x, y) * step) * texel, 0);\n"
+  "\n"
+  "  sum /= taps.x * taps.y;\n"
+  "  dst[id.xy] = swap ? sum.bgra : sum;\n"
+  "}\n";
+
+// the most samples taken along each axis, beyond this the filter thins out
+#define MAX_TAPS 8
+
+struct DownsampleParams
+{
+  float scale[2];
+  float texel[2];
+  UINT  size [2];
+  UINT  taps [2];
+  UINT  swap;
+  UINT  pad  [3];
+};
+
+struct DownsampleOutput
+{
+  ID3D11Texture2D           * tex;
+  ID3D11UnorderedAccessView * uav;
+  ID3D11ShaderResourceView  * srv;
+};
+
+struct Downsample
+{
+  struct DXGIInterface     * dxgi;
+  DXGI_FORMAT                format;
+
+  ID3D11ComputeShader      * shader;
+  ID3D11Buffer             * params;
+  ID3D11SamplerState       * sampler;
+
+  // the copy of the source the shader reads, kept up to date by the damage
+  ID3D11Texture2D          * src;
+  ID3D11ShaderResourceView * srcSRV;
+  bool                       srcValid;
+
+  // one per capture texture so an output is not rewritten while it is read
+  struct DownsampleOutput  * out;
+};
+
+static struct Downsample * this = NULL;
+
+static unsigned int taps(unsigned int from, unsigned int to)
+{
+  return min((from + to - 1) / to, (unsigned int)MAX_TAPS);
+}
+
+bool dxgi_downsampleInit(struct DXGIInterface * dxgi, bool convert,
+    bool shared)
+{
+  HRESULT status;
+
+  DEBUG_ASSERT(!this);
+  this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("failed to allocate the Downsample struct");
+    return false;
+  }
+
+  this->dxgi = dxgi;
+  this->out  = calloc(dxgi->maxTextures, sizeof(*this->out));
+  if (!this->out)
+  {
+    DEBUG_ERROR("out of memory");
+    goto fail;
+  }
+
+  /* BGRA can not be written through a typed UAV everywhere, write RGBA with
+   * the channels swapped instead which leaves the same bytes behind */
+  const bool bgra = dxgi->dxgiFormat == DXGI_FORMAT_B8G8R8A8_UNORM;
+  const bool fp   = dxgi->dxgiFormat == DXGI_FORMAT_R16G16B16A16_FLOAT;
+  this->format = bgra ? DXGI_FORMAT_R8G8B8A8_UNORM : dxgi->dxgiFormat;
+
+  char code[sizeof(scaleShader) + 64];
+  snprintf(code, sizeof(code), "#define DST_TYPE %s\n%s",
+      fp ? "float4" : "unorm float4", scaleShader);
+
+  if (!CompileComputeShader(dxgi->device, "downsample", code, strlen(code),
+        &this->shader))
+    goto fail;
+
+  const struct DownsampleParams params =
+  {
+    .scale =
+    {
+      (float)dxgi->width  / dxgi->targetWidth,
+      (float)dxgi->height / dxgi->targetHeight
+    },
+    .texel = { 1.0f / dxgi->width, 1.0f / dxgi->height },
+    .size  = { dxgi->targetWidth, dxgi->targetHeight },
+    .taps  =
+    {
+      taps(dxgi->width , dxgi->targetWidth ),
+      taps(dxgi->height, dxgi->targetHeight)
+    },
+    .swap  = bgra && !convert
+  };
+
+  D3D11_BUFFER_DESC paramsDesc =
+  {
+    .ByteWidth = sizeof(params),
+    .Usage     = D3D11_USAGE_IMMUTABLE,
+    .BindFlags = D3D11_BIND_CONSTANT_BUFFER
+  };
+  D3D11_SUBRESOURCE_DATA paramsData = { .pSysMem = &params };
+
+  status = ID3D11Device_CreateBuffer(dxgi->device, &paramsDesc, &paramsData,
+      &this->params);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the downsample params buffer", status);
+    goto fail;
+  }
+
+  D3D11_SAMPLER_DESC samplerDesc =
+  {
+    .Filter         = D3D11_FILTER_MIN_MAG_MIP_LINEAR,
+    .AddressU       = D3D11_TEXTURE_ADDRESS_CLAMP,
+    .AddressV       = D3D11_TEXTURE_ADDRESS_CLAMP,
+    .AddressW       = D3D11_TEXTURE_ADDRESS_CLAMP,
+    .ComparisonFunc = D3D11_COMPARISON_NEVER,
+    .MaxLOD         = D3D11_FLOAT32_MAX
+  };
+
+  status = ID3D11Device_CreateSamplerState(dxgi->device, &samplerDesc,
+      &this->sampler);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the downsample sampler", status);
+    goto fail;
+  }
+
+  D3D11_TEXTURE2D_DESC texDesc =
+  {
+    .Width            = dxgi->width,
+    .Height           = dxgi->height,
+    .MipLevels        = 1,
+    .ArraySize        = 1,
+    .Format           = dxgi->dxgiFormat,
+    .SampleDesc.Count = 1,
+    .Usage            = D3D11_USAGE_DEFAULT,
+    .BindFlags        = D3D11_BIND_SHADER_RESOURCE
+  };
+
+  status = ID3D11Device_CreateTexture2D(dxgi->device, &texDesc, NULL,
+      &this->src);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the downsample source texture", status);
+    goto fail;
+  }
+
+  status = ID3D11Device_CreateShaderResourceView(dxgi->device,
+      (ID3D11Resource *)this->src, NULL, &this->srcSRV);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the downsample source view", status);
+    goto fail;
+  }
+
+  texDesc.Width     = dxgi->targetWidth;
+  texDesc.Height    = dxgi->targetHeight;
+  texDesc.Format    = this->format;
+  texDesc.BindFlags = D3D11_BIND_UNORDERED_ACCESS |
+    (convert ? D3D11_BIND_SHADER_RESOURCE : 0);
+  texDesc.MiscFlags = shared ?
+    D3D11_RESOURCE_MISC_SHARED | D3D11_RESOURCE_MISC_SHARED_NTHANDLE : 0;
+
+  for (int i = 0; i < dxgi->maxTextures; ++i)
+  {
+    struct DownsampleOutput * out = this->out + i;
+    status = ID3D11Device_CreateTexture2D(dxgi->device, &texDesc, NULL,
+        &out->tex);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to create the downsample texture", status);
+      goto fail;
+    }
+
+    status = ID3D11Device_CreateUnorderedAccessView(dxgi->device,
+        (ID3D11Resource *)out->tex, NULL, &out->uav);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to create the downsample texture view", status);
+      goto fail;
+    }
+
+    if (!convert)
+      continue;
+
+    status = ID3D11Device_CreateShaderResourceView(dxgi->device,
+        (ID3D11Resource *)out->tex, NULL, &out->srv);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to create the downsample texture view", status);
+      goto fail;
+    }
+  }
+
+  DEBUG_INFO("Downsample taps   : %u x %u", params.taps[0], params.taps[1]);
+  return true;
+
+fail:
+  dxgi_downsampleFree();
+  return false;
+}
+
+void dxgi_downsampleFree(void)
+{
+  if (!this)
+    return;
+
+  if (this->out)
+  {
+    for (int i = 0; i < this->dxgi->maxTextures; ++i)
+    {
+      struct DownsampleOutput * out = this->out + i;
+      if (out->srv)
+        ID3D11ShaderResourceView_Release(out->srv);
+      if (out->uav)
+        ID3D11UnorderedAccessView_Release(out->uav);
+      if (out->tex)
+        ID3D11Texture2D_Release(out->tex);
+    }
+    free(this->out);
+  }
+
+  if (this->srcSRV)
+    ID3D11ShaderResourceView_Release(this->srcSRV);
+  if (this->src)
+    ID3D11Texture2D_Release(this->src);
+  if (this->sampler)
+    ID3D11SamplerState_Release(this->sampler);
+  if (this->params)
+    ID3D11Buffer_Release(this->params);
+  if (this->shader)
+    ID3D11ComputeShader_Release(this->shader);
+
+  free(this);
+  this = NULL;
+}
+
+DXGI_FORMAT dxgi_downsampleFormat(void)
+{
+  DEBUG_ASSERT(this);
+  return this->format;
+}
+
+ID3D11Texture2D * dxgi_downsample(Texture * tex, ID3D11Texture2D * src,
+    ID3D11ShaderResourceView ** srv)
+{
+  DEBUG_ASSERT(this);
+  struct DXGIInterface    * dxgi = this->dxgi;
+  ID3D11DeviceContext     * ctx  = dxgi->deviceContext;
+  struct DownsampleOutput * out  = this->out + (tex - dxgi->texture);
+
+  /* the texture's damage covers everything since it was last used, which
+   * includes everything since the last frame for the source copy */
+  if (!this->srcValid || tex->texDamageCount < 0)
+    ID3D11DeviceContext_CopyResource(ctx,
+        (ID3D11Resource *)this->src, (ID3D11Resource *)src);
+  else
+  {
+    for (int i = 0; i < tex->texDamageCount; ++i)
+    {
+      FrameDamageRect rect = tex->texDamageRects[i];
+      dxgi_downsampleRectToSource(dxgi, &rect);
+
+      D3D11_BOX box =
+      {
+        .left   = rect.x,
+        .top    = rect.y,
+        .front  = 0,
+        .back   = 1,
+        .right  = rect.x + rect.width ,
+        .bottom = rect.y + rect.height,
+      };
+      ID3D11DeviceContext_CopySubresourceRegion(ctx,
+          (ID3D11Resource *)this->src, 0, box.left, box.top, 0,
+          (ID3D11Resource *)src, 0, &box);
+    }
+  }
+  this->srcValid = true;
+
+  // as with the format conversion the whole frame is scaled and only the
+  // damage is staged from the output
+  ID3D11DeviceContext_CSSetShader(ctx, this->shader, NULL, 0);
+  ID3D11DeviceContext_CSSetShaderResources(ctx, 0, 1, &this->srcSRV);
+  ID3D11DeviceContext_CSSetUnorderedAccessViews(ctx, 0, 1, &out->uav, NULL);
+  ID3D11DeviceContext_CSSetConstantBuffers(ctx, 0, 1, &this->params);
+  ID3D11DeviceContext_CSSetSamplers(ctx, 0, 1, &this->sampler);
+  ID3D11DeviceContext_Dispatch(ctx,
+      (dxgi->targetWidth  + 7) / 8,
+      (dxgi->targetHeight + 7) / 8, 1);
+
+  ID3D11ShaderResourceView  * nullSRV = NULL;
+  ID3D11UnorderedAccessView * nullUAV = NULL;
+  ID3D11DeviceContext_CSSetShaderResources(ctx, 0, 1, &nullSRV);
+  ID3D11DeviceContext_CSSetUnorderedAccessViews(ctx, 0, 1, &nullUAV, NULL);
+  ID3D11DeviceContext_CSSetShader(ctx, NULL, NULL, 0);
+
+  if (srv)
+    *srv = out->srv;
+  return out->tex;
+}
+
+/* an output pixel samples from a pixel before its footprint to a pixel after
+ * it, so a changed source pixel affects the outputs whose widened footprint
+ * holds it, and an output reads the source its widened footprint covers */
+static void mapSpan(uint32_t * pos, uint32_t * len, uint64_t from, uint64_t to,
+    bool toTarget)
+{
+  uint64_t lo, hi;
+  if (toTarget)
+  {
+    lo = *pos ? (*pos - 1) * to / from : 0;
+    hi = ((*pos + *len + 1) * to + from - 1) / from;
+  }
+  else
+  {
+    lo = *pos * to / from;
+    lo = lo ? lo - 1 : 0;
+    hi = ((*pos + *len) * to + from - 1) / from + 1;
+  }
+
+  hi   = min(hi, to);
+  *pos = lo;
+  *len = hi - lo;
+}
+
+void dxgi_downsampleRectToTarget(const struct DXGIInterface * dxgi,
+    FrameDamageRect * rect)
+{
+  mapSpan(&rect->x, &rect->width , dxgi->width , dxgi->targetWidth , true);
+  mapSpan(&rect->y, &rect->height, dxgi->height, dxgi->targetHeight, true);
+}
+
+void dxgi_downsampleRectToSource(const struct DXGIInterface * dxgi,
+    FrameDamageRect * rect)
+{
+  mapSpan(&rect->x, &rect->width , dxgi->targetWidth , dxgi->width , false);
+  mapSpan(&rect->y, &rect->height, dxgi->targetHeight, dxgi->height, false);
+}
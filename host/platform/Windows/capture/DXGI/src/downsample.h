@@ -0,0 +1,51 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_DXGI_DOWNSAMPLE_
+#define _H_DXGI_DOWNSAMPLE_
+
+#include "dxgi_capture.h"
+
+/* Scales the desktop to the target size with a compute shader. Each output
+ * pixel averages bilinear taps spread over its footprint in the source, which
+ * is an exact box filter for whole ratios. The result is unswapped RGBA for the
+ * format conversion when convert is set, shared is needed to open it from
+ * another device. */
+bool dxgi_downsampleInit(struct DXGIInterface * dxgi, bool convert,
+    bool shared);
+void dxgi_downsampleFree(void);
+
+// the format of the output, which is not the source format for BGRA
+DXGI_FORMAT dxgi_downsampleFormat(void);
+
+/* Brings the output for the texture up to date with the damaged area of the
+ * source and returns it, and its view in srv if not NULL. Must be called with
+ * the device context lock held. */
+ID3D11Texture2D * dxgi_downsample(Texture * tex, ID3D11Texture2D * src,
+    ID3D11ShaderResourceView ** srv);
+
+/* The filter reads a pixel past the footprint of each output pixel, map a rect
+ * to all the pixels it affects in the target or that affect it in the source */
+void dxgi_downsampleRectToTarget(const struct DXGIInterface * dxgi,
+    FrameDamageRect * rect);
+void dxgi_downsampleRectToSource(const struct DXGIInterface * dxgi,
+    FrameDamageRect * rect);
+
+#endif
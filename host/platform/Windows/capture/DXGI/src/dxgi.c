@@ -28,8 +28,10 @@
 #include "common/event.h"
 #include "common/rects.h"
 #include "common/runningavg.h"
+#include "common/time.h"
 #include "common/KVMFR.h"
 #include "common/vector.h"
+#include "common/metrics.h"
 
 #include <stdatomic.h>
 #include <unistd.h>
@@ -41,8 +43,12 @@
 #include <d3dcommon.h>
 #include <versionhelpers.h>
 #include <dwmapi.h>
+#include <winternl.h>
 
 #include "dxgi_capture.h"
+#include "gpu_diff.h"
+#include "downsample.h"
+#include "wgc.h"
 
 #define LOCKED(...) INTERLOCKED_SECTION(this->deviceContextLock, __VA_ARGS__)
 
@@ -53,6 +59,8 @@ typedef struct
   unsigned int x;
   unsigned int y;
   unsigned int level;
+  unsigned int targetX;
+  unsigned int targetY;
 }
 DownsampleRule;
 
@@ -61,6 +69,31 @@ static Vector downsampleRules = {0};
 // locals
 static struct DXGIInterface * this = NULL;
 
+typedef UINT D3DKMT_HANDLE;
+
+typedef struct _D3DKMT_OPENADAPTERFROMGDIDISPLAYNAME
+{
+  WCHAR         DeviceName[32];
+  D3DKMT_HANDLE hAdapter;
+  LUID          AdapterLuid;
+  UINT          VidPnSourceId;
+}
+D3DKMT_OPENADAPTERFROMGDIDISPLAYNAME;
+
+typedef struct _D3DKMT_CLOSEADAPTER
+{
+  D3DKMT_HANDLE hAdapter;
+}
+D3DKMT_CLOSEADAPTER;
+
+NTSTATUS APIENTRY D3DKMTOpenAdapterFromGdiDisplayName(
+  _Inout_ D3DKMT_OPENADAPTERFROMGDIDISPLAYNAME *
+);
+
+NTSTATUS APIENTRY D3DKMTCloseAdapter(
+  _In_ const D3DKMT_CLOSEADAPTER *
+);
+
 extern struct DXGICopyBackend copyBackendD3D11;
 extern struct DXGICopyBackend copyBackendD3D12;
 static struct DXGICopyBackend * backends[] = {
@@ -86,6 +119,33 @@ static const char * dxgi_getName(void)
   return name;
 }
 
+static bool parseCrop(const char * str, unsigned int * w, unsigned int * h,
+    unsigned int * x, unsigned int * y)
+{
+  char end;
+  return sscanf(str, "%ux%u+%u+%u%c", w, h, x, y, &end) == 4 && *w && *h;
+}
+
+static bool cropOptValidator(struct Option * opt, const char ** error)
+{
+  unsigned int w, h, x, y;
+  if (!opt->value.x_string || parseCrop(opt->value.x_string, &w, &h, &x, &y))
+    return true;
+
+  *error = "Invalid crop region, expected (width)x(height)+(x)+(y)";
+  return false;
+}
+
+static bool sourceOptValidator(struct Option * opt, const char ** error)
+{
+  if (!strcasecmp(opt->value.x_string, "duplication") ||
+      !strcasecmp(opt->value.x_string, "wgc"))
+    return true;
+
+  *error = "Invalid capture source, expected duplication or wgc";
+  return false;
+}
+
 static bool downsampleOptParser(struct Option * opt, const char * str)
 {
   if (!str)
@@ -114,15 +174,26 @@ static bool downsampleOptParser(struct Option * opt, const char * str)
       ++token;
     }
 
-    if (sscanf(token, "%ux%u:%u", &rule.x, &rule.y, &rule.level) != 3)
+    // either a fractional level or, like NvFBC, an arbitrary target size
+    char target[32];
+    if (sscanf(token, "%ux%u:%ux%u",
+          &rule.x, &rule.y, &rule.targetX, &rule.targetY) == 4)
+    {
+      if (!rule.targetX || !rule.targetY)
+        return false;
+      snprintf(target, sizeof(target), "%ux%u", rule.targetX, rule.targetY);
+    }
+    else if (sscanf(token, "%ux%u:%u", &rule.x, &rule.y, &rule.level) == 3)
+      snprintf(target, sizeof(target), "%u%%", 100 / (1 << rule.level));
+    else
       return false;
 
     rule.id = count++;
 
     DEBUG_INFO(
-      "Rule %u: %u%% IF X %s %4u %s Y %s %4u",
+      "Rule %u: %s IF X %s %4u %s Y %s %4u",
       rule.id,
-      100 / (1 << rule.level),
+      target,
       rule.greater ? "> "  : "==",
       rule.x,
       rule.greater ? "OR " : "AND",
@@ -156,14 +227,37 @@ static void dxgi_initOptions(void)
       .type           = OPTION_TYPE_STRING,
       .value.x_string = NULL
     },
+    {
+      .module         = "dxgi",
+      .name           = "source",
+      .description    = "Where the frames come from, the desktop duplication or wgc (Windows.Graphics.Capture)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "duplication",
+      .validator      = sourceOptValidator
+    },
+    {
+      .module         = "dxgi",
+      .name           = "window",
+      .description    = "Capture the window with a title containing this instead of the output (wgc only)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = NULL
+    },
     {
       .module         = "dxgi",
       .name           = "downsample", //dxgi:downsample=1920x1200:1,
-      .description    = "Downsample conditions and levels, format: [>](width)x(height):level",
+      .description    = "Downsample conditions and levels, format: [>](width)x(height):(level|(width)x(height))",
       .type           = OPTION_TYPE_STRING,
       .value.x_string = NULL,
       .parser         = downsampleOptParser
     },
+    {
+      .module         = "dxgi",
+      .name           = "crop", //dxgi:crop=1280x720+0+0
+      .description    = "Only capture this region of the output, format: (width)x(height)+(x)+(y)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = NULL,
+      .validator      = cropOptValidator
+    },
     {
       .module         = "dxgi",
       .name           = "maxTextures",
@@ -171,6 +265,13 @@ static void dxgi_initOptions(void)
       .type           = OPTION_TYPE_INT,
       .value.x_int    = 4
     },
+    {
+      .module         = "dxgi",
+      .name           = "adaptiveTextures",
+      .description    = "Adjust the number of frames buffered (up to maxTextures) to the measured map latency",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
     {
       .module         = "dxgi",
       .name           = "useAcquireLock",
@@ -185,6 +286,13 @@ static void dxgi_initOptions(void)
       .type           = OPTION_TYPE_BOOL,
       .value.x_bool   = false
     },
+    {
+      .module         = "dxgi",
+      .name           = "vblankAlign",
+      .description    = "Wait for the DWM composition before acquiring a frame instead of polling",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
     {
       .module         = "dxgi",
       .name           = "copyBackend",
@@ -199,10 +307,38 @@ static void dxgi_initOptions(void)
       .type           = OPTION_TYPE_BOOL,
       .value.x_bool   = false
     },
+    {
+      .module         = "dxgi",
+      .name           = "gpuDiff",
+      .description    = "Compare frames on the GPU to find the damage when Windows reports a full frame update",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "dxgi",
+      .name           = "compositeCursor",
+      .description    = "Draw the cursor into the frame instead of sending it to the client (d3d11 only)",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "dxgi",
+      .name           = "nv12",
+      .description    = "Convert 8-bit frames to NV12 (YUV 4:2:0) on the GPU, reduces the transfer size at the cost of colour detail (d3d11 only)",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "dxgi",
+      .name           = "hdrPQ",
+      .description    = "Encode HDR (FP16) frames as 10-bit PQ on the GPU, halves the transfer size (d3d11 only)",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
     {
       .module         = "dxgi",
       .name           = "d3d12CopySleep",
-      .description    = "Milliseconds to sleep before copying frame with d3d12",
+      .description    = "Milliseconds to sleep before copying frame with d3d12 if shared fences are unsupported",
       .type           = OPTION_TYPE_FLOAT,
       .value.x_int    = 5
     },
@@ -240,17 +376,172 @@ static bool dxgi_create(CaptureGetPointerBuffer getPointerBufferFn, CapturePostP
   this->maxTextures = option_get_int("dxgi", "maxTextures");
   if (this->maxTextures <= 0)
     this->maxTextures = 1;
+  this->adaptiveTextures = option_get_bool("dxgi", "adaptiveTextures");
 
   this->debug               = option_get_bool("dxgi", "debug");
   this->useAcquireLock      = option_get_bool("dxgi", "useAcquireLock");
   this->dwmFlush            = option_get_bool("dxgi", "dwmFlush");
+  this->vblankAlign         = option_get_bool("dxgi", "vblankAlign");
   this->disableDamage       = option_get_bool("dxgi", "disableDamage");
+  this->gpuDiff             = option_get_bool("dxgi", "gpuDiff");
+  this->compositeCursor     = option_get_bool("dxgi", "compositeCursor");
+  this->nv12                = option_get_bool("dxgi", "nv12");
+  this->hdrPQ               = option_get_bool("dxgi", "hdrPQ");
+  this->wgc                 = !strcasecmp(
+      option_get_string("dxgi", "source"), "wgc");
+
+  const char * optCrop = option_get_string("dxgi", "crop");
+  if (optCrop)
+    parseCrop(optCrop, &this->cropWidth, &this->cropHeight,
+        &this->cropX, &this->cropY);
   this->texture             = calloc(this->maxTextures, sizeof(*this->texture));
+  this->avgAcquireLatency   = runningavg_new(120);
   this->getPointerBufferFn  = getPointerBufferFn;
   this->postPointerBufferFn = postPointerBufferFn;
+
+  metrics_registerValue("lg_host_dxgi_cross_adapter",
+      "1 when the captured output is driven by another adapter than the capture "
+      "device", false, metricCrossAdapter, NULL);
   return true;
 }
 
+static bool dxgi_duplicate(void)
+{
+  HRESULT status;
+
+  IDXGIOutput5 * output5 = NULL;
+  status = IDXGIOutput_QueryInterface(this->output, &IID_IDXGIOutput5, (void **)&output5);
+  if (FAILED(status))
+  {
+    DEBUG_WARN("IDXGIOutput5 is not available, please update windows for improved performance!");
+    DEBUG_WARN("Falling back to IDXIGOutput1");
+
+    IDXGIOutput1 * output1 = NULL;
+    status = IDXGIOutput_QueryInterface(this->output, &IID_IDXGIOutput1, (void **)&output1);
+    if (FAILED(status))
+    {
+      DEBUG_ERROR("Failed to query IDXGIOutput1 from the output");
+      return false;
+    }
+
+    // we try this twice in case we still get an error on re-initialization
+    for (int i = 0; i < 2; ++i)
+    {
+      status = IDXGIOutput1_DuplicateOutput(output1, (IUnknown *)this->device, &this->dup);
+      if (SUCCEEDED(status))
+        break;
+      Sleep(200);
+    }
+
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("DuplicateOutput Failed", status);
+      IDXGIOutput1_Release(output1);
+      return false;
+    }
+    IDXGIOutput1_Release(output1);
+  }
+  else
+  {
+    const DXGI_FORMAT supportedFormats[] =
+    {
+      DXGI_FORMAT_B8G8R8A8_UNORM,
+      DXGI_FORMAT_R8G8B8A8_UNORM,
+      DXGI_FORMAT_R10G10B10A2_UNORM,
+      DXGI_FORMAT_R16G16B16A16_FLOAT
+    };
+
+    // we try this twice in case we still get an error on re-initialization
+    for (int i = 0; i < 2; ++i)
+    {
+      status = IDXGIOutput5_DuplicateOutput1(
+        output5,
+        (IUnknown *)this->device,
+        0,
+        ARRAY_LENGTH(supportedFormats),
+        supportedFormats,
+        &this->dup);
+
+      if (SUCCEEDED(status))
+        break;
+
+      // if access is denied we just keep trying until it isn't
+      if (status == E_ACCESSDENIED)
+        --i;
+
+      Sleep(200);
+    }
+
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("DuplicateOutput1 Failed", status);
+      IDXGIOutput5_Release(output5);
+      return false;
+    }
+    IDXGIOutput5_Release(output5);
+  }
+
+  return true;
+}
+
+static double metricCrossAdapter(void * opaque)
+{
+  return this->crossAdapter ? 1.0 : 0.0;
+}
+
+/* the adapter that scans out the display, which on hybrid systems is not
+ * always the one DXGI enumerates the output under */
+static bool getOutputOwner(const DXGI_OUTPUT_DESC * desc, LUID * luid)
+{
+  D3DKMT_OPENADAPTERFROMGDIDISPLAYNAME open = { 0 };
+  wcsncpy(open.DeviceName, desc->DeviceName, ARRAY_LENGTH(open.DeviceName) - 1);
+  if (D3DKMTOpenAdapterFromGdiDisplayName(&open) < 0)
+    return false;
+
+  D3DKMT_CLOSEADAPTER close = { .hAdapter = open.hAdapter };
+  D3DKMTCloseAdapter(&close);
+
+  *luid = open.AdapterLuid;
+  return true;
+}
+
+// finds the output by name on the adapter with the LUID
+static bool findOwnerOutput(LUID luid, const WCHAR * name,
+    IDXGIAdapter1 ** adapter, IDXGIOutput ** output)
+{
+  IDXGIAdapter1 * a;
+  for (int i = 0; IDXGIFactory1_EnumAdapters1(this->factory, i, &a) != DXGI_ERROR_NOT_FOUND; ++i)
+  {
+    DXGI_ADAPTER_DESC1 adapterDesc;
+    if (FAILED(IDXGIAdapter1_GetDesc1(a, &adapterDesc)) ||
+        adapterDesc.AdapterLuid.LowPart  != luid.LowPart ||
+        adapterDesc.AdapterLuid.HighPart != luid.HighPart)
+    {
+      IDXGIAdapter1_Release(a);
+      continue;
+    }
+
+    IDXGIOutput * o;
+    for (int n = 0; IDXGIAdapter1_EnumOutputs(a, n, &o) != DXGI_ERROR_NOT_FOUND; ++n)
+    {
+      DXGI_OUTPUT_DESC outputDesc;
+      if (SUCCEEDED(IDXGIOutput_GetDesc(o, &outputDesc)) &&
+          wcscmp(outputDesc.DeviceName, name) == 0)
+      {
+        *adapter = a;
+        *output  = o;
+        return true;
+      }
+      IDXGIOutput_Release(o);
+    }
+
+    IDXGIAdapter1_Release(a);
+    break;
+  }
+
+  return false;
+}
+
 static bool dxgi_init(void)
 {
   DEBUG_ASSERT(this);
@@ -280,8 +571,12 @@ static bool dxgi_init(void)
   DXGI_OUTPUT_DESC outputDesc;
 
   this->stop      = false;
-  this->texRIndex = 0;
-  this->texWIndex = 0;
+  this->texRIndex      = 0;
+  this->texWIndex      = 0;
+  this->texDepth       = this->maxTextures;
+  this->texDepthFrames = 0;
+  this->texDepthSkips  = 0;
+  this->texDepthPeak   = 0;
   atomic_store(&this->texReady, 0);
 
   lgResetEvent(this->frameEvent);
@@ -387,6 +682,38 @@ next_output:
 
   DXGI_ADAPTER_DESC1 adapterDesc;
   IDXGIAdapter1_GetDesc1(this->adapter, &adapterDesc);
+
+  /* on hybrid systems the output may be listed under an adapter that does not
+   * drive it, duplicating it there copies every frame across adapters inside
+   * of AcquireNextFrame. Move to the owner unless the adapter was chosen */
+  LUID owner;
+  this->crossAdapter = false;
+  if (getOutputOwner(&outputDesc, &owner) &&
+      (owner.LowPart  != adapterDesc.AdapterLuid.LowPart ||
+       owner.HighPart != adapterDesc.AdapterLuid.HighPart))
+  {
+    IDXGIAdapter1 * ownerAdapter;
+    IDXGIOutput   * ownerOutput;
+    if (!optAdapter && findOwnerOutput(owner, outputDesc.DeviceName,
+          &ownerAdapter, &ownerOutput))
+    {
+      IDXGIOutput_Release(this->output);
+      IDXGIAdapter1_Release(this->adapter);
+      this->adapter = ownerAdapter;
+      this->output  = ownerOutput;
+      IDXGIOutput_GetDesc(this->output, &outputDesc);
+      IDXGIAdapter1_GetDesc1(this->adapter, &adapterDesc);
+      DEBUG_INFO("Using the adapter that drives the output: %ls",
+          adapterDesc.Description);
+    }
+    else
+    {
+      this->crossAdapter = true;
+      DEBUG_WARN("The output is driven by another adapter, every frame will be "
+          "copied across adapters which is slow");
+    }
+  }
+
   DEBUG_INFO("Device Name       : %ls"    , outputDesc.DeviceName);
   DEBUG_INFO("Device Description: %ls"    , adapterDesc.Description);
   DEBUG_INFO("Device Vendor ID  : 0x%x"   , adapterDesc.VendorId);
@@ -498,11 +825,38 @@ next_output:
       break;
   }
 
+  if (this->wgc)
+  {
+    const char * optWindow = option_get_string("dxgi", "window");
+    HWND window = NULL;
+    if (optWindow && !(window = dxgi_wgcFindWindow(optWindow)))
+    {
+      DEBUG_ERROR("No window has a title containing: %s", optWindow);
+      goto fail;
+    }
+
+    // frames are delivered upright, in the size of the monitor or window
+    if (!dxgi_wgcInit(this, outputDesc.Monitor, window,
+          &this->width, &this->height))
+      goto fail;
+    this->rotation = CAPTURE_ROT_0;
+  }
+
   ++this->formatVer;
 
   DEBUG_INFO("Feature Level     : 0x%x"   , this->featureLevel);
+  DEBUG_INFO("Capture Source    : %s"     , this->wgc ?
+      "Windows.Graphics.Capture" : "Desktop Duplication");
   DEBUG_INFO("Capture Size      : %u x %u", this->width, this->height);
   DEBUG_INFO("AcquireLock       : %s"     , this->useAcquireLock ? "enabled" : "disabled");
+
+  if (this->vblankAlign && this->dwmFlush)
+  {
+    DEBUG_WARN("dwmFlush and vblankAlign are exclusive, dwmFlush disabled");
+    this->dwmFlush = false;
+  }
+  DEBUG_INFO("VBlank align      : %s"     , this->vblankAlign ? "enabled" : "disabled");
+  runningavg_reset(this->avgAcquireLatency);
   DEBUG_INFO("Debug mode        : %s"     , this->debug ? "enabled" : "disabled");
 
   // try to reduce the latency
@@ -519,86 +873,23 @@ next_output:
     IDXGIDevice1_Release(dxgi);
   }
 
-  IDXGIOutput5 * output5 = NULL;
-  status = IDXGIOutput_QueryInterface(this->output, &IID_IDXGIOutput5, (void **)&output5);
-  if (FAILED(status))
-  {
-    DEBUG_WARN("IDXGIOutput5 is not available, please update windows for improved performance!");
-    DEBUG_WARN("Falling back to IDXIGOutput1");
-
-    IDXGIOutput1 * output1 = NULL;
-    status = IDXGIOutput_QueryInterface(this->output, &IID_IDXGIOutput1, (void **)&output1);
-    if (FAILED(status))
-    {
-      DEBUG_ERROR("Failed to query IDXGIOutput1 from the output");
-      goto fail;
-    }
-
-    // we try this twice in case we still get an error on re-initialization
-    for (int i = 0; i < 2; ++i)
-    {
-      status = IDXGIOutput1_DuplicateOutput(output1, (IUnknown *)this->device, &this->dup);
-      if (SUCCEEDED(status))
-        break;
-      Sleep(200);
-    }
-
-    if (FAILED(status))
-    {
-      DEBUG_WINERROR("DuplicateOutput Failed", status);
-      IDXGIOutput1_Release(output1);
-      goto fail;
-    }
-    IDXGIOutput1_Release(output1);
-  }
+  if (this->wgc)
+    this->dxgiFormat = DXGI_FORMAT_B8G8R8A8_UNORM;
   else
   {
-    const DXGI_FORMAT supportedFormats[] =
-    {
-      DXGI_FORMAT_B8G8R8A8_UNORM,
-      DXGI_FORMAT_R8G8B8A8_UNORM,
-      DXGI_FORMAT_R10G10B10A2_UNORM,
-      DXGI_FORMAT_R16G16B16A16_FLOAT
-    };
-
-    // we try this twice in case we still get an error on re-initialization
-    for (int i = 0; i < 2; ++i)
-    {
-      status = IDXGIOutput5_DuplicateOutput1(
-        output5,
-        (IUnknown *)this->device,
-        0,
-        ARRAY_LENGTH(supportedFormats),
-        supportedFormats,
-        &this->dup);
-
-      if (SUCCEEDED(status))
-        break;
-
-      // if access is denied we just keep trying until it isn't
-      if (status == E_ACCESSDENIED)
-        --i;
-
-      Sleep(200);
-    }
-
-    if (FAILED(status))
-    {
-      DEBUG_WINERROR("DuplicateOutput1 Failed", status);
-      IDXGIOutput5_Release(output5);
+    if (!dxgi_duplicate())
       goto fail;
-    }
-    IDXGIOutput5_Release(output5);
-  }
-
-  DXGI_OUTDUPL_DESC dupDesc;
-  IDXGIOutputDuplication_GetDesc(this->dup, &dupDesc);
 
-  this->dxgiFormat = dupDesc.ModeDesc.Format;
+    DXGI_OUTDUPL_DESC dupDesc;
+    IDXGIOutputDuplication_GetDesc(this->dup, &dupDesc);
+    this->dupMode     = dupDesc.ModeDesc;
+    this->dupRotation = dupDesc.Rotation;
+    this->dxgiFormat  = dupDesc.ModeDesc.Format;
+  }
   DEBUG_INFO("Source Format     : %s", GetDXGIFormatStr(this->dxgiFormat));
 
   this->bpp = 4;
-  switch(dupDesc.ModeDesc.Format)
+  switch(this->dxgiFormat)
   {
     case DXGI_FORMAT_B8G8R8A8_UNORM    : this->format = CAPTURE_FMT_BGRA   ; break;
     case DXGI_FORMAT_R8G8B8A8_UNORM    : this->format = CAPTURE_FMT_RGBA   ; break;
@@ -614,9 +905,9 @@ next_output:
       goto fail;
   }
 
-  this->downsampleLevel = 0;
-  this->targetWidth     = this->width;
-  this->targetHeight    = this->height;
+  this->downsample   = false;
+  this->targetWidth  = this->width;
+  this->targetHeight = this->height;
 
   DownsampleRule * rule, * match = NULL;
   vector_forEachRef(rule, &downsampleRules)
@@ -631,15 +922,94 @@ next_output:
 
   if (match)
   {
-    DEBUG_INFO("Matched downsample rule %d", rule->id);
-    this->downsampleLevel = match->level;
-    this->targetWidth   >>= match->level;
-    this->targetHeight  >>= match->level;
+    DEBUG_INFO("Matched downsample rule %d", match->id);
+    const unsigned int width  = match->targetX ?
+      match->targetX : this->width  >> match->level;
+    const unsigned int height = match->targetY ?
+      match->targetY : this->height >> match->level;
+
+    if (!width || !height || width > this->width || height > this->height)
+      DEBUG_WARN("Can not downsample %ux%u to %ux%u, disabled",
+          this->width, this->height, width, height);
+    else if (width != this->width || height != this->height)
+    {
+      this->downsample   = true;
+      this->targetWidth  = width;
+      this->targetHeight = height;
+    }
+  }
+
+  /* the adaptive scale halves the size on top of any rule, a crop region is
+   * left alone as it is already only what the client wants to see */
+  this->scaleLevel = atomic_load(&this->requestedScale);
+  if (this->scaleLevel && !this->cropWidth)
+  {
+    const unsigned int width  = (this->targetWidth  >> this->scaleLevel) & ~3U;
+    const unsigned int height = (this->targetHeight >> this->scaleLevel) & ~1U;
+    if (width && height)
+    {
+      DEBUG_INFO("Adaptive scale    : 1/%u", 1U << this->scaleLevel);
+      this->downsample   = true;
+      this->targetWidth  = width;
+      this->targetHeight = height;
+    }
+  }
+
+  this->crop = false;
+  if (this->cropWidth)
+  {
+    if (this->cropX + this->cropWidth  > this->width ||
+        this->cropY + this->cropHeight > this->height)
+    {
+      DEBUG_ERROR("The crop region %ux%u+%u+%u is outside of the %ux%u output",
+          this->cropWidth, this->cropHeight, this->cropX, this->cropY,
+          this->width, this->height);
+      goto fail;
+    }
+
+    if (this->downsample)
+    {
+      DEBUG_WARN("Downsampling is not supported with a crop region, disabled");
+      this->downsample = false;
+    }
+
+    this->crop         = true;
+    this->targetWidth  = this->cropWidth;
+    this->targetHeight = this->cropHeight;
+    DEBUG_INFO("Crop Region       : %ux%u+%u+%u",
+        this->cropWidth, this->cropHeight, this->cropX, this->cropY);
   }
 
   DEBUG_INFO("Request Size      : %u x %u", this->targetWidth, this->targetHeight);
 
   const char * copyBackend = option_get_string("dxgi", "copyBackend");
+  if (this->nv12)
+  {
+    if (this->format != CAPTURE_FMT_BGRA && this->format != CAPTURE_FMT_RGBA)
+      DEBUG_WARN("NV12 conversion needs an 8-bit source format, disabled");
+    else if ((this->targetWidth & 3) || (this->targetHeight & 1))
+      DEBUG_WARN("NV12 conversion needs a width that is a multiple of 4 and an even height, disabled");
+    else if (strcasecmp(copyBackend, "d3d11"))
+      DEBUG_WARN("NV12 conversion is only supported by the d3d11 copy backend, disabled");
+    else
+      this->format = CAPTURE_FMT_NV12;
+  }
+  DEBUG_INFO("NV12 conversion   : %s",
+      this->format == CAPTURE_FMT_NV12 ? "enabled" : "disabled");
+
+  if (this->hdrPQ && this->format == CAPTURE_FMT_RGBA16F)
+  {
+    if (strcasecmp(copyBackend, "d3d11"))
+      DEBUG_WARN("PQ encoding is only supported by the d3d11 copy backend, disabled");
+    else
+    {
+      this->format = CAPTURE_FMT_RGBA10_PQ;
+      this->bpp    = 4;
+    }
+  }
+  DEBUG_INFO("HDR PQ encoding   : %s",
+      this->format == CAPTURE_FMT_RGBA10_PQ ? "enabled" : "disabled");
+
   for (int i = 0; i < ARRAY_LENGTH(backends); ++i)
   {
     if (!strcasecmp(copyBackend, backends[i]->code))
@@ -666,10 +1036,42 @@ next_output:
   DEBUG_INFO("Copy backend      : %s", this->backend->name);
   DEBUG_INFO("Damage-aware copy : %s", this->disableDamage  ? "disabled" : "enabled" );
 
+  this->compositeCursorActive = false;
+  if (this->compositeCursor)
+  {
+    if (this->wgc)
+      DEBUG_INFO("Windows.Graphics.Capture draws the cursor itself");
+    else if (!this->backend->updateCursor)
+      DEBUG_WARN("The %s backend can not composite the cursor, disabled",
+          this->backend->name);
+    else if (this->crop || this->downsample ||
+        (this->format != CAPTURE_FMT_BGRA && this->format != CAPTURE_FMT_RGBA))
+      DEBUG_WARN("Cursor compositing needs an uncropped, full size, 8-bit frame, disabled");
+    else
+      this->compositeCursorActive = true;
+  }
+  DEBUG_INFO("Composite cursor  : %s", this->compositeCursorActive ? "enabled" : "disabled");
+  this->cursor.visible   = false;
+  this->cursor.lastValid = false;
+  this->cursor.width     = 0;
+  this->cursor.height    = 0;
+
+  /* Windows.Graphics.Capture reports no damage, without the diff every frame
+   * would be copied in full */
+  this->gpuDiffActive = false;
+  if ((this->gpuDiff || this->wgc) && !this->disableDamage)
+  {
+    if (dxgi_gpuDiffInit(this))
+      this->gpuDiffActive = true;
+    else
+      DEBUG_WARN("Failed to initialize the GPU diff, it will be disabled");
+  }
+  DEBUG_INFO("GPU diff          : %s", this->gpuDiffActive ? "enabled" : "disabled");
+
   for (int i = 0; i < this->maxTextures; ++i)
     this->texture[i].texDamageCount = -1;
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for (int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
     this->frameDamage[i].count = -1;
 
   QueryPerformanceFrequency(&this->perfFreq) ;
@@ -691,6 +1093,11 @@ static bool dxgi_deinit(void)
 {
   DEBUG_ASSERT(this);
 
+  // NaN until a frame has been acquired, which fails this comparison
+  const double latency = runningavg_calc(this->avgAcquireLatency);
+  if (latency > 0.0)
+    DEBUG_INFO("Acquire latency   : %.2f ms", latency / 1000.0);
+
   for (int i = 0; i < this->maxTextures; ++i)
   {
     if (this->texture[i].map)
@@ -700,9 +1107,15 @@ static bool dxgi_deinit(void)
     }
   }
 
-  if (this->dup)
+  if (this->dup || this->wgc)
     dxgi_releaseFrame();
 
+  if (this->gpuDiffActive)
+  {
+    dxgi_gpuDiffFree();
+    this->gpuDiffActive = false;
+  }
+
   if (this->backend)
   {
     this->backend->free();
@@ -721,6 +1134,8 @@ static bool dxgi_deinit(void)
     this->dup = NULL;
   }
 
+  dxgi_wgcFree();
+
   if (this->deviceContext)
   {
     ID3D11DeviceContext_Release(this->deviceContext);
@@ -776,6 +1191,10 @@ static void dxgi_free(void)
   if (this->initialized)
     dxgi_deinit();
 
+  metrics_unregister("lg_host_dxgi_cross_adapter");
+  runningavg_free(&this->avgAcquireLatency);
+  free(this->cursor.shape);
+  free(this->dirtyRects);
   free(this->texture);
   free(this);
   this = NULL;
@@ -804,19 +1223,78 @@ static void rectToFrameDamageRect(RECT * src, FrameDamageRect * dst)
 {
   *dst = (FrameDamageRect)
   {
-    .x      = src->left                >> this->downsampleLevel,
-    .y      = src->top                 >> this->downsampleLevel,
-    .width  = (src->right - src->left) >> this->downsampleLevel,
-    .height = (src->bottom - src->top) >> this->downsampleLevel
+    .x      = src->left,
+    .y      = src->top,
+    .width  = src->right - src->left,
+    .height = src->bottom - src->top
   };
+
+  if (this->downsample)
+    dxgi_downsampleRectToTarget(this, dst);
+}
+
+/* there were more dirty rects than a frame can carry, record them as tiles
+ * and build the rects from those. The map is in frame coordinates so it is not
+ * built when cropping, and move rects are only generated by Windows 8 and
+ * earlier, if there are any the full frame is damaged */
+static void computeFrameDamageMap(Texture * tex, UINT size)
+{
+  const unsigned int width  = this->targetWidth;
+  const unsigned int height = this->targetHeight;
+  if (this->crop || !rectsDamageMapFits(width, height))
+    return;
+
+  if (size > this->dirtyRectsSize)
+  {
+    RECT * rects = realloc(this->dirtyRects, size);
+    if (!rects)
+    {
+      DEBUG_ERROR("out of memory");
+      return;
+    }
+
+    this->dirtyRects     = rects;
+    this->dirtyRectsSize = size;
+  }
+
+  UINT dirtyRectsBufferSizeRequired;
+  if (FAILED(IDXGIOutputDuplication_GetFrameDirtyRects(this->dup,
+        this->dirtyRectsSize, this->dirtyRects,
+        &dirtyRectsBufferSizeRequired)))
+    return;
+
+  UINT moveRectsBufferSizeRequired;
+  if (FAILED(IDXGIOutputDuplication_GetFrameMoveRects(this->dup,
+        0, NULL, &moveRectsBufferSizeRequired)) ||
+      moveRectsBufferSizeRequired > 0)
+    return;
+
+  const unsigned int tilesX = rectsDamageMapTiles(width );
+  const unsigned int tilesY = rectsDamageMapTiles(height);
+  memset(tex->damageMap, 0, rectsDamageMapStride(tilesX) * tilesY);
+
+  const int count = dirtyRectsBufferSizeRequired / sizeof(*this->dirtyRects);
+  for (int i = 0; i < count; ++i)
+  {
+    FrameDamageRect rect;
+    rectToFrameDamageRect(this->dirtyRects + i, &rect);
+    rectsDamageMapAdd(tex->damageMap, tilesX, tilesY, &rect, 1);
+  }
+
+  tex->damageMapValid   = true;
+  tex->damageMapWidth   = tilesX;
+  tex->damageMapHeight  = tilesY;
+  tex->damageRectsCount = rectsFromDamageMap(tex->damageRects,
+      KVMFR_MAX_DAMAGE_RECTS, tex->damageMap, tilesX, tilesY, width, height);
 }
 
 static void computeFrameDamage(Texture * tex)
 {
   // By default, damage the full frame.
   tex->damageRectsCount = 0;
+  tex->damageMapValid   = false;
 
-  if (this->disableDamage)
+  if (this->disableDamage || this->wgc)
     return;
 
   const int maxDamageRectsCount = ARRAY_LENGTH(tex->damageRects);
@@ -824,9 +1302,17 @@ static void computeFrameDamage(Texture * tex)
   // Compute dirty rectangles.
   RECT dirtyRects[maxDamageRectsCount];
   UINT dirtyRectsBufferSizeRequired;
-  if (FAILED(IDXGIOutputDuplication_GetFrameDirtyRects(this->dup,
+  const HRESULT status = IDXGIOutputDuplication_GetFrameDirtyRects(this->dup,
         sizeof(dirtyRects), dirtyRects,
-        &dirtyRectsBufferSizeRequired)))
+        &dirtyRectsBufferSizeRequired);
+
+  if (status == DXGI_ERROR_MORE_DATA)
+  {
+    computeFrameDamageMap(tex, dirtyRectsBufferSizeRequired);
+    return;
+  }
+
+  if (FAILED(status))
     return;
 
   const int dirtyRectsCount = dirtyRectsBufferSizeRequired / sizeof(*dirtyRects);
@@ -878,6 +1364,49 @@ static void computeFrameDamage(Texture * tex)
   tex->damageRectsCount = dirtyRectsCount + actuallyMovedRectsCount;
 }
 
+/* move the damage into the crop region, the rects are in output coordinates
+ * but the copies and the client work in region coordinates */
+static void cropFrameDamage(Texture * tex)
+{
+  if (!this->crop || tex->damageRectsCount == 0)
+    return;
+
+  const int x1 = this->cropX, x2 = this->cropX + this->cropWidth;
+  const int y1 = this->cropY, y2 = this->cropY + this->cropHeight;
+
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < tex->damageRectsCount; ++i)
+  {
+    const FrameDamageRect * rect = tex->damageRects + i;
+    const int l = max((int)rect->x, x1);
+    const int t = max((int)rect->y, y1);
+    const int r = min((int)(rect->x + rect->width ), x2);
+    const int b = min((int)(rect->y + rect->height), y2);
+    if (l >= r || t >= b)
+      continue;
+
+    tex->damageRects[count++] = (FrameDamageRect)
+    {
+      .x      = l - x1,
+      .y      = t - y1,
+      .width  = r - l,
+      .height = b - t
+    };
+  }
+
+  // nothing in the region changed, but no rects means full damage
+  if (count == 0)
+    tex->damageRects[count++] = (FrameDamageRect)
+    {
+      .x      = 0,
+      .y      = 0,
+      .width  = 1,
+      .height = 1
+    };
+
+  tex->damageRectsCount = count;
+}
+
 static void computeTexDamage(Texture * tex)
 {
   if (tex->texDamageCount < 0 || tex->damageRectsCount == 0 ||
@@ -892,6 +1421,282 @@ static void computeTexDamage(Texture * tex)
   }
 }
 
+/* access to the duplication is lost on desktop switches (UAC, the lock
+ * screen) and mode changes. When the output mode is unchanged only the
+ * duplication itself needs recreating, the device, the textures and the
+ * copy backend stay as they are and the client keeps the last frame. */
+static CaptureResult dxgi_reduplicate(void)
+{
+  // the item was closed or resized, the capture must start over
+  if (this->wgc)
+    return CAPTURE_RESULT_REINIT;
+
+  LARGE_INTEGER start, end;
+  QueryPerformanceCounter(&start);
+
+  LOCKED({
+    if (this->needsRelease)
+      IDXGIOutputDuplication_ReleaseFrame(this->dup);
+    IDXGIOutputDuplication_Release(this->dup);
+  });
+  this->dup          = NULL;
+  this->needsRelease = false;
+
+  // follow the input desktop if it has changed
+  if (this->desktop)
+  {
+    HDESK desktop = OpenInputDesktop(0, FALSE, GENERIC_READ);
+    if (desktop)
+    {
+      if (SetThreadDesktop(desktop))
+      {
+        CloseDesktop(this->desktop);
+        this->desktop = desktop;
+      }
+      else
+        CloseDesktop(desktop);
+    }
+  }
+
+  if (!dxgi_duplicate())
+    return CAPTURE_RESULT_REINIT;
+
+  DXGI_OUTDUPL_DESC dupDesc;
+  IDXGIOutputDuplication_GetDesc(this->dup, &dupDesc);
+  if (dupDesc.ModeDesc.Width  != this->dupMode.Width  ||
+      dupDesc.ModeDesc.Height != this->dupMode.Height ||
+      dupDesc.ModeDesc.Format != this->dupMode.Format ||
+      dupDesc.Rotation        != this->dupRotation)
+  {
+    DEBUG_INFO("The output mode has changed, reinitializing");
+    return CAPTURE_RESULT_REINIT;
+  }
+
+  // the damage history does not carry over to the new duplication
+  for (int i = 0; i < this->maxTextures; ++i)
+    this->texture[i].texDamageCount = -1;
+
+  QueryPerformanceCounter(&end);
+  DEBUG_INFO("Re-duplicated the output in %.2f ms",
+      (end.QuadPart - start.QuadPart) * 1000.0 / this->perfFreq.QuadPart);
+
+  return CAPTURE_RESULT_TIMEOUT;
+}
+
+/* the number of frames the ring depth is evaluated over */
+#define TEX_DEPTH_WINDOW 120
+
+/* Frames that arrive while every texture in use is still waiting to be mapped
+ * are skipped, so the ring needs to be as deep as the map latency in frames,
+ * any deeper only adds latency. Grow when frames are being skipped and shrink
+ * when the deepest slot has not been needed for a while, the writer picks the
+ * index that follows each texture so the reader follows the change without
+ * any further synchronisation. */
+static int dxgi_nextTexIndex(int index, int pending)
+{
+  if (this->adaptiveTextures)
+  {
+    this->texDepthPeak = max(this->texDepthPeak, pending);
+
+    if (++this->texDepthFrames == TEX_DEPTH_WINDOW)
+    {
+      int depth = this->texDepth;
+      if (this->texDepthSkips > 1)
+        depth = min(depth + 1, this->maxTextures);
+      else if (!this->texDepthSkips && this->texDepthPeak + 1 < depth)
+        depth = max(depth - 1, min(2, this->maxTextures));
+
+      if (depth != this->texDepth)
+      {
+        DEBUG_INFO("Texture ring depth: %d -> %d (peak %d, skipped %d)",
+            this->texDepth, depth, this->texDepthPeak, this->texDepthSkips);
+        this->texDepth = depth;
+      }
+
+      this->texDepthFrames = 0;
+      this->texDepthSkips  = 0;
+      this->texDepthPeak   = 0;
+    }
+  }
+
+  return index + 1 >= this->texDepth ? 0 : index + 1;
+}
+
+static inline uint64_t qpcToMicrotime(uint64_t qpc)
+{
+  // the same conversion microtime uses so the two can be compared
+  return qpc / (this->perfFreq.QuadPart / 1000000LL);
+}
+
+/* DWM composes the desktop once per refresh and a new frame only becomes
+ * available to the duplication then. Rather than polling (and holding the
+ * device lock) across the whole interval, sleep until just before the next
+ * vblank and acquire with a timeout that spans it. */
+static UINT dxgi_acquireTimeout(void)
+{
+  const UINT timeout = this->useAcquireLock ? 1 : 1000;
+  if (!this->vblankAlign)
+    return timeout;
+
+  DWM_TIMING_INFO info = { .cbSize = sizeof(info) };
+  if (FAILED(DwmGetCompositionTimingInfo(NULL, &info)) ||
+      !info.qpcRefreshPeriod)
+    return timeout;
+
+  const uint64_t now    = microtime();
+  const uint64_t vblank = qpcToMicrotime(info.qpcVBlank);
+  const uint64_t period = qpcToMicrotime(info.qpcRefreshPeriod);
+  if (!period)
+    return timeout;
+
+  uint64_t next = vblank;
+  if (now >= next)
+    next += ((now - next) / period + 1) * period;
+
+  // wake early enough to absorb the timer and scheduling jitter
+  const uint64_t margin = 1000;
+  if (next - now > margin * 2)
+    lgSleepUntil(next - margin);
+
+  return this->useAcquireLock ? 3 : 1000;
+}
+
+/* tracks the pointer for compositing, changed is set when the frame needs to
+ * be updated for it */
+static CaptureResult dxgi_updateCursor(const DXGI_OUTDUPL_FRAME_INFO * frameInfo,
+    bool * changed)
+{
+  *changed = false;
+
+  if (frameInfo->PointerShapeBufferSize > 0)
+  {
+    if (frameInfo->PointerShapeBufferSize > this->cursor.shapeSize)
+    {
+      void * shape = realloc(this->cursor.shape,
+          frameInfo->PointerShapeBufferSize);
+      if (!shape)
+      {
+        DEBUG_ERROR("out of memory");
+        return CAPTURE_RESULT_ERROR;
+      }
+      this->cursor.shape     = shape;
+      this->cursor.shapeSize = frameInfo->PointerShapeBufferSize;
+    }
+
+    HRESULT status;
+    UINT    size;
+    DXGI_OUTDUPL_POINTER_SHAPE_INFO shapeInfo;
+    bool    uploaded = false;
+    LOCKED({
+      status = IDXGIOutputDuplication_GetFramePointerShape(this->dup,
+          this->cursor.shapeSize, this->cursor.shape, &size, &shapeInfo);
+      if (SUCCEEDED(status))
+        uploaded = this->backend->updateCursor(&shapeInfo, this->cursor.shape);
+    });
+
+    CaptureResult result = dxgi_hResultToCaptureResult(status);
+    if (result != CAPTURE_RESULT_OK)
+    {
+      if (result == CAPTURE_RESULT_ERROR)
+        DEBUG_WINERROR("Failed to get the new pointer shape", status);
+      return result;
+    }
+
+    if (uploaded)
+    {
+      this->cursor.width  = shapeInfo.Width;
+      this->cursor.height =
+        shapeInfo.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MONOCHROME ?
+        shapeInfo.Height / 2 : shapeInfo.Height;
+    }
+    else
+      this->cursor.width = this->cursor.height = 0;
+    *changed = true;
+  }
+
+  if (frameInfo->LastMouseUpdateTime.QuadPart)
+  {
+    const bool visible = frameInfo->PointerPosition.Visible;
+    if (visible != this->cursor.visible ||
+        (visible &&
+         (frameInfo->PointerPosition.Position.x != this->cursor.x ||
+          frameInfo->PointerPosition.Position.y != this->cursor.y)))
+    {
+      this->cursor.visible = visible;
+      if (visible)
+      {
+        this->cursor.x = frameInfo->PointerPosition.Position.x;
+        this->cursor.y = frameInfo->PointerPosition.Position.y;
+      }
+      *changed = true;
+    }
+  }
+
+  return CAPTURE_RESULT_OK;
+}
+
+/* the area the cursor covers in the frame, and the area it covered in the
+ * last frame, need to be copied again when it is composited */
+static void addCursorDamage(Texture * tex, bool frameChanged)
+{
+  FrameDamageRect rect = { 0 };
+  bool valid = false;
+  if (this->cursor.visible && this->cursor.width && this->cursor.height)
+  {
+    const int x1 = max(this->cursor.x, 0);
+    const int y1 = max(this->cursor.y, 0);
+    const int x2 = min(this->cursor.x + (int)this->cursor.width , (int)this->width );
+    const int y2 = min(this->cursor.y + (int)this->cursor.height, (int)this->height);
+    if (x1 < x2 && y1 < y2)
+    {
+      rect  = (FrameDamageRect){ .x = x1, .y = y1,
+        .width = x2 - x1, .height = y2 - y1 };
+      valid = true;
+    }
+  }
+
+  // a frame with no damage rects is a full frame update
+  if (!frameChanged)
+    tex->damageRectsCount = 0;
+  else if (tex->damageRectsCount == 0)
+    goto done;
+
+  const int needed = (valid ? 1 : 0) + (this->cursor.lastValid ? 1 : 0);
+  if (tex->damageRectsCount + needed > KVMFR_MAX_DAMAGE_RECTS)
+  {
+    tex->damageRectsCount = 0;
+    tex->damageMapValid   = false;
+    goto done;
+  }
+
+  if (valid)
+    tex->damageRects[tex->damageRectsCount++] = rect;
+  if (this->cursor.lastValid)
+    tex->damageRects[tex->damageRectsCount++] = this->cursor.lastRect;
+
+  // the damage map no longer matches the rects
+  tex->damageMapValid = false;
+
+  // nothing visible changed, but no rects means full damage
+  if (tex->damageRectsCount == 0)
+    tex->damageRects[tex->damageRectsCount++] = (FrameDamageRect)
+    {
+      .x      = 0,
+      .y      = 0,
+      .width  = 1,
+      .height = 1
+    };
+
+done:
+  this->cursor.lastValid = valid;
+  this->cursor.lastRect  = rect;
+}
+
+static void dxgi_setScaleLevel(unsigned int level)
+{
+  atomic_store(&this->requestedScale, level);
+}
+
 static CaptureResult dxgi_capture(void)
 {
   DEBUG_ASSERT(this);
@@ -912,8 +1717,14 @@ static CaptureResult dxgi_capture(void)
   void *         pointerShape     = NULL;
   UINT           pointerShapeSize = 0;
 
+  if (atomic_load(&this->requestedScale) != this->scaleLevel)
+    return CAPTURE_RESULT_REINIT;
+
   // release the prior frame
   result = dxgi_releaseFrame();
+  if (result == CAPTURE_RESULT_REINIT)
+    return dxgi_reduplicate();
+
   if (result != CAPTURE_RESULT_OK)
     return result;
 
@@ -924,14 +1735,20 @@ static CaptureResult dxgi_capture(void)
   if (this->dwmFlush)
     DwmFlush();
 
-  if (this->useAcquireLock)
+  const UINT timeout = dxgi_acquireTimeout();
+  if (this->wgc)
+    status = dxgi_wgcAcquire(&frameInfo, &res);
+  else if (this->useAcquireLock)
   {
     LOCKED({
-        status = IDXGIOutputDuplication_AcquireNextFrame(this->dup, 1, &frameInfo, &res);
+        status = IDXGIOutputDuplication_AcquireNextFrame(this->dup, timeout, &frameInfo, &res);
     });
   }
   else
-    status = IDXGIOutputDuplication_AcquireNextFrame(this->dup, 1000, &frameInfo, &res);
+    status = IDXGIOutputDuplication_AcquireNextFrame(this->dup, timeout, &frameInfo, &res);
+
+  if (status == DXGI_ERROR_ACCESS_LOST)
+    return dxgi_reduplicate();
 
   result = dxgi_hResultToCaptureResult(status);
   if (result != CAPTURE_RESULT_OK)
@@ -942,8 +1759,30 @@ static CaptureResult dxgi_capture(void)
   }
 
   this->needsRelease = true;
-  if (frameInfo.LastPresentTime.QuadPart != 0)
+
+  bool cursorChanged = false;
+  if (this->compositeCursorActive)
+  {
+    result = dxgi_updateCursor(&frameInfo, &cursorChanged);
+    if (result != CAPTURE_RESULT_OK)
+    {
+      IDXGIResource_Release(res);
+      return result;
+    }
+  }
+
+  const bool frameChanged = frameInfo.LastPresentTime.QuadPart != 0;
+  if (frameChanged || cursorChanged)
   {
+    // how long the frame was available before we picked it up
+    if (frameChanged)
+    {
+      const uint64_t presented = qpcToMicrotime(frameInfo.LastPresentTime.QuadPart);
+      const uint64_t now       = microtime();
+      if (now > presented)
+        runningavg_push(this->avgAcquireLatency, now - presented);
+    }
+
     tex = &this->texture[this->texWIndex];
 
     // check if the texture is free, if not skip the frame to keep up
@@ -964,14 +1803,17 @@ static CaptureResult dxgi_capture(void)
       // and must invalidate all the textures.
       for (int i = 0; i < this->maxTextures; ++i)
         this->texture[i].texDamageCount = -1;
+
+      if (this->adaptiveTextures)
+        ++this->texDepthSkips;
     }
   }
 
   IDXGIResource_Release(res);
 
   // if the pointer shape has changed
-  uint32_t bufferSize;
-  if (frameInfo.PointerShapeBufferSize > 0)
+  uint32_t bufferSize = frameInfo.PointerShapeBufferSize;
+  if (frameInfo.PointerShapeBufferSize > 0 && !this->compositeCursorActive)
   {
     if (!this->getPointerBufferFn(&pointerShape, &bufferSize))
       DEBUG_WARN("Failed to obtain a buffer for the pointer shape");
@@ -989,6 +1831,14 @@ static CaptureResult dxgi_capture(void)
       }
       else
         computeFrameDamage(tex);
+
+      if (this->gpuDiffActive && frameChanged)
+        LOCKED({ dxgi_gpuDiffUpdate(tex, src); });
+
+      if (this->compositeCursorActive)
+        addCursorDamage(tex, frameChanged);
+
+      cropFrameDamage(tex);
       computeTexDamage(tex);
 
       if (!this->backend->copyFrame(tex, src))
@@ -1015,6 +1865,15 @@ static CaptureResult dxgi_capture(void)
           t->texDamageCount = -1;
       }
 
+      // pick the next write index, the reader follows it from this texture
+      const int next = dxgi_nextTexIndex(this->texWIndex,
+          atomic_load_explicit(&this->texReady, memory_order_relaxed) + 1);
+      tex->nextIndex = next;
+
+      // a frame that only moved the composited cursor was not presented
+      tex->presentTime = frameChanged ?
+        qpcToMicrotime(frameInfo.LastPresentTime.QuadPart) : 0;
+
       // set the state, and signal
       tex->state     = TEXTURE_STATE_PENDING_MAP;
       tex->formatVer = this->formatVer;
@@ -1022,11 +1881,11 @@ static CaptureResult dxgi_capture(void)
         lgSignalEvent(this->frameEvent);
 
       // advance the write index
-      if (++this->texWIndex == this->maxTextures)
-        this->texWIndex = 0;
+      this->texWIndex = next;
 
       // update the last frame time
-      this->frameTime.QuadPart = frameInfo.LastPresentTime.QuadPart;
+      if (frameChanged)
+        this->frameTime.QuadPart = frameInfo.LastPresentTime.QuadPart;
     }
 
     if (copyPointer)
@@ -1071,7 +1930,7 @@ static CaptureResult dxgi_capture(void)
     }
   }
 
-  if (frameInfo.LastMouseUpdateTime.QuadPart)
+  if (frameInfo.LastMouseUpdateTime.QuadPart && !this->compositeCursorActive)
   {
     /* the pointer position is only valid if the pointer is visible */
     if (frameInfo.PointerPosition.Visible &&
@@ -1079,12 +1938,10 @@ static CaptureResult dxgi_capture(void)
        frameInfo.PointerPosition.Position.y != this->lastPointerY))
     {
       pointer.positionUpdate = true;
-      pointer.x =
-        this->lastPointerX =
-        frameInfo.PointerPosition.Position.x;
-      pointer.y =
-        this->lastPointerY =
-        frameInfo.PointerPosition.Position.y;
+      this->lastPointerX = frameInfo.PointerPosition.Position.x;
+      this->lastPointerY = frameInfo.PointerPosition.Position.y;
+      pointer.x = this->lastPointerX - (int)this->cropX;
+      pointer.y = this->lastPointerY - (int)this->cropY;
       postPointer = true;
     }
 
@@ -1131,9 +1988,22 @@ static CaptureResult dxgi_waitFrame(CaptureFrame * frame, const size_t maxFrameS
 
   const unsigned int maxHeight = maxFrameSize / this->pitch;
 
+  /* the chroma plane follows the full height of the luma plane so NV12 frames
+   * can't be truncated, fall back to RGB which can */
+  if (this->format == CAPTURE_FMT_NV12 &&
+      maxHeight < kvmfrFrameRows(FRAME_TYPE_NV12, this->targetHeight))
+  {
+    DEBUG_WARN("The NV12 frame does not fit, disabling NV12 conversion");
+    this->backend->unmapTexture(tex);
+    tex->state = TEXTURE_STATE_UNUSED;
+    this->nv12 = false;
+    return CAPTURE_RESULT_REINIT;
+  }
+
   frame->formatVer        = tex->formatVer;
-  frame->screenWidth      = this->width;
-  frame->screenHeight     = this->height;
+  frame->presentTime      = tex->presentTime;
+  frame->screenWidth      = this->crop ? this->cropWidth  : this->width;
+  frame->screenHeight     = this->crop ? this->cropHeight : this->height;
   frame->frameWidth       = this->targetWidth;
   frame->frameHeight      = min(maxHeight, this->targetHeight);
   frame->truncated        = maxHeight < this->targetHeight;
@@ -1146,6 +2016,15 @@ static CaptureResult dxgi_waitFrame(CaptureFrame * frame, const size_t maxFrameS
   memcpy(frame->damageRects, tex->damageRects,
       tex->damageRectsCount * sizeof(*tex->damageRects));
 
+  frame->damageMapValid = tex->damageMapValid;
+  if (tex->damageMapValid)
+  {
+    frame->damageMapWidth  = tex->damageMapWidth;
+    frame->damageMapHeight = tex->damageMapHeight;
+    memcpy(frame->damageMap, tex->damageMap,
+        rectsDamageMapStride(tex->damageMapWidth) * tex->damageMapHeight);
+  }
+
   atomic_fetch_sub_explicit(&this->texReady, 1, memory_order_release);
   return CAPTURE_RESULT_OK;
 }
@@ -1158,42 +2037,40 @@ static CaptureResult dxgi_getFrame(FrameBuffer * frame,
 
   Texture * tex = &this->texture[this->texRIndex];
 
+  // NV12 needs a rect for each plane
+  const bool nv12 = this->format == CAPTURE_FMT_NV12;
   struct FrameDamage * damage = this->frameDamage + frameIndex;
-  bool damageAll = tex->damageRectsCount == 0 || damage->count < 0 ||
-      damage->count + tex->damageRectsCount > KVMFR_MAX_DAMAGE_RECTS;
+  const bool damageAll = !rectsBeginFrameDamage(damage, tex->damageRects,
+      tex->damageRectsCount, KVMFR_MAX_DAMAGE_RECTS / (nv12 ? 2 : 1),
+      this->targetWidth, height);
+
+  const unsigned int rows = nv12 ?
+    kvmfrFrameRows(FRAME_TYPE_NV12, height) : height;
 
   if (damageAll)
-    framebuffer_write(frame, tex->map, this->pitch * height);
-  else
+    framebuffer_write(frame, tex->map, this->pitch * rows);
+  else if (nv12)
   {
-    memcpy(damage->rects + damage->count, tex->damageRects,
-      tex->damageRectsCount * sizeof(*tex->damageRects));
-    damage->count += tex->damageRectsCount;
+    FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+    memcpy(rects, damage->rects, damage->count * sizeof(*rects));
+    const int count = rectsToNV12(rects, damage->count, height);
+    rectsBufferToFramebuffer(rects, count, frame, this->pitch, rows,
+      tex->map, this->pitch);
+  }
+  else
     rectsBufferToFramebuffer(damage->rects, damage->count, frame, this->pitch,
       height, tex->map, this->pitch);
-  }
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
-  {
-    struct FrameDamage * damage = this->frameDamage + i;
-    if (i == frameIndex)
-      damage->count = 0;
-    else if (tex->damageRectsCount > 0 && damage->count >= 0 &&
-             damage->count + tex->damageRectsCount <= KVMFR_MAX_DAMAGE_RECTS)
-    {
-      memcpy(damage->rects + damage->count, tex->damageRects,
-        tex->damageRectsCount * sizeof(*tex->damageRects));
-      damage->count += tex->damageRectsCount;
-    }
-    else
-      damage->count = -1;
-  }
+  rectsEndFrameDamage(this->frameDamage, LGMP_Q_FRAME_LEN_MAX, frameIndex,
+      tex->damageRects, tex->damageRectsCount, this->targetWidth, height);
+
+  // read before releasing the texture, the writer may reuse it right away
+  const int next = tex->nextIndex;
 
   this->backend->unmapTexture(tex);
   tex->state = TEXTURE_STATE_UNUSED;
 
-  if (++this->texRIndex == this->maxTextures)
-    this->texRIndex = 0;
+  this->texRIndex = next;
 
   return CAPTURE_RESULT_OK;
 }
@@ -1206,6 +2083,13 @@ static CaptureResult dxgi_releaseFrame(void)
 
   this->backend->preRelease();
 
+  if (this->wgc)
+  {
+    dxgi_wgcRelease();
+    this->needsRelease = false;
+    return CAPTURE_RESULT_OK;
+  }
+
   HRESULT status;
   LOCKED({status = IDXGIOutputDuplication_ReleaseFrame(this->dup);});
   switch(status)
@@ -1246,5 +2130,6 @@ struct CaptureInterface Capture_DXGI =
   .free            = dxgi_free,
   .capture         = dxgi_capture,
   .waitFrame       = dxgi_waitFrame,
-  .getFrame        = dxgi_getFrame
+  .getFrame        = dxgi_getFrame,
+  .setScaleLevel   = dxgi_setScaleLevel
 };
@@ -27,6 +27,7 @@
 #include "common/KVMFR.h"
 #include "common/event.h"
 #include "common/locking.h"
+#include "common/rects.h"
 #include "common/types.h"
 #include "interface/capture.h"
 
@@ -43,21 +44,23 @@ typedef struct Texture
   volatile enum TextureState state;
   void                     * map;
   uint64_t                   copyTime;
+  uint64_t                   presentTime;
+  int                        nextIndex;
   uint32_t                   damageRectsCount;
   FrameDamageRect            damageRects[KVMFR_MAX_DAMAGE_RECTS];
   int32_t                    texDamageCount;
   FrameDamageRect            texDamageRects[KVMFR_MAX_DAMAGE_RECTS];
 
+  // the tile damage when there were too many dirty rects
+  bool                       damageMapValid;
+  uint16_t                   damageMapWidth;
+  uint16_t                   damageMapHeight;
+  uint8_t                    damageMap[KVMFR_DAMAGE_MAP_SIZE];
+
   void                     * impl;
 }
 Texture;
 
-struct FrameDamage
-{
-  int             count;
-  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
-};
-
 struct DXGICopyBackend;
 
 struct DXGIInterface
@@ -70,16 +73,29 @@ struct DXGIInterface
   IDXGIFactory1            * factory;
   IDXGIAdapter1            * adapter;
   IDXGIOutput              * output;
+  bool                       crossAdapter;
   ID3D11Device             * device;
   ID3D11DeviceContext      * deviceContext;
   LG_Lock                    deviceContextLock;
   bool                       debug;
   bool                       useAcquireLock;
   bool                       dwmFlush;
+  bool                       vblankAlign;
+  RunningAvg                 avgAcquireLatency;
   bool                       disableDamage;
+  bool                       gpuDiff, gpuDiffActive;
+  bool                       nv12, hdrPQ;
+  bool                       wgc;
   D3D_FEATURE_LEVEL          featureLevel;
   IDXGIOutputDuplication   * dup;
+  DXGI_MODE_DESC             dupMode;
+  DXGI_MODE_ROTATION         dupRotation;
   int                        maxTextures;
+  bool                       adaptiveTextures;
+  int                        texDepth;
+  int                        texDepthFrames;
+  int                        texDepthSkips;
+  int                        texDepthPeak;
   Texture                  * texture;
   int                        texRIndex;
   int                        texWIndex;
@@ -95,7 +111,11 @@ struct DXGIInterface
   unsigned int    formatVer;
   unsigned int    width , targetWidth ;
   unsigned int    height, targetHeight;
-  unsigned int    downsampleLevel;
+  bool            downsample;
+  atomic_uint     requestedScale; // the adaptive scale level asked for
+  unsigned int    scaleLevel;     // and the one the output was set up with
+  bool            crop;
+  unsigned int    cropX, cropY, cropWidth, cropHeight;
   unsigned int    pitch;
   unsigned int    stride;
   unsigned int    bpp;
@@ -105,7 +125,25 @@ struct DXGIInterface
   int  lastPointerX, lastPointerY;
   bool lastPointerVisible;
 
-  struct FrameDamage frameDamage[LGMP_Q_FRAME_LEN];
+  // the pointer when it is composited into the frame instead of being sent
+  bool compositeCursor, compositeCursorActive;
+  struct
+  {
+    bool            visible;
+    int             x, y;
+    unsigned int    width, height;
+    bool            lastValid;
+    FrameDamageRect lastRect;
+    void          * shape;
+    UINT            shapeSize;
+  }
+  cursor;
+
+  struct FrameDamage frameDamage[LGMP_Q_FRAME_LEN_MAX];
+
+  // dirty rects that did not fit on the stack, grown as needed
+  RECT * dirtyRects;
+  UINT   dirtyRectsSize;
 };
 
 struct DXGICopyBackend
@@ -118,6 +156,19 @@ struct DXGICopyBackend
   CaptureResult (*mapTexture)(Texture * tex);
   void (*unmapTexture)(Texture * tex);
   void (*preRelease)(void);
+
+  /* optional, upload a new pointer shape to composite into the frame, called
+   * with the device context lock held */
+  bool (*updateCursor)(const DXGI_OUTDUPL_POINTER_SHAPE_INFO * info,
+      const void * shape);
 };
 
 const char * GetDXGIFormatStr(DXGI_FORMAT format);
+
+// compile the HLSL shader code with the entry point main
+bool CompileComputeShader(ID3D11Device * device, const char * name,
+    const char * code, size_t size, ID3D11ComputeShader ** shader);
+bool CompileVertexShader(ID3D11Device * device, const char * name,
+    const char * code, size_t size, ID3D11VertexShader ** shader);
+bool CompilePixelShader(ID3D11Device * device, const char * name,
+    const char * code, size_t size, ID3D11PixelShader ** shader);
@@ -0,0 +1,342 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "gpu_diff.h"
+#include "downsample.h"
+
+#include "common/debug.h"
+#include "common/windebug.h"
+#include "common/rects.h"
+#include "common/util.h"
+
+#include <stdlib.h>
+
+// tiles are 32x32 pixels to match the compute shader group
+#define TILE_SHIFT 5
+
+static const char diffShader[] =
+  "Texture2D<float4> cur   : register(t0);\n"
+  "Texture2D<float4> prev  : register(t1);\n"
+  "RWBuffer<uint>    tiles : register(u0);\n"
+  "\n"
+  "cbuffer Params : register(b0)\n"
+  "{\n"
+  "  uint tilesX;\n"
+  "};\n"
+  "\n"
+  "[numthreads(32, 8, 1)]\n"
+  "void main(uint3 gid : SV_GroupID, uint3 tid : SV_GroupThreadID)\n"
+  "{\n"
+  "  int2 base = gid.xy * 32 + tid.xy;\n"
+  "  bool diff = false;\n"
+  "  [unroll] for(int i = 0; i < 32; i += 8)\n"
+  "  {\n"
+  "    int3 p = int3(base.x, base.y + i, 0);\n"
+  "    diff = diff || any(cur.Load(p) != prev.Load(p));\n"
+  "  }\n"
+  "\n"
+  "  if (diff)\n"
+  "    tiles[gid.y * tilesX + gid.x] = 1;\n"
+  "}\n";
+
+struct GPUDiff
+{
+  struct DXGIInterface      * dxgi;
+  unsigned int                tilesX, tilesY;
+  int                         shift;
+
+  ID3D11ComputeShader       * shader;
+  ID3D11Buffer              * params;
+  ID3D11Buffer              * tiles;
+  ID3D11UnorderedAccessView * tilesUAV;
+  ID3D11Buffer              * staging;
+
+  // the current and prior frame
+  ID3D11Texture2D           * tex[2];
+  ID3D11ShaderResourceView  * srv[2];
+  int                         cur;
+  bool                        valid;
+};
+
+static struct GPUDiff * this = NULL;
+
+bool dxgi_gpuDiffInit(struct DXGIInterface * dxgi)
+{
+  HRESULT status;
+
+  DEBUG_ASSERT(!this);
+  this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("failed to allocate the GPUDiff struct");
+    return false;
+  }
+
+  this->dxgi   = dxgi;
+  this->tilesX = (dxgi->width  + (1 << TILE_SHIFT) - 1) >> TILE_SHIFT;
+  this->tilesY = (dxgi->height + (1 << TILE_SHIFT) - 1) >> TILE_SHIFT;
+  this->shift  = TILE_SHIFT;
+
+  if (!CompileComputeShader(dxgi->device, "gpu_diff", diffShader,
+        sizeof(diffShader) - 1, &this->shader))
+    goto fail;
+
+  const UINT params[4] = { this->tilesX };
+  D3D11_BUFFER_DESC paramsDesc =
+  {
+    .ByteWidth = sizeof(params),
+    .Usage     = D3D11_USAGE_IMMUTABLE,
+    .BindFlags = D3D11_BIND_CONSTANT_BUFFER
+  };
+  D3D11_SUBRESOURCE_DATA paramsData = { .pSysMem = params };
+
+  status = ID3D11Device_CreateBuffer(dxgi->device, &paramsDesc, &paramsData,
+      &this->params);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the diff params buffer", status);
+    goto fail;
+  }
+
+  // one byte per tile so the map can be read back as-is for rectsFromDiffMap
+  const UINT tilesSize = (this->tilesX * this->tilesY + 3) & ~3;
+  D3D11_BUFFER_DESC tilesDesc =
+  {
+    .ByteWidth = tilesSize,
+    .Usage     = D3D11_USAGE_DEFAULT,
+    .BindFlags = D3D11_BIND_UNORDERED_ACCESS
+  };
+
+  status = ID3D11Device_CreateBuffer(dxgi->device, &tilesDesc, NULL,
+      &this->tiles);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the diff tile buffer", status);
+    goto fail;
+  }
+
+  D3D11_UNORDERED_ACCESS_VIEW_DESC uavDesc =
+  {
+    .Format             = DXGI_FORMAT_R8_UINT,
+    .ViewDimension      = D3D11_UAV_DIMENSION_BUFFER,
+    .Buffer.NumElements = tilesSize
+  };
+
+  status = ID3D11Device_CreateUnorderedAccessView(dxgi->device,
+      (ID3D11Resource *)this->tiles, &uavDesc, &this->tilesUAV);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the diff tile view", status);
+    goto fail;
+  }
+
+  tilesDesc.Usage          = D3D11_USAGE_STAGING;
+  tilesDesc.BindFlags      = 0;
+  tilesDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+
+  status = ID3D11Device_CreateBuffer(dxgi->device, &tilesDesc, NULL,
+      &this->staging);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the diff staging buffer", status);
+    goto fail;
+  }
+
+  D3D11_TEXTURE2D_DESC texDesc =
+  {
+    .Width            = dxgi->width,
+    .Height           = dxgi->height,
+    .MipLevels        = 1,
+    .ArraySize        = 1,
+    .Format           = dxgi->dxgiFormat,
+    .SampleDesc.Count = 1,
+    .Usage            = D3D11_USAGE_DEFAULT,
+    .BindFlags        = D3D11_BIND_SHADER_RESOURCE
+  };
+
+  for (int i = 0; i < 2; ++i)
+  {
+    status = ID3D11Device_CreateTexture2D(dxgi->device, &texDesc, NULL,
+        &this->tex[i]);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to create the diff texture", status);
+      goto fail;
+    }
+
+    status = ID3D11Device_CreateShaderResourceView(dxgi->device,
+        (ID3D11Resource *)this->tex[i], NULL, &this->srv[i]);
+    if (FAILED(status))
+    {
+      DEBUG_WINERROR("Failed to create the diff texture view", status);
+      goto fail;
+    }
+  }
+
+  DEBUG_INFO("GPU diff tiles    : %u x %u", this->tilesX, this->tilesY);
+  return true;
+
+fail:
+  dxgi_gpuDiffFree();
+  return false;
+}
+
+void dxgi_gpuDiffFree(void)
+{
+  if (!this)
+    return;
+
+  for (int i = 0; i < 2; ++i)
+  {
+    if (this->srv[i])
+      ID3D11ShaderResourceView_Release(this->srv[i]);
+    if (this->tex[i])
+      ID3D11Texture2D_Release(this->tex[i]);
+  }
+
+  if (this->staging)
+    ID3D11Buffer_Release(this->staging);
+  if (this->tilesUAV)
+    ID3D11UnorderedAccessView_Release(this->tilesUAV);
+  if (this->tiles)
+    ID3D11Buffer_Release(this->tiles);
+  if (this->params)
+    ID3D11Buffer_Release(this->params);
+  if (this->shader)
+    ID3D11ComputeShader_Release(this->shader);
+
+  free(this);
+  this = NULL;
+}
+
+/* too scattered for the rects, fold the diff tiles into the coarser frame
+ * damage map and build the rects from that instead. The map is in frame
+ * coordinates which only match the source when not cropping */
+static void buildDamageMap(Texture * tex, const uint8_t * diff,
+    unsigned int width, unsigned int height)
+{
+  if (this->dxgi->crop || !rectsDamageMapFits(width, height))
+    return;
+
+  const unsigned int tilesX = rectsDamageMapTiles(width );
+  const unsigned int tilesY = rectsDamageMapTiles(height);
+  const unsigned int stride = rectsDamageMapStride(tilesX);
+  const int          fold   = KVMFR_DAMAGE_TILE_SHIFT - this->shift;
+  memset(tex->damageMap, 0, stride * tilesY);
+
+  for (unsigned int y = 0; y < this->tilesY; ++y)
+  {
+    const uint8_t * row = diff + y * this->tilesX;
+    uint8_t       * out = tex->damageMap + (y >> fold) * stride;
+    for (unsigned int x = rectsDiffScan(row, 0, this->tilesX, true);
+        x < this->tilesX; x = rectsDiffScan(row, x + 1, this->tilesX, true))
+      out[(x >> fold) / 8] |= 1 << ((x >> fold) & 7);
+  }
+
+  tex->damageMapValid   = true;
+  tex->damageMapWidth   = tilesX;
+  tex->damageMapHeight  = tilesY;
+  tex->damageRectsCount = rectsFromDamageMap(tex->damageRects,
+      KVMFR_MAX_DAMAGE_RECTS, tex->damageMap, tilesX, tilesY, width, height);
+}
+
+static void computeDamage(Texture * tex)
+{
+  ID3D11DeviceContext * ctx = this->dxgi->deviceContext;
+  const int prev = this->cur ^ 1;
+
+  const UINT zero[4] = { 0 };
+  ID3D11DeviceContext_ClearUnorderedAccessViewUint(ctx, this->tilesUAV, zero);
+
+  ID3D11ShaderResourceView * srvs[2] = { this->srv[this->cur], this->srv[prev] };
+  ID3D11DeviceContext_CSSetShader(ctx, this->shader, NULL, 0);
+  ID3D11DeviceContext_CSSetShaderResources(ctx, 0, 2, srvs);
+  ID3D11DeviceContext_CSSetUnorderedAccessViews(ctx, 0, 1, &this->tilesUAV, NULL);
+  ID3D11DeviceContext_CSSetConstantBuffers(ctx, 0, 1, &this->params);
+  ID3D11DeviceContext_Dispatch(ctx, this->tilesX, this->tilesY, 1);
+
+  ID3D11ShaderResourceView  * nullSRVs[2] = { NULL, NULL };
+  ID3D11UnorderedAccessView * nullUAV     = NULL;
+  ID3D11DeviceContext_CSSetShaderResources(ctx, 0, 2, nullSRVs);
+  ID3D11DeviceContext_CSSetUnorderedAccessViews(ctx, 0, 1, &nullUAV, NULL);
+  ID3D11DeviceContext_CSSetShader(ctx, NULL, NULL, 0);
+
+  ID3D11DeviceContext_CopyResource(ctx,
+      (ID3D11Resource *)this->staging, (ID3D11Resource *)this->tiles);
+
+  // this stalls until the diff is done, but the map is tiny compared to the
+  // full frame the damage would otherwise fall back to
+  D3D11_MAPPED_SUBRESOURCE map;
+  HRESULT status = ID3D11DeviceContext_Map(ctx,
+      (ID3D11Resource *)this->staging, 0, D3D11_MAP_READ, 0, &map);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to map the diff tiles", status);
+    return;
+  }
+
+  /* the rects are in source coordinates, any crop is applied by the caller
+   * and any downsampling maps them into the frame below */
+  const unsigned int width  = this->dxgi->width;
+  const unsigned int height = this->dxgi->height;
+
+  const unsigned int len = this->tilesX * this->tilesY;
+  if (rectsDiffScan(map.pData, 0, len, true) == len)
+  {
+    // nothing changed, but no rects means full damage so damage one tile
+    tex->damageRects[0] = (FrameDamageRect) {
+      .x      = 0,
+      .y      = 0,
+      .width  = min(1U << this->shift, width ),
+      .height = min(1U << this->shift, height)
+    };
+    tex->damageRectsCount = 1;
+  }
+  else
+  {
+    tex->damageRectsCount = rectsFromDiffMap(tex->damageRects,
+      KVMFR_MAX_DAMAGE_RECTS, map.pData, this->tilesX, this->tilesY,
+      this->shift, width, height);
+
+    // the map is built in the frame's tiles, which the source is not in
+    if (tex->damageRectsCount == 0 && !this->dxgi->downsample)
+      buildDamageMap(tex, map.pData, width, height);
+  }
+
+  ID3D11DeviceContext_Unmap(ctx, (ID3D11Resource *)this->staging, 0);
+
+  if (this->dxgi->downsample)
+    for (uint32_t i = 0; i < tex->damageRectsCount; ++i)
+      dxgi_downsampleRectToTarget(this->dxgi, tex->damageRects + i);
+}
+
+void dxgi_gpuDiffUpdate(Texture * tex, ID3D11Texture2D * src)
+{
+  DEBUG_ASSERT(this);
+
+  ID3D11DeviceContext_CopyResource(this->dxgi->deviceContext,
+      (ID3D11Resource *)this->tex[this->cur], (ID3D11Resource *)src);
+
+  if (this->valid && tex->damageRectsCount == 0)
+    computeDamage(tex);
+
+  this->cur  ^= 1;
+  this->valid = true;
+}
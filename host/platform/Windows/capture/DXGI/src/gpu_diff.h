@@ -0,0 +1,35 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_DXGI_GPU_DIFF_
+#define _H_DXGI_GPU_DIFF_
+
+#include "dxgi_capture.h"
+
+bool dxgi_gpuDiffInit(struct DXGIInterface * intf);
+void dxgi_gpuDiffFree(void);
+
+/* Keeps a copy of the desktop texture and, when the frame is damaged in full,
+ * compares it against the prior frame on the GPU to replace the damage with
+ * the tiles that really changed. Must be called with the device context lock
+ * held. */
+void dxgi_gpuDiffUpdate(Texture * tex, ID3D11Texture2D * src);
+
+#endif
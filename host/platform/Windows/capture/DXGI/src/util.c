@@ -20,6 +20,9 @@
 
 #include "dxgi_capture.h"
 
+#include "common/debug.h"
+#include "common/windebug.h"
+
 static const char * DXGI_FORMAT_STR[] = {
   "DXGI_FORMAT_UNKNOWN",
   "DXGI_FORMAT_R32G32B32A32_TYPELESS",
@@ -151,3 +154,113 @@ const char * GetDXGIFormatStr(DXGI_FORMAT format)
     return DXGI_FORMAT_STR[0];
   return DXGI_FORMAT_STR[format];
 }
+
+typedef HRESULT (WINAPI * D3DCompile_t)(
+  LPCVOID                  pSrcData,
+  SIZE_T                   SrcDataSize,
+  LPCSTR                   pSourceName,
+  const D3D_SHADER_MACRO * pDefines,
+  ID3DInclude            * pInclude,
+  LPCSTR                   pEntrypoint,
+  LPCSTR                   pTarget,
+  UINT                     Flags1,
+  UINT                     Flags2,
+  ID3DBlob              ** ppCode,
+  ID3DBlob              ** ppErrorMsgs
+);
+
+static bool compileShader(const char * name, const char * target,
+    const char * code, size_t size, ID3DBlob ** blob)
+{
+  HMODULE compiler = LoadLibrary("d3dcompiler_47.dll");
+  if (!compiler)
+  {
+    DEBUG_WINERROR("Failed to load d3dcompiler_47.dll", GetLastError());
+    return false;
+  }
+
+  D3DCompile_t D3DCompile = (D3DCompile_t)GetProcAddress(compiler, "D3DCompile");
+  if (!D3DCompile)
+  {
+    DEBUG_ERROR("Failed to find D3DCompile");
+    FreeLibrary(compiler);
+    return false;
+  }
+
+  ID3DBlob * errors = NULL;
+  HRESULT status = D3DCompile(code, size, name, NULL, NULL, "main", target,
+      0, 0, blob, &errors);
+
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to compile the shader", status);
+    DEBUG_ERROR("Shader: %s", name);
+    if (errors)
+      DEBUG_ERROR("%s", (const char *)ID3D10Blob_GetBufferPointer(errors));
+  }
+
+  if (errors)
+    ID3D10Blob_Release(errors);
+  FreeLibrary(compiler);
+  return SUCCEEDED(status);
+}
+
+bool CompileComputeShader(ID3D11Device * device, const char * name,
+    const char * code, size_t size, ID3D11ComputeShader ** shader)
+{
+  ID3DBlob * blob = NULL;
+  if (!compileShader(name, "cs_5_0", code, size, &blob))
+    return false;
+
+  HRESULT status = ID3D11Device_CreateComputeShader(device,
+      ID3D10Blob_GetBufferPointer(blob), ID3D10Blob_GetBufferSize(blob),
+      NULL, shader);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the shader", status);
+    DEBUG_ERROR("Shader: %s", name);
+  }
+
+  ID3D10Blob_Release(blob);
+  return SUCCEEDED(status);
+}
+
+bool CompileVertexShader(ID3D11Device * device, const char * name,
+    const char * code, size_t size, ID3D11VertexShader ** shader)
+{
+  ID3DBlob * blob = NULL;
+  if (!compileShader(name, "vs_5_0", code, size, &blob))
+    return false;
+
+  HRESULT status = ID3D11Device_CreateVertexShader(device,
+      ID3D10Blob_GetBufferPointer(blob), ID3D10Blob_GetBufferSize(blob),
+      NULL, shader);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the shader", status);
+    DEBUG_ERROR("Shader: %s", name);
+  }
+
+  ID3D10Blob_Release(blob);
+  return SUCCEEDED(status);
+}
+
+bool CompilePixelShader(ID3D11Device * device, const char * name,
+    const char * code, size_t size, ID3D11PixelShader ** shader)
+{
+  ID3DBlob * blob = NULL;
+  if (!compileShader(name, "ps_5_0", code, size, &blob))
+    return false;
+
+  HRESULT status = ID3D11Device_CreatePixelShader(device,
+      ID3D10Blob_GetBufferPointer(blob), ID3D10Blob_GetBufferSize(blob),
+      NULL, shader);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the shader", status);
+    DEBUG_ERROR("Shader: %s", name);
+  }
+
+  ID3D10Blob_Release(blob);
+  return SUCCEEDED(status);
+}
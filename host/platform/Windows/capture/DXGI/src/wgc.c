@@ -0,0 +1,517 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "wgc.h"
+
+#include "common/debug.h"
+#include "common/windebug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <d3d11_4.h>
+#include <inspectable.h>
+#include <winstring.h>
+#include <roapi.h>
+
+/* The WinRT interfaces are not available to C in every SDK, the little that
+ * is needed of them is declared here. Only the order of the methods matters
+ * for those that are never called. */
+
+#define WGC_INSPECTABLE(type) \
+  HRESULT (STDMETHODCALLTYPE * QueryInterface)(type * This, REFIID riid, \
+      void ** obj); \
+  ULONG   (STDMETHODCALLTYPE * AddRef)(type * This); \
+  ULONG   (STDMETHODCALLTYPE * Release)(type * This); \
+  HRESULT (STDMETHODCALLTYPE * GetIids)(type * This, ULONG * count, \
+      IID ** iids); \
+  HRESULT (STDMETHODCALLTYPE * GetRuntimeClassName)(type * This, \
+      HSTRING * name); \
+  HRESULT (STDMETHODCALLTYPE * GetTrustLevel)(type * This, int * level);
+
+#define WGC_INTERFACE(type, methods) \
+  typedef struct type type; \
+  struct type##Vtbl { methods }; \
+  struct type { const struct type##Vtbl * lpVtbl; };
+
+typedef struct { int32_t Width, Height; } WGCSize;
+
+// DirectXPixelFormat
+#define WGC_FORMAT_B8G8R8A8_UNORM 87
+
+WGC_INTERFACE(WGCItemInterop,
+  HRESULT (STDMETHODCALLTYPE * QueryInterface)(WGCItemInterop * This,
+      REFIID riid, void ** obj);
+  ULONG   (STDMETHODCALLTYPE * AddRef)(WGCItemInterop * This);
+  ULONG   (STDMETHODCALLTYPE * Release)(WGCItemInterop * This);
+  HRESULT (STDMETHODCALLTYPE * CreateForWindow)(WGCItemInterop * This,
+      HWND window, REFIID riid, void ** item);
+  HRESULT (STDMETHODCALLTYPE * CreateForMonitor)(WGCItemInterop * This,
+      HMONITOR monitor, REFIID riid, void ** item);
+)
+
+WGC_INTERFACE(WGCItem,
+  WGC_INSPECTABLE(WGCItem)
+  HRESULT (STDMETHODCALLTYPE * get_DisplayName)(WGCItem * This,
+      HSTRING * value);
+  HRESULT (STDMETHODCALLTYPE * get_Size)(WGCItem * This, WGCSize * value);
+)
+
+WGC_INTERFACE(WGCSession,
+  WGC_INSPECTABLE(WGCSession)
+  HRESULT (STDMETHODCALLTYPE * StartCapture)(WGCSession * This);
+)
+
+WGC_INTERFACE(WGCSession2,
+  WGC_INSPECTABLE(WGCSession2)
+  HRESULT (STDMETHODCALLTYPE * get_IsCursorCaptureEnabled)(WGCSession2 * This,
+      boolean * value);
+  HRESULT (STDMETHODCALLTYPE * put_IsCursorCaptureEnabled)(WGCSession2 * This,
+      boolean value);
+)
+
+WGC_INTERFACE(WGCSession3,
+  WGC_INSPECTABLE(WGCSession3)
+  HRESULT (STDMETHODCALLTYPE * get_IsBorderRequired)(WGCSession3 * This,
+      boolean * value);
+  HRESULT (STDMETHODCALLTYPE * put_IsBorderRequired)(WGCSession3 * This,
+      boolean value);
+)
+
+WGC_INTERFACE(WGCFrame,
+  WGC_INSPECTABLE(WGCFrame)
+  HRESULT (STDMETHODCALLTYPE * get_Surface)(WGCFrame * This,
+      IInspectable ** value);
+  // a TimeSpan, in 100ns units of the performance counter
+  HRESULT (STDMETHODCALLTYPE * get_SystemRelativeTime)(WGCFrame * This,
+      int64_t * value);
+  HRESULT (STDMETHODCALLTYPE * get_ContentSize)(WGCFrame * This,
+      WGCSize * value);
+)
+
+WGC_INTERFACE(WGCPool,
+  WGC_INSPECTABLE(WGCPool)
+  HRESULT (STDMETHODCALLTYPE * Recreate)(WGCPool * This, IInspectable * device,
+      int32_t format, int32_t buffers, WGCSize size);
+  HRESULT (STDMETHODCALLTYPE * TryGetNextFrame)(WGCPool * This,
+      WGCFrame ** frame);
+  HRESULT (STDMETHODCALLTYPE * add_FrameArrived)(WGCPool * This,
+      void * handler, int64_t * token);
+  HRESULT (STDMETHODCALLTYPE * remove_FrameArrived)(WGCPool * This,
+      int64_t token);
+  HRESULT (STDMETHODCALLTYPE * CreateCaptureSession)(WGCPool * This,
+      WGCItem * item, WGCSession ** session);
+)
+
+WGC_INTERFACE(WGCPoolStatics2,
+  WGC_INSPECTABLE(WGCPoolStatics2)
+  HRESULT (STDMETHODCALLTYPE * CreateFreeThreaded)(WGCPoolStatics2 * This,
+      IInspectable * device, int32_t format, int32_t buffers, WGCSize size,
+      WGCPool ** pool);
+)
+
+WGC_INTERFACE(WGCClosable,
+  WGC_INSPECTABLE(WGCClosable)
+  HRESULT (STDMETHODCALLTYPE * Close)(WGCClosable * This);
+)
+
+WGC_INTERFACE(WGCDxgiAccess,
+  HRESULT (STDMETHODCALLTYPE * QueryInterface)(WGCDxgiAccess * This,
+      REFIID riid, void ** obj);
+  ULONG   (STDMETHODCALLTYPE * AddRef)(WGCDxgiAccess * This);
+  ULONG   (STDMETHODCALLTYPE * Release)(WGCDxgiAccess * This);
+  HRESULT (STDMETHODCALLTYPE * GetInterface)(WGCDxgiAccess * This,
+      REFIID riid, void ** obj);
+)
+
+static const IID IID_WGCItemInterop = {0x3628e81b, 0x3cac, 0x4c60,
+  {0xb7, 0xf4, 0x23, 0xce, 0x0e, 0x0c, 0x33, 0x56}};
+static const IID IID_WGCItem = {0x79c3f95b, 0x31f7, 0x4ec2,
+  {0xa4, 0x64, 0x63, 0x2e, 0xf5, 0xd3, 0x07, 0x60}};
+static const IID IID_WGCSession2 = {0x2c39ae40, 0x7d2e, 0x5044,
+  {0x80, 0x4e, 0x8b, 0x67, 0x99, 0xd4, 0xcf, 0x9e}};
+static const IID IID_WGCSession3 = {0xf2cdd966, 0x22ae, 0x5ea1,
+  {0x95, 0x96, 0x3a, 0x28, 0x93, 0x44, 0xc3, 0xbe}};
+static const IID IID_WGCPoolStatics2 = {0x589b103f, 0x6bbc, 0x5df5,
+  {0xa9, 0x91, 0x02, 0xe2, 0x8b, 0x3b, 0x66, 0xd5}};
+static const IID IID_WGCClosable = {0x30d5a829, 0x7fa4, 0x4026,
+  {0x83, 0xbb, 0xd7, 0x5b, 0xae, 0x4e, 0xa9, 0x9e}};
+static const IID IID_WGCDxgiAccess = {0xa9b3d012, 0x3df2, 0x4ee3,
+  {0xb8, 0xd1, 0x86, 0x95, 0xf4, 0x57, 0xd3, 0xc1}};
+
+typedef HRESULT (WINAPI * RoInitialize_t)(RO_INIT_TYPE type);
+typedef HRESULT (WINAPI * RoGetActivationFactory_t)(HSTRING class,
+    REFIID riid, void ** factory);
+typedef HRESULT (WINAPI * WindowsCreateString_t)(LPCWSTR src, UINT32 len,
+    HSTRING * str);
+typedef HRESULT (WINAPI * WindowsDeleteString_t)(HSTRING str);
+typedef HRESULT (WINAPI * CreateDirect3D11DeviceFromDXGIDevice_t)(
+    IDXGIDevice * dxgiDevice, IInspectable ** device);
+
+// the pool only needs to hold the frame being copied and the next
+#define WGC_BUFFERS 2
+
+struct WGC
+{
+  struct DXGIInterface * dxgi;
+  HWND                   window;
+
+  IInspectable         * device;
+  WGCItem              * item;
+  WGCPool              * pool;
+  WGCSession           * session;
+  WGCSize                size;
+  WGCFrame             * frame;
+};
+
+static struct WGC * this = NULL;
+
+static void wgcClose(void * obj)
+{
+  WGCClosable * closable;
+  if (SUCCEEDED(IUnknown_QueryInterface((IUnknown *)obj, &IID_WGCClosable,
+          (void **)&closable)))
+  {
+    closable->lpVtbl->Close(closable);
+    closable->lpVtbl->Release(closable);
+  }
+  IUnknown_Release((IUnknown *)obj);
+}
+
+static bool getFactory(HMODULE combase, LPCWSTR class, REFIID riid,
+    void ** factory)
+{
+  RoGetActivationFactory_t RoGetActivationFactory = (RoGetActivationFactory_t)
+    GetProcAddress(combase, "RoGetActivationFactory");
+  WindowsCreateString_t WindowsCreateString = (WindowsCreateString_t)
+    GetProcAddress(combase, "WindowsCreateString");
+  WindowsDeleteString_t WindowsDeleteString = (WindowsDeleteString_t)
+    GetProcAddress(combase, "WindowsDeleteString");
+
+  if (!RoGetActivationFactory || !WindowsCreateString || !WindowsDeleteString)
+    return false;
+
+  HSTRING str;
+  HRESULT status = WindowsCreateString(class, wcslen(class), &str);
+  if (FAILED(status))
+    return false;
+
+  status = RoGetActivationFactory(str, riid, factory);
+  WindowsDeleteString(str);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("RoGetActivationFactory failed", status);
+    return false;
+  }
+  return true;
+}
+
+bool dxgi_wgcInit(struct DXGIInterface * dxgi, HMONITOR monitor, HWND window,
+    unsigned int * width, unsigned int * height)
+{
+  DEBUG_ASSERT(!this);
+
+  HMODULE combase = LoadLibrary("combase.dll");
+  HMODULE d3d11   = GetModuleHandle("d3d11.dll");
+  if (!combase || !d3d11)
+  {
+    DEBUG_ERROR("Windows.Graphics.Capture is not available");
+    return false;
+  }
+
+  RoInitialize_t RoInitialize = (RoInitialize_t)
+    GetProcAddress(combase, "RoInitialize");
+  CreateDirect3D11DeviceFromDXGIDevice_t CreateDirect3D11DeviceFromDXGIDevice =
+    (CreateDirect3D11DeviceFromDXGIDevice_t)
+      GetProcAddress(d3d11, "CreateDirect3D11DeviceFromDXGIDevice");
+  if (!RoInitialize || !CreateDirect3D11DeviceFromDXGIDevice)
+  {
+    DEBUG_ERROR("Windows.Graphics.Capture is not available");
+    return false;
+  }
+
+  // the process stays in the multithreaded apartment, it is not left on free
+  HRESULT status = RoInitialize(RO_INIT_MULTITHREADED);
+  if (FAILED(status) && status != RPC_E_CHANGED_MODE)
+  {
+    DEBUG_WINERROR("RoInitialize failed", status);
+    return false;
+  }
+
+  this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  this->dxgi   = dxgi;
+  this->window = window;
+
+  // the pool copies into its buffers from another thread
+  ID3D11Multithread * mt;
+  if (SUCCEEDED(ID3D11DeviceContext_QueryInterface(dxgi->deviceContext,
+          &IID_ID3D11Multithread, (void **)&mt)))
+  {
+    ID3D11Multithread_SetMultithreadProtected(mt, TRUE);
+    ID3D11Multithread_Release(mt);
+  }
+
+  IDXGIDevice * dxgiDevice;
+  status = ID3D11Device_QueryInterface(dxgi->device, &IID_IDXGIDevice,
+      (void **)&dxgiDevice);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to query the IDXGIDevice", status);
+    goto fail;
+  }
+
+  status = CreateDirect3D11DeviceFromDXGIDevice(dxgiDevice, &this->device);
+  IDXGIDevice_Release(dxgiDevice);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("CreateDirect3D11DeviceFromDXGIDevice failed", status);
+    goto fail;
+  }
+
+  WGCItemInterop * interop;
+  if (!getFactory(combase, L"Windows.Graphics.Capture.GraphicsCaptureItem",
+        &IID_WGCItemInterop, (void **)&interop))
+    goto fail;
+
+  if (window)
+    status = interop->lpVtbl->CreateForWindow(interop, window, &IID_WGCItem,
+        (void **)&this->item);
+  else
+    status = interop->lpVtbl->CreateForMonitor(interop, monitor, &IID_WGCItem,
+        (void **)&this->item);
+  interop->lpVtbl->Release(interop);
+
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the capture item", status);
+    goto fail;
+  }
+
+  this->item->lpVtbl->get_Size(this->item, &this->size);
+  if (this->size.Width <= 0 || this->size.Height <= 0)
+  {
+    DEBUG_ERROR("The capture item has no size");
+    goto fail;
+  }
+
+  WGCPoolStatics2 * statics;
+  if (!getFactory(combase,
+        L"Windows.Graphics.Capture.Direct3D11CaptureFramePool",
+        &IID_WGCPoolStatics2, (void **)&statics))
+    goto fail;
+
+  status = statics->lpVtbl->CreateFreeThreaded(statics, this->device,
+      WGC_FORMAT_B8G8R8A8_UNORM, WGC_BUFFERS, this->size, &this->pool);
+  statics->lpVtbl->Release(statics);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the frame pool", status);
+    goto fail;
+  }
+
+  status = this->pool->lpVtbl->CreateCaptureSession(this->pool, this->item,
+      &this->session);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the capture session", status);
+    goto fail;
+  }
+
+  // the pointer is part of the frame, there is no shape to send on its own
+  WGCSession2 * session2;
+  if (SUCCEEDED(this->session->lpVtbl->QueryInterface(this->session,
+          &IID_WGCSession2, (void **)&session2)))
+  {
+    session2->lpVtbl->put_IsCursorCaptureEnabled(session2, TRUE);
+    session2->lpVtbl->Release(session2);
+  }
+
+  // the yellow border can only be removed on Windows 11 and is not an error
+  WGCSession3 * session3;
+  if (SUCCEEDED(this->session->lpVtbl->QueryInterface(this->session,
+          &IID_WGCSession3, (void **)&session3)))
+  {
+    session3->lpVtbl->put_IsBorderRequired(session3, FALSE);
+    session3->lpVtbl->Release(session3);
+  }
+
+  status = this->session->lpVtbl->StartCapture(this->session);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to start the capture", status);
+    goto fail;
+  }
+
+  *width  = this->size.Width;
+  *height = this->size.Height;
+  return true;
+
+fail:
+  dxgi_wgcFree();
+  return false;
+}
+
+void dxgi_wgcFree(void)
+{
+  if (!this)
+    return;
+
+  dxgi_wgcRelease();
+
+  if (this->session)
+    wgcClose(this->session);
+
+  if (this->pool)
+    wgcClose(this->pool);
+
+  if (this->item)
+    this->item->lpVtbl->Release(this->item);
+
+  if (this->device)
+    wgcClose(this->device);
+
+  free(this);
+  this = NULL;
+}
+
+struct FindWindow
+{
+  const char * title;
+  HWND         hwnd;
+};
+
+static BOOL CALLBACK findWindowProc(HWND hwnd, LPARAM lParam)
+{
+  struct FindWindow * find = (struct FindWindow *)lParam;
+  char text[256];
+
+  if (!IsWindowVisible(hwnd) ||
+      !GetWindowTextA(hwnd, text, sizeof(text)) ||
+      !strstr(text, find->title))
+    return TRUE;
+
+  find->hwnd = hwnd;
+  return FALSE;
+}
+
+HWND dxgi_wgcFindWindow(const char * title)
+{
+  struct FindWindow find = { .title = title };
+  EnumWindows(findWindowProc, (LPARAM)&find);
+  return find.hwnd;
+}
+
+static inline uint64_t timeToQPC(int64_t time)
+{
+  // 100ns units, split to not overflow at the counter frequency
+  const int64_t freq = this->dxgi->perfFreq.QuadPart;
+  return (time / 10000000LL) * freq + (time % 10000000LL) * freq / 10000000LL;
+}
+
+HRESULT dxgi_wgcAcquire(DXGI_OUTDUPL_FRAME_INFO * info, IDXGIResource ** res)
+{
+  DEBUG_ASSERT(this);
+  DEBUG_ASSERT(!this->frame);
+
+  WGCFrame * frame = NULL;
+  HRESULT status = this->pool->lpVtbl->TryGetNextFrame(this->pool, &frame);
+  if (SUCCEEDED(status) && !frame)
+  {
+    // the pool only fills on composition, there is no use polling before it
+    IDXGIOutput_WaitForVBlank(this->dxgi->output);
+    status = this->pool->lpVtbl->TryGetNextFrame(this->pool, &frame);
+  }
+
+  if (FAILED(status))
+    return status;
+
+  if (!frame)
+  {
+    if (this->window && !IsWindow(this->window))
+    {
+      DEBUG_INFO("The captured window has been closed");
+      return DXGI_ERROR_ACCESS_LOST;
+    }
+    return DXGI_ERROR_WAIT_TIMEOUT;
+  }
+
+  WGCSize size;
+  frame->lpVtbl->get_ContentSize(frame, &size);
+  if (size.Width != this->size.Width || size.Height != this->size.Height)
+  {
+    DEBUG_INFO("The capture item has changed size");
+    wgcClose(frame);
+    return DXGI_ERROR_ACCESS_LOST;
+  }
+
+  IInspectable  * surface;
+  WGCDxgiAccess * access;
+  status = frame->lpVtbl->get_Surface(frame, &surface);
+  if (FAILED(status))
+  {
+    wgcClose(frame);
+    return status;
+  }
+
+  status = IInspectable_QueryInterface(surface, &IID_WGCDxgiAccess,
+      (void **)&access);
+  IInspectable_Release(surface);
+  if (FAILED(status))
+  {
+    wgcClose(frame);
+    return status;
+  }
+
+  status = access->lpVtbl->GetInterface(access, &IID_IDXGIResource,
+      (void **)res);
+  access->lpVtbl->Release(access);
+  if (FAILED(status))
+  {
+    wgcClose(frame);
+    return status;
+  }
+
+  int64_t time = 0;
+  frame->lpVtbl->get_SystemRelativeTime(frame, &time);
+
+  // only new frames are delivered so every one is a present
+  memset(info, 0, sizeof(*info));
+  info->LastPresentTime.QuadPart = time ? timeToQPC(time) : 1;
+  info->AccumulatedFrames        = 1;
+
+  this->frame = frame;
+  return S_OK;
+}
+
+void dxgi_wgcRelease(void)
+{
+  DEBUG_ASSERT(this);
+  if (!this->frame)
+    return;
+
+  // closing hands the buffer back to the pool for the next frame
+  wgcClose(this->frame);
+  this->frame = NULL;
+}
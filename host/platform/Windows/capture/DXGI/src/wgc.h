@@ -0,0 +1,44 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_DXGI_WGC_
+#define _H_DXGI_WGC_
+
+#include "dxgi_capture.h"
+
+/* Captures the monitor, or the window when one is given, with
+ * Windows.Graphics.Capture instead of the desktop duplication. Frames come
+ * from a free threaded frame pool on the capture device, so they are handed to
+ * the copy backends like those of the duplication. The size of the item is
+ * returned in width and height. */
+bool dxgi_wgcInit(struct DXGIInterface * dxgi, HMONITOR monitor, HWND window,
+    unsigned int * width, unsigned int * height);
+void dxgi_wgcFree(void);
+
+// find the first visible top level window with a title containing title
+HWND dxgi_wgcFindWindow(const char * title);
+
+/* Takes the next frame as AcquireNextFrame does, waiting up to a vblank for
+ * one. DXGI_ERROR_ACCESS_LOST is returned when the item was closed or has
+ * changed size. The frame must be released before the next is taken. */
+HRESULT dxgi_wgcAcquire(DXGI_OUTDUPL_FRAME_INFO * info, IDXGIResource ** res);
+void dxgi_wgcRelease(void);
+
+#endif
@@ -96,11 +96,18 @@ struct iface
   bool mouseHookCreated;
   bool forceCompositionCreated;
 
-  struct FrameInfo frameInfo[LGMP_Q_FRAME_LEN];
+  struct FrameInfo frameInfo[LGMP_Q_FRAME_LEN_MAX];
 };
 
 static Vector downsampleRules = {0};
 
+static void diffMerge(uint8_t * restrict dst, const uint8_t * restrict src,
+    unsigned int len)
+{
+  for (unsigned int i = 0; i < len; ++i)
+    dst[i] |= src[i];
+}
+
 static struct iface * this = NULL;
 
 static bool nvfbc_deinit(void);
@@ -242,6 +249,13 @@ static void nvfbc_initOptions(void)
       .type           = OPTION_TYPE_BOOL,
       .value.x_bool   = false
     },
+    {
+      .module         = "nvfbc",
+      .name           = "cursorPollRate",
+      .description    = "Sample the cursor this many times a second instead of hooking the mouse, -1 for once per vblank, 0 to use the hook",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 0
+    },
     {0}
   };
 
@@ -398,7 +412,7 @@ static bool nvfbc_init(void)
   DEBUG_INFO("DiffMap block    : %dx%d", 1 << this->diffShift, 1 << this->diffShift);
   DEBUG_INFO("Cursor mode      : %s", this->seperateCursor ? "decoupled" : "integrated");
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for (int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
   {
     this->frameInfo[i].width    = 0;
     this->frameInfo[i].height   = 0;
@@ -424,7 +438,8 @@ static bool nvfbc_start(void)
 {
   if (!this->mouseHookCreated)
   {
-    mouseHook_install(on_mouseMove);
+    mouseHook_install(on_mouseMove,
+        option_get_int("nvfbc", "cursorPollRate"));
     this->mouseHookCreated = true;
   }
 
@@ -469,9 +484,13 @@ static void nvfbc_stop(void)
 
 static bool nvfbc_deinit(void)
 {
-  this->cursorEvent = NULL;
+  if (this->cursorEvent)
+  {
+    lgFreeEvent(this->cursorEvent);
+    this->cursorEvent = NULL;
+  }
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for (int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
   {
     free(this->frameInfo[i].diffMap);
     this->frameInfo[i].diffMap = NULL;
@@ -531,170 +550,23 @@ static CaptureResult nvfbc_capture(void)
   if (result != CAPTURE_RESULT_OK)
     return result;
 
-  bool changed = false;
-  const unsigned int h = DIFF_MAP_DIM(grabInfo.dwWidth , this->diffShift);
-  const unsigned int w = DIFF_MAP_DIM(grabInfo.dwHeight, this->diffShift);
-  for (unsigned int y = 0; y < h; ++y)
-    for (unsigned int x = 0; x < w; ++x)
-      if (this->diffMap[(y*w)+x])
-      {
-        changed = true;
-        goto done;
-      }
-
-done:
-  if (!changed)
+  const unsigned int h = DIFF_MAP_DIM(grabInfo.dwHeight, this->diffShift);
+  const unsigned int w = DIFF_MAP_DIM(grabInfo.dwWidth , this->diffShift);
+  if (rectsDiffScan(this->diffMap, 0, w * h, true) == w * h)
     return CAPTURE_RESULT_TIMEOUT;
 
   memcpy(&this->grabInfo, &grabInfo, sizeof(grabInfo));
   return CAPTURE_RESULT_OK;
 }
 
-struct DisjointSet {
-  int  id;
-  bool use;
-  bool row;
-  int  x1;
-  int  y1;
-  int  x2;
-  int  y2;
-};
-
-static int dsFind(struct DisjointSet * ds, int id)
-{
-  if (ds[id].id != id)
-    ds[id].id = dsFind(ds, ds[id].id);
-  return ds[id].id;
-}
-
-static void dsUnion(struct DisjointSet * ds, int a, int b)
-{
-  a = dsFind(ds, a);
-  b = dsFind(ds, b);
-  if (a == b)
-    return;
-
-  ds[b].id = a;
-  ds[a].x2 = max(ds[a].x2, ds[b].x2);
-  ds[a].y2 = max(ds[a].y2, ds[b].y2);
-}
-
 static void updateDamageRects(CaptureFrame * frame)
 {
   const unsigned int h = DIFF_MAP_DIM(this->grabHeight, this->diffShift);
   const unsigned int w = DIFF_MAP_DIM(this->grabWidth,  this->diffShift);
 
-  struct DisjointSet ds[w * h];
-
-  // init the ds usage
-  for(unsigned int i = 0; i < ARRAY_LENGTH(ds); ++i)
-    ds[i].use = (bool)this->diffMap[i];
-
-  // reduce the number of resulting rectangles by filling in holes and merging
-  // irregular shapes into contiguous rectangles
-  bool resolve;
-  do
-  {
-    resolve = false;
-    for (unsigned int y = 0; y < h; ++y)
-      for (unsigned int x = 0; x < w; ++x)
-      {
-        const int c = y * w + x;     // current
-        if (ds[c].use)
-          continue;
-
-        const int l  = c - 1; // left
-        const int r  = c + 1; // right
-        const int u  = c - w; // up
-        const int d  = c + w; // down
-
-        if ((x < w - 1 && y < h - 1 && ds[r].use && ds[d].use) ||
-            (x > 0     && y < h - 1 && ds[l].use && ds[d].use) ||
-            (x < w - 1 && y > 0     && ds[r].use && ds[u].use) ||
-            (x > 0     && y > 0     && ds[l].use && ds[u].use) ||
-            (x > 0     && y > 0     &&
-             x < w - 1 && y < h - 1 && ds[l].use && ds[u].use &&
-                                       ds[r].use && ds[d].use)
-            )
-        {
-          ds[c].use = true;
-          resolve   = true;
-        }
-      }
-  }
-  while(resolve);
-
-  for (unsigned int y = 0; y < h; ++y)
-    for (unsigned int x = 0; x < w; ++x)
-    {
-      const int c = y * w + x; // current
-      const int l = c - 1;     // left
-      const int u = c - w;     // up
-
-      if (ds[c].use)
-      {
-        ds[c].id  = c;
-        ds[c].row = false;
-        ds[c].x1  = ds[c].x2 = x;
-        ds[c].y1  = ds[c].y2 = y;
-
-        if (y > 0 && ds[u].use)
-        {
-          bool ok = true;
-          if (x > 0 && ds[l].id != ds[u].id)
-          {
-            // no need to use dsFind as the search order ensures that the id of
-            // the block above has been fully resolved
-            for(unsigned int j = ds[ds[u].id].x1; j <= ds[ds[u].id].x2; ++j)
-              if (!ds[y * w + j].use)
-              {
-                ok = false;
-                break;
-              }
-          }
-
-          if (ok)
-          {
-            dsUnion(ds, u, c);
-            ds[c].row = true;
-            continue;
-          }
-        }
-
-        if (x > 0 && ds[l].use && (ds[l].id == l || !ds[l].row))
-          dsUnion(ds, l, c);
-      }
-    }
-
-  int rectId = 0;
-  for (unsigned int y = 0; y < h; ++y)
-    for (unsigned int x = 0; x < w; ++x)
-    {
-      const int c = y * w + x;
-
-      if (ds[c].use && ds[c].id == c)
-      {
-        if (rectId >= KVMFR_MAX_DAMAGE_RECTS)
-        {
-          rectId = 0;
-          goto done;
-        }
-
-        int x1 = ds[c].x1 << this->diffShift;
-        int y1 = ds[c].y1 << this->diffShift;
-        int x2 = min((ds[c].x2 + 1) << this->diffShift, this->grabWidth);
-        int y2 = min((ds[c].y2 + 1) << this->diffShift, this->grabHeight);
-        frame->damageRects[rectId++] = (FrameDamageRect) {
-          .x = x1,
-          .y = y1,
-          .width = x2 - x1,
-          .height = y2 - y1,
-        };
-      }
-    }
-
-done:
-  frame->damageRectsCount = rectId;
+  frame->damageRectsCount = rectsFromDiffMap(frame->damageRects,
+      KVMFR_MAX_DAMAGE_RECTS, this->diffMap, w, h, this->diffShift,
+      this->grabWidth, this->grabHeight);
 }
 
 static CaptureResult nvfbc_waitFrame(CaptureFrame * frame,
@@ -763,24 +635,25 @@ static CaptureResult nvfbc_getFrame(FrameBuffer * frame,
 
   if (info->width == this->grabWidth && info->height == this->grabHeight)
   {
-    const bool wasFresh = info->wasFresh;
+    /* a slot that was not written by the last frame also needs the damage
+     * accumulated since it was, this is consumed here so merge in place */
+    const uint8_t * map = this->diffMap;
+    if (!info->wasFresh)
+    {
+      diffMerge(info->diffMap, this->diffMap, h * w);
+      map = info->diffMap;
+    }
 
     for (unsigned int y = 0; y < h; ++y)
     {
+      const uint8_t * row = map + y * w;
       const unsigned int ystart = y << this->diffShift;
       const unsigned int yend = min(height, (y + 1)  << this->diffShift);
 
-      for (unsigned int x = 0; x < w; )
+      for (unsigned int x = rectsDiffScan(row, 0, w, true); x < w;
+          x = rectsDiffScan(row, x, w, true))
       {
-        if ((wasFresh || !info->diffMap[y * w + x]) && !this->diffMap[y * w + x])
-        {
-          ++x;
-          continue;
-        }
-
-        unsigned int x2 = x;
-        while (x2 < w && ((!wasFresh && info->diffMap[y * w + x2]) || this->diffMap[y * w + x2]))
-          ++x2;
+        const unsigned int x2 = rectsDiffScan(row, x, w, false);
 
         unsigned int width = (min(x2 << this->diffShift, this->grabWidth) - (x << this->diffShift)) * 4;
         rectCopyUnaligned(frameData, this->frameBuffer, ystart, yend, x << (2 + this->diffShift),
@@ -808,7 +681,7 @@ static CaptureResult nvfbc_getFrame(FrameBuffer * frame,
       height * this->grabInfo.dwBufferWidth * 4
     );
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for (int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
   {
     if (i == frameIndex)
     {
@@ -825,10 +698,7 @@ static CaptureResult nvfbc_getFrame(FrameBuffer * frame,
         this->frameInfo[i].wasFresh = false;
       }
       else
-      {
-        for (unsigned int j = 0; j < h * w; ++j)
-          this->frameInfo[i].diffMap[j] |= this->diffMap[j];
-      }
+        diffMerge(this->frameInfo[i].diffMap, this->diffMap, h * w);
     }
     else
     {
@@ -851,15 +721,8 @@ static int pointerThread(void * unused)
     CaptureResult  result;
     CapturePointer pointer = { 0 };
 
-    void * data;
-    uint32_t size;
-    if (!this->getPointerBufferFn(&data, &size))
-    {
-      DEBUG_WARN("failed to get a pointer buffer");
-      continue;
-    }
-
-    result = NvFBCToSysGetCursor(this->nvfbc, &pointer, data, size);
+    result = NvFBCToSysGetCursor(this->nvfbc, &pointer,
+        this->getPointerBufferFn);
     if (result != CAPTURE_RESULT_OK)
     {
       DEBUG_WARN("NvFBCToSysGetCursor failed");
@@ -338,7 +338,8 @@ CaptureResult NvFBCToSysCapture(
   return CAPTURE_RESULT_OK;
 }
 
-CaptureResult NvFBCToSysGetCursor(NvFBCHandle handle, CapturePointer * pointer, void * buffer, unsigned int size)
+CaptureResult NvFBCToSysGetCursor(NvFBCHandle handle, CapturePointer * pointer,
+    CaptureGetPointerBuffer getPointerBufferFn)
 {
   NVFBC_CURSOR_CAPTURE_PARAMS params;
   params.dwVersion = NVFBC_CURSOR_CAPTURE_PARAMS_VER;
@@ -381,6 +382,15 @@ CaptureResult NvFBCToSysGetCursor(NvFBCHandle handle, CapturePointer * pointer,
       return CAPTURE_RESULT_ERROR;
   }
 
+  // the buffer is only taken once the size of the shape is known
+  void * buffer;
+  uint32_t size = params.dwBufferSize;
+  if (!getPointerBufferFn(&buffer, &size))
+  {
+    DEBUG_WARN("failed to get a pointer buffer");
+    return CAPTURE_RESULT_ERROR;
+  }
+
   if (params.dwBufferSize > size)
   {
     DEBUG_WARN("Cursor data larger then provided buffer");
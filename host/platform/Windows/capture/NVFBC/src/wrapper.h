@@ -92,7 +92,8 @@ CaptureResult NvFBCToSysCapture(
   NvFBCFrameGrabInfo * grabInfo
 );
 
-CaptureResult NvFBCToSysGetCursor(NvFBCHandle handle, CapturePointer * pointer, void * buffer, unsigned int size);
+CaptureResult NvFBCToSysGetCursor(NvFBCHandle handle, CapturePointer * pointer,
+    CaptureGetPointerBuffer getPointerBufferFn);
 
 #ifdef __cplusplus
 }
@@ -20,5 +20,8 @@
 
 typedef void (*MouseHookFn)(int x, int y);
 
-void mouseHook_install(MouseHookFn callback);
+/* a pollRate of zero hooks every mouse event, otherwise the position is
+ * sampled this many times a second, or once per DWM composition if negative,
+ * and the callback is only made when it has moved */
+void mouseHook_install(MouseHookFn callback, int pollRate);
 void mouseHook_remove(void);
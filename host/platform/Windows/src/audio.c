@@ -0,0 +1,359 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "interface/platform.h"
+#include "common/debug.h"
+#include "common/windebug.h"
+#include "common/time.h"
+
+#define COBJMACROS
+#include <windows.h>
+#include <initguid.h>
+#include <mmdeviceapi.h>
+#include <audioclient.h>
+#include <avrt.h>
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// the WASAPI buffer duration in 100ns units
+#define AUDIO_BUFFER_DURATION 1000000LL // 100ms
+#define AUDIO_POLL_MS         5
+
+struct WASAPI
+{
+  HANDLE      thread;
+  HANDLE      initEvent;
+  atomic_bool running;
+  OSAudioFn   fn;
+
+  IMMDeviceEnumerator * enumerator;
+  IMMDevice           * device;
+  IAudioClient        * client;
+  IAudioCaptureClient * capture;
+
+  unsigned int channels;
+  unsigned int sampleRate;
+  bool         isFloat;
+
+  int16_t    * buffer;
+  unsigned int bufferFrames;
+};
+
+static struct WASAPI wasapi = { 0 };
+
+static void wasapiClose(void)
+{
+  if (wasapi.client)
+    IAudioClient_Stop(wasapi.client);
+
+  if (wasapi.capture)
+  {
+    IAudioCaptureClient_Release(wasapi.capture);
+    wasapi.capture = NULL;
+  }
+
+  if (wasapi.client)
+  {
+    IAudioClient_Release(wasapi.client);
+    wasapi.client = NULL;
+  }
+
+  if (wasapi.device)
+  {
+    IMMDevice_Release(wasapi.device);
+    wasapi.device = NULL;
+  }
+}
+
+static bool wasapiOpen(void)
+{
+  HRESULT status;
+
+  status = IMMDeviceEnumerator_GetDefaultAudioEndpoint(wasapi.enumerator,
+      eRender, eConsole, &wasapi.device);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("GetDefaultAudioEndpoint failed", status);
+    return false;
+  }
+
+  status = IMMDevice_Activate(wasapi.device, &IID_IAudioClient, CLSCTX_ALL,
+      NULL, (void **)&wasapi.client);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("IMMDevice_Activate failed", status);
+    goto fail;
+  }
+
+  WAVEFORMATEX * format;
+  status = IAudioClient_GetMixFormat(wasapi.client, &format);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("GetMixFormat failed", status);
+    goto fail;
+  }
+
+  WORD tag = format->wFormatTag;
+  if (tag == WAVE_FORMAT_EXTENSIBLE)
+    tag = ((WAVEFORMATEXTENSIBLE *)format)->SubFormat.Data1;
+
+  wasapi.isFloat    = tag == WAVE_FORMAT_IEEE_FLOAT;
+  wasapi.channels   = format->nChannels;
+  wasapi.sampleRate = format->nSamplesPerSec;
+
+  if ((!wasapi.isFloat || format->wBitsPerSample != 32) &&
+      ( tag != WAVE_FORMAT_PCM || format->wBitsPerSample != 16))
+  {
+    DEBUG_ERROR("Unsupported mix format (tag: 0x%x, bits: %u)", tag,
+        format->wBitsPerSample);
+    CoTaskMemFree(format);
+    goto fail;
+  }
+
+  if (wasapi.channels < 1 || wasapi.channels > KVMFR_AUDIO_MAX_CHANNELS)
+  {
+    DEBUG_ERROR("Unsupported channel count: %u", wasapi.channels);
+    CoTaskMemFree(format);
+    goto fail;
+  }
+
+  status = IAudioClient_Initialize(wasapi.client, AUDCLNT_SHAREMODE_SHARED,
+      AUDCLNT_STREAMFLAGS_LOOPBACK, AUDIO_BUFFER_DURATION, 0, format, NULL);
+  CoTaskMemFree(format);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("IAudioClient_Initialize failed", status);
+    goto fail;
+  }
+
+  status = IAudioClient_GetService(wasapi.client, &IID_IAudioCaptureClient,
+      (void **)&wasapi.capture);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("IAudioClient_GetService failed", status);
+    goto fail;
+  }
+
+  status = IAudioClient_Start(wasapi.client);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("IAudioClient_Start failed", status);
+    goto fail;
+  }
+
+  DEBUG_INFO("Audio loopback   : %u channels @ %u Hz (%s)", wasapi.channels,
+      wasapi.sampleRate, wasapi.isFloat ? "F32" : "S16");
+  return true;
+
+fail:
+  wasapiClose();
+  return false;
+}
+
+static bool wasapiReserve(unsigned int frames)
+{
+  if (frames <= wasapi.bufferFrames)
+    return true;
+
+  int16_t * buffer = realloc(wasapi.buffer,
+      frames * wasapi.channels * sizeof(*buffer));
+  if (!buffer)
+  {
+    DEBUG_ERROR("Out of memory");
+    return false;
+  }
+
+  wasapi.buffer       = buffer;
+  wasapi.bufferFrames = frames;
+  return true;
+}
+
+/* Drains every packet that is ready, returns false if the device needs to be
+ * reopened, e.g. because the default endpoint or its format changed. */
+static bool wasapiProcess(void)
+{
+  HRESULT status;
+  UINT32  packet;
+
+  while (SUCCEEDED(status =
+        IAudioCaptureClient_GetNextPacketSize(wasapi.capture, &packet)) &&
+      packet > 0)
+  {
+    BYTE  * data;
+    UINT32  frames;
+    DWORD   flags;
+    UINT64  qpcPosition;
+
+    status = IAudioCaptureClient_GetBuffer(wasapi.capture, &data, &frames,
+        &flags, NULL, &qpcPosition);
+    if (FAILED(status))
+      break;
+
+    // qpcPosition is the capture time in 100ns units of the QPC clock
+    uint64_t captureTime = qpcPosition / 10;
+    if (flags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR)
+      captureTime = microtime();
+
+    if (!wasapiReserve(frames))
+    {
+      IAudioCaptureClient_ReleaseBuffer(wasapi.capture, frames);
+      continue;
+    }
+
+    const unsigned int samples = frames * wasapi.channels;
+    if (flags & AUDCLNT_BUFFERFLAGS_SILENT)
+      memset(wasapi.buffer, 0, samples * sizeof(*wasapi.buffer));
+    else if (wasapi.isFloat)
+    {
+      const float * src = (const float *)data;
+      for (unsigned int i = 0; i < samples; ++i)
+      {
+        const float s = src[i] * 32768.0f;
+        wasapi.buffer[i] = s >= 32767.0f ? 32767 : s <= -32768.0f ? -32768 :
+          (int16_t)lrintf(s);
+      }
+    }
+    else
+      memcpy(wasapi.buffer, data, samples * sizeof(*wasapi.buffer));
+
+    IAudioCaptureClient_ReleaseBuffer(wasapi.capture, frames);
+    wasapi.fn(wasapi.buffer, frames, wasapi.channels, wasapi.sampleRate,
+        captureTime);
+  }
+
+  if (FAILED(status))
+  {
+    if (status != AUDCLNT_E_DEVICE_INVALIDATED)
+      DEBUG_WINERROR("Audio capture failed", status);
+    return false;
+  }
+
+  return true;
+}
+
+static DWORD WINAPI wasapiThread(LPVOID lParam)
+{
+  HRESULT status = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("CoInitializeEx failed", status);
+    SetEvent(wasapi.initEvent);
+    return 0;
+  }
+
+  status = CoCreateInstance(&CLSID_MMDeviceEnumerator, NULL, CLSCTX_ALL,
+      &IID_IMMDeviceEnumerator, (void **)&wasapi.enumerator);
+  if (FAILED(status))
+  {
+    DEBUG_WINERROR("Failed to create the device enumerator", status);
+    SetEvent(wasapi.initEvent);
+    goto exit;
+  }
+
+  atomic_store(&wasapi.running, true);
+  SetEvent(wasapi.initEvent);
+
+  DWORD  taskIndex = 0;
+  HANDLE task      = AvSetMmThreadCharacteristicsA("Audio", &taskIndex);
+  if (!task)
+    DEBUG_WINERROR("AvSetMmThreadCharacteristicsA failed", GetLastError());
+
+  while (atomic_load(&wasapi.running))
+  {
+    if (!wasapi.client && !wasapiOpen())
+    {
+      // the endpoint may come back, e.g. when a new device is plugged in
+      Sleep(1000);
+      continue;
+    }
+
+    if (!wasapiProcess())
+    {
+      wasapiClose();
+      continue;
+    }
+
+    Sleep(AUDIO_POLL_MS);
+  }
+
+  if (task)
+    AvRevertMmThreadCharacteristics(task);
+
+  wasapiClose();
+  IMMDeviceEnumerator_Release(wasapi.enumerator);
+  wasapi.enumerator = NULL;
+
+exit:
+  CoUninitialize();
+  return 0;
+}
+
+bool os_audioStart(OSAudioFn fn)
+{
+  wasapi.fn        = fn;
+  wasapi.initEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (!wasapi.initEvent)
+  {
+    DEBUG_WINERROR("Failed to create the audio init event", GetLastError());
+    return false;
+  }
+
+  atomic_store(&wasapi.running, false);
+  wasapi.thread = CreateThread(NULL, 0, wasapiThread, NULL, 0, NULL);
+  if (!wasapi.thread)
+  {
+    DEBUG_WINERROR("Failed to create the audio thread", GetLastError());
+    CloseHandle(wasapi.initEvent);
+    wasapi.initEvent = NULL;
+    return false;
+  }
+
+  WaitForSingleObject(wasapi.initEvent, INFINITE);
+  CloseHandle(wasapi.initEvent);
+  wasapi.initEvent = NULL;
+
+  if (!atomic_load(&wasapi.running))
+  {
+    WaitForSingleObject(wasapi.thread, INFINITE);
+    CloseHandle(wasapi.thread);
+    wasapi.thread = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+void os_audioStop(void)
+{
+  if (!wasapi.thread)
+    return;
+
+  atomic_store(&wasapi.running, false);
+  WaitForSingleObject(wasapi.thread, INFINITE);
+  CloseHandle(wasapi.thread);
+  wasapi.thread = NULL;
+
+  free(wasapi.buffer);
+  wasapi.buffer       = NULL;
+  wasapi.bufferFrames = 0;
+}
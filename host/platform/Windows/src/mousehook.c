@@ -24,6 +24,7 @@
 #include "platform.h"
 
 #include <windows.h>
+#include <dwmapi.h>
 #include <stdbool.h>
 
 struct mouseHook
@@ -31,6 +32,7 @@ struct mouseHook
   bool        installed;
   HHOOK       hook;
   MouseHookFn callback;
+  int         pollRate;
   int         x, y;
   HANDLE      event , updateEvent;
   HANDLE      thread, updateThread;
@@ -41,7 +43,7 @@ static struct mouseHook mouseHook = { 0 };
 // forwards
 static LRESULT WINAPI mouseHook_hook(int nCode, WPARAM wParam, LPARAM lParam);
 
-static bool switchDesktopAndHook(void)
+static bool switchDesktop(void)
 {
   HDESK desk = OpenInputDesktop(0, FALSE, GENERIC_ALL);
   if (!desk)
@@ -57,6 +59,13 @@ static bool switchDesktopAndHook(void)
     return false;
   }
   CloseDesktop(desk);
+  return true;
+}
+
+static bool switchDesktopAndHook(void)
+{
+  if (!switchDesktop())
+    return false;
 
   POINT position;
   GetCursorPos(&position);
@@ -111,6 +120,55 @@ static DWORD WINAPI updateThreadProc(LPVOID lParam)
   }
 }
 
+/* samples the position instead of hooking every mouse event, this bounds the
+ * pointer updates to the rate and keeps the hook out of the guest's input */
+static DWORD WINAPI pollThreadProc(LPVOID lParam)
+{
+  if (!switchDesktop())
+    return 0;
+
+  const DWORD interval = mouseHook.pollRate > 0 ?
+    (mouseHook.pollRate < 1000 ? 1000 / mouseHook.pollRate : 1) : 0;
+  bool first = true;
+
+  while(true)
+  {
+    if (interval)
+    {
+      if (WaitForSingleObject(mouseHook.event, interval) != WAIT_TIMEOUT)
+        break;
+    }
+    else
+    {
+      // once per composition, or at 60Hz when it can not be waited on
+      if (FAILED(DwmFlush()))
+        Sleep(16);
+
+      if (WaitForSingleObject(mouseHook.event, 0) != WAIT_TIMEOUT)
+        break;
+    }
+
+    POINT position;
+    if (!GetCursorPos(&position))
+    {
+      // the input desktop has changed, such as to the secure desktop
+      switchDesktop();
+      continue;
+    }
+
+    if (first || mouseHook.x != position.x || mouseHook.y != position.y)
+    {
+      first       = false;
+      mouseHook.x = position.x;
+      mouseHook.y = position.y;
+      mouseHook.callback(position.x, position.y);
+    }
+  }
+
+  DEBUG_INFO("Mouse poll thread received quit request");
+  return 0;
+}
+
 static DWORD WINAPI threadProc(LPVOID lParam) {
   if (mouseHook.installed)
   {
@@ -163,7 +221,7 @@ static DWORD WINAPI threadProc(LPVOID lParam) {
   return 0;
 }
 
-void mouseHook_install(MouseHookFn callback)
+void mouseHook_install(MouseHookFn callback, int pollRate)
 {
   if (!mouseHook.event)
   {
@@ -187,6 +245,16 @@ void mouseHook_install(MouseHookFn callback)
     }
   }
 
+  mouseHook.pollRate = pollRate;
+  if (pollRate)
+  {
+    mouseHook.callback     = callback;
+    mouseHook.updateThread = NULL;
+    mouseHook.thread       =
+      CreateThread(NULL, 0, pollThreadProc, NULL, 0, NULL);
+    return;
+  }
+
   mouseHook.thread =
     CreateThread(NULL, 0, threadProc, callback, 0, NULL);
 
@@ -200,11 +268,14 @@ void mouseHook_remove(void)
     return;
 
   SetEvent(mouseHook.event);
-  WaitForSingleObject(mouseHook.thread      , INFINITE);
-  WaitForSingleObject(mouseHook.updateThread, INFINITE);
-  ResetEvent(mouseHook.event);
+  WaitForSingleObject(mouseHook.thread, INFINITE);
   CloseHandle(mouseHook.thread);
-  CloseHandle(mouseHook.updateThread);
+  if (mouseHook.updateThread)
+  {
+    WaitForSingleObject(mouseHook.updateThread, INFINITE);
+    CloseHandle(mouseHook.updateThread);
+  }
+  ResetEvent(mouseHook.event);
 }
 
 static LRESULT WINAPI mouseHook_hook(int nCode, WPARAM wParam, LPARAM lParam)
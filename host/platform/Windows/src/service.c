@@ -45,6 +45,12 @@
 #define FAIL_MAX_RETRIES         5
 #define FAIL_RETRY_INIT_INTERVAL 1000
 
+/* a host that exits after running for a while is restarted at once, one that
+ * keeps exiting backs off from RESTART_INIT_INTERVAL up to the maximum */
+#define RESTART_INIT_INTERVAL 50
+#define RESTART_MAX_INTERVAL  5000
+#define RESTART_STABLE_TIME   10000
+
 struct Service
 {
   FILE * logFile;
@@ -498,6 +504,7 @@ void Uninstall(void)
 SERVICE_STATUS         gSvcStatus;
 SERVICE_STATUS_HANDLE  gSvcStatusHandle;
 HANDLE                 ghSvcStopEvent = NULL;
+HANDLE                 ghSvcSessionEvent = NULL;
 
 void ReportSvcStatus(DWORD dwCurrentState, DWORD dwWin32ExitCode,
     DWORD dwWaitHint)
@@ -511,7 +518,8 @@ void ReportSvcStatus(DWORD dwCurrentState, DWORD dwWin32ExitCode,
   if (dwCurrentState == SERVICE_START_PENDING)
     gSvcStatus.dwControlsAccepted = 0;
   else
-    gSvcStatus.dwControlsAccepted = SERVICE_ACCEPT_STOP;
+    gSvcStatus.dwControlsAccepted = SERVICE_ACCEPT_STOP |
+      SERVICE_ACCEPT_SESSIONCHANGE;
 
   if ((dwCurrentState == SERVICE_RUNNING) || (dwCurrentState == SERVICE_STOPPED))
     gSvcStatus.dwCheckPoint = 0;
@@ -521,7 +529,8 @@ void ReportSvcStatus(DWORD dwCurrentState, DWORD dwWin32ExitCode,
   SetServiceStatus(gSvcStatusHandle, &gSvcStatus);
 }
 
-VOID WINAPI SvcCtrlHandler(DWORD dwControl)
+DWORD WINAPI SvcCtrlHandler(DWORD dwControl, DWORD dwEventType,
+    LPVOID lpEventData, LPVOID lpContext)
 {
   switch(dwControl)
   {
@@ -530,6 +539,13 @@ VOID WINAPI SvcCtrlHandler(DWORD dwControl)
       SetEvent(ghSvcStopEvent);
       break;
 
+    // wake the launch loop so it does not wait out its poll for a new session
+    case SERVICE_CONTROL_SESSIONCHANGE:
+      if (dwEventType == WTS_CONSOLE_CONNECT ||
+          dwEventType == WTS_SESSION_LOGON)
+        SetEvent(ghSvcSessionEvent);
+      return NO_ERROR;
+
     case SERVICE_CONTROL_INTERROGATE:
       break;
 
@@ -538,6 +554,7 @@ VOID WINAPI SvcCtrlHandler(DWORD dwControl)
   }
 
   ReportSvcStatus(gSvcStatus.dwCurrentState, NO_ERROR, 0);
+  return NO_ERROR;
 }
 
 static bool sleepOrStop(DWORD ms)
@@ -555,7 +572,8 @@ static bool sleepOrStop(DWORD ms)
 
 VOID WINAPI SvcMain(DWORD dwArgc, LPTSTR *lpszArgv)
 {
-  gSvcStatusHandle = RegisterServiceCtrlHandler(SVCNAME, SvcCtrlHandler);
+  gSvcStatusHandle = RegisterServiceCtrlHandlerEx(SVCNAME, SvcCtrlHandler,
+      NULL);
 
   gSvcStatus.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
   gSvcStatus.dwServiceSpecificExitCode = 0;
@@ -569,6 +587,14 @@ VOID WINAPI SvcMain(DWORD dwArgc, LPTSTR *lpszArgv)
     return;
   }
 
+  ghSvcSessionEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (!ghSvcSessionEvent)
+  {
+    CloseHandle(ghSvcStopEvent);
+    ReportSvcStatus(SERVICE_STOPPED, NO_ERROR, 0);
+    return;
+  }
+
   setupLogging();
 
   /* check if the ivshmem device exists */
@@ -598,7 +624,8 @@ VOID WINAPI SvcMain(DWORD dwArgc, LPTSTR *lpszArgv)
       doLog("Failed to create exit event: 0x%lx\n", GetLastError());
   }
 
-  int failCount = 0;
+  int failCount    = 0;
+  int restartCount = 0;
   while(1)
   {
     ULONGLONG launchTime = 0ULL;
@@ -616,9 +643,10 @@ VOID WINAPI SvcMain(DWORD dwArgc, LPTSTR *lpszArgv)
 
     if (!service.running)
     {
-      // If the service is running, wait only on ghSvcStopEvent and prepare to restart in one second.
-      count = 1;
-      duration = 1000;
+      /* If the host is not running, wait on ghSvcStopEvent and for a console
+       * session, retrying in one second in case the notification is missed */
+      waitOn[1] = ghSvcSessionEvent;
+      duration  = 1000;
     }
 
     switch (WaitForMultipleObjects(count, waitOn, FALSE, duration))
@@ -628,7 +656,11 @@ VOID WINAPI SvcMain(DWORD dwArgc, LPTSTR *lpszArgv)
 
       case WAIT_OBJECT_0 + 1:
       {
+        if (!service.running)
+          break;
+
         service.running = false;
+        bool quickRestart = true;
 
         DWORD code;
         if (!GetExitCodeProcess(service.process, &code))
@@ -666,6 +698,7 @@ VOID WINAPI SvcMain(DWORD dwArgc, LPTSTR *lpszArgv)
 
               if (sleepOrStop(backoff))
                 goto stopped;
+              quickRestart = false;
               break;
             }
 
@@ -679,9 +712,22 @@ VOID WINAPI SvcMain(DWORD dwArgc, LPTSTR *lpszArgv)
           }
         }
 
-        // avoid restarting too often
-        if (GetTickCount64() - launchTime < 1000 && sleepOrStop(1000))
-          goto stopped;
+        // avoid restarting too often, but get a host that was running back fast
+        if (GetTickCount64() - launchTime >= RESTART_STABLE_TIME)
+          restartCount = 0;
+
+        if (quickRestart && restartCount++ > 0)
+        {
+          const int shift = restartCount - 2 < 7 ? restartCount - 2 : 7;
+          DWORD delay = RESTART_INIT_INTERVAL << shift;
+          if (delay > RESTART_MAX_INTERVAL)
+            delay = RESTART_MAX_INTERVAL;
+
+          doLog("Host application exited %d times in quick succession, waiting %u ms...\n",
+              restartCount, delay);
+          if (sleepOrStop(delay))
+            goto stopped;
+        }
         break;
       }
 
@@ -728,6 +774,7 @@ VOID WINAPI SvcMain(DWORD dwArgc, LPTSTR *lpszArgv)
 
 shutdown:
   ReportSvcStatus(SERVICE_STOPPED, NO_ERROR, 0);
+  CloseHandle(ghSvcSessionEvent);
   CloseHandle(ghSvcStopEvent);
   finishLogging();
 }
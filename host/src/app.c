@@ -35,6 +35,10 @@
 #include "common/cpuinfo.h"
 #include "common/util.h"
 #include "common/array.h"
+#include "common/backoff.h"
+#include "common/fbprofile.h"
+#include "common/rects.h"
+#include "common/metrics.h"
 
 #include <lgmp/host.h>
 
@@ -44,17 +48,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdatomic.h>
 
 #define CONFIG_FILE "looking-glass-host.ini"
 #define POINTER_SHAPE_BUFFERS 3
 
-static const struct LGMPQueueConfig FRAME_QUEUE_CONFIG =
-{
-  .queueID     = LGMP_Q_FRAME,
-  .numMessages = LGMP_Q_FRAME_LEN,
-  .subTimeout  = 1000
-};
-
 static const struct LGMPQueueConfig POINTER_QUEUE_CONFIG =
 {
   .queueID     = LGMP_Q_POINTER,
@@ -62,7 +60,18 @@ static const struct LGMPQueueConfig POINTER_QUEUE_CONFIG =
   .subTimeout  = 1000
 };
 
-#define MAX_POINTER_SIZE (sizeof(KVMFRCursor) + (512 * 512 * 4))
+/* most shapes fit the rotating buffers, the rare larger ones share a single
+ * buffer sized for the largest shape supported */
+#define POINTER_SHAPE_SIZE (sizeof(KVMFRCursor) + (128 * 128 * 4))
+#define MAX_POINTER_SIZE   (sizeof(KVMFRCursor) + (512 * 512 * 4))
+
+// adaptive resolution, the output is reduced by at most 2^SCALE_LEVEL_MAX
+#define SCALE_LEVEL_MAX   2
+#define SCALE_FRAMES_DOWN 30  // frames over budget before lowering
+#define SCALE_FRAMES_UP   300 // frames well under budget before raising
+
+// the most clients that can be woken through the ivshmem doorbell at once
+#define MAX_DOORBELL_PEERS 16
 
 enum AppState
 {
@@ -82,23 +91,88 @@ struct app
   PLGMPHostQueue pointerQueue;
   PLGMPMemory    pointerMemory[LGMP_Q_POINTER_LEN];
   PLGMPMemory    pointerShapeMemory[POINTER_SHAPE_BUFFERS];
+  PLGMPMemory    pointerShapeLarge;
+  PLGMPMemory    pointerShapeNext;  // handed to the capture for the next shape
   LG_Lock        pointerLock;
   CapturePointer pointerInfo;
   PLGMPMemory    pointerShape;
+  PLGMPMemory    pointerLive;
   bool           pointerShapeValid;
+  bool           pointerResend;     // a new client still needs the state
+  bool           pointerPending;    // an update is waiting for queue space
+  bool           pointerPendingPos; // and it includes a position change
   unsigned int   pointerIndex;
   unsigned int   pointerShapeIndex;
 
   long           pageSize;
   size_t         maxFrameSize;
   PLGMPHostQueue frameQueue;
-  PLGMPMemory    frameMemory[LGMP_Q_FRAME_LEN];
+  unsigned int   frameQueueLen;
+  bool           autoFrameQueue; // frameQueueLen is chosen by planFrameQueue
+  size_t         frameMemAvail;  // IVSHMEM left for the frames after setup
+  size_t         frameNeeded;    // the slot size the current mode needs
+  PLGMPMemory    frameMemory[LGMP_Q_FRAME_LEN_MAX];
+  bool           compress;
+  void         * compressMemory[LGMP_Q_FRAME_LEN_MAX];
+  FrameBuffer  * compressBuffer[LGMP_Q_FRAME_LEN_MAX];
   unsigned int   frameIndex;
   bool           frameValid;
   uint32_t       frameSerial;
 
+  bool           audio;
+  LG_Lock        audioLock;
+  PLGMPHostQueue audioQueue;
+  PLGMPMemory    audioMemory[LGMP_Q_AUDIO_LEN];
+  unsigned int   audioIndex;
+
+  // latency tracing, set by the capture loop and read by sendFrame
+  _Atomic(uint64_t) captureStart;
+  _Atomic(uint64_t) captureDone;
+
+  // the counters for the KVMFRHostStats being gathered, owned by sendFrame
+  struct
+  {
+    uint64_t       start;
+    unsigned int   frames;
+    uint64_t       damage;
+    unsigned int   writes;
+    uint64_t       writeUs;
+    uint64_t       gpuCopyUs;
+    unsigned int   queueWaits;
+    KVMFRHostStats published;
+    StatsHistogram writeStats; // for the metrics export, in microseconds
+  }
+  stats;
+
+  // adaptive capture rate, the interval is updated by sendFrame
+  struct
+  {
+    unsigned int minUs;     // from throttleFPS, zero for no limit
+    unsigned int idleUs;    // from idleFPS, zero to disable
+    double       threshold; // fraction of the frame that counts as motion
+    atomic_uint  interval;  // the current delay between captures
+    unsigned int standbyUs; // from standbyFPS, zero to stop with no clients
+  }
+  rate;
+
+  // adaptive resolution, the level is updated by sendFrame
+  struct
+  {
+    bool         enabled;
+    unsigned int budgetUs; // from adaptiveScaleFPS
+    unsigned int level;    // the capture output is reduced by 2^level
+    double       avgUs;    // moving average of the frame write time
+    unsigned int over;     // consecutive frames over the budget
+    unsigned int under;    // consecutive frames that would fit a level up
+  }
+  scale;
+
   CaptureInterface * iface;
 
+  struct IVSHMEM * shmDev;
+  bool             hasDoorbell;
+  atomic_int       doorbellPeers[MAX_DOORBELL_PEERS]; // -1 if the slot is free
+
   enum AppState state;
   LGTimer  * lgmpTimer;
   LGThread * frameThread;
@@ -118,6 +192,17 @@ static bool validateCaptureBackend(struct Option * opt, const char ** error)
   return false;
 }
 
+static bool validateFrameBuffers(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_int == 0 ||
+      (opt->value.x_int >= LGMP_Q_FRAME_LEN &&
+       opt->value.x_int <= LGMP_Q_FRAME_LEN_MAX))
+    return true;
+
+  *error = "The number of frame buffers must be 0 (auto) or between 2 and 4";
+  return false;
+}
+
 static struct Option options[] =
 {
   {
@@ -135,9 +220,116 @@ static struct Option options[] =
     .type           = OPTION_TYPE_INT,
     .value.x_int    = 0,
   },
+  {
+    .module         = "app",
+    .name           = "idleFPS",
+    .description    = "Lower the capture rate towards this while little is changing (0 to disable)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 0,
+  },
+  {
+    .module         = "app",
+    .name           = "idleThreshold",
+    .description    = "The percentage of the frame that must change to restore the full capture rate",
+    .type           = OPTION_TYPE_FLOAT,
+    .value.x_float  = 1.0f,
+  },
+  {
+    .module         = "app",
+    .name           = "standbyFPS",
+    .description    = "Keep capturing at this rate with no client connected so a new client gets a frame at once (0 to disable)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 0,
+  },
+  {
+    .module         = "app",
+    .name           = "frameBuffers",
+    .description    = "The number of frames to buffer in IVSHMEM (2-4, 0 = as many as fit)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = LGMP_Q_FRAME_LEN,
+    .validator      = validateFrameBuffers,
+  },
+  {
+    .module         = "app",
+    .name           = "compressFrames",
+    .description    = "Losslessly compress frames to reduce IVSHMEM bandwidth (not compatible with client DMA)",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
+  {
+    .module         = "app",
+    .name           = "adaptiveScale",
+    .description    = "Lower the capture resolution while the frames take longer than adaptiveScaleFPS allows to write",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
+  {
+    .module         = "app",
+    .name           = "adaptiveScaleFPS",
+    .description    = "The frame rate adaptiveScale keeps the frame write time within",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 60,
+  },
+  {
+    .module         = "app",
+    .name           = "copyThreads",
+    .description    = "The number of threads used to copy frames (0 = auto)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 0,
+  },
+  {
+    .module         = "app",
+    .name           = "fbProfile",
+    .description    = "Profile the frame buffer copies and log the results when capture stops",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
+  {
+    .module         = "app",
+    .name           = "metrics",
+    .description    = "Publish the performance metrics on a UNIX socket at this path (Linux) or a shared memory page by this name (Windows), empty to disable",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "",
+  },
+  {
+    .module         = "app",
+    .name           = "audio",
+    .description    = "Capture the guest audio output and send it to the client over IVSHMEM",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
   {0}
 };
 
+static void flushPointer(bool position);
+static void sendPointer(bool newClient);
+
+/* only the LGMP timer registers peers, the frame and pointer paths ring them
+ * and free the slots of those that have gone */
+static void addDoorbellPeer(uint16_t peerID)
+{
+  int freeSlot = -1;
+  for(int i = 0; i < MAX_DOORBELL_PEERS; ++i)
+  {
+    const int peer = atomic_load(&app.doorbellPeers[i]);
+    if (peer == peerID)
+      return;
+
+    if (peer < 0 && freeSlot < 0)
+      freeSlot = i;
+  }
+
+  if (freeSlot < 0)
+  {
+    DEBUG_WARN("Too many doorbell peers, peer %u will wait on its timeout",
+        peerID);
+    return;
+  }
+
+  atomic_store(&app.doorbellPeers[freeSlot], peerID);
+  DEBUG_INFO("Doorbell registered for peer %u", peerID);
+}
+
 static bool lgmpTimer(void * opaque)
 {
   LGMP_STATUS status;
@@ -170,11 +362,292 @@ static bool lgmpTimer(void * opaque)
         os_setCursorPos(sp->x, sp->y);
         break;
       }
+
+      case KVMFR_MESSAGE_DOORBELL:
+      {
+        if (!app.hasDoorbell)
+          break;
+
+        KVMFRDoorbell *db = (KVMFRDoorbell *)msg;
+        addDoorbellPeer(db->peerID);
+        break;
+      }
     }
 
     lgmpHostAckData(app.pointerQueue);
   }
 
+  /* new clients are served from here rather than the capture loop so a slow
+   * capture or frame copy never holds up their cursor state. Processing may
+   * also have freed space for a held back position update */
+  LG_LOCK(app.pointerLock);
+  if (lgmpHostQueueNewSubs(app.pointerQueue) > 0)
+    app.pointerResend = true;
+
+  if (app.pointerResend)
+    sendPointer(true);
+  else if (app.pointerPending)
+    flushPointer(false);
+  LG_UNLOCK(app.pointerLock);
+
+  return true;
+}
+
+static void ringDoorbell(uint16_t vector)
+{
+  for(int i = 0; i < MAX_DOORBELL_PEERS; ++i)
+  {
+    int peer = atomic_load(&app.doorbellPeers[i]);
+    if (peer < 0 || ivshmemRingDoorbell(app.shmDev, peer, vector))
+      continue;
+
+    // the peer is gone, unless the slot was given to a new one meanwhile
+    DEBUG_WARN("Failed to ring the doorbell of peer %d, dropping it", peer);
+    atomic_compare_exchange_strong(&app.doorbellPeers[i], &peer, -1);
+  }
+}
+
+/* Slows the capture down towards idleFPS while frames change less than the
+ * threshold or the client is not keeping up, and returns to the full rate as
+ * soon as there is motion. */
+static uint64_t damageArea(const CaptureFrame * frame)
+{
+  if (frame->damageRectsCount == 0)
+    return (uint64_t)frame->frameWidth * frame->frameHeight;
+
+  uint64_t area = 0;
+  for (uint32_t i = 0; i < frame->damageRectsCount; ++i)
+    area += (uint64_t)frame->damageRects[i].width *
+      frame->damageRects[i].height;
+  return area;
+}
+
+/* closed loop control of the capture resolution. When the frames take longer
+ * than the budget to write the capture is asked for half the size in each
+ * dimension, which cuts the copy to about a quarter, so the level is only
+ * raised again once the average would still fit with room to spare */
+static void scaleUpdate(uint64_t writeUs)
+{
+  if (!app.scale.enabled)
+    return;
+
+  if (app.scale.avgUs == 0.0)
+    app.scale.avgUs = writeUs;
+  else
+    app.scale.avgUs += ((double)writeUs - app.scale.avgUs) / 16.0;
+
+  const double budget = app.scale.budgetUs;
+  unsigned int level  = app.scale.level;
+  if (app.scale.avgUs > budget * 0.9)
+  {
+    app.scale.under = 0;
+    if (level < SCALE_LEVEL_MAX && ++app.scale.over >= SCALE_FRAMES_DOWN)
+      ++level;
+  }
+  else if (level > 0 && app.scale.avgUs * 4.0 < budget * 0.6)
+  {
+    app.scale.over = 0;
+    if (++app.scale.under >= SCALE_FRAMES_UP)
+      --level;
+  }
+  else
+  {
+    app.scale.over  = 0;
+    app.scale.under = 0;
+  }
+
+  if (level == app.scale.level)
+    return;
+
+  DEBUG_INFO("Frame write time %.2f ms against a %.2f ms budget, scale 1/%u",
+      app.scale.avgUs / 1000.0, budget / 1000.0, 1U << level);
+
+  app.scale.level = level;
+  app.scale.avgUs = 0.0;
+  app.scale.over  = 0;
+  app.scale.under = 0;
+  app.iface->setScaleLevel(level);
+}
+
+static void rateUpdate(const CaptureFrame * frame, bool clientBehind)
+{
+  if (!app.rate.idleUs)
+    return;
+
+  const uint64_t frameArea = (uint64_t)frame->frameWidth * frame->frameHeight;
+  const uint64_t area      = damageArea(frame);
+
+  const unsigned int interval = atomic_load(&app.rate.interval);
+  if (!clientBehind && area >= frameArea * app.rate.threshold)
+  {
+    if (interval != app.rate.minUs)
+      atomic_store(&app.rate.interval, app.rate.minUs);
+    return;
+  }
+
+  // back off by a quarter plus 1ms each idle frame
+  atomic_store(&app.rate.interval,
+      min(app.rate.idleUs, interval + interval / 4 + 1000));
+}
+
+static void statsFrame(const CaptureFrame * frame, uint64_t gpuCopyUs,
+    bool queueWait)
+{
+  const uint64_t frameArea = (uint64_t)frame->frameWidth * frame->frameHeight;
+  if (frameArea)
+    app.stats.damage += min(damageArea(frame) * 100 / frameArea, 100);
+
+  app.stats.gpuCopyUs += gpuCopyUs;
+  app.stats.queueWaits += queueWait ? 1 : 0;
+  ++app.stats.frames;
+}
+
+static void statsWrite(uint64_t us)
+{
+  app.stats.writeUs += us;
+  ++app.stats.writes;
+
+  if (app.stats.writeStats)
+    stats_histogramRecord(app.stats.writeStats, us);
+}
+
+// replace the published counters once a second has passed
+static void statsPublish(void)
+{
+  const uint64_t now     = microtime();
+  const uint64_t elapsed = now - app.stats.start;
+  if (elapsed < 1000000)
+    return;
+
+  if (app.stats.start)
+  {
+    const unsigned int frames = max(app.stats.frames, 1U);
+    KVMFRHostStats * out = &app.stats.published;
+    ++out->period;
+    out->captureRate = min(app.stats.frames * 1000000ULL / elapsed, UINT16_MAX);
+    out->damage      = app.stats.damage / frames;
+    out->gpuCopyUs   = app.stats.gpuCopyUs / frames;
+    out->writeUs     = app.stats.writes ?
+      app.stats.writeUs / app.stats.writes : 0;
+    out->queueWaits  = app.stats.queueWaits;
+  }
+
+  app.stats.start      = now;
+  app.stats.frames     = 0;
+  app.stats.damage     = 0;
+  app.stats.writes     = 0;
+  app.stats.writeUs    = 0;
+  app.stats.gpuCopyUs  = 0;
+  app.stats.queueWaits = 0;
+}
+
+/* the published counters are read without a lock, each is updated in a single
+ * store once a second which is all a monitor needs */
+static double metricCaptureRate(void * opaque)
+{
+  return app.stats.published.captureRate;
+}
+
+static double metricDamage(void * opaque)
+{
+  return app.stats.published.damage;
+}
+
+static double metricGPUCopy(void * opaque)
+{
+  return app.stats.published.gpuCopyUs * 1e-6;
+}
+
+static double metricQueueWaits(void * opaque)
+{
+  return app.stats.published.queueWaits;
+}
+
+static void startMetrics(const char * location)
+{
+  app.stats.writeStats = stats_histogramNew();
+  if (app.stats.writeStats)
+    metrics_registerHistogram("lg_host_write_seconds",
+        "Time taken to write a frame to IVSHMEM", app.stats.writeStats, 1e-6);
+
+  metrics_registerValue("lg_host_capture_rate",
+      "Frames captured over the last second", false, metricCaptureRate, NULL);
+  metrics_registerValue("lg_host_damage_percent",
+      "Mean damaged area of the frames over the last second", false,
+      metricDamage, NULL);
+  metrics_registerValue("lg_host_gpu_copy_seconds",
+      "Mean GPU copy time over the last second", false, metricGPUCopy, NULL);
+  metrics_registerValue("lg_host_queue_waits",
+      "Captures that waited on a full frame queue over the last second", false,
+      metricQueueWaits, NULL);
+
+  if (!metrics_startExport(location))
+    DEBUG_WARN("The metrics will not be exported");
+}
+
+static void stopMetrics(void)
+{
+  metrics_stopExport();
+  metrics_unregister("lg_host_write_seconds");
+  metrics_unregister("lg_host_capture_rate");
+  metrics_unregister("lg_host_damage_percent");
+  metrics_unregister("lg_host_gpu_copy_seconds");
+  metrics_unregister("lg_host_queue_waits");
+  stats_histogramFree(&app.stats.writeStats);
+}
+
+// the rows of pitch bytes the frame data spans
+static unsigned int frameRows(const CaptureFrame * frame)
+{
+  if (frame->format == CAPTURE_FMT_NV12)
+    return kvmfrFrameRows(FRAME_TYPE_NV12, frame->frameHeight);
+  return frame->frameHeight;
+}
+
+/* the size of a frame slot including the page the KVMFRFrame header uses, if
+ * compressing it must hold the worst case or compression is skipped */
+static size_t frameSlotSize(const CaptureFrame * frame)
+{
+  const size_t data = app.compress ?
+    framebuffer_compress_bound(frameRows(frame), frame->pitch) :
+    (size_t)frameRows(frame) * frame->pitch;
+
+  return ALIGN_PAD(app.pageSize + data, (size_t)app.pageSize);
+}
+
+/* pick the deepest queue whose slots fit the last mode seen, with no mode yet,
+ * or a truncated one, fall back to the default depth to get the largest slots */
+static unsigned int planFrameQueue(size_t avail)
+{
+  if (!app.autoFrameQueue)
+    return app.frameQueueLen;
+
+  if (!app.frameNeeded)
+    return LGMP_Q_FRAME_LEN;
+
+  return clamp(avail / app.frameNeeded,
+      (size_t)LGMP_Q_FRAME_LEN, (size_t)LGMP_Q_FRAME_LEN_MAX);
+}
+
+/* returns true if the layout no longer suits the frame and IVSHMEM needs to be
+ * reinitialized, which also happens when the guest changes resolution */
+static bool replanFrameQueue(const CaptureFrame * frame)
+{
+  if (!app.autoFrameQueue)
+    return false;
+
+  const size_t needed = frame->truncated ? 0 : frameSlotSize(frame);
+  if (needed == app.frameNeeded)
+    return false;
+
+  app.frameNeeded = needed;
+  const unsigned int len = planFrameQueue(app.frameMemAvail);
+  if (len == app.frameQueueLen)
+    return false;
+
+  DEBUG_INFO("Frame layout change, %u -> %u frame buffers",
+      app.frameQueueLen, len);
+  app.frameQueueLen = len;
   return true;
 }
 
@@ -184,19 +657,28 @@ static bool sendFrame(void)
   bool repeatFrame = false;
 
   //wait until there is room in the queue
+  Backoff backoff = BACKOFF_INIT;
   while(app.state == APP_STATE_RUNNING &&
-      lgmpHostQueuePending(app.frameQueue) == LGMP_Q_FRAME_LEN)
-  {
-    usleep(1);
-    continue;
-  }
+      lgmpHostQueuePending(app.frameQueue) == app.frameQueueLen)
+    backoff_wait(&backoff);
+
+  // a full queue means the client is not consuming the frames we capture
+  const bool clientBehind = backoff.count > 0;
 
   if (app.state != APP_STATE_RUNNING)
     return false;
 
-  switch(app.iface->waitFrame(&frame, app.maxFrameSize))
+  const CaptureResult result = app.iface->waitFrame(&frame, app.maxFrameSize);
+  const uint64_t mapDone = microtime();
+  switch(result)
   {
     case CAPTURE_RESULT_OK:
+      if (replanFrameQueue(&frame))
+      {
+        app.state = APP_STATE_REINIT;
+        return false;
+      }
+
       // reading the new subs count zeros it
       lgmpHostQueueNewSubs(app.frameQueue);
       break;
@@ -235,21 +717,25 @@ static bool sendFrame(void)
     if ((status = lgmpHostQueuePost(app.frameQueue, 0,
            app.frameMemory[app.frameIndex])) != LGMP_OK)
       DEBUG_ERROR("%s", lgmpStatusString(status));
+    else
+      ringDoorbell(KVMFR_DOORBELL_FRAME);
     return true;
   }
 
   // we increment the index first so that if we need to repeat a frame
   // the index still points to the latest valid frame
-  if (++app.frameIndex == LGMP_Q_FRAME_LEN)
+  if (++app.frameIndex == app.frameQueueLen)
     app.frameIndex = 0;
 
   KVMFRFrame * fi = lgmpHostMemPtr(app.frameMemory[app.frameIndex]);
   switch(frame.format)
   {
-    case CAPTURE_FMT_BGRA   : fi->type = FRAME_TYPE_BGRA   ; break;
-    case CAPTURE_FMT_RGBA   : fi->type = FRAME_TYPE_RGBA   ; break;
-    case CAPTURE_FMT_RGBA10 : fi->type = FRAME_TYPE_RGBA10 ; break;
-    case CAPTURE_FMT_RGBA16F: fi->type = FRAME_TYPE_RGBA16F; break;
+    case CAPTURE_FMT_BGRA     : fi->type = FRAME_TYPE_BGRA     ; break;
+    case CAPTURE_FMT_RGBA     : fi->type = FRAME_TYPE_RGBA     ; break;
+    case CAPTURE_FMT_RGBA10   : fi->type = FRAME_TYPE_RGBA10   ; break;
+    case CAPTURE_FMT_RGBA16F  : fi->type = FRAME_TYPE_RGBA16F  ; break;
+    case CAPTURE_FMT_NV12     : fi->type = FRAME_TYPE_NV12     ; break;
+    case CAPTURE_FMT_RGBA10_PQ: fi->type = FRAME_TYPE_RGBA10_PQ; break;
     default:
       DEBUG_ERROR("Unsupported frame format %d, skipping frame", frame.format);
       return true;
@@ -282,12 +768,47 @@ static bool sendFrame(void)
     (os_getAndClearPendingActivationRequest() ?
       FRAME_FLAG_REQUEST_ACTIVATION : 0) |
     (frame.truncated ?
-      FRAME_FLAG_TRUNCATED : 0);
+      FRAME_FLAG_TRUNCATED : 0) |
+    (app.scale.level && frame.frameWidth < frame.screenWidth ?
+      FRAME_FLAG_HOST_SCALED : 0);
+
+  // fall back to an uncompressed copy if the worst case would not fit
+  const size_t fbSize = app.maxFrameSize - app.pageSize;
+  const bool compress = app.compress &&
+    framebuffer_compress_bound(frameRows(&frame), frame.pitch) <= fbSize;
+  if (compress)
+    fi->flags |= FRAME_FLAG_COMPRESSED;
 
   fi->damageRectsCount  = frame.damageRectsCount;
   memcpy(fi->damageRects, frame.damageRects,
     frame.damageRectsCount * sizeof(FrameDamageRect));
 
+  if (frame.damageMapValid)
+  {
+    fi->flags          |= FRAME_FLAG_DAMAGE_MAP;
+    fi->damageMapWidth  = frame.damageMapWidth;
+    fi->damageMapHeight = frame.damageMapHeight;
+    memcpy(fi->damageMap, frame.damageMap,
+      rectsDamageMapStride(frame.damageMapWidth) * frame.damageMapHeight);
+  }
+
+  rateUpdate(&frame, clientBehind);
+
+  /* async backends may hand us a frame from a newer capture than the one we
+   * recorded, clamp so the offsets never go negative */
+  const uint64_t captureStart = min(atomic_load(&app.captureStart), mapDone);
+  const uint64_t captureDone  = min(atomic_load(&app.captureDone ), mapDone);
+  fi->captureTime       = captureStart;
+  fi->copyTime          = max(captureDone, captureStart) - captureStart;
+  fi->mapTime           = mapDone - captureStart;
+  fi->postTime          = microtime() - captureStart;
+  fi->writeTime         = 0;
+  fi->presentTime       = frame.presentTime;
+
+  statsFrame(&frame, fi->mapTime - fi->copyTime, clientBehind);
+  statsPublish();
+  fi->stats             = app.stats.published;
+
   app.frameValid = true;
 
   // put the framebuffer on the border of the next page
@@ -295,21 +816,56 @@ static bool sendFrame(void)
   FrameBuffer * fb = (FrameBuffer *)(((uint8_t*)fi) + fi->offset);
   framebuffer_prepare(fb);
 
-  /* we post and then get the frame, this is intentional! */
-  if ((status = lgmpHostQueuePost(app.frameQueue, 0,
-    app.frameMemory[app.frameIndex])) != LGMP_OK)
+  /* we post and then get the frame, this is intentional! In standby there is
+   * no one to post to, the frame is kept for the next client */
+  if (lgmpHostQueueHasSubs(app.frameQueue))
   {
-    DEBUG_ERROR("%s", lgmpStatusString(status));
+    if ((status = lgmpHostQueuePost(app.frameQueue, 0,
+      app.frameMemory[app.frameIndex])) != LGMP_OK)
+    {
+      DEBUG_ERROR("%s", lgmpStatusString(status));
+      return true;
+    }
+
+    ringDoorbell(KVMFR_DOORBELL_FRAME);
+  }
+  if (!app.compress)
+  {
+    if (app.iface->getFrame(fb, frame.frameHeight, app.frameIndex) ==
+        CAPTURE_RESULT_OK)
+    {
+      fi->writeTime = max(microtime() - captureStart, 1);
+      statsWrite(max(fi->writeTime, fi->postTime) - fi->postTime);
+      scaleUpdate(fi->writeTime);
+    }
     return true;
   }
 
-  app.iface->getFrame(fb, frame.frameHeight, app.frameIndex);
+  /* capture into the staging buffer for this frame index so the damage aware
+   * backends still see the previous content of the slot */
+  FrameBuffer * staging = app.compressBuffer[app.frameIndex];
+  framebuffer_prepare(staging);
+  if (app.iface->getFrame(staging, frame.frameHeight, app.frameIndex) !=
+      CAPTURE_RESULT_OK)
+    return true;
+
+  const uint8_t * data = framebuffer_get_buffer(staging);
+  if (compress)
+    framebuffer_write_compressed(fb, data, frameRows(&frame), frame.pitch,
+        fbSize);
+  else
+    framebuffer_write(fb, data, frameRows(&frame) * frame.pitch);
+
+  fi->writeTime = max(microtime() - captureStart, 1);
+  statsWrite(max(fi->writeTime, fi->postTime) - fi->postTime);
+  scaleUpdate(fi->writeTime);
   return true;
 }
 
 static int frameThread(void * opaque)
 {
   DEBUG_INFO("Frame thread started");
+  lgThreadSetPriority(LG_THREAD_PRIORITY_CAPTURE);
 
   while(app.state == APP_STATE_RUNNING)
   {
@@ -384,6 +940,12 @@ static bool captureStop(void)
 {
   DEBUG_INFO("==== [ Capture Stop ] ====");
 
+  if (atomic_load(&fbprofile_enabled))
+  {
+    fbprofile_log();
+    fbprofile_reset();
+  }
+
   if (!app.iface->deinit())
   {
     DEBUG_ERROR("Failed to deinitialize the capture device");
@@ -393,35 +955,176 @@ static bool captureStop(void)
   return true;
 }
 
+/* the large buffer is not rotated, wait until no message the client may still
+ * be reading from it is queued. This is not done under pointerLock as the
+ * LGMP timer that retires the messages takes it */
+static void waitPointerShapeLarge(void)
+{
+  const uint64_t timeout = microtime() + POINTER_QUEUE_CONFIG.subTimeout * 1000;
+  Backoff backoff = BACKOFF_INIT;
+  while (lgmpHostQueueHasSubs(app.pointerQueue) &&
+      lgmpHostQueuePending(app.pointerQueue) > 0)
+  {
+    if (microtime() > timeout)
+    {
+      DEBUG_WARN("Timed out waiting for the large pointer shape buffer");
+      break;
+    }
+    backoff_wait(&backoff);
+  }
+}
+
 bool captureGetPointerBuffer(void ** data, uint32_t * size)
 {
-  PLGMPMemory mem = app.pointerShapeMemory[app.pointerShapeIndex];
+  PLGMPMemory mem;
+  if (*size > POINTER_SHAPE_SIZE - sizeof(KVMFRCursor))
+  {
+    waitPointerShapeLarge();
+    mem   = app.pointerShapeLarge;
+    *size = MAX_POINTER_SIZE - sizeof(KVMFRCursor);
+  }
+  else
+  {
+    mem   = app.pointerShapeMemory[app.pointerShapeIndex];
+    *size = POINTER_SHAPE_SIZE - sizeof(KVMFRCursor);
+  }
+
+  app.pointerShapeNext = mem;
   *data = (uint8_t*)lgmpHostMemPtr(mem) + sizeof(KVMFRCursor);
-  *size = MAX_POINTER_SIZE - sizeof(KVMFRCursor);
   return true;
 }
 
-static void postPointer(uint32_t flags, PLGMPMemory mem)
+/* shape updates must be delivered so wait for space when the queue is full,
+ * position updates return false instead so the newest can be sent later */
+static bool postPointer(uint32_t flags, PLGMPMemory mem, bool wait)
 {
+  // in standby the state is only kept, new clients are sent it on subscribing
+  if (!lgmpHostQueueHasSubs(app.pointerQueue))
+    return true;
+
   LGMP_STATUS status;
+  Backoff backoff = BACKOFF_INIT;
   while ((status = lgmpHostQueuePost(app.pointerQueue, flags, mem)) != LGMP_OK)
   {
     if (status == LGMP_ERR_QUEUE_FULL)
     {
-      usleep(1);
+      if (!wait)
+        return false;
+
+      backoff_wait(&backoff);
       continue;
     }
 
     DEBUG_ERROR("lgmpHostQueuePost Failed (Pointer): %s", lgmpStatusString(status));
-    break;
+    return true;
   }
+
+  ringDoorbell(KVMFR_DOORBELL_POINTER);
+  return true;
+}
+
+/* posts the latest position and visibility, merged with any update that was
+ * held back. The caller must hold pointerLock */
+static void flushPointer(bool position)
+{
+  position |= app.pointerPendingPos;
+
+  /* the next buffer may still be queued when the queue is full, check first
+   * so it is not overwritten while the client could be reading it */
+  PLGMPMemory mem = app.pointerMemory[app.pointerIndex];
+  if (lgmpHostQueuePending(app.pointerQueue) == LGMP_Q_POINTER_LEN)
+    goto pending;
+
+  KVMFRCursor *cursor = lgmpHostMemPtr(mem);
+  if (position)
+  {
+    cursor->x = app.pointerInfo.x;
+    cursor->y = app.pointerInfo.y;
+  }
+
+  const uint32_t flags =
+    (position                ? CURSOR_FLAG_POSITION : 0) |
+    (app.pointerInfo.visible ? CURSOR_FLAG_VISIBLE  : 0);
+
+  if (!postPointer(flags, mem, false))
+    goto pending;
+
+  app.pointerPending    = false;
+  app.pointerPendingPos = false;
+  if (++app.pointerIndex == LGMP_Q_POINTER_LEN)
+    app.pointerIndex = 0;
+  return;
+
+pending:
+  app.pointerPending    = true;
+  app.pointerPendingPos = position;
+}
+
+// rewrite the live position record, the caller must hold pointerLock
+static void updateLivePointer(void)
+{
+  KVMFRCursorLive * live = lgmpHostMemPtr(app.pointerLive);
+  const uint32_t seq = live->seq;
+
+  live->seq = seq + 1;
+  atomic_thread_fence(memory_order_release);
+  live->x = app.pointerInfo.x;
+  live->y = app.pointerInfo.y;
+  atomic_thread_fence(memory_order_release);
+  live->seq = seq + 2;
+}
+
+/* a content hash of the shape so the client can recognise shapes it already
+ * has uploaded, never zero as that means unknown */
+static uint32_t hashPointerShape(const KVMFRCursor * cursor)
+{
+  const uint64_t prime = 0x100000001b3ULL;
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  h = (h ^ cursor->type  ) * prime;
+  h = (h ^ cursor->width ) * prime;
+  h = (h ^ cursor->height) * prime;
+  h = (h ^ cursor->pitch ) * prime;
+
+  const uint8_t * data = (const uint8_t *)(cursor + 1);
+  const size_t    size = (size_t)cursor->height * cursor->pitch;
+  size_t i = 0;
+  for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+  {
+    uint64_t v;
+    memcpy(&v, data + i, sizeof(v));
+    h = (h ^ v) * prime;
+    h ^= h >> 29;
+  }
+
+  for(; i < size; ++i)
+    h = (h ^ data[i]) * prime;
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+
+  const uint32_t id = (uint32_t)h;
+  return id ? id : 1;
 }
 
 static void sendPointer(bool newClient)
 {
-  // new clients need the last known shape and current position
+  /* new clients need the live record, the last known shape and the position.
+   * This runs on the LGMP timer which must not block, if the queue is full it
+   * is retried on the next tick */
   if (newClient)
   {
+    app.pointerResend =
+      lgmpHostQueuePending(app.pointerQueue) + 2 > LGMP_Q_POINTER_LEN;
+    if (app.pointerResend)
+      return;
+
+    updateLivePointer();
+    postPointer(CURSOR_FLAG_LIVE |
+        (app.pointerInfo.visible ? CURSOR_FLAG_VISIBLE : 0),
+        app.pointerLive, false);
+
     PLGMPMemory mem;
     if (app.pointerShapeValid)
       mem = app.pointerShape;
@@ -441,27 +1144,31 @@ static void sendPointer(bool newClient)
       (app.pointerShapeValid   ? CURSOR_FLAG_SHAPE   : 0) |
       (app.pointerInfo.visible ? CURSOR_FLAG_VISIBLE : 0);
 
-    postPointer(flags, mem);
+    postPointer(flags, mem, false);
+    app.pointerPending    = false;
+    app.pointerPendingPos = false;
     return;
   }
 
-  uint32_t flags = 0;
-  PLGMPMemory mem;
-  if (app.pointerInfo.shapeUpdate)
-  {
-    mem = app.pointerShapeMemory[app.pointerShapeIndex];
-    if (++app.pointerShapeIndex == POINTER_SHAPE_BUFFERS)
-      app.pointerShapeIndex = 0;
-  }
-  else
+  // while the queue is full position updates collapse into the newest one
+  if (!app.pointerInfo.shapeUpdate)
   {
-    mem = app.pointerMemory[app.pointerIndex];
-    if (++app.pointerIndex == LGMP_Q_POINTER_LEN)
-      app.pointerIndex = 0;
+    flushPointer(app.pointerInfo.positionUpdate);
+    return;
   }
+
+  uint32_t flags = 0;
+  PLGMPMemory mem = app.pointerShapeNext;
+  if (!mem)
+    mem = app.pointerShapeMemory[app.pointerShapeIndex];
+  if (mem == app.pointerShapeMemory[app.pointerShapeIndex] &&
+      ++app.pointerShapeIndex == POINTER_SHAPE_BUFFERS)
+    app.pointerShapeIndex = 0;
+  app.pointerShapeNext = NULL;
   KVMFRCursor *cursor = lgmpHostMemPtr(mem);
 
-  if (app.pointerInfo.positionUpdate || newClient)
+  // a held back position goes out with the shape
+  if (app.pointerInfo.positionUpdate || app.pointerPendingPos)
   {
     flags |= CURSOR_FLAG_POSITION;
     cursor->x = app.pointerInfo.x;
@@ -471,35 +1178,40 @@ static void sendPointer(bool newClient)
   if (app.pointerInfo.visible)
     flags |= CURSOR_FLAG_VISIBLE;
 
-  if (app.pointerInfo.shapeUpdate)
+  cursor->hx     = app.pointerInfo.hx;
+  cursor->hy     = app.pointerInfo.hy;
+  cursor->width  = app.pointerInfo.width;
+  cursor->height = app.pointerInfo.height;
+  cursor->pitch  = app.pointerInfo.pitch;
+  switch(app.pointerInfo.format)
   {
-    cursor->hx     = app.pointerInfo.hx;
-    cursor->hy     = app.pointerInfo.hy;
-    cursor->width  = app.pointerInfo.width;
-    cursor->height = app.pointerInfo.height;
-    cursor->pitch  = app.pointerInfo.pitch;
-    switch(app.pointerInfo.format)
-    {
-      case CAPTURE_FMT_COLOR : cursor->type = CURSOR_TYPE_COLOR       ; break;
-      case CAPTURE_FMT_MONO  : cursor->type = CURSOR_TYPE_MONOCHROME  ; break;
-      case CAPTURE_FMT_MASKED: cursor->type = CURSOR_TYPE_MASKED_COLOR; break;
+    case CAPTURE_FMT_COLOR : cursor->type = CURSOR_TYPE_COLOR       ; break;
+    case CAPTURE_FMT_MONO  : cursor->type = CURSOR_TYPE_MONOCHROME  ; break;
+    case CAPTURE_FMT_MASKED: cursor->type = CURSOR_TYPE_MASKED_COLOR; break;
 
-      default:
-        DEBUG_ERROR("Invalid pointer type");
-        return;
-    }
+    default:
+      DEBUG_ERROR("Invalid pointer type");
+      return;
+  }
 
-    app.pointerShapeValid = true;
-    flags |= CURSOR_FLAG_SHAPE;
+  cursor->shapeID       = hashPointerShape(cursor);
+  app.pointerShapeValid = true;
+  flags |= CURSOR_FLAG_SHAPE;
 
-    app.pointerShape = mem;
-  }
+  app.pointerShape = mem;
 
-  postPointer(flags, mem);
+  postPointer(flags, mem, true);
+  app.pointerPending    = false;
+  app.pointerPendingPos = false;
 }
 
 void capturePostPointerBuffer(CapturePointer pointer)
 {
+  // the cursor is delivered by the capture on some backends, do not hold it
+  // back while the desktop is idle
+  if (app.rate.idleUs)
+    atomic_store(&app.rate.interval, app.rate.minUs);
+
   LG_LOCK(app.pointerLock);
 
   int x = app.pointerInfo.x;
@@ -513,26 +1225,88 @@ void capturePostPointerBuffer(CapturePointer pointer)
     app.pointerInfo.x = x;
     app.pointerInfo.y = y;
   }
+  else
+    updateLivePointer();
 
   sendPointer(false);
 
   LG_UNLOCK(app.pointerLock);
 }
 
+/* Called from the platform audio thread, posts the samples to the audio queue
+ * in packets, dropping them if the client is not keeping up. */
+static void postAudio(const int16_t * samples, unsigned int frames,
+    unsigned int channels, unsigned int sampleRate, uint64_t captureTime)
+{
+  LG_LOCK(app.audioLock);
+  if (!app.audioQueue || !lgmpHostQueueHasSubs(app.audioQueue))
+    goto out;
+
+  while(frames)
+  {
+    if (lgmpHostQueuePending(app.audioQueue) == LGMP_Q_AUDIO_LEN)
+      break;
+
+    const unsigned int count = min(frames, KVMFR_AUDIO_MAX_FRAMES);
+    PLGMPMemory  mem   = app.audioMemory[app.audioIndex];
+    KVMFRAudio * audio = lgmpHostMemPtr(mem);
+    audio->channels    = channels;
+    audio->sampleRate  = sampleRate;
+    audio->frames      = count;
+    audio->captureTime = captureTime;
+    memcpy(audio + 1, samples, count * channels * sizeof(*samples));
+
+    LGMP_STATUS status;
+    if ((status = lgmpHostQueuePost(app.audioQueue, 0, mem)) != LGMP_OK)
+    {
+      DEBUG_ERROR("lgmpHostQueuePost Failed (Audio): %s",
+          lgmpStatusString(status));
+      break;
+    }
+
+    if (++app.audioIndex == LGMP_Q_AUDIO_LEN)
+      app.audioIndex = 0;
+
+    samples     += count * channels;
+    frames      -= count;
+    captureTime += (uint64_t)count * 1000000ULL / sampleRate;
+  }
+
+out:
+  LG_UNLOCK(app.audioLock);
+}
+
 static void lgmpShutdown(void)
 {
   if (app.lgmpTimer)
     lgTimerDestroy(app.lgmpTimer);
 
-  for(int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  LG_LOCK(app.audioLock);
+  for(int i = 0; i < LGMP_Q_AUDIO_LEN; ++i)
+    lgmpHostMemFree(&app.audioMemory[i]);
+  app.audioQueue = NULL;
+  app.audioIndex = 0;
+  LG_UNLOCK(app.audioLock);
+
+  for(int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
+  {
     lgmpHostMemFree(&app.frameMemory[i]);
+    free(app.compressMemory[i]);
+    app.compressMemory[i] = NULL;
+    app.compressBuffer[i] = NULL;
+  }
   for(int i = 0; i < LGMP_Q_POINTER_LEN; ++i)
     lgmpHostMemFree(&app.pointerMemory[i]);
   for(int i = 0; i < POINTER_SHAPE_BUFFERS; ++i)
     lgmpHostMemFree(&app.pointerShapeMemory[i]);
+  lgmpHostMemFree(&app.pointerShapeLarge);
+  app.pointerShapeNext = NULL;
+  lgmpHostMemFree(&app.pointerLive);
   lgmpHostFree(&app.lgmp);
 
   app.pointerShapeValid = false;
+  app.pointerPending    = false;
+  app.pointerPendingPos = false;
 }
 
 typedef struct KVMFRUserData
@@ -570,8 +1344,12 @@ static bool newKVMFRData(KVMFRUserData * dst)
     KVMFR kvmfr =
     {
       .magic    = KVMFR_MAGIC,
-      .version  = KVMFR_VERSION,
-      .features = os_hasSetCursorPos() ? KVMFR_FEATURE_SETCURSORPOS : 0
+      .version       = KVMFR_VERSION,
+      .features      =
+        (os_hasSetCursorPos() ? KVMFR_FEATURE_SETCURSORPOS : 0) |
+        (app.hasDoorbell      ? KVMFR_FEATURE_DOORBELL     : 0) |
+        (app.audio            ? KVMFR_FEATURE_AUDIO        : 0),
+      .frameQueueLen = app.frameQueueLen
     };
     strncpy(kvmfr.hostver, BUILD_VERSION, sizeof(kvmfr.hostver) - 1);
     appendData(dst, &kvmfr, sizeof(kvmfr));
@@ -637,6 +1415,13 @@ static bool newKVMFRData(KVMFRUserData * dst)
 
 static bool lgmpSetup(struct IVSHMEM * shmDev)
 {
+  // clients must register again with the new session
+  for(int i = 0; i < MAX_DOORBELL_PEERS; ++i)
+    atomic_store(&app.doorbellPeers[i], -1);
+
+  // the KVMFR header and the frame queue both carry the depth
+  app.frameQueueLen = planFrameQueue(app.frameMemAvail);
+
   KVMFRUserData udata = { 0 };
   if (!newKVMFRData(&udata))
     return false;
@@ -649,7 +1434,14 @@ static bool lgmpSetup(struct IVSHMEM * shmDev)
     goto fail_init;
   }
 
-  if ((status = lgmpHostQueueNew(app.lgmp, FRAME_QUEUE_CONFIG, &app.frameQueue)) != LGMP_OK)
+  const struct LGMPQueueConfig frameQueueConfig =
+  {
+    .queueID     = LGMP_Q_FRAME,
+    .numMessages = app.frameQueueLen,
+    .subTimeout  = 1000
+  };
+
+  if ((status = lgmpHostQueueNew(app.lgmp, frameQueueConfig, &app.frameQueue)) != LGMP_OK)
   {
     DEBUG_ERROR("lgmpHostQueueCreate Failed (Frame): %s", lgmpStatusString(status));
     goto fail_lgmp;
@@ -673,20 +1465,70 @@ static bool lgmpSetup(struct IVSHMEM * shmDev)
 
   for(int i = 0; i < POINTER_SHAPE_BUFFERS; ++i)
   {
-    if ((status = lgmpHostMemAlloc(app.lgmp, MAX_POINTER_SIZE, &app.pointerShapeMemory[i])) != LGMP_OK)
+    if ((status = lgmpHostMemAlloc(app.lgmp, POINTER_SHAPE_SIZE, &app.pointerShapeMemory[i])) != LGMP_OK)
     {
       DEBUG_ERROR("lgmpHostMemAlloc Failed (Pointer Shapes): %s", lgmpStatusString(status));
       goto fail_lgmp;
     }
-    memset(lgmpHostMemPtr(app.pointerShapeMemory[i]), 0, MAX_POINTER_SIZE);
+    memset(lgmpHostMemPtr(app.pointerShapeMemory[i]), 0, POINTER_SHAPE_SIZE);
+  }
+
+  if ((status = lgmpHostMemAlloc(app.lgmp, MAX_POINTER_SIZE, &app.pointerShapeLarge)) != LGMP_OK)
+  {
+    DEBUG_ERROR("lgmpHostMemAlloc Failed (Pointer Shapes): %s", lgmpStatusString(status));
+    goto fail_lgmp;
+  }
+  memset(lgmpHostMemPtr(app.pointerShapeLarge), 0, MAX_POINTER_SIZE);
+
+  /* subscribers that do not know the live record see it as a cursor message
+   * without a position or shape, so it must be at least that large */
+  const size_t liveSize = max(sizeof(KVMFRCursorLive), sizeof(KVMFRCursor));
+  if ((status = lgmpHostMemAlloc(app.lgmp, liveSize, &app.pointerLive)) != LGMP_OK)
+  {
+    DEBUG_ERROR("lgmpHostMemAlloc Failed (Pointer Live): %s", lgmpStatusString(status));
+    goto fail_lgmp;
   }
+  memset(lgmpHostMemPtr(app.pointerLive), 0, liveSize);
 
-  app.maxFrameSize = lgmpHostMemAvail(app.lgmp);
-  app.maxFrameSize = (app.maxFrameSize - (app.pageSize - 1)) & ~(app.pageSize - 1);
-  app.maxFrameSize /= LGMP_Q_FRAME_LEN;
+  if (app.audio)
+  {
+    const struct LGMPQueueConfig audioQueueConfig =
+    {
+      .queueID     = LGMP_Q_AUDIO,
+      .numMessages = LGMP_Q_AUDIO_LEN,
+      .subTimeout  = 1000
+    };
+
+    PLGMPHostQueue audioQueue;
+    if ((status = lgmpHostQueueNew(app.lgmp, audioQueueConfig, &audioQueue)) != LGMP_OK)
+    {
+      DEBUG_ERROR("lgmpHostQueueNew Failed (Audio): %s", lgmpStatusString(status));
+      goto fail_lgmp;
+    }
+
+    for(int i = 0; i < LGMP_Q_AUDIO_LEN; ++i)
+      if ((status = lgmpHostMemAlloc(app.lgmp, KVMFR_AUDIO_MAX_SIZE, &app.audioMemory[i])) != LGMP_OK)
+      {
+        DEBUG_ERROR("lgmpHostMemAlloc Failed (Audio): %s", lgmpStatusString(status));
+        goto fail_lgmp;
+      }
+
+    // publish the queue only once the buffers exist
+    INTERLOCKED_SECTION(app.audioLock,
+    {
+      app.audioQueue = audioQueue;
+      app.audioIndex = 0;
+    });
+  }
+
+  app.frameMemAvail = lgmpHostMemAvail(app.lgmp);
+  app.frameMemAvail = (app.frameMemAvail - (app.pageSize - 1)) & ~(app.pageSize - 1);
+  app.maxFrameSize  = (app.frameMemAvail / app.frameQueueLen) & ~(app.pageSize - 1);
+  DEBUG_INFO("Frame Buffers    : %u%s", app.frameQueueLen,
+      app.autoFrameQueue ? " (auto)" : "");
   DEBUG_INFO("Max Frame Size   : %u MiB", (unsigned int)(app.maxFrameSize / 1048576LL));
 
-  for(int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for(int i = 0; i < app.frameQueueLen; ++i)
   {
     if ((status = lgmpHostMemAllocAligned(app.lgmp, app.maxFrameSize,
             app.pageSize, &app.frameMemory[i])) != LGMP_OK)
@@ -696,6 +1538,21 @@ static bool lgmpSetup(struct IVSHMEM * shmDev)
     }
   }
 
+  for(int i = 0; app.compress && i < app.frameQueueLen; ++i)
+  {
+    // align the data for the wider copy kernels
+    app.compressMemory[i] = malloc(app.maxFrameSize + app.pageSize);
+    if (!app.compressMemory[i])
+    {
+      DEBUG_ERROR("Out of memory (Compression)");
+      goto fail_lgmp;
+    }
+
+    app.compressBuffer[i] = (FrameBuffer *)(ALIGN_PAD(
+        (uintptr_t)app.compressMemory[i] + sizeof(FrameBuffer), 64) -
+        sizeof(FrameBuffer));
+  }
+
   if (!lgCreateTimer(10, lgmpTimer, NULL, &app.lgmpTimer))
   {
     DEBUG_ERROR("Failed to create the LGMP timer");
@@ -770,6 +1627,20 @@ int app_main(int argc, char * argv[])
 
   DEBUG_INFO("Looking Glass Host (%s)", BUILD_VERSION);
   lgDebugCPU();
+  framebuffer_init();
+
+  int copyThreads = option_get_int("app", "copyThreads");
+  if (copyThreads <= 0)
+  {
+    int procs;
+    if (!lgCPUInfo(NULL, 0, &procs, NULL, NULL))
+      procs = 1;
+    copyThreads = min(procs / 2, 4);
+  }
+
+  // the frame thread participates in the copy so needs one less worker
+  if (copyThreads > 1 && !framebuffer_start_workers(copyThreads - 1))
+    DEBUG_WARN("Failed to start the copy workers, using a single thread");
 
   struct IVSHMEM shmDev = { 0 };
   if (!ivshmemInit(&shmDev))
@@ -789,13 +1660,51 @@ int app_main(int argc, char * argv[])
   DEBUG_INFO("IVSHMEM Address  : 0x%" PRIXPTR, (uintptr_t)shmDev.mem);
   DEBUG_INFO("Max Pointer Size : %u KiB", (unsigned int)MAX_POINTER_SIZE / 1024);
   DEBUG_INFO("KVMFR Version    : %u", KVMFR_VERSION);
+  DEBUG_INFO("IVSHMEM Doorbell : %s", ivshmemHasDoorbell(&shmDev) ? "yes" : "no");
 
   app.pageSize          = sysinfo_getPageSize();
+  app.frameQueueLen     = option_get_int("app", "frameBuffers");
+  app.autoFrameQueue    = app.frameQueueLen == 0;
+  if (app.autoFrameQueue)
+    app.frameQueueLen   = LGMP_Q_FRAME_LEN;
+  app.compress          = option_get_bool("app", "compressFrames");
+  fbprofile_enable(option_get_bool("app", "fbProfile"));
+  app.shmDev            = &shmDev;
+  app.hasDoorbell       = ivshmemHasDoorbell(&shmDev);
+  for(int i = 0; i < MAX_DOORBELL_PEERS; ++i)
+    atomic_init(&app.doorbellPeers[i], -1);
   app.frameValid        = false;
   app.pointerShapeValid = false;
+  LG_LOCK_INIT(app.audioLock);
+  LG_LOCK_INIT(app.pointerLock);
 
-  int throttleFps = option_get_int("app", "throttleFPS");
-  int throttleUs = throttleFps ? 1000000 / throttleFps : 0;
+  if (option_get_bool("app", "audio"))
+  {
+    app.audio = os_audioStart(postAudio);
+    if (!app.audio)
+      DEBUG_WARN("Audio capture is not available, continuing without it");
+  }
+
+  const int throttleFps = option_get_int("app", "throttleFPS");
+  const int idleFps     = option_get_int("app", "idleFPS");
+  app.rate.minUs     = throttleFps > 0 ? 1000000 / throttleFps : 0;
+  app.rate.idleUs    = idleFps > 0 ?
+    max(1000000U / (unsigned int)idleFps, app.rate.minUs) : 0;
+  app.rate.threshold = option_get_float("app", "idleThreshold") / 100.0;
+  atomic_init(&app.rate.interval, app.rate.minUs);
+  if (app.rate.idleUs)
+    DEBUG_INFO("Idle capture rate: %d FPS below %.1f%% damage", idleFps,
+        app.rate.threshold * 100.0);
+
+  const int standbyFps = option_get_int("app", "standbyFPS");
+  app.rate.standbyUs = standbyFps > 0 ?
+    max(1000000U / (unsigned int)standbyFps, app.rate.minUs) : 0;
+  if (app.rate.standbyUs)
+    DEBUG_INFO("Standby capture rate: %d FPS with no client", standbyFps);
+
+  const char * metrics = option_get_string("app", "metrics");
+  if (*metrics)
+    startMetrics(metrics);
   uint64_t previousFrameTime = 0;
 
   const char * ifaceName = option_get_string("app", "capture");
@@ -837,14 +1746,27 @@ int app_main(int argc, char * argv[])
 
   app.iface = iface;
 
+  if (option_get_bool("app", "adaptiveScale"))
+  {
+    const int scaleFps = option_get_int("app", "adaptiveScaleFPS");
+    if (!iface->setScaleLevel)
+      DEBUG_WARN("Adaptive scale is not supported by %s", iface->getName());
+    else if (scaleFps <= 0)
+      DEBUG_WARN("Invalid adaptiveScaleFPS, adaptive scale disabled");
+    else
+    {
+      app.scale.enabled  = true;
+      app.scale.budgetUs = 1000000 / scaleFps;
+      DEBUG_INFO("Adaptive scale   : %d FPS write budget", scaleFps);
+    }
+  }
+
   if (!lgmpSetup(&shmDev))
   {
     exitcode = LG_HOST_EXIT_FATAL;
     goto fail_ivshmem;
   }
 
-  LG_LOCK_INIT(app.pointerLock);
-
   if (app.iface->start && !app.iface->start())
   {
     DEBUG_ERROR("Failed to start the capture interface");
@@ -858,14 +1780,17 @@ int app_main(int argc, char * argv[])
     {
       DEBUG_INFO("Performing LGMP reinitialization");
       lgmpShutdown();
-      app.state = APP_STATE_RUNNING;
+
+      // capture was stopped before getting here, restart it with the clients
+      app.state = APP_STATE_IDLE;
       if (!lgmpSetup(&shmDev))
         goto fail_lgmp;
     }
 
     if (app.state == APP_STATE_IDLE)
     {
-      if(lgmpHostQueueHasSubs(app.pointerQueue) ||
+      if(app.rate.standbyUs ||
+          lgmpHostQueueHasSubs(app.pointerQueue) ||
           lgmpHostQueueHasSubs(app.frameQueue))
       {
         if (!captureStart())
@@ -887,27 +1812,36 @@ int app_main(int argc, char * argv[])
       }
     }
 
-    while(app.state != APP_STATE_SHUTDOWN && (
-          lgmpHostQueueHasSubs(app.pointerQueue) ||
-          lgmpHostQueueHasSubs(app.frameQueue)))
+    while(app.state != APP_STATE_SHUTDOWN)
     {
+      const bool hasSubs =
+        lgmpHostQueueHasSubs(app.pointerQueue) ||
+        lgmpHostQueueHasSubs(app.frameQueue);
+      if (!hasSubs && !app.rate.standbyUs)
+        break;
+
       if (app.state == APP_STATE_RESTART || app.state == APP_STATE_REINIT)
         break;
 
-      if (lgmpHostQueueNewSubs(app.pointerQueue) > 0)
+      const uint64_t throttleUs = atomic_load(&app.rate.interval);
+      const uint64_t delta      = microtime() - previousFrameTime;
+      if (!hasSubs)
       {
-        LG_LOCK(app.pointerLock);
-        sendPointer(true);
-        LG_UNLOCK(app.pointerLock);
+        /* in standby keep a recent frame for the next client, polling for one
+         * rather than sleeping the whole interval so the last frame can be
+         * resent as soon as it subscribes */
+        if (delta < app.rate.standbyUs)
+        {
+          usleep(min(app.rate.standbyUs - delta, 10000));
+          continue;
+        }
       }
-
-      const uint64_t delta = microtime() - previousFrameTime;
-      if (delta < throttleUs)
+      else if (delta < throttleUs)
       {
         const uint64_t us = throttleUs - delta;
         // only delay if the time is reasonable
         if (us > 1000)
-          nsleep(us * 1000);
+          lgSleepUntil(previousFrameTime + throttleUs);
       }
 
       const uint64_t captureStart = microtime();
@@ -915,6 +1849,8 @@ int app_main(int argc, char * argv[])
       {
         case CAPTURE_RESULT_OK:
           previousFrameTime = captureStart;
+          atomic_store(&app.captureStart, captureStart);
+          atomic_store(&app.captureDone , microtime());
           break;
 
         case CAPTURE_RESULT_TIMEOUT:
@@ -971,14 +1907,19 @@ fail_threads:
 
 fail_capture:
   iface->free();
-  LG_LOCK_FREE(app.pointerLock);
 
 fail_lgmp:
   lgmpShutdown();
 
 fail_ivshmem:
+  stopMetrics();
+  os_audioStop();
   ivshmemClose(&shmDev);
   ivshmemFree(&shmDev);
+  LG_LOCK_FREE(app.audioLock);
+  LG_LOCK_FREE(app.pointerLock);
+  framebuffer_stop_workers();
+  backoff_log_stats("Host");
   DEBUG_INFO("Host application exited");
   return exitcode;
 }
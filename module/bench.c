@@ -0,0 +1,336 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/* Benchmarks a kvmfr device, run it against a PCI and a static device to
+ * compare the two. Build with `make bench`, or `make bench-egl` to include
+ * the dmabuf import into EGL.
+ *
+ *   ./bench [-s MiB] [device ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#ifdef BENCH_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include "kvmfr.h"
+
+#define BLOCK_SIZE   4096
+#define CREATE_TIME  1000000000ULL // ns
+#define IMPORT_COUNT 100
+
+static uint64_t nsNow(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char * name, double value, const char * unit)
+{
+  printf("  %-24s %12.2f %s\n", name, value, unit);
+}
+
+static double mibPerSec(size_t bytes, uint64_t ns)
+{
+  return (bytes / 1048576.0) / (ns / 1e9);
+}
+
+// xorshift, the quality hardly matters, only that it is cheap
+static uint32_t nextRandom(uint32_t * state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static int createDMABuf(int fd, size_t size)
+{
+  struct kvmfr_dmabuf_create create =
+  {
+    .flags  = KVMFR_DMABUF_FLAG_CLOEXEC,
+    .offset = 0,
+    .size   = size,
+  };
+  return ioctl(fd, KVMFR_DMABUF_CREATE, &create);
+}
+
+// the cost of the first touch of each page of a fresh mapping
+static bool benchFaults(int mapFd, size_t size, const char * name)
+{
+  const int pageSize = getpagesize();
+  uint8_t * mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mapFd, 0);
+  if (mem == MAP_FAILED)
+  {
+    perror("mmap");
+    return false;
+  }
+
+  volatile uint8_t sink = 0;
+  const uint64_t start = nsNow();
+  for (size_t i = 0; i < size; i += pageSize)
+    sink += mem[i];
+  const uint64_t ns = nsNow() - start;
+  (void)sink;
+
+  report(name, (double)ns / (size / pageSize), "ns/page");
+  munmap(mem, size);
+  return true;
+}
+
+static void benchSequential(uint8_t * mem, uint8_t * buf, size_t size)
+{
+  uint64_t start = nsNow();
+  memcpy(buf, mem, size);
+  report("sequential read", mibPerSec(size, nsNow() - start), "MiB/s");
+
+  start = nsNow();
+  memcpy(mem, buf, size);
+  report("sequential write", mibPerSec(size, nsNow() - start), "MiB/s");
+}
+
+static void benchRandom(uint8_t * mem, uint8_t * buf, size_t size)
+{
+  const size_t blocks = size / BLOCK_SIZE;
+  uint32_t state = 0x4c474d54;
+
+  uint64_t start = nsNow();
+  for (size_t i = 0; i < blocks; ++i)
+    memcpy(buf + i * BLOCK_SIZE,
+        mem + (nextRandom(&state) % blocks) * BLOCK_SIZE, BLOCK_SIZE);
+  report("random 4K read", mibPerSec(blocks * BLOCK_SIZE, nsNow() - start),
+      "MiB/s");
+
+  start = nsNow();
+  for (size_t i = 0; i < blocks; ++i)
+    memcpy(mem + (nextRandom(&state) % blocks) * BLOCK_SIZE,
+        buf + i * BLOCK_SIZE, BLOCK_SIZE);
+  report("random 4K write", mibPerSec(blocks * BLOCK_SIZE, nsNow() - start),
+      "MiB/s");
+}
+
+static bool benchBandwidth(int dmaFd, size_t size)
+{
+  uint8_t * mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dmaFd, 0);
+  if (mem == MAP_FAILED)
+  {
+    perror("mmap");
+    return false;
+  }
+
+  uint8_t * buf = aligned_alloc(BLOCK_SIZE, size);
+  if (!buf)
+  {
+    perror("aligned_alloc");
+    munmap(mem, size);
+    return false;
+  }
+
+  // fault everything in first so only the copies are measured
+  memset(buf, 0x55, size);
+  memcpy(mem, buf, size);
+
+  benchSequential(mem, buf, size);
+  benchRandom(mem, buf, size);
+
+  free(buf);
+  munmap(mem, size);
+  return true;
+}
+
+static void benchCreate(int fd, size_t size)
+{
+  unsigned int count = 0;
+  const uint64_t start = nsNow();
+  uint64_t ns;
+  do
+  {
+    const int dmaFd = createDMABuf(fd, size);
+    if (dmaFd < 0)
+    {
+      perror("KVMFR_DMABUF_CREATE");
+      return;
+    }
+    close(dmaFd);
+    ++count;
+  }
+  while ((ns = nsNow() - start) < CREATE_TIME);
+
+  report("dmabuf create/destroy", count / (ns / 1e9), "ops/s");
+}
+
+#ifdef BENCH_EGL
+static void benchImport(int fd, size_t size)
+{
+  const EGLint width  = 1920;
+  const EGLint height = 1080;
+  if (size < (size_t)width * height * 4)
+  {
+    printf("  the device is too small for the EGL import\n");
+    return;
+  }
+
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  PFNEGLCREATEIMAGEKHRPROC createImage =
+    (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
+  PFNEGLDESTROYIMAGEKHRPROC destroyImage =
+    (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
+  if (!getPlatformDisplay || !createImage || !destroyImage)
+  {
+    printf("  the EGL dmabuf import extensions are not available\n");
+    return;
+  }
+
+  EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+      EGL_DEFAULT_DISPLAY, NULL);
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+  {
+    printf("  failed to initialize a surfaceless EGL display\n");
+    return;
+  }
+
+  const int dmaFd = createDMABuf(fd, (size_t)width * height * 4);
+  if (dmaFd < 0)
+  {
+    perror("KVMFR_DMABUF_CREATE");
+    eglTerminate(display);
+    return;
+  }
+
+  const EGLint attribs[] =
+  {
+    EGL_WIDTH                    , width,
+    EGL_HEIGHT                   , height,
+    EGL_LINUX_DRM_FOURCC_EXT     , 0x34325241, // DRM_FORMAT_ARGB8888
+    EGL_DMA_BUF_PLANE0_FD_EXT    , dmaFd,
+    EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
+    EGL_DMA_BUF_PLANE0_PITCH_EXT , width * 4,
+    EGL_NONE
+  };
+
+  uint64_t total = 0, worst = 0;
+  int done = 0;
+  for (; done < IMPORT_COUNT; ++done)
+  {
+    const uint64_t start = nsNow();
+    EGLImage image = createImage(display, EGL_NO_CONTEXT,
+        EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+    const uint64_t ns = nsNow() - start;
+    if (image == EGL_NO_IMAGE)
+    {
+      printf("  eglCreateImage failed: 0x%x\n", eglGetError());
+      break;
+    }
+    destroyImage(display, image);
+
+    total += ns;
+    if (ns > worst)
+      worst = ns;
+  }
+
+  if (done)
+  {
+    report("EGL import (mean)", total / 1000.0 / done, "us");
+    report("EGL import (worst)", worst / 1000.0, "us");
+  }
+
+  close(dmaFd);
+  eglTerminate(display);
+}
+#endif
+
+static bool benchDevice(const char * path, size_t maxSize)
+{
+  int fd = open(path, O_RDWR);
+  if (fd < 0)
+  {
+    perror(path);
+    return false;
+  }
+
+  const size_t devSize = ioctl(fd, KVMFR_DMABUF_GETSIZE, 0);
+  const size_t size    = devSize < maxSize ? devSize : maxSize;
+  printf("%s: %zu MiB, testing %zu MiB\n", path, devSize / 1048576,
+      size / 1048576);
+
+  bool ok = benchFaults(fd, size, "device fault");
+
+  const int dmaFd = createDMABuf(fd, size);
+  if (dmaFd < 0)
+  {
+    perror("KVMFR_DMABUF_CREATE");
+    close(fd);
+    return false;
+  }
+
+  ok = benchFaults(dmaFd, size, "dmabuf fault") && ok;
+  ok = benchBandwidth(dmaFd, size) && ok;
+  close(dmaFd);
+
+  benchCreate(fd, size);
+#ifdef BENCH_EGL
+  benchImport(fd, size);
+#endif
+
+  close(fd);
+  return ok;
+}
+
+int main(int argc, char * argv[])
+{
+  size_t maxSize = 256 * 1048576;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:")) != -1)
+    switch (opt)
+    {
+      case 's':
+        maxSize = strtoul(optarg, NULL, 10) * 1048576;
+        break;
+
+      default:
+        fprintf(stderr, "usage: %s [-s MiB] [device ...]\n", argv[0]);
+        return -1;
+    }
+
+  bool ok = true;
+  if (optind == argc)
+    ok = benchDevice("/dev/kvmfr0", maxSize);
+  else
+    for (int i = optind; i < argc; ++i)
+      ok = benchDevice(argv[i], maxSize) && ok;
+
+  return ok ? 0 : -1;
+}
@@ -25,8 +25,12 @@
 #include <linux/module.h>
 #include <linux/pci.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include <linux/fs.h>
 #include <linux/dma-buf.h>
+#include <linux/eventfd.h>
+#include <linux/interrupt.h>
 #include <linux/highmem.h>
 #include <linux/memremap.h>
 #include <linux/version.h>
@@ -40,12 +44,22 @@ DEFINE_IDR(kvmfr_idr);
 
 #define KVMFR_DEV_NAME    "kvmfr"
 #define KVMFR_MAX_DEVICES 10
+#define KVMFR_MAX_VECTORS 8
+
+// ivshmem BAR0 registers
+#define IVSHMEM_REG_IVPOSITION 8
 
 static int static_size_mb[KVMFR_MAX_DEVICES];
 static int static_count;
 module_param_array(static_size_mb, int, &static_count, 0000);
 MODULE_PARM_DESC(static_size_mb, "List of static devices to create in MiB");
 
+static bool static_contig;
+module_param(static_contig, bool, 0000);
+MODULE_PARM_DESC(static_contig, "Back static devices with physically contiguous 2MiB chunks");
+
+#define KVMFR_CONTIG_ORDER 9
+
 struct kvmfr_info
 {
   int             major;
@@ -60,6 +74,13 @@ enum kvmfr_type
   KVMFR_TYPE_STATIC,
 };
 
+struct kvmfr_vector
+{
+  spinlock_t            lock;
+  struct eventfd_ctx  * ctx;
+  struct file         * owner;
+};
+
 struct kvmfr_dev
 {
   unsigned long        size;
@@ -69,6 +90,15 @@ struct kvmfr_dev
   struct dev_pagemap   pgmap;
   void               * addr;
   enum kvmfr_type      type;
+
+  // static devices backed by static_contig only
+  struct page       ** contigPages;
+
+  // PCI devices only
+  struct pci_dev     * pciDev;
+  void __iomem       * regs;
+  int                  vectors;
+  struct kvmfr_vector  vector[KVMFR_MAX_VECTORS];
 };
 
 struct kvmfrbuf
@@ -77,6 +107,19 @@ struct kvmfrbuf
   pgoff_t               pagecount;
   unsigned long         offset;
   struct page        ** pages;
+
+  struct mutex          lock;
+  struct list_head      attachments; // kvmfrbuf_attachment::link
+};
+
+/* importers such as Mesa map and unmap the buffer every frame, the mapping is
+ * kept per attachment until it is detached or mapped in another direction */
+struct kvmfrbuf_attachment
+{
+  struct list_head         link;
+  struct device          * dev;
+  struct sg_table        * sgt;
+  enum dma_data_direction  dir;
 };
 
 static vm_fault_t kvmfr_vm_fault(struct vm_fault *vmf)
@@ -94,19 +137,138 @@ static const struct vm_operations_struct kvmfr_vm_ops =
   .fault = kvmfr_vm_fault
 };
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#define KVMFR_INSERT_BATCH 512UL
+
+/* the first touch of a large PCI backed mapping would otherwise take a fault
+ * for every page, populate it up front instead, the fault handlers remain to
+ * serve any entries that are later zapped */
+static int kvmfr_populate_pages(struct vm_area_struct * vma,
+    struct page ** pages)
+{
+  unsigned long num = vma_pages(vma);
+  return vm_insert_pages(vma, vma->vm_start, pages, &num);
+}
+
+static int kvmfr_populate_pci(struct kvmfr_dev * kdev,
+    struct vm_area_struct * vma)
+{
+  struct page ** pages;
+  unsigned long addr   = vma->vm_start;
+  unsigned long pgoff  = vma->vm_pgoff;
+  unsigned long remain = vma_pages(vma);
+  unsigned long i, count, num;
+  int ret = 0;
+
+  pages = kmalloc_array(KVMFR_INSERT_BATCH, sizeof(*pages), GFP_KERNEL);
+  if (!pages)
+    return -ENOMEM;
+
+  while (remain)
+  {
+    count = min_t(unsigned long, remain, KVMFR_INSERT_BATCH);
+    for (i = 0; i < count; ++i)
+      pages[i] = virt_to_page(kdev->addr + ((pgoff + i) << PAGE_SHIFT));
+
+    num = count;
+    ret = vm_insert_pages(vma, addr, pages, &num);
+    if (ret)
+      break;
+
+    addr   += count << PAGE_SHIFT;
+    pgoff  += count;
+    remain -= count;
+  }
+
+  kfree(pages);
+  return ret;
+}
+#endif
+
+static void free_kvmfrbuf_sgt(struct dma_buf_attachment * at,
+    struct kvmfrbuf_attachment * kat)
+{
+  if (!kat->sgt)
+    return;
+
+  dma_unmap_sg(at->dev, kat->sgt->sgl, kat->sgt->nents, kat->dir);
+  sg_free_table(kat->sgt);
+  kfree(kat->sgt);
+  kat->sgt = NULL;
+  kat->dir = DMA_NONE;
+}
+
+static int attach_kvmfrbuf(struct dma_buf * buf,
+    struct dma_buf_attachment * at)
+{
+  struct kvmfrbuf * kbuf = buf->priv;
+  struct kvmfrbuf_attachment * kat;
+
+  kat = kzalloc(sizeof(*kat), GFP_KERNEL);
+  if (!kat)
+    return -ENOMEM;
+
+  kat->dev = at->dev;
+  kat->dir = DMA_NONE;
+  at->priv = kat;
+
+  mutex_lock(&kbuf->lock);
+  list_add(&kat->link, &kbuf->attachments);
+  mutex_unlock(&kbuf->lock);
+  return 0;
+}
+
+static void detach_kvmfrbuf(struct dma_buf * buf,
+    struct dma_buf_attachment * at)
+{
+  struct kvmfrbuf * kbuf = buf->priv;
+  struct kvmfrbuf_attachment * kat = at->priv;
+
+  mutex_lock(&kbuf->lock);
+  list_del(&kat->link);
+  free_kvmfrbuf_sgt(at, kat);
+  mutex_unlock(&kbuf->lock);
+
+  kfree(kat);
+  at->priv = NULL;
+}
+
 static struct sg_table * map_kvmfrbuf(struct dma_buf_attachment *at,
     enum dma_data_direction direction)
 {
   struct kvmfrbuf *kbuf = at->dmabuf->priv;
+  struct kvmfrbuf_attachment * kat = at->priv;
   struct sg_table *sg;
   int ret;
 
+  mutex_lock(&kbuf->lock);
+  if (kat->sgt)
+  {
+    if (kat->dir == direction)
+    {
+      mutex_unlock(&kbuf->lock);
+      return kat->sgt;
+    }
+    free_kvmfrbuf_sgt(at, kat);
+  }
+
   sg = kzalloc(sizeof(*sg), GFP_KERNEL);
   if (!sg)
+  {
+    mutex_unlock(&kbuf->lock);
     return ERR_PTR(-ENOMEM);
+  }
 
+  /* physically contiguous pages, such as the BAR, are merged into as few
+   * segments as the device allows */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+  ret = sg_alloc_table_from_pages_segment(sg, kbuf->pages, kbuf->pagecount,
+      0, kbuf->pagecount << PAGE_SHIFT, dma_get_max_seg_size(at->dev),
+      GFP_KERNEL);
+#else
   ret = sg_alloc_table_from_pages(sg, kbuf->pages, kbuf->pagecount,
       0, kbuf->pagecount << PAGE_SHIFT, GFP_KERNEL);
+#endif
   if (ret < 0)
     goto err;
 
@@ -116,9 +278,13 @@ static struct sg_table * map_kvmfrbuf(struct dma_buf_attachment *at,
     goto err;
   }
 
+  kat->sgt = sg;
+  kat->dir = direction;
+  mutex_unlock(&kbuf->lock);
   return sg;
 
 err:
+  mutex_unlock(&kbuf->lock);
   sg_free_table(sg);
   kfree(sg);
   return ERR_PTR(ret);
@@ -127,9 +293,48 @@ err:
 static void unmap_kvmfrbuf(struct dma_buf_attachment * at, struct sg_table * sg,
     enum dma_data_direction direction)
 {
-  dma_unmap_sg(at->dev, sg->sgl, sg->nents, direction);
-  sg_free_table(sg);
-  kfree(sg);
+  // the mapping is cached by the attachment and released on detach
+}
+
+/* hand the buffer between the importers and the CPU, for static devices the
+ * kernel's vmalloc alias is also kept coherent with the user mappings */
+static int begin_cpu_access_kvmfrbuf(struct dma_buf * buf,
+    enum dma_data_direction direction)
+{
+  struct kvmfrbuf * kbuf = buf->priv;
+  struct kvmfrbuf_attachment * kat;
+
+  mutex_lock(&kbuf->lock);
+  list_for_each_entry(kat, &kbuf->attachments, link)
+    if (kat->sgt)
+      dma_sync_sg_for_cpu(kat->dev, kat->sgt->sgl, kat->sgt->nents, kat->dir);
+  mutex_unlock(&kbuf->lock);
+
+  if (kbuf->kdev->type == KVMFR_TYPE_STATIC)
+    invalidate_kernel_vmap_range(kbuf->kdev->addr + kbuf->offset,
+        kbuf->pagecount << PAGE_SHIFT);
+
+  return 0;
+}
+
+static int end_cpu_access_kvmfrbuf(struct dma_buf * buf,
+    enum dma_data_direction direction)
+{
+  struct kvmfrbuf * kbuf = buf->priv;
+  struct kvmfrbuf_attachment * kat;
+
+  if (kbuf->kdev->type == KVMFR_TYPE_STATIC)
+    flush_kernel_vmap_range(kbuf->kdev->addr + kbuf->offset,
+        kbuf->pagecount << PAGE_SHIFT);
+
+  mutex_lock(&kbuf->lock);
+  list_for_each_entry(kat, &kbuf->attachments, link)
+    if (kat->sgt)
+      dma_sync_sg_for_device(kat->dev, kat->sgt->sgl, kat->sgt->nents,
+          kat->dir);
+  mutex_unlock(&kbuf->lock);
+
+  return 0;
 }
 
 static void release_kvmfrbuf(struct dma_buf * buf)
@@ -157,7 +362,11 @@ static int mmap_kvmfrbuf(struct dma_buf * buf, struct vm_area_struct * vma)
     case KVMFR_TYPE_PCI:
       vma->vm_ops          = &kvmfr_vm_ops;
       vma->vm_private_data = buf->priv;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+      return kvmfr_populate_pages(vma, kbuf->pages + vma->vm_pgoff);
+#else
       return 0;
+#endif
 
     case KVMFR_TYPE_STATIC:
       return remap_vmalloc_range(vma, kbuf->kdev->addr + kbuf->offset,
@@ -170,9 +379,13 @@ static int mmap_kvmfrbuf(struct dma_buf * buf, struct vm_area_struct * vma)
 
 static const struct dma_buf_ops kvmfrbuf_ops =
 {
+  .attach        = attach_kvmfrbuf,
+  .detach        = detach_kvmfrbuf,
   .map_dma_buf   = map_kvmfrbuf,
   .unmap_dma_buf = unmap_kvmfrbuf,
   .release       = release_kvmfrbuf,
+  .begin_cpu_access = begin_cpu_access_kvmfrbuf,
+  .end_cpu_access   = end_cpu_access_kvmfrbuf,
   .mmap          = mmap_kvmfrbuf
 };
 
@@ -206,6 +419,9 @@ static long kvmfr_dmabuf_create(struct kvmfr_dev * kdev, struct file * filp,
   if (!kbuf)
     return -ENOMEM;
 
+  mutex_init(&kbuf->lock);
+  INIT_LIST_HEAD(&kbuf->attachments);
+
   kbuf->kdev      = kdev;
   kbuf->pagecount = create.size >> PAGE_SHIFT;
   kbuf->offset    = create.offset;
@@ -260,6 +476,152 @@ err:
   return ret;
 }
 
+static irqreturn_t kvmfr_irq(int irq, void * opaque)
+{
+  struct kvmfr_vector * v = opaque;
+
+  spin_lock(&v->lock);
+  if (v->ctx)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+    eventfd_signal(v->ctx);
+#else
+    eventfd_signal(v->ctx, 1);
+#endif
+  spin_unlock(&v->lock);
+
+  return IRQ_HANDLED;
+}
+
+// binds ctx to the vector and returns the context it replaced
+static struct eventfd_ctx * kvmfr_swap_eventfd(struct kvmfr_vector * v,
+    struct eventfd_ctx * ctx, struct file * owner)
+{
+  struct eventfd_ctx * old;
+  unsigned long flags;
+
+  spin_lock_irqsave(&v->lock, flags);
+  old      = v->ctx;
+  v->ctx   = ctx;
+  v->owner = ctx ? owner : NULL;
+  spin_unlock_irqrestore(&v->lock, flags);
+
+  return old;
+}
+
+static long kvmfr_set_eventfd(struct kvmfr_dev * kdev, struct file * filp,
+    unsigned long arg)
+{
+  struct kvmfr_eventfd efd;
+  struct eventfd_ctx * ctx = NULL;
+  struct eventfd_ctx * old;
+
+  if (copy_from_user(&efd, (void __user *)arg, sizeof(efd)))
+    return -EFAULT;
+
+  if (efd.vector >= kdev->vectors)
+    return -EINVAL;
+
+  if (efd.fd >= 0)
+  {
+    ctx = eventfd_ctx_fdget(efd.fd);
+    if (IS_ERR(ctx))
+      return PTR_ERR(ctx);
+  }
+
+  old = kvmfr_swap_eventfd(&kdev->vector[efd.vector], ctx, filp);
+  if (old)
+    eventfd_ctx_put(old);
+
+  return 0;
+}
+
+static int device_release(struct inode * inode, struct file * filp)
+{
+  struct kvmfr_dev * kdev;
+  struct eventfd_ctx * old;
+  unsigned long flags;
+  int i;
+
+  kdev = (struct kvmfr_dev *)idr_find(&kvmfr_idr, iminor(inode));
+  if (!kdev)
+    return 0;
+
+  // drop the doorbell bindings made through this file
+  for (i = 0; i < kdev->vectors; ++i)
+  {
+    struct kvmfr_vector * v = &kdev->vector[i];
+
+    spin_lock_irqsave(&v->lock, flags);
+    old = NULL;
+    if (v->owner == filp)
+    {
+      old      = v->ctx;
+      v->ctx   = NULL;
+      v->owner = NULL;
+    }
+    spin_unlock_irqrestore(&v->lock, flags);
+
+    if (old)
+      eventfd_ctx_put(old);
+  }
+
+  return 0;
+}
+
+static void kvmfr_free_vectors(struct kvmfr_dev * kdev)
+{
+  struct eventfd_ctx * old;
+  int i;
+
+  for (i = 0; i < kdev->vectors; ++i)
+  {
+    free_irq(pci_irq_vector(kdev->pciDev, i), &kdev->vector[i]);
+    old = kvmfr_swap_eventfd(&kdev->vector[i], NULL, NULL);
+    if (old)
+      eventfd_ctx_put(old);
+  }
+
+  if (kdev->vectors)
+    pci_free_irq_vectors(kdev->pciDev);
+  kdev->vectors = 0;
+}
+
+/* the doorbell is optional, without MSI-X the device still works for mmap and
+ * DMA-BUF and userspace falls back to polling */
+static void kvmfr_setup_vectors(struct kvmfr_dev * kdev)
+{
+  int i, nvec;
+
+  for (i = 0; i < KVMFR_MAX_VECTORS; ++i)
+    spin_lock_init(&kdev->vector[i].lock);
+
+  // MSI-X messages are memory writes from the device
+  pci_set_master(kdev->pciDev);
+
+  nvec = pci_alloc_irq_vectors(kdev->pciDev, 1, KVMFR_MAX_VECTORS,
+      PCI_IRQ_MSIX);
+  if (nvec < 0)
+    return;
+
+  for (i = 0; i < nvec; ++i)
+  {
+    if (request_irq(pci_irq_vector(kdev->pciDev, i), kvmfr_irq, 0,
+          KVMFR_DEV_NAME, &kdev->vector[i]))
+    {
+      printk(KERN_WARNING "kvmfr%d: failed to request doorbell vector %d\n",
+          kdev->minor, i);
+      break;
+    }
+    kdev->vectors = i + 1;
+  }
+
+  if (!kdev->vectors)
+    pci_free_irq_vectors(kdev->pciDev);
+  else
+    printk(KERN_INFO "kvmfr%d: %d doorbell vectors\n", kdev->minor,
+        kdev->vectors);
+}
+
 static long device_ioctl(struct file * filp, unsigned int ioctl,
     unsigned long arg)
 {
@@ -280,6 +642,20 @@ static long device_ioctl(struct file * filp, unsigned int ioctl,
       ret = kdev->size;
       break;
 
+    case KVMFR_GET_VECTORS:
+      ret = kdev->vectors;
+      break;
+
+    case KVMFR_GET_PEERID:
+      if (!kdev->regs)
+        return -ENODEV;
+      ret = ioread32(kdev->regs + IVSHMEM_REG_IVPOSITION);
+      break;
+
+    case KVMFR_SET_EVENTFD:
+      ret = kvmfr_set_eventfd(kdev, filp, arg);
+      break;
+
     default:
       return -ENOTTY;
   }
@@ -323,7 +699,11 @@ static int device_mmap(struct file * filp, struct vm_area_struct * vma)
     case KVMFR_TYPE_PCI:
       vma->vm_ops          = &pci_mmap_ops;
       vma->vm_private_data = kdev;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+      return kvmfr_populate_pci(kdev, vma);
+#else
       return 0;
+#endif
 
     case KVMFR_TYPE_STATIC:
       return remap_vmalloc_range(vma, kdev->addr, vma->vm_pgoff);
@@ -338,6 +718,7 @@ static struct file_operations fops =
   .owner          = THIS_MODULE,
   .unlocked_ioctl = device_ioctl,
   .mmap           = device_mmap,
+  .release        = device_release,
 };
 
 static int kvmfr_pci_probe(struct pci_dev *dev, const struct pci_device_id *id)
@@ -392,6 +773,11 @@ static int kvmfr_pci_probe(struct pci_dev *dev, const struct pci_device_id *id)
   if (IS_ERR(kdev->addr))
     goto out_destroy;
 
+  kdev->pciDev = dev;
+  kdev->regs   = pci_iomap(dev, 0, 0);
+  if (kdev->regs)
+    kvmfr_setup_vectors(kdev);
+
   pci_set_drvdata(dev, kdev);
   return 0;
 
@@ -414,6 +800,10 @@ static void kvmfr_pci_remove(struct pci_dev *dev)
 {
   struct kvmfr_dev *kdev = pci_get_drvdata(dev);
 
+  kvmfr_free_vectors(kdev);
+  if (kdev->regs)
+    pci_iounmap(dev, kdev->regs);
+
   devm_memunmap_pages(&dev->dev, &kdev->pgmap);
   device_destroy(kvmfr->pClass, kdev->devNo);
 
@@ -446,6 +836,77 @@ static struct pci_driver kvmfr_pci_driver =
   .remove   = kvmfr_pci_remove
 };
 
+static void free_static_memory(struct kvmfr_dev * kdev)
+{
+  unsigned long i;
+
+  if (!kdev->contigPages)
+  {
+    vfree(kdev->addr);
+    return;
+  }
+
+  if (kdev->addr)
+    vunmap(kdev->addr);
+
+  for (i = 0; i < kdev->size >> PAGE_SHIFT; ++i)
+    if (kdev->contigPages[i])
+      __free_page(kdev->contigPages[i]);
+
+  kvfree(kdev->contigPages);
+  kdev->contigPages = NULL;
+}
+
+/* allocates the memory in 2MiB physically contiguous chunks and maps them
+ * into a vmalloc style area, DMA-BUF importers then get a handful of large
+ * scatter entries instead of one per page. Chunks that can not be allocated
+ * due to fragmentation fall back to single pages */
+static void * alloc_static_contig(struct kvmfr_dev * kdev)
+{
+  const unsigned long count = kdev->size >> PAGE_SHIFT;
+  const unsigned long chunk = 1UL << KVMFR_CONTIG_ORDER;
+  struct page * page;
+  unsigned long i = 0, j;
+
+  kdev->contigPages = kvcalloc(count, sizeof(*kdev->contigPages), GFP_KERNEL);
+  if (!kdev->contigPages)
+    return NULL;
+
+  while (i < count)
+  {
+    if (count - i >= chunk)
+    {
+      page = alloc_pages(GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN |
+          __GFP_RETRY_MAYFAIL, KVMFR_CONTIG_ORDER);
+      if (page)
+      {
+        // each page must be reference counted on its own to be mapped
+        split_page(page, KVMFR_CONTIG_ORDER);
+        for (j = 0; j < chunk; ++j)
+          kdev->contigPages[i++] = page + j;
+        continue;
+      }
+    }
+
+    page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (!page)
+      goto err;
+    kdev->contigPages[i++] = page;
+  }
+
+  // VM_USERMAP permits remap_vmalloc_range on the area
+  kdev->addr = vmap(kdev->contigPages, count, VM_MAP | VM_USERMAP,
+      PAGE_KERNEL);
+  if (!kdev->addr)
+    goto err;
+
+  return kdev->addr;
+
+err:
+  free_static_memory(kdev);
+  return NULL;
+}
+
 static int create_static_device_unlocked(int size_mb)
 {
   struct kvmfr_dev * kdev;
@@ -457,7 +918,11 @@ static int create_static_device_unlocked(int size_mb)
 
   kdev->size = size_mb * 1024 * 1024;
   kdev->type = KVMFR_TYPE_STATIC;
-  kdev->addr = vmalloc_user(kdev->size);
+  if (static_contig)
+    kdev->addr = alloc_static_contig(kdev);
+  else
+    kdev->addr = vmalloc_user(kdev->size);
+
   if (!kdev->addr)
   {
     printk(
@@ -482,7 +947,7 @@ static int create_static_device_unlocked(int size_mb)
 out_unminor:
   idr_remove(&kvmfr_idr, kdev->minor);
 out_release:
-  vfree(kdev->addr);
+  free_static_memory(kdev);
 out_free:
   kfree(kdev);
   return ret;
@@ -492,7 +957,7 @@ static void free_static_device_unlocked(struct kvmfr_dev * kdev)
 {
   device_destroy(kvmfr->pClass, kdev->devNo);
   idr_remove(&kvmfr_idr, kdev->minor);
-  vfree(kdev->addr);
+  free_static_memory(kdev);
   kfree(kdev);
 }
 
@@ -32,7 +32,17 @@ struct kvmfr_dmabuf_create {
   __u64 size;
 };
 
+/* binds an eventfd to one of the device's MSI-X doorbell vectors, the fd is
+ * signalled each time the vector fires, an fd of -1 unbinds the vector */
+struct kvmfr_eventfd {
+  __u16 vector;
+  __s32 fd;
+};
+
 #define KVMFR_DMABUF_GETSIZE _IO('u', 0x44)
 #define KVMFR_DMABUF_CREATE  _IOW('u', 0x42, struct kvmfr_dmabuf_create)
+#define KVMFR_GET_VECTORS    _IO('u', 0x45)
+#define KVMFR_GET_PEERID     _IO('u', 0x46)
+#define KVMFR_SET_EVENTFD    _IOW('u', 0x47, struct kvmfr_eventfd)
 
 #endif
\ No newline at end of file
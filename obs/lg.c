@@ -23,6 +23,7 @@
 #include <obs/obs-config.h>
 #include <obs/obs-module.h>
 #include <obs/util/threading.h>
+#include <obs/util/platform.h>
 #include <obs/graphics/graphics.h>
 #include <obs/graphics/matrix4.h>
 
@@ -30,6 +31,7 @@
 #include <common/ivshmem.h>
 #include <common/KVMFR.h>
 #include <common/framebuffer.h>
+#include <common/rects.h>
 #include <lgmp/client.h>
 
 #include <stdio.h>
@@ -48,6 +50,14 @@
 #define DRM_FORMAT_BGRA1010102   fourcc_code('B', 'A', '3', '0')
 #define DRM_FORMAT_ABGR16161616F fourcc_code('A', 'B', '4', 'H')
 
+/* how often the frame thread keeps the queue alive while the source is not
+ * being ticked, and how long without a tick before it takes over */
+#define FRAME_KEEPALIVE_US  10000
+#define FRAME_TICK_STALE_NS 100000000ULL
+
+// how often the async source checks for a new frame
+#define ASYNC_POLL_US 250
+
 typedef enum
 {
   STATE_STOPPED,
@@ -70,6 +80,7 @@ DMAFrameInfo;
 typedef struct
 {
   obs_source_t    * context;
+  bool              async;
   LGState           state;
   char            * shmFile;
   uint32_t          formatVer;
@@ -84,15 +95,24 @@ typedef struct
   gs_texture_t    * texture;
   uint8_t         * texData;
   uint32_t          linesize;
+  bool              texValid;
+  uint32_t          frameSerial;
 
   bool              hideMouse;
 #if LIBOBS_API_MAJOR_VER >= 27
   bool              dmabuf;
-  DMAFrameInfo      dmaInfo[LGMP_Q_FRAME_LEN];
+  DMAFrameInfo      dmaInfo[LGMP_Q_FRAME_LEN_MAX];
 #endif
 
   pthread_t         frameThread, pointerThread;
   os_sem_t        * frameSem;
+  _Atomic(uint64_t) lastTick;
+
+  // async mode only
+  uint8_t         * asyncData;
+  size_t            asyncSize;
+  int64_t           clockOffset;
+  bool              clockValid;
 
   bool                 cursorMono;
   gs_texture_t       * cursorTex;
@@ -117,10 +137,17 @@ static const char * lgGetName(void * unused)
   return obs_module_text("Looking Glass Client");
 }
 
-static void * lgCreate(obs_data_t * settings, obs_source_t * context)
+static const char * lgGetAsyncName(void * unused)
+{
+  return obs_module_text("Looking Glass Client (Async)");
+}
+
+static void * createSource(obs_data_t * settings, obs_source_t * context,
+    bool async)
 {
   LGPlugin * this = bzalloc(sizeof(LGPlugin));
   this->context = context;
+  this->async   = async;
   os_sem_init (&this->frameSem , 0);
   os_sem_init (&this->cursorSem, 1);
   atomic_store(&this->cursorVer, 0);
@@ -128,6 +155,16 @@ static void * lgCreate(obs_data_t * settings, obs_source_t * context)
   return this;
 }
 
+static void * lgCreate(obs_data_t * settings, obs_source_t * context)
+{
+  return createSource(settings, context, false);
+}
+
+static void * lgCreateAsync(obs_data_t * settings, obs_source_t * context)
+{
+  return createSource(settings, context, true);
+}
+
 static void createThreads(LGPlugin * this)
 {
   pthread_create(&this->frameThread, NULL, frameThread, this);
@@ -190,7 +227,8 @@ static void deinit(LGPlugin * this)
     gs_texture_destroy(this->texture);
     gs_texture_unmap(this->texture);
     obs_leave_graphics();
-    this->texture = NULL;
+    this->texture  = NULL;
+    this->texValid = false;
   }
 
   if (this->cursorTex)
@@ -211,6 +249,7 @@ static void lgDestroy(void * data)
   deinit(this);
   os_sem_destroy(this->frameSem );
   os_sem_destroy(this->cursorSem);
+  bfree(this->asyncData);
   bfree(this);
 }
 
@@ -236,23 +275,124 @@ static obs_properties_t * lgGetProperties(void * data)
   return props;
 }
 
-static void * frameThread(void * data)
+/* hands a frame straight to OBS, which copies it before returning so an
+ * uncompressed frame is passed from the shared memory as is */
+static void outputAsyncFrame(LGPlugin * this, KVMFRFrame * frame)
 {
-  LGPlugin * this = (LGPlugin *)data;
+  enum video_format format;
+  switch(frame->type)
+  {
+    case FRAME_TYPE_BGRA:
+      format = VIDEO_FORMAT_BGRA;
+      break;
 
-  if (lgmpClientSubscribe(this->lgmp, LGMP_Q_FRAME, &this->frameQueue) != LGMP_OK)
+    case FRAME_TYPE_RGBA:
+      format = VIDEO_FORMAT_RGBA;
+      break;
+
+    default:
+      if (this->type != frame->type)
+        printf("Frame type %d is not supported by the async source\n",
+            frame->type);
+      this->type = frame->type;
+      return;
+  }
+  this->type = frame->type;
+
+  const size_t size = (size_t)frame->frameHeight * frame->pitch;
+  FrameBuffer * fb = (FrameBuffer *)(((uint8_t*)frame) + frame->offset);
+  const uint8_t * data;
+
+  if (frame->flags & FRAME_FLAG_COMPRESSED)
   {
-    this->state = STATE_STOPPING;
-    return NULL;
+    if (this->asyncSize < size)
+    {
+      bfree(this->asyncData);
+      this->asyncData = bmalloc(size);
+      this->asyncSize = size;
+    }
+
+    if (!framebuffer_read_compressed(fb, this->asyncData, frame->pitch,
+          frame->frameHeight, frame->frameWidth, 4, frame->pitch))
+      return;
+    data = this->asyncData;
+  }
+  else
+  {
+    if (!framebuffer_wait(fb, size))
+      return;
+    data = framebuffer_get_buffer(fb);
   }
 
-  this->state = STATE_RUNNING;
-  os_sem_post(this->frameSem);
+  /* map the host capture time onto the OBS clock, the smallest difference
+   * seen is the best estimate of the clock offset and keeps the real spacing
+   * of the frames, it creeps up slowly to follow any drift between clocks */
+  const int64_t offset = (int64_t)os_gettime_ns() -
+    (int64_t)frame->captureTime * 1000;
+  if (!this->clockValid || offset < this->clockOffset)
+  {
+    this->clockOffset = offset;
+    this->clockValid  = true;
+  }
+  else
+    this->clockOffset += (offset - this->clockOffset) / 256;
+
+  struct obs_source_frame out =
+  {
+    .data      = { (uint8_t *)data },
+    .linesize  = { frame->pitch },
+    .width     = frame->frameWidth,
+    .height    = frame->frameHeight,
+    .timestamp = frame->captureTime * 1000 + this->clockOffset,
+    .format    = format
+  };
+  obs_source_output_video(this->context, &out);
+}
+
+static void asyncFrameLoop(LGPlugin * this)
+{
+  while(this->state == STATE_RUNNING)
+  {
+    LGMP_STATUS status;
+    LGMPMessage msg;
+
+    if ((status = lgmpClientAdvanceToLast(this->frameQueue)) != LGMP_OK &&
+        status != LGMP_ERR_QUEUE_EMPTY)
+    {
+      printf("lgmpClientAdvanceToLast: %s\n", lgmpStatusString(status));
+      break;
+    }
+
+    if ((status = lgmpClientProcess(this->frameQueue, &msg)) != LGMP_OK)
+    {
+      if (status == LGMP_ERR_QUEUE_EMPTY)
+      {
+        usleep(ASYNC_POLL_US);
+        continue;
+      }
+
+      printf("lgmpClientProcess: %s\n", lgmpStatusString(status));
+      break;
+    }
+
+    outputAsyncFrame(this, (KVMFRFrame *)msg.mem);
+    lgmpClientMessageDone(this->frameQueue);
+  }
+}
 
+static void keepAliveLoop(LGPlugin * this)
+{
   while(this->state == STATE_RUNNING)
   {
     LGMP_STATUS status;
 
+    usleep(FRAME_KEEPALIVE_US);
+
+    /* while OBS ticks the source the tick consumes every frame, taking the
+     * semaphore here would only make the render tick wait */
+    if (os_gettime_ns() - atomic_load(&this->lastTick) < FRAME_TICK_STALE_NS)
+      continue;
+
     os_sem_wait(this->frameSem);
     if ((status = lgmpClientAdvanceToLast(this->frameQueue)) != LGMP_OK)
     {
@@ -260,14 +400,36 @@ static void * frameThread(void * data)
       {
         os_sem_post(this->frameSem);
         printf("lgmpClientAdvanceToLast: %s\n", lgmpStatusString(status));
-        break;
+        return;
       }
     }
     os_sem_post(this->frameSem);
-    usleep(1000);
   }
+}
+
+static void * frameThread(void * data)
+{
+  LGPlugin * this = (LGPlugin *)data;
 
+  if (lgmpClientSubscribe(this->lgmp, LGMP_Q_FRAME, &this->frameQueue) != LGMP_OK)
+  {
+    this->state = STATE_STOPPING;
+    return NULL;
+  }
+
+  this->state = STATE_RUNNING;
+  os_sem_post(this->frameSem);
+
+  // the async source has no render tick, this thread consumes every frame
+  if (this->async)
+    asyncFrameLoop(this);
+  else
+    keepAliveLoop(this);
+
+  // do not pull the queue out from under a tick that is still running
+  os_sem_wait(this->frameSem);
   lgmpClientUnsubscribe(&this->frameQueue);
+  os_sem_post(this->frameSem);
   this->state = STATE_RESTARTING;
   return NULL;
 }
@@ -503,6 +665,8 @@ static void lgVideoTick(void * data, float seconds)
   if (this->state != STATE_RUNNING)
     return;
 
+  atomic_store(&this->lastTick, os_gettime_ns());
+
   LGMP_STATUS status;
   LGMPMessage msg;
   bool framebuffer = true;
@@ -524,45 +688,50 @@ static void lgVideoTick(void * data, float seconds)
     os_sem_wait(this->cursorSem);
     obs_enter_graphics();
 
-    if (this->cursorTex)
-    {
-      gs_texture_destroy(this->cursorTex);
-      this->cursorTex = NULL;
-    }
-
     switch(this->cursor.type)
     {
       case CURSOR_TYPE_MASKED_COLOR:
         /* fallthrough */
 
       case CURSOR_TYPE_COLOR:
-        this->cursorMono  = false;
-        this->cursorTex   =
-          gs_texture_create(
-              this->cursor.width,
-              this->cursor.height,
-              GS_BGRA,
-              1,
-              (const uint8_t **)&this->cursorData,
-              GS_DYNAMIC);
+        this->cursorMono = false;
         break;
 
       case CURSOR_TYPE_MONOCHROME:
         this->cursorMono = true;
-        this->cursorTex  =
-          gs_texture_create(
-              this->cursor.width,
-              this->cursor.height,
-              GS_BGRA,
-              1,
-              (const uint8_t **)&this->cursorData,
-              GS_DYNAMIC);
         break;
 
       default:
-        break;
+        if (this->cursorTex)
+        {
+          gs_texture_destroy(this->cursorTex);
+          this->cursorTex = NULL;
+        }
+        goto cursor_done;
     }
 
+    /* shape changes rarely change the size, reuse the texture if we can */
+    if (this->cursorTex &&
+        gs_texture_get_width (this->cursorTex) == this->cursor.width &&
+        gs_texture_get_height(this->cursorTex) == this->cursor.height)
+      gs_texture_set_image(this->cursorTex, (const uint8_t *)this->cursorData,
+          this->cursor.width * sizeof(uint32_t), false);
+    else
+    {
+      if (this->cursorTex)
+        gs_texture_destroy(this->cursorTex);
+
+      this->cursorTex =
+        gs_texture_create(
+            this->cursor.width,
+            this->cursor.height,
+            GS_BGRA,
+            1,
+            (const uint8_t **)&this->cursorData,
+            GS_DYNAMIC);
+    }
+
+  cursor_done:
     obs_leave_graphics();
 
     this->cursorCurVer  = cursorVer;
@@ -616,6 +785,7 @@ static void lgVideoTick(void * data, float seconds)
       gs_texture_destroy(this->texture);
       this->texture = NULL;
     }
+    this->texValid = false;
 
     enum gs_color_format format;
     uint32_t drm_format;
@@ -701,15 +871,47 @@ static void lgVideoTick(void * data, float seconds)
   if (framebuffer && this->texture)
   {
     FrameBuffer * fb = (FrameBuffer *)(((uint8_t*)frame) + frame->offset);
-    framebuffer_read(
-        fb,
-        this->texData,      // dst
-        this->linesize,     // dstpitch
-        frame->frameHeight, // height
-        frame->frameWidth,  // width
-        this->bpp,          // bpp
-        frame->pitch        // linepitch
-    );
+
+    /* the mapped unpack buffer keeps the last frame we wrote into it, so if we
+     * have not missed a frame only the damaged areas need to be copied */
+    const bool partial =
+      this->texValid &&
+      frame->frameSerial == this->frameSerial + 1 &&
+      frame->damageRectsCount > 0 &&
+      this->bpp == 4 &&
+      !(frame->flags & FRAME_FLAG_COMPRESSED);
+
+    this->texValid = true;
+    if (partial)
+      rectsFramebufferToBuffer(
+          frame->damageRects,
+          frame->damageRectsCount,
+          this->texData,
+          this->linesize,
+          frame->frameHeight,
+          fb,
+          frame->pitch);
+    else if (frame->flags & FRAME_FLAG_COMPRESSED)
+      this->texValid = framebuffer_read_compressed(
+          fb,
+          this->texData,
+          this->linesize,
+          frame->frameHeight,
+          frame->frameWidth,
+          this->bpp,
+          frame->pitch);
+    else
+      framebuffer_read(
+          fb,
+          this->texData,      // dst
+          this->linesize,     // dstpitch
+          frame->frameHeight, // height
+          frame->frameWidth,  // width
+          this->bpp,          // bpp
+          frame->pitch        // linepitch
+      );
+
+    this->frameSerial = frame->frameSerial;
 
     lgmpClientMessageDone(this->frameQueue);
     os_sem_post(this->frameSem);
@@ -726,6 +928,18 @@ static void lgVideoTick(void * data, float seconds)
   }
 }
 
+static void lgAsyncVideoTick(void * data, float seconds)
+{
+  LGPlugin * this = (LGPlugin *)data;
+
+  if (this->state == STATE_RESTARTING) {
+    waitThreads(this);
+
+    this->state = STATE_STARTING;
+    createThreads(this);
+  }
+}
+
 static void lgVideoRender(void * data, gs_effect_t * effect)
 {
   LGPlugin * this = (LGPlugin *)data;
@@ -827,3 +1041,17 @@ struct obs_source_info lg_source =
   .get_height     = lgGetHeight,
 //  .icon_type      = OBS_ICON_TYPE_DESKTOP_CAPTURE
 };
+
+struct obs_source_info lg_source_async =
+{
+  .id             = "looking-glass-obs-async",
+  .type           = OBS_SOURCE_TYPE_INPUT,
+  .output_flags   = OBS_SOURCE_ASYNC_VIDEO | OBS_SOURCE_DO_NOT_DUPLICATE,
+  .get_name       = lgGetAsyncName,
+  .create         = lgCreateAsync,
+  .destroy        = lgDestroy,
+  .update         = lgUpdate,
+  .get_defaults   = lgGetDefaults,
+  .get_properties = lgGetProperties,
+  .video_tick     = lgAsyncVideoTick,
+};
@@ -37,12 +37,14 @@ MODULE_EXPORT const char *obs_module_description(void)
 }
 
 extern struct obs_source_info lg_source;
+extern struct obs_source_info lg_source_async;
 
 MODULE_EXPORT bool obs_module_load(void)
 {
   debug_init();
   printf("Looking Glass OBS Client (%s)\n", BUILD_VERSION);
   obs_register_source(&lg_source);
+  obs_register_source(&lg_source_async);
   return true;
 }
 
@@ -25,6 +25,9 @@
 #include "common/locking.h"
 #include "common/stringutils.h"
 #include "common/ivshmem.h"
+#include "common/framebuffer.h"
+#include "common/rects.h"
+#include "common/time.h"
 #include "common/util.h"
 
 #include <stdlib.h>
@@ -56,9 +59,197 @@ static struct Option options[] =
     .type           = OPTION_TYPE_STRING,
     .value.x_string = NULL
   },
+  {
+    .module         = "bench",
+    .name           = "copy",
+    .description    = "Copy each frame out of IVSHMEM like the client does",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = true
+  },
+  {
+    .module         = "bench",
+    .name           = "samples",
+    .description    = "The number of frames to collect for each report",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 600
+  },
   {0}
 };
 
+enum DamageProfile
+{
+  DAMAGE_FULL,
+  DAMAGE_RECTS,
+  DAMAGE_COMPRESSED,
+  DAMAGE_MAX
+};
+
+static const char * DamageProfileStr[DAMAGE_MAX] =
+{
+  "full",
+  "rects",
+  "compressed"
+};
+
+struct CopyProfile
+{
+  unsigned int count;
+  uint64_t     bytes;
+  uint64_t     totalNs;
+  uint64_t     firstTime;
+  uint64_t     lastTime;
+  uint32_t   * samples;
+};
+
+struct Bench
+{
+  bool               enabled;
+  unsigned int       maxSamples;
+  unsigned int       total;
+  uint8_t          * buffer;
+  size_t             bufferSize;
+  struct CopyProfile profiles[FRAME_TYPE_MAX][DAMAGE_MAX];
+};
+
+static int compareU32(const void * a, const void * b)
+{
+  const uint32_t x = *(const uint32_t *)a;
+  const uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static bool benchInit(struct Bench * bench)
+{
+  memset(bench, 0, sizeof(*bench));
+  bench->enabled    = option_get_bool("bench", "copy");
+  bench->maxSamples = max(1, option_get_int("bench", "samples"));
+  if (!bench->enabled)
+    return true;
+
+  for(int t = 0; t < FRAME_TYPE_MAX; ++t)
+    for(int d = 0; d < DAMAGE_MAX; ++d)
+    {
+      bench->profiles[t][d].samples =
+        malloc(sizeof(uint32_t) * bench->maxSamples);
+      if (!bench->profiles[t][d].samples)
+      {
+        DEBUG_ERROR("out of memory");
+        return false;
+      }
+    }
+
+  return true;
+}
+
+static void benchFree(struct Bench * bench)
+{
+  for(int t = 0; t < FRAME_TYPE_MAX; ++t)
+    for(int d = 0; d < DAMAGE_MAX; ++d)
+      free(bench->profiles[t][d].samples);
+  free(bench->buffer);
+}
+
+static void benchReport(struct Bench * bench)
+{
+  for(int t = 0; t < FRAME_TYPE_MAX; ++t)
+    for(int d = 0; d < DAMAGE_MAX; ++d)
+    {
+      struct CopyProfile * p = &bench->profiles[t][d];
+      if (!p->count)
+        continue;
+
+      qsort(p->samples, p->count, sizeof(*p->samples), compareU32);
+      const uint32_t p50 = p->samples[(p->count - 1) * 50 / 100];
+      const uint32_t p99 = p->samples[(p->count - 1) * 99 / 100];
+
+      const double elapsed = (p->lastTime - p->firstTime) / 1e9;
+      const double fps     = elapsed > 0.0 ? (p->count - 1) / elapsed : 0.0;
+      const double gbps    = p->totalNs ? (double)p->bytes / p->totalNs : 0.0;
+
+      fprintf(stdout, "copy %-18s %-10s frames:%5u fps:%7.2f "
+          "p50:%6.3f ms p99:%6.3f ms %6.2f GB/s\n",
+          FrameTypeStr[t], DamageProfileStr[d], p->count, fps,
+          p50 / 1e6, p99 / 1e6, gbps);
+
+      p->count   = 0;
+      p->bytes   = 0;
+      p->totalNs = 0;
+    }
+
+  bench->total = 0;
+}
+
+/* copies the frame out the same way the client framebuffer texture does, the
+ * read blocks on the host write so this times the full transfer */
+static bool benchFrame(struct Bench * bench, const KVMFRFrame * frame)
+{
+  if (frame->type <= FRAME_TYPE_INVALID || frame->type >= FRAME_TYPE_MAX)
+    return true;
+
+  const size_t bpp  = frame->type == FRAME_TYPE_RGBA16F ? 8 : 4;
+  const size_t size = (size_t)frame->frameHeight * frame->pitch;
+  if (size > bench->bufferSize)
+  {
+    free(bench->buffer);
+    bench->buffer     = malloc(size);
+    bench->bufferSize = bench->buffer ? size : 0;
+    if (!bench->buffer)
+    {
+      DEBUG_ERROR("out of memory");
+      return false;
+    }
+  }
+
+  const FrameBuffer * fb = (const FrameBuffer *)(((const uint8_t *)frame) +
+      frame->offset);
+
+  enum DamageProfile profile;
+  uint64_t bytes = 0;
+  const uint64_t start = nanotime();
+
+  if (frame->flags & FRAME_FLAG_COMPRESSED)
+  {
+    profile = DAMAGE_COMPRESSED;
+    framebuffer_read_compressed(fb, bench->buffer, frame->pitch,
+        frame->frameHeight, frame->frameWidth, bpp, frame->pitch);
+    bytes   = size;
+  }
+  else if (frame->damageRectsCount == 0)
+  {
+    profile = DAMAGE_FULL;
+    framebuffer_read(fb, bench->buffer, frame->pitch,
+        frame->frameHeight, frame->frameWidth, bpp, frame->pitch);
+    bytes   = size;
+  }
+  else
+  {
+    profile = DAMAGE_RECTS;
+    FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+    const int count = min(frame->damageRectsCount, KVMFR_MAX_DAMAGE_RECTS);
+    memcpy(rects, frame->damageRects, count * sizeof(*rects));
+    rectsFramebufferToBuffer(rects, count, bench->buffer, frame->pitch,
+        frame->frameHeight, fb, frame->pitch);
+
+    for(int i = 0; i < count; ++i)
+      bytes += (uint64_t)rects[i].width * rects[i].height * bpp;
+  }
+
+  const uint64_t end  = nanotime();
+  struct CopyProfile * p = &bench->profiles[frame->type][profile];
+  if (p->count == 0)
+    p->firstTime = end;
+
+  p->lastTime = end;
+  p->samples[p->count++] = end - start;
+  p->bytes   += bytes;
+  p->totalNs += end - start;
+
+  if (p->count == bench->maxSamples || ++bench->total >= bench->maxSamples)
+    benchReport(bench);
+
+  return true;
+}
+
 static bool config_load(int argc, char * argv[])
 {
   // load any global options first
@@ -149,6 +340,13 @@ static int run(void)
   struct perf  p10 = {};
   struct perf  p30 = {};
 
+  struct Bench bench;
+  if (!benchInit(&bench))
+  {
+    benchFree(&bench);
+    return -1;
+  }
+
   // start accepting frames
   while(state.running)
   {
@@ -159,6 +357,14 @@ static int run(void)
         continue;
 
       DEBUG_ERROR("lgmpClientProcess: %s", lgmpStatusString(status));
+      benchFree(&bench);
+      return -1;
+    }
+
+    if (bench.enabled && !benchFrame(&bench, (const KVMFRFrame *)msg.mem))
+    {
+      lgmpClientMessageDone(frameQueue);
+      benchFree(&bench);
       return -1;
     }
 
@@ -205,6 +411,7 @@ static int run(void)
     lastFrameTime = frameTime;
   }
 
+  benchFree(&bench);
   return 0;
 }
 